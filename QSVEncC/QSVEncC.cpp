@@ -42,9 +42,13 @@
 #endif
 
 #include "qsv_pipeline.h"
+#include "qsv_segment.h"
+#include "qsv_ladder.h"
+#include "qsv_autotune.h"
 #include "qsv_cmd.h"
 #include "qsv_prm.h"
 #include "qsv_query.h"
+#include "rgy_event.h"
 #include "rgy_version.h"
 #include "rgy_avutil.h"
 
@@ -211,6 +215,9 @@ static tstring help() {
         _T("                                 specified path. With no value, \"qsv_check.html\"\n")
         _T("                                 will be created to current directory.\n")
         _T("   --check-environment          check environment info\n")
+        _T("   --check-event-latency [<int>]\n")
+        _T("                                measure thread handoff latency of events\n")
+        _T("                                 with <int> round trips (default: 100000).\n")
 #if ENABLE_AVSW_READER
         _T("   --check-avversion            show dll version\n")
         _T("   --check-codecs               show codecs available\n")
@@ -543,10 +550,40 @@ static tstring help() {
         );
     str += strsprintf(_T("")
         _T("   --output-buf <int>           buffer size for output in MByte\n")
-        _T("                                 default %d MB (0-%d)\n"),
-        QSV_DEFAULT_OUTPUT_BUF_MB, RGY_OUTPUT_BUF_MB_MAX
+        _T("                                 default %d MB (0-%d)\n")
+        _T("   --output-prealloc            preallocate output file from estimated size\n")
+        _T("                                 (bitrate modes only)\n")
+        _T("   --auto-tune [<param1>=<value>][,<param2>=<value>]...\n")
+        _T("     set --async-depth, --input-buf, --output-buf and audio queue size\n")
+        _T("     from a host probe and a short calibration run on the input.\n")
+        _T("     values set explicitly are kept. chosen values are logged.\n")
+        _T("    params\n")
+        _T("      mem=<int>                 memory budget in MB (default: auto)\n")
+        _T("      frames=<int>              frames for each calibration run\n")
+        _T("                                 (default: %d, 0 = no calibration)\n")
+        _T("      enc=<string>              encoder used for calibration\n")
+        _T("                                 auto ... qsv, software stand-in if unavailable\n")
+        _T("                                 sw   ... software stand-in\n"),
+        QSV_DEFAULT_OUTPUT_BUF_MB, RGY_OUTPUT_BUF_MB_MAX, QSV_DEFAULT_AUTO_TUNE_FRAMES
         );
     str += strsprintf(_T("")
+        _T("   --segment-parallel <int>     split input at keyframes and encode segments\n")
+        _T("                                 with <int> pipelines in parallel.\n")
+        _T("                                 avhw/avsw reader only, video only output.\n")
+        _T("   --ladder <int>x<int>:<int>[,...]\n")
+        _T("                                decode and filter the input once, and encode\n")
+        _T("                                 each <width>x<height>:<bitrate kbps> rung to\n")
+        _T("                                 \"<output stem>_<width>x<height>.<ext>\".\n")
+        _T("                                 audio is encoded once and muxed into all rungs.\n")
+        _T("   --tee <string>               also write the encoded stream to <string>.\n")
+        _T("                                 can be specified multiple times.\n")
+        _T("                                 audio/chapters are copied from the main output,\n")
+        _T("                                 subtitles are not written to tee outputs.\n")
+        _T("   --hls-time <float>           target segment duration in seconds for\n")
+        _T("                                 hls output (output file \"*.m3u8\").\n")
+        _T("                                 segments are cut at IDR frames.\n")
+        _T("                                 default %.0f sec\n"), QSV_DEFAULT_HLS_TIME);
+    str += strsprintf(_T("")
 #if defined(_WIN32) || defined(_WIN64)
         _T("   --mfx-thread <int>          set mfx thread num (-1 (auto), 2, 3, ...)\n")
         _T("                                 note that mfx thread cannot be less than 2.\n")
@@ -567,6 +604,15 @@ static tstring help() {
         _T("                                  2: use two thread\n")
 #endif //#if ENABLE_AVCODEC_AUDPROCESS_THREAD
 #endif //#if ENABLE_AVCODEC_OUT_THREAD
+        _T("   --thread-affinity [<role>=]<cpu>[,...]\n")
+        _T("                                set cpus to run threads for each role.\n")
+        _T("                                 role: main, enc, input, dec, output, audproc, audenc\n")
+        _T("                                 cpu : all, logical#<int>[:<int>], node#<int>[:<int>]\n")
+        _T("                                       0x<hex>  (ranges like 0-7 are allowed)\n")
+        _T("   --thread-mempolicy [<role>=]<policy>[,...]\n")
+        _T("                                set numa memory policy for each role. (linux only)\n")
+        _T("                                 policy: default, local, bind#<node>[:<node>],\n")
+        _T("                                         interleave#<node>[:<node>], preferred#<node>\n")
         _T("   --min-memory                 minimize memory usage of QSVEncC.\n")
         _T("                                 same as --output-thread 0 --audio-thread 0\n")
         _T("                                   --mfx-thread 2 -a 1 --input-buf 1 --output-buf 0\n")
@@ -640,6 +686,21 @@ static tstring help() {
         _T("                                 default: python\n")
         _T("   --perf-monitor-interval <int> set perf monitor check interval (millisec)\n")
         _T("                                 default 250, must be 50 or more\n")
+        _T("   --metrics-socket <string>    serve live encode status, perf monitor counters,\n")
+        _T("                                 queue usage and stage latencies as json or\n")
+        _T("                                 prometheus text on a unix domain socket.\n")
+        _T("                                 updated every --perf-monitor-interval.\n")
+        _T("   --sw-session [<param1>=<value>][,<param2>=<value>]...\n")
+        _T("     run the pipeline with a software stand-in of the mfx session,\n")
+        _T("     without using GPU. output will not be a valid video stream.\n")
+        _T("     for debugging and checking the pipeline scheduling.\n")
+        _T("    params\n")
+        _T("      async=<int>               max tasks in flight per component\n")
+        _T("                                 (default: same as --async-depth)\n")
+        _T("      busy=<int>                return MFX_WRN_DEVICE_BUSY once\n")
+        _T("                                 every <int> calls (default: 0 = off)\n")
+        _T("      reorder=<int>             frames held by decoder/encoder\n")
+        _T("      task-us=<int>             simulated duration of a task (us)\n")
 #if defined(_WIN32) || defined(_WIN64)
         _T("   --(no-)timer-period-tuning   enable(disable) timer period tuning\n")
         _T("                                  default: enabled\n")
@@ -1259,6 +1320,17 @@ int parse_print_options(const TCHAR *option_name, const TCHAR *arg1) {
         }
         return 1;
     }
+    if (0 == _tcscmp(option_name, _T("check-event-latency"))) {
+        int nLoop = (arg1[0] != _T('-')) ? _tcstol(arg1, nullptr, 10) : 0;
+        if (nLoop <= 0) {
+            nLoop = 100000;
+        }
+        show_version();
+        _ftprintf(stdout, _T("event handoff latency (%d round trips)\n"), nLoop);
+        _ftprintf(stdout, _T("  event         : %8.3f us\n"), rgy_event_handoff_latency(nLoop, false));
+        _ftprintf(stdout, _T("  mutex+condvar : %8.3f us\n"), rgy_event_handoff_latency(nLoop, true));
+        return 1;
+    }
     if (0 == _tcscmp(option_name, _T("check-features"))) {
         tstring output = (arg1[0] != _T('-')) ? arg1 : _T("");
         writeFeatureList(output, false);
@@ -1721,6 +1793,23 @@ int run(int argc, TCHAR *argv[]) {
     if (Params.bBenchmark) {
         return run_benchmark(&Params);
     }
+    if (Params.autoTune.enable) {
+        set_signal_handler();
+        if (qsv_run_auto_tune(&Params, &g_signal_abort) != 0) {
+            return 1;
+        }
+    }
+    if (Params.nSegmentParallel > 1) {
+        set_signal_handler();
+        return qsv_run_segment_parallel(&Params, &g_signal_abort);
+    }
+    if (Params.nLadderRungs > 0) {
+        set_signal_handler();
+        ret = qsv_run_ladder(&Params, &g_signal_abort);
+        rgy_free(Params.pLadderRungs);
+        Params.nLadderRungs = 0;
+        return ret;
+    }
     unique_ptr<CQSVPipeline> pPipeline(new CQSVPipeline);
     if (!pPipeline) {
         return MFX_ERR_MEMORY_ALLOC;
@@ -27,6 +27,11 @@
 
 #include "qsv_allocator_sys.h"
 #include "qsv_util.h"
+#if !(defined(_WIN32) || defined(_WIN64))
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
 
 #pragma warning(disable : 4100)
 
@@ -89,71 +94,115 @@ mfxStatus QSVBufferAllocatorSys::BufFree(mfxMemId mid) {
     return MFX_ERR_NONE;
 }
 
-QSVAllocatorSys::QSVAllocatorSys()
-: m_pBufferAllocator() {
-}
-
-QSVAllocatorSys::~QSVAllocatorSys() {
-    Close();
-}
-
-mfxStatus QSVAllocatorSys::Init(mfxAllocatorParams *pParams, shared_ptr<RGYLog> pQSVLog) {
-    m_pQSVLog = pQSVLog;
-    m_pBufferAllocator.reset(new QSVBufferAllocatorSys());
-    return MFX_ERR_NONE;
-}
-
-mfxStatus QSVAllocatorSys::Close() {
-    mfxStatus sts = QSVAllocator::Close();
-    m_pBufferAllocator.reset();
-    return sts;
+//ラージページのサイズ (2MB)
+static const size_t SYS_FRAME_HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+//フレーム間の配置単位
+static const size_t SYS_FRAME_ALIGN = 4096;
+
+//呼び出したスレッドが動作しているNUMAノードを返す (取得できない場合は-1)
+static int sys_frame_current_numa_node() {
+#if defined(_WIN32) || defined(_WIN64)
+    PROCESSOR_NUMBER procNumber = { 0 };
+    GetCurrentProcessorNumberEx(&procNumber);
+    USHORT node = 0;
+    return (GetNumaProcessorNodeEx(&procNumber, &node)) ? (int)node : -1;
+#else
+    unsigned int cpu = 0, node = 0;
+    return (syscall(SYS_getcpu, &cpu, &node, nullptr) == 0) ? (int)node : -1;
+#endif
 }
 
-mfxStatus QSVAllocatorSys::FrameLock(mfxMemId mid, mfxFrameData *ptr) {
-    if (!m_pBufferAllocator) {
-        return MFX_ERR_NOT_INITIALIZED;
+//フレーム用の領域を確保する
+//まずラージページで確保を試み、できなければ通常のページで確保する (Linuxではtransparent huge pageを要求する)
+//NUMAノードが取得できれば、そのノードのメモリを優先して使用する
+static mfxU8 *sys_frame_arena_alloc(size_t *size, bool *hugePage, int *numaNode) {
+    *numaNode = sys_frame_current_numa_node();
+    *hugePage = false;
+#if defined(_WIN32) || defined(_WIN64)
+    //MEM_LARGE_PAGESはSeLockMemoryPrivilegeが必要で、なければ失敗する
+    const size_t largePageSize = GetLargePageMinimum();
+    const DWORD nodeWin = (*numaNode >= 0) ? (DWORD)*numaNode : NUMA_NO_PREFERRED_NODE;
+    void *ptr = nullptr;
+    if (largePageSize > 0) {
+        const size_t sizeLarge = ALIGN(*size, largePageSize);
+        if (nullptr != (ptr = VirtualAllocExNuma(GetCurrentProcess(), nullptr, sizeLarge, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE, nodeWin))) {
+            *size = sizeLarge;
+            *hugePage = true;
+        }
     }
-    if (!ptr) {
-        return MFX_ERR_NULL_PTR;
+    if (ptr == nullptr) {
+        *size = ALIGN(*size, SYS_FRAME_ALIGN);
+        ptr = VirtualAllocExNuma(GetCurrentProcess(), nullptr, *size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE, nodeWin);
     }
-
-    sFrame *fs = 0;
-    mfxStatus sts = m_pBufferAllocator->Lock(m_pBufferAllocator->pthis, mid, (mfxU8 **)&fs);
-    if (MFX_ERR_NONE != sts) {
-        m_pQSVLog->write(RGY_LOG_ERROR, _T("QSVAllocatorSys::FrameLock Failed to Lock frmame mid 0x%x: %s\n"), mid, get_err_mes(sts));
-        return sts;
+    return (mfxU8 *)ptr;
+#else
+    *size = ALIGN(*size, SYS_FRAME_HUGE_PAGE_SIZE);
+    void *ptr = mmap(nullptr, *size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (ptr != MAP_FAILED) {
+        *hugePage = true;
+    } else {
+        //hugetlbfsのページが予約されていない場合はこちら
+        ptr = mmap(nullptr, *size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (ptr == MAP_FAILED) {
+            return nullptr;
+        }
+        madvise(ptr, *size, MADV_HUGEPAGE);
     }
-    if (ID_FRAME != fs->id) {
-        m_pBufferAllocator->Unlock(m_pBufferAllocator->pthis, mid);
-        m_pQSVLog->write(RGY_LOG_ERROR, _T("QSVAllocatorSys::FrameLock Invalid mem handle\n"), mid, get_err_mes(sts));
-        return MFX_ERR_INVALID_HANDLE;
+    if (*numaNode >= 0) {
+        //まだページは割り当てられていないので、ここで指定すればページフォルト時にそのノードから割り当てられる
+        //MPOL_PREFERREDなので、そのノードのメモリが不足した場合は他のノードが使用される
+        const int MPOL_PREFERRED_ = 1;
+        unsigned long nodemask[16] = { 0 };
+        if (*numaNode < (int)(sizeof(nodemask) * 8)) {
+            nodemask[*numaNode / (sizeof(unsigned long) * 8)] = 1UL << (*numaNode % (sizeof(unsigned long) * 8));
+            if (syscall(SYS_mbind, ptr, *size, MPOL_PREFERRED_, nodemask, sizeof(nodemask) * 8, 0) != 0) {
+                *numaNode = -1;
+            }
+        }
+    }
+    return (mfxU8 *)ptr;
+#endif
+}
+
+static void sys_frame_arena_free(mfxU8 *ptr, size_t size) {
+    if (ptr) {
+#if defined(_WIN32) || defined(_WIN64)
+        VirtualFree(ptr, 0, MEM_RELEASE);
+#else
+        munmap(ptr, size);
+#endif
     }
+}
 
-    uint32_t WidthAlign  = ALIGN32(fs->info.Width);
-    uint32_t HeightAlign = ALIGN32(fs->info.Height);
-    ptr->B = ptr->Y = (uint8_t *)fs + ALIGN32(sizeof(sFrame));
+//各プレーンへのポインタとpitchを計算する
+static mfxStatus sys_frame_set_plane_ptr(sFrame *fs, mfxU8 *buffer) {
+    const mfxU32 WidthAlign  = ALIGN32(fs->info.Width);
+    const mfxU32 HeightAlign = ALIGN32(fs->info.Height);
+    mfxFrameData data = { 0 };
+    mfxFrameData *ptr = &data;
+    ptr->B = ptr->Y = buffer;
 
     switch (fs->info.FourCC) {
     case MFX_FOURCC_NV12:
         ptr->U = ptr->Y + WidthAlign * HeightAlign;
         ptr->V = ptr->U + 1;
         ptr->Pitch = (mfxU16)WidthAlign;
-        break;
-    case MFX_FOURCC_NV16:
-        ptr->U = ptr->Y + WidthAlign * HeightAlign;
-        ptr->V = ptr->U + 1;
-        ptr->Pitch = (mfxU16)WidthAlign;
+        break;
+    case MFX_FOURCC_NV16:
+        ptr->U = ptr->Y + WidthAlign * HeightAlign;
+        ptr->V = ptr->U + 1;
+        ptr->Pitch = (mfxU16)WidthAlign;
         break;
     case MFX_FOURCC_YV12:
         ptr->V = ptr->Y + WidthAlign * HeightAlign;
         ptr->U = ptr->V + (WidthAlign >> 1) * (HeightAlign >> 1);
         ptr->Pitch = (mfxU16)WidthAlign;
-        break;
-    case MFX_FOURCC_UYVY:
-        ptr->U = ptr->Y;
-        ptr->Y = ptr->U + 1;
-        ptr->V = ptr->U + 2;
-        ptr->Pitch = 2 * (mfxU16)WidthAlign;
+        break;
+    case MFX_FOURCC_UYVY:
+        ptr->U = ptr->Y;
+        ptr->Y = ptr->U + 1;
+        ptr->V = ptr->U + 2;
+        ptr->Pitch = 2 * (mfxU16)WidthAlign;
         break;
     case MFX_FOURCC_YUY2:
         ptr->U = ptr->Y + 1;
@@ -180,37 +229,87 @@ mfxStatus QSVAllocatorSys::FrameLock(mfxMemId mid, mfxFrameData *ptr) {
         ptr->U = ptr->Y + WidthAlign * HeightAlign * 2;
         ptr->V = ptr->U + 2;
         ptr->Pitch = (mfxU16)WidthAlign * 2;
-        break;
-    case MFX_FOURCC_P210:
-        ptr->U = ptr->Y + WidthAlign * HeightAlign * 2;
-        ptr->V = ptr->U + 2;
-        ptr->Pitch = (mfxU16)WidthAlign * 2;
-        break;
-    case MFX_FOURCC_AYUV:
-        ptr->Y = ptr->B;
-        ptr->U = ptr->Y + 1;
-        ptr->V = ptr->Y + 2;
-        ptr->A = ptr->Y + 3;
-        ptr->Pitch = 4 * (mfxU16)WidthAlign;
-        break;
-#ifdef FUTURE_API
-    case MFX_FOURCC_Y210:
-    case MFX_FOURCC_Y216:
-        ptr->Y16 = (mfxU16 *)ptr->B;
-        ptr->U16 = ptr->Y16 + 1;
-        ptr->V16 = ptr->Y16 + 3;
-        //4 words per macropixel -> 2 words per pixel -> 4 bytes per pixel
-        ptr->Pitch = 4 * (mfxU16)WidthAlign;
-        break;
-    case MFX_FOURCC_Y410:
-        ptr->U = ptr->V = ptr->A = ptr->Y;
-        ptr->Pitch = 4 * (mfxU16)WidthAlign;
-        break;
+        break;
+    case MFX_FOURCC_P210:
+        ptr->U = ptr->Y + WidthAlign * HeightAlign * 2;
+        ptr->V = ptr->U + 2;
+        ptr->Pitch = (mfxU16)WidthAlign * 2;
+        break;
+    case MFX_FOURCC_AYUV:
+        ptr->Y = ptr->B;
+        ptr->U = ptr->Y + 1;
+        ptr->V = ptr->Y + 2;
+        ptr->A = ptr->Y + 3;
+        ptr->Pitch = 4 * (mfxU16)WidthAlign;
+        break;
+#ifdef FUTURE_API
+    case MFX_FOURCC_Y210:
+    case MFX_FOURCC_Y216:
+        ptr->Y16 = (mfxU16 *)ptr->B;
+        ptr->U16 = ptr->Y16 + 1;
+        ptr->V16 = ptr->Y16 + 3;
+        //4 words per macropixel -> 2 words per pixel -> 4 bytes per pixel
+        ptr->Pitch = 4 * (mfxU16)WidthAlign;
+        break;
+    case MFX_FOURCC_Y410:
+        ptr->U = ptr->V = ptr->A = ptr->Y;
+        ptr->Pitch = 4 * (mfxU16)WidthAlign;
+        break;
 #endif
     default:
         return MFX_ERR_UNSUPPORTED;
     }
-    m_pQSVLog->write(RGY_LOG_TRACE, _T("QSVAllocatorSys::FrameLock success mid 0x%x\n"), mid);
+    fs->Y = ptr->Y;
+    fs->U = ptr->U;
+    fs->V = ptr->V;
+    fs->A = ptr->A;
+    fs->Pitch = ptr->Pitch;
+    return MFX_ERR_NONE;
+}
+
+QSVAllocatorSys::QSVAllocatorSys()
+: m_pBufferAllocator(), m_arenas() {
+}
+
+QSVAllocatorSys::~QSVAllocatorSys() {
+    Close();
+}
+
+mfxStatus QSVAllocatorSys::Init(mfxAllocatorParams *pParams, shared_ptr<RGYLog> pQSVLog) {
+    m_pQSVLog = pQSVLog;
+    m_pBufferAllocator.reset(new QSVBufferAllocatorSys());
+    return MFX_ERR_NONE;
+}
+
+mfxStatus QSVAllocatorSys::Close() {
+    mfxStatus sts = QSVAllocator::Close();
+    for (auto& arena : m_arenas) {
+        sys_frame_arena_free(arena->ptr, arena->size);
+    }
+    m_arenas.clear();
+    m_pBufferAllocator.reset();
+    return sts;
+}
+
+mfxStatus QSVAllocatorSys::FrameLock(mfxMemId mid, mfxFrameData *ptr) {
+    if (!m_pBufferAllocator) {
+        return MFX_ERR_NOT_INITIALIZED;
+    }
+    if (!ptr) {
+        return MFX_ERR_NULL_PTR;
+    }
+
+    //プレーンのポインタはAllocImplで計算済みなので、それを返すのみ
+    const sFrame *fs = (const sFrame *)mid;
+    if (!fs || ID_FRAME != fs->id) {
+        m_pQSVLog->write(RGY_LOG_ERROR, _T("QSVAllocatorSys::FrameLock Invalid mem handle 0x%p\n"), mid);
+        return MFX_ERR_INVALID_HANDLE;
+    }
+    ptr->Y = fs->Y;
+    ptr->U = fs->U;
+    ptr->V = fs->V;
+    ptr->A = fs->A;
+    ptr->Pitch = fs->Pitch;
     return MFX_ERR_NONE;
 }
 
@@ -219,10 +318,10 @@ mfxStatus QSVAllocatorSys::FrameUnlock(mfxMemId mid, mfxFrameData *ptr) {
         return MFX_ERR_NOT_INITIALIZED;
     }
 
-    mfxStatus sts = m_pBufferAllocator->Unlock(m_pBufferAllocator->pthis, mid);
-    if (MFX_ERR_NONE != sts) {
-        m_pQSVLog->write(RGY_LOG_ERROR, _T("QSVAllocatorSys::FrameUnlock failed to unlock frame mid 0x%x: %s\n"), mid, get_err_mes(sts));
-        return sts;
+    const sFrame *fs = (const sFrame *)mid;
+    if (!fs || ID_FRAME != fs->id) {
+        m_pQSVLog->write(RGY_LOG_ERROR, _T("QSVAllocatorSys::FrameUnlock Invalid mem handle 0x%p\n"), mid);
+        return MFX_ERR_INVALID_HANDLE;
     }
 
     if (NULL != ptr) {
@@ -231,7 +330,6 @@ mfxStatus QSVAllocatorSys::FrameUnlock(mfxMemId mid, mfxFrameData *ptr) {
         ptr->U     = nullptr;
         ptr->V     = nullptr;
     }
-    m_pQSVLog->write(RGY_LOG_TRACE, _T("QSVAllocatorSys::FrameUnlock success mid 0x%x\n"), mid);
     return MFX_ERR_NONE;
 }
 
@@ -261,20 +359,20 @@ mfxStatus QSVAllocatorSys::AllocImpl(mfxFrameAllocRequest *request, mfxFrameAllo
     case MFX_FOURCC_YV12:
     case MFX_FOURCC_NV12:
         nbytes = WidthAlign * HeightAlign * 3/2;
-        break;
+        break;
     case MFX_FOURCC_NV16:
         nbytes = WidthAlign * HeightAlign * 2;
         break;
     case MFX_FOURCC_RGB3:
         nbytes = WidthAlign * HeightAlign * 3;
         break;
-    case MFX_FOURCC_RGB4:
-    case MFX_FOURCC_AYUV:
-#ifdef FUTURE_API
-    case MFX_FOURCC_Y410:
+    case MFX_FOURCC_RGB4:
+    case MFX_FOURCC_AYUV:
+#ifdef FUTURE_API
+    case MFX_FOURCC_Y410:
 #endif
         nbytes = WidthAlign * HeightAlign * 4;
-        break;
+        break;
     case MFX_FOURCC_UYVY:
     case MFX_FOURCC_YUY2:
         nbytes = WidthAlign * HeightAlign * 2;
@@ -287,13 +385,13 @@ mfxStatus QSVAllocatorSys::AllocImpl(mfxFrameAllocRequest *request, mfxFrameAllo
         break;
     case MFX_FOURCC_A2RGB10:
         nbytes = WidthAlign * HeightAlign * 4;
-        break;
-    case MFX_FOURCC_P210:
-#ifdef FUTURE_API
-    case MFX_FOURCC_Y210:
-    case MFX_FOURCC_Y216:
-#endif
-        nbytes = WidthAlign * HeightAlign * 4;
+        break;
+    case MFX_FOURCC_P210:
+#ifdef FUTURE_API
+    case MFX_FOURCC_Y210:
+    case MFX_FOURCC_Y216:
+#endif
+        nbytes = WidthAlign * HeightAlign * 4;
         break;
     default:
         return MFX_ERR_UNSUPPORTED;
@@ -304,33 +402,32 @@ mfxStatus QSVAllocatorSys::AllocImpl(mfxFrameAllocRequest *request, mfxFrameAllo
         return MFX_ERR_MEMORY_ALLOC;
     }
 
+    //要求された全フレームを1つの領域に連続して配置する
+    const size_t frameStride = ALIGN((size_t)nbytes, SYS_FRAME_ALIGN);
     m_pQSVLog->write(RGY_LOG_DEBUG, _T("QSVAllocatorSys::AllocImpl allocating %d frames...\n"), request->NumFrameSuggested);
-    mfxU32 numAllocated = 0;
-    for (numAllocated = 0; numAllocated < request->NumFrameSuggested; numAllocated++) {
-        mfxStatus sts = m_pBufferAllocator->Alloc(m_pBufferAllocator->pthis,
-            nbytes + ALIGN32(sizeof(sFrame)), request->Type, &(mids.get()[numAllocated]));
-        if (sts != MFX_ERR_NONE) {
-            m_pQSVLog->write(RGY_LOG_ERROR, _T("QSVAllocatorSys::AllocImpl failed to allocate frame #%d, size %d: %s\n"), numAllocated, nbytes + ALIGN32(sizeof(sFrame)), get_err_mes(sts));
-            return MFX_ERR_MEMORY_ALLOC;
-        }
-
-        sFrame *fs;
-        sts = m_pBufferAllocator->Lock(m_pBufferAllocator->pthis, mids.get()[numAllocated], (mfxU8 **)&fs);
-        if (sts != MFX_ERR_NONE) {
-            m_pQSVLog->write(RGY_LOG_ERROR, _T("QSVAllocatorSys::AllocImpl failed to unlock frame mid 0x%x: %s\n"), mids.get()[numAllocated], get_err_mes(sts));
-            return MFX_ERR_MEMORY_ALLOC;
-        }
-
+    std::unique_ptr<sFrameArena> arena(new sFrameArena());
+    arena->size = frameStride * request->NumFrameSuggested;
+    if (nullptr == (arena->ptr = sys_frame_arena_alloc(&arena->size, &arena->hugePage, &arena->numaNode))) {
+        m_pQSVLog->write(RGY_LOG_ERROR, _T("QSVAllocatorSys::AllocImpl failed to allocate %d frames, size %d x %d.\n"), request->NumFrameSuggested, (int)frameStride, request->NumFrameSuggested);
+        return MFX_ERR_MEMORY_ALLOC;
+    }
+    arena->frames.resize(request->NumFrameSuggested);
+    for (mfxU32 i = 0; i < request->NumFrameSuggested; i++) {
+        sFrame *fs = &arena->frames[i];
         fs->id = ID_FRAME;
         fs->info = request->Info;
-        sts = m_pBufferAllocator->Unlock(m_pBufferAllocator->pthis, mids.get()[numAllocated]);
+        mfxStatus sts = sys_frame_set_plane_ptr(fs, arena->ptr + frameStride * i);
         if (sts != MFX_ERR_NONE) {
-            m_pQSVLog->write(RGY_LOG_ERROR, _T("QSVAllocatorSys::AllocImpl failed to unlock frame mid 0x%x: %s\n"), mids.get()[numAllocated], get_err_mes(sts));
-            return MFX_ERR_MEMORY_ALLOC;
+            sys_frame_arena_free(arena->ptr, arena->size);
+            return sts;
         }
+        mids.get()[i] = (mfxMemId)fs;
     }
+    m_pQSVLog->write(RGY_LOG_DEBUG, _T("QSVAllocatorSys::AllocImpl allocated %.1f MB, huge page: %s, numa node: %d.\n"),
+        arena->size / (double)(1024 * 1024), arena->hugePage ? _T("yes") : _T("no"), arena->numaNode);
+    m_arenas.push_back(std::move(arena));
 
-    response->NumFrameActual = (mfxU16)numAllocated;
+    response->NumFrameActual = (mfxU16)request->NumFrameSuggested;
     response->mids = mids.release();
     m_pQSVLog->write(RGY_LOG_DEBUG, _T("QSVAllocatorSys::AllocImpl Success.\n"));
     return MFX_ERR_NONE;
@@ -346,11 +443,16 @@ mfxStatus QSVAllocatorSys::ReleaseResponse(mfxFrameAllocResponse *response) {
     }
 
     if (response->mids) {
-        int nFrameCount = response->NumFrameActual;
-        for (int i = 0; i < nFrameCount; i++) {
-            if (response->mids[i]) {
-                mfxStatus sts = m_pBufferAllocator->Free(m_pBufferAllocator->pthis, response->mids[i]);
-                if (MFX_ERR_NONE != sts) return sts;
+        //responseのフレームを含む領域を解放する
+        if (response->NumFrameActual > 0 && response->mids[0]) {
+            const sFrame *fs = (const sFrame *)response->mids[0];
+            for (auto it = m_arenas.begin(); it != m_arenas.end(); it++) {
+                const auto& frames = (*it)->frames;
+                if (frames.size() > 0 && &frames.front() <= fs && fs <= &frames.back()) {
+                    sys_frame_arena_free((*it)->ptr, (*it)->size);
+                    m_arenas.erase(it);
+                    break;
+                }
             }
         }
         delete [] response->mids;
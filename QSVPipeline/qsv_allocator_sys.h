@@ -29,6 +29,7 @@
 #define __QSV_ALLOCATOR_SYS_H__
 
 #include <memory>
+#include <vector>
 #include "mfxvideo.h"
 #include "qsv_allocator.h"
 
@@ -41,6 +42,22 @@ struct sBuffer {
 struct sFrame {
     mfxU32       id;
     mfxFrameInfo info;
+    //各プレーンへのポインタとpitch (AllocImplで計算しておき、FrameLockではこれを返すのみとする)
+    mfxU8       *Y;
+    mfxU8       *U;
+    mfxU8       *V;
+    mfxU8       *A;
+    mfxU16       Pitch;
+};
+
+//AllocImplの1回の要求ごとに確保するフレーム用のメモリ領域
+//全フレームを連続して配置し、可能ならラージページ(2MB)・呼び出したスレッドのNUMAノードで確保する
+struct sFrameArena {
+    mfxU8 *ptr;        //確保した領域の先頭
+    size_t size;       //確保した領域のサイズ
+    bool hugePage;     //ラージページで確保できたか
+    int numaNode;      //確保したNUMAノード (-1は指定なし)
+    std::vector<sFrame> frames;
 };
 
 class QSVBufferAllocatorSys : public QSVBufferAllocator {
@@ -70,6 +87,7 @@ protected:
     virtual mfxStatus AllocImpl(mfxFrameAllocRequest *request, mfxFrameAllocResponse *response) override;
 
     std::unique_ptr<QSVBufferAllocatorSys> m_pBufferAllocator;
+    std::vector<std::unique_ptr<sFrameArena>> m_arenas;
 };
 
 #endif // __QSV_ALLOCATOR_SYS_H__
\ No newline at end of file
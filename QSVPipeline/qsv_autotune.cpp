@@ -0,0 +1,430 @@
+﻿// -----------------------------------------------------------------------------------------
+// QSVEnc/NVEnc by rigaya
+// -----------------------------------------------------------------------------------------
+// The MIT License
+//
+// Copyright (c) 2011-2016 rigaya
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// --------------------------------------------------------------------------------------------
+
+#include <cmath>
+#include <algorithm>
+#include "rgy_osdep.h"
+#include "rgy_tchar.h"
+#include "rgy_util.h"
+#include "rgy_status.h"
+#include "cpu_info.h"
+#include "ram_speed.h"
+#include "convert_csp.h"
+#include "qsv_util.h"
+#include "qsv_pipeline.h"
+#include "qsv_autotune.h"
+
+RGYOutputAutoTune::RGYOutputAutoTune(PerfStageLatency *pStageLatency, int nWarmupFrames, bool bRawOutput) :
+    m_pStageLatency(pStageLatency),
+    m_nWarmupFrames(nWarmupFrames),
+    m_nFrameCount(0),
+    m_nFrames(0),
+    m_nBytes(0),
+    m_tmStart(),
+    m_tmLast() {
+    m_strWriterName = _T("auto-tune");
+    m_OutType = (bRawOutput) ? OUT_TYPE_SURFACE : OUT_TYPE_BITSTREAM;
+}
+
+RGYOutputAutoTune::~RGYOutputAutoTune() {
+}
+
+RGY_ERR RGYOutputAutoTune::Init(const TCHAR *strFileName, const VideoInfo *pOutputInfo, const void *prm) {
+    UNREFERENCED_PARAMETER(strFileName);
+    UNREFERENCED_PARAMETER(pOutputInfo);
+    UNREFERENCED_PARAMETER(prm);
+    m_nFrameCount = 0;
+    m_nFrames = 0;
+    m_nBytes = 0;
+    m_tmStart = m_tmLast = std::chrono::steady_clock::now();
+    m_bInited = true;
+    return RGY_ERR_NONE;
+}
+
+void RGYOutputAutoTune::addFrame(uint32_t size) {
+    const auto now = std::chrono::steady_clock::now();
+    m_nFrameCount++;
+    if (m_nFrameCount <= m_nWarmupFrames) {
+        //ウォームアップが終わったところから計測する
+        if (m_nFrameCount == m_nWarmupFrames && m_pStageLatency) {
+            m_pStageLatency->reset();
+        }
+        m_tmStart = now;
+    } else {
+        m_nFrames++;
+        m_nBytes += size;
+    }
+    m_tmLast = now;
+}
+
+double RGYOutputAutoTune::elapsedSec() const {
+    return std::chrono::duration_cast<std::chrono::microseconds>(m_tmLast - m_tmStart).count() * 1e-6;
+}
+
+RGY_ERR RGYOutputAutoTune::WriteNextFrame(RGYBitstream *pBitstream) {
+    if (pBitstream == nullptr) {
+        AddMessage(RGY_LOG_ERROR, _T("Invalid call: WriteNextFrame\n"));
+        return RGY_ERR_NULL_PTR;
+    }
+    addFrame((uint32_t)pBitstream->size());
+    m_pEncSatusInfo->SetOutputData(pBitstream->frametype(), pBitstream->size(), 0);
+    pBitstream->setSize(0);
+    return RGY_ERR_NONE;
+}
+
+RGY_ERR RGYOutputAutoTune::WriteNextFrame(RGYFrame *pSurface) {
+    if (pSurface == nullptr) {
+        AddMessage(RGY_LOG_ERROR, _T("Invalid call: WriteNextFrame\n"));
+        return RGY_ERR_NULL_PTR;
+    }
+    const uint32_t frameSize = pSurface->width() * pSurface->height() * 3 / 2 * ((RGY_CSP_BIT_DEPTH[pSurface->csp()] > 8) ? 2 : 1);
+    addFrame(frameSize);
+    m_pEncSatusInfo->SetOutputData(frametype_enc_to_rgy(MFX_FRAMETYPE_IDR | MFX_FRAMETYPE_I), frameSize, 0);
+    return RGY_ERR_NONE;
+}
+
+QSVAutoTuneHostInfo qsv_auto_tune_probe_host() {
+    QSVAutoTuneHostInfo host = { 0 };
+    cpu_info_t cpu_info = { 0 };
+    if (get_cpu_info(&cpu_info)) {
+        host.physicalCores = (int)cpu_info.physical_cores;
+        host.logicalCores  = (int)cpu_info.logical_cores;
+    }
+    uint64_t ramUsed = 0;
+    const uint64_t ramTotal = getPhysicalRamSize(&ramUsed);
+    host.ramTotalMB = ramTotal >> 20;
+    host.ramAvailMB = (ramTotal > ramUsed) ? (ramTotal - ramUsed) >> 20 : 0;
+    if (host.physicalCores > 0) {
+        //キャッシュに収まらない大きさで、物理コア数分のスレッドで読み書きの帯域を測定する
+        const double speed = ram_speed_mt(64 * 1024, RAM_SPEED_MODE_RW, (std::min)(host.physicalCores, 16));
+        host.ramSpeedMBps = (0.0 < speed && speed < 1e9) ? speed : 0.0;
+    }
+    return host;
+}
+
+int qsv_auto_tune_mem_budget(const sAutoTunePrm& prm, const QSVAutoTuneHostInfo& host) {
+    if (prm.memBudgetMB > 0) {
+        return prm.memBudgetMB;
+    }
+    const int64_t avail = (host.ramAvailMB > 0) ? (int64_t)host.ramAvailMB : (int64_t)host.ramTotalMB;
+    return (int)clamp(avail / QSV_AUTO_TUNE_MEM_AVAIL_DIV, (int64_t)QSV_AUTO_TUNE_MEM_MIN_MB, (int64_t)QSV_AUTO_TUNE_MEM_MAX_MB);
+}
+
+//ビットレートを指定するレート制御モードかどうか
+static bool qsv_auto_tune_rc_has_bitrate(int encMode) {
+    switch (encMode) {
+    case MFX_RATECONTROL_CBR:
+    case MFX_RATECONTROL_VBR:
+    case MFX_RATECONTROL_AVBR:
+    case MFX_RATECONTROL_VCM:
+    case MFX_RATECONTROL_LA:
+    case MFX_RATECONTROL_LA_HRD:
+    case MFX_RATECONTROL_LA_EXT:
+    case MFX_RATECONTROL_QVBR:
+        return true;
+    default:
+        return false;
+    }
+}
+
+//--async-depthに0(自動)が指定された場合の目安
+static int qsv_auto_tune_async_depth_value(int asyncDepth) {
+    return (asyncDepth > 0) ? asyncDepth : QSV_DEFAULT_ASYNC_DEPTH;
+}
+
+QSVAutoTuneResult qsv_auto_tune_derive(const sInputParams *pParams, const QSVAutoTuneHostInfo& host,
+    const std::vector<QSVAutoTuneCalib>& calib, int memBudgetMB, std::shared_ptr<RGYLog> pLog) {
+    QSVAutoTuneResult result;
+    result.asyncDepth     = pParams->nAsyncDepth;
+    result.inputBuf       = pParams->nInputBufSize;
+    result.outputBufMB    = pParams->nOutputBufSizeMB;
+    result.audioQueueSize = pParams->nAudioQueueSize;
+
+    const int64_t budgetBytes = (int64_t)memBudgetMB << 20;
+    const uint8_t fixed = pParams->autoTune.fixed;
+
+    //最も速かった候補
+    const QSVAutoTuneCalib *best = nullptr;
+    for (const auto& c : calib) {
+        if (best == nullptr || c.fps > best->fps) {
+            best = &c;
+        }
+    }
+
+    //async depth
+    //最も速い候補に対して、一定以上の速度が出る最小の値を選ぶ (大きくしても、メモリと遅延が増えるだけのため)
+    const QSVAutoTuneCalib *chosen = best;
+    if (fixed & QSV_AUTO_TUNE_FIXED_ASYNC_DEPTH) {
+        pLog->write(RGY_LOG_INFO, _T("auto-tune: async-depth %d: set by user.\n"), result.asyncDepth);
+    } else if (best == nullptr) {
+        pLog->write(RGY_LOG_INFO, _T("auto-tune: async-depth %d: unchanged, no calibration result.\n"), result.asyncDepth);
+    } else if (best->swSession) {
+        pLog->write(RGY_LOG_INFO, _T("auto-tune: async-depth %d: unchanged, calibration used the software stand-in encoder, which does not reflect GPU pipelining.\n"), result.asyncDepth);
+    } else {
+        for (const auto& c : calib) {
+            if (c.fps >= best->fps * QSV_AUTO_TUNE_FPS_RATIO) {
+                chosen = &c;
+                break;
+            }
+        }
+        result.asyncDepth = chosen->asyncDepth;
+        pLog->write(RGY_LOG_INFO, _T("auto-tune: async-depth %d: %.2f fps, %.1f%% of the fastest (async-depth %d, %.2f fps), about %d MB for surfaces.\n"),
+            result.asyncDepth, chosen->fps, chosen->fps * 100.0 / best->fps, best->asyncDepth, best->fps,
+            (int)(((int64_t)chosen->frameBytes * 2 * chosen->asyncDepth) >> 20));
+    }
+
+    //入力バッファ
+    //入力の取得で待たされた最長の時間を、フレーム数に換算した分だけ先読みしておく
+    if (fixed & QSV_AUTO_TUNE_FIXED_INPUT_BUF) {
+        pLog->write(RGY_LOG_INFO, _T("auto-tune: input-buf %d: set by user.\n"), result.inputBuf);
+    } else if (chosen == nullptr) {
+        pLog->write(RGY_LOG_INFO, _T("auto-tune: input-buf %d: unchanged, no calibration result.\n"), result.inputBuf);
+    } else if (chosen->decode) {
+        pLog->write(RGY_LOG_INFO, _T("auto-tune: input-buf %d: unchanged, input is decoded by QSV and the buffer is always 1.\n"), result.inputBuf);
+    } else {
+        const double frameMs = 1000.0 / (std::max)(chosen->fps, 1.0);
+        const double waitFrames = chosen->inputMaxMs / frameMs;
+        int inputBuf = clamp((int)std::ceil(waitFrames) + 1, QSV_INPUT_BUF_MIN, QSV_INPUT_BUF_MAX);
+        const TCHAR *limit = _T("");
+        const int budgetFrames = (int)(std::max<int64_t>)(QSV_INPUT_BUF_MIN, budgetBytes / 4 / (std::max)(chosen->frameBytes, 1u));
+        if (inputBuf > budgetFrames) {
+            inputBuf = budgetFrames;
+            limit = _T(", limited by memory budget");
+        }
+        //メモリ帯域に余裕がない場合、先読みを増やしてもキャッシュミスが増えるだけなので、既定値までとする
+        //入力バッファへのコピーを含め、1フレームあたり4回程度のコピーを想定する
+        const double copyMBps = chosen->frameBytes * chosen->fps * 4.0 / (1024.0 * 1024.0);
+        if (host.ramSpeedMBps > 0.0 && copyMBps > host.ramSpeedMBps * 0.5 && inputBuf > QSV_DEFAULT_INPUT_BUF_HW) {
+            inputBuf = QSV_DEFAULT_INPUT_BUF_HW;
+            limit = _T(", limited by memory bandwidth");
+        }
+        //論理コア数が少ない場合、読み込みスレッドは先行して動作できないので、既定値までとする
+        if (host.logicalCores > 0 && host.logicalCores <= 2 && inputBuf > QSV_DEFAULT_INPUT_BUF_HW) {
+            inputBuf = QSV_DEFAULT_INPUT_BUF_HW;
+            limit = _T(", limited by cpu threads");
+        }
+        result.inputBuf = inputBuf;
+        pLog->write(RGY_LOG_INFO, _T("auto-tune: input-buf %d: longest input wait %.2f ms (avg %.2f ms), %.1f frames at %.2f fps%s.\n"),
+            result.inputBuf, chosen->inputMaxMs, chosen->inputAvgMs, waitFrames, chosen->fps, limit);
+    }
+
+    //出力バッファ
+    //出力のデータレートで、一定時間または書き出しの最長の時間の2倍のいずれか長い方を格納できるようにする
+    if (fixed & QSV_AUTO_TUNE_FIXED_OUTPUT_BUF) {
+        pLog->write(RGY_LOG_INFO, _T("auto-tune: output-buf %d MB: set by user.\n"), result.outputBufMB);
+    } else {
+        double bytesPerSec = 0.0;
+        double holdSec = QSV_AUTO_TUNE_OUTPUT_BUF_SEC;
+        const TCHAR *source = nullptr;
+        if (chosen && !chosen->swSession) {
+            bytesPerSec = chosen->bytesPerSec;
+            holdSec = (std::max)(holdSec, chosen->outputMaxMs * 2.0 * 0.001);
+            source = _T("measured");
+        } else if (qsv_auto_tune_rc_has_bitrate(pParams->nEncMode) && pParams->nBitRate > 0) {
+            //実際の出力が得られない場合は、指定されたビットレートから見積もる
+            const double speed = (chosen && chosen->videoFps > 0.0) ? chosen->fps / chosen->videoFps : 1.0;
+            bytesPerSec = pParams->nBitRate * 1000.0 / 8.0 * speed;
+            source = _T("from bitrate");
+        }
+        if (source == nullptr) {
+            pLog->write(RGY_LOG_INFO, _T("auto-tune: output-buf %d MB: unchanged, output rate unknown.\n"), result.outputBufMB);
+        } else {
+            int outputBufMB = clamp((int)std::ceil(bytesPerSec * holdSec / (1024.0 * 1024.0)), QSV_DEFAULT_OUTPUT_BUF_MB, RGY_OUTPUT_BUF_MB_MAX);
+            const TCHAR *limit = _T("");
+            const int budgetMB = (std::max)(1, memBudgetMB / 8);
+            if (outputBufMB > budgetMB) {
+                outputBufMB = budgetMB;
+                limit = _T(", limited by memory budget");
+            }
+            result.outputBufMB = outputBufMB;
+            pLog->write(RGY_LOG_INFO, _T("auto-tune: output-buf %d MB: output rate %.2f MB/s (%s), holding %.2f s%s.\n"),
+                result.outputBufMB, bytesPerSec / (1024.0 * 1024.0), source, holdSec, limit);
+        }
+    }
+
+    //音声のキュー
+    //muxerでは、映像のパイプラインの遅延分だけ音声のパケットが待たされるので、その分を上乗せする
+    const int audioTracks = pParams->nAudioSelectCount + pParams->nAudioSourceCount;
+    if (audioTracks > 0) {
+        const double videoFps = (chosen && chosen->videoFps > 0.0) ? chosen->videoFps : 30.0;
+        const int delayFrames = qsv_auto_tune_async_depth_value(result.asyncDepth) + result.inputBuf + 3;
+        const double lagSec = delayFrames / videoFps;
+        int queueSize = (int)std::ceil((QSV_AUTO_TUNE_AUDIO_QUEUE_SEC + lagSec) * QSV_AUTO_TUNE_AUDIO_PKT_PER_SEC * audioTracks);
+        queueSize = clamp(queueSize, QSV_AUTO_TUNE_AUDIO_PKT_PER_SEC * audioTracks, QSV_AUTO_TUNE_AUDIO_QUEUE_MAX);
+        result.audioQueueSize = queueSize;
+        pLog->write(RGY_LOG_INFO, _T("auto-tune: audio queue %d packets: %d track(s), %.1f s at %d packets/s plus video pipeline delay %.2f s.\n"),
+            result.audioQueueSize, audioTracks, QSV_AUTO_TUNE_AUDIO_QUEUE_SEC, QSV_AUTO_TUNE_AUDIO_PKT_PER_SEC, lagSec);
+    }
+    return result;
+}
+
+//キャリブレーションを1回実行する
+//pInitFailedには、パイプラインの初期化に失敗したかどうかを返す
+static mfxStatus qsv_auto_tune_calib_one(const sInputParams *pParams, int asyncDepth, bool swSession,
+    QSVAutoTuneCalib& calib, bool *pInitFailed, std::shared_ptr<RGYLog> pLog, bool *pAbort) {
+    sTrim trim;
+    trim.start = 0;
+    trim.fin = pParams->autoTune.calibFrames - 1;
+
+    //映像のみを処理し、ログは既に本番のエンコードで表示されるもの以外は出さないようにする
+    sInputParams calibParams = *pParams;
+    calibParams.autoTune.enable = FALSE;
+    calibParams.nAsyncDepth = (mfxU16)asyncDepth;
+    calibParams.nTrimCount = 1;
+    calibParams.pTrimList = &trim;
+    calibParams.fSeekSec = 0.0f;
+    calibParams.nAudioSelectCount = 0;
+    calibParams.nAudioSourceCount = 0;
+    calibParams.nSubtitleSelectCount = 0;
+    calibParams.caption2ass = FORMAT_INVALID;
+    calibParams.pChapterFile = nullptr;
+    calibParams.bCopyChapter = FALSE;
+    calibParams.nTeeCount = 0;
+    calibParams.pMetricsSocket = nullptr;
+    calibParams.nSegmentParallel = 0;
+    calibParams.nLadderRungs = 0;
+    calibParams.nLogLevel = (std::max)((int)pParams->nLogLevel, (int)RGY_LOG_ERROR);
+    calibParams.pStrLogFile = nullptr;
+    calibParams.pFramePosListLog = nullptr;
+    calibParams.pMuxVidTsLogFile = nullptr;
+    calibParams.pLogCopyFrameData = nullptr;
+    calibParams.nPerfMonitorSelect = 0;
+    calibParams.nPerfMonitorSelectMatplot = 0;
+    if (swSession) {
+        calibParams.swSession.enable = TRUE;
+    }
+
+    const int nWarmupFrames = (std::min)(QSV_AUTO_TUNE_WARMUP_FRAMES, pParams->autoTune.calibFrames / 5);
+    PerfStageLatency latency;
+    auto pWriter = std::make_shared<RGYOutputAutoTune>(&latency, nWarmupFrames, pParams->CodecId == MFX_CODEC_RAW);
+    unique_ptr<CQSVPipeline> pPipeline(new CQSVPipeline);
+    pPipeline->SetOutputOverride(pWriter);
+    pPipeline->SetStageLatencyOverride(&latency);
+    auto sts = pPipeline->Init(&calibParams);
+    *pInitFailed = sts < MFX_ERR_NONE;
+    if (sts >= MFX_ERR_NONE) {
+        pPipeline->SetAbortFlagPointer(pAbort);
+        sts = pPipeline->Run();
+    }
+    pPipeline->Close();
+    if (sts < MFX_ERR_NONE) {
+        return sts;
+    }
+    if (pWriter->frames() <= 0 || pWriter->elapsedSec() <= 0.0) {
+        pLog->write(RGY_LOG_WARN, _T("auto-tune: input is too short for calibration.\n"));
+        return MFX_ERR_MORE_DATA;
+    }
+
+    const auto& outputInfo = pWriter->videoOutputInfo();
+    const auto& input  = latency.stage[PERF_STAGE_INPUT];
+    const auto& output = latency.stage[PERF_STAGE_OUTPUT];
+    const uint64_t inputCount  = (std::max<uint64_t>)(input.count.load(), 1);
+    const uint64_t outputCount = (std::max<uint64_t>)(output.count.load(), 1);
+    calib.asyncDepth  = asyncDepth;
+    calib.frames      = pWriter->frames();
+    calib.fps         = pWriter->frames() / pWriter->elapsedSec();
+    calib.inputAvgMs  = input.total_us.load() * 0.001 / inputCount;
+    calib.inputMaxMs  = input.max_us.load() * 0.001;
+    calib.outputAvgMs = output.total_us.load() * 0.001 / outputCount;
+    calib.outputMaxMs = output.max_us.load() * 0.001;
+    calib.bytesPerSec = pWriter->bytes() / pWriter->elapsedSec();
+    calib.frameBytes  = outputInfo.dstWidth * outputInfo.dstHeight * 3 / 2 * ((RGY_CSP_BIT_DEPTH[outputInfo.csp] > 8) ? 2 : 1);
+    calib.videoFps    = (outputInfo.fpsD > 0) ? outputInfo.fpsN / (double)outputInfo.fpsD : 0.0;
+    //デコードを行う場合は、パイプラインが入力バッファを1に設定する
+    calib.decode      = calibParams.nInputBufSize == 1 && pParams->nInputBufSize > 1;
+    calib.swSession   = swSession;
+    pLog->write(RGY_LOG_INFO, _T("auto-tune: calibration async-depth %d%s: %d frames, %.2f fps, input %.2f/%.2f ms, output %.2f/%.2f ms (avg/max).\n"),
+        asyncDepth, (swSession) ? _T(" (sw)") : _T(""), calib.frames, calib.fps,
+        calib.inputAvgMs, calib.inputMaxMs, calib.outputAvgMs, calib.outputMaxMs);
+    return MFX_ERR_NONE;
+}
+
+int qsv_run_auto_tune(sInputParams *pParams, bool *pAbort) {
+    auto pLog = std::make_shared<RGYLog>(pParams->pStrLogFile, pParams->nLogLevel);
+
+    const auto host = qsv_auto_tune_probe_host();
+    const int memBudgetMB = qsv_auto_tune_mem_budget(pParams->autoTune, host);
+    pLog->write(RGY_LOG_INFO, _T("auto-tune: host: %d cores / %d threads, RAM %u MB (available %u MB), memory bandwidth %.1f GB/s.\n"),
+        host.physicalCores, host.logicalCores, (uint32_t)host.ramTotalMB, (uint32_t)host.ramAvailMB, host.ramSpeedMBps / 1024.0);
+    pLog->write(RGY_LOG_INFO, _T("auto-tune: memory budget %d MB%s.\n"), memBudgetMB,
+        (pParams->autoTune.memBudgetMB > 0) ? _T(" (set by user)") : _T(""));
+
+    std::vector<QSVAutoTuneCalib> calib;
+    if (pParams->autoTune.calibFrames <= 0) {
+        pLog->write(RGY_LOG_INFO, _T("auto-tune: calibration disabled.\n"));
+    } else if (_tcscmp(pParams->strSrcFile, _T("-")) == 0) {
+        //パイプ入力は読み直せないので、キャリブレーションは行わない
+        pLog->write(RGY_LOG_INFO, _T("auto-tune: calibration skipped for pipe input.\n"));
+    } else {
+        std::vector<int> asyncList;
+        if (pParams->autoTune.fixed & QSV_AUTO_TUNE_FIXED_ASYNC_DEPTH) {
+            asyncList.push_back(pParams->nAsyncDepth);
+        } else {
+            asyncList.assign(QSV_AUTO_TUNE_ASYNC_LIST, QSV_AUTO_TUNE_ASYNC_LIST + _countof(QSV_AUTO_TUNE_ASYNC_LIST));
+        }
+        bool swSession = pParams->swSession.enable || pParams->autoTune.encMode == QSV_AUTO_TUNE_ENC_SW;
+        for (const auto asyncDepth : asyncList) {
+            if (pAbort && *pAbort) {
+                return 1;
+            }
+            //1回目の結果から、メモリの上限に収まらない候補は試さない
+            if (calib.size() > 0 && (int64_t)calib[0].frameBytes * 2 * qsv_auto_tune_async_depth_value(asyncDepth) > ((int64_t)memBudgetMB << 20) / 2) {
+                pLog->write(RGY_LOG_INFO, _T("auto-tune: async-depth %d skipped, exceeds memory budget.\n"), asyncDepth);
+                continue;
+            }
+            QSVAutoTuneCalib result = { 0 };
+            bool initFailed = false;
+            auto sts = qsv_auto_tune_calib_one(pParams, asyncDepth, swSession, result, &initFailed, pLog, pAbort);
+            if (sts < MFX_ERR_NONE && initFailed && !swSession && calib.size() == 0
+                && pParams->autoTune.encMode == QSV_AUTO_TUNE_ENC_AUTO) {
+                //QSVを初期化できなければ、ソフトウェアによる代替実装でキャリブレーションを行う
+                pLog->write(RGY_LOG_WARN, _T("auto-tune: failed to initialize QSV, calibrating with the software stand-in encoder.\n"));
+                swSession = true;
+                sts = qsv_auto_tune_calib_one(pParams, asyncDepth, swSession, result, &initFailed, pLog, pAbort);
+            }
+            if (sts < MFX_ERR_NONE) {
+                pLog->write(RGY_LOG_WARN, _T("auto-tune: calibration failed: %s.\n"), get_err_mes(sts));
+                break;
+            }
+            calib.push_back(result);
+            //代替実装ではasync depthによる差は意味を持たないので、1回で終了する
+            if (swSession) {
+                break;
+            }
+        }
+    }
+    if (pAbort && *pAbort) {
+        return 1;
+    }
+
+    const auto result = qsv_auto_tune_derive(pParams, host, calib, memBudgetMB, pLog);
+    pParams->nAsyncDepth      = (mfxU16)result.asyncDepth;
+    pParams->nInputBufSize    = (mfxU16)result.inputBuf;
+    pParams->nOutputBufSizeMB = (int16_t)result.outputBufMB;
+    pParams->nAudioQueueSize  = result.audioQueueSize;
+    return 0;
+}
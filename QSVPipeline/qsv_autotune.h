@@ -0,0 +1,139 @@
+﻿// -----------------------------------------------------------------------------------------
+// QSVEnc/NVEnc by rigaya
+// -----------------------------------------------------------------------------------------
+// The MIT License
+//
+// Copyright (c) 2011-2016 rigaya
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// --------------------------------------------------------------------------------------------
+
+#pragma once
+#ifndef __QSV_AUTOTUNE_H__
+#define __QSV_AUTOTUNE_H__
+
+#include <chrono>
+#include <memory>
+#include <vector>
+#include "rgy_osdep.h"
+#include "rgy_tchar.h"
+#include "rgy_util.h"
+#include "rgy_log.h"
+#include "rgy_output.h"
+#include "rgy_perf_monitor.h"
+#include "qsv_prm.h"
+
+//--auto-tune
+//ホストの性能(CPUのコア数、メモリ容量、メモリ帯域)の測定と、入力の先頭部分を使った短いキャリブレーションから、
+//--async-depth, --input-buf, --output-buf, 音声のキューの長さを決める
+
+//キャリブレーションで試すasync depthの候補
+static const int QSV_AUTO_TUNE_ASYNC_LIST[] = { 1, 2, 4, 8 };
+//最も速い候補に対して、この割合以上の速度が出ていれば、より小さいasync depthを選択する
+static const double QSV_AUTO_TUNE_FPS_RATIO = 0.95;
+//キャリブレーションの計測から除外する先頭のフレーム数の上限
+static const int QSV_AUTO_TUNE_WARMUP_FRAMES = 15;
+//メモリの上限を自動で決める場合の、空きメモリに対する割合と最大値・最小値
+static const int QSV_AUTO_TUNE_MEM_AVAIL_DIV = 4;
+static const int QSV_AUTO_TUNE_MEM_MAX_MB = 2048;
+static const int QSV_AUTO_TUNE_MEM_MIN_MB = 256;
+//出力バッファに格納する時間の最小値 (秒)
+static const double QSV_AUTO_TUNE_OUTPUT_BUF_SEC = 0.5;
+//音声のキューの見積もりに使用する1トラックあたりのパケット数/秒と、保持する時間 (秒)
+static const int QSV_AUTO_TUNE_AUDIO_PKT_PER_SEC = 64;
+static const double QSV_AUTO_TUNE_AUDIO_QUEUE_SEC = 4.0;
+static const int QSV_AUTO_TUNE_AUDIO_QUEUE_MAX = 8192;
+
+//ホストの性能
+struct QSVAutoTuneHostInfo {
+    int physicalCores;
+    int logicalCores;
+    uint64_t ramTotalMB;
+    uint64_t ramAvailMB;
+    double ramSpeedMBps; //マルチスレッドでのメモリ帯域 (MB/s, 測定できなければ0)
+};
+
+//1回のキャリブレーションの結果
+struct QSVAutoTuneCalib {
+    int asyncDepth;      //使用したasync depth
+    int frames;          //計測したフレーム数 (ウォームアップを除く)
+    double fps;          //処理速度
+    double inputAvgMs;   //入力の取得に要した時間 (平均)
+    double inputMaxMs;   //入力の取得に要した時間 (最大)
+    double outputAvgMs;  //出力の書き出しに要した時間 (平均)
+    double outputMaxMs;  //出力の書き出しに要した時間 (最大)
+    double bytesPerSec;  //出力のデータレート (処理時間あたり)
+    uint32_t frameBytes; //1フレームのサイズ
+    double videoFps;     //映像のフレームレート
+    bool decode;         //入力をデコードしているか (入力バッファは常に1となる)
+    bool swSession;      //ソフトウェアによる代替実装を使用したか
+};
+
+//決定した値
+struct QSVAutoTuneResult {
+    int asyncDepth;
+    int inputBuf;
+    int outputBufMB;
+    int audioQueueSize;
+};
+
+//キャリブレーション用に、出力を破棄しつつ、出力のデータ量と処理時間を記録するRGYOutput
+//ウォームアップのフレーム数を出力したところで、計測を開始し、pStageLatencyをリセットする
+class RGYOutputAutoTune : public RGYOutput {
+public:
+    RGYOutputAutoTune(PerfStageLatency *pStageLatency, int nWarmupFrames, bool bRawOutput);
+    virtual ~RGYOutputAutoTune();
+
+    virtual RGY_ERR WriteNextFrame(RGYBitstream *pBitstream) override;
+    virtual RGY_ERR WriteNextFrame(RGYFrame *pSurface) override;
+
+    int frames() const { return m_nFrames; }
+    uint64_t bytes() const { return m_nBytes; }
+    double elapsedSec() const;
+    const VideoInfo& videoOutputInfo() const { return m_VideoOutputInfo; }
+protected:
+    virtual RGY_ERR Init(const TCHAR *strFileName, const VideoInfo *pOutputInfo, const void *prm) override;
+    void addFrame(uint32_t size);
+
+    PerfStageLatency *m_pStageLatency;
+    int m_nWarmupFrames;
+    int m_nFrameCount; //ウォームアップを含む出力したフレーム数
+    int m_nFrames;     //計測したフレーム数
+    uint64_t m_nBytes; //計測したデータ量
+    std::chrono::steady_clock::time_point m_tmStart;
+    std::chrono::steady_clock::time_point m_tmLast;
+};
+
+//ホストの性能を測定する
+QSVAutoTuneHostInfo qsv_auto_tune_probe_host();
+
+//--auto-tuneで使用するメモリの上限 (MB)
+int qsv_auto_tune_mem_budget(const sAutoTunePrm& prm, const QSVAutoTuneHostInfo& host);
+
+//測定結果から各値を決め、その理由をログに出力する
+//calibが空の場合は、ホストの性能とパラメータのみから決める
+QSVAutoTuneResult qsv_auto_tune_derive(const sInputParams *pParams, const QSVAutoTuneHostInfo& host,
+    const std::vector<QSVAutoTuneCalib>& calib, int memBudgetMB, std::shared_ptr<RGYLog> pLog);
+
+//--auto-tuneを実行し、pParamsの各値を書き換える
+//戻り値は0で成功、それ以外はエラー
+int qsv_run_auto_tune(sInputParams *pParams, bool *pAbort);
+
+#endif //__QSV_AUTOTUNE_H__
@@ -269,12 +269,9 @@ int ParseOneOption(const TCHAR *option_name, const TCHAR* strInput[], int& i, in
             trim_list.push_back(trim);
         }
         if (trim_list.size()) {
-            std::sort(trim_list.begin(), trim_list.end(), [](const sTrim& trimA, const sTrim& trimB) { return trimA.start < trimB.start; });
-            for (int j = (int)trim_list.size() - 2; j >= 0; j--) {
-                if (trim_list[j].fin > trim_list[j+1].start) {
-                    trim_list[j].fin = trim_list[j+1].fin;
-                    trim_list.erase(trim_list.begin() + j+1);
-                }
+            normalize_trim_list(trim_list);
+            if (pParams->pTrimList) {
+                free(pParams->pTrimList);
             }
             pParams->nTrimCount = (mfxU16)trim_list.size();
             pParams->pTrimList = (sTrim *)malloc(sizeof(pParams->pTrimList[0]) * trim_list.size());
@@ -1466,6 +1463,7 @@ int ParseOneOption(const TCHAR *option_name, const TCHAR* strInput[], int& i, in
             return 1;
         }
         pParams->nAsyncDepth = (mfxU16)v;
+        pParams->autoTune.fixed |= QSV_AUTO_TUNE_FIXED_ASYNC_DEPTH;
         return 0;
     }
 #if ENABLE_SESSION_THREAD_CONFIG
@@ -1792,6 +1790,7 @@ int ParseOneOption(const TCHAR *option_name, const TCHAR* strInput[], int& i, in
             SET_ERR(strInput[0], _T("Unknown value"), option_name, strInput[i]);
             return 1;
         }
+        pParams->autoTune.fixed |= QSV_AUTO_TUNE_FIXED_INPUT_BUF;
         return 0;
     }
     if (0 == _tcscmp(option_name, _T("output-buf"))) {
@@ -1806,6 +1805,80 @@ int ParseOneOption(const TCHAR *option_name, const TCHAR* strInput[], int& i, in
             return 1;
         }
         pParams->nOutputBufSizeMB = (int16_t)(std::min)(value, RGY_OUTPUT_BUF_MB_MAX);
+        pParams->autoTune.fixed |= QSV_AUTO_TUNE_FIXED_OUTPUT_BUF;
+        return 0;
+    }
+    if (0 == _tcscmp(option_name, _T("output-prealloc"))) {
+        pParams->bOutputPrealloc = TRUE;
+        return 0;
+    }
+    if (0 == _tcscmp(option_name, _T("segment-parallel"))) {
+        i++;
+        int value = 0;
+        if (1 != _stscanf_s(strInput[i], _T("%d"), &value)) {
+            SET_ERR(strInput[0], _T("Unknown value"), option_name, strInput[i]);
+            return 1;
+        }
+        if (value < 0) {
+            SET_ERR(strInput[0], _T("Invalid value"), option_name, strInput[i]);
+            return 1;
+        }
+        pParams->nSegmentParallel = value;
+        return 0;
+    }
+    if (0 == _tcscmp(option_name, _T("ladder"))) {
+        i++;
+        auto rung_str_list = split(strInput[i], _T(","));
+        std::vector<sLadderRung> rung_list;
+        for (auto rung_str : rung_str_list) {
+            sLadderRung rung = { 0 };
+            if (3 != _stscanf_s(rung_str.c_str(), _T("%dx%d:%d"), &rung.nWidth, &rung.nHeight, &rung.nBitrate)) {
+                SET_ERR(strInput[0], _T("Unknown value"), option_name, strInput[i]);
+                return 1;
+            }
+            if (rung.nWidth <= 0 || rung.nHeight <= 0 || rung.nBitrate <= 0
+                || (rung.nWidth & 1) || (rung.nHeight & 1)) {
+                SET_ERR(strInput[0], _T("Invalid value"), option_name, strInput[i]);
+                return 1;
+            }
+            rung_list.push_back(rung);
+        }
+        if (rung_list.size()) {
+            if (pParams->pLadderRungs) {
+                free(pParams->pLadderRungs);
+            }
+            pParams->nLadderRungs = (int)rung_list.size();
+            pParams->pLadderRungs = (sLadderRung *)malloc(sizeof(pParams->pLadderRungs[0]) * rung_list.size());
+            memcpy(pParams->pLadderRungs, &rung_list[0], sizeof(pParams->pLadderRungs[0]) * rung_list.size());
+        }
+        return 0;
+    }
+    if (0 == _tcscmp(option_name, _T("hls-time"))) {
+        i++;
+        float value = 0.0f;
+        if (1 != _stscanf_s(strInput[i], _T("%f"), &value)) {
+            SET_ERR(strInput[0], _T("Unknown value"), option_name, strInput[i]);
+            return 1;
+        }
+        if (value <= 0.0f) {
+            SET_ERR(strInput[0], _T("Invalid value"), option_name, strInput[i]);
+            return 1;
+        }
+        pParams->fHLSTime = value;
+        return 0;
+    }
+    if (0 == _tcscmp(option_name, _T("tee"))) {
+        i++;
+        if (_tcscmp(strInput[i], _T("-")) == 0) {
+            SET_ERR(strInput[0], _T("Invalid value"), option_name, strInput[i]);
+            return 1;
+        }
+        size_t teeLen = _tcslen(strInput[i]) + 1;
+        TCHAR *pTee = (TCHAR *)malloc(sizeof(strInput[i][0]) * teeLen);
+        memcpy(pTee, strInput[i], sizeof(strInput[i][0]) * teeLen);
+        pParams->ppTeeList = (TCHAR **)realloc(pParams->ppTeeList, sizeof(pParams->ppTeeList[0]) * (pParams->nTeeCount + 1));
+        pParams->ppTeeList[pParams->nTeeCount] = pTee;
+        pParams->nTeeCount++;
         return 0;
     }
 #if defined(_WIN32) || defined(_WIN64)
@@ -1870,6 +1943,24 @@ int ParseOneOption(const TCHAR *option_name, const TCHAR* strInput[], int& i, in
         pParams->nAudioThread = (int8_t)value;
         return 0;
     }
+    if (0 == _tcscmp(option_name, _T("thread-affinity"))) {
+        i++;
+        tstring errmes;
+        if (parse_thread_affinity(&pParams->threadAffinity, strInput[i], errmes)) {
+            SET_ERR(strInput[0], errmes.c_str(), option_name, strInput[i]);
+            return 1;
+        }
+        return 0;
+    }
+    if (0 == _tcscmp(option_name, _T("thread-mempolicy"))) {
+        i++;
+        tstring errmes;
+        if (parse_thread_mempolicy(&pParams->threadAffinity, strInput[i], errmes)) {
+            SET_ERR(strInput[0], errmes.c_str(), option_name, strInput[i]);
+            return 1;
+        }
+        return 0;
+    }
     if (0 == _tcscmp(option_name, _T("min-memory"))) {
         pParams->nOutputThread = 0;
         pParams->nAudioThread = 0;
@@ -1877,6 +1968,7 @@ int ParseOneOption(const TCHAR *option_name, const TCHAR* strInput[], int& i, in
         argData->nTmpInputBuf = 1;
         pParams->nOutputBufSizeMB = 0;
         pParams->nSessionThreads = 2;
+        pParams->autoTune.fixed |= QSV_AUTO_TUNE_FIXED_ASYNC_DEPTH | QSV_AUTO_TUNE_FIXED_INPUT_BUF | QSV_AUTO_TUNE_FIXED_OUTPUT_BUF;
         return 0;
     }
     if (0 == _tcscmp(option_name, _T("max-procfps"))) {
@@ -2047,6 +2139,15 @@ int ParseOneOption(const TCHAR *option_name, const TCHAR* strInput[], int& i, in
         pParams->nPerfMonitorInterval = std::max(50, v);
         return 0;
     }
+    if (0 == _tcscmp(option_name, _T("metrics-socket"))) {
+        i++;
+        if (_tcslen(strInput[i]) == 0) {
+            SET_ERR(strInput[0], _T("Invalid value"), option_name, strInput[i]);
+            return 1;
+        }
+        pParams->pMetricsSocket = _tcsdup(strInput[i]);
+        return 0;
+    }
     if (0 == _tcscmp(option_name, _T("perf-monitor-plot"))) {
         if (strInput[i+1][0] == _T('-') || _tcslen(strInput[i+1]) == 0) {
             pParams->nPerfMonitorSelectMatplot =
@@ -2068,6 +2169,78 @@ int ParseOneOption(const TCHAR *option_name, const TCHAR* strInput[], int& i, in
         }
         return 0;
     }
+    if (0 == _tcscmp(option_name, _T("sw-session"))) {
+        pParams->swSession.enable = TRUE;
+        if (strInput[i+1][0] == _T('-') || _tcslen(strInput[i+1]) == 0) {
+            return 0;
+        }
+        i++;
+        for (const auto& item : split(strInput[i], _T(","))) {
+            auto pos = item.find(_T("="));
+            if (pos == tstring::npos) {
+                SET_ERR(item.c_str(), _T("Unknown value"), option_name, strInput[i]);
+                return 1;
+            }
+            const auto param_name = item.substr(0, pos);
+            int value = 0;
+            if (1 != _stscanf_s(item.substr(pos+1).c_str(), _T("%d"), &value) || value < 0) {
+                SET_ERR(item.c_str(), _T("Unknown value"), option_name, strInput[i]);
+                return 1;
+            }
+            if (param_name == _T("async")) {
+                pParams->swSession.asyncDepth = (int8_t)clamp(value, 0, 127);
+            } else if (param_name == _T("busy")) {
+                pParams->swSession.busyInterval = value;
+            } else if (param_name == _T("reorder")) {
+                pParams->swSession.reorderDelay = (int16_t)clamp(value, 0, 16);
+            } else if (param_name == _T("task-us")) {
+                pParams->swSession.taskDurationUs = value;
+            } else {
+                SET_ERR(item.c_str(), _T("Unknown param"), option_name, strInput[i]);
+                return 1;
+            }
+        }
+        return 0;
+    }
+    if (0 == _tcscmp(option_name, _T("auto-tune"))) {
+        pParams->autoTune.enable = TRUE;
+        if (strInput[i+1][0] == _T('-') || _tcslen(strInput[i+1]) == 0) {
+            return 0;
+        }
+        i++;
+        for (const auto& item : split(strInput[i], _T(","))) {
+            auto pos = item.find(_T("="));
+            if (pos == tstring::npos) {
+                SET_ERR(item.c_str(), _T("Unknown value"), option_name, strInput[i]);
+                return 1;
+            }
+            const auto param_name = item.substr(0, pos);
+            const auto param_val  = item.substr(pos+1);
+            if (param_name == _T("enc")) {
+                int value = 0;
+                if (PARSE_ERROR_FLAG == (value = get_value_from_chr(list_auto_tune_enc, param_val.c_str()))) {
+                    SET_ERR(item.c_str(), _T("Unknown value"), option_name, strInput[i]);
+                    return 1;
+                }
+                pParams->autoTune.encMode = (int8_t)value;
+                continue;
+            }
+            int value = 0;
+            if (1 != _stscanf_s(param_val.c_str(), _T("%d"), &value) || value < 0) {
+                SET_ERR(item.c_str(), _T("Unknown value"), option_name, strInput[i]);
+                return 1;
+            }
+            if (param_name == _T("mem")) {
+                pParams->autoTune.memBudgetMB = value;
+            } else if (param_name == _T("frames")) {
+                pParams->autoTune.calibFrames = value;
+            } else {
+                SET_ERR(item.c_str(), _T("Unknown param"), option_name, strInput[i]);
+                return 1;
+            }
+        }
+        return 0;
+    }
     if (0 == _tcscmp(option_name, _T("python"))) {
         i++;
         pParams->pPythonPath = _tcsdup(strInput[i]);
@@ -2702,9 +2875,28 @@ tstring gen_cmd(const sInputParams *pParams, bool save_disabled_prm) {
 #endif //#if defined(_WIN32) || defined(_WIN64)
     OPT_NUM(_T("--input-buf"), nInputBufSize);
     OPT_NUM(_T("--output-buf"), nOutputBufSizeMB);
+    OPT_BOOL(_T("--output-prealloc"), _T(""), bOutputPrealloc);
+    OPT_NUM(_T("--segment-parallel"), nSegmentParallel);
+    if (pParams->nLadderRungs > 0) {
+        cmd << _T(" --ladder ");
+        for (int i = 0; i < pParams->nLadderRungs; i++) {
+            if (i > 0) cmd << _T(",");
+            cmd << pParams->pLadderRungs[i].nWidth << _T("x") << pParams->pLadderRungs[i].nHeight << _T(":") << pParams->pLadderRungs[i].nBitrate;
+        }
+    }
+    for (int i = 0; i < pParams->nTeeCount; i++) {
+        cmd << _T(" --tee ") << _T("\"") << pParams->ppTeeList[i] << _T("\"");
+    }
+    OPT_FLOAT(_T("--hls-time"), fHLSTime, 3);
     OPT_NUM(_T("--output-thread"), nOutputThread);
     OPT_NUM(_T("--input-thread"), nInputThread);
     OPT_NUM(_T("--audio-thread"), nAudioThread);
+    if (print_thread_affinity(pParams->threadAffinity).length() > 0) {
+        cmd << _T(" --thread-affinity ") << print_thread_affinity(pParams->threadAffinity);
+    }
+    if (print_thread_mempolicy(pParams->threadAffinity).length() > 0) {
+        cmd << _T(" --thread-mempolicy ") << print_thread_mempolicy(pParams->threadAffinity);
+    }
     OPT_NUM(_T("--max-procfps"), nProcSpeedLimit);
     OPT_CHAR_PATH(_T("--log"), pStrLogFile);
     OPT_LST(_T("--log-level"), nLogLevel, list_log_level);
@@ -2744,6 +2936,30 @@ tstring gen_cmd(const sInputParams *pParams, bool save_disabled_prm) {
         }
     }
     OPT_NUM(_T("--perf-monitor-interval"), nPerfMonitorInterval);
+    OPT_CHAR_PATH(_T("--metrics-socket"), pMetricsSocket);
+    if (pParams->swSession.enable) {
+        tmp.str(tstring());
+        if (pParams->swSession.asyncDepth)     tmp << _T(",async=")   << (int)pParams->swSession.asyncDepth;
+        if (pParams->swSession.busyInterval)   tmp << _T(",busy=")    << pParams->swSession.busyInterval;
+        if (pParams->swSession.reorderDelay)   tmp << _T(",reorder=") << pParams->swSession.reorderDelay;
+        if (pParams->swSession.taskDurationUs) tmp << _T(",task-us=") << pParams->swSession.taskDurationUs;
+        if (tmp.str().empty()) {
+            cmd << _T(" --sw-session");
+        } else {
+            cmd << _T(" --sw-session ") << tmp.str().substr(1);
+        }
+    }
+    if (pParams->autoTune.enable) {
+        tmp.str(tstring());
+        if (pParams->autoTune.memBudgetMB) tmp << _T(",mem=") << pParams->autoTune.memBudgetMB;
+        if (pParams->autoTune.calibFrames != encPrmDefault.autoTune.calibFrames) tmp << _T(",frames=") << pParams->autoTune.calibFrames;
+        if (pParams->autoTune.encMode != encPrmDefault.autoTune.encMode) tmp << _T(",enc=") << get_chr_from_value(list_auto_tune_enc, pParams->autoTune.encMode);
+        if (tmp.str().empty()) {
+            cmd << _T(" --auto-tune");
+        } else {
+            cmd << _T(" --auto-tune ") << tmp.str().substr(1);
+        }
+    }
     OPT_CHAR_PATH(_T("--python"), pLogCopyFrameData);
     OPT_BOOL(_T("--timer-period-tuning"), _T("--no-timer-period-tuning"), bDisableTimerPeriodTuning);
     return cmd.str();
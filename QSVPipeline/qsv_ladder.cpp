@@ -0,0 +1,641 @@
+﻿// -----------------------------------------------------------------------------------------
+// QSVEnc/NVEnc by rigaya
+// -----------------------------------------------------------------------------------------
+// The MIT License
+//
+// Copyright (c) 2011-2016 rigaya
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// --------------------------------------------------------------------------------------------
+
+#include <cstring>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include "rgy_osdep.h"
+#include "rgy_tchar.h"
+#include "rgy_util.h"
+#include "rgy_status.h"
+#include "convert_csp.h"
+#include "qsv_pipeline.h"
+#include "qsv_ladder.h"
+
+QSVLadderHub::QSVLadderHub(int nRungs, int nFrameBuf) :
+    m_mtx(),
+    m_cvFrameAdded(),
+    m_cvFrameFree(),
+    m_frames(),
+    m_framesFree(),
+    m_queue(nRungs),
+    m_nFrameBuf((std::max)(nFrameBuf, 1)),
+    m_bFinished(false),
+    m_bAborted(false),
+    m_videoInfo(),
+    m_nFrameIn(0),
+    m_nWaitCount(0),
+    m_fWaitSec(0.0)
+#if ENABLE_AVSW_READER
+    , m_mtxAudio(),
+    m_audioStreams(),
+    m_audioWriters()
+#endif //#if ENABLE_AVSW_READER
+{
+}
+
+QSVLadderHub::~QSVLadderHub() {
+#if ENABLE_AVSW_READER
+    clearAudioWriters();
+#endif //#if ENABLE_AVSW_READER
+}
+
+QSVLadderFrame *QSVLadderHub::getFreeFrame(int width, int height) {
+    std::unique_lock<std::mutex> lock(m_mtx);
+    QSVLadderFrame *frame = nullptr;
+    if (m_framesFree.size() > 0) {
+        frame = m_framesFree.back();
+        m_framesFree.pop_back();
+    } else if ((int)m_frames.size() < m_nFrameBuf) {
+        //必要になった時点で確保する
+        m_frames.push_back(std::unique_ptr<QSVLadderFrame>(new QSVLadderFrame()));
+        frame = m_frames.back().get();
+        frame->width = 0;
+        frame->height = 0;
+        frame->pitch = 0;
+        frame->nRef = 0;
+    } else {
+        //最も遅い段がフレームを使い終わるまで待機する
+        const auto waitStart = std::chrono::steady_clock::now();
+        m_cvFrameFree.wait(lock, [this]() { return m_framesFree.size() > 0 || m_bAborted; });
+        m_nWaitCount++;
+        m_fWaitSec += std::chrono::duration_cast<std::chrono::duration<double>>(std::chrono::steady_clock::now() - waitStart).count();
+        if (m_bAborted) {
+            return nullptr;
+        }
+        frame = m_framesFree.back();
+        m_framesFree.pop_back();
+    }
+    lock.unlock();
+
+    if (frame->width != width || frame->height != height) {
+        const int pitch = ALIGN(width, 64);
+        frame->buf.reset((uint8_t *)_aligned_malloc(pitch * height * 3 / 2, 64));
+        if (!frame->buf) {
+            //確保に失敗したフレームは、次回に確保しなおすようにしてプールに戻す
+            frame->width = 0;
+            frame->height = 0;
+            frame->pitch = 0;
+            cancelFrame(frame);
+            return nullptr;
+        }
+        frame->width = width;
+        frame->height = height;
+        frame->pitch = pitch;
+    }
+    return frame;
+}
+
+void QSVLadderHub::cancelFrame(QSVLadderFrame *frame) {
+    {
+        std::lock_guard<std::mutex> lock(m_mtx);
+        m_framesFree.push_back(frame);
+    }
+    m_cvFrameFree.notify_one();
+}
+
+void QSVLadderHub::pushFrame(QSVLadderFrame *frame) {
+    {
+        std::lock_guard<std::mutex> lock(m_mtx);
+        frame->nRef = (int)m_queue.size();
+        for (auto& queue : m_queue) {
+            queue.push_back(frame);
+        }
+        m_nFrameIn++;
+    }
+    m_cvFrameAdded.notify_all();
+}
+
+void QSVLadderHub::finish() {
+    {
+        std::lock_guard<std::mutex> lock(m_mtx);
+        m_bFinished = true;
+    }
+    m_cvFrameAdded.notify_all();
+}
+
+QSVLadderFrame *QSVLadderHub::popFrame(int rung) {
+    std::unique_lock<std::mutex> lock(m_mtx);
+    auto& queue = m_queue[rung];
+    m_cvFrameAdded.wait(lock, [&]() { return queue.size() > 0 || m_bFinished || m_bAborted; });
+    if (m_bAborted || queue.size() == 0) {
+        return nullptr;
+    }
+    auto frame = queue.front();
+    queue.pop_front();
+    return frame;
+}
+
+void QSVLadderHub::releaseFrame(QSVLadderFrame *frame) {
+    bool bFree = false;
+    {
+        std::lock_guard<std::mutex> lock(m_mtx);
+        if (--frame->nRef == 0) {
+            m_framesFree.push_back(frame);
+            bFree = true;
+        }
+    }
+    if (bFree) {
+        m_cvFrameFree.notify_one();
+    }
+}
+
+void QSVLadderHub::abort() {
+    {
+        std::lock_guard<std::mutex> lock(m_mtx);
+        m_bAborted = true;
+    }
+    m_cvFrameAdded.notify_all();
+    m_cvFrameFree.notify_all();
+}
+
+bool QSVLadderHub::aborted() {
+    std::lock_guard<std::mutex> lock(m_mtx);
+    return m_bAborted;
+}
+
+#if ENABLE_AVSW_READER
+void QSVLadderHub::addAudioStream(const AVStream *pStream, int64_t nPtsOffset) {
+    AVPassthroughStreamPrm prm;
+    prm.pStream = pStream;
+    prm.nPtsOffset = nPtsOffset;
+    m_audioStreams.push_back(prm);
+}
+
+void QSVLadderHub::addAudioWriter(std::shared_ptr<RGYOutputAvcodec> pWriter) {
+    std::lock_guard<std::mutex> lock(m_mtxAudio);
+    m_audioWriters.push_back(pWriter);
+}
+
+void QSVLadderHub::writeAudioPacket(const AVPacket *pkt, AVRational timebase) {
+    std::lock_guard<std::mutex> lock(m_mtxAudio);
+    for (auto& writer : m_audioWriters) {
+        writer->WritePassthroughPacket(pkt, timebase);
+    }
+}
+
+void QSVLadderHub::clearAudioWriters() {
+    std::lock_guard<std::mutex> lock(m_mtxAudio);
+    m_audioWriters.clear();
+}
+#endif //#if ENABLE_AVSW_READER
+
+RGYOutputLadder::RGYOutputLadder(std::shared_ptr<QSVLadderHub> hub) :
+    m_hub(hub) {
+    m_strWriterName = _T("ladder");
+    m_OutType = OUT_TYPE_SURFACE;
+}
+
+RGYOutputLadder::~RGYOutputLadder() {
+}
+
+RGY_ERR RGYOutputLadder::Init(const TCHAR *strFileName, const VideoInfo *pOutputInfo, const void *prm) {
+    UNREFERENCED_PARAMETER(strFileName);
+    UNREFERENCED_PARAMETER(prm);
+    if (pOutputInfo->csp != RGY_CSP_NV12) {
+        AddMessage(RGY_LOG_ERROR, _T("unsupported color format: %s, only nv12 is supported.\n"), RGY_CSP_NAMES[pOutputInfo->csp]);
+        return RGY_ERR_INVALID_COLOR_FORMAT;
+    }
+    VideoInfo info = *pOutputInfo;
+    info.frames = m_pEncSatusInfo->m_sData.frameTotal;
+    m_hub->setVideoInfo(info);
+    AddMessage(RGY_LOG_DEBUG, _T("%dx%d, %d rungs.\n"), info.dstWidth, info.dstHeight, m_hub->rungs());
+    m_bInited = true;
+    return RGY_ERR_NONE;
+}
+
+RGY_ERR RGYOutputLadder::WriteNextFrame(RGYBitstream *pBitstream) {
+    UNREFERENCED_PARAMETER(pBitstream);
+    return RGY_ERR_UNSUPPORTED;
+}
+
+RGY_ERR RGYOutputLadder::WriteNextFrame(RGYFrame *pSurface) {
+    if (pSurface->csp() != RGY_CSP_NV12) {
+        AddMessage(RGY_LOG_ERROR, _T("unsupported color format: %s.\n"), RGY_CSP_NAMES[pSurface->csp()]);
+        return RGY_ERR_INVALID_COLOR_FORMAT;
+    }
+    const int width = (int)pSurface->width();
+    const int height = (int)pSurface->height();
+    auto frame = m_hub->getFreeFrame(width, height);
+    if (frame == nullptr) {
+        if (m_hub->aborted()) {
+            return RGY_ERR_ABORTED;
+        }
+        AddMessage(RGY_LOG_ERROR, _T("Failed to allocate frame buffer.\n"));
+        return RGY_ERR_MEMORY_ALLOC;
+    }
+    //crop後の領域をコピーする
+    const auto crop = pSurface->crop();
+    if ((crop.e.left | crop.e.up) & 1) {
+        //NV12の色差はU/Vの組で2x2画素ごとなので、奇数の位置からではずれてしまう
+        AddMessage(RGY_LOG_ERROR, _T("crop offset (left %d, up %d) must be even for nv12.\n"), crop.e.left, crop.e.up);
+        m_hub->cancelFrame(frame);
+        return RGY_ERR_INVALID_PARAM;
+    }
+    const uint8_t *ptrSrcY = pSurface->ptrY() + crop.e.up * pSurface->pitch() + crop.e.left;
+    for (int j = 0; j < height; j++) {
+        memcpy(frame->buf.get() + j * frame->pitch, ptrSrcY + j * pSurface->pitch(), width);
+    }
+    const uint8_t *ptrSrcUV = pSurface->ptrUV() + (crop.e.up >> 1) * pSurface->pitch() + crop.e.left;
+    uint8_t *ptrDstUV = frame->buf.get() + frame->pitch * height;
+    for (int j = 0; j < (height >> 1); j++) {
+        memcpy(ptrDstUV + j * frame->pitch, ptrSrcUV + j * pSurface->pitch(), width);
+    }
+    m_hub->pushFrame(frame);
+    //前処理の出力は未圧縮のフレームで、ピクチャタイプは各段のエンコーダが決めるので、I/P/Bとしては数えない
+    m_pEncSatusInfo->SetOutputData(RGY_FRAMETYPE_UNKNOWN, frame->pitch * height * 3 / 2, 0);
+    return RGY_ERR_NONE;
+}
+
+#if ENABLE_AVSW_READER
+RGY_ERR RGYOutputLadder::InitAudio(const sInputParams *pParams, std::shared_ptr<RGYInputAvcodec> pReader, const sTrimParam& trimParam, std::shared_ptr<RGYOutput>& pAudioWriter) {
+    pAudioWriter.reset();
+    if (pReader == nullptr) {
+        AddMessage(RGY_LOG_ERROR, _T("audio output requires avhw/avsw reader.\n"));
+        return RGY_ERR_UNSUPPORTED;
+    }
+    //音声はエンコードのみ行い、nullフォーマットに出力する (ファイルには書き出さない)
+    AvcodecWriterPrm writerPrm;
+    writerPrm.pOutputFormat = _T("null");
+    writerPrm.nOutputThread = pParams->nOutputThread;
+    writerPrm.nAudioThread = pParams->nAudioThread;
+    writerPrm.nBufSizeMB = pParams->nOutputBufSizeMB;
+    writerPrm.nAudioResampler = pParams->nAudioResampler;
+    writerPrm.nAudioIgnoreDecodeError = pParams->nAudioIgnoreDecodeError;
+    writerPrm.trimList = trimParam.list;
+    writerPrm.nVideoInputFirstKeyPts = pReader->GetVideoFirstKeyPts();
+    writerPrm.pVideoInputStream = pReader->GetInputVideoStream();
+    for (const auto& stream : pReader->GetInputStreamInfo()) {
+        if (stream.nTrackId <= 0) {
+            continue; //字幕は扱わない
+        }
+        const sAudioSelect *pAudioSelect = nullptr;
+        for (int i = 0; i < pParams->nAudioSelectCount; i++) {
+            if (stream.nTrackId == pParams->ppAudioSelectList[i]->nAudioSelect) {
+                pAudioSelect = pParams->ppAudioSelectList[i];
+            }
+        }
+        if (pAudioSelect == nullptr) {
+            //一致するTrackIDがなければ、nAudioSelect = 0 (全指定)を探す
+            for (int i = 0; i < pParams->nAudioSelectCount; i++) {
+                if (pParams->ppAudioSelectList[i]->nAudioSelect == 0) {
+                    pAudioSelect = pParams->ppAudioSelectList[i];
+                }
+            }
+        }
+        if (pAudioSelect == nullptr) {
+            continue;
+        }
+        AVOutputStreamPrm prm;
+        prm.src = stream;
+        prm.nBitrate = pAudioSelect->nAVAudioEncodeBitrate;
+        prm.nSamplingRate = pAudioSelect->nAudioSamplingRate;
+        prm.pEncodeCodec = pAudioSelect->pAVAudioEncodeCodec;
+        prm.pEncodeCodecPrm = pAudioSelect->pAVAudioEncodeCodecPrm;
+        prm.pEncodeCodecProfile = pAudioSelect->pAVAudioEncodeCodecProfile;
+        prm.pFilter = pAudioSelect->pAudioFilter;
+        AddMessage(RGY_LOG_DEBUG, _T("Added audio track#%d (stream idx %d), bitrate %d, codec: %s.\n"),
+            stream.nTrackId, stream.nIndex, prm.nBitrate, prm.pEncodeCodec);
+        writerPrm.inputStreamList.push_back(std::move(prm));
+    }
+    if (writerPrm.inputStreamList.size() == 0) {
+        AddMessage(RGY_LOG_WARN, _T("no audio track found for output.\n"));
+        return RGY_ERR_NONE;
+    }
+    auto pWriter = std::make_shared<RGYOutputAvcodec>();
+    pAudioWriter = pWriter;
+    auto ret = pAudioWriter->Init(pParams->strDstFile, nullptr, &writerPrm, m_pPrintMes, m_pEncSatusInfo);
+    if (ret != RGY_ERR_NONE) {
+        AddMessage(RGY_LOG_ERROR, pAudioWriter->GetOutputMessage());
+        pAudioWriter.reset();
+        return ret;
+    }
+    //出力するパケットのタイムスタンプは映像の先頭を0としたものなので、オフセットは不要
+    for (const auto pStream : pWriter->GetAudioOutputStreams()) {
+        m_hub->addAudioStream(pStream, 0);
+    }
+    auto hub = m_hub.get();
+    pWriter->SetPacketTee([hub](const AVPacket *pkt, AVRational timebase) { hub->writeAudioPacket(pkt, timebase); });
+    return RGY_ERR_NONE;
+}
+#endif //#if ENABLE_AVSW_READER
+
+RGYInputLadder::RGYInputLadder(std::shared_ptr<QSVLadderHub> hub, int rung) :
+    m_hub(hub),
+    m_nRung(rung) {
+    m_strReaderName = _T("ladder");
+}
+
+RGYInputLadder::~RGYInputLadder() {
+    Close();
+}
+
+void RGYInputLadder::Close() {
+    RGYInput::Close();
+}
+
+RGY_ERR RGYInputLadder::Init(const TCHAR *strFileName, VideoInfo *pInputInfo, const void *prm) {
+    UNREFERENCED_PARAMETER(strFileName);
+    UNREFERENCED_PARAMETER(prm);
+    memcpy(&m_inputVideoInfo, pInputInfo, sizeof(m_inputVideoInfo));
+    if (pInputInfo->csp != RGY_CSP_NV12) {
+        AddMessage(RGY_LOG_ERROR, _T("unsupported color format: %s, only nv12 is supported.\n"), RGY_CSP_NAMES[pInputInfo->csp]);
+        return RGY_ERR_INVALID_COLOR_FORMAT;
+    }
+    //入力の情報は前処理の出力から決まる
+    const auto& hubInfo = m_hub->videoInfo();
+    m_inputVideoInfo.srcWidth = hubInfo.dstWidth;
+    m_inputVideoInfo.srcHeight = hubInfo.dstHeight;
+    m_inputVideoInfo.srcPitch = ALIGN(hubInfo.dstWidth, 64);
+    m_inputVideoInfo.fpsN = hubInfo.fpsN;
+    m_inputVideoInfo.fpsD = hubInfo.fpsD;
+    m_inputVideoInfo.sar[0] = hubInfo.sar[0];
+    m_inputVideoInfo.sar[1] = hubInfo.sar[1];
+    m_inputVideoInfo.picstruct = hubInfo.picstruct;
+    m_inputVideoInfo.frames = hubInfo.frames;
+    m_inputVideoInfo.csp = RGY_CSP_NV12;
+    m_inputVideoInfo.shift = 0;
+    memset(&m_inputVideoInfo.crop, 0, sizeof(m_inputVideoInfo.crop));
+    m_InputCsp = RGY_CSP_NV12;
+
+    m_sConvert = get_convert_csp_func(RGY_CSP_NV12, RGY_CSP_NV12, false);
+    if (nullptr == m_sConvert) {
+        AddMessage(RGY_LOG_ERROR, _T("color conversion not supported: nv12 -> nv12.\n"));
+        return RGY_ERR_INVALID_COLOR_FORMAT;
+    }
+    CreateInputInfo(m_strReaderName.c_str(), RGY_CSP_NAMES[m_sConvert->csp_from], RGY_CSP_NAMES[m_sConvert->csp_to], get_simd_str(m_sConvert->simd), &m_inputVideoInfo);
+    AddMessage(RGY_LOG_DEBUG, _T("rung #%d: %s"), m_nRung, m_strInputInfo.c_str());
+    *pInputInfo = m_inputVideoInfo;
+    return RGY_ERR_NONE;
+}
+
+RGY_ERR RGYInputLadder::LoadNextFrame(RGYFrame *pSurface) {
+    auto frame = m_hub->popFrame(m_nRung);
+    if (frame == nullptr) {
+        return (m_hub->aborted()) ? RGY_ERR_ABORTED : RGY_ERR_MORE_DATA;
+    }
+    void *dst_array[3];
+    pSurface->ptrArray(dst_array, false);
+    const void *src_array[3];
+    src_array[0] = frame->buf.get();
+    src_array[1] = frame->buf.get() + frame->pitch * frame->height;
+    src_array[2] = nullptr;
+    m_sConvert->func[0](dst_array, src_array, frame->width, frame->pitch, frame->pitch,
+        pSurface->pitch(), frame->height, frame->height, m_inputVideoInfo.crop.c);
+    m_hub->releaseFrame(frame);
+
+    m_pEncSatusInfo->m_sData.frameIn++;
+    return m_pEncSatusInfo->UpdateDisplay();
+}
+
+tstring qsv_ladder_output_filename(const TCHAR *strDstFile, const sLadderRung& rung) {
+    const tstring dst = strDstFile;
+    const TCHAR *ext = PathFindExtension(strDstFile);
+    const tstring extStr = (ext && ext[0] == _T('.')) ? ext : _T("");
+    return dst.substr(0, dst.length() - extStr.length()) + strsprintf(_T("_%dx%d"), rung.nWidth, rung.nHeight) + extStr;
+}
+
+//--ladderで使用できない設定をチェックする
+static bool qsv_ladder_check_param(const sInputParams *pParams, std::shared_ptr<RGYLog> pLog) {
+    const bool useESOutput =
+        ((pParams->pAVMuxOutputFormat && 0 == _tcscmp(pParams->pAVMuxOutputFormat, _T("raw"))))
+        || (PathFindExtension(pParams->strDstFile) == nullptr || PathFindExtension(pParams->strDstFile)[0] != '.')
+        || check_ext(pParams->strDstFile, { ".m2v", ".264", ".h264", ".avc", ".avc1", ".x264", ".265", ".h265", ".hevc" });
+    bool audioExtract = false;
+    for (int i = 0; i < pParams->nAudioSelectCount; i++) {
+        audioExtract |= pParams->ppAudioSelectList[i]->pAudioExtractFilename != nullptr;
+    }
+    const TCHAR *unsupported = nullptr;
+    if (pParams->bBenchmark) {
+        unsupported = _T("--benchmark");
+    } else if (pParams->CodecId == MFX_CODEC_RAW) {
+        unsupported = _T("raw output");
+    } else if (_tcscmp(pParams->strDstFile, _T("-")) == 0) {
+        unsupported = _T("stdout output");
+    } else if (pParams->nSegmentParallel > 1) {
+        unsupported = _T("--segment-parallel");
+    } else if (pParams->nTeeCount > 0) {
+        unsupported = _T("--tee");
+    } else if (pParams->pMetricsSocket) {
+        unsupported = _T("--metrics-socket");
+    } else if (pParams->CodecId == MFX_CODEC_HEVC && pParams->CodecProfile == MFX_PROFILE_HEVC_MAIN10) {
+        unsupported = _T("10bit encoding");
+    } else if (pParams->nSubtitleSelectCount > 0 || pParams->caption2ass != FORMAT_INVALID) {
+        unsupported = _T("subtitle output");
+    } else if (pParams->pChapterFile || pParams->bCopyChapter) {
+        unsupported = _T("chapter output");
+    } else if (pParams->nAVSyncMode != RGY_AVSYNC_ASSUME_CFR) {
+        unsupported = _T("--avsync");
+    } else if (pParams->nAudioSourceCount > 0) {
+        unsupported = _T("--audio-source");
+    } else if (audioExtract) {
+        unsupported = _T("--audio-file");
+    } else if (pParams->nAudioSelectCount > 0 && (pParams->nTrimCount > 0 || pParams->fSeekSec > 0.0f)) {
+        unsupported = _T("--trim/--seek with audio output");
+    } else if (pParams->nAudioSelectCount > 0 && useESOutput) {
+        unsupported = _T("audio output to elementary stream");
+    }
+    if (unsupported) {
+        pLog->write(RGY_LOG_ERROR, _T("--ladder cannot be used with %s.\n"), unsupported);
+        return false;
+    }
+#if !ENABLE_AVSW_READER
+    if (pParams->nAudioSelectCount > 0) {
+        pLog->write(RGY_LOG_ERROR, _T("audio output with --ladder requires avcodec reader, which is not compiled in this binary.\n"));
+        return false;
+    }
+#endif //#if !ENABLE_AVSW_READER
+    return true;
+}
+
+int qsv_run_ladder(sInputParams *pParams, bool *pAbort) {
+    auto pLog = std::make_shared<RGYLog>(pParams->pStrLogFile, pParams->nLogLevel);
+    if (!qsv_ladder_check_param(pParams, pLog)) {
+        return 1;
+    }
+    const int nRungs = pParams->nLadderRungs;
+    auto hub = std::make_shared<QSVLadderHub>(nRungs, QSV_LADDER_FRAME_BUF);
+
+    //前処理: デコードと共通のvpp処理を1回だけ行い、フレームをhubに渡す
+    //リサイズは各段で行うので、前処理では出力解像度を指定しない
+    sInputParams frontParams = *pParams;
+    frontParams.nLadderRungs = 0;
+    frontParams.pLadderRungs = nullptr;
+    frontParams.CodecId = MFX_CODEC_RAW;
+    frontParams.nDstWidth = 0;
+    frontParams.nDstHeight = 0;
+
+    unique_ptr<CQSVPipeline> pFront(new CQSVPipeline);
+    pFront->SetOutputOverride(std::make_shared<RGYOutputLadder>(hub));
+    auto sts = pFront->Init(&frontParams);
+    if (sts < MFX_ERR_NONE) {
+        pLog->write(RGY_LOG_ERROR, _T("ladder: failed to initialize front-end: %s\n"), get_err_mes(sts));
+        pFront->Close();
+        return 1;
+    }
+    pFront->SetAbortFlagPointer(pAbort);
+    const auto frontInfo = hub->videoInfo();
+    pLog->write(RGY_LOG_INFO, _T("ladder: front-end %dx%d, %d/%d fps, %d rungs.\n"),
+        frontInfo.dstWidth, frontInfo.dstHeight, frontInfo.fpsN, frontInfo.fpsD, nRungs);
+
+    //各段のパラメータ
+    //vpp処理は前処理で行うので、各段ではリサイズのみ行う
+    //ログは最終結果のみ表示するため、各段のエンコードでは警告以上のみ表示する
+    sInputParams defaultParams;
+    init_qsvp_prm(&defaultParams);
+    std::vector<sInputParams> rungParams(nRungs);
+    std::vector<tstring> rungDstFile(nRungs);
+    for (int i = 0; i < nRungs; i++) {
+        const auto& rung = pParams->pLadderRungs[i];
+        auto& prm = rungParams[i];
+        prm = *pParams;
+        prm.nLadderRungs = 0;
+        prm.pLadderRungs = nullptr;
+        prm.nInputFmt = RGY_INPUT_FMT_RAW;
+        prm.nWidth = 0;
+        prm.nHeight = 0;
+        prm.nFPSRate = 0;
+        prm.nFPSScale = 0;
+        prm.nPicStruct = picstruct_rgy_to_enc(frontInfo.picstruct);
+        prm.sInCrop = defaultParams.sInCrop;
+        prm.vpp = defaultParams.vpp;
+        prm.vpp.scalingQuality = pParams->vpp.scalingQuality;
+        prm.nDstWidth = (mfxU16)rung.nWidth;
+        prm.nDstHeight = (mfxU16)rung.nHeight;
+        if (   prm.nEncMode == MFX_RATECONTROL_CQP
+            || prm.nEncMode == MFX_RATECONTROL_ICQ
+            || prm.nEncMode == MFX_RATECONTROL_LA_ICQ) {
+            if (i == 0) {
+                pLog->write(RGY_LOG_WARN, _T("ladder: rate control switched to VBR, as each rung is encoded with its own bitrate.\n"));
+            }
+            prm.nEncMode = MFX_RATECONTROL_VBR;
+        }
+        //最大ビットレートは、指定されたビットレートとの比を維持する
+        prm.nMaxBitrate = (pParams->nBitRate > 0 && pParams->nMaxBitrate > 0)
+            ? (mfxU32)((int64_t)pParams->nMaxBitrate * rung.nBitrate / pParams->nBitRate) : 0;
+        prm.nBitRate = rung.nBitrate;
+        if (prm.nMaxBitrate > 0) {
+            prm.nMaxBitrate = (std::max)(prm.nMaxBitrate, prm.nBitRate);
+        }
+        prm.nAudioSelectCount = 0;
+        prm.ppAudioSelectList = nullptr;
+        prm.nAVMux &= ~(RGY_MUX_AUDIO | RGY_MUX_SUBTITLE);
+        prm.nTrimCount = 0;
+        prm.pTrimList = nullptr;
+        prm.fSeekSec = 0.0f;
+        prm.nLogLevel = (std::max)((int)pParams->nLogLevel, (int)RGY_LOG_WARN);
+        prm.pStrLogFile = nullptr;
+        prm.pFramePosListLog = nullptr;
+        prm.pMuxVidTsLogFile = nullptr;
+        prm.pLogCopyFrameData = nullptr;
+        prm.nPerfMonitorSelect = 0;
+        prm.nPerfMonitorSelectMatplot = 0;
+        rungDstFile[i] = qsv_ladder_output_filename(pParams->strDstFile, rung);
+        _tcscpy_s(prm.strDstFile, _countof(prm.strDstFile), rungDstFile[i].c_str());
+    }
+
+    //各段を初期化する
+    //前処理側の音声出力のストリームは前処理の初期化時に登録済みなので、各段の出力にそのままコピーされる
+    std::vector<unique_ptr<CQSVPipeline>> rungs;
+    bool bInitError = false;
+    for (int i = 0; i < nRungs; i++) {
+        unique_ptr<CQSVPipeline> pRung(new CQSVPipeline);
+        pRung->SetInputOverride(std::make_shared<RGYInputLadder>(hub, i));
+        sts = pRung->Init(&rungParams[i]);
+        if (sts < MFX_ERR_NONE) {
+            pLog->write(RGY_LOG_ERROR, _T("ladder: failed to initialize rung #%d (%dx%d): %s\n"),
+                i, pParams->pLadderRungs[i].nWidth, pParams->pLadderRungs[i].nHeight, get_err_mes(sts));
+            pRung->Close();
+            bInitError = true;
+            break;
+        }
+        pRung->SetAbortFlagPointer(pAbort);
+        rungs.push_back(std::move(pRung));
+    }
+    if (bInitError) {
+        for (auto& pRung : rungs) {
+            pRung->Close();
+        }
+        pFront->Close();
+#if ENABLE_AVSW_READER
+        hub->clearAudioWriters();
+#endif //#if ENABLE_AVSW_READER
+        return 1;
+    }
+
+    //すべてのパイプラインを並列に実行する
+    //いずれかでエラーが発生した場合は、hubを中断して他のパイプラインの待機を解除する
+    std::vector<mfxStatus> rungSts(nRungs, MFX_ERR_NONE);
+    std::vector<std::thread> threads;
+    for (int i = 0; i < nRungs; i++) {
+        threads.push_back(std::thread([&, i]() {
+            rungSts[i] = rungs[i]->Run();
+            if (rungSts[i] < MFX_ERR_NONE) {
+                hub->abort();
+            }
+        }));
+    }
+    const auto frontSts = pFront->Run();
+    if (frontSts < MFX_ERR_NONE) {
+        hub->abort();
+    }
+    //前処理を先にCloseして残りの音声を各段に渡してから、フレームの終了を通知する
+    pFront->Close();
+    hub->finish();
+    for (auto& th : threads) {
+        th.join();
+    }
+
+    int ret = 0;
+    if (frontSts < MFX_ERR_NONE) {
+        pLog->write(RGY_LOG_ERROR, _T("ladder: front-end failed: %s\n"), get_err_mes(frontSts));
+        ret = 1;
+    }
+    for (int i = 0; i < nRungs; i++) {
+        if (rungSts[i] < MFX_ERR_NONE) {
+            pLog->write(RGY_LOG_ERROR, _T("ladder: rung #%d failed: %s\n"), i, get_err_mes(rungSts[i]));
+            ret = 1;
+        } else {
+            EncodeStatusData data = { 0 };
+            rungs[i]->GetEncodeStatusData(&data);
+            pLog->write(RGY_LOG_INFO, _T("ladder: rung #%d %dx%d -> \"%s\": %u frames, %.2f kbps.\n"),
+                i, pParams->pLadderRungs[i].nWidth, pParams->pLadderRungs[i].nHeight,
+                rungDstFile[i].c_str(), data.frameOut, data.bitrateKbps);
+        }
+        rungs[i]->Close();
+    }
+#if ENABLE_AVSW_READER
+    hub->clearAudioWriters();
+#endif //#if ENABLE_AVSW_READER
+    pLog->write(RGY_LOG_INFO, _T("ladder: %lld frames distributed, front-end waited for rungs %d times (%.2f sec).\n"),
+        (long long int)hub->frameIn(), hub->waitCount(), hub->waitSec());
+    if (pAbort && *pAbort) {
+        ret = 1;
+    }
+    return ret;
+}
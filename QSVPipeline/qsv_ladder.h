@@ -0,0 +1,179 @@
+﻿// -----------------------------------------------------------------------------------------
+// QSVEnc/NVEnc by rigaya
+// -----------------------------------------------------------------------------------------
+// The MIT License
+//
+// Copyright (c) 2011-2016 rigaya
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// --------------------------------------------------------------------------------------------
+
+#pragma once
+#ifndef __QSV_LADDER_H__
+#define __QSV_LADDER_H__
+
+#include <vector>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include "rgy_osdep.h"
+#include "rgy_tchar.h"
+#include "rgy_util.h"
+#include "rgy_input.h"
+#include "rgy_output.h"
+#include "qsv_prm.h"
+#if ENABLE_AVSW_READER
+#include "rgy_input_avcodec.h"
+#include "rgy_output_avcodec.h"
+#endif //#if ENABLE_AVSW_READER
+
+//--ladder
+//1つのCQSVPipeline(前処理)でデコード・共通のvpp処理を1回だけ行い、その出力フレームを
+//ラダーの各段(リサイズとエンコードを行うCQSVPipeline)に分配する
+//音声は前処理側で1回だけエンコードし、各段の出力にそのままコピーする
+
+//前処理から各段に渡すフレームのバッファ数 (最も遅い段が処理するまで、前処理はこれ以上先に進まない)
+static const int QSV_LADDER_FRAME_BUF = 8;
+
+//各段に渡すフレーム (NV12)
+struct QSVLadderFrame {
+    std::unique_ptr<uint8_t, aligned_malloc_deleter> buf;
+    int width;
+    int height;
+    int pitch;
+    int nRef; //このフレームをまだ使用している段の数
+};
+
+//前処理と各段の間でフレームを受け渡す
+class QSVLadderHub {
+public:
+    QSVLadderHub(int nRungs, int nFrameBuf);
+    ~QSVLadderHub();
+
+    int rungs() const { return (int)m_queue.size(); }
+
+    //前処理の出力の情報
+    void setVideoInfo(const VideoInfo& info) { m_videoInfo = info; }
+    const VideoInfo& videoInfo() const { return m_videoInfo; }
+
+    //前処理側: 空きフレームを取得する
+    //すべてのフレームが使用中なら、いずれかのフレームがすべての段で使用済みとなるまで待機する
+    //中断された場合はnullptrを返す
+    QSVLadderFrame *getFreeFrame(int width, int height);
+    //前処理側: getFreeFrameで取得したが、段に渡さなかったフレームを返却する
+    void cancelFrame(QSVLadderFrame *frame);
+    //前処理側: フレームをすべての段に渡す
+    void pushFrame(QSVLadderFrame *frame);
+    //前処理側: これ以上フレームがないことを通知する
+    void finish();
+
+    //各段: 次のフレームを取得する (フレームがなければ待機し、終了・中断時はnullptrを返す)
+    QSVLadderFrame *popFrame(int rung);
+    //各段: 使用済みのフレームを返却する
+    void releaseFrame(QSVLadderFrame *frame);
+
+    //いずれかのパイプラインでエラーが発生した場合に、すべての待機を解除する
+    void abort();
+    bool aborted();
+
+    //前処理が空きフレームを待った回数と時間 (各段の処理が追い付いていない)
+    int64_t frameIn() const { return m_nFrameIn; }
+    int waitCount() const { return m_nWaitCount; }
+    double waitSec() const { return m_fWaitSec; }
+
+#if ENABLE_AVSW_READER
+    //前処理側の音声出力のストリームを登録する
+    //nPtsOffsetはストリームのtimebaseでの映像の先頭の位置
+    void addAudioStream(const AVStream *pStream, int64_t nPtsOffset);
+    const std::vector<AVPassthroughStreamPrm>& audioStreams() const { return m_audioStreams; }
+    //各段の出力を登録する
+    void addAudioWriter(std::shared_ptr<RGYOutputAvcodec> pWriter);
+    //前処理側の音声出力で書き出すパケットを、各段の出力に渡す
+    void writeAudioPacket(const AVPacket *pkt, AVRational timebase);
+    //各段の出力の登録を解除する
+    void clearAudioWriters();
+#endif //#if ENABLE_AVSW_READER
+protected:
+    std::mutex m_mtx;
+    std::condition_variable m_cvFrameAdded;
+    std::condition_variable m_cvFrameFree;
+    std::vector<std::unique_ptr<QSVLadderFrame>> m_frames;
+    std::vector<QSVLadderFrame *> m_framesFree;
+    std::vector<std::deque<QSVLadderFrame *>> m_queue;
+    int m_nFrameBuf;
+    bool m_bFinished;
+    bool m_bAborted;
+    VideoInfo m_videoInfo;
+    int64_t m_nFrameIn;
+    int m_nWaitCount;
+    double m_fWaitSec;
+#if ENABLE_AVSW_READER
+    std::mutex m_mtxAudio;
+    std::vector<AVPassthroughStreamPrm> m_audioStreams;
+    std::vector<std::shared_ptr<RGYOutputAvcodec>> m_audioWriters;
+#endif //#if ENABLE_AVSW_READER
+};
+
+//前処理の出力フレームをQSVLadderHubに渡すRGYOutput
+class RGYOutputLadder : public RGYOutput {
+public:
+    RGYOutputLadder(std::shared_ptr<QSVLadderHub> hub);
+    virtual ~RGYOutputLadder();
+
+    virtual RGY_ERR WriteNextFrame(RGYBitstream *pBitstream) override;
+    virtual RGY_ERR WriteNextFrame(RGYFrame *pSurface) override;
+
+    QSVLadderHub *hub() { return m_hub.get(); }
+#if ENABLE_AVSW_READER
+    //前処理の音声出力を作成し、書き出すパケットを各段に渡すよう設定する
+    //音声は実際にはファイルに書き出さない
+    RGY_ERR InitAudio(const sInputParams *pParams, std::shared_ptr<RGYInputAvcodec> pReader, const sTrimParam& trimParam, std::shared_ptr<RGYOutput>& pAudioWriter);
+#endif //#if ENABLE_AVSW_READER
+protected:
+    virtual RGY_ERR Init(const TCHAR *strFileName, const VideoInfo *pOutputInfo, const void *prm) override;
+
+    std::shared_ptr<QSVLadderHub> m_hub;
+};
+
+//QSVLadderHubからフレームを読み込むRGYInput (ラダーの各段で使用する)
+class RGYInputLadder : public RGYInput {
+public:
+    RGYInputLadder(std::shared_ptr<QSVLadderHub> hub, int rung);
+    virtual ~RGYInputLadder();
+
+    virtual RGY_ERR LoadNextFrame(RGYFrame *pSurface) override;
+    virtual void Close() override;
+
+    QSVLadderHub *hub() { return m_hub.get(); }
+protected:
+    virtual RGY_ERR Init(const TCHAR *strFileName, VideoInfo *pInputInfo, const void *prm) override;
+
+    std::shared_ptr<QSVLadderHub> m_hub;
+    int m_nRung;
+};
+
+//--ladderの出力ファイル名 ("<stem>_<width>x<height><ext>")
+tstring qsv_ladder_output_filename(const TCHAR *strDstFile, const sLadderRung& rung);
+
+//--ladderによるエンコードを実行する
+int qsv_run_ladder(sInputParams *pParams, bool *pAbort);
+
+#endif //__QSV_LADDER_H__
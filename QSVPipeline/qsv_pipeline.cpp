@@ -37,11 +37,15 @@
 #include <climits>
 #include <deque>
 #include <mutex>
+#include <future>
+#include <functional>
+#include <chrono>
 #define TTMATH_NOASM
 #include "ttmath/ttmath.h"
 #include "rgy_osdep.h"
 #include "qsv_pipeline.h"
 #include "qsv_query.h"
+#include "qsv_query_cache.h"
 #include "rgy_input.h"
 #include "rgy_output.h"
 #include "rgy_input_raw.h"
@@ -50,10 +54,14 @@
 #include "rgy_input_avi.h"
 #include "rgy_input_avcodec.h"
 #include "rgy_output_avcodec.h"
+#include "rgy_output_tee.h"
 #include "rgy_bitstream.h"
 #include "qsv_hw_device.h"
 #include "qsv_allocator.h"
 #include "qsv_allocator_sys.h"
+#include "qsv_sw_session.h"
+#include "qsv_ladder.h"
+#include "qsv_stage.h"
 #include "rgy_avlog.h"
 #include "chapter_rw.h"
 #if defined(_WIN32) || defined(_WIN64)
@@ -341,7 +349,7 @@ mfxStatus CQSVPipeline::InitMfxDecParams(sInputParams *pInParams) {
         }
 
         //デコーダの作成
-        m_pmfxDEC.reset(new MFXVideoDECODE(m_mfxSession));
+        m_pmfxDEC.reset(qsv_create_decode(m_mfxSession.get()));
         if (!m_pmfxDEC) {
             return MFX_ERR_MEMORY_ALLOC;
         }
@@ -356,7 +364,8 @@ mfxStatus CQSVPipeline::InitMfxDecParams(sInputParams *pInParams) {
                 [inputCodec](decltype((codecPluginList[0])) codecPlugin) {
             return codecPlugin.first == inputCodec;
         });
-        if (plugin != codecPluginList.end()) {
+        //ソフトウェアによるsessionの代替実装の場合は、プラグインは不要
+        if (plugin != codecPluginList.end() && m_SessionPlugins) {
             PrintMes(RGY_LOG_DEBUG, _T("InitMfxDecParams: Loading %s decoder plugin..."), CodecToStr(plugin->first).c_str());
             if (MFX_ERR_NONE != m_SessionPlugins->LoadPlugin(MFX_PLUGINTYPE_VIDEO_DECODE, plugin->second, 1)) {
                 PrintMes(RGY_LOG_ERROR, _T("Failed to load hw %s decoder.\n"), CodecToStr(plugin->first).c_str());
@@ -456,6 +465,34 @@ mfxStatus CQSVPipeline::InitMfxDecParams(sInputParams *pInParams) {
     return MFX_ERR_NONE;
 }
 
+//出力先(--teeを含む)にHLS出力(.m3u8)があるか
+static bool qsv_hls_output(const sInputParams *pParams) {
+    if (pParams->fHLSTime <= 0.0f) {
+        return false;
+    }
+    if (check_ext(pParams->strDstFile, { ".m3u8" })) {
+        return true;
+    }
+    for (int i = 0; i < pParams->nTeeCount; i++) {
+        if (check_ext(pParams->ppTeeList[i], { ".m3u8" })) {
+            return true;
+        }
+    }
+    return false;
+}
+
+//HLSのセグメントの最大の長さ (秒)
+//セグメントは--hls-timeを超えた最初のIDRで区切るので、GOP長の倍数に切り上げた長さとなる (不明な場合は0)
+static double qsv_hls_segment_max_sec(const sInputParams *pParams, const mfxVideoParam& encParams) {
+    const auto& mfx = encParams.mfx;
+    if (mfx.GopPicSize == 0 || mfx.FrameInfo.FrameRateExtN == 0 || mfx.FrameInfo.FrameRateExtD == 0) {
+        return 0.0;
+    }
+    const double fFrameSec = mfx.FrameInfo.FrameRateExtD / (double)mfx.FrameInfo.FrameRateExtN;
+    const int nGopCount = (std::max)(1, (int)std::ceil((pParams->fHLSTime / fFrameSec - 0.5) / mfx.GopPicSize));
+    return nGopCount * mfx.GopPicSize * fFrameSec;
+}
+
 mfxStatus CQSVPipeline::InitMfxEncParams(sInputParams *pInParams) {
     if (pInParams->CodecId == MFX_CODEC_RAW) {
         PrintMes(RGY_LOG_DEBUG, _T("Raw codec is selected, disable encode.\n"));
@@ -466,7 +503,10 @@ mfxStatus CQSVPipeline::InitMfxEncParams(sInputParams *pInParams) {
         PrintMes(log_level, _T("%s is not supported on current platform, disabled.\n"), feature_name);
     };
 
-    if (pInParams->CodecId == MFX_CODEC_HEVC) {
+    if (!m_SessionPlugins) {
+        //ソフトウェアによるsessionの代替実装の場合は、プラグインは不要
+        PrintMes(RGY_LOG_DEBUG, _T("Skip loading encoder plugin for sw session.\n"));
+    } else if (pInParams->CodecId == MFX_CODEC_HEVC) {
         if (MFX_ERR_NONE != m_SessionPlugins->LoadPlugin(MFX_PLUGINTYPE_VIDEO_ENCODE, MFX_PLUGINID_HEVCE_HW, 1)) {
             PrintMes(RGY_LOG_ERROR, _T("Failed to load hw hevc encoder.\n"));
             PrintMes(RGY_LOG_ERROR, _T("hevc encoding is not supported on current platform.\n"));
@@ -486,7 +526,7 @@ mfxStatus CQSVPipeline::InitMfxEncParams(sInputParams *pInParams) {
         }
     }
     //エンコードモードのチェック
-    auto availableFeaures = CheckEncodeFeature(m_mfxSession, m_mfxVer, pInParams->nEncMode, pInParams->CodecId);
+    auto availableFeaures = CheckEncodeFeature(*m_mfxSession, m_mfxVer, pInParams->nEncMode, pInParams->CodecId);
     PrintMes(RGY_LOG_DEBUG, _T("Detected avaliable features for hw API v%d.%d, %s, %s\n%s\n"),
         m_mfxVer.Major, m_mfxVer.Minor,
         CodecIdToStr(pInParams->CodecId), EncmodeToStr(pInParams->nEncMode), MakeFeatureListStr(availableFeaures).c_str());
@@ -495,7 +535,7 @@ mfxStatus CQSVPipeline::InitMfxEncParams(sInputParams *pInParams) {
         if (   pInParams->nEncMode == MFX_RATECONTROL_CQP
             || pInParams->nEncMode == MFX_RATECONTROL_VBR
             || pInParams->nEncMode == MFX_RATECONTROL_CBR
-            || !(CheckEncodeFeature(m_mfxSession, m_mfxVer, MFX_RATECONTROL_CQP, pInParams->CodecId) & ENC_FEATURE_CURRENT_RC)) {
+            || !(CheckEncodeFeature(*m_mfxSession, m_mfxVer, MFX_RATECONTROL_CQP, pInParams->CodecId) & ENC_FEATURE_CURRENT_RC)) {
             PrintMes(RGY_LOG_ERROR, _T("%s encoding is not supported on current platform.\n"), CodecIdToStr(pInParams->CodecId));
             return MFX_ERR_INVALID_VIDEO_PARAM;
         }
@@ -564,7 +604,7 @@ mfxStatus CQSVPipeline::InitMfxEncParams(sInputParams *pInParams) {
         //check_rc_listに設定したfallbackの候補リストをチェックする
         bool bFallbackSuccess = false;
         for (uint32_t i = 0; i < (uint32_t)check_rc_list.size(); i++) {
-            auto availRCFeatures = CheckEncodeFeature(m_mfxSession, m_mfxVer, (uint16_t)check_rc_list[i], pInParams->CodecId);
+            auto availRCFeatures = CheckEncodeFeature(*m_mfxSession, m_mfxVer, (uint16_t)check_rc_list[i], pInParams->CodecId);
             if (availRCFeatures & ENC_FEATURE_CURRENT_RC) {
                 pInParams->nEncMode = (uint16_t)check_rc_list[i];
                 if (pInParams->nEncMode == MFX_RATECONTROL_LA_ICQ) {
@@ -640,7 +680,7 @@ mfxStatus CQSVPipeline::InitMfxEncParams(sInputParams *pInParams) {
         && (pInParams->nPicStruct & (MFX_PICSTRUCT_FIELD_TFF | MFX_PICSTRUCT_FIELD_BFF))
         && pInParams->vpp.deinterlace == MFX_DEINTERLACE_NONE
         && pInParams->nBframes > 0
-        && getCPUGen(&m_mfxSession) == CPU_GEN_HASWELL
+        && GetCPUGen() == CPU_GEN_HASWELL
         && m_memType == D3D11_MEMORY) {
         PrintMes(RGY_LOG_WARN, _T("H.264 interlaced encoding with B frames on d3d11 mode results fuzzy outputs on Haswell CPUs.\n"));
         PrintMes(RGY_LOG_WARN, _T("B frames will be disabled.\n"));
@@ -654,7 +694,7 @@ mfxStatus CQSVPipeline::InitMfxEncParams(sInputParams *pInParams) {
         PrintMes(RGY_LOG_WARN, _T("B pyramid with too many bframes is not supported on current platform, B pyramid disabled.\n"));
         pInParams->bBPyramid = false;
     }
-    if (pInParams->bBPyramid && getCPUGen(&m_mfxSession) < CPU_GEN_HASWELL) {
+    if (pInParams->bBPyramid && GetCPUGen() < CPU_GEN_HASWELL) {
         PrintMes(RGY_LOG_WARN, _T("B pyramid on IvyBridge generation might cause artifacts, please check your encoded video.\n"));
     }
     if (pInParams->bNoDeblock && !(availableFeaures & ENC_FEATURE_NO_DEBLOCK)) {
@@ -852,6 +892,24 @@ mfxStatus CQSVPipeline::InitMfxEncParams(sInputParams *pInParams) {
     OutputFPSRate /= gcd;
     OutputFPSScale /= gcd;
     PrintMes(RGY_LOG_DEBUG, _T("InitMfxEncParams: Output FPS %d/%d\n"), OutputFPSRate, OutputFPSScale);
+    //HLS出力(.m3u8)では、セグメントをIDRでのみ区切るので、--hls-timeごとにIDRが来るようGOP長を決める
+    const bool bHLSOutput = qsv_hls_output(pInParams);
+    if (bHLSOutput) {
+        const int nHLSFrames = (int)std::ceil(pInParams->fHLSTime * OutputFPSRate / (double)OutputFPSScale - 1e-3);
+        if (pInParams->bIntraRefresh) {
+            PrintMes(RGY_LOG_WARN, _T("HLS output will not be split into segments with --intra-refresh, as it does not insert IDR frames.\n"));
+        } else if (pInParams->nGOPLength == 0) {
+            pInParams->nGOPLength = (mfxU16)clamp(nHLSFrames, 1, (int)UINT16_MAX);
+            PrintMes(RGY_LOG_DEBUG, _T("InitMfxEncParams: GOP Length %d for hls-time %.2f sec.\n"), pInParams->nGOPLength, pInParams->fHLSTime);
+        } else if (nHLSFrames % pInParams->nGOPLength != 0) {
+            PrintMes(RGY_LOG_WARN, _T("--gop-len %d is not aligned to --hls-time %.2f sec (%d frames), segments will be longer than the target duration.\n"),
+                pInParams->nGOPLength, pInParams->fHLSTime, nHLSFrames);
+        }
+        if (pInParams->bopenGOP) {
+            PrintMes(RGY_LOG_WARN, _T("--open-gop is disabled for HLS output, as segments must start with IDR.\n"));
+            pInParams->bopenGOP = false;
+        }
+    }
     if (pInParams->nGOPLength == 0) {
         pInParams->nGOPLength = (mfxU16)((OutputFPSRate + OutputFPSScale - 1) / OutputFPSScale) * 10;
         PrintMes(RGY_LOG_DEBUG, _T("InitMfxEncParams: Auto GOP Length: %d\n"), pInParams->nGOPLength);
@@ -867,6 +925,10 @@ mfxStatus CQSVPipeline::InitMfxEncParams(sInputParams *pInParams) {
     m_mfxEncParams.mfx.GopOptFlag              = 0;
     m_mfxEncParams.mfx.GopOptFlag             |= (!pInParams->bopenGOP) ? MFX_GOP_CLOSED : 0x00;
     m_mfxEncParams.mfx.IdrInterval             = (!pInParams->bopenGOP) ? 0 : (mfxU16)((OutputFPSRate + OutputFPSScale - 1) / OutputFPSScale) * 20 / pInParams->nGOPLength;
+    if (bHLSOutput) {
+        //すべてのIフレームをIDRとする (HEVCではIdrInterval=0だと先頭のみがIDRとなる)
+        m_mfxEncParams.mfx.IdrInterval = (mfxU16)((pInParams->CodecId == MFX_CODEC_HEVC) ? 1 : 0);
+    }
     //MFX_GOP_STRICTにより、インタレ保持時にフレームが壊れる場合があるため、無効とする
     //m_mfxEncParams.mfx.GopOptFlag             |= (pInParams->bforceGOPSettings) ? MFX_GOP_STRICT : NULL;
 
@@ -1155,7 +1217,7 @@ mfxStatus CQSVPipeline::InitMfxEncParams(sInputParams *pInParams) {
 
 mfxStatus CQSVPipeline::InitMfxVppParams(sInputParams *pInParams) {
     const mfxU32 blocksz = (pInParams->CodecId == MFX_CODEC_HEVC) ? 32 : 16;
-    mfxU64 availableFeaures = CheckVppFeatures(m_mfxSession, m_mfxVer);
+    mfxU64 availableFeaures = CheckVppFeatures(*m_mfxSession, m_mfxVer);
 #if ENABLE_FPS_CONVERSION
     if (FPS_CONVERT_NONE != pInParams->vpp.nFPSConversion && !(availableFeaures & VPP_FEATURE_FPS_CONVERSION_ADV)) {
         PrintMes(RGY_LOG_WARN, _T("FPS Conversion not supported on this platform, disabled.\n"));
@@ -1522,7 +1584,7 @@ mfxStatus CQSVPipeline::CreateVppExtBuffers(sInputParams *pParams) {
     }
 
     //Haswell以降では、DONOTUSEをセットするとdetail enhancerの効きが固定になるなど、よくわからない挙動を示す。
-    if (m_VppDoNotUseList.size() && getCPUGen(&m_mfxSession) < CPU_GEN_HASWELL) {
+    if (m_VppDoNotUseList.size() && GetCPUGen() < CPU_GEN_HASWELL) {
         AllocAndInitVppDoNotUse();
         m_VppExtParams.push_back((mfxExtBuffer *)&m_VppDoNotUse);
         for (const auto& extParam : m_VppDoNotUseList) {
@@ -1542,6 +1604,12 @@ mfxStatus CQSVPipeline::InitVppPrePlugins(sInputParams *pParams) {
     mfxStatus sts = MFX_ERR_NONE;
 #if ENABLE_CUSTOM_VPP
     tstring vppPreMes = _T("");
+    if (qsv_is_sw_session(m_mfxSession.get())
+        && (pParams->vpp.subburn.nTrack || pParams->vpp.subburn.pFilePath || pParams->vpp.delogo.pFilePath || pParams->vpp.halfTurn)) {
+        //カスタムVPPは独自のsessionをメインのsessionにJoinして使用するため、代替実装では使用できない
+        PrintMes(RGY_LOG_ERROR, _T("--vpp-sub-burn, --vpp-delogo, --vpp-half-turn are not supported with --sw-session.\n"));
+        return MFX_ERR_UNSUPPORTED;
+    }
 #if ENABLE_AVSW_READER && ENABLE_LIBASS_SUBBURN
     if (pParams->vpp.subburn.nTrack || pParams->vpp.subburn.pFilePath) {
         int nCrop[4] = { 0 };
@@ -1583,7 +1651,7 @@ mfxStatus CQSVPipeline::InitVppPrePlugins(sInputParams *pParams) {
             PrintMes(RGY_LOG_ERROR, _T("%s\n"), filter->getMessage().c_str());
             return sts;
         } else {
-            sts = MFXJoinSession(m_mfxSession, filter->getSession());
+            sts = MFXJoinSession(*m_mfxSession, filter->getSession());
             QSV_ERR_MES(sts, _T("Failed to join vpp pre filter session."));
             tstring mes = filter->getMessage();
             PrintMes(RGY_LOG_DEBUG, _T("InitVppPrePlugins: add filter: %s\n"), mes.c_str());
@@ -1605,7 +1673,7 @@ mfxStatus CQSVPipeline::InitVppPrePlugins(sInputParams *pParams) {
             PrintMes(RGY_LOG_ERROR, _T("%s\n"), filter->getMessage().c_str());
             return sts;
         } else {
-            sts = MFXJoinSession(m_mfxSession, filter->getSession());
+            sts = MFXJoinSession(*m_mfxSession, filter->getSession());
             QSV_ERR_MES(sts, _T("Failed to join vpp pre filter session."));
             tstring mes = filter->getMessage();
             PrintMes(RGY_LOG_DEBUG, _T("InitVppPrePlugins: add filter: %s\n"), mes.c_str());
@@ -1621,7 +1689,7 @@ mfxStatus CQSVPipeline::InitVppPrePlugins(sInputParams *pParams) {
             PrintMes(RGY_LOG_ERROR, _T("%s\n"), filter->getMessage().c_str());
             return sts;
         } else {
-            sts = MFXJoinSession(m_mfxSession, filter->getSession());
+            sts = MFXJoinSession(*m_mfxSession, filter->getSession());
             QSV_ERR_MES(sts, _T("Failed to join vpp pre filter session."));
             tstring mes = filter->getMessage();
             PrintMes(RGY_LOG_DEBUG, _T("InitVppPrePlugins: add filter: %s\n"), mes.c_str());
@@ -1654,7 +1722,7 @@ mfxStatus CQSVPipeline::CreateHWDevice() {
             m_memType = D3D11_MEMORY;
             PrintMes(RGY_LOG_DEBUG, _T("HWDevice: d3d11 - initializing...\n"));
 
-            sts = m_hwdev->Init(NULL, GetAdapterID(m_mfxSession), m_pQSVLog);
+            sts = m_hwdev->Init(NULL, GetAdapterID(*m_mfxSession), m_pQSVLog);
             if (sts != MFX_ERR_NONE) {
                 m_hwdev.reset();
                 PrintMes(RGY_LOG_DEBUG, _T("HWDevice: d3d11 - initializing failed.\n"));
@@ -1671,7 +1739,7 @@ mfxStatus CQSVPipeline::CreateHWDevice() {
             }
 
             PrintMes(RGY_LOG_DEBUG, _T("HWDevice: d3d9 - initializing...\n"));
-            sts = m_hwdev->Init(window, GetAdapterID(m_mfxSession), m_pQSVLog);
+            sts = m_hwdev->Init(window, GetAdapterID(*m_mfxSession), m_pQSVLog);
         }
     }
     QSV_ERR_MES(sts, _T("Failed to initialize HW Device."));
@@ -1682,7 +1750,7 @@ mfxStatus CQSVPipeline::CreateHWDevice() {
     if (!m_hwdev) {
         return MFX_ERR_MEMORY_ALLOC;
     }
-    sts = m_hwdev->Init(NULL, GetAdapterID(m_mfxSession), m_pQSVLog);
+    sts = m_hwdev->Init(NULL, GetAdapterID(*m_mfxSession), m_pQSVLog);
     QSV_ERR_MES(sts, _T("Failed to initialize HW Device."));
 #endif
     return MFX_ERR_NONE;
@@ -2010,10 +2078,10 @@ mfxStatus CQSVPipeline::CreateAllocator() {
         PrintMes(RGY_LOG_DEBUG, _T("CreateAllocator: HW device GetHandle success.\n"));
 
         mfxIMPL impl = 0;
-        m_mfxSession.QueryIMPL(&impl);
+        m_mfxSession->QueryIMPL(&impl);
         if (impl != MFX_IMPL_SOFTWARE) {
             // hwエンコード時のみハンドルを渡す
-            sts = m_mfxSession.SetHandle(hdl_t, hdl);
+            sts = m_mfxSession->SetHandle(hdl_t, hdl);
             QSV_ERR_MES(sts, _T("Failed to set HW device handle to encode session."));
             PrintMes(RGY_LOG_DEBUG, _T("CreateAllocator: set HW device handle to encode session.\n"));
         }
@@ -2060,7 +2128,7 @@ mfxStatus CQSVPipeline::CreateAllocator() {
 
         //GPUメモリ使用時には external allocatorを使用する必要がある
         //mfxSessionにallocatorを渡してやる必要がある
-        sts = m_mfxSession.SetFrameAllocator(m_pMFXAllocator.get());
+        sts = m_mfxSession->SetFrameAllocator(m_pMFXAllocator.get());
         QSV_ERR_MES(sts, _T("Failed to set frame allocator to encode session."));
         PrintMes(RGY_LOG_DEBUG, _T("CreateAllocator: frame allocator set to session.\n"));
 
@@ -2076,7 +2144,7 @@ mfxStatus CQSVPipeline::CreateAllocator() {
         PrintMes(RGY_LOG_DEBUG, _T("CreateAllocator: HW device GetHandle success. : 0x%x\n"), (uint32_t)(size_t)hdl);
 
         //ハンドルを渡す
-        sts = m_mfxSession.SetHandle(MFX_HANDLE_VA_DISPLAY, hdl);
+        sts = m_mfxSession->SetHandle(MFX_HANDLE_VA_DISPLAY, hdl);
         QSV_ERR_MES(sts, _T("Failed to set HW device handle to encode session."));
 
         //VAAPI allocatorを作成
@@ -2097,7 +2165,7 @@ mfxStatus CQSVPipeline::CreateAllocator() {
 
         //GPUメモリ使用時には external allocatorを使用する必要がある
         //mfxSessionにallocatorを渡してやる必要がある
-        sts = m_mfxSession.SetFrameAllocator(m_pMFXAllocator.get());
+        sts = m_mfxSession->SetFrameAllocator(m_pMFXAllocator.get());
         QSV_ERR_MES(sts, _T("Failed to set frame allocator to encode session."));
         PrintMes(RGY_LOG_DEBUG, _T("CreateAllocator: frame allocator set to session.\n"));
 
@@ -2107,7 +2175,7 @@ mfxStatus CQSVPipeline::CreateAllocator() {
 #ifdef LIBVA_SUPPORT
         //システムメモリ使用でも MFX_HANDLE_VA_DISPLAYをHW libraryに渡してやる必要がある
         mfxIMPL impl;
-        m_mfxSession.QueryIMPL(&impl);
+        m_mfxSession->QueryIMPL(&impl);
 
         if (MFX_IMPL_HARDWARE == MFX_IMPL_BASETYPE(impl)) {
             sts = CreateHWDevice();
@@ -2119,7 +2187,7 @@ mfxStatus CQSVPipeline::CreateAllocator() {
             PrintMes(RGY_LOG_DEBUG, _T("CreateAllocator: HW device GetHandle success. : 0x%x\n"), (uint32_t)(size_t)hdl);
 
             //ハンドルを渡す
-            sts = m_mfxSession.SetHandle(MFX_HANDLE_VA_DISPLAY, hdl);
+            sts = m_mfxSession->SetHandle(MFX_HANDLE_VA_DISPLAY, hdl);
             QSV_ERR_MES(sts, _T("Failed to set HW device handle to encode session."));
         }
 #endif
@@ -2172,10 +2240,13 @@ CQSVPipeline::CQSVPipeline() {
     m_memType = SYSTEM_MEMORY;
     m_bExternalAlloc = false;
     m_nAsyncDepth = 0;
+    RGY_MEMSET_ZERO(m_swSessionPrm);
+    m_pStageLatencyOverride = nullptr;
     m_nAVSyncMode = RGY_AVSYNC_ASSUME_CFR;
     m_nProcSpeedLimit = 0;
     m_bTimerPeriodTuning = false;
     m_nMFXThreads = -1;
+    m_nCPUGen = -1;
 
     m_pAbortByUser = NULL;
     m_heAbort.reset();
@@ -2239,6 +2310,18 @@ void CQSVPipeline::SetAbortFlagPointer(bool *abortFlag) {
     m_pAbortByUser = abortFlag;
 }
 
+void CQSVPipeline::SetOutputOverride(shared_ptr<RGYOutput> pWriter) {
+    m_pFileWriterOverride = pWriter;
+}
+
+void CQSVPipeline::SetInputOverride(shared_ptr<RGYInput> pReader) {
+    m_pFileReaderOverride = pReader;
+}
+
+void CQSVPipeline::SetStageLatencyOverride(PerfStageLatency *pStageLatency) {
+    m_pStageLatencyOverride = pStageLatency;
+}
+
 mfxStatus CQSVPipeline::readChapterFile(tstring chapfile) {
 #if ENABLE_AVSW_READER
     ChapterRW chapter;
@@ -2288,6 +2371,39 @@ RGY_CSP CQSVPipeline::EncoderCsp(const sInputParams *pParams, int *pShift) {
     return RGY_CSP_NV12;
 }
 
+//出力ファイルの領域をあらかじめ確保するため、ビットレートとフレーム数から出力サイズを見積もる
+//ビットレートが指定されていない場合やフレーム数が不明な場合は、見積もれないので0を返す
+static int64_t estimateOutputFileSize(const mfxVideoParam& encParams, int inputFrames, const sTrimParam& trimParam) {
+    switch (encParams.mfx.RateControlMethod) {
+    case MFX_RATECONTROL_CBR:
+    case MFX_RATECONTROL_VBR:
+    case MFX_RATECONTROL_AVBR:
+    case MFX_RATECONTROL_VCM:
+    case MFX_RATECONTROL_LA:
+    case MFX_RATECONTROL_LA_HRD:
+    case MFX_RATECONTROL_LA_EXT:
+    case MFX_RATECONTROL_QVBR:
+        break;
+    default:
+        return 0;
+    }
+    if (inputFrames <= 0 || encParams.mfx.FrameInfo.FrameRateExtN == 0 || encParams.mfx.FrameInfo.FrameRateExtD == 0) {
+        return 0;
+    }
+    int64_t frames = inputFrames;
+    if (trim_active(&trimParam)) {
+        frames = 0;
+        for (const auto& trim : trimParam.list) {
+            const int64_t fin = (std::min)((int64_t)trim.fin, (int64_t)inputFrames - 1);
+            frames += (std::max)((int64_t)0, fin - trim.start + 1);
+        }
+    }
+    const int64_t kbps = (int64_t)encParams.mfx.TargetKbps * (std::max<int64_t>)(1, encParams.mfx.BRCParamMultiplier);
+    const double duration = frames * (double)encParams.mfx.FrameInfo.FrameRateExtD / encParams.mfx.FrameInfo.FrameRateExtN;
+    //音声やコンテナのオーバーヘッドを考慮して多めに見積もる (使用しなかった領域は閉じる際に解放される)
+    return (int64_t)(kbps * 1000 / 8 * duration * 1.1);
+}
+
 mfxStatus CQSVPipeline::InitOutput(sInputParams *pParams) {
     RGY_ERR ret = RGY_ERR_NONE;
     bool stdoutUsed = false;
@@ -2297,6 +2413,32 @@ mfxStatus CQSVPipeline::InitOutput(sInputParams *pParams) {
         PrintMes(RGY_LOG_ERROR, _T("Failed to parse HEVC HDR10 metadata.\n"));
         return MFX_ERR_UNSUPPORTED;
     }
+    if (m_pFileWriterOverride) {
+        //映像のみを指定された出力先に書き出す (音声・字幕等は扱わない)
+        m_pFileWriter = m_pFileWriterOverride;
+        ret = m_pFileWriter->Init(pParams->strDstFile, &outputVideoInfo, nullptr, m_pQSVLog, m_pEncSatusInfo);
+        if (ret != RGY_ERR_NONE) {
+            PrintMes(RGY_LOG_ERROR, m_pFileWriter->GetOutputMessage());
+            return err_to_mfx(ret);
+        }
+        PrintMes(RGY_LOG_DEBUG, _T("Output: Initialized output override.\n"));
+#if ENABLE_AVSW_READER
+        //--ladderでは、音声は前処理側で1回だけエンコードし、各段の出力にコピーする
+        auto pLadderWriter = std::dynamic_pointer_cast<RGYOutputLadder>(m_pFileWriter);
+        if (pLadderWriter && pParams->nAudioSelectCount > 0) {
+            shared_ptr<RGYOutput> pAudioWriter;
+            ret = pLadderWriter->InitAudio(pParams, std::dynamic_pointer_cast<RGYInputAvcodec>(m_pFileReader), m_trimParam, pAudioWriter);
+            if (ret != RGY_ERR_NONE) {
+                return err_to_mfx(ret);
+            }
+            if (pAudioWriter) {
+                m_pFileWriterListAudio.push_back(pAudioWriter);
+                PrintMes(RGY_LOG_DEBUG, _T("Output: Initialized audio output for ladder.\n"));
+            }
+        }
+#endif //#if ENABLE_AVSW_READER
+        return MFX_ERR_NONE;
+    }
 #if ENABLE_AVSW_READER
     vector<int> streamTrackUsed; //使用した音声/字幕のトラックIDを保存する
     bool useH264ESOutput =
@@ -2334,6 +2476,13 @@ mfxStatus CQSVPipeline::InitOutput(sInputParams *pParams) {
         writerPrm.nOutputThread = pParams->nOutputThread;
         writerPrm.nAudioThread  = pParams->nAudioThread;
         writerPrm.nBufSizeMB = pParams->nOutputBufSizeMB;
+        writerPrm.nAudioQueueSize = pParams->nAudioQueueSize;
+        if (pParams->bOutputPrealloc) {
+            writerPrm.nPreallocSize = estimateOutputFileSize(m_mfxEncParams, m_pFileReader->GetInputFrameInfo().frames, m_trimParam);
+            if (writerPrm.nPreallocSize <= 0) {
+                PrintMes(RGY_LOG_WARN, _T("--output-prealloc is ignored, as the output size could not be estimated (requires bitrate mode and known frame count).\n"));
+            }
+        }
         writerPrm.nAudioResampler = pParams->nAudioResampler;
         writerPrm.pVidTimestamp = &m_outputTimestamp;
         writerPrm.nAudioIgnoreDecodeError = pParams->nAudioIgnoreDecodeError;
@@ -2341,6 +2490,8 @@ mfxStatus CQSVPipeline::InitOutput(sInputParams *pParams) {
         writerPrm.pQueueInfo = (m_pPerfMonitor) ? m_pPerfMonitor->GetQueueInfoPtr() : nullptr;
         writerPrm.pMuxVidTsLogFile = pParams->pMuxVidTsLogFile;
         writerPrm.videoCodecTag = (pParams->videoCodecTag) ? pParams->videoCodecTag : "";
+        writerPrm.fSegmentSec = pParams->fHLSTime;
+        writerPrm.fSegmentMaxSec = qsv_hls_segment_max_sec(pParams, m_mfxEncParams);
         if (pParams->pMuxOpt) {
             writerPrm.vMuxOpt = *pParams->pMuxOpt;
         }
@@ -2366,6 +2517,11 @@ mfxStatus CQSVPipeline::InitOutput(sInputParams *pParams) {
             writerPrm.pVideoInputStream = pAVCodecReader->GetInputVideoStream();
             writerPrm.pHEVCHdrSei = &hedrsei;
         }
+        auto pLadderReader = std::dynamic_pointer_cast<RGYInputLadder>(m_pFileReader);
+        if (pLadderReader) {
+            //--ladderの各段では、前処理側でエンコードした音声をコピーする
+            writerPrm.passthroughStreamList = pLadderReader->hub()->audioStreams();
+        }
         if (pParams->nAVMux & (RGY_MUX_AUDIO | RGY_MUX_SUBTITLE)) {
             PrintMes(RGY_LOG_DEBUG, _T("Output: Audio/Subtitle muxing enabled.\n"));
             pAVCodecReader = std::dynamic_pointer_cast<RGYInputAvcodec>(m_pFileReader);
@@ -2451,6 +2607,9 @@ mfxStatus CQSVPipeline::InitOutput(sInputParams *pParams) {
         } else if (pParams->nAVMux & (RGY_MUX_AUDIO | RGY_MUX_SUBTITLE)) {
             m_pFileWriterListAudio.push_back(m_pFileWriter);
         }
+        if (pLadderReader && writerPrm.passthroughStreamList.size() > 0) {
+            pLadderReader->hub()->addAudioWriter(std::dynamic_pointer_cast<RGYOutputAvcodec>(m_pFileWriter));
+        }
         stdoutUsed = m_pFileWriter->outputStdout();
         PrintMes(RGY_LOG_DEBUG, _T("Output: Initialized avformat writer%s.\n"), (stdoutUsed) ? _T("using stdout") : _T(""));
     } else if (pParams->nAVMux & (RGY_MUX_AUDIO | RGY_MUX_SUBTITLE)) {
@@ -2535,6 +2694,7 @@ mfxStatus CQSVPipeline::InitOutput(sInputParams *pParams) {
                 writerAudioPrm.nOutputThread   = pParams->nOutputThread;
                 writerAudioPrm.nAudioThread    = pParams->nAudioThread;
                 writerAudioPrm.nBufSizeMB      = pParams->nOutputBufSizeMB;
+                writerAudioPrm.nAudioQueueSize = pParams->nAudioQueueSize;
                 writerAudioPrm.pOutputFormat   = pAudioSelect->pAudioExtractFormat;
                 writerAudioPrm.nAudioIgnoreDecodeError = pParams->nAudioIgnoreDecodeError;
                 writerAudioPrm.nAudioResampler = pParams->nAudioResampler;
@@ -2562,6 +2722,134 @@ mfxStatus CQSVPipeline::InitOutput(sInputParams *pParams) {
         }
     }
 #endif //ENABLE_AVSW_READER
+    if (pParams->nTeeCount > 0) {
+        auto sts = InitOutputTee(pParams, &outputVideoInfo, &hedrsei);
+        if (sts != MFX_ERR_NONE) {
+            return sts;
+        }
+    }
+    return MFX_ERR_NONE;
+}
+
+mfxStatus CQSVPipeline::InitOutputTee(sInputParams *pParams, const VideoInfo *pOutputVideoInfo, HEVCHDRSei *pHdrSei) {
+    if (pParams->CodecId == MFX_CODEC_RAW) {
+        PrintMes(RGY_LOG_ERROR, _T("--tee cannot be used with raw output.\n"));
+        return MFX_ERR_UNSUPPORTED;
+    }
+    RGY_ERR ret = RGY_ERR_NONE;
+    RGYOutputTeePrm teePrm;
+    teePrm.primary = m_pFileWriter;
+    teePrm.nQueueSize = 0;
+#if ENABLE_AVSW_READER
+    //主出力の音声は、そのまま副出力にコピーする
+    auto pAVCodecPrimary = std::dynamic_pointer_cast<RGYOutputAvcodec>(m_pFileWriter);
+    vector<shared_ptr<RGYOutputAvcodec>> audioTeeTargets;
+#endif //#if ENABLE_AVSW_READER
+    for (int i = 0; i < pParams->nTeeCount; i++) {
+        const TCHAR *strTeeFile = pParams->ppTeeList[i];
+        if (_tcscmp(strTeeFile, pParams->strDstFile) == 0) {
+            PrintMes(RGY_LOG_ERROR, _T("--tee: \"%s\" is the same as the output file.\n"), strTeeFile);
+            return MFX_ERR_INVALID_VIDEO_PARAM;
+        }
+        shared_ptr<RGYOutput> pWriter;
+#if ENABLE_AVSW_READER
+        const bool useESOutput =
+            (PathFindExtension(strTeeFile) == nullptr || PathFindExtension(strTeeFile)[0] != '.') //拡張子がない
+            || check_ext(strTeeFile, { ".m2v", ".264", ".h264", ".avc", ".avc1", ".x264", ".265", ".h265", ".hevc" }); //特定の拡張子
+        if (!useESOutput) {
+            if (pParams->CodecId == MFX_CODEC_VP8 || pParams->CodecId == MFX_CODEC_VP9) {
+                PrintMes(RGY_LOG_ERROR, _T("Output: muxing not supported with %s.\n"), CodecIdToStr(pParams->CodecId));
+                return MFX_ERR_UNSUPPORTED;
+            }
+            AvcodecWriterPrm writerPrm;
+            writerPrm.trimList = m_trimParam.list;
+            writerPrm.nOutputThread = pParams->nOutputThread;
+            writerPrm.nBufSizeMB = pParams->nOutputBufSizeMB;
+            writerPrm.pVidTimestamp = &m_outputTimestamp;
+            writerPrm.bVideoDtsUnavailable = !check_lib_version(m_mfxVer, MFX_LIB_VERSION_1_6);
+            writerPrm.videoCodecTag = (pParams->videoCodecTag) ? pParams->videoCodecTag : "";
+            writerPrm.fSegmentSec = pParams->fHLSTime;
+            writerPrm.fSegmentMaxSec = qsv_hls_segment_max_sec(pParams, m_mfxEncParams);
+            if (pParams->pMuxOpt) {
+                writerPrm.vMuxOpt = *pParams->pMuxOpt;
+            }
+            auto pAVCodecReader = std::dynamic_pointer_cast<RGYInputAvcodec>(m_pFileReader);
+            if (pAVCodecReader != nullptr) {
+                writerPrm.pInputFormatMetadata = pAVCodecReader->GetInputFormatMetadata();
+                if (pParams->pChapterFile) {
+                    //チャプターファイルは主出力がmuxしない場合には、まだ読み込まれていない
+                    if (m_AVChapterFromFile.size() == 0 && MFX_ERR_NONE != readChapterFile(pParams->pChapterFile)) {
+                        return MFX_ERR_UNKNOWN;
+                    }
+                    for (uint32_t j = 0; j < m_AVChapterFromFile.size(); j++) {
+                        writerPrm.chapterList.push_back(m_AVChapterFromFile[j].get());
+                    }
+                    writerPrm.bChapterNoTrim = pParams->bChapterNoTrim != 0;
+                } else {
+                    writerPrm.chapterList = pAVCodecReader->GetChapterList();
+                }
+                writerPrm.nVideoInputFirstKeyPts = pAVCodecReader->GetVideoFirstKeyPts();
+                writerPrm.pVideoInputStream = pAVCodecReader->GetInputVideoStream();
+                writerPrm.pHEVCHdrSei = pHdrSei;
+            }
+            if (pAVCodecPrimary) {
+                //主出力のパケットのタイムスタンプは映像の先頭を0としたものなので、オフセットは不要
+                for (const auto pStream : pAVCodecPrimary->GetAudioOutputStreams()) {
+                    AVPassthroughStreamPrm prm;
+                    prm.pStream = pStream;
+                    prm.nPtsOffset = 0;
+                    writerPrm.passthroughStreamList.push_back(prm);
+                }
+            }
+            auto pAVCodecWriter = std::make_shared<RGYOutputAvcodec>();
+            pWriter = pAVCodecWriter;
+            //エンコードの統計は主出力でのみ集計する
+            ret = pWriter->Init(strTeeFile, pOutputVideoInfo, &writerPrm, m_pQSVLog, std::make_shared<EncodeStatus>());
+            if (ret != RGY_ERR_NONE) {
+                PrintMes(RGY_LOG_ERROR, pWriter->GetOutputMessage());
+                return err_to_mfx(ret);
+            }
+            if (writerPrm.passthroughStreamList.size() > 0) {
+                audioTeeTargets.push_back(pAVCodecWriter);
+            }
+            PrintMes(RGY_LOG_DEBUG, _T("Output: Initialized avformat writer for tee output \"%s\".\n"), strTeeFile);
+        } else {
+#endif //#if ENABLE_AVSW_READER
+            pWriter = std::make_shared<RGYOutputRaw>();
+            RGYOutputRawPrm rawPrm = { 0 };
+            rawPrm.bBenchmark = false;
+            rawPrm.nBufSizeMB = pParams->nOutputBufSizeMB;
+            rawPrm.codecId = codec_enc_to_rgy(pParams->CodecId);
+            rawPrm.seiNal = pHdrSei->gen_nal();
+            ret = pWriter->Init(strTeeFile, pOutputVideoInfo, &rawPrm, m_pQSVLog, std::make_shared<EncodeStatus>());
+            if (ret != RGY_ERR_NONE) {
+                PrintMes(RGY_LOG_ERROR, pWriter->GetOutputMessage());
+                return err_to_mfx(ret);
+            }
+            PrintMes(RGY_LOG_DEBUG, _T("Output: Initialized bitstream writer for tee output \"%s\".\n"), strTeeFile);
+#if ENABLE_AVSW_READER
+        }
+#endif //#if ENABLE_AVSW_READER
+        teePrm.secondaries.push_back(pWriter);
+    }
+#if ENABLE_AVSW_READER
+    if (pAVCodecPrimary && audioTeeTargets.size() > 0) {
+        pAVCodecPrimary->SetPacketTee([audioTeeTargets](const AVPacket *pkt, AVRational timebase) {
+            for (const auto& target : audioTeeTargets) {
+                target->WritePassthroughPacket(pkt, timebase);
+            }
+        });
+    }
+#endif //#if ENABLE_AVSW_READER
+
+    shared_ptr<RGYOutput> pTeeWriter = std::make_shared<RGYOutputTee>();
+    ret = pTeeWriter->Init(pParams->strDstFile, pOutputVideoInfo, &teePrm, m_pQSVLog, m_pEncSatusInfo);
+    if (ret != RGY_ERR_NONE) {
+        PrintMes(RGY_LOG_ERROR, pTeeWriter->GetOutputMessage());
+        return err_to_mfx(ret);
+    }
+    m_pFileWriter = pTeeWriter;
+    PrintMes(RGY_LOG_DEBUG, _T("Output: Initialized tee output to %d files.\n"), pParams->nTeeCount);
     return MFX_ERR_NONE;
 }
 
@@ -2649,7 +2937,11 @@ mfxStatus CQSVPipeline::InitInput(sInputParams *pParams) {
 
     //まずavs or vpy readerをためす
     m_pFileReader = nullptr;
-    if (   inputVideo.type == RGY_INPUT_FMT_VPY
+    if (m_pFileReaderOverride) {
+        m_pFileReader = m_pFileReaderOverride;
+        ret = m_pFileReader->Init(pParams->strSrcFile, &inputVideo, nullptr, m_pQSVLog, m_pEncSatusInfo);
+        PrintMes(RGY_LOG_DEBUG, _T("Input: using input override.\n"));
+    } else if (   inputVideo.type == RGY_INPUT_FMT_VPY
         || inputVideo.type == RGY_INPUT_FMT_VPY_MT
         || inputVideo.type == RGY_INPUT_FMT_AVS) {
         if (inputVideo.type == RGY_INPUT_FMT_VPY || inputVideo.type == RGY_INPUT_FMT_VPY_MT) {
@@ -2728,6 +3020,8 @@ mfxStatus CQSVPipeline::InitInput(sInputParams *pParams) {
                 avcodecReaderPrm.pLogCopyFrameData = pParams->pLogCopyFrameData;
                 avcodecReaderPrm.pHWDecCodecCsp = &HWDecCodecCsp;
                 avcodecReaderPrm.bVideoDetectPulldown = pParams->nAVSyncMode == RGY_AVSYNC_ASSUME_CFR;
+                //GPUメモリの場合は、サーフェスをLockして得たバッファへの書き込みが必要なので、システムメモリの場合のみ
+                avcodecReaderPrm.bZeroCopyFrame = pParams->memType == SYSTEM_MEMORY;
                 avcodecReaderPrm.caption2ass = pParams->caption2ass;
                 input_option = &avcodecReaderPrm;
                 PrintMes(RGY_LOG_DEBUG, _T("Input: avhw/avsw reader selected.\n"));
@@ -2775,7 +3069,8 @@ mfxStatus CQSVPipeline::InitInput(sInputParams *pParams) {
             avcodecReaderPrm.nProcSpeedLimit = pParams->nProcSpeedLimit;
             avcodecReaderPrm.nAVSyncMode = RGY_AVSYNC_ASSUME_CFR;
             avcodecReaderPrm.fSeekSec = pParams->fSeekSec;
-            avcodecReaderPrm.nInputThread = 0;
+            //音声ファイルは、それぞれ専用のスレッドで映像と並行して読み込む
+            avcodecReaderPrm.nInputThread = 1;
             avcodecReaderPrm.pQueueInfo = nullptr;
 
             unique_ptr<RGYInput> audioReader(new RGYInputAvcodec());
@@ -3058,7 +3353,9 @@ mfxStatus CQSVPipeline::CheckParam(sInputParams *pParams) {
     if (m_pFileReader->getInputCodec() != RGY_CODEC_UNKNOWN) {
         pParams->nInputBufSize = 1;
         //Haswell以前はHEVCデコーダを使用する場合はD3D11メモリを使用しないと正常に稼働しない (4080ドライバ)
-        if (getCPUGen(&m_mfxSession) <= CPU_GEN_HASWELL && m_pFileReader->getInputCodec() == RGY_CODEC_HEVC) {
+        //sessionを並行して初期化していれば、CPUの世代はそのsessionから取得する
+        //HEVCの場合のみ必要なので、先にコーデックを判定し、不要なsessionの作成を避ける
+        if (m_pFileReader->getInputCodec() == RGY_CODEC_HEVC && GetCPUGen() <= CPU_GEN_HASWELL) {
             if (pParams->memType & D3D9_MEMORY) {
                 pParams->memType &= ~D3D9_MEMORY;
                 pParams->memType |= D3D11_MEMORY;
@@ -3084,6 +3381,16 @@ mfxStatus CQSVPipeline::CheckParam(sInputParams *pParams) {
     return MFX_ERR_NONE;
 }
 
+int CQSVPipeline::GetCPUGen() {
+    if (m_nCPUGen < 0) {
+        //sessionが未初期化の場合は、getCPUGenが一時的なsessionを作成して取得する
+        m_nCPUGen = getCPUGen(m_mfxSession.get());
+        PrintMes(RGY_LOG_DEBUG, _T("GetCPUGen: %d (%s).\n"), m_nCPUGen,
+            (m_mfxSession && (mfxSession)(*m_mfxSession)) ? _T("from current session") : _T("from temporary session"));
+    }
+    return m_nCPUGen;
+}
+
 mfxStatus CQSVPipeline::InitSessionInitParam(mfxU16 threads, mfxU16 priority) {
     INIT_MFX_EXT_BUFFER(m_ThreadsParam, MFX_EXTBUFF_THREADS_PARAM);
     m_ThreadsParam.NumThread = (mfxU16)clamp_param_int(threads, 0, QSV_SESSION_THREAD_MAX, _T("session-threads"));
@@ -3118,7 +3425,30 @@ void __stdcall GetSystemInfoHook(LPSYSTEM_INFO lpSystemInfo) {
 mfxStatus CQSVPipeline::InitSession(bool useHWLib, mfxU16 memType) {
     mfxStatus sts = MFX_ERR_NONE;
     m_SessionPlugins.reset();
-    m_mfxSession.Close();
+    if (m_mfxSession) {
+        m_mfxSession->Close();
+    }
+    if (m_swSessionPrm.enable) {
+        //GPUを使用せず、ソフトウェアによる代替実装で処理する
+        //デコード時にDecodeHeaderで返すフレーム情報は、readerの情報から作成する
+        auto decFrameInfo = frameinfo_rgy_to_enc(m_pFileReader->GetInputFrameInfo());
+        decFrameInfo.CropX = 0;
+        decFrameInfo.CropY = 0;
+        decFrameInfo.CropW = decFrameInfo.Width;
+        decFrameInfo.CropH = decFrameInfo.Height;
+        decFrameInfo.Width  = (mfxU16)ALIGN16(decFrameInfo.Width);
+        decFrameInfo.Height = (mfxU16)((decFrameInfo.PicStruct & MFX_PICSTRUCT_PROGRESSIVE) ? ALIGN16(decFrameInfo.Height) : ALIGN32(decFrameInfo.Height));
+        m_mfxSession.reset(new QSVSWSession(m_swSessionPrm, decFrameInfo));
+        sts = m_mfxSession->Init(MFX_IMPL_SOFTWARE, nullptr);
+        m_memType = SYSTEM_MEMORY;
+        m_mfxSession->QueryVersion(&m_mfxVer);
+        PrintMes(RGY_LOG_DEBUG, _T("InitSession: initialized sw session: async depth %d, busy interval %d, reorder delay %d, task duration %d us.\n"),
+            m_swSessionPrm.asyncDepth, m_swSessionPrm.busyInterval, m_swSessionPrm.reorderDelay, m_swSessionPrm.taskDurationUs);
+        return sts;
+    }
+    if (!m_mfxSession) {
+        m_mfxSession.reset(new MFXVideoSession());
+    }
     PrintMes(RGY_LOG_DEBUG, _T("InitSession: Start initilaizing... memType: %s\n"), MemTypeToStr(memType));
 #if defined(_WIN32) || defined(_WIN64)
     //コードの簡略化のため、静的フィールドを使うので、念のためロックをかける
@@ -3138,7 +3468,7 @@ mfxStatus CQSVPipeline::InitSession(bool useHWLib, mfxU16 memType) {
                     if (useHWLib) {
                         m_InitParam.GPUCopy = MFX_GPUCOPY_ON;
                     }
-                    if (MFX_ERR_NONE == m_mfxSession.InitEx(m_InitParam)) {
+                    if (MFX_ERR_NONE == m_mfxSession->InitEx(m_InitParam)) {
                         return MFX_ERR_NONE;
                     } else {
                         m_ThreadsParam.NumThread = 0;
@@ -3146,7 +3476,7 @@ mfxStatus CQSVPipeline::InitSession(bool useHWLib, mfxU16 memType) {
                     }
                 }
 #endif
-                return m_mfxSession.Init(impl, verRequired);
+                return m_mfxSession->Init(impl, verRequired);
             };
 
             if (useHWLib) {
@@ -3190,7 +3520,7 @@ mfxStatus CQSVPipeline::InitSession(bool useHWLib, mfxU16 memType) {
                     //MFX_IMPL_HARDWARE_ANYがサポートされない場合もあり得るので、失敗したらこれをオフにしてもう一回試す
                     if (MFX_ERR_NONE != sts) {
                         PrintMes(RGY_LOG_DEBUG, _T("InitSession: failed to init session for multi GPU mode, retry by single GPU mode.\n"));
-                        sts = m_mfxSession.Init((impl & (~MFX_IMPL_HARDWARE_ANY)) | MFX_IMPL_HARDWARE, &verRequired);
+                        sts = m_mfxSession->Init((impl & (~MFX_IMPL_HARDWARE_ANY)) | MFX_IMPL_HARDWARE, &verRequired);
                     }
 
                     //成功したらループを出る
@@ -3212,7 +3542,7 @@ mfxStatus CQSVPipeline::InitSession(bool useHWLib, mfxU16 memType) {
 #endif
 
     //使用できる最大のversionをチェック
-    m_mfxSession.QueryVersion(&m_mfxVer);
+    m_mfxSession->QueryVersion(&m_mfxVer);
     PrintMes(RGY_LOG_DEBUG, _T("InitSession: mfx lib version: %d.%d\n"), m_mfxVer.Major, m_mfxVer.Minor);
     return sts;
 }
@@ -3234,6 +3564,22 @@ mfxStatus CQSVPipeline::Init(sInputParams *pParams) {
     InitLog(pParams);
 
     mfxStatus sts = MFX_ERR_NONE;
+    const auto queryStatsStart = QSVQueryCache::get().stats();
+
+    //初期化の各段階の所要時間を計測し、ログに出力する
+    //並行して実行する段階もあるので、記録はロックして行う
+    const auto initStart = std::chrono::steady_clock::now();
+    std::mutex mtxInitPhase;
+    std::vector<std::pair<tstring, double>> initPhaseTimes;
+    auto initPhase = [&](const TCHAR *name, std::function<mfxStatus()> func) {
+        const auto start = std::chrono::steady_clock::now();
+        const auto ret = func();
+        const double ms = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count() * 1e-3;
+        PrintMes(RGY_LOG_DEBUG, _T("Init: %s: %.1f ms.\n"), name, ms);
+        std::lock_guard<std::mutex> lock(mtxInitPhase);
+        initPhaseTimes.push_back(std::make_pair(tstring(name), ms));
+        return ret;
+    };
 
     if (pParams->bBenchmark) {
         pParams->nAVMux = RGY_MUX_NONE;
@@ -3262,11 +3608,23 @@ mfxStatus CQSVPipeline::Init(sInputParams *pParams) {
         PrintMes(RGY_LOG_DEBUG, _T("Param adjusted for benchmark mode.\n"));
     }
 
+    //ソフトウェアによるsessionの代替実装はシステムメモリのみ対応
+    m_swSessionPrm = pParams->swSession;
+    if (m_swSessionPrm.enable) {
+        PrintMes(RGY_LOG_WARN, _T("--sw-session is set, GPU will not be used and the output will not be a valid video stream.\n"));
+        pParams->memType = SYSTEM_MEMORY;
+    }
+
     //メモリの指定が自動の場合、出力コーデックがrawなら、systemメモリを自動的に使用する
     if (HW_MEMORY == (pParams->memType & HW_MEMORY) && pParams->CodecId == MFX_CODEC_RAW) {
         PrintMes(RGY_LOG_DEBUG, _T("Automatically selecting system memory for output raw frames.\n"));
         pParams->memType = SYSTEM_MEMORY;
     }
+    //各スレッドは開始時にRGYThreadAffinity::apply()を呼び、自身の役割の設定を適用する
+    RGYThreadAffinity::get().init(pParams->threadAffinity, m_pQSVLog);
+    if (RGYThreadAffinity::get().enabled()) {
+        PrintMes(RGY_LOG_DEBUG, _T("thread affinity: %s\n"), RGYThreadAffinity::get().summary().c_str());
+    }
     if (true) {
         m_pPerfMonitor = std::unique_ptr<CPerfMonitor>(new CPerfMonitor());
         const bool bLogOutput = pParams->nPerfMonitorSelect || pParams->nPerfMonitorSelectMatplot;
@@ -3274,17 +3632,24 @@ mfxStatus CQSVPipeline::Init(sInputParams *pParams) {
         if (bLogOutput) {
             perfMonLog = tstring(pParams->strDstFile) + _T("_perf.csv");
         }
-        if (m_pPerfMonitor->init(perfMonLog.c_str(), pParams->pPythonPath, (bLogOutput) ? pParams->nPerfMonitorInterval : 1000,
+        CPerfMonitorPrm perfMonitorPrm;
+        memset(&perfMonitorPrm, 0, sizeof(perfMonitorPrm));
+        perfMonitorPrm.metricsSocket = pParams->pMetricsSocket;
+        if (m_pPerfMonitor->init(perfMonLog.c_str(), pParams->pPythonPath, (bLogOutput || pParams->pMetricsSocket) ? pParams->nPerfMonitorInterval : 1000,
             (int)pParams->nPerfMonitorSelect, (int)pParams->nPerfMonitorSelectMatplot,
 #if defined(_WIN32) || defined(_WIN64)
             std::unique_ptr<void, handle_deleter>(OpenThread(SYNCHRONIZE | THREAD_QUERY_INFORMATION, false, GetCurrentThreadId()), handle_deleter()),
 #else
             nullptr,
 #endif
-            m_pQSVLog, nullptr)) {
+            m_pQSVLog, &perfMonitorPrm)) {
             PrintMes(RGY_LOG_WARN, _T("Failed to initialize performance monitor, disabled.\n"));
             m_pPerfMonitor.reset();
         }
+        if (pParams->pMetricsSocket && (!m_pPerfMonitor || !m_pPerfMonitor->GetStageLatencyPtr())) {
+            PrintMes(RGY_LOG_ERROR, _T("Failed to start --metrics-socket.\n"));
+            return MFX_ERR_UNSUPPORTED;
+        }
     }
 
     m_nMFXThreads = pParams->nSessionThreads;
@@ -3293,47 +3658,75 @@ mfxStatus CQSVPipeline::Init(sInputParams *pParams) {
     sts = InitSessionInitParam(pParams->nSessionThreads, pParams->nSessionThreadPriority);
     if (sts < MFX_ERR_NONE) return sts;
 
-    sts = InitInput(pParams);
+    //sessionの初期化は入力ファイルの情報を必要としないので、入力の初期化と並行して行う
+    //入力の確認の結果memTypeが変更された場合には、sessionの初期化をやり直す
+    //  - ソフトウェアによる代替実装のsessionは、入力の情報を使用するので並行できない
+    //  - sessionのスレッド数を指定した場合、InitSession中のGetSystemInfoのフックが
+    //    入力側のスレッドにも影響してしまうので並行しない
+    const bool initSessionAsync = !m_swSessionPrm.enable && m_nMFXThreads <= 0;
+    const auto memTypeAsync = pParams->memType;
+    std::future<mfxStatus> thInitSession;
+    if (initSessionAsync) {
+        thInitSession = std::async(std::launch::async, [&, memTypeAsync]() {
+            return initPhase(_T("InitSession"), [&]() { return InitSession(true, memTypeAsync); });
+        });
+    }
+    sts = initPhase(_T("InitInput"), [&]() { return InitInput(pParams); });
+    mfxStatus stsSession = (initSessionAsync) ? thInitSession.get() : MFX_ERR_NONE;
     if (sts < MFX_ERR_NONE) return sts;
 
-    sts = CheckParam(pParams);
+    sts = initPhase(_T("CheckParam"), [&]() { return CheckParam(pParams); });
     if (sts != MFX_ERR_NONE) return sts;
 
     sts = m_EncThread.Init(pParams->nInputBufSize);
     QSV_ERR_MES(sts, _T("Failed to allocate memory for thread control."));
 
-    sts = InitSession(true, pParams->memType);
+    if (!initSessionAsync || pParams->memType != memTypeAsync) {
+        if (initSessionAsync) {
+            PrintMes(RGY_LOG_DEBUG, _T("memType changed (%s -> %s), re-initializing session.\n"), MemTypeToStr(memTypeAsync), MemTypeToStr(pParams->memType));
+        }
+        stsSession = initPhase(_T("InitSession"), [&]() { return InitSession(true, pParams->memType); });
+    }
+    sts = stsSession;
     QSV_ERR_MES(sts, _T("Failed to initialize encode session."));
 
-    m_SessionPlugins = std::unique_ptr<CSessionPlugins>(new CSessionPlugins(m_mfxSession));
+    if (!m_swSessionPrm.enable) {
+        m_SessionPlugins = std::unique_ptr<CSessionPlugins>(new CSessionPlugins(*m_mfxSession));
+    }
 
-    sts = CreateAllocator();
+    sts = initPhase(_T("CreateAllocator"), [&]() { return CreateAllocator(); });
     if (sts < MFX_ERR_NONE) return sts;
 
-    sts = InitMfxDecParams(pParams);
+    sts = initPhase(_T("InitMfxDecParams"), [&]() { return InitMfxDecParams(pParams); });
     if (sts < MFX_ERR_NONE) return sts;
 
-    sts = InitMfxEncParams(pParams);
+    sts = initPhase(_T("InitMfxEncParams"), [&]() { return InitMfxEncParams(pParams); });
     if (sts < MFX_ERR_NONE) return sts;
 
-    sts = InitMfxVppParams(pParams);
+    sts = initPhase(_T("InitMfxVppParams"), [&]() { return InitMfxVppParams(pParams); });
     if (sts < MFX_ERR_NONE) return sts;
 
-    sts = CreateVppExtBuffers(pParams);
+    sts = initPhase(_T("CreateVppExtBuffers"), [&]() { return CreateVppExtBuffers(pParams); });
     if (sts < MFX_ERR_NONE) return sts;
 
-    sts = InitVppPrePlugins(pParams);
+    sts = initPhase(_T("InitVppPrePlugins"), [&]() { return InitVppPrePlugins(pParams); });
     if (sts < MFX_ERR_NONE) return sts;
 
-    sts = InitVppPostPlugins(pParams);
+    sts = initPhase(_T("InitVppPostPlugins"), [&]() { return InitVppPostPlugins(pParams); });
     if (sts < MFX_ERR_NONE) return sts;
 
-    sts = InitOutput(pParams);
-    if (sts < MFX_ERR_NONE) return sts;
+    //出力の初期化 (muxerのオープン、音声エンコーダの初期化など) は、
+    //MFXコンポーネントの作成・フレームの確保と並行して行う
+    //  - InitOutputはm_mfxEncParams/m_mfxVppParams.vpp.Outを読むだけで、これらはフレームの確保では変更されない
+    //  - MFXコンポーネントのInitは一時的にログレベルを変更するので、その前に出力の初期化を待つ
+    //  - 以降でエラーによりreturnした場合も、futureのデストラクタで出力の初期化の終了を待つ
+    auto thInitOutput = std::async(std::launch::async, [&]() {
+        return initPhase(_T("InitOutput"), [&]() { return InitOutput(pParams); });
+    });
 
     //encの作成 (raw出力の場合はエンコードしないので不要)
     if (pParams->CodecId != MFX_CODEC_RAW) {
-        m_pmfxENC.reset(new MFXVideoENCODE(m_mfxSession));
+        m_pmfxENC.reset(qsv_create_encode(m_mfxSession.get()));
         if (!m_pmfxENC) {
             return MFX_ERR_MEMORY_ALLOC;
         }
@@ -3349,7 +3742,7 @@ mfxStatus CQSVPipeline::Init(sInputParams *pParams) {
         || m_mfxVppParams.NumExtParam > 1
         || pParams->vpp.deinterlace) {
         PrintMes(RGY_LOG_DEBUG, _T("Vpp Enabled...\n"));
-        m_pmfxVPP.reset(new MFXVideoVPP(m_mfxSession));
+        m_pmfxVPP.reset(qsv_create_vpp(m_mfxSession.get()));
         if (!m_pmfxVPP) {
             return MFX_ERR_MEMORY_ALLOC;
         }
@@ -3391,9 +3784,42 @@ mfxStatus CQSVPipeline::Init(sInputParams *pParams) {
     }
 #endif //#if defined(_WIN32) || defined(_WIN64)
 
-    sts = ResetMFXComponents(pParams);
+    //機能の問い合わせにかかった時間
+    const auto queryStats = QSVQueryCache::get().stats();
+    PrintMes(RGY_LOG_DEBUG, _T("feature query: %d cached (%.1f ms, %.1f ms saved), %d queried (%.1f ms).\n"),
+        queryStats.hit - queryStatsStart.hit, queryStats.hitMs - queryStatsStart.hitMs, queryStats.savedMs - queryStatsStart.savedMs,
+        queryStats.miss - queryStatsStart.miss, queryStats.missMs - queryStatsStart.missMs);
+    if (queryStats.miss > queryStatsStart.miss) {
+        if (QSVQueryCache::get().save()) {
+            PrintMes(RGY_LOG_DEBUG, _T("feature query cache saved to %s.\n"), QSVQueryCache::get().filename().c_str());
+        } else {
+            PrintMes(RGY_LOG_DEBUG, _T("failed to save feature query cache to %s.\n"), QSVQueryCache::get().filename().c_str());
+        }
+    }
+
+    sts = initPhase(_T("AllocFrames"), [&]() {
+        auto ret = CloseMFXComponents();
+        return (ret < MFX_ERR_NONE) ? ret : AllocFrames();
+    });
+    if (sts < MFX_ERR_NONE) return sts;
+
+    sts = thInitOutput.get();
+    if (sts < MFX_ERR_NONE) return sts;
+
+    sts = initPhase(_T("InitMFXComponents"), [&]() { return InitMFXComponents(); });
+    if (sts < MFX_ERR_NONE) return sts;
+
+    sts = initPhase(_T("InitTaskPool"), [&]() { return InitTaskPool(); });
     if (sts < MFX_ERR_NONE) return sts;
 
+    const double initTotalMs = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - initStart).count() * 1e-3;
+    double initPhaseSumMs = 0.0;
+    for (const auto& phase : initPhaseTimes) {
+        initPhaseSumMs += phase.second;
+    }
+    PrintMes(RGY_LOG_DEBUG, _T("Init: total %.1f ms (sum of phases %.1f ms, at least %.1f ms overlapped).\n"),
+        initTotalMs, initPhaseSumMs, (std::max)(0.0, initPhaseSumMs - initTotalMs));
+
     return MFX_ERR_NONE;
 }
 
@@ -3438,7 +3864,9 @@ void CQSVPipeline::Close() {
     m_TaskPool.Close();
 
     PrintMes(RGY_LOG_DEBUG, _T("Closing mfxSession...\n"));
-    m_mfxSession.Close();
+    if (m_mfxSession) {
+        m_mfxSession->Close();
+    }
 
     PrintMes(RGY_LOG_DEBUG, _T("DeleteFrames...\n"));
     DeleteFrames();
@@ -3481,8 +3909,10 @@ void CQSVPipeline::Close() {
 
     PrintMes(RGY_LOG_DEBUG, _T("Closing perf monitor...\n"));
     m_pPerfMonitor.reset();
+    RGYThreadAffinity::get().close();
 
     m_nMFXThreads = -1;
+    m_nCPUGen = -1;
     m_pAbortByUser = NULL;
     m_nAVSyncMode = RGY_AVSYNC_ASSUME_CFR;
     m_nProcSpeedLimit = 0;
@@ -3501,9 +3931,23 @@ mfxStatus CQSVPipeline::ResetMFXComponents(sInputParams* pParams) {
         return MFX_ERR_NULL_PTR;
     }
 
-    mfxStatus sts = MFX_ERR_NONE;
     PrintMes(RGY_LOG_DEBUG, _T("ResetMFXComponents: Start...\n"));
 
+    mfxStatus sts = CloseMFXComponents();
+    if (sts < MFX_ERR_NONE) return sts;
+
+    sts = AllocFrames();
+    if (sts < MFX_ERR_NONE) return sts;
+    PrintMes(RGY_LOG_DEBUG, _T("ResetMFXComponents: Frames allocated.\n"));
+
+    sts = InitMFXComponents();
+    if (sts < MFX_ERR_NONE) return sts;
+
+    return InitTaskPool();
+}
+
+mfxStatus CQSVPipeline::CloseMFXComponents() {
+    mfxStatus sts = MFX_ERR_NONE;
     if (m_pmfxENC) {
         sts = m_pmfxENC->Close();
         QSV_IGNORE_STS(sts, MFX_ERR_NOT_INITIALIZED);
@@ -3530,11 +3974,11 @@ mfxStatus CQSVPipeline::ResetMFXComponents(sInputParams* pParams) {
     PrintMes(RGY_LOG_DEBUG, _T("ResetMFXComponents: Frames deleted.\n"));
 
     m_TaskPool.Close();
+    return MFX_ERR_NONE;
+}
 
-    sts = AllocFrames();
-    if (sts < MFX_ERR_NONE) return sts;
-    PrintMes(RGY_LOG_DEBUG, _T("ResetMFXComponents: Frames allocated.\n"));
-
+mfxStatus CQSVPipeline::InitMFXComponents() {
+    mfxStatus sts = MFX_ERR_NONE;
     //MediaSDK内のエラーをRGY_LOG_DEBUG以下の時以外には一時的に無視するようにする。
     //RGY_LOG_DEBUG以下の時にも、「無視できるエラーが発生するかもしれない」ことをログに残す。
     auto logIgnoreMFXLibraryInternalErrors = [this]() {
@@ -3592,11 +4036,20 @@ mfxStatus CQSVPipeline::ResetMFXComponents(sInputParams* pParams) {
         QSV_ERR_MES(sts, _T("Failed to initialize decoder.\n"));
         PrintMes(RGY_LOG_DEBUG, _T("ResetMFXComponents: Dec initialized.\n"));
     }
+    return MFX_ERR_NONE;
+}
 
+mfxStatus CQSVPipeline::InitTaskPool() {
+    mfxStatus sts = MFX_ERR_NONE;
     mfxU32 nEncodedDataBufferSize = m_mfxEncParams.mfx.FrameInfo.Width * m_mfxEncParams.mfx.FrameInfo.Height * 4;
     PrintMes(RGY_LOG_DEBUG, _T("ResetMFXComponents: Creating task pool, poolSize %d, bufsize %d KB.\n"), m_nAsyncDepth, nEncodedDataBufferSize >> 10);
-    sts = m_TaskPool.Init(&m_mfxSession, m_pMFXAllocator.get(), m_pFileWriter, m_nAsyncDepth, nEncodedDataBufferSize);
+    sts = m_TaskPool.Init(m_mfxSession.get(), m_pMFXAllocator.get(), m_pFileWriter, m_nAsyncDepth, nEncodedDataBufferSize);
     QSV_ERR_MES(sts, _T("Failed to initialize task pool for encoding."));
+    if (m_pStageLatencyOverride) {
+        m_TaskPool.SetStageLatency(m_pStageLatencyOverride);
+    } else {
+        m_TaskPool.SetStageLatency((m_pPerfMonitor) ? m_pPerfMonitor->GetStageLatencyPtr() : nullptr);
+    }
     PrintMes(RGY_LOG_DEBUG, _T("ResetMFXComponents: Created task pool.\n"));
 
     return MFX_ERR_NONE;
@@ -3699,6 +4152,7 @@ mfxStatus CQSVPipeline::SynchronizeFirstTask() {
 }
 
 void CQSVPipeline::RunEncThreadLauncher(void *pParam) {
+    RGYThreadAffinity::get().apply(RGY_THREAD_ROLE_ENC);
     reinterpret_cast<CQSVPipeline*>(pParam)->RunEncode();
 }
 
@@ -3718,6 +4172,8 @@ mfxStatus CQSVPipeline::Run(size_t SubThreadAffinityMask) {
     PrintMes(RGY_LOG_DEBUG, _T("Main Thread: Lauching encode thread...\n"));
     sts = m_EncThread.RunEncFuncbyThread(&RunEncThreadLauncher, this, SubThreadAffinityMask);
     QSV_ERR_MES(sts, _T("Failed to start encode thread."));
+    //他のスレッドに設定が継承されないよう、すべてのスレッドを起動した後で適用する
+    RGYThreadAffinity::get().apply(RGY_THREAD_ROLE_MAIN);
     PrintMes(RGY_LOG_DEBUG, _T("Main Thread: Starting Encode...\n"));
 
 #if ENABLE_AVSW_READER
@@ -3730,7 +4186,8 @@ mfxStatus CQSVPipeline::Run(size_t SubThreadAffinityMask) {
         if (pAVCodecReader != nullptr) {
             thInput = pAVCodecReader->getThreadHandleInput();
         }
-        auto pAVCodecWriter = std::dynamic_pointer_cast<RGYOutputAvcodec>(m_pFileWriter);
+        auto pTeeWriter = std::dynamic_pointer_cast<RGYOutputTee>(m_pFileWriter);
+        auto pAVCodecWriter = std::dynamic_pointer_cast<RGYOutputAvcodec>((pTeeWriter) ? pTeeWriter->primary() : m_pFileWriter);
         if (pAVCodecWriter != nullptr) {
             thOutput = pAVCodecWriter->getThreadHandleOutput();
             thAudProc = pAVCodecWriter->getThreadHandleAudProcess();
@@ -3745,6 +4202,7 @@ mfxStatus CQSVPipeline::Run(size_t SubThreadAffinityMask) {
     sInputBufSys *pInputBuf;
     //入力ループ
     if (m_pFileReader->getInputCodec() == RGY_CODEC_UNKNOWN) {
+        auto pStageLatency = m_TaskPool.GetStageLatency();
         for (int i = 0; sts == MFX_ERR_NONE; i++) {
             pInputBuf = &pArrayInputBuf[i % bufferSize];
 
@@ -3761,7 +4219,11 @@ mfxStatus CQSVPipeline::Run(size_t SubThreadAffinityMask) {
             //フレームを読み込み
             PrintMes(RGY_LOG_TRACE, _T("Main Thread: LoadNextFrame %d.\n"), i);
             if (sts == MFX_ERR_NONE) {
+                const auto tmInput = std::chrono::steady_clock::now();
                 sts = err_to_mfx(m_pFileReader->LoadNextFrame(pInputBuf->pFrameSurface));
+                if (sts == MFX_ERR_NONE && pStageLatency) {
+                    pStageLatency->add(PERF_STAGE_INPUT, tmInput);
+                }
             }
             if (m_pAbortByUser != nullptr && *m_pAbortByUser) {
                 PrintMes(RGY_LOG_INFO, _T("                                                                              \r"));
@@ -3820,19 +4282,14 @@ mfxStatus CQSVPipeline::RunEncode() {
     mfxStatus sts = MFX_ERR_NONE;
 
     mfxFrameSurface1 *pSurfInputBuf = nullptr;
-    mfxFrameSurface1 *pSurfEncIn = nullptr;
-    mfxFrameSurface1 *pSurfVppIn = nullptr;
     mfxFrameSurface1 *pSurfCheckPts = nullptr; //checkptsから出てきて、他の要素に投入するフレーム / 投入後、ロックを解除する必要がある
-    vector<mfxFrameSurface1 *>pSurfVppPreFilter(m_VppPrePlugins.size() + 1, nullptr);
-    vector<mfxFrameSurface1 *>pSurfVppPostFilter(m_VppPostPlugins.size() + 1, nullptr);
     mfxFrameSurface1 *pNextFrame = nullptr;
     mfxSyncPoint lastSyncP = nullptr;
+    mfxSyncPoint lastVppSyncP = nullptr;
     bool bVppRequireMoreFrame = false;
     int nFramePutToEncoder = 0; //エンコーダに投入したフレーム数 (TimeStamp計算用)
 
     QSVTask *pCurrentTask = nullptr; //現在のタスクへのポインタ
-    int nEncSurfIdx = -1; //使用するフレームのインデックス encoder input (vpp output)
-    int nVppSurfIdx = -1; //使用するフレームのインデックス vpp input
 
     bool bVppMultipleOutput = false;  //bob化などの際にvppが余分にフレームを出力するフラグ
     bool bCheckPtsMultipleOutput = false; //dorcecfrなどにともなって、checkptsが余分にフレームを出力するフラグ
@@ -3905,60 +4362,62 @@ mfxStatus CQSVPipeline::RunEncode() {
 
     sts = MFX_ERR_NONE;
 
-    auto get_all_free_surface =[&](mfxFrameSurface1 *pSurfEncInput) {
-        //パイプラインの後ろからたどっていく
-        pSurfInputBuf = pSurfEncInput; //pSurfEncInにはパイプラインを後ろからたどった順にフレームポインタを更新していく
-        pSurfVppPostFilter[m_VppPostPlugins.size()] = pSurfInputBuf; //pSurfVppPreFilterの最後はその直前のステップのフレームに出力される
-        for (int i_filter = (int)m_VppPostPlugins.size()-1; i_filter >= 0; i_filter--) {
-            int freeSurfIdx = GetFreeSurface(m_VppPostPlugins[i_filter]->m_pPluginSurfaces.get(), m_VppPostPlugins[i_filter]->m_PluginResponse.NumFrameActual);
-            if (freeSurfIdx == MSDK_INVALID_SURF_IDX) {
-                PrintMes(RGY_LOG_ERROR, _T("Failed to get free surface for vpp post.\n"));
-                return MFX_ERR_MEMORY_ALLOC;
-            }
-            pSurfVppPostFilter[i_filter] = &m_VppPostPlugins[i_filter]->m_pPluginSurfaces[freeSurfIdx];
-            pSurfInputBuf = pSurfVppPostFilter[i_filter];
-        }
-        //vppが有効ならvpp用のフレームも用意する
-        if (m_pmfxVPP) {
-            //空いているフレームバッファを取得、空いていない場合は待機して、空くまで待ってから取得
-            nVppSurfIdx = GetFreeSurface(m_pVppSurfaces.data(), m_VppResponse.NumFrameActual);
-            if (nVppSurfIdx == MSDK_INVALID_SURF_IDX) {
-                PrintMes(RGY_LOG_ERROR, _T("Failed to get free surface for vpp.\n"));
-                return MFX_ERR_MEMORY_ALLOC;
-            }
-            pSurfVppIn = &m_pVppSurfaces[nVppSurfIdx];
-            pSurfInputBuf = pSurfVppIn;
-        }
-        pSurfVppPreFilter[m_VppPrePlugins.size()] = pSurfInputBuf; //pSurfVppPreFilterの最後はその直前のステップのフレームに出力される
-        for (int i_filter = (int)m_VppPrePlugins.size()-1; i_filter >= 0; i_filter--) {
-            int freeSurfIdx = GetFreeSurface(m_VppPrePlugins[i_filter]->m_pPluginSurfaces.get(), m_VppPrePlugins[i_filter]->m_PluginResponse.NumFrameActual);
-            if (freeSurfIdx == MSDK_INVALID_SURF_IDX) {
-                PrintMes(RGY_LOG_ERROR, _T("Failed to get free surface for vpp pre.\n"));
-                return MFX_ERR_MEMORY_ALLOC;
-            }
-            pSurfVppPreFilter[i_filter] = &m_VppPrePlugins[i_filter]->m_pPluginSurfaces[freeSurfIdx];
-            pSurfInputBuf = pSurfVppPreFilter[i_filter];
+    //各段の入力に使用するフレームのプール
+    //  パイプラインの順に、vpp前フィルタ -> vpp -> vpp後フィルタ -> エンコーダ
+    //  各段は、次にプールを持つ段のプールから空いているフレームを取得して出力先とする
+    struct SurfacePool {
+        mfxFrameSurface1 *pSurfaces;
+        int nSurfaces;
+        const TCHAR *name;
+    };
+    vector<SurfacePool> surfacePools;
+    for (const auto& filter : m_VppPrePlugins) {
+        surfacePools.push_back({ filter->m_pPluginSurfaces.get(), (int)filter->m_PluginResponse.NumFrameActual, _T("vpp pre") });
+    }
+    if (m_pmfxVPP) {
+        surfacePools.push_back({ m_pVppSurfaces.data(), (int)m_VppResponse.NumFrameActual, _T("vpp") });
+    }
+    for (const auto& filter : m_VppPostPlugins) {
+        surfacePools.push_back({ filter->m_pPluginSurfaces.get(), (int)filter->m_PluginResponse.NumFrameActual, _T("vpp post") });
+    }
+    surfacePools.push_back({ m_pEncSurfaces.data(), (int)m_EncResponse.NumFrameActual, _T("enc") });
+
+    auto get_free_surface = [&](const SurfacePool& pool) -> mfxFrameSurface1 * {
+        //空いているフレームバッファを取得、空いていない場合は待機して、空くまで待ってから取得
+        const int freeSurfIdx = GetFreeSurface(pool.pSurfaces, pool.nSurfaces);
+        if (freeSurfIdx == MSDK_INVALID_SURF_IDX) {
+            PrintMes(RGY_LOG_ERROR, _T("Failed to get free surface for %s.\n"), pool.name);
+            return nullptr;
         }
-        //最終的にpSurfInputBufには一番最初のステップのフレームポインタが入る
-        return MFX_ERR_NONE;
+        return &pool.pSurfaces[freeSurfIdx];
     };
 
     auto set_surface_to_input_buffer = [&]() {
         mfxStatus sts_set_buffer = MFX_ERR_NONE;
         for (int i = 0; i < m_EncThread.m_nFrameBuffer; i++) {
-            get_all_free_surface(&m_pEncSurfaces[GetFreeSurface(m_pEncSurfaces.data(), m_EncResponse.NumFrameActual)]);
+            //入力のフレームは、パイプラインの最初のプールから取得する
+            if (nullptr == (pSurfInputBuf = get_free_surface(surfacePools.front()))) {
+                return MFX_ERR_MEMORY_ALLOC;
+            }
 
             //フレーム読み込みでない場合には、ここでロックする必要はない
             if (m_bExternalAlloc && m_pFileReader->getInputCodec() == RGY_CODEC_UNKNOWN) {
                 if (MFX_ERR_NONE != (sts_set_buffer = m_pMFXAllocator->Lock(m_pMFXAllocator->pthis, pSurfInputBuf->Data.MemId, &(pSurfInputBuf->Data))))
                     break;
+            }
+            //空いているフレームを読み込み側に渡し、該当フレームの読み込み開始イベントをSetする(pInputBuf->heInputStart)
+            SetNextSurface(pSurfInputBuf);
         }
-        //空いているフレームを読み込み側に渡し、該当フレームの読み込み開始イベントをSetする(pInputBuf->heInputStart)
-        SetNextSurface(pSurfInputBuf);
-    }
         return sts_set_buffer;
     };
 
+    //デバイスがビジーの間は待機して再試行する (各段で共通)
+    auto run_retry_busy = [&](std::function<mfxStatus(bool&)> func) {
+        return qsv_run_retry_busy(func, [&]() {
+            PrintMes(RGY_LOG_ERROR, _T("device kept on busy for 30s, unknown error occurred.\n"));
+        });
+    };
+
     //先読みバッファ用フレームを読み込み側に提供する
     set_surface_to_input_buffer();
     PrintMes(RGY_LOG_DEBUG, _T("Encode Thread: Set surface to input buffer...\n"));
@@ -3972,20 +4431,26 @@ mfxStatus CQSVPipeline::RunEncode() {
         }
     };
 
-    auto extract_audio = [&]() {
+    //bInputEnd ... 映像の入力が終了した
+    auto extract_audio = [&](bool bInputEnd) {
         RGY_ERR ret = RGY_ERR_NONE;
 #if ENABLE_AVSW_READER
         if (m_pFileWriterListAudio.size() + pFilterForStreams.size() > 0) {
+            //音声ファイルからは、次に読み込む映像のフレームの終わりまでの音声を取得する
+            //映像の入力が終了したら、残りの音声をすべて取得する
+            const auto inputFrameInfo = m_pFileReader->GetInputFrameInfo();
+            const AVRational vidTimebase = av_make_q(inputFrameInfo.fpsD, inputFrameInfo.fpsN);
+            const int64_t vidPts = (bInputEnd) ? AV_NOPTS_VALUE : (int64_t)m_pEncSatusInfo->m_sData.frameIn + 1;
             auto pAVCodecReader = std::dynamic_pointer_cast<RGYInputAvcodec>(m_pFileReader);
             vector<AVPacket> packetList;
             if (pAVCodecReader != nullptr) {
-                packetList = pAVCodecReader->GetStreamDataPackets();
+                packetList = pAVCodecReader->GetStreamDataPackets(vidPts, vidTimebase);
             }
             //音声ファイルリーダーからのトラックを結合する
             for (const auto& reader : m_AudioReaders) {
                 auto pReader = std::dynamic_pointer_cast<RGYInputAvcodec>(reader);
                 if (pReader != nullptr) {
-                    vector_cat(packetList, pReader->GetStreamDataPackets());
+                    vector_cat(packetList, pReader->GetStreamDataPackets(vidPts, vidTimebase));
                 }
             }
             //パケットを各Writerに分配する
@@ -4033,7 +4498,11 @@ mfxStatus CQSVPipeline::RunEncode() {
                 //これを無視する実装も併せて行った。
                 && (m_DecInputBitstream.size() <= 1)) {
                 //この関数がMFX_ERR_NONE以外を返せば、入力ビットストリームは終了
+                const auto tmInput = std::chrono::steady_clock::now();
                 auto ret = m_pFileReader->GetNextBitstream(&m_DecInputBitstream);
+                if (ret == RGY_ERR_NONE && m_TaskPool.GetStageLatency()) {
+                    m_TaskPool.GetStageLatency()->add(PERF_STAGE_INPUT, tmInput);
+                }
                 if (ret == RGY_ERR_MORE_BITSTREAM) {
                     return err_to_mfx(ret); //入力ビットストリームは終了
                 }
@@ -4042,7 +4511,7 @@ mfxStatus CQSVPipeline::RunEncode() {
 
             getNextBitstream |= m_DecInputBitstream.size() > 0;
 
-            //デコードも行う場合は、デコード用のフレームをpSurfVppInかpSurfEncInから受け取る
+            //デコードも行う場合は、デコード用のフレームをパイプラインの最初のプールから受け取る
             mfxFrameSurface1 *pSurfDecWork = pNextFrame;
             mfxFrameSurface1 *pSurfDecOut = NULL;
             mfxBitstream *pInputBitstream = (getNextBitstream) ? &m_DecInputBitstream.bitstream() : nullptr;
@@ -4060,27 +4529,20 @@ mfxStatus CQSVPipeline::RunEncode() {
             pSurfDecWork->Data.TimeStamp = (mfxU64)MFX_TIMESTAMP_UNKNOWN;
             pSurfDecWork->Data.DataFlag |= MFX_FRAMEDATA_ORIGINAL_TIMESTAMP;
 
-            for (int i = 0; ; i++) {
+            const auto tmDecode = std::chrono::steady_clock::now();
+            dec_sts = run_retry_busy([&](bool& bOutput) {
                 mfxSyncPoint DecSyncPoint = NULL;
-                dec_sts = m_pmfxDEC->DecodeFrameAsync(pInputBitstream, pSurfDecWork, &pSurfDecOut, &DecSyncPoint);
+                mfxStatus ret = m_pmfxDEC->DecodeFrameAsync(pInputBitstream, pSurfDecWork, &pSurfDecOut, &DecSyncPoint);
                 lastSyncP = DecSyncPoint;
+                bOutput = DecSyncPoint != nullptr;
+                return ret;
+            });
+            if (dec_sts < MFX_ERR_NONE && (dec_sts != MFX_ERR_MORE_DATA && dec_sts != MFX_ERR_MORE_SURFACE)) {
+                PrintMes(RGY_LOG_ERROR, _T("DecodeFrameAsync error: %s.\n"), get_err_mes(dec_sts));
+            }
 
-                if (MFX_ERR_NONE < dec_sts && !DecSyncPoint) {
-                    if (MFX_WRN_DEVICE_BUSY == dec_sts)
-                        sleep_hybrid(i);
-                    if (i > 1024 * 1024 * 30) {
-                        PrintMes(RGY_LOG_ERROR, _T("device kept on busy for 30s, unknown error occurred.\n"));
-                        return MFX_ERR_UNKNOWN;
-                    }
-                } else if (MFX_ERR_NONE < dec_sts && DecSyncPoint) {
-                    dec_sts = MFX_ERR_NONE; //出力があれば、警告は無視する
-                    break;
-                } else if (dec_sts < MFX_ERR_NONE && (dec_sts != MFX_ERR_MORE_DATA && dec_sts != MFX_ERR_MORE_SURFACE)) {
-                    PrintMes(RGY_LOG_ERROR, _T("DecodeFrameAsync error: %s.\n"), get_err_mes(dec_sts));
-                    break;
-                } else {
-                    break;
-                }
+            if (pSurfDecOut != nullptr && lastSyncP != nullptr && m_TaskPool.GetStageLatency()) {
+                m_TaskPool.GetStageLatency()->add(PERF_STAGE_DECODE, tmDecode);
             }
 
             //次のステップのフレームをデコードの出力に設定
@@ -4184,24 +4646,20 @@ mfxStatus CQSVPipeline::RunEncode() {
         mfxStatus filter_sts = MFX_ERR_NONE;
         mfxSyncPoint filterSyncPoint = NULL;
 
-        for (int i = 0; ; i++) {
+        const auto tmFilter = std::chrono::steady_clock::now();
+        filter_sts = run_retry_busy([&](bool& bOutput) {
             mfxHDL *h1 = (mfxHDL *)ppSurfIn;
             mfxHDL *h2 = (mfxHDL *)ppSurfOut;
 
-            filter_sts = MFXVideoUSER_ProcessFrameAsync(filter->getSession(), h1, 1, h2, 1, &filterSyncPoint);
-
-            if (MFX_WRN_DEVICE_BUSY == filter_sts) {
-                sleep_hybrid(i);
-                if (i > 1024 * 1024 * 30) {
-                    PrintMes(RGY_LOG_ERROR, _T("device kept on busy for 30s, unknown error occurred.\n"));
-                    return MFX_ERR_UNKNOWN;
-                }
-            } else {
-                break;
-            }
-        }
+            mfxStatus ret = MFXVideoUSER_ProcessFrameAsync(filter->getSession(), h1, 1, h2, 1, &filterSyncPoint);
+            bOutput = filterSyncPoint != nullptr;
+            return ret;
+        });
         // save the id of preceding vpp task which will produce input data for the encode task
         if (filterSyncPoint) {
+            if (m_TaskPool.GetStageLatency()) {
+                m_TaskPool.GetStageLatency()->add(PERF_STAGE_FILTER, tmFilter);
+            }
             lastSyncP = filterSyncPoint;
             //pCurrentTask->vppSyncPoint.push_back(filterSyncPoint);
             filterSyncPoint = NULL;
@@ -4219,27 +4677,16 @@ mfxStatus CQSVPipeline::RunEncode() {
             //vpp前に、vpp用のパラメータでFrameInfoを更新
             copy_crop_info(pSurfVppIn, &m_mfxVppParams.mfx.FrameInfo);
 
-            for (int i = 0; ; i++) {
+            const auto tmVpp = std::chrono::steady_clock::now();
+            vpp_sts = run_retry_busy([&](bool& bOutput) {
                 //bob化の際、pSurfVppInに連続で同じフレーム(同じtimestamp)を投入すると、
                 //最初のフレームには設定したtimestamp、次のフレームにはMFX_TIMESTAMP_UNKNOWNが設定されて出てくる
                 //特別pSurfVppOut側のTimestampを設定する必要はなさそう
-                vpp_sts = m_pmfxVPP->RunFrameVPPAsync(pSurfVppIn, pSurfVppOut, NULL, &VppSyncPoint);
+                mfxStatus ret = m_pmfxVPP->RunFrameVPPAsync(pSurfVppIn, pSurfVppOut, NULL, &VppSyncPoint);
                 lastSyncP = VppSyncPoint;
-
-                if (MFX_ERR_NONE < vpp_sts && !VppSyncPoint) {
-                    if (MFX_WRN_DEVICE_BUSY == vpp_sts)
-                        sleep_hybrid(i);
-                    if (i > 1024 * 1024 * 30) {
-                        PrintMes(RGY_LOG_ERROR, _T("device kept on busy for 30s, unknown error occurred.\n"));
-                        return MFX_ERR_UNKNOWN;
-                    }
-                } else if (MFX_ERR_NONE < vpp_sts && VppSyncPoint) {
-                    vpp_sts = MFX_ERR_NONE;
-                    break;
-                } else {
-                    break;
-                }
-            }
+                bOutput = VppSyncPoint != nullptr;
+                return ret;
+            });
 
             if (MFX_ERR_MORE_DATA == vpp_sts) {
                 bVppRequireMoreFrame = true;
@@ -4249,7 +4696,10 @@ mfxStatus CQSVPipeline::RunEncode() {
             }
 
             if (VppSyncPoint) {
-                pCurrentTask->vppSyncPoint.push_back(VppSyncPoint);
+                if (m_TaskPool.GetStageLatency()) {
+                    m_TaskPool.GetStageLatency()->add(PERF_STAGE_VPP, tmVpp);
+                }
+                lastVppSyncP = VppSyncPoint;
                 VppSyncPoint = NULL;
                 pNextFrame = pSurfVppOut;
             }
@@ -4282,431 +4732,297 @@ mfxStatus CQSVPipeline::RunEncode() {
             pSurfEncIn->Data.TimeStamp = (uint64_t)m_outputTimestamp.check(pSurfEncIn->Data.TimeStamp);
         }
 
-        bool bDeviceBusy = false;
-        for (int i = 0; ; i++) {
-            enc_sts = m_pmfxENC->EncodeFrameAsync(nullptr, pSurfEncIn, &pCurrentTask->mfxBS, &pCurrentTask->encSyncPoint);
-            bDeviceBusy = false;
-
-            if (MFX_ERR_NONE < enc_sts && !pCurrentTask->encSyncPoint) {
-                bDeviceBusy = true;
-                if (MFX_WRN_DEVICE_BUSY == enc_sts)
-                sleep_hybrid(i);
-                if (i > 65536 * 1024 * 30) {
-                    PrintMes(RGY_LOG_ERROR, _T("device kept on busy for 30s, unknown error occurred.\n"));
-                    return MFX_ERR_UNKNOWN;
-                }
-            } else if (MFX_ERR_NONE < enc_sts && pCurrentTask->encSyncPoint) {
-                enc_sts = MFX_ERR_NONE;
-                break;
-            } else if (MFX_ERR_NOT_ENOUGH_BUFFER == enc_sts) {
+        for (;;) {
+            enc_sts = run_retry_busy([&](bool& bOutput) {
+                mfxStatus ret = m_pmfxENC->EncodeFrameAsync(nullptr, pSurfEncIn, &pCurrentTask->mfxBS, &pCurrentTask->encSyncPoint);
+                bOutput = pCurrentTask->encSyncPoint != nullptr;
+                return ret;
+            });
+            if (MFX_ERR_NOT_ENOUGH_BUFFER == enc_sts) {
+                //出力バッファを拡張して再試行する
                 enc_sts = AllocateSufficientBuffer(&pCurrentTask->mfxBS);
                 if (enc_sts < MFX_ERR_NONE) return enc_sts;
-            } else if (enc_sts < MFX_ERR_NONE && (enc_sts != MFX_ERR_MORE_DATA && enc_sts != MFX_ERR_MORE_SURFACE)) {
+                continue;
+            }
+            if (enc_sts < MFX_ERR_NONE && (enc_sts != MFX_ERR_MORE_DATA && enc_sts != MFX_ERR_MORE_SURFACE)) {
                 PrintMes(RGY_LOG_ERROR, _T("EncodeFrameAsync error: %s.\n"), get_err_mes(enc_sts));
-                break;
-            } else {
-                QSV_IGNORE_STS(enc_sts, MFX_ERR_MORE_BITSTREAM);
-                break;
             }
+            QSV_IGNORE_STS(enc_sts, MFX_ERR_MORE_BITSTREAM);
+            break;
+        }
+        if (pCurrentTask->encSyncPoint && m_TaskPool.GetStageLatency()) {
+            pCurrentTask->tmSubmit = std::chrono::steady_clock::now();
         }
         return enc_sts;
     };
 
-    //メインループ
-    while (MFX_ERR_NONE <= sts || MFX_ERR_MORE_DATA == sts || MFX_ERR_MORE_SURFACE == sts) {
-        if (pSurfCheckPts) {
-            //pSurfCheckPtsはcheckptsから出てきて、他の要素に投入するフレーム
-            //投入後、ロックを解除する必要がある
-            pSurfCheckPts->Data.Locked--;
-            pSurfCheckPts = nullptr;
-        }
-        speedCtrl.wait(m_pEncSatusInfo->m_sData.frameIn);
-#if defined(_WIN32) || defined(_WIN64)
-        //中断オブジェクトのチェック
-        if (WaitForSingleObject(m_heAbort.get(), 0) == WAIT_OBJECT_0) {
-            m_EncThread.m_bthForceAbort = true;
-        }
-#endif
-
-        //空いているフレームバッファを取得、空いていない場合は待機して、出力ストリームの書き出しを待ってから取得
-        if (MFX_ERR_NONE != (sts = GetFreeTask(&pCurrentTask)))
-            break;
-
-        //空いているフレームバッファを取得、空いていない場合は待機して、空くまで待ってから取得
-        nEncSurfIdx = GetFreeSurface(m_pEncSurfaces.data(), m_EncResponse.NumFrameActual);
-        if (nEncSurfIdx == MSDK_INVALID_SURF_IDX) {
-            PrintMes(RGY_LOG_ERROR, _T("Failed to get free surface for enc.\n"));
-            return MFX_ERR_MEMORY_ALLOC;
-        }
-
-        // point pSurf to encoder surface
-        pSurfEncIn = &m_pEncSurfaces[nEncSurfIdx];
-
-        if (!bVppMultipleOutput) {
-            if (MFX_ERR_NONE != (sts = get_all_free_surface(pSurfEncIn))) {
-                break;
+    //パイプラインの各段
+    //  入力(読み込み/デコード/trim) -> avsync(check_pts) -> vpp前フィルタ -> vpp -> vpp後フィルタ -> エンコード
+    //各段は自分のキューを持ち、前段の出力を1フレームずつ処理する
+    //このうちフレームをため込む段(デコーダ、avsyncのキュー、vpp、エンコーダ)は、入力の終了後に先頭から順にflushする
+    QSVStageGraph stageGraph;
+
+    //入力から1フレームを取得し、デコードする
+    //戻り値がMFX_ERR_MORE_SURFACEなら次のフレームへ
+    auto read_one_frame = [&]() {
+        mfxStatus read_sts = MFX_ERR_NONE;
+        if (m_pFileReader->getInputCodec() == RGY_CODEC_UNKNOWN) {
+            //読み込み側の該当フレームの読み込み終了を待機(pInputBuf->heInputDone)して、読み込んだフレームを取得
+            //この関数がRGY_ERR_NONE以外を返すことでRunEncodeは終了処理に入る
+            read_sts = GetNextFrame(&pNextFrame);
+            if (read_sts != MFX_ERR_NONE) {
+                return read_sts;
             }
-            if (!bCheckPtsMultipleOutput) {
-                //if (m_VppPrePlugins.size()) {
-                //    pSurfInputBuf = pSurfVppPreFilter[0];
-                //    //ppNextFrame = &;
-                //} else if (m_pmfxVPP) {
-                //    pSurfInputBuf = &m_pVppSurfaces[nVppSurfIdx];
-                //    //ppNextFrame = &pSurfVppIn;
-                //} else if (m_VppPostPlugins.size()) {
-                //    pSurfInputBuf = &pSurfVppPostFilter[0];
-                //    //ppNextFrame = &;
-                //} else {
-                //    pSurfInputBuf = pSurfEncIn;
-                //    //ppNextFrame = &pSurfEncIn;
-                //}
-
-                if (m_pFileReader->getInputCodec() == RGY_CODEC_UNKNOWN) {
-                    //読み込み側の該当フレームの読み込み終了を待機(pInputBuf->heInputDone)して、読み込んだフレームを取得
-                    //この関数がRGY_ERR_NONE以外を返すことでRunEncodeは終了処理に入る
-                    sts = GetNextFrame(&pNextFrame);
-                    if (sts != MFX_ERR_NONE) {
-                        break;
-                    }
-                    pNextFrame->Data.TimeStamp = (mfxU64)MFX_TIMESTAMP_UNKNOWN;
-                    //フレーム読み込みの場合には、必要ならここでロックする
-                    if (m_bExternalAlloc) {
-                        if (MFX_ERR_NONE != (sts = m_pMFXAllocator->Unlock(m_pMFXAllocator->pthis, (pNextFrame)->Data.MemId, &((pNextFrame)->Data))))
-                            break;
-
-                        if (MFX_ERR_NONE != (sts = m_pMFXAllocator->Lock(m_pMFXAllocator->pthis, pSurfInputBuf->Data.MemId, &(pSurfInputBuf->Data))))
-                            break;
-                    }
-
-                    //空いているフレームを読み込み側に渡す
-                    SetNextSurface(pSurfInputBuf);
-                } else {
-                    //フレーム読み込みでない場合には、フレームバッファをm_pFileReaderを通さずに直接渡す
-                    pNextFrame = pSurfInputBuf;
-                    if (m_EncThread.m_bthForceAbort) {
-                        sts = m_EncThread.m_stsThread;
-                        break;
-                    }
-                }
-
-                auto ret = extract_audio();
-                if (ret != RGY_ERR_NONE) {
-                    sts = err_to_mfx(ret);
-                    break;
-                }
+            pNextFrame->Data.TimeStamp = (mfxU64)MFX_TIMESTAMP_UNKNOWN;
+            //フレーム読み込みの場合には、必要ならここでロックする
+            if (m_bExternalAlloc) {
+                if (MFX_ERR_NONE != (read_sts = m_pMFXAllocator->Unlock(m_pMFXAllocator->pthis, (pNextFrame)->Data.MemId, &((pNextFrame)->Data))))
+                    return read_sts;
 
-                //この関数がMFX_ERR_MORE_BITSTREAMを返せば、入力は終了
-                sts = decode_one_frame(true);
-                if (sts == MFX_ERR_MORE_DATA || sts == MFX_ERR_MORE_SURFACE)
-                    continue;
-                if (sts != MFX_ERR_NONE)
-                    break;
+                if (MFX_ERR_NONE != (read_sts = m_pMFXAllocator->Lock(m_pMFXAllocator->pthis, pSurfInputBuf->Data.MemId, &(pSurfInputBuf->Data))))
+                    return read_sts;
             }
 
-            if (!frame_inside_range(nInputFrameCount, m_trimParam.list).first)
-                continue;
-
-            sts = check_pts();
-            if (sts == MFX_ERR_MORE_SURFACE)
-                continue;
-            if (sts != MFX_ERR_NONE)
-                break;
-
-            for (int i_filter = 0; i_filter < (int)m_VppPrePlugins.size(); i_filter++) {
-                mfxFrameSurface1 *pSurfFilterOut = pSurfVppPreFilter[i_filter + 1];
-                if (MFX_ERR_NONE != (sts = filter_one_frame(m_VppPrePlugins[i_filter], &pNextFrame, &pSurfFilterOut)))
-                    break;
-                pNextFrame = pSurfFilterOut;
+            //空いているフレームを読み込み側に渡す
+            SetNextSurface(pSurfInputBuf);
+        } else {
+            //フレーム読み込みでない場合には、フレームバッファをm_pFileReaderを通さずに直接渡す
+            pNextFrame = pSurfInputBuf;
+            if (m_EncThread.m_bthForceAbort) {
+                //中断された場合は、入力の終了として扱う
+                return (m_EncThread.m_stsThread != MFX_ERR_NONE) ? m_EncThread.m_stsThread : MFX_ERR_MORE_BITSTREAM;
             }
-            if (sts != MFX_ERR_NONE)
-                break;
-
-            pSurfVppIn = pNextFrame;
         }
 
-        sts = vpp_one_frame(pSurfVppIn, (m_VppPostPlugins.size()) ? pSurfVppPostFilter[0] : pSurfEncIn);
-        if (bVppRequireMoreFrame)
-            continue;
-        if (sts != MFX_ERR_NONE)
-            break;
-
-        for (int i_filter = 0; i_filter < (int)m_VppPostPlugins.size(); i_filter++) {
-            mfxFrameSurface1 *pSurfFilterOut = pSurfVppPostFilter[i_filter + 1];
-            if (MFX_ERR_NONE != (sts = filter_one_frame(m_VppPostPlugins[i_filter], &pNextFrame, &pSurfFilterOut)))
-                break;
-            pNextFrame = pSurfFilterOut;
+        auto ret = extract_audio(false);
+        if (ret != RGY_ERR_NONE) {
+            return err_to_mfx(ret);
         }
-        if (sts != MFX_ERR_NONE)
-            break;
-
-        sts = encode_one_frame(pNextFrame);
-    }
-
-    //MFX_ERR_MORE_DATA/MFX_ERR_MORE_BITSTREAMは入力が終了したことを示す
-    QSV_IGNORE_STS(sts, (m_pFileReader->getInputCodec() != RGY_CODEC_UNKNOWN) ? MFX_ERR_MORE_BITSTREAM : MFX_ERR_MORE_DATA);
-    //エラーチェック
-    m_EncThread.m_stsThread = sts;
-    QSV_ERR_MES(sts, _T("Error in encoding pipeline."));
-    PrintMes(RGY_LOG_DEBUG, _T("Encode Thread: finished main loop.\n"));
-
-    if (m_pmfxDEC) {
-        auto ret = extract_audio();
-        RGY_ERR_MES(ret, _T("Error on extracting audio."));
-
-        pNextFrame = NULL;
-
-        while (MFX_ERR_NONE <= sts || sts == MFX_ERR_MORE_SURFACE) {
-            if (pSurfCheckPts) {
-                //pSurfCheckPtsはcheckptsから出てきて、他の要素に投入するフレーム
-                //投入後、ロックを解除する必要がある
-                pSurfCheckPts->Data.Locked--;
-                pSurfCheckPts = nullptr;
-            }
-
-            //空いているフレームバッファを取得、空いていない場合は待機して、出力ストリームの書き出しを待ってから取得
-            if (MFX_ERR_NONE != (sts = GetFreeTask(&pCurrentTask)))
-                break;
-
-            //空いているフレームバッファを取得、空いていない場合は待機して、空くまで待ってから取得
-            nEncSurfIdx = GetFreeSurface(m_pEncSurfaces.data(), m_EncResponse.NumFrameActual);
-            if (nEncSurfIdx == MSDK_INVALID_SURF_IDX) {
-                PrintMes(RGY_LOG_ERROR, _T("Failed to get free surface for enc.\n"));
-                return MFX_ERR_MEMORY_ALLOC;
-            }
-
-            pSurfEncIn = &m_pEncSurfaces[nEncSurfIdx];
-
-            if (!bVppMultipleOutput) {
-                get_all_free_surface(pSurfEncIn);
-                pNextFrame = pSurfInputBuf;
-
-                if (!bCheckPtsMultipleOutput) {
-                    sts = decode_one_frame(false);
-                    if (sts == MFX_ERR_MORE_SURFACE)
-                        continue;
-                    if (sts != MFX_ERR_NONE)
-                        break;
-                }
-
-                sts = check_pts();
-                if (sts == MFX_ERR_MORE_SURFACE)
-                    continue;
-                if (sts != MFX_ERR_NONE)
-                    break;
-
-                for (int i_filter = 0; i_filter < (int)m_VppPrePlugins.size(); i_filter++) {
-                    mfxFrameSurface1 *pSurfFilterOut = pSurfVppPreFilter[i_filter + 1];
-                    if (MFX_ERR_NONE != (sts = filter_one_frame(m_VppPrePlugins[i_filter], &pNextFrame, &pSurfFilterOut)))
-                        break;
-                    pNextFrame = pSurfFilterOut;
-                }
-                if (sts != MFX_ERR_NONE)
-                    break;
-
-                pSurfVppIn = pNextFrame;
-            }
-
-            if (!frame_inside_range(nInputFrameCount, m_trimParam.list).first)
-                continue;
-
-            sts = vpp_one_frame(pSurfVppIn, (m_VppPostPlugins.size()) ? pSurfVppPostFilter[0] : pSurfEncIn);
-            if (bVppRequireMoreFrame)
-                continue;
-            if (sts != MFX_ERR_NONE)
-                break;
-
-            for (int i_filter = 0; i_filter < (int)m_VppPostPlugins.size(); i_filter++) {
-                mfxFrameSurface1 *pSurfFilterOut = pSurfVppPostFilter[i_filter + 1];
-                if (MFX_ERR_NONE != (sts = filter_one_frame(m_VppPostPlugins[i_filter], &pNextFrame, &pSurfFilterOut)))
-                    break;
-                pNextFrame = pSurfFilterOut;
-            }
-            if (sts != MFX_ERR_NONE)
-                break;
 
-            sts = encode_one_frame(pNextFrame);
+        //この関数がMFX_ERR_MORE_BITSTREAMを返せば、入力は終了
+        read_sts = decode_one_frame(true);
+        if (read_sts == MFX_ERR_MORE_DATA) {
+            read_sts = MFX_ERR_MORE_SURFACE;
         }
+        return read_sts;
+    };
 
-        //MFX_ERR_MORE_DATAはデコーダにもうflushするべきフレームがないことを示す
-        QSV_IGNORE_STS(sts, MFX_ERR_MORE_DATA);
-        //エラーチェック
-        m_EncThread.m_stsThread = sts;
-        QSV_ERR_MES(sts, _T("Error in getting buffered frames from decoder."));
-        PrintMes(RGY_LOG_DEBUG, _T("Encode Thread: finished getting buffered frames from decoder.\n"));
-    }
-
-#if ENABLE_AVSW_READER
-    if (m_pmfxDEC && (m_nAVSyncMode & RGY_AVSYNC_FORCE_CFR)) {
-
-        pNextFrame = NULL;
-
-        while (MFX_ERR_NONE <= sts || sts == MFX_ERR_MORE_SURFACE) {
-            if (pSurfCheckPts) {
-                //pSurfCheckPtsはcheckptsから出てきて、他の要素に投入するフレーム
-                //投入後、ロックを解除する必要がある
-                pSurfCheckPts->Data.Locked--;
-                pSurfCheckPts = nullptr;
+    //入力の段: 読み込み/デコードしたフレームのうち、trimの範囲内のものを出力する
+    auto input_output = [&](mfxStatus input_sts, QSVStageFrame *out) {
+        if (input_sts == MFX_ERR_MORE_SURFACE) {
+            return MFX_ERR_NONE; //デコーダがフレームをため込んだだけ
+        }
+        if (input_sts != MFX_ERR_NONE) {
+            return input_sts;
+        }
+        if (frame_inside_range(nInputFrameCount, m_trimParam.list).first) {
+            out->pSurface = pNextFrame;
+            out->syncp = (m_pmfxDEC) ? lastSyncP : nullptr;
+        }
+        return MFX_ERR_NONE;
+    };
+    stageGraph.add(std::unique_ptr<QSVStage>(new QSVStageFunc(_T("decoder"), m_pmfxDEC != nullptr,
+        [&](const QSVStageFrame *in, QSVStageFrame *out) {
+            speedCtrl.wait(m_pEncSatusInfo->m_sData.frameIn);
+#if defined(_WIN32) || defined(_WIN64)
+            //中断オブジェクトのチェック
+            if (WaitForSingleObject(m_heAbort.get(), 0) == WAIT_OBJECT_0) {
+                m_EncThread.m_bthForceAbort = true;
             }
-
-            //空いているフレームバッファを取得、空いていない場合は待機して、出力ストリームの書き出しを待ってから取得
-            if (MFX_ERR_NONE != (sts = GetFreeTask(&pCurrentTask)))
-                break;
-
-            //空いているフレームバッファを取得、空いていない場合は待機して、空くまで待ってから取得
-            nEncSurfIdx = GetFreeSurface(m_pEncSurfaces.data(), m_EncResponse.NumFrameActual);
-            if (nEncSurfIdx == MSDK_INVALID_SURF_IDX) {
-                PrintMes(RGY_LOG_ERROR, _T("Failed to get free surface for enc.\n"));
+#endif
+            if (nullptr == (pSurfInputBuf = get_free_surface(surfacePools.front()))) {
                 return MFX_ERR_MEMORY_ALLOC;
             }
-
-            pSurfEncIn = &m_pEncSurfaces[nEncSurfIdx];
-
-            if (!bVppMultipleOutput) {
-                get_all_free_surface(pSurfEncIn);
-                pNextFrame = nullptr;
-                lastSyncP = nullptr;
-
-                sts = check_pts();
-                if (sts == MFX_ERR_MORE_SURFACE)
-                    continue;
-                if (sts != MFX_ERR_NONE)
-                    break;
-
-                for (int i_filter = 0; i_filter < (int)m_VppPrePlugins.size(); i_filter++) {
-                    mfxFrameSurface1 *pSurfFilterOut = pSurfVppPreFilter[i_filter + 1];
-                    if (MFX_ERR_NONE != (sts = filter_one_frame(m_VppPrePlugins[i_filter], &pNextFrame, &pSurfFilterOut)))
-                        break;
-                    pNextFrame = pSurfFilterOut;
-                }
-                if (sts != MFX_ERR_NONE)
-                    break;
-
-                pSurfVppIn = pNextFrame;
+            mfxStatus input_sts = read_one_frame();
+            //MFX_ERR_MORE_DATA/MFX_ERR_MORE_BITSTREAMは入力が終了したことを示す
+            if (input_sts == ((m_pFileReader->getInputCodec() != RGY_CODEC_UNKNOWN) ? MFX_ERR_MORE_BITSTREAM : MFX_ERR_MORE_DATA)) {
+                return MFX_ERR_MORE_DATA;
             }
-
-            sts = vpp_one_frame(pSurfVppIn, (m_VppPostPlugins.size()) ? pSurfVppPostFilter[0] : pSurfEncIn);
-            if (bVppRequireMoreFrame)
-                continue;
-            if (sts != MFX_ERR_NONE)
-                break;
-
-            for (int i_filter = 0; i_filter < (int)m_VppPostPlugins.size(); i_filter++) {
-                mfxFrameSurface1 *pSurfFilterOut = pSurfVppPostFilter[i_filter + 1];
-                if (MFX_ERR_NONE != (sts = filter_one_frame(m_VppPostPlugins[i_filter], &pNextFrame, &pSurfFilterOut)))
-                    break;
-                pNextFrame = pSurfFilterOut;
+            return input_output(input_sts, out);
+        },
+        [&](QSVStageFrame *out) {
+            //デコーダのflush
+            if (nullptr == (pSurfInputBuf = get_free_surface(surfacePools.front()))) {
+                return MFX_ERR_MEMORY_ALLOC;
             }
-            if (sts != MFX_ERR_NONE)
-                break;
-
-            sts = encode_one_frame(pNextFrame);
-        }
-
-        //MFX_ERR_MORE_DATAはcheck_ptsにもうflushするべきフレームがないことを示す
-        QSV_IGNORE_STS(sts, MFX_ERR_MORE_DATA);
-        // exit in case of other errors
-        m_EncThread.m_stsThread = sts;
-        QSV_ERR_MES(sts, _T("Error in getting buffered frames from avsync buffer."));
-        PrintMes(RGY_LOG_DEBUG, _T("Encode Thread: finished getting buffered frames from avsync buffer.\n"));
-    }
-
-    for (const auto& writer : m_pFileWriterListAudio) {
-        auto pAVCodecWriter = std::dynamic_pointer_cast<RGYOutputAvcodec>(writer);
-        if (pAVCodecWriter != nullptr) {
-            //エンコーダなどにキャッシュされたパケットを書き出す
-            pAVCodecWriter->WriteNextPacket(nullptr);
+            pNextFrame = pSurfInputBuf;
+            mfxStatus input_sts = decode_one_frame(false);
+            return (input_sts == MFX_ERR_MORE_DATA) ? input_sts : input_output(input_sts, out);
+        })));
+
+    //avsyncの段: check_ptsでtimestampを設定し、必要ならフレームの水増し・間引きを行う
+    auto avsync_output = [&](QSVStageFrame *out) {
+        mfxStatus avsync_sts = check_pts();
+        if (avsync_sts == MFX_ERR_MORE_SURFACE) {
+            return MFX_ERR_NONE; //間引かれたフレーム
+        }
+        if (avsync_sts != MFX_ERR_NONE) {
+            return avsync_sts;
+        }
+        out->pSurface = pNextFrame;
+        out->syncp = lastSyncP;
+        return MFX_ERR_NONE;
+    };
+    auto avsync_unlock = [&]() {
+        if (pSurfCheckPts) {
+            //pSurfCheckPtsはcheckptsから出てきて、他の要素に投入するフレーム
+            //投入後、ロックを解除する必要がある
+            pSurfCheckPts->Data.Locked--;
+            pSurfCheckPts = nullptr;
         }
+    };
+    auto pStageAvsync = stageGraph.add(std::unique_ptr<QSVStage>(new QSVStageFunc(_T("avsync buffer"), m_pmfxDEC != nullptr && (m_nAVSyncMode & RGY_AVSYNC_FORCE_CFR) != 0,
+        [&](const QSVStageFrame *in, QSVStageFrame *out) {
+            avsync_unlock();
+            pNextFrame = in->pSurface;
+            lastSyncP = in->syncp;
+            mfxStatus avsync_sts = avsync_output(out);
+            //水増しが必要な場合は、同じ入力でもう一度呼ぶ
+            return (avsync_sts == MFX_ERR_NONE && bCheckPtsMultipleOutput) ? MFX_ERR_MORE_SURFACE : avsync_sts;
+        },
+        [&](QSVStageFrame *out) {
+            //avsyncのflush中は、check_ptsのキューにためられたフレームを取り出す
+            avsync_unlock();
+            pNextFrame = nullptr;
+            lastSyncP = nullptr;
+            return avsync_output(out);
+        })));
+
+    //フィルタの段: 次の段のプールのフレームに出力する
+    int nPoolIdx = 1;
+    auto add_filter_stage = [&](const unique_ptr<CVPPPlugin>& filter, const TCHAR *name) {
+        const SurfacePool& outPool = surfacePools[nPoolIdx++];
+        const unique_ptr<CVPPPlugin> *pFilter = &filter;
+        stageGraph.add(std::unique_ptr<QSVStage>(new QSVStageFunc(name, false,
+            [&, outPool, pFilter](const QSVStageFrame *in, QSVStageFrame *out) {
+                mfxFrameSurface1 *pSurfFilterOut = get_free_surface(outPool);
+                if (pSurfFilterOut == nullptr) {
+                    return MFX_ERR_MEMORY_ALLOC;
+                }
+                pNextFrame = in->pSurface;
+                lastSyncP = in->syncp;
+                mfxStatus filter_sts = filter_one_frame(*pFilter, &pNextFrame, &pSurfFilterOut);
+                if (filter_sts != MFX_ERR_NONE) {
+                    return filter_sts;
+                }
+                out->pSurface = pSurfFilterOut;
+                out->syncp = lastSyncP;
+                out->vppSyncp = in->vppSyncp;
+                return MFX_ERR_NONE;
+            })));
+    };
+    for (const auto& filter : m_VppPrePlugins) {
+        add_filter_stage(filter, _T("vpp pre"));
     }
-#endif //ENABLE_AVSW_READER
 
+    //vppの段
     if (m_pmfxVPP) {
-        //vppのフレームをflush
-        while (MFX_ERR_NONE <= sts || MFX_ERR_MORE_DATA == sts || MFX_ERR_MORE_SURFACE == sts) {
-            // MFX_ERR_MORE_SURFACE can be returned only by RunFrameVPPAsync
-            // MFX_ERR_MORE_DATA is accepted only from EncodeFrameAsync
-            if (pSurfCheckPts) {
-                //pSurfCheckPtsはcheckptsから出てきて、他の要素に投入するフレーム
-                //投入後、ロックを解除する必要がある
-                pSurfCheckPts->Data.Locked--;
-                pSurfCheckPts = nullptr;
-            }
-
-            pNextFrame = nullptr;
-
-            nEncSurfIdx = GetFreeSurface(m_pEncSurfaces.data(), m_EncResponse.NumFrameActual);
-            if (nEncSurfIdx == MSDK_INVALID_SURF_IDX) {
-                PrintMes(RGY_LOG_ERROR, _T("Failed to get free surface for enc.\n"));
+        const SurfacePool& outPool = surfacePools[nPoolIdx++];
+        auto vpp_output = [&, outPool](const QSVStageFrame *in, QSVStageFrame *out) {
+            mfxFrameSurface1 *pSurfVppOut = get_free_surface(outPool);
+            if (pSurfVppOut == nullptr) {
                 return MFX_ERR_MEMORY_ALLOC;
             }
-
-            pSurfEncIn = &m_pEncSurfaces[nEncSurfIdx];
-
-            if (MFX_ERR_NONE != (sts = GetFreeTask(&pCurrentTask)))
-                break;
-
-            get_all_free_surface(pSurfEncIn);
-
-            //for (int i_filter = 0; i_filter < (int)m_VppPrePlugins.size(); i_filter++) {
-            //    bVppAllFiltersFlushed &= m_VppPrePlugins[i_filter]->m_bPluginFlushed;
-            //    if (!m_VppPrePlugins[i_filter]->m_bPluginFlushed) {
-            //        mfxFrameSurface1 *pSurfFilterOut = pSurfVppPreFilter[i_filter + 1];
-            //        sts = filter_one_frame(m_VppPrePlugins[i_filter], &pNextFrame, &pSurfFilterOut);
-            //        if (sts == MFX_ERR_MORE_DATA) {
-            //            m_VppPrePlugins[i_filter]->m_bPluginFlushed = true;
-            //            sts = MFX_ERR_NONE;
-            //        }
-            //        MSDK_BREAK_ON_ERROR(sts);
-            //        pNextFrame = pSurfFilterOut;
-            //    }
-            //}
-            //MSDK_BREAK_ON_ERROR(sts);
-
-            sts = vpp_one_frame(pNextFrame, (m_VppPostPlugins.size()) ? pSurfVppPostFilter[0] : pSurfEncIn);
+            pNextFrame = nullptr;
+            lastSyncP = nullptr;
+            lastVppSyncP = nullptr;
+            mfxStatus vpp_sts = vpp_one_frame((in) ? in->pSurface : nullptr, pSurfVppOut);
             if (bVppRequireMoreFrame) {
-                break;
+                //flush中なら、vppが空になったことを示す
+                return MFX_ERR_MORE_DATA;
             }
-            if (sts != MFX_ERR_NONE)
-                break;
-
-            for (int i_filter = 0; i_filter < (int)m_VppPostPlugins.size(); i_filter++) {
-                mfxFrameSurface1 *pSurfFilterOut = pSurfVppPostFilter[i_filter + 1];
-                if (MFX_ERR_NONE != (sts = filter_one_frame(m_VppPostPlugins[i_filter], &pNextFrame, &pSurfFilterOut)))
-                    break;
-                pNextFrame = pSurfFilterOut;
+            if (vpp_sts != MFX_ERR_NONE) {
+                return vpp_sts;
             }
-            if (sts != MFX_ERR_NONE)
-                break;
-
-            sts = encode_one_frame(pNextFrame);
-        }
+            if (pNextFrame) {
+                out->pSurface = pNextFrame;
+                out->syncp = lastSyncP;
+                out->vppSyncp = lastVppSyncP;
+            }
+            //bob化などで余分にフレームを出力する場合は、同じ入力でもう一度呼ぶ
+            return (in && bVppMultipleOutput) ? MFX_ERR_MORE_SURFACE : MFX_ERR_NONE;
+        };
+        stageGraph.add(std::unique_ptr<QSVStage>(new QSVStageFunc(_T("vpp"), true,
+            vpp_output,
+            [vpp_output](QSVStageFrame *out) {
+                //vppのflush中は、vppに新たなフレームを投入しない
+                return vpp_output(nullptr, out);
+            })));
+    }
 
-        //MFX_ERR_MORE_DATAはvppにもうflushするべきフレームがないことを示す
-        QSV_IGNORE_STS(sts, MFX_ERR_MORE_DATA);
-        //エラーチェック
-        m_EncThread.m_stsThread = sts;
-        QSV_ERR_MES(sts, _T("Error in getting buffered frames from vpp."));
-        PrintMes(RGY_LOG_DEBUG, _T("Encode Thread: finished getting buffered frames from vpp.\n"));
+    for (const auto& filter : m_VppPostPlugins) {
+        add_filter_stage(filter, _T("vpp post"));
     }
 
-    //encのフレームをflush
-    while (MFX_ERR_NONE <= sts && m_pmfxENC) {
-        if (pSurfCheckPts) {
-            pSurfCheckPts->Data.Locked--;
-            pSurfCheckPts = nullptr;
+    //エンコードの段
+    auto encode_output = [&](const QSVStageFrame *in) {
+        //空いているフレームバッファを取得、空いていない場合は待機して、出力ストリームの書き出しを待ってから取得
+        mfxStatus enc_sts = GetFreeTask(&pCurrentTask);
+        if (enc_sts != MFX_ERR_NONE) {
+            return enc_sts;
         }
+        if (in == nullptr) {
+            //エンコーダのflush
+            return encode_one_frame(nullptr);
+        }
+        if (in->vppSyncp) {
+            pCurrentTask->vppSyncPoint.push_back(in->vppSyncp);
+        }
+        lastSyncP = in->syncp;
+        enc_sts = encode_one_frame(in->pSurface);
+        //MFX_ERR_MORE_DATAはエンコーダがフレームをため込んでいるだけ
+        return (enc_sts == MFX_ERR_MORE_DATA) ? MFX_ERR_NONE : enc_sts;
+    };
+    stageGraph.add(std::unique_ptr<QSVStage>(new QSVStageFunc(_T("encoder"), m_pmfxENC != nullptr,
+        [encode_output](const QSVStageFrame *in, QSVStageFrame *out) {
+            return encode_output(in);
+        },
+        [encode_output](QSVStageFrame *out) {
+            return encode_output(nullptr);
+        })));
+
+    //headの段の入力の終了・flushの完了、またはエラーの際の処理
+    auto on_head_end = [&](QSVStage *head, bool bDraining, mfxStatus sts_end) {
+        //MFX_ERR_MORE_DATAは入力の終了、またはheadの段にもうflushするべきフレームがないことを示す
+        QSV_IGNORE_STS(sts_end, MFX_ERR_MORE_DATA);
+        //エラーチェック
+        m_EncThread.m_stsThread = sts_end;
+        if (!bDraining) {
+            QSV_ERR_MES(sts_end, _T("Error in encoding pipeline."));
+            PrintMes(RGY_LOG_DEBUG, _T("Encode Thread: finished main loop.\n"));
+            //入力が終了したので、残りの音声を取得する
+            //音声ファイルの読み込みスレッドに残っている分もここで出力する (中断された場合は、残りの読み込みを待たない)
+            const bool bAborted = m_EncThread.m_bthForceAbort || (m_pAbortByUser != nullptr && *m_pAbortByUser);
+            auto ret = extract_audio(!bAborted);
+            RGY_ERR_MES(ret, _T("Error on extracting audio."));
+        } else {
+            QSV_ERR_MES(sts_end, strsprintf(_T("Error in getting buffered frames from %s."), head->name()).c_str());
+            PrintMes(RGY_LOG_DEBUG, _T("Encode Thread: finished getting buffered frames from %s.\n"), head->name());
+        }
+        return MFX_ERR_NONE;
+    };
+    auto on_flushed = [&](QSVStage *stage) {
+        if (stage != pStageAvsync) {
+            return;
+        }
+        avsync_unlock();
+#if ENABLE_AVSW_READER
+        //avsyncのキューまでflushしたら、音声もすべて書き出す
+        for (const auto& writer : m_pFileWriterListAudio) {
+            auto pAVCodecWriter = std::dynamic_pointer_cast<RGYOutputAvcodec>(writer);
+            if (pAVCodecWriter != nullptr) {
+                //エンコーダなどにキャッシュされたパケットを書き出す
+                pAVCodecWriter->WriteNextPacket(nullptr);
+            }
+        }
+#endif //ENABLE_AVSW_READER
+    };
 
-        if (MFX_ERR_NONE != (sts = GetFreeTask(&pCurrentTask)))
-            break;
-
-        sts = encode_one_frame(NULL);
+    //すべての段のflushが完了するまで処理する
+    sts = stageGraph.run(on_head_end, on_flushed);
+    if (sts != MFX_ERR_NONE) {
+        return sts;
     }
-    PrintMes(RGY_LOG_DEBUG, _T("Encode Thread: finished getting buffered frames from encoder.\n"));
-
-    //MFX_ERR_MORE_DATAはencにもうflushするべきフレームがないことを示す
-    QSV_IGNORE_STS(sts, MFX_ERR_MORE_DATA);
-    //エラーチェック
-    m_EncThread.m_stsThread = sts;
-    QSV_ERR_MES(sts, _T("Error in getting buffered frames from encoder."));
 
     //タスクプールのすべてのタスクの終了を確認
     while (MFX_ERR_NONE == sts) {
@@ -4750,7 +5066,7 @@ void CQSVPipeline::PrintMes(int log_level, const TCHAR *format, ...) {
 void CQSVPipeline::GetEncodeLibInfo(mfxVersion *ver, bool *hardware) {
     if (NULL != ver && NULL != hardware) {
         mfxIMPL impl;
-        m_mfxSession.QueryIMPL(&impl);
+        m_mfxSession->QueryIMPL(&impl);
         *hardware = !!Check_HWUsed(impl);
         *ver = m_mfxVer;
     }
@@ -4778,7 +5094,7 @@ const TCHAR *CQSVPipeline::GetInputMessage() {
 
 mfxStatus CQSVPipeline::CheckCurrentVideoParam(TCHAR *str, mfxU32 bufSize) {
     mfxIMPL impl;
-    m_mfxSession.QueryIMPL(&impl);
+    m_mfxSession->QueryIMPL(&impl);
 
     mfxFrameInfo SrcPicInfo = m_mfxVppParams.vpp.In;
     mfxFrameInfo DstPicInfo = m_mfxEncParams.mfx.FrameInfo;
@@ -4853,7 +5169,7 @@ mfxStatus CQSVPipeline::CheckCurrentVideoParam(TCHAR *str, mfxU32 bufSize) {
     }
 
     TCHAR cpuInfo[256] = { 0 };
-    getCPUInfo(cpuInfo, _countof(cpuInfo), &m_mfxSession);
+    getCPUInfo(cpuInfo, _countof(cpuInfo), m_mfxSession.get());
 
     TCHAR gpu_info[1024] = { 0 };
     if (Check_HWUsed(impl)) {
@@ -4878,9 +5194,11 @@ mfxStatus CQSVPipeline::CheckCurrentVideoParam(TCHAR *str, mfxU32 bufSize) {
     }
     if (Check_HWUsed(impl)) {
         static const TCHAR * const NUM_APPENDIX[] = { _T("st"), _T("nd"), _T("rd"), _T("th")};
-        mfxU32 iGPUID = GetAdapterID(m_mfxSession);
+        mfxU32 iGPUID = GetAdapterID(*m_mfxSession);
         PRINT_INFO(    _T("Media SDK      QuickSyncVideo (hardware encoder)%s, %d%s GPU, API v%d.%d\n"),
             get_low_power_str(videoPrm.mfx.LowPower), iGPUID + 1, NUM_APPENDIX[clamp(iGPUID, 0, _countof(NUM_APPENDIX) - 1)], m_mfxVer.Major, m_mfxVer.Minor);
+    } else if (qsv_is_sw_session(m_mfxSession.get())) {
+        PRINT_INFO(    _T("Media SDK      sw session (no GPU, debug only), API v%d.%d\n"), m_mfxVer.Major, m_mfxVer.Minor);
     } else {
         PRINT_INFO(    _T("Media SDK      software encoder, API v%d.%d\n"), m_mfxVer.Major, m_mfxVer.Minor);
     }
@@ -4952,8 +5270,10 @@ mfxStatus CQSVPipeline::CheckCurrentVideoParam(TCHAR *str, mfxU32 bufSize) {
             }
         }
     }
+    //--teeの主出力の情報は、m_pFileWriterの情報に含まれている
+    auto pTeeWriter = std::dynamic_pointer_cast<RGYOutputTee>(m_pFileWriter);
     for (auto pWriter : m_pFileWriterListAudio) {
-        if (pWriter && pWriter != m_pFileWriter) {
+        if (pWriter && pWriter != m_pFileWriter && !(pTeeWriter && pWriter == pTeeWriter->primary())) {
             inputMesSplitted = split(pWriter->GetOutputMessage(), _T("\n"));
             for (auto mes : inputMesSplitted) {
                 if (mes.length()) {
@@ -64,6 +64,7 @@
 #include <iostream>
 
 struct AVChapter;
+class HEVCHDRSei;
 
 enum {
     MFX_PRM_EX_SCENE_CHANGE = 0x01,
@@ -99,10 +100,19 @@ public:
     virtual mfxStatus Run(size_t SubThreadAffinityMask);
     virtual void Close();
     virtual mfxStatus ResetMFXComponents(sInputParams* pParams);
+    virtual mfxStatus CloseMFXComponents();
+    virtual mfxStatus InitMFXComponents();
+    virtual mfxStatus InitTaskPool();
     virtual mfxStatus ResetDevice();
     virtual mfxStatus CheckCurrentVideoParam(TCHAR *buf = NULL, mfxU32 bufSize = 0);
 
     virtual void SetAbortFlagPointer(bool *abort);
+    //映像の出力先を指定のRGYOutputに置き換える (Initの前に呼ぶこと)
+    virtual void SetOutputOverride(shared_ptr<RGYOutput> pWriter);
+    //映像の入力元を指定のRGYInputに置き換える (Initの前に呼ぶこと)
+    virtual void SetInputOverride(shared_ptr<RGYInput> pReader);
+    //処理段ごとの所要時間を指定の構造体に積算する (Initの前に呼ぶこと)
+    virtual void SetStageLatencyOverride(PerfStageLatency *pStageLatency);
 
     virtual mfxStatus GetEncodeStatusData(EncodeStatusData *data);
     virtual void GetEncodeLibInfo(mfxVersion *ver, bool *hardware);
@@ -125,8 +135,11 @@ protected:
 
     vector<shared_ptr<RGYOutput>> m_pFileWriterListAudio;
     shared_ptr<RGYOutput> m_pFileWriter;
+    shared_ptr<RGYOutput> m_pFileWriterOverride; //--segment-parallelで区間ごとの出力、--ladderで前処理の出力に使用する
     vector<shared_ptr<RGYInput>> m_AudioReaders;
     shared_ptr<RGYInput> m_pFileReader;
+    shared_ptr<RGYInput> m_pFileReaderOverride; //--ladderで各段の入力に使用する
+    PerfStageLatency *m_pStageLatencyOverride;  //--auto-tuneのキャリブレーションで使用する
 
     CQSVTaskControl m_TaskPool;
     mfxU16 m_nAsyncDepth;
@@ -144,7 +157,8 @@ protected:
     mfxExtCodingOption3 m_CodingOption3;
     mfxExtVP8CodingOption m_ExtVP8CodingOption;
     mfxExtHEVCParam m_ExtHEVCParam;
-    MFXVideoSession m_mfxSession;
+    unique_ptr<MFXVideoSession> m_mfxSession;
+    sSWSessionPrm m_swSessionPrm; //ソフトウェアによるsessionの代替実装を使用する場合の設定
     unique_ptr<MFXVideoDECODE> m_pmfxDEC;
     unique_ptr<MFXVideoENCODE> m_pmfxENC;
     unique_ptr<MFXVideoVPP>    m_pmfxVPP;
@@ -190,6 +204,7 @@ protected:
     unique_ptr<QSVAllocator> m_pMFXAllocator;
     unique_ptr<mfxAllocatorParams> m_pmfxAllocatorParams;
     int m_nMFXThreads;
+    int m_nCPUGen; //GetCPUGenで取得したCPUの世代 (未取得なら-1)
     MemType m_memType;
     bool m_bd3dAlloc;
     bool m_bExternalAlloc;
@@ -219,12 +234,17 @@ protected:
     virtual mfxStatus InitLog(sInputParams *pParams);
     virtual mfxStatus InitInput(sInputParams *pParams);
     virtual mfxStatus InitOutput(sInputParams *pParams);
+    //--teeの出力先を作成し、m_pFileWriterをRGYOutputTeeに置き換える
+    virtual mfxStatus InitOutputTee(sInputParams *pParams, const VideoInfo *pOutputVideoInfo, HEVCHDRSei *pHdrSei);
     virtual mfxStatus InitMfxDecParams(sInputParams *pInParams);
     virtual mfxStatus InitMfxEncParams(sInputParams *pParams);
     virtual mfxStatus InitMfxVppParams(sInputParams *pParams);
     virtual mfxStatus InitVppPrePlugins(sInputParams *pParams);
     virtual mfxStatus InitVppPostPlugins(sInputParams *pParams);
     virtual mfxStatus InitSession(bool useHWLib, mfxU16 memType);
+    //CPUの世代を返す
+    //初期化済みのsessionがあればそれを使用し、結果を保持して以降の呼び出しでは再利用する
+    virtual int GetCPUGen();
     virtual RGY_CSP EncoderCsp(const sInputParams *pParams, int *pShift);
     //virtual void InitVppExtParam();
     virtual mfxStatus CreateVppExtBuffers(sInputParams *pParams);
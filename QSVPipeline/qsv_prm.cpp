@@ -70,6 +70,8 @@ void init_qsvp_prm(sInputParams *prm) {
     prm->nVQPSensitivity   = QSV_DEFAULT_VQP_SENSITIVITY;
     prm->nPerfMonitorInterval = QSV_DEFAULT_PERF_MONITOR_INTERVAL;
     prm->nOutputBufSizeMB  = QSV_DEFAULT_OUTPUT_BUF_MB;
+    prm->fHLSTime          = QSV_DEFAULT_HLS_TIME;
+    prm->autoTune.calibFrames = QSV_DEFAULT_AUTO_TUNE_FRAMES;
     prm->nInputBufSize     = QSV_DEFAULT_INPUT_BUF_HW;
     prm->nOutputThread     = RGY_OUTPUT_THREAD_AUTO;
     prm->nAudioThread      = RGY_AUDIO_THREAD_AUTO;
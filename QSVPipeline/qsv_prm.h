@@ -37,6 +37,7 @@
 #include "mfxvp9.h"
 #include "convert_csp.h"
 #include "rgy_caption.h"
+#include "rgy_thread_affinity.h"
 
 #define QSVENCC_ABORT_EVENT _T("QSVEncC_abort_%u")
 
@@ -151,6 +152,51 @@ struct sVppParams {
     VppSubburn subburn;
 };
 
+//GPUを使用せず、ソフトウェアによるMFX sessionの代替実装で処理する (デバッグ・検証用)
+struct sSWSessionPrm {
+    int8_t  enable;
+    int8_t  asyncDepth;     //同時に処理中とできるタスク数 (0で--async-depthの値)
+    int16_t reorderDelay;   //デコーダ/エンコーダがフレームを保持する数
+    int32_t busyInterval;   //この回数に1回MFX_WRN_DEVICE_BUSYを返す (0で無効)
+    int32_t taskDurationUs; //1タスクあたりの擬似的な処理時間 (us)
+};
+
+//--auto-tuneでユーザーが指定したため調整しない値
+enum {
+    QSV_AUTO_TUNE_FIXED_ASYNC_DEPTH = 0x01, //--async-depth
+    QSV_AUTO_TUNE_FIXED_INPUT_BUF   = 0x02, //--input-buf
+    QSV_AUTO_TUNE_FIXED_OUTPUT_BUF  = 0x04, //--output-buf
+};
+
+//--auto-tuneのキャリブレーションに使用するエンコーダ
+enum {
+    QSV_AUTO_TUNE_ENC_AUTO = 0, //QSVを使用し、初期化できなければソフトウェアによる代替実装を使用する
+    QSV_AUTO_TUNE_ENC_SW,       //常にソフトウェアによる代替実装を使用する
+};
+
+static const CX_DESC list_auto_tune_enc[] = {
+    { _T("auto"), QSV_AUTO_TUNE_ENC_AUTO },
+    { _T("sw"),   QSV_AUTO_TUNE_ENC_SW   },
+    { NULL, 0 }
+};
+
+//--auto-tune ホストの性能の測定とキャリブレーションから、各バッファのサイズを決める
+struct sAutoTunePrm {
+    int8_t  enable;
+    int8_t  encMode;     //キャリブレーションに使用するエンコーダ (QSV_AUTO_TUNE_ENC_xxx)
+    uint8_t fixed;       //調整しない値 (QSV_AUTO_TUNE_FIXED_xxx)
+    int8_t  reserved;
+    int32_t memBudgetMB; //フレームバッファとキューに使用するメモリの上限 (MB, 0で自動)
+    int32_t calibFrames; //キャリブレーションでエンコードするフレーム数 (0でキャリブレーションを行わない)
+};
+
+//--ladderの各段の設定
+struct sLadderRung {
+    int nWidth;   //出力の幅
+    int nHeight;  //出力の高さ
+    int nBitrate; //ビットレート (kbps)
+};
+
 struct sInputParams
 {
     mfxU16 nInputFmt;     // RGY_INUPT_FMT_xxx
@@ -297,7 +343,7 @@ struct sInputParams
     RGYAVSync  nAVSyncMode;     //avsyncの方法 (RGY_AVSYNC_xxx)
     uint16_t   nProcSpeedLimit; //プリデコードする場合の処理速度制限 (0で制限なし)
     int8_t     nInputThread;
-    int8_t     unused;
+    int8_t     bOutputPrealloc; //出力ファイルの領域をあらかじめ確保する
     float      fSeekSec; //指定された秒数分先頭を飛ばす
     TCHAR     *pFramePosListLog;
     uint32_t   nFallback;
@@ -326,7 +372,19 @@ struct sInputParams
 
     C2AFormat  caption2ass;
 
-    int8_t     Reserved[980];
+    sSWSessionPrm swSession;
+    int        nSegmentParallel; //キーフレームで分割した区間を並列にエンコードする数 (0,1で無効)
+    RGYThreadAffinityPrm threadAffinity; //スレッドの役割ごとのCPU/NUMAの割り当て
+    sLadderRung *pLadderRungs; //--ladderの各段の設定
+    int        nLadderRungs;   //--ladderの段数 (0で無効)
+    int        nTeeCount;      //--teeの出力先の数
+    TCHAR    **ppTeeList;      //--teeの出力先のファイル名
+    float      fHLSTime;       //--hls-time HLSのセグメントの目標の長さ (秒)
+    TCHAR     *pMetricsSocket; //--metrics-socket 計測結果を返すUnixドメインソケットのパス
+    sAutoTunePrm autoTune;     //--auto-tune
+    int        nAudioQueueSize; //音声のキューの最大長 (パケット数, 0で既定値, --auto-tuneで設定する)
+
+    int8_t     Reserved[616];
 
     TCHAR strSrcFile[MAX_FILENAME_LEN];
     TCHAR strDstFile[MAX_FILENAME_LEN];
@@ -821,6 +879,7 @@ const int QSV_DEFAULT_CONVERGENCE = 90;
 const int QSV_DEFAULT_ACCURACY = 500;
 const int QSV_DEFAULT_FORCE_GOP_LEN = 1;
 const int QSV_DEFAULT_OUTPUT_BUF_MB = 8;
+const float QSV_DEFAULT_HLS_TIME = 6.0f;
 const uint32_t QSV_DEFAULT_BENCH = (1 << 1) | (1 << 4) | (1 << 7);
 
 const mfxU16 QSV_DEFAULT_VQP_STRENGTH = 10;
@@ -840,6 +899,8 @@ const mfxI16 QSV_DEFAULT_VPP_DELOGO_DEPTH = 128;
 
 const int QSV_DEFAULT_PERF_MONITOR_INTERVAL = 500;
 
+const int QSV_DEFAULT_AUTO_TUNE_FRAMES = 150;
+
 const int QSV_VPP_DENOISE_MIN = 0;
 const int QSV_VPP_DENOISE_MAX = 100;
 const int QSV_VPP_MCTF_AUTO = 0;
@@ -33,6 +33,7 @@
 #include <future>
 #include <algorithm>
 #include <type_traits>
+#include <chrono>
 #if (_MSC_VER >= 1800)
 #include <Windows.h>
 #include <VersionHelpers.h>
@@ -57,7 +58,9 @@
 #include "qsv_plugin.h"
 #include "rgy_osdep.h"
 #include "qsv_query.h"
+#include "qsv_sw_session.h"
 #include "qsv_hw_device.h"
+#include "qsv_query_cache.h"
 #include "cpu_info.h"
 
 #if 1
@@ -336,7 +339,7 @@ mfxU64 CheckVppFeaturesInternal(MFXVideoSession& session, mfxVersion mfxVer) {
         result |= VPP_FEATURE_DEINTERLACE_AUTO;
         result |= VPP_FEATURE_DEINTERLACE_IT_MANUAL;
     }
-    MFXVideoVPP vpp(session);
+    std::unique_ptr<MFXVideoVPP> vpp(qsv_create_vpp(&session));
     mfxIMPL impl;
     session.QueryIMPL(&impl);
     const auto HARDWARE_IMPL = make_array<mfxIMPL>(MFX_IMPL_HARDWARE, MFX_IMPL_HARDWARE_ANY, MFX_IMPL_HARDWARE2, MFX_IMPL_HARDWARE3, MFX_IMPL_HARDWARE4);
@@ -472,7 +475,7 @@ mfxU64 CheckVppFeaturesInternal(MFXVideoSession& session, mfxVersion mfxVer) {
             //bufの一番端はチェック用に開けてあるので、そこに構造体へのポインタを入れる
             *(buf.end()    - 1) = (mfxExtBuffer *)structIn;
             *(bufOut.end() - 1) = (mfxExtBuffer *)structOut;
-            mfxStatus ret = vpp.Query(&videoPrm, &videoPrmOut);
+            mfxStatus ret = vpp->Query(&videoPrm, &videoPrmOut);
             if (MFX_ERR_NONE <= ret) {
                 result |= (MFX_ERR_NONE == ret || MFX_WRN_PARTIAL_ACCELERATION == ret) ? featureNoErr : featureWarn;
             }
@@ -606,6 +609,52 @@ std::unique_ptr<CQSVHWDevice> InitHWDevice(MFXVideoSession& session, MemType& me
     return hwdev;
 }
 
+//問い合わせ結果のキャッシュに使用するデバイスのキー
+static std::string QueryCacheDeviceKey(MFXVideoSession& session) {
+    //ソフトウェアによる代替実装の結果はキャッシュしない
+    if (qsv_is_sw_session(&session)) {
+        return "";
+    }
+    mfxIMPL impl = 0;
+    mfxVersion ver;
+    RGY_MEMSET_ZERO(ver);
+    if (session.QueryIMPL(&impl) != MFX_ERR_NONE || session.QueryVersion(&ver) != MFX_ERR_NONE) {
+        return "";
+    }
+    mfxPlatform platform;
+    RGY_MEMSET_ZERO(platform);
+    if (check_lib_version(ver, MFX_LIB_VERSION_1_19)) {
+        session.QueryPlatform(&platform);
+    }
+    return strsprintf("impl %x, API v%d.%d, codename %d, device %04x, runtime %s",
+        impl, ver.Major, ver.Minor, platform.CodeName, platform.DeviceId, QSVQueryCache::runtimeStamp().c_str());
+}
+
+//キャッシュがあればそれを返し、なければprobeで問い合わせてキャッシュに登録する
+template<typename Func>
+static mfxU64 QueryCached(MFXVideoSession& session, const std::string& item, Func probe) {
+    auto& cache = QSVQueryCache::get();
+    const auto start = std::chrono::steady_clock::now();
+    auto elapsedMs = [start]() {
+        return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count() * 1e-3;
+    };
+    const auto devkey = (cache.enabled()) ? QueryCacheDeviceKey(session) : std::string();
+    uint64_t value = 0;
+    double probeMs = 0.0;
+    if (devkey.length() > 0 && cache.lookup(devkey, item, &value, &probeMs)) {
+        cache.addStat(true, elapsedMs(), probeMs);
+        return value;
+    }
+    value = probe();
+    const double ms = elapsedMs();
+    cache.addStat(false, ms, 0.0);
+    //デバイスのキーが得られた(セッションが初期化済みの)場合の結果なので、何もサポートされていないという結果もキャッシュする
+    if (devkey.length() > 0) {
+        cache.store(devkey, item, value, ms);
+    }
+    return value;
+}
+
 mfxU64 CheckVppFeatures(MFXVideoSession& session, mfxVersion ver) {
     mfxU64 feature = 0x00;
     if (!check_lib_version(ver, MFX_LIB_VERSION_1_3)) {
@@ -617,7 +666,9 @@ mfxU64 CheckVppFeatures(MFXVideoSession& session, mfxVersion ver) {
         feature |= VPP_FEATURE_DETAIL_ENHANCEMENT;
         feature |= VPP_FEATURE_PROC_AMP;
     } else {
-        feature = CheckVppFeaturesInternal(session, ver);
+        feature = QueryCached(session, strsprintf("vpp_v%d.%d", ver.Major, ver.Minor), [&]() {
+            return CheckVppFeaturesInternal(session, ver);
+        });
     }
 
     return feature;
@@ -638,7 +689,9 @@ mfxU64 CheckVppFeatures(mfxVersion ver) {
         MFXVideoSession session;
         if (InitSession(session, true, memType) == MFX_ERR_NONE) {
             if (auto hwdevice = InitHWDevice(session, memType)) {
-                feature = CheckVppFeaturesInternal(session, ver);
+                feature = QueryCached(session, strsprintf("vpp_v%d.%d", ver.Major, ver.Minor), [&]() {
+                    return CheckVppFeaturesInternal(session, ver);
+                });
             }
         }
 
@@ -647,7 +700,7 @@ mfxU64 CheckVppFeatures(mfxVersion ver) {
     return feature;
 }
 
-mfxU64 CheckEncodeFeature(MFXVideoSession& session, mfxVersion mfxVer, mfxU16 ratecontrol, mfxU32 codecId) {
+static mfxU64 CheckEncodeFeatureInternal(MFXVideoSession& session, mfxVersion mfxVer, mfxU16 ratecontrol, mfxU32 codecId) {
     if (codecId == MFX_CODEC_HEVC && !check_lib_version(mfxVer, MFX_LIB_VERSION_1_15)) {
         return 0x00;
     }
@@ -672,7 +725,7 @@ mfxU64 CheckEncodeFeature(MFXVideoSession& session, mfxVersion mfxVer, mfxU16 ra
         }
     }
 
-    MFXVideoENCODE encode(session);
+    std::unique_ptr<MFXVideoENCODE> encode(qsv_create_encode(&session));
 
     mfxExtCodingOption cop;
     mfxExtCodingOption2 cop2;
@@ -803,7 +856,7 @@ mfxU64 CheckEncodeFeature(MFXVideoSession& session, mfxVersion mfxVer, mfxU16 ra
     videoPrm.NumExtParam = (mfxU16)bufOut.size();
     videoPrm.ExtParam = &bufOut[0];
 
-    mfxStatus ret = encode.Query(&videoPrm, &videoPrmOut);
+    mfxStatus ret = encode->Query(&videoPrm, &videoPrmOut);
 
     mfxU64 result = (MFX_ERR_NONE <= ret && videoPrm.mfx.RateControlMethod == videoPrmOut.mfx.RateControlMethod) ? ENC_FEATURE_CURRENT_RC : 0x00;
     if (result) {
@@ -821,7 +874,7 @@ mfxU64 CheckEncodeFeature(MFXVideoSession& session, mfxVersion mfxVer, mfxU16 ra
                 memcpy(&videoPrmOut, &videoPrm, sizeof(videoPrm));
                 videoPrm.NumExtParam = (mfxU16)bufOut.size();
                 videoPrm.ExtParam = &bufOut[0];
-                if (MFX_ERR_NONE <= encode.Query(&videoPrm, &videoPrmOut) && videoPrm.mfx.RateControlMethod == videoPrmOut.mfx.RateControlMethod)
+                if (MFX_ERR_NONE <= encode->Query(&videoPrm, &videoPrmOut) && videoPrm.mfx.RateControlMethod == videoPrmOut.mfx.RateControlMethod)
                     result |= flag;
                 videoPrm.mfx.RateControlMethod = original_method;
                 set_default_quality_prm();
@@ -843,7 +896,7 @@ mfxU64 CheckEncodeFeature(MFXVideoSession& session, mfxVersion mfxVer, mfxU16 ra
             memcpy(&cop2Out, &cop2, sizeof(cop2)); \
             memcpy(&cop3Out, &cop3, sizeof(cop3)); \
             memcpy(&hevcOut, &hevc, sizeof(hevc)); \
-            auto check_ret = encode.Query(&videoPrm, &videoPrmOut); \
+            auto check_ret = encode->Query(&videoPrm, &videoPrmOut); \
             if (MFX_ERR_NONE <= check_ret \
                 && (membersIn) == (membersOut) \
                 && videoPrm.mfx.RateControlMethod == videoPrmOut.mfx.RateControlMethod) { \
@@ -945,6 +998,12 @@ mfxU64 CheckEncodeFeature(MFXVideoSession& session, mfxVersion mfxVer, mfxU16 ra
     return result;
 }
 
+mfxU64 CheckEncodeFeature(MFXVideoSession& session, mfxVersion mfxVer, mfxU16 ratecontrol, mfxU32 codecId) {
+    return QueryCached(session, strsprintf("enc_%08x_rc%d_v%d.%d", codecId, ratecontrol, mfxVer.Major, mfxVer.Minor), [&]() {
+        return CheckEncodeFeatureInternal(session, mfxVer, ratecontrol, codecId);
+    });
+}
+
 //サポートする機能のチェックをAPIバージョンのみで行う
 //API v1.6以降はCheckEncodeFeatureを使うべき
 //同一のAPIバージョンでも環境により異なることが多くなるため
@@ -0,0 +1,327 @@
+﻿// -----------------------------------------------------------------------------------------
+// QSVEnc/NVEnc by rigaya
+// -----------------------------------------------------------------------------------------
+// The MIT License
+//
+// Copyright (c) 2011-2016 rigaya
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// --------------------------------------------------------------------------------------------
+
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#include <sys/types.h>
+#include <sys/stat.h>
+#if !(defined(_WIN32) || defined(_WIN64))
+#include <unistd.h>
+#endif
+#include "rgy_osdep.h"
+#include "rgy_tchar.h"
+#include "rgy_util.h"
+#include "rgy_version.h"
+#include "qsv_query_cache.h"
+
+static const char *QSV_QUERY_CACHE_HEADER = "QSVEncQueryCache";
+
+//ファイルを示す文字列 (パス・サイズ・更新日時, 見つからなければ空文字列)
+static std::string qsv_query_cache_file_stamp(const tstring& path) {
+#if defined(_WIN32) || defined(_WIN64)
+    WIN32_FILE_ATTRIBUTE_DATA attr = { 0 };
+    if (path.length() == 0 || !GetFileAttributesEx(path.c_str(), GetFileExInfoStandard, &attr)) {
+        return "";
+    }
+    return strsprintf("%s %u%08u %08x%08x", tchar_to_string(path).c_str(),
+        attr.nFileSizeHigh, attr.nFileSizeLow, attr.ftLastWriteTime.dwHighDateTime, attr.ftLastWriteTime.dwLowDateTime);
+#else
+    struct stat st;
+    if (path.length() == 0 || stat(path.c_str(), &st) != 0) {
+        return "";
+    }
+    return strsprintf("%s %lld %lld", path.c_str(), (long long)st.st_size, (long long)st.st_mtime);
+#endif
+}
+
+//ビルドを示す文字列
+//__DATE__/__TIME__はこのファイルをコンパイルした時刻でしかないので、実行ファイルそのものを示す文字列を使用する
+static std::string qsv_query_cache_build() {
+    static std::once_flag once;
+    static std::string build;
+    std::call_once(once, []() {
+#if defined(_WIN32) || defined(_WIN64)
+        TCHAR path[4096] = { 0 };
+        const tstring exePath = (GetModuleFileName(NULL, path, _countof(path)) > 0) ? path : _T("");
+#else
+        char path[4096] = { 0 };
+        const ssize_t len = readlink("/proc/self/exe", path, sizeof(path) - 1);
+        const tstring exePath = (len > 0) ? std::string(path, len) : std::string();
+#endif
+        build = strsprintf("%s %s %s", VER_STR_FILEVERSION, tchar_to_string(BUILD_ARCH_STR).c_str(), qsv_query_cache_file_stamp(exePath).c_str());
+    });
+    return build;
+}
+
+//キャッシュのファイルの場所
+static tstring qsv_query_cache_filename() {
+#if defined(_WIN32) || defined(_WIN64)
+    const TCHAR *dir = _tgetenv(_T("LOCALAPPDATA"));
+    if (dir == nullptr || dir[0] == _T('\0')) {
+        return _T("");
+    }
+    return tstring(dir) + _T("\\QSVEnc\\query_cache.txt");
+#else
+    const char *dir = getenv("XDG_CACHE_HOME");
+    if (dir != nullptr && dir[0] != '\0') {
+        return tstring(dir) + "/qsvenc/query_cache.txt";
+    }
+    dir = getenv("HOME");
+    if (dir == nullptr || dir[0] == '\0') {
+        return "";
+    }
+    return tstring(dir) + "/.cache/qsvenc/query_cache.txt";
+#endif
+}
+
+QSVQueryCache& QSVQueryCache::get() {
+    static QSVQueryCache cache;
+    return cache;
+}
+
+QSVQueryCache::QSVQueryCache() :
+    m_mtx(),
+    m_bLoaded(false),
+    m_bDirty(false),
+    m_sFilename(qsv_query_cache_filename()),
+    m_data(),
+    m_stats() {
+    memset(&m_stats, 0, sizeof(m_stats));
+}
+
+QSVQueryCache::~QSVQueryCache() {
+    save();
+}
+
+std::string QSVQueryCache::runtimeStamp() {
+#if defined(_WIN32) || defined(_WIN64)
+    //Windowsでは、MediaSDKのランタイムはドライバに含まれる
+    static std::once_flag once;
+    static std::string stamp;
+    std::call_once(once, []() {
+#if defined(_M_X64)
+        const TCHAR *runtimeNames[] = { _T("libmfxhw64.dll"), _T("libmfxsw64.dll") };
+#else
+        const TCHAR *runtimeNames[] = { _T("libmfxhw32.dll"), _T("libmfxsw32.dll") };
+#endif
+        for (auto name : runtimeNames) {
+            HMODULE hModule = GetModuleHandle(name);
+            TCHAR path[4096] = { 0 };
+            if (hModule != NULL && GetModuleFileName(hModule, path, _countof(path)) > 0) {
+                stamp = qsv_query_cache_file_stamp(path);
+                if (stamp.length() > 0) {
+                    break;
+                }
+            }
+        }
+    });
+    return stamp;
+#else
+    //Linuxでは、MediaSDKのランタイムとVA-APIのドライバの両方で区別する
+    //VA-APIのドライバはデバイスの初期化時に読み込まれるので、見つかるまでは毎回探しなおす
+    static std::mutex mtx;
+    static std::string stampCache;
+    std::lock_guard<std::mutex> lock(mtx);
+    if (stampCache.length() > 0) {
+        return stampCache;
+    }
+    std::string mfxStamp, driverStamp;
+    FILE *fp = fopen("/proc/self/maps", "r");
+    if (fp) {
+        char buf[4096];
+        while (fgets(buf, sizeof(buf), fp) != nullptr) {
+            const char *path = strchr(buf, '/');
+            if (path == nullptr) {
+                continue;
+            }
+            const bool isRuntime = strstr(path, "libmfxhw") != nullptr || strstr(path, "libmfxsw") != nullptr;
+            const bool isDriver = strstr(path, "_drv_video.so") != nullptr;
+            if ((!isRuntime || mfxStamp.length() > 0) && (!isDriver || driverStamp.length() > 0)) {
+                continue;
+            }
+            std::string filePath = path;
+            while (filePath.length() > 0 && (filePath.back() == '\n' || filePath.back() == '\r')) {
+                filePath.pop_back();
+            }
+            ((isRuntime) ? mfxStamp : driverStamp) = qsv_query_cache_file_stamp(filePath);
+        }
+        fclose(fp);
+    }
+    const auto stamp = mfxStamp + ", driver " + driverStamp;
+    if (driverStamp.length() > 0) {
+        stampCache = stamp;
+    }
+    return stamp;
+#endif
+}
+
+bool QSVQueryCache::enabled() {
+    return m_sFilename.length() > 0;
+}
+
+tstring QSVQueryCache::filename() {
+    return m_sFilename;
+}
+
+void QSVQueryCache::load() {
+    //m_mtxをロックした状態で呼ぶこと
+    if (m_bLoaded) {
+        return;
+    }
+    m_bLoaded = true;
+    FILE *fp = nullptr;
+    if (m_sFilename.length() == 0 || _tfopen_s(&fp, m_sFilename.c_str(), _T("r")) != 0 || fp == nullptr) {
+        return;
+    }
+    std::vector<std::string> lines;
+    {
+        char buf[4096];
+        while (fgets(buf, sizeof(buf), fp) != nullptr) {
+            std::string line = buf;
+            while (line.length() > 0 && (line.back() == '\n' || line.back() == '\r')) {
+                line.pop_back();
+            }
+            lines.push_back(line);
+        }
+        fclose(fp);
+    }
+    //キャッシュ形式のバージョンやビルドが異なる場合は、すべて破棄する
+    if (lines.size() < 2
+        || lines[0] != strsprintf("%s %d", QSV_QUERY_CACHE_HEADER, QSV_QUERY_CACHE_VERSION)
+        || lines[1] != std::string("build ") + qsv_query_cache_build()) {
+        m_bDirty = true;
+        return;
+    }
+    std::map<std::string, CacheEntry> *section = nullptr;
+    for (size_t i = 2; i < lines.size(); i++) {
+        const auto& line = lines[i];
+        if (line.length() == 0) {
+            continue;
+        }
+        if (line.front() == '[' && line.back() == ']') {
+            section = &m_data[line.substr(1, line.length() - 2)];
+            continue;
+        }
+        char item[256] = { 0 };
+        unsigned long long value = 0;
+        double probeMs = 0.0;
+        if (section == nullptr || sscanf(line.c_str(), "%255s %llx %lf", item, &value, &probeMs) != 3) {
+            //壊れている場合は、読み込んだものも含めてすべて破棄する
+            m_data.clear();
+            m_bDirty = true;
+            return;
+        }
+        (*section)[item] = { (uint64_t)value, probeMs };
+    }
+}
+
+bool QSVQueryCache::save() {
+    std::lock_guard<std::mutex> lock(m_mtx);
+    if (!m_bDirty || m_sFilename.length() == 0) {
+        return true;
+    }
+    auto dir = PathRemoveFileSpecFixed(m_sFilename);
+    if (dir.first == 0 || !CreateDirectoryRecursive(dir.second.c_str())) {
+        return false;
+    }
+    //書き込み途中のファイルが読まれないよう、一時ファイルに書き出してから置き換える
+#if defined(_WIN32) || defined(_WIN64)
+    const tstring tmpname = m_sFilename + strsprintf(_T(".%u.tmp"), (uint32_t)GetCurrentProcessId());
+#else
+    const tstring tmpname = m_sFilename + strsprintf(".%d.tmp", (int)getpid());
+#endif
+    FILE *fp = nullptr;
+    if (_tfopen_s(&fp, tmpname.c_str(), _T("w")) != 0 || fp == nullptr) {
+        return false;
+    }
+    fprintf(fp, "%s %d\n", QSV_QUERY_CACHE_HEADER, QSV_QUERY_CACHE_VERSION);
+    fprintf(fp, "build %s\n", qsv_query_cache_build().c_str());
+    for (const auto& section : m_data) {
+        fprintf(fp, "[%s]\n", section.first.c_str());
+        for (const auto& entry : section.second) {
+            fprintf(fp, "%s %llx %.3f\n", entry.first.c_str(), (unsigned long long)entry.second.value, entry.second.probeMs);
+        }
+    }
+    const bool writeError = ferror(fp) != 0;
+    fclose(fp);
+    if (writeError) {
+        _tremove(tmpname.c_str());
+        return false;
+    }
+#if defined(_WIN32) || defined(_WIN64)
+    const bool replaced = MoveFileEx(tmpname.c_str(), m_sFilename.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+    const bool replaced = rename(tmpname.c_str(), m_sFilename.c_str()) == 0;
+#endif
+    if (!replaced) {
+        _tremove(tmpname.c_str());
+        return false;
+    }
+    m_bDirty = false;
+    return true;
+}
+
+bool QSVQueryCache::lookup(const std::string& devkey, const std::string& item, uint64_t *value, double *probeMs) {
+    std::lock_guard<std::mutex> lock(m_mtx);
+    load();
+    auto section = m_data.find(devkey);
+    if (section == m_data.end()) {
+        return false;
+    }
+    auto entry = section->second.find(item);
+    if (entry == section->second.end()) {
+        return false;
+    }
+    *value = entry->second.value;
+    *probeMs = entry->second.probeMs;
+    return true;
+}
+
+void QSVQueryCache::store(const std::string& devkey, const std::string& item, uint64_t value, double probeMs) {
+    std::lock_guard<std::mutex> lock(m_mtx);
+    load();
+    m_data[devkey][item] = { value, probeMs };
+    m_bDirty = true;
+}
+
+void QSVQueryCache::addStat(bool hit, double elapsedMs, double savedMs) {
+    std::lock_guard<std::mutex> lock(m_mtx);
+    if (hit) {
+        m_stats.hit++;
+        m_stats.hitMs += elapsedMs;
+        m_stats.savedMs += savedMs;
+    } else {
+        m_stats.miss++;
+        m_stats.missMs += elapsedMs;
+    }
+}
+
+QSVQueryCacheStats QSVQueryCache::stats() {
+    std::lock_guard<std::mutex> lock(m_mtx);
+    return m_stats;
+}
@@ -0,0 +1,91 @@
+﻿// -----------------------------------------------------------------------------------------
+// QSVEnc/NVEnc by rigaya
+// -----------------------------------------------------------------------------------------
+// The MIT License
+//
+// Copyright (c) 2011-2016 rigaya
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// --------------------------------------------------------------------------------------------
+
+#ifndef __QSV_QUERY_CACHE_H__
+#define __QSV_QUERY_CACHE_H__
+
+#include <cstdint>
+#include <string>
+#include <map>
+#include <mutex>
+#include "rgy_tchar.h"
+#include "rgy_util.h"
+
+//CheckEncodeFeature/CheckVppFeaturesの結果をファイルに保存し、次回以降の起動時の問い合わせを省略する
+//  - ファイル全体はキャッシュ形式のバージョンとビルド (実行ファイルのパス・サイズ・更新日時) で、各エントリはデバイスのキー
+//    (実装・APIバージョン・GPUの世代/DeviceId・MediaSDKランタイムとドライバのファイル) で区別し、
+//    いずれかが変わった場合には、自動的に無効となり再度問い合わせを行う
+//  - キャッシュのファイルは、Windowsでは %LOCALAPPDATA%\QSVEnc\query_cache.txt、
+//    Linuxでは $XDG_CACHE_HOME/qsvenc/query_cache.txt (未設定なら ~/.cache/qsvenc/query_cache.txt)
+
+//キャッシュ形式のバージョン (問い合わせの内容を変更した場合には、これを更新する)
+static const int QSV_QUERY_CACHE_VERSION = 2;
+
+struct QSVQueryCacheStats {
+    int hit;        //キャッシュを使用した回数
+    int miss;       //実際に問い合わせを行った回数
+    double hitMs;   //キャッシュを使用した場合にかかった時間の合計
+    double missMs;  //実際に問い合わせを行った場合にかかった時間の合計
+    double savedMs; //キャッシュを使用したことで省略された問い合わせの時間 (保存時の計測値の合計)
+};
+
+class QSVQueryCache {
+public:
+    static QSVQueryCache& get();
+    ~QSVQueryCache();
+
+    //MediaSDKのランタイム (LinuxではVA-APIのドライバも) のファイルを示す文字列 (パス・サイズ・更新日時)
+    static std::string runtimeStamp();
+
+    bool enabled();
+    tstring filename();
+
+    //devkey/itemに対応する値があればtrueを返し、valueと保存時の問い合わせ時間を返す
+    bool lookup(const std::string& devkey, const std::string& item, uint64_t *value, double *probeMs);
+    void store(const std::string& devkey, const std::string& item, uint64_t value, double probeMs);
+    void addStat(bool hit, double elapsedMs, double savedMs);
+    QSVQueryCacheStats stats();
+
+    //変更があればファイルに書き出す
+    bool save();
+protected:
+    QSVQueryCache();
+    void load();
+
+    struct CacheEntry {
+        uint64_t value;
+        double probeMs;
+    };
+    std::mutex m_mtx;
+    bool m_bLoaded;
+    bool m_bDirty;
+    tstring m_sFilename;
+    std::map<std::string, std::map<std::string, CacheEntry>> m_data; //devkey -> item -> entry
+    QSVQueryCacheStats m_stats;
+};
+
+#endif //__QSV_QUERY_CACHE_H__
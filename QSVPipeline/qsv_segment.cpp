@@ -0,0 +1,619 @@
+﻿// -----------------------------------------------------------------------------------------
+// QSVEnc/NVEnc by rigaya
+// -----------------------------------------------------------------------------------------
+// The MIT License
+//
+// Copyright (c) 2011-2016 rigaya
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// --------------------------------------------------------------------------------------------
+
+#include <cstdio>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include "rgy_osdep.h"
+#include "rgy_tchar.h"
+#include "rgy_util.h"
+#include "rgy_avutil.h"
+#include "rgy_bitstream.h"
+#include "rgy_status.h"
+#include "rgy_output_avcodec.h"
+#include "qsv_pipeline.h"
+#include "qsv_segment.h"
+
+std::vector<sTrim> qsv_split_segments(const std::vector<int>& keyFrames, int nFrames, int nSegments, int minFrames) {
+    std::vector<sTrim> segments;
+    if (keyFrames.size() == 0) {
+        return segments;
+    }
+    //総フレーム数が不明な場合は、最後のキーフレームまでで均等に分割する
+    const int lastFrame = (nFrames > 0) ? nFrames : keyFrames.back() + 1;
+    std::vector<int> startList = { keyFrames.front() };
+    for (int i = 1; i < nSegments; i++) {
+        const int target = (int)((int64_t)lastFrame * i / nSegments);
+        //targetに最も近いキーフレームを区間の開始位置とする
+        auto it = std::lower_bound(keyFrames.begin(), keyFrames.end(), target);
+        int start = 0;
+        if (it == keyFrames.end()) {
+            start = keyFrames.back();
+        } else if (it != keyFrames.begin() && target - *(it - 1) < *it - target) {
+            start = *(it - 1);
+        } else {
+            start = *it;
+        }
+        //短すぎる区間はつくらない
+        if (start - startList.back() < minFrames
+            || (nFrames > 0 && nFrames - start < minFrames)) {
+            continue;
+        }
+        startList.push_back(start);
+    }
+    for (size_t i = 0; i < startList.size(); i++) {
+        sTrim trim;
+        trim.start = startList[i];
+        trim.fin = (i + 1 < startList.size()) ? startList[i + 1] - 1 : TRIM_MAX;
+        segments.push_back(trim);
+    }
+    return segments;
+}
+
+int qsv_segment_bitrate(int targetKbps, int maxKbps, int fpsN, int fpsD, int64_t doneBytes, int doneFrames, int remainFrames) {
+    if (targetKbps <= 0 || fpsN <= 0 || fpsD <= 0 || doneFrames <= 0 || remainFrames <= 0) {
+        return targetKbps;
+    }
+    const double doneSec = doneFrames * (double)fpsD / fpsN;
+    const double remainSec = remainFrames * (double)fpsD / fpsN;
+    //完了した区間の、目標に対する超過分 (kbit)
+    const double overKbit = doneBytes * 8.0 / 1000.0 - targetKbps * doneSec;
+    double kbps = targetKbps - overKbit / remainSec;
+    kbps = clamp(kbps, targetKbps * (1.0 - QSV_SEGMENT_BITRATE_ADJUST_MAX), targetKbps * (1.0 + QSV_SEGMENT_BITRATE_ADJUST_MAX));
+    if (maxKbps > 0) {
+        kbps = (std::min)(kbps, (double)maxKbps);
+    }
+    return (std::max)(1, (int)(kbps + 0.5));
+}
+
+RGYOutputSegment::RGYOutputSegment() :
+    m_sFilename(),
+    m_nFileOffset(0),
+    m_frames() {
+    m_strWriterName = _T("segment");
+    m_OutType = OUT_TYPE_BITSTREAM;
+}
+
+RGYOutputSegment::~RGYOutputSegment() {
+    Close();
+}
+
+RGY_ERR RGYOutputSegment::Init(const TCHAR *strFileName, const VideoInfo *pOutputInfo, const void *prm) {
+    UNREFERENCED_PARAMETER(pOutputInfo);
+    UNREFERENCED_PARAMETER(prm);
+    //strFileNameは最終的な出力ファイル名なので、区間ごとの一時ファイル名は事前に設定しておく
+    if (m_sFilename.length() == 0) {
+        m_sFilename = tstring(strFileName) + _T(".seg.tmp");
+    }
+    FILE *fp = NULL;
+    int error = _tfopen_s(&fp, m_sFilename.c_str(), _T("wb"));
+    if (error != 0 || fp == NULL) {
+        AddMessage(RGY_LOG_ERROR, _T("failed to open temporary file \"%s\": %s\n"), m_sFilename.c_str(), _tcserror(error));
+        return RGY_ERR_FILE_OPEN;
+    }
+    m_fDest.reset(fp);
+    m_nFileOffset = 0;
+    m_frames.clear();
+    AddMessage(RGY_LOG_DEBUG, _T("Opened temporary file \"%s\"\n"), m_sFilename.c_str());
+    m_bInited = true;
+    return RGY_ERR_NONE;
+}
+
+RGY_ERR RGYOutputSegment::WriteNextFrame(RGYBitstream *pBitstream) {
+    if (pBitstream == nullptr) {
+        AddMessage(RGY_LOG_ERROR, _T("Invalid call: WriteNextFrame\n"));
+        return RGY_ERR_NULL_PTR;
+    }
+    const size_t nBytesWritten = _fwrite_nolock(pBitstream->data(), 1, pBitstream->size(), m_fDest.get());
+    if (nBytesWritten != pBitstream->size()) {
+        AddMessage(RGY_LOG_ERROR, _T("Error writing file.\nNot enough disk space!\n"));
+        return RGY_ERR_UNDEFINED_BEHAVIOR;
+    }
+    SegmentFrame frame;
+    frame.offset = m_nFileOffset;
+    frame.size = (uint32_t)pBitstream->size();
+    frame.frametype = (uint32_t)pBitstream->frametype();
+    frame.pts = pBitstream->pts();
+    frame.dts = pBitstream->dts();
+    m_frames.push_back(frame);
+    m_nFileOffset += pBitstream->size();
+
+    m_pEncSatusInfo->SetOutputData(pBitstream->frametype(), pBitstream->size(), 0);
+    pBitstream->setSize(0);
+    return RGY_ERR_NONE;
+}
+
+RGY_ERR RGYOutputSegment::WriteNextFrame(RGYFrame *pSurface) {
+    UNREFERENCED_PARAMETER(pSurface);
+    return RGY_ERR_UNSUPPORTED;
+}
+
+void RGYOutputSegment::Close() {
+    //結合時に使用するので、m_framesは残しておく
+    RGYOutput::Close();
+}
+
+RGY_ERR qsv_stitch_segments(const std::vector<std::shared_ptr<RGYOutputSegment>>& segments,
+    std::shared_ptr<RGYOutput> pWriter, RGYTimestamp *pTimestamp, std::shared_ptr<RGYLog> pLog) {
+    if (segments.size() == 0) {
+        return RGY_ERR_NONE;
+    }
+    const auto& videoInfo = segments[0]->videoOutputInfo();
+    const int64_t frameDuration = (std::max)((int64_t)1, (int64_t)(HW_TIMEBASE * (double)videoInfo.fpsD / videoInfo.fpsN + 0.5));
+
+    //各区間の先頭が直前の区間の最後のフレームの直後になるよう、区間ごとのタイムスタンプのオフセットを求める
+    //区間内のタイムスタンプの間隔はそのまま維持する
+    std::vector<int64_t> ptsOffset(segments.size(), 0);
+    std::vector<int64_t> ptsList;
+    int64_t nextPts = 0;
+    for (size_t iseg = 0; iseg < segments.size(); iseg++) {
+        const auto& frames = segments[iseg]->frames();
+        if (frames.size() == 0) {
+            continue;
+        }
+        int64_t firstPts = frames[0].pts;
+        int64_t lastPts = frames[0].pts;
+        for (const auto& frame : frames) {
+            firstPts = (std::min)(firstPts, frame.pts);
+            lastPts = (std::max)(lastPts, frame.pts);
+        }
+        ptsOffset[iseg] = nextPts - firstPts;
+        nextPts = lastPts + ptsOffset[iseg] + frameDuration;
+        for (const auto& frame : frames) {
+            ptsList.push_back(frame.pts + ptsOffset[iseg]);
+        }
+    }
+    //各フレームのdurationは次のフレームのptsとの差とする
+    if (pTimestamp) {
+        std::sort(ptsList.begin(), ptsList.end());
+        for (size_t i = 0; i < ptsList.size(); i++) {
+            pTimestamp->add(ptsList[i], (i + 1 < ptsList.size()) ? ptsList[i + 1] - ptsList[i] : frameDuration);
+        }
+    }
+
+    RGY_ERR ret = RGY_ERR_NONE;
+    RGYBitstream bitstream = RGYBitstreamInit();
+    for (size_t iseg = 0; ret == RGY_ERR_NONE && iseg < segments.size(); iseg++) {
+        const auto& segment = segments[iseg];
+        FILE *fp = NULL;
+        int error = _tfopen_s(&fp, segment->filename().c_str(), _T("rb"));
+        if (error != 0 || fp == NULL) {
+            pLog->write(RGY_LOG_ERROR, _T("failed to open temporary file \"%s\": %s\n"), segment->filename().c_str(), _tcserror(error));
+            ret = RGY_ERR_FILE_OPEN;
+            break;
+        }
+        unique_ptr<FILE, fp_deleter> fpSegment(fp, fp_deleter());
+        for (const auto& frame : segment->frames()) {
+            if (bitstream.bufsize() < frame.size) {
+                if (RGY_ERR_NONE != (ret = bitstream.init(frame.size * 2))) {
+                    pLog->write(RGY_LOG_ERROR, _T("failed to allocate memory for bitstream.\n"));
+                    break;
+                }
+            }
+            if (_fseeki64(fpSegment.get(), frame.offset, SEEK_SET) != 0
+                || frame.size != fread(bitstream.bufptr(), 1, frame.size, fpSegment.get())) {
+                pLog->write(RGY_LOG_ERROR, _T("failed to read temporary file \"%s\".\n"), segment->filename().c_str());
+                ret = RGY_ERR_MORE_BITSTREAM;
+                break;
+            }
+            bitstream.setOffset(0);
+            bitstream.setSize(frame.size);
+            bitstream.setFrametype((RGY_FRAMETYPE)frame.frametype);
+            bitstream.setPts(frame.pts + ptsOffset[iseg]);
+            bitstream.setDts((frame.dts == (int64_t)MFX_TIMESTAMP_UNKNOWN) ? frame.dts : frame.dts + ptsOffset[iseg]);
+            if (RGY_ERR_NONE != (ret = pWriter->WriteNextFrame(&bitstream))) {
+                pLog->write(RGY_LOG_ERROR, _T("failed to write segment #%d: %s\n"), (int)iseg, get_err_mes(ret));
+                break;
+            }
+        }
+    }
+    bitstream.clear();
+    return ret;
+}
+
+#if ENABLE_AVSW_READER
+//区間の開始位置として使用できるキーフレームの種類
+enum QSVSegmentKey {
+    QSV_SEGMENT_KEY_NONE,          //使用できない (キーフレームでない、open GOPのIフレーム・CRAなど)
+    QSV_SEGMENT_KEY_CHECK_LEADING, //後続のフレームに、表示順でこれより前に来るフレーム(leading picture)がなければ使用できる
+    QSV_SEGMENT_KEY_NO_LEADING,    //leading pictureを持たないIDRなので、そのまま使用できる
+};
+
+//映像のパケットが区間の開始位置として使用できるか判定する
+static QSVSegmentKey qsv_segment_key_type(const AVCodecParameters *codecpar, const AVPacket *pkt) {
+    if ((pkt->flags & AV_PKT_FLAG_KEY) == 0) {
+        return QSV_SEGMENT_KEY_NONE;
+    }
+    const bool isH264 = codecpar->codec_id == AV_CODEC_ID_H264;
+    const bool isHEVC = codecpar->codec_id == AV_CODEC_ID_HEVC;
+    if (!isH264 && !isHEVC) {
+        //NALの種類で判定できないので、leading pictureの有無のみで判定する
+        return QSV_SEGMENT_KEY_CHECK_LEADING;
+    }
+    std::vector<uint8_t> nalTypes;
+    //mp4/mkvなどでは、NALの先頭は開始コードではなく長さとなっている (avcC/hvcC)
+    int nalLengthSize = 0;
+    if (codecpar->extradata_size > 0 && codecpar->extradata[0] == 1) {
+        if (isH264 && codecpar->extradata_size >= 5) {
+            nalLengthSize = (codecpar->extradata[4] & 0x03) + 1;
+        } else if (isHEVC && codecpar->extradata_size >= 22) {
+            nalLengthSize = (codecpar->extradata[21] & 0x03) + 1;
+        }
+    }
+    if (nalLengthSize > 0) {
+        for (int pos = 0; pos + nalLengthSize < pkt->size; ) {
+            uint32_t nalSize = 0;
+            for (int j = 0; j < nalLengthSize; j++) {
+                nalSize = (nalSize << 8) | pkt->data[pos + j];
+            }
+            pos += nalLengthSize;
+            if (nalSize == 0 || nalSize > (uint32_t)(pkt->size - pos)) {
+                break;
+            }
+            nalTypes.push_back((isHEVC) ? (uint8_t)((pkt->data[pos] & 0x7f) >> 1) : (uint8_t)(pkt->data[pos] & 0x1f));
+            pos += nalSize;
+        }
+    } else {
+        const auto nalList = (isHEVC) ? parse_nal_unit_hevc(pkt->data, pkt->size) : parse_nal_unit_h264(pkt->data, pkt->size);
+        for (const auto& nal : nalList) {
+            nalTypes.push_back(nal.type);
+        }
+    }
+    for (const auto type : nalTypes) {
+        if (isH264 && type == NALU_H264_IDR) {
+            return QSV_SEGMENT_KEY_NO_LEADING;
+        }
+        if (isHEVC && type == NALU_HEVC_IDR_N_LP) {
+            return QSV_SEGMENT_KEY_NO_LEADING;
+        }
+        if (isHEVC && type == NALU_HEVC_IDR_W_RADL) {
+            return QSV_SEGMENT_KEY_CHECK_LEADING;
+        }
+    }
+    return QSV_SEGMENT_KEY_NONE;
+}
+
+//demuxerから映像のキーフレームの位置(読み込み時のフレーム番号)を取得する
+//区間の開始位置とするため、closed GOPの先頭(IDR)で、leading pictureを持たないもののみを返す
+static RGY_ERR qsv_scan_keyframes(const sInputParams *pParams, std::vector<int>& keyFrames, int& nFrames, std::shared_ptr<RGYLog> pLog, bool *pAbort) {
+    keyFrames.clear();
+    nFrames = 0;
+    if (!check_avcodec_dll()) {
+        pLog->write(RGY_LOG_ERROR, error_mes_avcodec_dll_not_found().c_str());
+        return RGY_ERR_NULL_PTR;
+    }
+    av_register_all();
+
+    std::string filename_char;
+    if (0 == tchar_to_string(pParams->strSrcFile, filename_char, CP_UTF8)) {
+        pLog->write(RGY_LOG_ERROR, _T("failed to convert filename to utf-8 characters.\n"));
+        return RGY_ERR_UNSUPPORTED;
+    }
+    AVInputFormat *pInFormat = nullptr;
+    if (pParams->pAVInputFormat) {
+        if (nullptr == (pInFormat = av_find_input_format(tchar_to_string(pParams->pAVInputFormat).c_str()))) {
+            pLog->write(RGY_LOG_ERROR, _T("Unknown Input format: %s.\n"), pParams->pAVInputFormat);
+            return RGY_ERR_INVALID_FORMAT;
+        }
+    }
+    AVFormatContext *pFormatCtx = nullptr;
+    int ret = 0;
+    if (0 != (ret = avformat_open_input(&pFormatCtx, filename_char.c_str(), pInFormat, nullptr))) {
+        pLog->write(RGY_LOG_ERROR, _T("error opening file \"%s\": %s\n"), pParams->strSrcFile, qsv_av_err2str(ret).c_str());
+        return RGY_ERR_FILE_OPEN;
+    }
+    unique_ptr<AVFormatContext, RGYAVDeleter<AVFormatContext>> formatCtx(pFormatCtx, RGYAVDeleter<AVFormatContext>(avformat_close_input));
+    if (avformat_find_stream_info(formatCtx.get(), nullptr) < 0) {
+        pLog->write(RGY_LOG_ERROR, _T("error finding stream information.\n"));
+        return RGY_ERR_UNKNOWN;
+    }
+    const int videoIndex = av_find_best_stream(formatCtx.get(), AVMEDIA_TYPE_VIDEO, -1, -1, nullptr, 0);
+    if (videoIndex < 0) {
+        pLog->write(RGY_LOG_ERROR, _T("no video stream found in \"%s\".\n"), pParams->strSrcFile);
+        return RGY_ERR_INVALID_DATA_TYPE;
+    }
+    //demuxerのindexはデコード順で、open GOPかどうかもわからないので、映像のパケットを読み込んで確認する
+    const AVCodecParameters *codecpar = formatCtx->streams[videoIndex]->codecpar;
+    for (uint32_t i = 0; i < formatCtx->nb_streams; i++) {
+        if ((int)i != videoIndex) {
+            formatCtx->streams[i]->discard = AVDISCARD_ALL;
+        }
+    }
+    struct ScanPacket {
+        int64_t pts;
+        bool key;
+        QSVSegmentKey segmentKey;
+    };
+    std::vector<ScanPacket> packets;
+    AVPacket pkt;
+    av_init_packet(&pkt);
+    while (av_read_frame(formatCtx.get(), &pkt) >= 0) {
+        if (pkt.stream_index == videoIndex) {
+            packets.push_back({ pkt.pts, (pkt.flags & AV_PKT_FLAG_KEY) != 0, qsv_segment_key_type(codecpar, &pkt) });
+        }
+        av_packet_unref(&pkt);
+        if (pAbort && *pAbort) {
+            return RGY_ERR_ABORTED;
+        }
+    }
+    //最初のキーフレームより前のフレームは読み込み時に捨てられるので、その分フレーム番号をずらす
+    //最初のキーフレームは、通常のエンコードと同様に扱われるので、closed GOPでなくても区間の開始位置とする
+    const auto firstKey = std::find_if(packets.begin(), packets.end(), [](const ScanPacket& packet) { return packet.key; });
+    if (firstKey == packets.end()) {
+        return RGY_ERR_NONE;
+    }
+    const int firstKeyFrame = (int)(firstKey - packets.begin());
+    keyFrames.push_back(0);
+    int nOpenGOP = 0;
+    for (int i = firstKeyFrame + 1; i < (int)packets.size(); i++) {
+        if (!packets[i].key) {
+            continue;
+        }
+        bool usable = packets[i].segmentKey == QSV_SEGMENT_KEY_NO_LEADING;
+        if (packets[i].segmentKey == QSV_SEGMENT_KEY_CHECK_LEADING && packets[i].pts != AV_NOPTS_VALUE) {
+            //次のキーフレームまでに、表示順でこれより前に来るフレームがないか確認する
+            usable = true;
+            for (int j = i + 1; usable && j < (int)packets.size() && !packets[j].key; j++) {
+                usable = packets[j].pts != AV_NOPTS_VALUE && packets[j].pts > packets[i].pts;
+            }
+        }
+        if (usable) {
+            keyFrames.push_back(i - firstKeyFrame);
+        } else {
+            nOpenGOP++;
+        }
+    }
+    nFrames = (int)packets.size() - firstKeyFrame;
+    pLog->write(RGY_LOG_DEBUG, _T("segment: got %d keyframes (%d skipped as open GOP) in %d frames.\n"), (int)keyFrames.size(), nOpenGOP, nFrames);
+    return RGY_ERR_NONE;
+}
+#endif //#if ENABLE_AVSW_READER
+
+//--segment-parallelで使用できない設定をチェックする
+static bool qsv_segment_check_param(const sInputParams *pParams, std::shared_ptr<RGYLog> pLog) {
+    const TCHAR *unsupported = nullptr;
+    if (pParams->bBenchmark) {
+        unsupported = _T("--benchmark");
+    } else if (pParams->CodecId == MFX_CODEC_RAW) {
+        unsupported = _T("raw output");
+    } else if (_tcscmp(pParams->strDstFile, _T("-")) == 0) {
+        unsupported = _T("stdout output");
+    } else if (pParams->nAudioSelectCount > 0 || pParams->nAudioSourceCount > 0) {
+        unsupported = _T("audio output");
+    } else if (pParams->nSubtitleSelectCount > 0 || pParams->caption2ass != FORMAT_INVALID) {
+        unsupported = _T("subtitle output");
+    } else if (pParams->pChapterFile || pParams->bCopyChapter) {
+        unsupported = _T("chapter output");
+    } else if (pParams->nTrimCount > 0 || pParams->fSeekSec > 0.0f) {
+        unsupported = _T("--trim/--seek");
+    } else if (pParams->nAVSyncMode != RGY_AVSYNC_ASSUME_CFR) {
+        unsupported = _T("--avsync");
+    } else if (pParams->nVideoTrack != 0 || pParams->nVideoStreamId != 0) {
+        unsupported = _T("--video-track/--video-streamid");
+    } else if (!(pParams->nInputFmt == RGY_INPUT_FMT_AVHW
+              || pParams->nInputFmt == RGY_INPUT_FMT_AVSW
+              || pParams->nInputFmt == RGY_INPUT_FMT_AVANY
+              || (pParams->nInputFmt == RGY_INPUT_FMT_AUTO
+                  && !check_ext(pParams->strSrcFile, { ".y4m", ".yuv", ".avi", ".avs", ".vpy" })))) {
+        unsupported = _T("input other than avhw/avsw reader");
+    } else if (_tcscmp(pParams->strSrcFile, _T("-")) == 0) {
+        unsupported = _T("pipe input");
+    } else if (pParams->nTeeCount > 0) {
+        unsupported = _T("--tee");
+    } else if (pParams->pMetricsSocket) {
+        unsupported = _T("--metrics-socket");
+    } else if (check_ext(pParams->strDstFile, { ".m3u8" })) {
+        unsupported = _T("hls output");
+    }
+    if (unsupported) {
+        pLog->write(RGY_LOG_ERROR, _T("--segment-parallel cannot be used with %s.\n"), unsupported);
+        return false;
+    }
+    return true;
+}
+
+int qsv_run_segment_parallel(sInputParams *pParams, bool *pAbort) {
+    auto pLog = std::make_shared<RGYLog>(pParams->pStrLogFile, pParams->nLogLevel);
+    if (!qsv_segment_check_param(pParams, pLog)) {
+        return 1;
+    }
+#if !ENABLE_AVSW_READER
+    pLog->write(RGY_LOG_ERROR, _T("--segment-parallel requires avcodec reader, which is not compiled in this binary.\n"));
+    return 1;
+#else
+    auto pEncStatus = std::make_shared<EncodeStatus>();
+    pEncStatus->SetStart();
+
+    //キーフレームの位置を取得し、区間に分割する
+    std::vector<int> keyFrames;
+    int nFrames = 0;
+    if (RGY_ERR_NONE != qsv_scan_keyframes(pParams, keyFrames, nFrames, pLog, pAbort)) {
+        return 1;
+    }
+    const int nParallel = pParams->nSegmentParallel;
+    std::vector<sTrim> segmentTrim = qsv_split_segments(keyFrames, nFrames, nParallel * QSV_SEGMENT_PER_PARALLEL, QSV_SEGMENT_MIN_FRAMES);
+    if (segmentTrim.size() == 0) {
+        pLog->write(RGY_LOG_ERROR, _T("--segment-parallel: no keyframe found in the input.\n"));
+        return 1;
+    }
+    if (segmentTrim.size() == 1) {
+        pLog->write(RGY_LOG_WARN, _T("--segment-parallel: the input could not be split at closed GOP keyframes, encoding serially.\n"));
+    }
+    pLog->write(RGY_LOG_INFO, _T("segment-parallel: %d segments, %d parallel.\n"), (int)segmentTrim.size(), nParallel);
+
+    //区間ごとのパラメータ
+    //ログは最終結果のみ表示するため、各区間のエンコードでは警告以上のみ表示する
+    std::vector<sInputParams> segmentParams(segmentTrim.size());
+    std::vector<std::shared_ptr<RGYOutputSegment>> segments;
+    for (size_t i = 0; i < segmentTrim.size(); i++) {
+        segmentParams[i] = *pParams;
+        segmentParams[i].nSegmentParallel = 0;
+        segmentParams[i].nTrimCount = 1;
+        segmentParams[i].pTrimList = &segmentTrim[i];
+        segmentParams[i].nLogLevel = (std::max)((int)pParams->nLogLevel, (int)RGY_LOG_WARN);
+        segmentParams[i].pStrLogFile = nullptr;
+        segmentParams[i].pFramePosListLog = nullptr;
+        segmentParams[i].pMuxVidTsLogFile = nullptr;
+        segmentParams[i].pLogCopyFrameData = nullptr;
+        segmentParams[i].nPerfMonitorSelect = 0;
+        segmentParams[i].nPerfMonitorSelectMatplot = 0;
+        auto segment = std::make_shared<RGYOutputSegment>();
+        segment->setFilename(tstring(pParams->strDstFile) + strsprintf(_T(".seg%03d.tmp"), (int)i));
+        segments.push_back(segment);
+    }
+
+    //ビットレートを指定するモードでは、完了した区間の出力サイズから、次の区間のビットレートを調整する
+    //CBRはビットレートを変えられないので調整しない
+    //VBVのバッファサイズは区間ごとに同じ値を使用する (各区間はバッファの半分が満たされた状態から開始する)
+    const bool adjustBitrate = !(pParams->nEncMode == MFX_RATECONTROL_CQP
+                              || pParams->nEncMode == MFX_RATECONTROL_ICQ
+                              || pParams->nEncMode == MFX_RATECONTROL_LA_ICQ
+                              || pParams->nEncMode == MFX_RATECONTROL_CBR) && nFrames > 0;
+    std::mutex mtxBudget;
+    int64_t doneBytes = 0;
+    int doneFrames = 0;
+    int budgetFpsN = 0, budgetFpsD = 0;
+
+    //空いたパイプラインから順に次の区間をエンコードする
+    //区間は先頭から順に開始するので、この区間以降のフレームはまだエンコードを開始していない
+    std::atomic<int> nextSegment(0);
+    std::atomic<int> failedSegment(-1);
+    auto encodeSegments = [&]() {
+        for (;;) {
+            const int iseg = nextSegment++;
+            if (iseg >= (int)segments.size() || failedSegment >= 0 || (pAbort && *pAbort)) {
+                break;
+            }
+            if (adjustBitrate) {
+                std::lock_guard<std::mutex> lock(mtxBudget);
+                const int bitrate = qsv_segment_bitrate(pParams->nBitRate, pParams->nMaxBitrate, budgetFpsN, budgetFpsD,
+                    doneBytes, doneFrames, nFrames - segmentTrim[iseg].start);
+                if (bitrate != (int)pParams->nBitRate) {
+                    pLog->write(RGY_LOG_DEBUG, _T("segment-parallel: segment #%d bitrate %d -> %d kbps.\n"), iseg, (int)pParams->nBitRate, bitrate);
+                }
+                segmentParams[iseg].nBitRate = bitrate;
+            }
+            unique_ptr<CQSVPipeline> pPipeline(new CQSVPipeline);
+            pPipeline->SetOutputOverride(segments[iseg]);
+            auto sts = pPipeline->Init(&segmentParams[iseg]);
+            if (sts >= MFX_ERR_NONE) {
+                pPipeline->SetAbortFlagPointer(pAbort);
+                sts = pPipeline->Run();
+            }
+            pPipeline->Close();
+            if (sts < MFX_ERR_NONE) {
+                pLog->write(RGY_LOG_ERROR, _T("segment-parallel: failed to encode segment #%d: %s\n"), iseg, get_err_mes(sts));
+                failedSegment = iseg;
+                break;
+            }
+            if (adjustBitrate) {
+                std::lock_guard<std::mutex> lock(mtxBudget);
+                for (const auto& frame : segments[iseg]->frames()) {
+                    doneBytes += frame.size;
+                }
+                doneFrames += (int)segments[iseg]->frames().size();
+                budgetFpsN = segments[iseg]->videoOutputInfo().fpsN;
+                budgetFpsD = segments[iseg]->videoOutputInfo().fpsD;
+            }
+            pLog->write(RGY_LOG_INFO, _T("segment-parallel: segment #%d (frame %d - %d) finished, %d frames.\n"),
+                iseg, segmentTrim[iseg].start, segmentTrim[iseg].start + (int)segments[iseg]->frames().size() - 1, (int)segments[iseg]->frames().size());
+        }
+    };
+    std::vector<std::thread> threads;
+    for (int i = 0; i < (std::min)(nParallel, (int)segments.size()); i++) {
+        threads.push_back(std::thread(encodeSegments));
+    }
+    for (auto& th : threads) {
+        th.join();
+    }
+
+    int ret = 0;
+    if (failedSegment >= 0 || (pAbort && *pAbort)) {
+        ret = 1;
+    } else {
+        //区間ごとの出力を結合する
+        const auto& videoInfo = segments[0]->videoOutputInfo();
+        uint32_t nFramesOut = 0;
+        for (const auto& segment : segments) {
+            nFramesOut += (uint32_t)segment->frames().size();
+        }
+        pEncStatus->Init(videoInfo.fpsN, videoInfo.fpsD, nFramesOut, 0.0, sTrimParam(), pLog, nullptr);
+
+        HEVCHDRSei hedrsei;
+        hedrsei.parse(std::string(pParams->sMaxCll ? pParams->sMaxCll : ""), std::string(pParams->sMasterDisplay ? pParams->sMasterDisplay : ""));
+        const bool useESOutput =
+            ((pParams->pAVMuxOutputFormat && 0 == _tcscmp(pParams->pAVMuxOutputFormat, _T("raw"))))
+            || (PathFindExtension(pParams->strDstFile) == nullptr || PathFindExtension(pParams->strDstFile)[0] != '.')
+            || check_ext(pParams->strDstFile, { ".m2v", ".264", ".h264", ".avc", ".avc1", ".x264", ".265", ".h265", ".hevc" });
+        RGYTimestamp timestamp;
+        std::shared_ptr<RGYOutput> pWriter;
+        RGY_ERR err = RGY_ERR_NONE;
+        if (!useESOutput) {
+            AvcodecWriterPrm writerPrm;
+            writerPrm.pOutputFormat = pParams->pAVMuxOutputFormat;
+            writerPrm.nOutputThread = pParams->nOutputThread;
+            writerPrm.nAudioThread = 0;
+            writerPrm.nBufSizeMB = pParams->nOutputBufSizeMB;
+            writerPrm.pVidTimestamp = &timestamp;
+            writerPrm.pMuxVidTsLogFile = pParams->pMuxVidTsLogFile;
+            writerPrm.videoCodecTag = (pParams->videoCodecTag) ? pParams->videoCodecTag : "";
+            writerPrm.pHEVCHdrSei = &hedrsei;
+            if (pParams->pMuxOpt) {
+                writerPrm.vMuxOpt = *pParams->pMuxOpt;
+            }
+            pWriter = std::make_shared<RGYOutputAvcodec>();
+            err = pWriter->Init(pParams->strDstFile, &videoInfo, &writerPrm, pLog, pEncStatus);
+        } else {
+            RGYOutputRawPrm rawPrm = { 0 };
+            rawPrm.bBenchmark = false;
+            rawPrm.nBufSizeMB = pParams->nOutputBufSizeMB;
+            rawPrm.codecId = videoInfo.codec;
+            rawPrm.seiNal = hedrsei.gen_nal();
+            pWriter = std::make_shared<RGYOutputRaw>();
+            err = pWriter->Init(pParams->strDstFile, &videoInfo, &rawPrm, pLog, pEncStatus);
+        }
+        if (err != RGY_ERR_NONE) {
+            pLog->write(RGY_LOG_ERROR, pWriter->GetOutputMessage());
+            ret = 1;
+        } else if (RGY_ERR_NONE != qsv_stitch_segments(segments, pWriter, &timestamp, pLog)) {
+            ret = 1;
+        }
+        pWriter->WaitFin();
+        pWriter->Close();
+        if (ret == 0) {
+            pEncStatus->WriteResults();
+        }
+    }
+    for (const auto& segment : segments) {
+        segment->Close();
+        _tremove(segment->filename().c_str());
+    }
+    return ret;
+#endif //#if !ENABLE_AVSW_READER
+}
@@ -0,0 +1,109 @@
+﻿// -----------------------------------------------------------------------------------------
+// QSVEnc/NVEnc by rigaya
+// -----------------------------------------------------------------------------------------
+// The MIT License
+//
+// Copyright (c) 2011-2016 rigaya
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// --------------------------------------------------------------------------------------------
+
+#pragma once
+#ifndef __QSV_SEGMENT_H__
+#define __QSV_SEGMENT_H__
+
+#include <vector>
+#include <memory>
+#include "rgy_osdep.h"
+#include "rgy_tchar.h"
+#include "rgy_util.h"
+#include "rgy_output.h"
+#include "qsv_prm.h"
+
+//--segment-parallel
+//入力をキーフレームで区間に分割し、複数のCQSVPipelineで並列にエンコードしたのち、
+//区間ごとのビットストリームを順に結合して出力する
+
+//分割の際、1区間の最小フレーム数
+static const int QSV_SEGMENT_MIN_FRAMES = 60;
+//並列数に対して作成する区間の数 (区間ごとの処理時間のばらつきを吸収するため、並列数より多く分割する)
+static const int QSV_SEGMENT_PER_PARALLEL = 2;
+//区間ごとのビットレートの調整幅の上限 (目標ビットレートに対する割合)
+static const double QSV_SEGMENT_BITRATE_ADJUST_MAX = 0.5;
+
+//キーフレームの位置(フレーム番号)のリストから、nSegments個程度の区間に分割する
+//  keyFrames ... キーフレームのフレーム番号 (昇順)
+//  nFrames   ... 総フレーム数 (不明な場合は0)
+//  nSegments ... 目標とする区間の数
+//  minFrames ... 1区間の最小フレーム数
+//各区間はキーフレームから始まり、最後の区間のfinはTRIM_MAXとなる
+std::vector<sTrim> qsv_split_segments(const std::vector<int>& keyFrames, int nFrames, int nSegments, int minFrames);
+
+//これからエンコードを開始する区間のビットレート(kbps)を決める
+//  targetKbps   ... 全体の目標ビットレート
+//  maxKbps      ... 最大ビットレート (0なら制限なし)
+//  fpsN, fpsD   ... フレームレート
+//  doneBytes    ... エンコードの完了した区間の出力サイズの合計
+//  doneFrames   ... エンコードの完了した区間のフレーム数の合計
+//  remainFrames ... この区間以降の、まだエンコードを開始していない区間のフレーム数の合計
+//完了した区間の目標に対する超過・不足分を、残りの区間に均等に割り振る
+//エンコード中の区間は目標ビットレートで出力されるものとみなし、調整幅はQSV_SEGMENT_BITRATE_ADJUST_MAXまでとする
+int qsv_segment_bitrate(int targetKbps, int maxKbps, int fpsN, int fpsD, int64_t doneBytes, int doneFrames, int remainFrames);
+
+//区間ごとのエンコード結果を一時ファイルに格納するRGYOutput
+//後で結合するため、各フレームのファイル上の位置とタイムスタンプを記録しておく
+class RGYOutputSegment : public RGYOutput {
+public:
+    struct SegmentFrame {
+        int64_t offset;
+        uint32_t size;
+        uint32_t frametype;
+        int64_t pts;
+        int64_t dts;
+    };
+
+    RGYOutputSegment();
+    virtual ~RGYOutputSegment();
+
+    virtual RGY_ERR WriteNextFrame(RGYBitstream *pBitstream) override;
+    virtual RGY_ERR WriteNextFrame(RGYFrame *pSurface) override;
+    virtual void Close() override;
+
+    void setFilename(const tstring& filename) { m_sFilename = filename; }
+    const tstring& filename() const { return m_sFilename; }
+    const std::vector<SegmentFrame>& frames() const { return m_frames; }
+    const VideoInfo& videoOutputInfo() const { return m_VideoOutputInfo; }
+protected:
+    virtual RGY_ERR Init(const TCHAR *strFileName, const VideoInfo *pOutputInfo, const void *prm) override;
+
+    tstring m_sFilename;
+    int64_t m_nFileOffset;
+    std::vector<SegmentFrame> m_frames;
+};
+
+//区間ごとの一時ファイルを順に読み込み、タイムスタンプを連続するよう補正しながらpWriterに出力する
+//pTimestampには出力する各フレームのdurationを登録する (RGYOutputAvcodecのpVidTimestampに渡したもの)
+RGY_ERR qsv_stitch_segments(const std::vector<std::shared_ptr<RGYOutputSegment>>& segments,
+    std::shared_ptr<RGYOutput> pWriter, RGYTimestamp *pTimestamp, std::shared_ptr<RGYLog> pLog);
+
+//--segment-parallelによるエンコードを実行する
+int qsv_run_segment_parallel(sInputParams *pParams, bool *pAbort);
+
+#endif //__QSV_SEGMENT_H__
@@ -0,0 +1,95 @@
+﻿// -----------------------------------------------------------------------------------------
+// QSVEnc by rigaya
+// -----------------------------------------------------------------------------------------
+// The MIT License
+//
+// Copyright (c) 2011-2016 rigaya
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// ------------------------------------------------------------------------------------------
+
+#include "qsv_stage.h"
+
+mfxStatus QSVStageGraph::run(FuncHeadEnd onHeadEnd, FuncFlushed onFlushed) {
+    const int nStages = (int)m_stages.size();
+    for (auto& stage : m_stages) {
+        stage->setState(QSV_STAGE_RUNNING);
+    }
+    int head = 0;
+    while (head < nStages) {
+        //後ろの段から、キューにフレームのある段を探す
+        int target = nStages - 1;
+        while (target > head && m_stages[target]->empty()) {
+            target--;
+        }
+        auto stage = m_stages[target].get();
+        QSVStageFrame out = { 0 };
+        mfxStatus sts = MFX_ERR_NONE;
+        const bool bHeadCall = stage->empty();
+        if (!bHeadCall) {
+            sts = stage->process(&stage->front(), &out);
+            if (sts != MFX_ERR_MORE_SURFACE) {
+                stage->pop();
+            }
+        } else if (stage->state() == QSV_STAGE_RUNNING) {
+            sts = stage->process(nullptr, &out);
+        } else {
+            sts = stage->drain(&out);
+        }
+
+        if (sts == MFX_ERR_MORE_DATA) {
+            if (!bHeadCall) {
+                continue; //次の入力を待つ
+            }
+            //headの入力の終了、またはflushの完了
+            const bool bDraining = stage->state() == QSV_STAGE_DRAINING;
+            mfxStatus ret = onHeadEnd(stage, bDraining, MFX_ERR_MORE_DATA);
+            if (ret != MFX_ERR_NONE) {
+                return ret;
+            }
+            if (!bDraining && stage->hasBuffer()) {
+                //入力が終了したので、ため込まれたフレームをflushする
+                stage->setState(QSV_STAGE_DRAINING);
+                continue;
+            }
+            stage->setState(QSV_STAGE_FLUSHED);
+            onFlushed(stage);
+            //次にflushが必要な段を探す
+            for (head++; head < nStages && !m_stages[head]->hasBuffer(); head++) {
+                m_stages[head]->setState(QSV_STAGE_FLUSHED);
+                onFlushed(m_stages[head].get());
+            }
+            if (head < nStages) {
+                m_stages[head]->setState(QSV_STAGE_DRAINING);
+            }
+            continue;
+        }
+        if (sts < MFX_ERR_NONE && sts != MFX_ERR_MORE_SURFACE) {
+            auto headStage = m_stages[head].get();
+            mfxStatus ret = onHeadEnd(headStage, headStage->state() == QSV_STAGE_DRAINING, sts);
+            return (ret != MFX_ERR_NONE) ? ret : sts;
+        }
+        //出力を次の段に渡す (最後の段の出力はない)
+        if (out.pSurface && target + 1 < nStages) {
+            m_stages[target + 1]->submit(out);
+        }
+    }
+    return MFX_ERR_NONE;
+}
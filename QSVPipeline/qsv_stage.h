@@ -0,0 +1,197 @@
+﻿// -----------------------------------------------------------------------------------------
+// QSVEnc by rigaya
+// -----------------------------------------------------------------------------------------
+// The MIT License
+//
+// Copyright (c) 2011-2016 rigaya
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// ------------------------------------------------------------------------------------------
+
+#ifndef __QSV_STAGE_H__
+#define __QSV_STAGE_H__
+
+#include <deque>
+#include <vector>
+#include <memory>
+#include <chrono>
+#include <functional>
+#include "rgy_tchar.h"
+#include "rgy_thread.h"
+#include "mfxstructures.h"
+
+//デバイスがビジーの状態が続いた場合に、エラーとするまでの時間
+static const uint32_t QSV_DEVICE_BUSY_TIMEOUT_MS = 30 * 1000;
+
+//出力が得られるまで、funcを再試行する (デバイスがビジーの間は待機する)
+//  func       ... mfxStatus(bool& bOutput) 処理を行い、出力(syncpoint)が得られたらbOutputをtrueにする
+//  onTimeout  ... timeoutMsの間、出力が得られなかった場合に呼ばれる
+//戻り値
+//  funcの戻り値 (出力があった場合の警告はMFX_ERR_NONEとする)
+//  タイムアウトした場合はMFX_ERR_UNKNOWN
+template<typename Func>
+static mfxStatus qsv_run_retry_busy(Func func, std::function<void()> onTimeout = nullptr, uint32_t timeoutMs = QSV_DEVICE_BUSY_TIMEOUT_MS) {
+    const auto tmStart = std::chrono::steady_clock::now();
+    for (int i = 0; ; i++) {
+        bool bOutput = false;
+        const mfxStatus sts = func(bOutput);
+        if (sts <= MFX_ERR_NONE) {
+            return sts;
+        }
+        if (bOutput) {
+            return MFX_ERR_NONE; //出力があれば、警告は無視する
+        }
+        if (MFX_WRN_DEVICE_BUSY == sts) {
+            sleep_hybrid(i);
+        }
+        if ((i & 1023) == 1023
+            && std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - tmStart).count() >= timeoutMs) {
+            if (onTimeout) {
+                onTimeout();
+            }
+            return MFX_ERR_UNKNOWN;
+        }
+    }
+}
+
+//パイプラインの段の間で受け渡すフレーム
+struct QSVStageFrame {
+    mfxFrameSurface1 *pSurface; //フレーム
+    mfxSyncPoint syncp;         //このフレームを出力した処理のsyncpoint
+    mfxSyncPoint vppSyncp;      //vppのsyncpoint (中断時に同期できるよう、エンコードの段でタスクに登録する)
+};
+
+enum QSVStageState {
+    QSV_STAGE_RUNNING = 0, //通常の処理中
+    QSV_STAGE_DRAINING,    //ため込まれたフレームをflush中
+    QSV_STAGE_FLUSHED,     //flush完了
+};
+
+//パイプラインの段
+//  前段の出力はsubmitでこの段のキューに追加され、processで先頭から1つずつ処理される
+//  入力の終了後は、drainでため込んだフレームを取り出す
+class QSVStage {
+public:
+    QSVStage(const TCHAR *name, bool hasBuffer) :
+        m_name(name), m_hasBuffer(hasBuffer), m_state(QSV_STAGE_RUNNING), m_queue() {};
+    virtual ~QSVStage() {};
+
+    //inを処理し、出力があればout->pSurfaceに設定する
+    //inがnullptrの場合(先頭の段のみ)は、入力から新たなフレームを取得する
+    //戻り値
+    //  MFX_ERR_NONE         ... 処理した (フレームをため込んだり、破棄した場合は出力なし)
+    //  MFX_ERR_MORE_SURFACE ... 出力があり、同じinでもう一度呼ぶ必要がある (1つの入力から複数のフレームを出力する場合)
+    //  MFX_ERR_MORE_DATA    ... 出力はなく、次の入力が必要 (inがnullptrの場合は、入力が終了した)
+    //  正の値(警告)はMFX_ERR_NONEと同様に扱い、その他の負の値はエラーとして処理を中断する
+    virtual mfxStatus process(const QSVStageFrame *in, QSVStageFrame *out) = 0;
+
+    //ため込んだフレームを1つ取り出し、out->pSurfaceに設定する
+    //戻り値はMFX_ERR_NONEなら続けて呼ぶ、MFX_ERR_MORE_DATAならもうフレームはない
+    virtual mfxStatus drain(QSVStageFrame *out) {
+        return MFX_ERR_MORE_DATA;
+    }
+
+    void submit(const QSVStageFrame& frame) {
+        m_queue.push_back(frame);
+    }
+    bool empty() const {
+        return m_queue.empty();
+    }
+    size_t queueSize() const {
+        return m_queue.size();
+    }
+    const QSVStageFrame& front() const {
+        return m_queue.front();
+    }
+    void pop() {
+        m_queue.pop_front();
+    }
+    const TCHAR *name() const {
+        return m_name;
+    }
+    //フレームをため込み、flushが必要な段か
+    bool hasBuffer() const {
+        return m_hasBuffer;
+    }
+    QSVStageState state() const {
+        return m_state;
+    }
+    void setState(QSVStageState state) {
+        m_state = state;
+    }
+protected:
+    const TCHAR *m_name;
+    bool m_hasBuffer;
+    QSVStageState m_state;
+    std::deque<QSVStageFrame> m_queue;
+};
+
+//処理を関数で与える段
+class QSVStageFunc : public QSVStage {
+public:
+    typedef std::function<mfxStatus(const QSVStageFrame *in, QSVStageFrame *out)> FuncProcess;
+    typedef std::function<mfxStatus(QSVStageFrame *out)> FuncDrain;
+
+    QSVStageFunc(const TCHAR *name, bool hasBuffer, FuncProcess funcProcess, FuncDrain funcDrain = nullptr) :
+        QSVStage(name, hasBuffer), m_funcProcess(funcProcess), m_funcDrain(funcDrain) {};
+    virtual ~QSVStageFunc() {};
+
+    virtual mfxStatus process(const QSVStageFrame *in, QSVStageFrame *out) override {
+        return m_funcProcess(in, out);
+    }
+    virtual mfxStatus drain(QSVStageFrame *out) override {
+        return (m_funcDrain) ? m_funcDrain(out) : MFX_ERR_MORE_DATA;
+    }
+protected:
+    FuncProcess m_funcProcess;
+    FuncDrain m_funcDrain;
+};
+
+//パイプラインの段をつないで実行する
+//  後ろの段のキューにあるフレームから優先して処理し、パイプライン内のフレームを最小限にとどめる
+//  すべてのキューが空なら、head(flushの完了していない最初の段)に、
+//  通常の処理中は入力から新たなフレームを取得させ、flush中はため込んだフレームを取り出させる
+//  headが空になったら、次にフレームをため込む段をheadとしてflushし、すべての段のflushが完了したら終了する
+class QSVStageGraph {
+public:
+    //headの入力の終了・flushの完了、またはいずれかの段のエラーの際に呼ばれる
+    //  stsはMFX_ERR_MORE_DATA(終了)かエラー、bDrainingはheadがflush中だったか
+    //  MFX_ERR_NONE以外を返すと、runはその値を返して終了する
+    typedef std::function<mfxStatus(QSVStage *head, bool bDraining, mfxStatus sts)> FuncHeadEnd;
+    //段のflushが完了した際に呼ばれる
+    typedef std::function<void(QSVStage *stage)> FuncFlushed;
+
+    QSVStageGraph() : m_stages() {};
+    ~QSVStageGraph() {};
+
+    //段を最後に追加する
+    QSVStage *add(std::unique_ptr<QSVStage> stage) {
+        m_stages.push_back(std::move(stage));
+        return m_stages.back().get();
+    }
+    const std::vector<std::unique_ptr<QSVStage>>& stages() const {
+        return m_stages;
+    }
+    mfxStatus run(FuncHeadEnd onHeadEnd, FuncFlushed onFlushed);
+protected:
+    std::vector<std::unique_ptr<QSVStage>> m_stages;
+};
+
+#endif //__QSV_STAGE_H__
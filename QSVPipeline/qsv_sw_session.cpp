@@ -0,0 +1,898 @@
+﻿// -----------------------------------------------------------------------------------------
+// QSVEnc by rigaya
+// -----------------------------------------------------------------------------------------
+// The MIT License
+//
+// Copyright (c) 2011-2016 rigaya
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// ------------------------------------------------------------------------------------------
+
+#include <cstring>
+#include <vector>
+#include <thread>
+#include <algorithm>
+#include "rgy_osdep.h"
+#include "qsv_util.h"
+#include "qsv_sw_session.h"
+
+#pragma warning(disable : 4100)
+
+//エンコーダが1フレームあたりに出力する最大のサイズ
+static const mfxU32 QSV_SW_ENC_MAX_FRAME_SIZE = 256;
+
+static inline mfxU32 sw_pitch(const mfxFrameData& data) {
+    return ((mfxU32)data.PitchHigh << 16) | (mfxU32)data.PitchLow;
+}
+
+static inline bool sw_fourcc_supported(mfxU32 fourcc) {
+    return fourcc == MFX_FOURCC_NV12 || fourcc == MFX_FOURCC_P010;
+}
+
+static inline int sw_pixel_size(mfxU32 fourcc) {
+    return (fourcc == MFX_FOURCC_P010) ? 2 : 1;
+}
+
+//Cropが設定されていなければフレーム全体を対象とする
+static inline void sw_get_rect(const mfxFrameInfo& info, int& x, int& y, int& w, int& h) {
+    x = info.CropX;
+    y = info.CropY;
+    w = (info.CropW) ? info.CropW : info.Width;
+    h = (info.CropH) ? info.CropH : info.Height;
+}
+
+//dstのExtParamは維持したまま、srcの内容をコピーする
+//dstの拡張バッファについては、srcに同じ拡張バッファがあればその内容をコピーする
+static void sw_copy_video_param(mfxVideoParam *dst, const mfxVideoParam *src) {
+    mfxExtBuffer **dstExtParam = dst->ExtParam;
+    const mfxU16 dstNumExtParam = dst->NumExtParam;
+    memcpy(dst, src, sizeof(mfxVideoParam));
+    dst->ExtParam = dstExtParam;
+    dst->NumExtParam = dstNumExtParam;
+
+    for (int i = 0; i < dstNumExtParam; i++) {
+        mfxExtBuffer *dstBuf = dstExtParam[i];
+        if (dstBuf == nullptr) {
+            continue;
+        }
+        //ヘッダは出力しないので、サイズ0を返す
+        if (dstBuf->BufferId == MFX_EXTBUFF_CODING_OPTION_SPSPPS) {
+            ((mfxExtCodingOptionSPSPPS *)dstBuf)->SPSBufSize = 0;
+            ((mfxExtCodingOptionSPSPPS *)dstBuf)->PPSBufSize = 0;
+            continue;
+        }
+        if (dstBuf->BufferId == MFX_EXTBUFF_CODING_OPTION_VPS) {
+            ((mfxExtCodingOptionVPS *)dstBuf)->VPSBufSize = 0;
+            continue;
+        }
+        for (int j = 0; j < src->NumExtParam; j++) {
+            const mfxExtBuffer *srcBuf = src->ExtParam[j];
+            if (srcBuf && srcBuf != dstBuf
+                && srcBuf->BufferId == dstBuf->BufferId
+                && srcBuf->BufferSz == dstBuf->BufferSz) {
+                memcpy(dstBuf, srcBuf, dstBuf->BufferSz);
+                break;
+            }
+        }
+    }
+}
+
+//デコーダの出力用に、フレーム番号に応じたパターンでフレームを埋める
+static void sw_fill_pattern(mfxFrameSurface1 *surf, uint32_t frameIndex) {
+    const auto& info = surf->Info;
+    const int width = info.Width;
+    const int height = info.Height;
+    const mfxU32 pitch = sw_pitch(surf->Data);
+    if (info.FourCC == MFX_FOURCC_P010) {
+        for (int y = 0; y < height; y++) {
+            uint16_t *ptr = (uint16_t *)(surf->Data.Y + (size_t)y * pitch);
+            std::fill(ptr, ptr + width, (uint16_t)(((frameIndex + y) & 0xff) << 8));
+        }
+        for (int y = 0; y < height / 2; y++) {
+            uint16_t *ptr = (uint16_t *)(surf->Data.UV + (size_t)y * pitch);
+            std::fill(ptr, ptr + width, (uint16_t)0x8000);
+        }
+    } else {
+        for (int y = 0; y < height; y++) {
+            memset(surf->Data.Y + (size_t)y * pitch, (frameIndex + y) & 0xff, width);
+        }
+        for (int y = 0; y < height / 2; y++) {
+            memset(surf->Data.UV + (size_t)y * pitch, 0x80, width);
+        }
+    }
+}
+
+//輝度の単純なチェックサムを計算する
+static uint32_t sw_luma_checksum(const mfxFrameSurface1 *surf) {
+    int x, y, w, h;
+    sw_get_rect(surf->Info, x, y, w, h);
+    const int pixelSize = sw_pixel_size(surf->Info.FourCC);
+    const mfxU32 pitch = sw_pitch(surf->Data);
+    uint32_t sum = 0;
+    for (int j = 0; j < h; j++) {
+        const uint8_t *ptr = surf->Data.Y + (size_t)(y + j) * pitch + x * pixelSize;
+        uint32_t rowsum = 0;
+        for (int i = 0; i < w * pixelSize; i++) {
+            rowsum += ptr[i];
+        }
+        sum = sum * 31 + rowsum;
+    }
+    return sum;
+}
+
+//最近傍法でリサイズしながらplaneをコピーする
+//x方向の座標・幅は要素単位(NV12/P010の色差ではUVの組単位)、elemsは1要素あたりの画素数
+template<typename Tout, typename Tin>
+static void sw_resize_plane(uint8_t *dst, mfxU32 dstPitch, int dstX, int dstY, int dstW, int dstH,
+    const uint8_t *src, mfxU32 srcPitch, int srcX, int srcY, int srcW, int srcH, int elems) {
+    const int shift = 8 * ((int)sizeof(Tout) - (int)sizeof(Tin));
+    if (shift == 0 && dstW == srcW && dstH == srcH) {
+        for (int y = 0; y < dstH; y++) {
+            memcpy(dst + (size_t)(dstY + y) * dstPitch + dstX * elems * sizeof(Tout),
+                   src + (size_t)(srcY + y) * srcPitch + srcX * elems * sizeof(Tin), dstW * elems * sizeof(Tout));
+        }
+        return;
+    }
+    std::vector<int> xmap(dstW);
+    for (int x = 0; x < dstW; x++) {
+        xmap[x] = (srcX + (int)((int64_t)x * srcW / dstW)) * elems;
+    }
+    for (int y = 0; y < dstH; y++) {
+        const int sy = srcY + (int)((int64_t)y * srcH / dstH);
+        const Tin *srcLine = (const Tin *)(src + (size_t)sy * srcPitch);
+        Tout *dstLine = (Tout *)(dst + (size_t)(dstY + y) * dstPitch) + dstX * elems;
+        for (int x = 0; x < dstW; x++) {
+            for (int e = 0; e < elems; e++) {
+                const int v = srcLine[xmap[x] + e];
+                dstLine[x * elems + e] = (Tout)((shift >= 0) ? (v << shift) : (v >> (-shift)));
+            }
+        }
+    }
+}
+
+template<typename Tout, typename Tin>
+static void sw_resize_frame(mfxFrameSurface1 *out, const mfxFrameSurface1 *in) {
+    int srcX, srcY, srcW, srcH, dstX, dstY, dstW, dstH;
+    sw_get_rect(in->Info, srcX, srcY, srcW, srcH);
+    sw_get_rect(out->Info, dstX, dstY, dstW, dstH);
+    sw_resize_plane<Tout, Tin>(out->Data.Y, sw_pitch(out->Data), dstX, dstY, dstW, dstH,
+        in->Data.Y, sw_pitch(in->Data), srcX, srcY, srcW, srcH, 1);
+    sw_resize_plane<Tout, Tin>(out->Data.UV, sw_pitch(out->Data), dstX / 2, dstY / 2, dstW / 2, dstH / 2,
+        in->Data.UV, sw_pitch(in->Data), srcX / 2, srcY / 2, srcW / 2, srcH / 2, 2);
+}
+
+MFXVideoDECODE *qsv_create_decode(MFXVideoSession *session) {
+    if (auto swSession = dynamic_cast<QSVSWSession *>(session)) {
+        return new QSVSWDecode(swSession);
+    }
+    return new MFXVideoDECODE(*session);
+}
+
+MFXVideoVPP *qsv_create_vpp(MFXVideoSession *session) {
+    if (auto swSession = dynamic_cast<QSVSWSession *>(session)) {
+        return new QSVSWVPP(swSession);
+    }
+    return new MFXVideoVPP(*session);
+}
+
+MFXVideoENCODE *qsv_create_encode(MFXVideoSession *session) {
+    if (auto swSession = dynamic_cast<QSVSWSession *>(session)) {
+        return new QSVSWEncode(swSession);
+    }
+    return new MFXVideoENCODE(*session);
+}
+
+bool qsv_is_sw_session(MFXVideoSession *session) {
+    return dynamic_cast<QSVSWSession *>(session) != nullptr;
+}
+
+QSVSWSession::QSVSWSession(const sSWSessionPrm& prm, const mfxFrameInfo& decFrameInfo) :
+    m_prm(prm),
+    m_decFrameInfo(decFrameInfo),
+    m_pAllocator(nullptr),
+    m_bInit(false),
+    m_mtxTask(),
+    m_nDefaultAsyncDepth(0),
+    m_nCallCount(0),
+    m_nNextTaskId(1),
+    m_nTaskInFlight(),
+    m_lastTaskEnd(),
+    m_tasks() {
+}
+
+QSVSWSession::~QSVSWSession() {
+    Close();
+}
+
+mfxStatus QSVSWSession::Init(mfxIMPL impl, mfxVersion *ver) {
+    m_bInit = true;
+    return MFX_ERR_NONE;
+}
+
+mfxStatus QSVSWSession::InitEx(mfxInitParam par) {
+    m_bInit = true;
+    return MFX_ERR_NONE;
+}
+
+mfxStatus QSVSWSession::Close(void) {
+    std::lock_guard<std::mutex> lock(m_mtxTask);
+    m_tasks.clear();
+    memset(m_nTaskInFlight, 0, sizeof(m_nTaskInFlight));
+    m_pAllocator = nullptr;
+    m_bInit = false;
+    return MFX_ERR_NONE;
+}
+
+mfxStatus QSVSWSession::QueryIMPL(mfxIMPL *impl) {
+    if (impl == nullptr) {
+        return MFX_ERR_NULL_PTR;
+    }
+    *impl = MFX_IMPL_SOFTWARE;
+    return MFX_ERR_NONE;
+}
+
+mfxStatus QSVSWSession::QueryVersion(mfxVersion *version) {
+    if (version == nullptr) {
+        return MFX_ERR_NULL_PTR;
+    }
+    //ヘッダのAPIバージョンをすべてサポートしているものとする
+    version->Major = MFX_VERSION_MAJOR;
+    version->Minor = MFX_VERSION_MINOR;
+    return MFX_ERR_NONE;
+}
+
+mfxStatus QSVSWSession::JoinSession(mfxSession child_session) {
+    return MFX_ERR_UNSUPPORTED;
+}
+
+mfxStatus QSVSWSession::DisjoinSession() {
+    return MFX_ERR_UNSUPPORTED;
+}
+
+mfxStatus QSVSWSession::CloneSession(mfxSession *clone) {
+    return MFX_ERR_UNSUPPORTED;
+}
+
+mfxStatus QSVSWSession::SetPriority(mfxPriority priority) {
+    return MFX_ERR_NONE;
+}
+
+mfxStatus QSVSWSession::GetPriority(mfxPriority *priority) {
+    if (priority == nullptr) {
+        return MFX_ERR_NULL_PTR;
+    }
+    *priority = MFX_PRIORITY_NORMAL;
+    return MFX_ERR_NONE;
+}
+
+mfxStatus QSVSWSession::SetBufferAllocator(mfxBufferAllocator *allocator) {
+    return MFX_ERR_NONE;
+}
+
+mfxStatus QSVSWSession::SetFrameAllocator(mfxFrameAllocator *allocator) {
+    m_pAllocator = allocator;
+    return MFX_ERR_NONE;
+}
+
+mfxStatus QSVSWSession::SetHandle(mfxHandleType type, mfxHDL hdl) {
+    return MFX_ERR_NONE;
+}
+
+mfxStatus QSVSWSession::GetHandle(mfxHandleType type, mfxHDL *hdl) {
+    return MFX_ERR_NOT_FOUND;
+}
+
+mfxStatus QSVSWSession::QueryPlatform(mfxPlatform *platform) {
+    if (platform == nullptr) {
+        return MFX_ERR_NULL_PTR;
+    }
+    memset(platform, 0, sizeof(platform[0]));
+    return MFX_ERR_UNSUPPORTED;
+}
+
+mfxStatus QSVSWSession::DoWork() {
+    return MFX_ERR_NONE;
+}
+
+void QSVSWSession::SetDefaultAsyncDepth(int asyncDepth) {
+    std::lock_guard<std::mutex> lock(m_mtxTask);
+    m_nDefaultAsyncDepth = std::max(m_nDefaultAsyncDepth, asyncDepth);
+}
+
+void QSVSWSession::RetireTasks(std::chrono::steady_clock::time_point now) {
+    //タスクの終了時刻はIDの順に単調増加するので、先頭から終了したものを取り除けばよい
+    while (m_tasks.size() > 0 && m_tasks.begin()->second.end <= now) {
+        m_nTaskInFlight[m_tasks.begin()->second.type]--;
+        m_tasks.erase(m_tasks.begin());
+    }
+}
+
+mfxStatus QSVSWSession::CheckBusy(int type) {
+    std::lock_guard<std::mutex> lock(m_mtxTask);
+    RetireTasks(std::chrono::steady_clock::now());
+    if (m_prm.busyInterval > 0 && (++m_nCallCount % m_prm.busyInterval) == 0) {
+        return MFX_WRN_DEVICE_BUSY;
+    }
+    const int asyncDepth = (m_prm.asyncDepth > 0) ? m_prm.asyncDepth : m_nDefaultAsyncDepth;
+    if (asyncDepth > 0 && m_nTaskInFlight[type] >= asyncDepth) {
+        return MFX_WRN_DEVICE_BUSY;
+    }
+    return MFX_ERR_NONE;
+}
+
+mfxSyncPoint QSVSWSession::AddTask(int type) {
+    std::lock_guard<std::mutex> lock(m_mtxTask);
+    //GPU上の処理を模して、タスクは投入された順に1つずつ処理されるものとする
+    const auto now = std::chrono::steady_clock::now();
+    const auto start = std::max(now, m_lastTaskEnd);
+    m_lastTaskEnd = start + std::chrono::microseconds(m_prm.taskDurationUs);
+    const uint64_t id = m_nNextTaskId++;
+    m_tasks[id] = SWTask{ m_lastTaskEnd, type };
+    m_nTaskInFlight[type]++;
+    return (mfxSyncPoint)(size_t)id;
+}
+
+mfxStatus QSVSWSession::SyncOperation(mfxSyncPoint syncp, mfxU32 wait) {
+    if (syncp == nullptr) {
+        return MFX_ERR_NULL_PTR;
+    }
+    const uint64_t id = (uint64_t)(size_t)syncp;
+    std::unique_lock<std::mutex> lock(m_mtxTask);
+    if (id >= m_nNextTaskId) {
+        return MFX_ERR_UNDEFINED_BEHAVIOR;
+    }
+    auto task = m_tasks.find(id);
+    if (task == m_tasks.end()) {
+        return MFX_ERR_NONE; //終了済み
+    }
+    const auto end = task->second.end;
+    const auto now = std::chrono::steady_clock::now();
+    if (end > now) {
+        if (end - now > std::chrono::milliseconds(wait)) {
+            lock.unlock();
+            std::this_thread::sleep_for(std::chrono::milliseconds(wait));
+            return MFX_WRN_IN_EXECUTION;
+        }
+        lock.unlock();
+        std::this_thread::sleep_until(end);
+        lock.lock();
+    }
+    RetireTasks(std::chrono::steady_clock::now());
+    return MFX_ERR_NONE;
+}
+
+mfxStatus QSVSWSession::LockSurface(mfxFrameSurface1 *surf, bool *locked) {
+    *locked = false;
+    if (surf->Data.Y == nullptr) {
+        if (m_pAllocator == nullptr || surf->Data.MemId == nullptr) {
+            return MFX_ERR_LOCK_MEMORY;
+        }
+        auto sts = m_pAllocator->Lock(m_pAllocator->pthis, surf->Data.MemId, &surf->Data);
+        if (sts != MFX_ERR_NONE) {
+            return sts;
+        }
+        *locked = true;
+    }
+    return MFX_ERR_NONE;
+}
+
+mfxStatus QSVSWSession::UnlockSurface(mfxFrameSurface1 *surf, bool locked) {
+    if (locked) {
+        return m_pAllocator->Unlock(m_pAllocator->pthis, surf->Data.MemId, &surf->Data);
+    }
+    return MFX_ERR_NONE;
+}
+
+QSVSWDecode::QSVSWDecode(QSVSWSession *session) :
+    MFXVideoDECODE(nullptr),
+    m_swSession(session),
+    m_param(),
+    m_bInit(false),
+    m_nFrameIn(0),
+    m_nFrameOut(0),
+    m_frames() {
+}
+
+QSVSWDecode::~QSVSWDecode() {
+    Close();
+}
+
+mfxStatus QSVSWDecode::Query(mfxVideoParam *in, mfxVideoParam *out) {
+    if (out == nullptr) {
+        return MFX_ERR_NULL_PTR;
+    }
+    if (in) {
+        sw_copy_video_param(out, in);
+    }
+    return MFX_ERR_NONE;
+}
+
+mfxStatus QSVSWDecode::DecodeHeader(mfxBitstream *bs, mfxVideoParam *par) {
+    if (bs == nullptr || par == nullptr) {
+        return MFX_ERR_NULL_PTR;
+    }
+    const auto& frameInfo = m_swSession->decFrameInfo();
+    if (frameInfo.Width == 0 || frameInfo.Height == 0) {
+        return MFX_ERR_MORE_DATA;
+    }
+    par->mfx.FrameInfo = frameInfo;
+    par->mfx.CodecProfile = 0;
+    par->mfx.CodecLevel = 0;
+    //渡されたデータはすべてヘッダとして扱い、フレームとしてはデコードしない
+    bs->DataOffset += bs->DataLength;
+    bs->DataLength = 0;
+    return MFX_ERR_NONE;
+}
+
+mfxStatus QSVSWDecode::QueryIOSurf(mfxVideoParam *par, mfxFrameAllocRequest *request) {
+    if (par == nullptr || request == nullptr) {
+        return MFX_ERR_NULL_PTR;
+    }
+    memset(request, 0, sizeof(request[0]));
+    request->Info = par->mfx.FrameInfo;
+    request->Type = MFX_MEMTYPE_EXTERNAL_FRAME | MFX_MEMTYPE_FROM_DECODE | MFX_MEMTYPE_SYSTEM_MEMORY;
+    request->NumFrameMin = (mfxU16)(m_swSession->prm().reorderDelay + 1);
+    request->NumFrameSuggested = (mfxU16)(request->NumFrameMin + std::max<int>(1, par->AsyncDepth));
+    return MFX_ERR_NONE;
+}
+
+mfxStatus QSVSWDecode::Init(mfxVideoParam *par) {
+    if (par == nullptr) {
+        return MFX_ERR_NULL_PTR;
+    }
+    if (m_bInit) {
+        return MFX_ERR_UNDEFINED_BEHAVIOR;
+    }
+    if (!sw_fourcc_supported(par->mfx.FrameInfo.FourCC)) {
+        return MFX_ERR_INVALID_VIDEO_PARAM;
+    }
+    m_param = *par;
+    m_nFrameIn = 0;
+    m_nFrameOut = 0;
+    m_swSession->SetDefaultAsyncDepth(par->AsyncDepth);
+    m_bInit = true;
+    return MFX_ERR_NONE;
+}
+
+mfxStatus QSVSWDecode::Reset(mfxVideoParam *par) {
+    Close();
+    return Init(par);
+}
+
+mfxStatus QSVSWDecode::Close(void) {
+    if (!m_bInit) {
+        return MFX_ERR_NOT_INITIALIZED;
+    }
+    for (auto& frame : m_frames) {
+        frame.surf->Data.Locked--;
+    }
+    m_frames.clear();
+    m_bInit = false;
+    return MFX_ERR_NONE;
+}
+
+mfxStatus QSVSWDecode::GetVideoParam(mfxVideoParam *par) {
+    if (par == nullptr) {
+        return MFX_ERR_NULL_PTR;
+    }
+    if (!m_bInit) {
+        return MFX_ERR_NOT_INITIALIZED;
+    }
+    sw_copy_video_param(par, &m_param);
+    return MFX_ERR_NONE;
+}
+
+mfxStatus QSVSWDecode::GetDecodeStat(mfxDecodeStat *stat) {
+    if (stat == nullptr) {
+        return MFX_ERR_NULL_PTR;
+    }
+    memset(stat, 0, sizeof(stat[0]));
+    stat->NumFrame = m_nFrameOut;
+    stat->NumCachedFrame = (mfxU32)m_frames.size();
+    return MFX_ERR_NONE;
+}
+
+mfxStatus QSVSWDecode::GetPayload(mfxU64 *ts, mfxPayload *payload) {
+    if (ts == nullptr || payload == nullptr) {
+        return MFX_ERR_NULL_PTR;
+    }
+    *ts = 0;
+    payload->NumBit = 0;
+    return MFX_ERR_NONE;
+}
+
+mfxStatus QSVSWDecode::SetSkipMode(mfxSkipMode mode) {
+    return MFX_ERR_NONE;
+}
+
+mfxStatus QSVSWDecode::DecodeFrameAsync(mfxBitstream *bs, mfxFrameSurface1 *surface_work, mfxFrameSurface1 **surface_out, mfxSyncPoint *syncp) {
+    if (!m_bInit) {
+        return MFX_ERR_NOT_INITIALIZED;
+    }
+    if (surface_out == nullptr || syncp == nullptr) {
+        return MFX_ERR_NULL_PTR;
+    }
+    *surface_out = nullptr;
+    *syncp = nullptr;
+    if (bs != nullptr && bs->DataLength == 0) {
+        return MFX_ERR_MORE_DATA;
+    }
+    auto sts = m_swSession->CheckBusy(QSV_SW_TASK_DEC);
+    if (sts != MFX_ERR_NONE) {
+        return sts;
+    }
+    if (bs) {
+        if (surface_work == nullptr) {
+            return MFX_ERR_NULL_PTR;
+        }
+        //ビットストリームは1回の呼び出しで1フレーム分として、すべて消費する
+        bool locked = false;
+        if (MFX_ERR_NONE != (sts = m_swSession->LockSurface(surface_work, &locked))) {
+            return sts;
+        }
+        surface_work->Info.CropX = m_param.mfx.FrameInfo.CropX;
+        surface_work->Info.CropY = m_param.mfx.FrameInfo.CropY;
+        surface_work->Info.CropW = m_param.mfx.FrameInfo.CropW;
+        surface_work->Info.CropH = m_param.mfx.FrameInfo.CropH;
+        surface_work->Info.PicStruct = m_param.mfx.FrameInfo.PicStruct;
+        sw_fill_pattern(surface_work, m_nFrameIn);
+        m_swSession->UnlockSurface(surface_work, locked);
+
+        surface_work->Data.TimeStamp = bs->TimeStamp;
+        surface_work->Data.FrameOrder = m_nFrameIn++;
+        surface_work->Data.Locked++;
+        m_frames.push_back({ surface_work, bs->TimeStamp });
+        bs->DataOffset += bs->DataLength;
+        bs->DataLength = 0;
+        if ((int)m_frames.size() <= m_swSession->prm().reorderDelay) {
+            return MFX_ERR_MORE_DATA;
+        }
+    } else if (m_frames.size() == 0) {
+        return MFX_ERR_MORE_DATA;
+    }
+    auto frame = m_frames.front();
+    m_frames.pop_front();
+    frame.surf->Data.Locked--;
+    *surface_out = frame.surf;
+    *syncp = m_swSession->AddTask(QSV_SW_TASK_DEC);
+    m_nFrameOut++;
+    return MFX_ERR_NONE;
+}
+
+QSVSWVPP::QSVSWVPP(QSVSWSession *session) :
+    MFXVideoVPP(nullptr),
+    m_swSession(session),
+    m_param(),
+    m_bInit(false),
+    m_nFrameCount(0) {
+}
+
+QSVSWVPP::~QSVSWVPP() {
+    Close();
+}
+
+mfxStatus QSVSWVPP::Query(mfxVideoParam *in, mfxVideoParam *out) {
+    if (out == nullptr) {
+        return MFX_ERR_NULL_PTR;
+    }
+    if (in) {
+        sw_copy_video_param(out, in);
+    }
+    return MFX_ERR_NONE;
+}
+
+mfxStatus QSVSWVPP::QueryIOSurf(mfxVideoParam *par, mfxFrameAllocRequest request[2]) {
+    if (par == nullptr || request == nullptr) {
+        return MFX_ERR_NULL_PTR;
+    }
+    memset(request, 0, sizeof(request[0]) * 2);
+    request[0].Info = par->vpp.In;
+    request[0].Type = MFX_MEMTYPE_EXTERNAL_FRAME | MFX_MEMTYPE_FROM_VPPIN | MFX_MEMTYPE_SYSTEM_MEMORY;
+    request[0].NumFrameMin = 1;
+    request[0].NumFrameSuggested = (mfxU16)(1 + std::max<int>(1, par->AsyncDepth));
+    request[1].Info = par->vpp.Out;
+    request[1].Type = MFX_MEMTYPE_EXTERNAL_FRAME | MFX_MEMTYPE_FROM_VPPOUT | MFX_MEMTYPE_SYSTEM_MEMORY;
+    request[1].NumFrameMin = 1;
+    request[1].NumFrameSuggested = (mfxU16)(1 + std::max<int>(1, par->AsyncDepth));
+    return MFX_ERR_NONE;
+}
+
+mfxStatus QSVSWVPP::Init(mfxVideoParam *par) {
+    if (par == nullptr) {
+        return MFX_ERR_NULL_PTR;
+    }
+    if (m_bInit) {
+        return MFX_ERR_UNDEFINED_BEHAVIOR;
+    }
+    if (!sw_fourcc_supported(par->vpp.In.FourCC) || !sw_fourcc_supported(par->vpp.Out.FourCC)) {
+        return MFX_ERR_INVALID_VIDEO_PARAM;
+    }
+    m_param = *par;
+    m_nFrameCount = 0;
+    m_swSession->SetDefaultAsyncDepth(par->AsyncDepth);
+    m_bInit = true;
+    return MFX_ERR_NONE;
+}
+
+mfxStatus QSVSWVPP::Reset(mfxVideoParam *par) {
+    Close();
+    return Init(par);
+}
+
+mfxStatus QSVSWVPP::Close(void) {
+    if (!m_bInit) {
+        return MFX_ERR_NOT_INITIALIZED;
+    }
+    m_bInit = false;
+    return MFX_ERR_NONE;
+}
+
+mfxStatus QSVSWVPP::GetVideoParam(mfxVideoParam *par) {
+    if (par == nullptr) {
+        return MFX_ERR_NULL_PTR;
+    }
+    if (!m_bInit) {
+        return MFX_ERR_NOT_INITIALIZED;
+    }
+    sw_copy_video_param(par, &m_param);
+    return MFX_ERR_NONE;
+}
+
+mfxStatus QSVSWVPP::GetVPPStat(mfxVPPStat *stat) {
+    if (stat == nullptr) {
+        return MFX_ERR_NULL_PTR;
+    }
+    memset(stat, 0, sizeof(stat[0]));
+    stat->NumFrame = m_nFrameCount;
+    return MFX_ERR_NONE;
+}
+
+mfxStatus QSVSWVPP::RunFrameVPPAsync(mfxFrameSurface1 *in, mfxFrameSurface1 *out, mfxExtVppAuxData *aux, mfxSyncPoint *syncp) {
+    if (!m_bInit) {
+        return MFX_ERR_NOT_INITIALIZED;
+    }
+    if (syncp == nullptr) {
+        return MFX_ERR_NULL_PTR;
+    }
+    *syncp = nullptr;
+    //フレームを保持しないので、flush時に出力するフレームはない
+    if (in == nullptr) {
+        return MFX_ERR_MORE_DATA;
+    }
+    if (out == nullptr) {
+        return MFX_ERR_NULL_PTR;
+    }
+    auto sts = m_swSession->CheckBusy(QSV_SW_TASK_VPP);
+    if (sts != MFX_ERR_NONE) {
+        return sts;
+    }
+    bool lockedIn = false, lockedOut = false;
+    if (   MFX_ERR_NONE != (sts = m_swSession->LockSurface(in, &lockedIn))
+        || MFX_ERR_NONE != (sts = m_swSession->LockSurface(out, &lockedOut))) {
+        m_swSession->UnlockSurface(in, lockedIn);
+        return sts;
+    }
+    if (out->Info.CropW == 0 || out->Info.CropH == 0) {
+        out->Info.CropX = m_param.vpp.Out.CropX;
+        out->Info.CropY = m_param.vpp.Out.CropY;
+        out->Info.CropW = m_param.vpp.Out.CropW;
+        out->Info.CropH = m_param.vpp.Out.CropH;
+    }
+    const bool in16 = sw_pixel_size(in->Info.FourCC) == 2;
+    const bool out16 = sw_pixel_size(out->Info.FourCC) == 2;
+    if (in16) {
+        if (out16) sw_resize_frame<uint16_t, uint16_t>(out, in);
+        else       sw_resize_frame<uint8_t,  uint16_t>(out, in);
+    } else {
+        if (out16) sw_resize_frame<uint16_t, uint8_t>(out, in);
+        else       sw_resize_frame<uint8_t,  uint8_t>(out, in);
+    }
+    m_swSession->UnlockSurface(out, lockedOut);
+    m_swSession->UnlockSurface(in, lockedIn);
+
+    out->Data.TimeStamp = in->Data.TimeStamp;
+    out->Data.FrameOrder = m_nFrameCount++;
+    out->Data.DataFlag = in->Data.DataFlag;
+    out->Info.PicStruct = m_param.vpp.Out.PicStruct;
+    *syncp = m_swSession->AddTask(QSV_SW_TASK_VPP);
+    return MFX_ERR_NONE;
+}
+
+mfxStatus QSVSWVPP::RunFrameVPPAsyncEx(mfxFrameSurface1 *in, mfxFrameSurface1 *work, mfxFrameSurface1 **out, mfxSyncPoint *syncp) {
+    if (out == nullptr) {
+        return MFX_ERR_NULL_PTR;
+    }
+    *out = work;
+    return RunFrameVPPAsync(in, work, nullptr, syncp);
+}
+
+QSVSWEncode::QSVSWEncode(QSVSWSession *session) :
+    MFXVideoENCODE(nullptr),
+    m_swSession(session),
+    m_param(),
+    m_bInit(false),
+    m_nFrameIn(0),
+    m_nFrameOut(0),
+    m_nFrameDuration(0),
+    m_frames() {
+}
+
+QSVSWEncode::~QSVSWEncode() {
+    Close();
+}
+
+mfxStatus QSVSWEncode::Query(mfxVideoParam *in, mfxVideoParam *out) {
+    if (out == nullptr) {
+        return MFX_ERR_NULL_PTR;
+    }
+    if (in) {
+        sw_copy_video_param(out, in);
+    }
+    return MFX_ERR_NONE;
+}
+
+mfxStatus QSVSWEncode::QueryIOSurf(mfxVideoParam *par, mfxFrameAllocRequest *request) {
+    if (par == nullptr || request == nullptr) {
+        return MFX_ERR_NULL_PTR;
+    }
+    memset(request, 0, sizeof(request[0]));
+    request->Info = par->mfx.FrameInfo;
+    request->Type = MFX_MEMTYPE_EXTERNAL_FRAME | MFX_MEMTYPE_FROM_ENCODE | MFX_MEMTYPE_SYSTEM_MEMORY;
+    request->NumFrameMin = (mfxU16)(m_swSession->prm().reorderDelay + 1);
+    request->NumFrameSuggested = (mfxU16)(request->NumFrameMin + std::max<int>(1, par->AsyncDepth));
+    return MFX_ERR_NONE;
+}
+
+mfxStatus QSVSWEncode::Init(mfxVideoParam *par) {
+    if (par == nullptr) {
+        return MFX_ERR_NULL_PTR;
+    }
+    if (m_bInit) {
+        return MFX_ERR_UNDEFINED_BEHAVIOR;
+    }
+    if (!sw_fourcc_supported(par->mfx.FrameInfo.FourCC)) {
+        return MFX_ERR_INVALID_VIDEO_PARAM;
+    }
+    m_param = *par;
+    //AllocateSufficientBufferで使用される
+    m_param.mfx.BufferSizeInKB = std::max<mfxU16>(m_param.mfx.BufferSizeInKB, 1);
+    m_nFrameDuration = (par->mfx.FrameInfo.FrameRateExtN > 0 && par->mfx.FrameInfo.FrameRateExtD > 0)
+        ? (int64_t)90000 * par->mfx.FrameInfo.FrameRateExtD / par->mfx.FrameInfo.FrameRateExtN : 3003;
+    m_nFrameIn = 0;
+    m_nFrameOut = 0;
+    m_swSession->SetDefaultAsyncDepth(par->AsyncDepth);
+    m_bInit = true;
+    return MFX_ERR_NONE;
+}
+
+mfxStatus QSVSWEncode::Reset(mfxVideoParam *par) {
+    Close();
+    return Init(par);
+}
+
+mfxStatus QSVSWEncode::Close(void) {
+    if (!m_bInit) {
+        return MFX_ERR_NOT_INITIALIZED;
+    }
+    for (auto& frame : m_frames) {
+        frame.surf->Data.Locked--;
+    }
+    m_frames.clear();
+    m_bInit = false;
+    return MFX_ERR_NONE;
+}
+
+mfxStatus QSVSWEncode::GetVideoParam(mfxVideoParam *par) {
+    if (par == nullptr) {
+        return MFX_ERR_NULL_PTR;
+    }
+    if (!m_bInit) {
+        return MFX_ERR_NOT_INITIALIZED;
+    }
+    sw_copy_video_param(par, &m_param);
+    return MFX_ERR_NONE;
+}
+
+mfxStatus QSVSWEncode::GetEncodeStat(mfxEncodeStat *stat) {
+    if (stat == nullptr) {
+        return MFX_ERR_NULL_PTR;
+    }
+    memset(stat, 0, sizeof(stat[0]));
+    stat->NumFrame = m_nFrameOut;
+    stat->NumCachedFrame = (mfxU32)m_frames.size();
+    return MFX_ERR_NONE;
+}
+
+mfxStatus QSVSWEncode::EncodeFrameAsync(mfxEncodeCtrl *ctrl, mfxFrameSurface1 *surface, mfxBitstream *bs, mfxSyncPoint *syncp) {
+    if (!m_bInit) {
+        return MFX_ERR_NOT_INITIALIZED;
+    }
+    if (bs == nullptr || syncp == nullptr) {
+        return MFX_ERR_NULL_PTR;
+    }
+    *syncp = nullptr;
+    if (surface == nullptr && m_frames.size() == 0) {
+        return MFX_ERR_MORE_DATA;
+    }
+    auto sts = m_swSession->CheckBusy(QSV_SW_TASK_ENC);
+    if (sts != MFX_ERR_NONE) {
+        return sts;
+    }
+    //reorderDelay分のフレームがたまるまでは出力しない
+    const bool output = (surface == nullptr) || ((int)m_frames.size() + 1 > m_swSession->prm().reorderDelay);
+    if (output && bs->MaxLength < bs->DataOffset + bs->DataLength + QSV_SW_ENC_MAX_FRAME_SIZE) {
+        return MFX_ERR_NOT_ENOUGH_BUFFER;
+    }
+    if (surface) {
+        surface->Data.Locked++;
+        m_frames.push_back({ surface, surface->Data.TimeStamp, surface->Info.PicStruct });
+        m_nFrameIn++;
+    }
+    if (!output) {
+        return MFX_ERR_MORE_DATA;
+    }
+
+    auto frame = m_frames.front();
+    m_frames.pop_front();
+    bool locked = false;
+    if (MFX_ERR_NONE != (sts = m_swSession->LockSurface(frame.surf, &locked))) {
+        frame.surf->Data.Locked--;
+        return sts;
+    }
+    const uint32_t checksum = sw_luma_checksum(frame.surf);
+    m_swSession->UnlockSurface(frame.surf, locked);
+    frame.surf->Data.Locked--;
+
+    const uint32_t frameIndex = m_nFrameOut++;
+    const mfxU16 gopLen = m_param.mfx.GopPicSize;
+    const bool keyframe = frameIndex == 0 || (gopLen > 0 && (frameIndex % gopLen) == 0);
+    const mfxU16 frameType = (keyframe) ? (MFX_FRAMETYPE_IDR | MFX_FRAMETYPE_I | MFX_FRAMETYPE_REF) : (MFX_FRAMETYPE_P | MFX_FRAMETYPE_REF);
+
+    //NAL unit typeが"unspecified"のNALユニットとして、フレームの情報を出力する
+    //0x00を含まない文字列とすることで、emulation preventionは不要
+    uint8_t *ptr = bs->Data + bs->DataOffset + bs->DataLength;
+    uint8_t *const ptrStart = ptr;
+    if (m_param.mfx.CodecId == MFX_CODEC_AVC || m_param.mfx.CodecId == MFX_CODEC_HEVC) {
+        *ptr++ = 0x00;
+        *ptr++ = 0x00;
+        *ptr++ = 0x00;
+        *ptr++ = 0x01;
+        if (m_param.mfx.CodecId == MFX_CODEC_HEVC) {
+            *ptr++ = (48 << 1); //nal_unit_type = 48 (unspecified)
+            *ptr++ = 0x01;      //nuh_temporal_id_plus1 = 1
+        } else {
+            *ptr++ = 0x00;      //nal_unit_type = 0 (unspecified)
+        }
+    }
+    char payload[128];
+    const int payloadLen = snprintf(payload, sizeof(payload), "QSVSW frame=%u pts=%lld type=%c sum=%08x",
+        frameIndex, (long long)(int64_t)frame.timestamp, (keyframe) ? 'I' : 'P', checksum);
+    memcpy(ptr, payload, payloadLen);
+    ptr += payloadLen;
+    bs->DataLength += (mfxU32)(ptr - ptrStart);
+
+    bs->TimeStamp = frame.timestamp;
+    bs->DecodeTimeStamp = (frame.timestamp == (mfxU64)MFX_TIMESTAMP_UNKNOWN)
+        ? (mfxI64)MFX_TIMESTAMP_UNKNOWN : (mfxI64)frame.timestamp - m_swSession->prm().reorderDelay * m_nFrameDuration;
+    bs->FrameType = frameType;
+    bs->PicStruct = frame.picstruct;
+    *syncp = m_swSession->AddTask(QSV_SW_TASK_ENC);
+    return MFX_ERR_NONE;
+}
@@ -0,0 +1,214 @@
+﻿// -----------------------------------------------------------------------------------------
+// QSVEnc by rigaya
+// -----------------------------------------------------------------------------------------
+// The MIT License
+//
+// Copyright (c) 2011-2016 rigaya
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// ------------------------------------------------------------------------------------------
+
+#ifndef __QSV_SW_SESSION_H__
+#define __QSV_SW_SESSION_H__
+
+#include <cstdint>
+#include <map>
+#include <deque>
+#include <mutex>
+#include <chrono>
+#include <mfxvideo++.h>
+#include "qsv_prm.h"
+
+//GPUを使用せずに、CQSVPipelineのスケジューリング(サーフェスの取得、flush、trim、avsyncなど)を
+//動作させるためのMFXVideoSession/DECODE/VPP/ENCODEのソフトウェアによる代替実装
+//  - 処理はすべてシステムメモリ上で、各Async関数の呼び出し時に同期的に行う
+//  - SyncPointは擬似的な処理時間を持つタスクとして管理し、
+//    処理中のタスク数がasyncDepthに達するとMFX_WRN_DEVICE_BUSYを返す
+//  - busyIntervalを指定すると、その回数に1回MFX_WRN_DEVICE_BUSYを返す
+//  - reorderDelayを指定すると、デコーダ/エンコーダがその分だけフレームを保持してから出力する
+//  - 対応するフレーム形式はNV12/P010のみ
+//エンコーダの出力は、フレーム番号・タイムスタンプ・輝度のチェックサムを格納した
+//"unspecified"タイプのNALユニットとなり、実際に再生可能なストリームではない
+
+class QSVSWSession;
+
+enum {
+    QSV_SW_TASK_DEC = 0,
+    QSV_SW_TASK_VPP,
+    QSV_SW_TASK_ENC,
+    QSV_SW_TASK_MAX,
+};
+
+//sessionがQSVSWSessionならソフトウェアによる代替実装を、そうでなければMediaSDKのコンポーネントを作成する
+MFXVideoDECODE *qsv_create_decode(MFXVideoSession *session);
+MFXVideoVPP    *qsv_create_vpp(MFXVideoSession *session);
+MFXVideoENCODE *qsv_create_encode(MFXVideoSession *session);
+
+//sessionがQSVSWSessionかどうか
+bool qsv_is_sw_session(MFXVideoSession *session);
+
+class QSVSWSession : public MFXVideoSession {
+public:
+    QSVSWSession(const sSWSessionPrm& prm, const mfxFrameInfo& decFrameInfo);
+    virtual ~QSVSWSession();
+
+    virtual mfxStatus Init(mfxIMPL impl, mfxVersion *ver) override;
+    virtual mfxStatus InitEx(mfxInitParam par) override;
+    virtual mfxStatus Close(void) override;
+
+    virtual mfxStatus QueryIMPL(mfxIMPL *impl) override;
+    virtual mfxStatus QueryVersion(mfxVersion *version) override;
+
+    virtual mfxStatus JoinSession(mfxSession child_session) override;
+    virtual mfxStatus DisjoinSession() override;
+    virtual mfxStatus CloneSession(mfxSession *clone) override;
+    virtual mfxStatus SetPriority(mfxPriority priority) override;
+    virtual mfxStatus GetPriority(mfxPriority *priority) override;
+
+    virtual mfxStatus SetBufferAllocator(mfxBufferAllocator *allocator) override;
+    virtual mfxStatus SetFrameAllocator(mfxFrameAllocator *allocator) override;
+    virtual mfxStatus SetHandle(mfxHandleType type, mfxHDL hdl) override;
+    virtual mfxStatus GetHandle(mfxHandleType type, mfxHDL *hdl) override;
+    virtual mfxStatus QueryPlatform(mfxPlatform *platform) override;
+
+    virtual mfxStatus SyncOperation(mfxSyncPoint syncp, mfxU32 wait) override;
+    virtual mfxStatus DoWork() override;
+
+    //以下は各コンポーネントから使用する
+    const sSWSessionPrm& prm() const { return m_prm; }
+    const mfxFrameInfo& decFrameInfo() const { return m_decFrameInfo; }
+
+    //prm.asyncDepthが指定されていない場合に使用する値を設定する (各コンポーネントのInitから呼ぶ)
+    void SetDefaultAsyncDepth(int asyncDepth);
+    //typeの要素に新たなタスクを投入できない場合にはMFX_WRN_DEVICE_BUSYを返す
+    mfxStatus CheckBusy(int type);
+    //擬似的な処理時間を持つタスクを登録し、そのSyncPointを返す
+    mfxSyncPoint AddTask(int type);
+
+    //外部allocatorを使用している場合、必要に応じてサーフェスをLockする
+    mfxStatus LockSurface(mfxFrameSurface1 *surf, bool *locked);
+    mfxStatus UnlockSurface(mfxFrameSurface1 *surf, bool locked);
+
+protected:
+    void RetireTasks(std::chrono::steady_clock::time_point now);
+
+    sSWSessionPrm m_prm;
+    mfxFrameInfo m_decFrameInfo;
+    mfxFrameAllocator *m_pAllocator;
+    bool m_bInit;
+
+    struct SWTask {
+        std::chrono::steady_clock::time_point end; //擬似的な処理の終了時刻
+        int type; //QSV_SW_TASK_xxx
+    };
+    std::mutex m_mtxTask;
+    int m_nDefaultAsyncDepth;
+    uint64_t m_nCallCount;  //busyIntervalのカウント用
+    uint64_t m_nNextTaskId; //次に発行するタスクのID (0はnullptrになるので使用しない)
+    int m_nTaskInFlight[QSV_SW_TASK_MAX]; //各要素の未完了のタスク数
+    std::chrono::steady_clock::time_point m_lastTaskEnd; //最後に投入したタスクの終了時刻
+    std::map<uint64_t, SWTask> m_tasks; //未完了のタスク
+};
+
+class QSVSWDecode : public MFXVideoDECODE {
+public:
+    QSVSWDecode(QSVSWSession *session);
+    virtual ~QSVSWDecode();
+
+    virtual mfxStatus Query(mfxVideoParam *in, mfxVideoParam *out) override;
+    virtual mfxStatus DecodeHeader(mfxBitstream *bs, mfxVideoParam *par) override;
+    virtual mfxStatus QueryIOSurf(mfxVideoParam *par, mfxFrameAllocRequest *request) override;
+    virtual mfxStatus Init(mfxVideoParam *par) override;
+    virtual mfxStatus Reset(mfxVideoParam *par) override;
+    virtual mfxStatus Close(void) override;
+
+    virtual mfxStatus GetVideoParam(mfxVideoParam *par) override;
+    virtual mfxStatus GetDecodeStat(mfxDecodeStat *stat) override;
+    virtual mfxStatus GetPayload(mfxU64 *ts, mfxPayload *payload) override;
+    virtual mfxStatus SetSkipMode(mfxSkipMode mode) override;
+    virtual mfxStatus DecodeFrameAsync(mfxBitstream *bs, mfxFrameSurface1 *surface_work, mfxFrameSurface1 **surface_out, mfxSyncPoint *syncp) override;
+
+protected:
+    struct DecFrame {
+        mfxFrameSurface1 *surf;
+        mfxU64 timestamp;
+    };
+    QSVSWSession *m_swSession;
+    mfxVideoParam m_param;
+    bool m_bInit;
+    uint32_t m_nFrameIn;
+    uint32_t m_nFrameOut;
+    std::deque<DecFrame> m_frames; //reorderDelay分保持しているフレーム
+};
+
+class QSVSWVPP : public MFXVideoVPP {
+public:
+    QSVSWVPP(QSVSWSession *session);
+    virtual ~QSVSWVPP();
+
+    virtual mfxStatus Query(mfxVideoParam *in, mfxVideoParam *out) override;
+    virtual mfxStatus QueryIOSurf(mfxVideoParam *par, mfxFrameAllocRequest request[2]) override;
+    virtual mfxStatus Init(mfxVideoParam *par) override;
+    virtual mfxStatus Reset(mfxVideoParam *par) override;
+    virtual mfxStatus Close(void) override;
+
+    virtual mfxStatus GetVideoParam(mfxVideoParam *par) override;
+    virtual mfxStatus GetVPPStat(mfxVPPStat *stat) override;
+    virtual mfxStatus RunFrameVPPAsync(mfxFrameSurface1 *in, mfxFrameSurface1 *out, mfxExtVppAuxData *aux, mfxSyncPoint *syncp) override;
+    virtual mfxStatus RunFrameVPPAsyncEx(mfxFrameSurface1 *in, mfxFrameSurface1 *work, mfxFrameSurface1 **out, mfxSyncPoint *syncp) override;
+
+protected:
+    QSVSWSession *m_swSession;
+    mfxVideoParam m_param;
+    bool m_bInit;
+    uint32_t m_nFrameCount;
+};
+
+class QSVSWEncode : public MFXVideoENCODE {
+public:
+    QSVSWEncode(QSVSWSession *session);
+    virtual ~QSVSWEncode();
+
+    virtual mfxStatus Query(mfxVideoParam *in, mfxVideoParam *out) override;
+    virtual mfxStatus QueryIOSurf(mfxVideoParam *par, mfxFrameAllocRequest *request) override;
+    virtual mfxStatus Init(mfxVideoParam *par) override;
+    virtual mfxStatus Reset(mfxVideoParam *par) override;
+    virtual mfxStatus Close(void) override;
+
+    virtual mfxStatus GetVideoParam(mfxVideoParam *par) override;
+    virtual mfxStatus GetEncodeStat(mfxEncodeStat *stat) override;
+    virtual mfxStatus EncodeFrameAsync(mfxEncodeCtrl *ctrl, mfxFrameSurface1 *surface, mfxBitstream *bs, mfxSyncPoint *syncp) override;
+
+protected:
+    struct EncFrame {
+        mfxFrameSurface1 *surf;
+        mfxU64 timestamp;
+        mfxU16 picstruct;
+    };
+    QSVSWSession *m_swSession;
+    mfxVideoParam m_param;
+    bool m_bInit;
+    uint32_t m_nFrameIn;
+    uint32_t m_nFrameOut;
+    int64_t m_nFrameDuration; //90kHz基準の1フレームの長さ
+    std::deque<EncFrame> m_frames; //reorderDelay分保持しているフレーム
+};
+
+#endif //__QSV_SW_SESSION_H__
@@ -44,7 +44,8 @@ QSVTask::QSVTask() :
     encSyncPoint(0),
     vppSyncPoint(),
     pWriter(),
-    pmfxAllocator(nullptr) {
+    pmfxAllocator(nullptr),
+    tmSubmit() {
     RGY_MEMSET_ZERO(mfxBS);
 }
 
@@ -90,7 +91,8 @@ CQSVTaskControl::CQSVTaskControl() :
     m_pTasks(),
     m_nPoolSize(0),
     m_nTaskBufferStart(0),
-    m_pmfxSession(nullptr) {
+    m_pmfxSession(nullptr),
+    m_pStageLatency(nullptr) {
 }
 
 CQSVTaskControl::~CQSVTaskControl() {
@@ -137,9 +139,17 @@ mfxStatus CQSVTaskControl::SynchronizeFirstTask() {
     mfxStatus sts = m_pmfxSession->SyncOperation(m_pTasks[m_nTaskBufferStart].encSyncPoint, MSDK_WAIT_INTERVAL);
 
     if (sts == MFX_ERR_NONE) {
+        std::chrono::steady_clock::time_point tmWrite;
+        if (m_pStageLatency) {
+            m_pStageLatency->add(PERF_STAGE_ENCODE, m_pTasks[m_nTaskBufferStart].tmSubmit);
+            tmWrite = std::chrono::steady_clock::now();
+        }
         if (MFX_ERR_NONE > (sts = m_pTasks[m_nTaskBufferStart].WriteBitstream())) {
             return sts;
         }
+        if (m_pStageLatency) {
+            m_pStageLatency->add(PERF_STAGE_OUTPUT, tmWrite);
+        }
 
         if (MFX_ERR_NONE > (sts = m_pTasks[m_nTaskBufferStart].Clear())) {
             return sts;
@@ -172,6 +182,7 @@ void CQSVTaskControl::Close() {
     m_pTasks.clear();
 
     m_pmfxSession = NULL;
+    m_pStageLatency = nullptr;
     m_nTaskBufferStart = 0;
     m_nPoolSize = 0;
 }
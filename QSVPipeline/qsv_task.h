@@ -51,6 +51,7 @@
 #include "gpuz_info.h"
 #include "qsv_allocator.h"
 #include "rgy_thread.h"
+#include "rgy_perf_monitor.h"
 #include "qsv_control.h"
 
 static inline int GetFreeSurface(mfxFrameSurface1 *pSurfacesPool, int nPoolSize) {
@@ -82,6 +83,7 @@ struct QSVTask {
     vector<mfxSyncPoint> vppSyncPoint;
     shared_ptr<RGYOutput> pWriter;
     QSVAllocator *pmfxAllocator;
+    std::chrono::steady_clock::time_point tmSubmit; //EncodeFrameAsyncに投入した時刻 (処理時間の計測用)
 
     QSVTask();
 
@@ -155,12 +157,21 @@ public:
     virtual mfxStatus SynchronizeFirstTask();
     virtual void Close();
 
+    //nullptrでなければ、エンコードと出力の処理時間を計測する
+    void SetStageLatency(PerfStageLatency *pStageLatency) {
+        m_pStageLatency = pStageLatency;
+    }
+    PerfStageLatency *GetStageLatency() {
+        return m_pStageLatency;
+    }
+
 protected:
     vector<QSVTask> m_pTasks;
     uint32_t m_nPoolSize;
     uint32_t m_nTaskBufferStart;
 
     MFXVideoSession *m_pmfxSession;
+    PerfStageLatency *m_pStageLatency;
 };
 
 #endif //__QSV_TASK_H__
@@ -404,9 +404,20 @@ public:
     uint8_t *ptrRGB() {
         return (std::min)((std::min)(m_surface.Data.R, m_surface.Data.G), m_surface.Data.B);
     }
+    //フレームデータへのポインタとpitchを差し替える (ptrArrayと対になる)
+    void setPtrArray(void *array[3], uint32_t pitch) {
+        m_surface.Data.Y  = (mfxU8 *)array[0];
+        m_surface.Data.UV = (mfxU8 *)array[1];
+        m_surface.Data.V  = (mfxU8 *)array[2];
+        m_surface.Data.Pitch = (mfxU16)pitch;
+    }
     uint32_t pitch() {
         return m_surface.Data.Pitch;
     }
+    //確保されているフレームの高さ (height()はcrop後の高さ)
+    uint32_t allocHeight() {
+        return m_surface.Info.Height;
+    }
     uint32_t width() {
         return m_surface.Info.CropW;
     }
@@ -489,6 +489,39 @@ tstring getAVVersions() {
     return char_to_tstring(mes);
 }
 
+RGY_ERR filterSPSWithBsf(AVBSFContext *bsfc, const uint8_t *sps, size_t size, std::vector<uint8_t>& out, tstring& errMes) {
+    AVPacket pkt = { 0 };
+    av_init_packet(&pkt);
+    if (0 > av_new_packet(&pkt, (int)size)) {
+        errMes = _T("failed to allocate packet for bitstream filter.\n");
+        return RGY_ERR_NULL_PTR;
+    }
+    memcpy(pkt.data, sps, size);
+    int ret = 0;
+    if (0 > (ret = av_bsf_send_packet(bsfc, &pkt))) {
+        av_packet_unref(&pkt);
+        errMes = strsprintf(_T("failed to send packet to %s bitstream filter: %s.\n"),
+            char_to_tstring(bsfc->filter->name).c_str(), qsv_av_err2str(ret).c_str());
+        return RGY_ERR_UNKNOWN;
+    }
+    ret = av_bsf_receive_packet(bsfc, &pkt);
+    if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
+        //出力がまだない場合は、RGYHeaderCacheが元のSPSをそのまま使用し、次のフレームで再度書き換える
+        return RGY_ERR_MORE_DATA;
+    } else if (ret < 0 || pkt.size < 0) {
+        av_packet_unref(&pkt);
+        errMes = strsprintf(_T("failed to run %s bitstream filter: %s.\n"),
+            char_to_tstring(bsfc->filter->name).c_str(), qsv_av_err2str(ret).c_str());
+        return RGY_ERR_UNKNOWN;
+    } else if (pkt.size == 0) {
+        av_packet_unref(&pkt);
+        return RGY_ERR_MORE_DATA;
+    }
+    out.assign(pkt.data, pkt.data + pkt.size);
+    av_packet_unref(&pkt);
+    return RGY_ERR_NONE;
+}
+
 static const auto CSP_PIXFMT_RGY = make_array<std::pair<AVPixelFormat, RGY_CSP>>(
     std::make_pair(AV_PIX_FMT_YUV420P,     RGY_CSP_YV12),
     std::make_pair(AV_PIX_FMT_YUVJ420P,    RGY_CSP_YV12),
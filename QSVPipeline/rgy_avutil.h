@@ -60,6 +60,7 @@ extern "C" {
 #pragma warning (pop)
 
 #include "rgy_util.h"
+#include "rgy_err.h"
 
 #if _DEBUG
 #define RGY_AV_LOG_LEVEL AV_LOG_WARNING
@@ -226,6 +227,11 @@ bool usingAVProtocols(std::string filename, int bOutput);
 //バージョン情報の取得
 tstring getAVVersions();
 
+//SPSをbitstream filterに通して書き換える (RGYHeaderCacheのSPSFilterとして使用する)
+//出力がまだない場合(EAGAIN/EOF/空の出力)はRGY_ERR_MORE_DATAを返し、
+//エラーの場合はエラーメッセージをerrMesに格納して返す
+RGY_ERR filterSPSWithBsf(AVBSFContext *bsfc, const uint8_t *sps, size_t size, std::vector<uint8_t>& out, tstring& errMes);
+
 MAP_PAIR_0_1_PROTO(csp, avpixfmt, AVPixelFormat, rgy, RGY_CSP);
 
 #else
@@ -154,3 +154,174 @@ void HEVCHDRSei::to_nal(std::vector<uint8_t>& data) const {
         }
     }
 }
+
+template<typename GetType, typename IsVCL>
+static void parse_nal_header(std::vector<nal_info>& nal_list, const uint8_t *data, size_t size, GetType get_type, IsVCL is_vcl) {
+    nal_list.clear();
+    if (size <= 3) {
+        return;
+    }
+    const auto i_fin = size - 3;
+    for (size_t i = 0; i < i_fin; i++) {
+        if (data[i+0] == 0 && data[i+1] == 0 && data[i+2] == 1) {
+            nal_info nal;
+            nal.ptr = data + i - (i > 0 && data[i-1] == 0);
+            nal.type = get_type(data[i+3]);
+            nal.size = data + size - nal.ptr;
+            if (nal_list.size()) {
+                auto& prev = nal_list.back();
+                prev.size = nal.ptr - prev.ptr;
+            }
+            nal_list.push_back(nal);
+            if (is_vcl(nal.type)) {
+                break;
+            }
+            i += 3;
+        }
+    }
+}
+
+void parse_nal_header_h264(std::vector<nal_info>& nal_list, const uint8_t *data, size_t size) {
+    parse_nal_header(nal_list, data, size,
+        [](uint8_t header) { return (uint8_t)(header & 0x1f); },
+        [](uint8_t type) { return NALU_H264_NONIDR <= type && type <= NALU_H264_IDR; });
+}
+
+void parse_nal_header_hevc(std::vector<nal_info>& nal_list, const uint8_t *data, size_t size) {
+    parse_nal_header(nal_list, data, size,
+        [](uint8_t header) { return (uint8_t)((header & 0x7f) >> 1); },
+        [](uint8_t type) { return type < NALU_HEVC_VPS; });
+}
+
+RGYHeaderCache::RGYHeaderCache() :
+    m_hevc(false),
+    m_seiNal(),
+    m_seiInserted(false),
+    m_spsFilter(),
+    m_headerOrig(),
+    m_header(),
+    m_spsOut(),
+    m_nalList() {
+}
+
+void RGYHeaderCache::init(bool hevc, const std::vector<uint8_t>& seiNal, SPSFilter spsFilter) {
+    clear();
+    m_hevc = hevc;
+    m_seiNal = seiNal;
+    m_spsFilter = spsFilter;
+    m_nalList.reserve(16);
+}
+
+void RGYHeaderCache::clear() {
+    m_seiNal.clear();
+    m_seiInserted = false;
+    m_spsFilter = nullptr;
+    m_headerOrig.clear();
+    m_header.clear();
+    m_spsOut.clear();
+    m_nalList.clear();
+}
+
+bool RGYHeaderCache::isParamSet(uint8_t type) const {
+    return (m_hevc) ? (type == NALU_HEVC_VPS || type == NALU_HEVC_SPS || type == NALU_HEVC_PPS)
+                    : (type == NALU_H264_SPS || type == NALU_H264_PPS);
+}
+
+size_t RGYHeaderCache::spansSize(const std::vector<RGYBitstreamSpan>& spans) {
+    size_t size = 0;
+    for (const auto& span : spans) {
+        size += span.size;
+    }
+    return size;
+}
+
+RGY_ERR RGYHeaderCache::process(const uint8_t *data, size_t size, std::vector<RGYBitstreamSpan>& spans) {
+    spans.clear();
+    if (!enabled()) {
+        spans.push_back({ data, size });
+        return RGY_ERR_NONE;
+    }
+    if (m_hevc) {
+        parse_nal_header_hevc(m_nalList, data, size);
+    } else {
+        parse_nal_header_h264(m_nalList, data, size);
+    }
+    //パラメータセットの範囲を探す
+    int first = -1, last = -1;
+    uint32_t found = 0;
+    for (int i = 0; i < (int)m_nalList.size(); i++) {
+        if (isParamSet(m_nalList[i].type)) {
+            if (first < 0) {
+                first = i;
+            }
+            last = i;
+            found |= 1 << (m_nalList[i].type & 0x1f);
+        }
+    }
+    const bool seiPending = seiNalPending();
+    if (seiPending) {
+        //SEIを挿入する最初のフレームは、VPS/SPS/PPSをすべて含んでいる必要がある
+        const uint32_t required = (1 << (NALU_HEVC_VPS & 0x1f)) | (1 << (NALU_HEVC_SPS & 0x1f)) | (1 << (NALU_HEVC_PPS & 0x1f));
+        if ((found & required) != required) {
+            return RGY_ERR_UNDEFINED_BEHAVIOR;
+        }
+    }
+    if (first < 0) {
+        //パラメータセットを含まないフレームはそのまま出力する
+        spans.push_back({ data, size });
+        return RGY_ERR_NONE;
+    }
+    const uint8_t *headerStart = m_nalList[first].ptr;
+    const uint8_t *headerEnd   = m_nalList[last].ptr + m_nalList[last].size;
+    const size_t headerSize = headerEnd - headerStart;
+    //パラメータセットが前回と異なる場合のみ、書き換え後のパラメータセットを作り直す
+    if (headerSize != m_headerOrig.size() || memcmp(headerStart, m_headerOrig.data(), headerSize) != 0) {
+        bool cacheable = true;
+        m_header.clear();
+        for (int i = first; i <= last; i++) {
+            const auto& nal = m_nalList[i];
+            if (!isParamSet(nal.type)) {
+                continue;
+            }
+            if (m_spsFilter && nal.type == ((m_hevc) ? NALU_HEVC_SPS : NALU_H264_SPS)) {
+                m_spsOut.clear();
+                auto err = m_spsFilter(nal.ptr, nal.size, m_spsOut);
+                if (err == RGY_ERR_MORE_DATA || (err == RGY_ERR_NONE && m_spsOut.size() == 0)) {
+                    //書き換え後のSPSがまだ得られないので、元のSPSを出力し、キャッシュしない
+                    m_spsOut.assign(nal.ptr, nal.ptr + nal.size);
+                    cacheable = false;
+                } else if (err != RGY_ERR_NONE) {
+                    m_headerOrig.clear();
+                    return err;
+                }
+                m_header.insert(m_header.end(), m_spsOut.begin(), m_spsOut.end());
+            } else {
+                m_header.insert(m_header.end(), nal.ptr, nal.ptr + nal.size);
+            }
+        }
+        if (cacheable) {
+            m_headerOrig.assign(headerStart, headerEnd);
+        } else {
+            m_headerOrig.clear();
+        }
+    }
+    if (headerStart > data) {
+        spans.push_back({ data, (size_t)(headerStart - data) });
+    }
+    spans.push_back({ m_header.data(), m_header.size() });
+    if (seiPending) {
+        //SEIは1回だけ挿入する (spansが参照するので、m_seiNalはクリアしない)
+        spans.push_back({ m_seiNal.data(), m_seiNal.size() });
+        m_seiInserted = true;
+    }
+    //パラメータセットの間にあったそれ以外のNALは、パラメータセットの後ろに出力する
+    for (int i = first + 1; i < last; i++) {
+        if (!isParamSet(m_nalList[i].type)) {
+            spans.push_back({ m_nalList[i].ptr, m_nalList[i].size });
+        }
+    }
+    if (headerEnd < data + size) {
+        spans.push_back({ headerEnd, (size_t)(data + size - headerEnd) });
+    }
+    return RGY_ERR_NONE;
+}
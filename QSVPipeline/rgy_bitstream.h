@@ -32,6 +32,8 @@
 #include <vector>
 #include <cstdint>
 #include <string>
+#include <functional>
+#include "rgy_err.h"
 
 struct nal_info {
     const uint8_t *ptr;
@@ -58,6 +60,8 @@ enum : uint8_t {
     NALU_H264_SUBSPS   = 15,
 
     NALU_HEVC_UNDEF    = 0,
+    NALU_HEVC_IDR_W_RADL = 19,
+    NALU_HEVC_IDR_N_LP   = 20,
     NALU_HEVC_VPS      = 32,
     NALU_HEVC_SPS      = 33,
     NALU_HEVC_PPS      = 34,
@@ -152,4 +156,53 @@ private:
     void add_u32(std::vector<uint8_t>& data, uint32_t u32) const;
 };
 
+//先頭から最初のVCL NAL(スライス)までのNALのみを解析する
+//パラメータセットやSEIはフレームの先頭にあるため、フレーム全体を走査する必要はない
+//最後の要素は最初のVCL NALで、そのsizeはデータの終端までとなる
+//nal_listはクリアしてから使用する (メモリ確保を避けるため、呼び出し側で再利用すること)
+void parse_nal_header_h264(std::vector<nal_info>& nal_list, const uint8_t *data, size_t size);
+void parse_nal_header_hevc(std::vector<nal_info>& nal_list, const uint8_t *data, size_t size);
+
+//出力するデータの区間
+struct RGYBitstreamSpan {
+    const uint8_t *ptr;
+    size_t size;
+};
+
+//キーフレームのヘッダー(VPS/SPS/PPS)の書き換えとSEIの挿入を行う出力用のキャッシュ
+//  - 書き換え後のパラメータセットは、最初のキーフレームで1回だけ作成してバイト列として保持し、
+//    以降のキーフレームでは、元のパラメータセットが同一であればそのまま再利用する
+//  - 結果は出力するデータの区間のリストとして返すので、フレームのデータを詰め直す必要はなく、
+//    書き出しは各区間を順に書き出すだけでよい
+//  - SEIは最初のキーフレームのパラメータセットの直後に1回だけ挿入する
+class RGYHeaderCache {
+public:
+    //SPSを書き換える関数 (書き換え後のSPSをoutに格納する)
+    //まだ書き換え後のSPSが得られない場合はRGY_ERR_MORE_DATAを返し、そのフレームは元のSPSのまま出力して、次のフレームで再度書き換える
+    typedef std::function<RGY_ERR(const uint8_t *sps, size_t size, std::vector<uint8_t>& out)> SPSFilter;
+
+    RGYHeaderCache();
+    void init(bool hevc, const std::vector<uint8_t>& seiNal, SPSFilter spsFilter);
+    void clear();
+    //書き換えを行う必要があるか
+    bool enabled() const { return m_spsFilter || seiNalPending(); }
+    //dataのヘッダーを書き換えた結果を、出力するデータの区間のリストとしてspansに返す
+    //spansの各区間はdataか、このクラスの保持するバッファを指すので、次にprocessを呼ぶまで有効
+    RGY_ERR process(const uint8_t *data, size_t size, std::vector<RGYBitstreamSpan>& spans);
+    //spansの合計サイズ
+    static size_t spansSize(const std::vector<RGYBitstreamSpan>& spans);
+protected:
+    bool isParamSet(uint8_t type) const;
+    bool seiNalPending() const { return m_seiNal.size() > 0 && !m_seiInserted; }
+
+    bool m_hevc;
+    std::vector<uint8_t> m_seiNal; //最初のキーフレームに挿入するSEI
+    bool m_seiInserted;            //SEIを挿入済みか
+    SPSFilter m_spsFilter;
+    std::vector<uint8_t> m_headerOrig; //元のパラメータセット (キャッシュのキー)
+    std::vector<uint8_t> m_header;     //書き換え後のパラメータセット
+    std::vector<uint8_t> m_spsOut;     //SPSFilterの出力用
+    std::vector<nal_info> m_nalList;   //解析結果 (メモリ確保を避けるため再利用する)
+};
+
 #endif //__RGY_BITSTREAM_H__
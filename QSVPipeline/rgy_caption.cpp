@@ -32,6 +32,8 @@
 
 #if ENABLE_AVSW_READER && (defined(_WIN32) || defined(_WIN64))
 
+#include <intrin.h>
+#include <emmintrin.h>
 #include "packet_types.h"
 
 #define TIMESTAMP_INVALID_VALUE     (-1LL)
@@ -300,38 +302,91 @@ static int count_utf8_length(const unsigned char *string, HALFCHAR_INFO *hc) {
     return len;
 }
 
-static int FindStartOffset(rgy_stream& st) {
-    const char *const start_ptr = (char *)st.data();
-    const char * fin_ptr = start_ptr + st.size();
-    for (const char *ptr = start_ptr; ptr < fin_ptr; ptr++) {
-        if (ptr[0] == 'G' && ptr[188] == 'G') {
-            st.add_offset(ptr - start_ptr);
-            return 0;
+static inline int ctz32(uint32_t mask) {
+    unsigned long index = 0;
+    _BitScanForward(&index, mask);
+    return (int)index;
+}
+
+//同期バイト('G')が188byte間隔で続く最初の位置を返す (見つからなければsizeを返す)
+//16byteずつ、ptr[i]とptr[i+188]の両方が同期バイトである位置をSSE2で探す
+static size_t ts_find_sync(const uint8_t *ptr, const size_t size) {
+    if (size <= 188) {
+        return size;
+    }
+    const size_t check_size = size - 188;
+    const __m128i xSync = _mm_set1_epi8('G');
+    size_t i = 0;
+    for (; i + 16 <= check_size; i += 16) {
+        const __m128i x0 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(ptr + i)), xSync);
+        const __m128i x1 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(ptr + i + 188)), xSync);
+        const uint32_t mask = (uint32_t)_mm_movemask_epi8(_mm_and_si128(x0, x1));
+        if (mask) {
+            return i + ctz32(mask);
+        }
+    }
+    for (; i < check_size; i++) {
+        if (ptr[i] == 'G' && ptr[i + 188] == 'G') {
+            return i;
         }
     }
-    return 1;
+    return size;
 }
 
-static int resync(void *pbPacket, rgy_stream& st) {
-    char *ptr = (char *)memchr(pbPacket, 'G', 188);
-    if (!ptr) {
-        for (int i = 0; i < 20; i++) {
-            if (st.size() < 188) {
-                return 1;
-            }
-            memcpy(pbPacket, st.data(), 188);
-            st.add_offset(188);
-            ptr = (char *)memchr(pbPacket, 'G', 188);
-            if (ptr != nullptr) {
-                break;
-            }
+//先頭から順にパケットヘッダを確認し、処理が必要なパケットまでのパケット数を返す
+//処理が必要なパケット: 同期バイトが一致しないもの、またはエラーがなくpidsのいずれかのPIDを持つもの
+//4パケット分のヘッダをまとめてSSE2で比較する
+static size_t ts_skip_packets(const uint8_t *ptr, const size_t packets, const uint16_t pids[4]) {
+    //ヘッダの先頭3byte (同期バイト, TEI+PID上位5bit, PID下位8bit) を比較する
+    static const uint32_t HEADER_MASK = 0x00ff9fff;
+    uint32_t pattern[4];
+    for (int k = 0; k < 4; k++) {
+        pattern[k] = 'G' | ((uint32_t)((pids[k] >> 8) & 0x1f) << 8) | ((uint32_t)(pids[k] & 0xff) << 16);
+    }
+    auto header = [ptr](size_t i) {
+        uint32_t value;
+        memcpy(&value, ptr + i * 188, sizeof(value));
+        return value;
+    };
+    const __m128i xMask     = _mm_set1_epi32(HEADER_MASK);
+    const __m128i xSyncMask = _mm_set1_epi32(0xff);
+    const __m128i xSync     = _mm_set1_epi32('G');
+    const __m128i xPattern0 = _mm_set1_epi32(pattern[0]);
+    const __m128i xPattern1 = _mm_set1_epi32(pattern[1]);
+    const __m128i xPattern2 = _mm_set1_epi32(pattern[2]);
+    const __m128i xPattern3 = _mm_set1_epi32(pattern[3]);
+    size_t i = 0;
+    for (; i + 4 <= packets; i += 4) {
+        const __m128i xHeader = _mm_setr_epi32((int)header(i+0), (int)header(i+1), (int)header(i+2), (int)header(i+3));
+        const __m128i xHeaderMasked = _mm_and_si128(xHeader, xMask);
+        __m128i xMatch = _mm_cmpeq_epi32(xHeaderMasked, xPattern0);
+        xMatch = _mm_or_si128(xMatch, _mm_cmpeq_epi32(xHeaderMasked, xPattern1));
+        xMatch = _mm_or_si128(xMatch, _mm_cmpeq_epi32(xHeaderMasked, xPattern2));
+        xMatch = _mm_or_si128(xMatch, _mm_cmpeq_epi32(xHeaderMasked, xPattern3));
+        //同期バイトが一致しない場合
+        xMatch = _mm_or_si128(xMatch, _mm_andnot_si128(_mm_cmpeq_epi32(_mm_and_si128(xHeader, xSyncMask), xSync), _mm_set1_epi32(-1)));
+        const uint32_t mask = (uint32_t)_mm_movemask_ps(_mm_castsi128_ps(xMatch));
+        if (mask) {
+            return i + ctz32(mask);
+        }
+    }
+    for (; i < packets; i++) {
+        const uint32_t value = header(i);
+        const uint32_t masked = value & HEADER_MASK;
+        if ((value & 0xff) != 'G'
+            || masked == pattern[0] || masked == pattern[1] || masked == pattern[2] || masked == pattern[3]) {
+            return i;
         }
     }
-    if (!ptr) {
+    return packets;
+}
+
+static int FindStartOffset(rgy_stream& st) {
+    const size_t offset = ts_find_sync(st.data(), st.size());
+    if (offset >= st.size()) {
         return 1;
     }
-    auto pos = ptr - (char *)pbPacket;
-    st.add_offset(-(188 - pos));
+    st.add_offset(offset);
     return 0;
 }
 
@@ -683,31 +738,54 @@ void Caption2Ass::printParam(int log_level) {
 RGY_ERR Caption2Ass::proc(const uint8_t *data, const size_t data_size, std::vector<AVPacket>& subList) {
     m_stream.append(data, data_size);
 
-    if (m_streamSync) {
-        if (!FindStartOffset(m_stream)) {
-            return RGY_ERR_UNKNOWN;
+    if (!m_streamSync) {
+        if (FindStartOffset(m_stream)) {
+            //同期位置が見つからなければ、次のデータを待つ
+            if (m_stream.size() > 188) {
+                m_stream.add_offset(m_stream.size() - 188);
+            }
+            return RGY_ERR_NONE;
         }
         m_streamSync = true;
     }
 
     bool bPrintPMT = true;
-    uint8_t pbPacket[188 * 2 + 4] = { 0 };
-    uint32_t packetCount = 0;
+    uint8_t pbPacketLast[188 + 16] = { 0 };
 
     while (m_stream.size() >= 188) {
-        memcpy(pbPacket, m_stream.data(), 188);
-        m_stream.add_offset(188);
-        packetCount++;
+        //処理の必要のないパケットは、ヘッダのみ確認して読み飛ばす
+        //PAT(PID=0)は常に確認する
+        const uint16_t pids[4] = { 0, m_pid.PMTPid, m_pid.PCRPid, m_pid.CaptionPid };
+        const size_t packets = m_stream.size() / 188;
+        const size_t skip = ts_skip_packets(m_stream.data(), packets, pids);
+        m_stream.add_offset(skip * 188);
+        if (skip == packets) {
+            break;
+        }
+        //パケットはコピーせず、バッファ上で直接処理する
+        //ただし、バッファ末尾のパケットは後続のデータがなく、パケット境界を越えて参照する場合があるのでコピーする
+        uint8_t *pbPacket = m_stream.data();
+        if (m_stream.size() < _countof(pbPacketLast)) {
+            memcpy(pbPacketLast, pbPacket, 188);
+            pbPacket = pbPacketLast;
+        }
 
         Packet_Header packet;
         parse_Packet_Header(&packet, &pbPacket[0]);
 
         if (packet.Sync != 'G') {
-            if (!resync(pbPacket, m_stream)) {
-                return RGY_ERR_UNKNOWN;
+            //同期が外れたら、次の同期位置を探す
+            m_streamSync = false;
+            if (FindStartOffset(m_stream)) {
+                if (m_stream.size() > 188) {
+                    m_stream.add_offset(m_stream.size() - 188);
+                }
+                break;
             }
+            m_streamSync = true;
             continue;
         }
+        m_stream.add_offset(188);
 
         if (packet.TsErr)
             continue;
@@ -25,7 +25,6 @@
 //
 // --------------------------------------------------------------------------------------------
 
-#if !(defined(_WIN32) || defined(_WIN64))
 #include "rgy_event.h"
 
 #include <thread>
@@ -34,42 +33,118 @@
 #include <atomic>
 #include <climits>
 #include <chrono>
+#include <vector>
 #include <algorithm>
 
+#if !(defined(_WIN32) || defined(_WIN64))
+#include <cerrno>
+#include <ctime>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t), "futex word must be 32bit.");
+
+//futexでvalが変化するまで待機する (timeout_msがINFINITEなら無制限)
+static void futex_wait(std::atomic<uint32_t> *addr, uint32_t val, uint32_t timeout_ms) {
+    struct timespec ts;
+    struct timespec *pts = nullptr;
+    if (timeout_ms != INFINITE) {
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = (long)(timeout_ms % 1000) * 1000000;
+        pts = &ts;
+    }
+    //EINTR/EAGAIN/ETIMEDOUTは呼び出し側で状態を再確認するので、ここでは無視する
+    syscall(SYS_futex, (uint32_t *)addr, FUTEX_WAIT_PRIVATE, val, pts, nullptr, 0);
+}
+
+static void futex_wake(std::atomic<uint32_t> *addr, int count) {
+    syscall(SYS_futex, (uint32_t *)addr, FUTEX_WAKE_PRIVATE, count, nullptr, nullptr, 0);
+}
+
+//WaitForMultipleObjectsで待機中のスレッド
+//待機対象のいずれかのイベントがセットされるとwordが変化する
+struct EventMultiWaiter {
+    std::atomic<uint32_t> word;
+    EventMultiWaiter() : word(0) {};
+};
+
+//futexによるWin32 Eventの代替実装
+//  - シグナル状態はatomic変数で管理し、シグナル状態のイベントの取得はロックもシステムコールも行わない
+//  - 待機中のスレッドがない場合、SetEventはシステムコールを行わない
+//  - WaitForSingleObjectはseqをfutexとして待機する
+//  - WaitForMultipleObjectsは待機するスレッドごとのfutexを各イベントに登録して待機する
 class Event {
 public:
     bool bManualReset;
-    bool bReady;
-    std::mutex mtx;
-    std::condition_variable cv;
+    std::atomic<uint32_t> signaled;      //シグナル状態なら1
+    std::atomic<uint32_t> seq;           //SetEventのたびに変化する (WaitForSingleObjectのfutex)
+    std::atomic<uint32_t> nWaiters;      //待機中のスレッド数
+    std::atomic<uint32_t> nMultiWaiters; //WaitForMultipleObjectsで待機中のスレッド数
+    std::mutex mtxMultiWaiters;
+    std::vector<EventMultiWaiter *> multiWaiters;
 
-    Event() : bManualReset(false), bReady(false), mtx(), cv() {
+    Event(bool manualReset) : bManualReset(manualReset), signaled(0), seq(0), nWaiters(0), nMultiWaiters(0), mtxMultiWaiters(), multiWaiters() {
 
     };
-    Event(bool manualReset) : Event() {
-        bManualReset = manualReset;
-    };
+
+    //シグナル状態なら取得する (自動リセットの場合は非シグナル状態に戻す)
+    bool tryAcquire() {
+        if (bManualReset) {
+            return signaled.load() != 0;
+        }
+        uint32_t expected = 1;
+        return signaled.compare_exchange_strong(expected, 0);
+    }
+    void set() {
+        signaled.store(1);
+        //シグナル状態のstoreとnWaitersのloadの順序は、待機側のnWaitersの加算とシグナル状態の確認の順序と対になる
+        if (nWaiters.load() == 0) {
+            return;
+        }
+        seq.fetch_add(1);
+        futex_wake(&seq, INT_MAX);
+        if (nMultiWaiters.load() > 0) {
+            std::lock_guard<std::mutex> lock(mtxMultiWaiters);
+            for (auto waiter : multiWaiters) {
+                waiter->word.fetch_add(1);
+                futex_wake(&waiter->word, 1);
+            }
+        }
+    }
+    void addMultiWaiter(EventMultiWaiter *waiter) {
+        {
+            std::lock_guard<std::mutex> lock(mtxMultiWaiters);
+            multiWaiters.push_back(waiter);
+        }
+        nMultiWaiters.fetch_add(1);
+        nWaiters.fetch_add(1);
+    }
+    void removeMultiWaiter(EventMultiWaiter *waiter) {
+        nWaiters.fetch_sub(1);
+        nMultiWaiters.fetch_sub(1);
+        std::lock_guard<std::mutex> lock(mtxMultiWaiters);
+        multiWaiters.erase(std::find(multiWaiters.begin(), multiWaiters.end(), waiter));
+    }
 };
 
+//待機開始時刻からの残り時間 (ミリ秒) を返す
+static uint32_t event_remaining_ms(std::chrono::steady_clock::time_point start, uint32_t millisec) {
+    if (millisec == INFINITE) {
+        return INFINITE;
+    }
+    const auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+    return (elapsed >= (int64_t)millisec) ? 0 : (uint32_t)(millisec - elapsed);
+}
+
 void ResetEvent(HANDLE ev) {
     Event *event = (Event *)ev;
-    {
-        std::lock_guard<std::mutex> lock(event->mtx);
-        if (event->bReady) {
-            event->bReady = false;
-        }
-    }
+    event->signaled.store(0);
 }
 
 void SetEvent(HANDLE ev) {
     Event *event = (Event *)ev;
-    {
-        std::lock_guard<std::mutex> lock(event->mtx);
-        if (!event->bReady) {
-            event->bReady = true;
-            (event->bManualReset) ? event->cv.notify_all() : event->cv.notify_one();
-        }
-    }
+    event->set();
 }
 
 HANDLE CreateEvent(void *pDummy, int bManualReset, int bInitialState, void *pDummy2) {
@@ -83,43 +158,163 @@ HANDLE CreateEvent(void *pDummy, int bManualReset, int bInitialState, void *pDum
 void CloseEvent(HANDLE ev) {
     if (ev != NULL) {
         Event *event = (Event *)ev;
-       delete event;
+        delete event;
     }
 }
 
 uint32_t WaitForSingleObject(HANDLE ev, uint32_t millisec) {
     Event *event = (Event *)ev;
-    {
-        std::unique_lock<std::mutex> uniq_lk(event->mtx);
-        if (millisec == INFINITE) {
-            event->cv.wait(uniq_lk, [&event]{ return event->bReady;});
-            if (!event->bManualReset) {
-                event->bReady = false;
-            }
-        } else {
-            event->cv.wait_for(uniq_lk, std::chrono::milliseconds(millisec), [&event]{ return event->bReady;});
-            if (!event->bReady) {
-                return WAIT_TIMEOUT;
-            }
-            if (!event->bManualReset) {
-                event->bReady = false;
+    //シグナル状態なら、そのまま返す
+    if (event->tryAcquire()) {
+        return WAIT_OBJECT_0;
+    }
+    if (millisec == 0) {
+        return WAIT_TIMEOUT;
+    }
+    const auto start = std::chrono::steady_clock::now();
+    uint32_t ret = WAIT_TIMEOUT;
+    event->nWaiters.fetch_add(1);
+    for (;;) {
+        //seqを先に取得しておき、確認後にSetEventされた場合にfutex_waitが待機しないようにする
+        const uint32_t seq = event->seq.load();
+        if (event->tryAcquire()) {
+            ret = WAIT_OBJECT_0;
+            break;
+        }
+        const uint32_t remaining = event_remaining_ms(start, millisec);
+        if (remaining == 0) {
+            break;
+        }
+        futex_wait(&event->seq, seq, remaining);
+    }
+    event->nWaiters.fetch_sub(1);
+    return ret;
+}
+
+//bWaitAll=TRUEの場合、すべてのイベントをまとめて取得する
+//途中で取得できないイベントがあれば、取得済みの自動リセットのイベントをシグナル状態に戻す
+static bool event_try_acquire_all(Event **pevent, uint32_t count) {
+    for (uint32_t i = 0; i < count; i++) {
+        if (!pevent[i]->tryAcquire()) {
+            for (uint32_t j = 0; j < i; j++) {
+                if (!pevent[j]->bManualReset) {
+                    pevent[j]->set();
+                }
             }
+            return false;
+        }
+    }
+    return true;
+}
+
+//bWaitAll=FALSEの場合、最も小さいインデックスのシグナル状態のイベントを取得する
+static int event_try_acquire_any(Event **pevent, uint32_t count) {
+    for (uint32_t i = 0; i < count; i++) {
+        if (pevent[i]->tryAcquire()) {
+            return (int)i;
         }
     }
-    return WAIT_OBJECT_0;
+    return -1;
 }
 
-uint32_t WaitForMultipleObjects(uint32_t count, HANDLE *pev, int dummy, uint32_t millisec) {
+uint32_t WaitForMultipleObjects(uint32_t count, HANDLE *pev, int bWaitAll, uint32_t millisec) {
     Event **pevent = (Event **)pev;
-    int success = 0;
-    bool bTimeout = false;
+    auto tryAcquire = [&]() {
+        return (bWaitAll) ? ((event_try_acquire_all(pevent, count)) ? 0 : -1) : event_try_acquire_any(pevent, count);
+    };
+    int idx = tryAcquire();
+    if (idx >= 0) {
+        return WAIT_OBJECT_0 + idx;
+    }
+    if (millisec == 0) {
+        return WAIT_TIMEOUT;
+    }
+    const auto start = std::chrono::steady_clock::now();
+    EventMultiWaiter waiter;
     for (uint32_t i = 0; i < count; i++) {
-        if (WAIT_TIMEOUT == WaitForSingleObject(pevent[i], (bTimeout) ? 0 : millisec)) {
-            bTimeout = true;
-        } else {
-            success++;
+        pevent[i]->addMultiWaiter(&waiter);
+    }
+    for (;;) {
+        const uint32_t word = waiter.word.load();
+        if ((idx = tryAcquire()) >= 0) {
+            break;
         }
+        const uint32_t remaining = event_remaining_ms(start, millisec);
+        if (remaining == 0) {
+            break;
+        }
+        futex_wait(&waiter.word, word, remaining);
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        pevent[i]->removeMultiWaiter(&waiter);
     }
-    return (bTimeout) ? WAIT_TIMEOUT : (WAIT_OBJECT_0 + success);
+    return (idx >= 0) ? WAIT_OBJECT_0 + idx : WAIT_TIMEOUT;
 }
 #endif //#if !(defined(_WIN32) || defined(_WIN64))
+
+//比較用の、mutexとcondition_variableによるイベント (以前のLinux版の実装と同じ)
+class EventCondVar {
+public:
+    bool bReady;
+    std::mutex mtx;
+    std::condition_variable cv;
+
+    EventCondVar() : bReady(false), mtx(), cv() {
+
+    };
+    void set() {
+        std::lock_guard<std::mutex> lock(mtx);
+        if (!bReady) {
+            bReady = true;
+            cv.notify_one();
+        }
+    }
+    void wait() {
+        std::unique_lock<std::mutex> uniq_lk(mtx);
+        cv.wait(uniq_lk, [this]{ return bReady; });
+        bReady = false;
+    }
+};
+
+double rgy_event_handoff_latency(int nLoop, bool bCondVar) {
+    nLoop = (std::max)(nLoop, 1);
+    //2つのスレッドで自動リセットのイベントを交互にセットし、往復に要した時間の半分を受け渡しの遅延とする
+    std::chrono::steady_clock::time_point start, fin;
+    if (bCondVar) {
+        EventCondVar evPing, evPong;
+        std::thread th([&]() {
+            for (int i = 0; i < nLoop; i++) {
+                evPing.wait();
+                evPong.set();
+            }
+        });
+        start = std::chrono::steady_clock::now();
+        for (int i = 0; i < nLoop; i++) {
+            evPing.set();
+            evPong.wait();
+        }
+        fin = std::chrono::steady_clock::now();
+        th.join();
+    } else {
+        HANDLE heEvent[2] = {
+            CreateEvent(NULL, FALSE, FALSE, NULL),
+            CreateEvent(NULL, FALSE, FALSE, NULL)
+        };
+        std::thread th([&]() {
+            for (int i = 0; i < nLoop; i++) {
+                WaitForSingleObject(heEvent[0], INFINITE);
+                SetEvent(heEvent[1]);
+            }
+        });
+        start = std::chrono::steady_clock::now();
+        for (int i = 0; i < nLoop; i++) {
+            SetEvent(heEvent[0]);
+            WaitForSingleObject(heEvent[1], INFINITE);
+        }
+        fin = std::chrono::steady_clock::now();
+        th.join();
+        CloseEvent(heEvent[0]);
+        CloseEvent(heEvent[1]);
+    }
+    return std::chrono::duration_cast<std::chrono::duration<double, std::micro>>(fin - start).count() / (nLoop * 2);
+}
@@ -55,8 +55,14 @@ void CloseEvent(HANDLE ev);
 
 uint32_t WaitForSingleObject(HANDLE ev, uint32_t millisec);
 
-uint32_t WaitForMultipleObjects(uint32_t count, HANDLE *pev, int dummy, uint32_t millisec);
+//bWaitAll=TRUEならすべてのイベントがシグナル状態になるまで待機してWAIT_OBJECT_0を、
+//FALSEならいずれかのイベントがシグナル状態になるまで待機してWAIT_OBJECT_0 + そのインデックスを返す
+uint32_t WaitForMultipleObjects(uint32_t count, HANDLE *pev, int bWaitAll, uint32_t millisec);
 
 #endif //#if defined(_WIN32) || defined(_WIN64)
 
+//2スレッド間のイベントによる受け渡しの平均遅延 (マイクロ秒) を測定する
+//bCondVar=trueなら、比較用にmutexとcondition_variableによるイベントで測定する
+double rgy_event_handoff_latency(int nLoop, bool bCondVar);
+
 #endif //__RGY_EVENT_H__
@@ -36,7 +36,13 @@ RGYInput::RGYInput() :
     m_pPrintMes(),
     m_strInputInfo(),
     m_strReaderName(_T("unknown")),
-    m_sTrimParam() {
+    m_sTrimParam(),
+    m_nConvPlanes(0),
+    m_nConvPitch(0),
+    m_nConvPlaneOffset(),
+    m_nConvPlaneRows(),
+    m_nConvRowBytes(0),
+    m_nConvBufSize(0) {
     memset(&m_inputVideoInfo, 0, sizeof(m_inputVideoInfo));
 }
 
@@ -73,3 +79,49 @@ void RGYInput::CreateInputInfo(const TCHAR *inputTypeName, const TCHAR *inputCSp
 
     m_strInputInfo = ss.str();
 }
+
+void RGYInput::initConvertedFrameLayout() {
+    //変換済みのフレームは、出力の色空間・crop後のサイズで、全プレーン共通のpitchで格納する
+    //変換関数はSIMDの幅単位で書き込むので、pitchとバッファの末尾には余裕を持たせる
+    const int outWidth  = m_inputVideoInfo.srcWidth  - m_inputVideoInfo.crop.e.left - m_inputVideoInfo.crop.e.right;
+    const int outHeight = m_inputVideoInfo.srcHeight - m_inputVideoInfo.crop.e.up   - m_inputVideoInfo.crop.e.bottom;
+    const auto csp_to = m_sConvert->csp_to;
+    if (csp_to == RGY_CSP_RGB24 || csp_to == RGY_CSP_RGB32) {
+        m_nConvPlanes = 1;
+        m_nConvRowBytes = outWidth * ((csp_to == RGY_CSP_RGB24) ? 3 : 4);
+    } else {
+        const auto chromafmt = RGY_CSP_CHROMA_FORMAT[csp_to];
+        m_nConvPlanes = (chromafmt == RGY_CHROMAFMT_YUV444) ? 3 : 2;
+        m_nConvRowBytes = outWidth * ((RGY_CSP_BIT_DEPTH[csp_to] > 8) ? 2 : 1);
+    }
+    m_nConvPitch = ALIGN(m_nConvRowBytes, 64);
+    m_nConvPlaneRows[0] = outHeight;
+    m_nConvPlaneRows[1] = (m_nConvPlanes == 1) ? 0 : ((RGY_CSP_CHROMA_FORMAT[csp_to] == RGY_CHROMAFMT_YUV420) ? outHeight >> 1 : outHeight);
+    m_nConvPlaneRows[2] = (m_nConvPlanes == 3) ? outHeight : 0;
+    size_t offset = 0;
+    for (int i = 0; i < 3; i++) {
+        m_nConvPlaneOffset[i] = offset;
+        offset += (size_t)m_nConvPitch * m_inputVideoInfo.srcHeight;
+    }
+    m_nConvBufSize = offset + 64;
+}
+
+void RGYInput::convertFrameToBuffer(uint8_t *buf, const void *src_array[3], int src_y_pitch, int src_uv_pitch) {
+    void *dst_array[3] = { buf + m_nConvPlaneOffset[0], buf + m_nConvPlaneOffset[1], buf + m_nConvPlaneOffset[2] };
+    m_sConvert->func[(m_inputVideoInfo.picstruct & RGY_PICSTRUCT_INTERLACED) ? 1 : 0](
+        dst_array, src_array,
+        m_inputVideoInfo.srcWidth, src_y_pitch, src_uv_pitch,
+        m_nConvPitch, m_inputVideoInfo.srcHeight, m_inputVideoInfo.srcHeight, m_inputVideoInfo.crop.c);
+}
+
+void RGYInput::copyConvertedFrame(RGYFrame *pSurface, const uint8_t *buf) {
+    void *dst_array[3];
+    pSurface->ptrArray(dst_array, m_sConvert->csp_to == RGY_CSP_RGB24 || m_sConvert->csp_to == RGY_CSP_RGB32);
+    for (int i = 0; i < m_nConvPlanes; i++) {
+        const uint8_t *srcLine = buf + m_nConvPlaneOffset[i];
+        uint8_t *dstLine = (uint8_t *)dst_array[i];
+        for (int y = 0; y < m_nConvPlaneRows[i]; y++, srcLine += m_nConvPitch, dstLine += pSurface->pitch()) {
+            memcpy(dstLine, srcLine, m_nConvRowBytes);
+        }
+    }
+}
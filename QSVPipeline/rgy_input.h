@@ -148,6 +148,13 @@ protected:
         return m_sTrimParam.list[m_sTrimParam.list.size()-1].fin;
     }
 
+    //変換済みのフレームのレイアウトを、m_sConvertとm_inputVideoInfoから決める (フレームを先読みして変換するリーダーで使用する)
+    void initConvertedFrameLayout();
+    //入力フレームをm_sConvertで変換し、変換済みのフレームのレイアウトでbufに格納する
+    void convertFrameToBuffer(uint8_t *buf, const void *src_array[3], int src_y_pitch, int src_uv_pitch);
+    //変換済みのフレームをサーフェスにコピーする
+    void copyConvertedFrame(RGYFrame *pSurface, const uint8_t *buf);
+
     shared_ptr<EncodeStatus> m_pEncSatusInfo;
 
     VideoInfo m_inputVideoInfo;
@@ -160,6 +167,14 @@ protected:
     tstring m_strReaderName;    //読み込みの名前
 
     sTrimParam m_sTrimParam;
+
+    //変換済みフレームのレイアウト
+    int m_nConvPlanes;
+    int m_nConvPitch;
+    size_t m_nConvPlaneOffset[3];
+    int m_nConvPlaneRows[3];
+    int m_nConvRowBytes;
+    size_t m_nConvBufSize;
 };
 
 #endif //__RGY_INPUT_H__
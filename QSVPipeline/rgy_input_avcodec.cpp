@@ -39,6 +39,7 @@
 #include "rgy_input_avcodec.h"
 #include "rgy_bitstream.h"
 #include "rgy_avlog.h"
+#include "rgy_thread_affinity.h"
 
 //#ifdef LIBVA_SUPPORT
 //#include "qsv_hw_va.h"
@@ -73,6 +74,11 @@ static inline void extend_array_size(VideoFrameData *dataset) {
 RGYInputAvcodec::RGYInputAvcodec() {
     memset(&m_Demux.format, 0, sizeof(m_Demux.format));
     memset(&m_Demux.video,  0, sizeof(m_Demux.video));
+    m_Demux.trimSeek = AVDemuxTrimSeek();
+    m_Demux.thread.bDecodeThread = false;
+    m_Demux.thread.nDecodeRet = RGY_ERR_NONE;
+    m_Demux.thread.bAudioEnd = false;
+    m_bZeroCopyFrame = false;
     m_strReaderName = _T("av" DECODER_NAME "/avsw");
 }
 
@@ -82,12 +88,36 @@ RGYInputAvcodec::~RGYInputAvcodec() {
 
 void RGYInputAvcodec::CloseThread() {
     m_Demux.thread.bAbortInput = true;
+    if (m_Demux.thread.thDecode.joinable()) {
+        //デコードスレッドがキューへの追加やパケットの取得で待機したままにならないよう、制限を解除する
+        m_Demux.qVideoFrame.set_capacity(SIZE_MAX);
+        m_Demux.qVideoPkt.set_capacity(SIZE_MAX);
+        m_Demux.qVideoPkt.set_keep_length(0);
+        m_Demux.thread.thDecode.join();
+        AddMessage(RGY_LOG_DEBUG, _T("Closed Decode thread.\n"));
+    }
     if (m_Demux.thread.thInput.joinable()) {
         m_Demux.qVideoPkt.set_capacity(SIZE_MAX);
         m_Demux.qVideoPkt.set_keep_length(0);
         m_Demux.thread.thInput.join();
         AddMessage(RGY_LOG_DEBUG, _T("Closed Input thread.\n"));
     }
+    if (m_Demux.thread.thAudio.joinable()) {
+        //キューが一杯で待機している読み込みスレッドを起こす
+        {
+            std::lock_guard<std::mutex> lock(m_Demux.thread.mtxAudio);
+        }
+        m_Demux.thread.cvAudio.notify_all();
+        m_Demux.thread.thAudio.join();
+        AddMessage(RGY_LOG_DEBUG, _T("Closed audio input thread.\n"));
+    }
+    for (auto& batch : m_Demux.thread.qAudioPkt) {
+        for (auto& pkt : batch.packets) {
+            av_packet_unref(&pkt);
+        }
+    }
+    m_Demux.thread.qAudioPkt.clear();
+    m_Demux.thread.bAudioEnd = false;
     m_Demux.thread.bAbortInput = false;
 }
 
@@ -158,6 +188,12 @@ void RGYInputAvcodec::Close() {
     AddMessage(RGY_LOG_DEBUG, _T("Closing...\n"));
     //リソースの解放
     CloseThread();
+    //サーフェスはパイプライン側ですでに開放されているので、ここではフレームの開放のみ行う
+    for (auto& ref : m_frameRef) {
+        av_frame_free(&ref.pFrame);
+    }
+    m_frameRef.clear();
+    m_Demux.qVideoFrame.close([](AVFrame **frame) { av_frame_free(frame); });
     m_Demux.qVideoPkt.close([](AVPacket *pkt) { av_packet_unref(pkt); });
     for (uint32_t i = 0; i < m_Demux.qStreamPktL1.size(); i++) {
         av_packet_unref(&m_Demux.qStreamPktL1[i]);
@@ -177,6 +213,7 @@ void RGYInputAvcodec::Close() {
     }
     m_Demux.stream.clear();
     m_Demux.chapter.clear();
+    m_Demux.trimSeek = AVDemuxTrimSeek();
 
     m_sTrimParam.list.clear();
     m_sTrimParam.offset = 0;
@@ -677,6 +714,295 @@ RGY_ERR RGYInputAvcodec::getFirstFramePosAndFrameRate(const sTrim *pTrimList, in
 #pragma warning(push)
 #pragma warning(disable:4100)
 #pragma warning(disable:4127) //warning C4127: 条件式が定数です。
+void RGYInputAvcodec::scanTrimSeekKeyframes(int64_t maxPts, std::function<bool(const AVTrimSeekKey& key)> fnKey) {
+    AVTrimSeekKey key = { 0 };
+    bool bCheckLead = false; //キーフレームの直後で、leading pictureを確認している
+    int nSkipped = 0;
+    AVPacket pkt;
+    av_init_packet(&pkt);
+    while (av_read_frame(m_Demux.format.pFormatCtx, &pkt) >= 0) {
+        if (pkt.stream_index != m_Demux.video.nIndex) {
+            av_packet_unref(&pkt);
+            continue;
+        }
+        const int64_t pts = pkt.pts;
+        const int64_t dts = pkt.dts;
+        const bool bKeyPkt = (pkt.flags & AV_PKT_FLAG_KEY) != 0;
+        av_packet_unref(&pkt);
+        if (bCheckLead) {
+            //キーフレームより後にデコードされ、先に表示されるフレーム
+            if (!bKeyPkt && pts != AV_NOPTS_VALUE && key.pts != AV_NOPTS_VALUE && pts < key.pts) {
+                key.nLead++;
+                key.minPts = (std::min)(key.minPts, pts);
+                continue;
+            }
+            bCheckLead = false;
+            if (!fnKey(key)) {
+                return;
+            }
+        }
+        if (pts != AV_NOPTS_VALUE && pts > maxPts) {
+            return;
+        }
+        if (bKeyPkt) {
+            key.pts = pts;
+            key.dts = dts;
+            key.minPts = pts;
+            key.nLead = 0;
+            key.nSkipped = nSkipped;
+            bCheckLead = true;
+        } else {
+            nSkipped++;
+        }
+    }
+    if (bCheckLead) {
+        fnKey(key);
+    }
+}
+
+int RGYInputAvcodec::trimSeekFrameIdx(const AVTrimSeekKey& key, bool bGopStart) {
+    const auto& trimSeek = m_Demux.trimSeek;
+    if (trimSeek.bIndex) {
+        //indexはデコード順なので、キーフレームのindexの位置がその手前にデコードされるフレーム数となる
+        //表示順では、これに入力の最初のキーフレームのleading picture(trimのフレーム番号に含まれない)の分がずれ、
+        //キーフレーム自身はそのleading pictureの後に表示される
+        if (key.dts == AV_NOPTS_VALUE) {
+            return -1;
+        }
+        AVStream *pStream = (AVStream *)m_Demux.video.pStream;
+        const int idx = av_index_search_timestamp(pStream, key.dts, AVSEEK_FLAG_BACKWARD | AVSEEK_FLAG_ANY);
+        if (idx < 0 || pStream->index_entries[idx].timestamp != key.dts) {
+            return -1;
+        }
+        return idx - trimSeek.nLead0 + ((bGopStart) ? 0 : key.nLead);
+    }
+    //indexがない場合は、入力の最初のキーフレームからのptsの差とフレームレートから求める
+    const int64_t pts = (bGopStart) ? key.minPts : key.pts;
+    if (pts == AV_NOPTS_VALUE) {
+        return -1;
+    }
+    return trimSeek.nSkipped0 + (int)av_rescale_q_rnd(pts - trimSeek.firstKeyPts, m_Demux.video.pStream->time_base, av_inv_q(trimSeek.fps),
+        (AVRounding)(AV_ROUND_NEAR_INF | AV_ROUND_PASS_MINMAX));
+}
+
+int64_t RGYInputAvcodec::trimSeekFramePts(int frame) {
+    const auto& trimSeek = m_Demux.trimSeek;
+    return trimSeek.firstKeyPts + av_rescale_q(frame - trimSeek.nSkipped0, av_inv_q(trimSeek.fps), m_Demux.video.pStream->time_base);
+}
+
+RGY_ERR RGYInputAvcodec::initTrimSeek(const sTrim *pTrimList, int nTrimCount, int& firstFrame, int64_t& firstKeyPts) {
+    firstFrame = -1;
+    firstKeyPts = AV_NOPTS_VALUE;
+    auto& trimSeek = m_Demux.trimSeek;
+    trimSeek = AVDemuxTrimSeek();
+    const AVStream *pStream = m_Demux.video.pStream;
+    trimSeek.fps = pStream->avg_frame_rate;
+    if (trimSeek.fps.num <= 0 || trimSeek.fps.den <= 0) {
+        trimSeek.fps = pStream->r_frame_rate;
+    }
+    if (trimSeek.fps.num <= 0 || trimSeek.fps.den <= 0) {
+        AddMessage(RGY_LOG_DEBUG, _T("unknown frame rate, read from the beginning for trim.\n"));
+        return RGY_ERR_NONE;
+    }
+    //trimの範囲の前や範囲の間に、seekする価値のある長さがあるか
+    const int minSkipFrames = (std::max)(1, (int)(AV_TRIM_SEEK_MIN_SEC * av_q2d(trimSeek.fps) + 0.5));
+    bool bSeekable = false;
+    for (int i = 0; i < nTrimCount; i++) {
+        const int prevFin = (i > 0) ? pTrimList[i-1].fin : -1;
+        if (prevFin == TRIM_MAX) {
+            break;
+        }
+        bSeekable |= (pTrimList[i].start - (prevFin + 1) >= minSkipFrames);
+    }
+    if (!bSeekable) {
+        return RGY_ERR_NONE;
+    }
+    AVFormatContext *pFormatCtx = m_Demux.format.pFormatCtx;
+    const int nVideoIndex = m_Demux.video.nIndex;
+
+    //フレーム番号の基準となる、入力の最初のキーフレームの情報を取得する
+    AVTrimSeekKey firstKey = { 0 };
+    bool bFirstKey = false;
+    scanTrimSeekKeyframes(INT64_MAX, [&](const AVTrimSeekKey& key) {
+        firstKey = key;
+        bFirstKey = true;
+        return false;
+    });
+    //先頭に戻す
+    //byte単位でseekできない入力では、最初のキーフレームに戻し、その手前のフレーム数をfirstFrameとする
+    auto seek_to_start = [&]() {
+        firstFrame = -1;
+        firstKeyPts = AV_NOPTS_VALUE;
+        if (!(pFormatCtx->iformat->flags & AVFMT_NO_BYTE_SEEK)
+            && 0 <= av_seek_frame(pFormatCtx, -1, 0, AVSEEK_FLAG_BACKWARD | AVSEEK_FLAG_BYTE)) {
+            return RGY_ERR_NONE;
+        }
+        const int64_t firstKeyTs = (firstKey.dts != AV_NOPTS_VALUE) ? firstKey.dts : firstKey.pts;
+        if (bFirstKey && firstKeyTs != AV_NOPTS_VALUE
+            && 0 <= av_seek_frame(pFormatCtx, nVideoIndex, firstKeyTs, AVSEEK_FLAG_BACKWARD)) {
+            if (firstKey.nSkipped > 0) {
+                firstFrame = firstKey.nSkipped;
+                firstKeyPts = firstKey.pts;
+            }
+            return RGY_ERR_NONE;
+        }
+        AddMessage(RGY_LOG_ERROR, _T("failed to seek back to the beginning.\n"));
+        return RGY_ERR_UNKNOWN;
+    };
+    if (!bFirstKey || firstKey.pts == AV_NOPTS_VALUE) {
+        AddMessage(RGY_LOG_DEBUG, _T("no timestamp in the first keyframe, read from the beginning for trim.\n"));
+        return seek_to_start();
+    }
+    trimSeek.bIndex = pStream->nb_frames > 0 && pStream->nb_index_entries == pStream->nb_frames;
+    trimSeek.firstKeyPts = firstKey.pts;
+    trimSeek.nSkipped0 = firstKey.nSkipped;
+    trimSeek.nLead0 = firstKey.nLead;
+    if (trimSeek.bIndex && trimSeekFrameIdx(firstKey, false) != firstKey.nSkipped) {
+        //indexと実際のパケットが一致しない場合は、timestampから求める
+        AddMessage(RGY_LOG_DEBUG, _T("index of video stream does not match packets, use timestamp for trim.\n"));
+        trimSeek.bIndex = false;
+    }
+    AddMessage(RGY_LOG_DEBUG, _T("trim seek: %s, first keyframe pts %lld, skipped %d, leading %d.\n"),
+        (trimSeek.bIndex) ? _T("index") : _T("timestamp"), (long long)firstKey.pts, firstKey.nSkipped, firstKey.nLead);
+
+    vector<AVTrimSeekPoint> points;
+    int64_t firstSeekTs = AV_NOPTS_VALUE;
+    for (int i = 0; i < nTrimCount; i++) {
+        const int prevFin = (i > 0) ? pTrimList[i-1].fin : -1;
+        if (prevFin == TRIM_MAX) {
+            break;
+        }
+        if (pTrimList[i].start - (prevFin + 1) < minSkipFrames) {
+            continue;
+        }
+        //seek先は、trimの範囲の開始フレーム以前のキーフレーム
+        //timestampからの推定では、seek後のキーフレームが範囲の開始より後になる場合があるので、手前にずらして再試行する
+        AVTrimSeekKey seekKey = { 0 };
+        int64_t seekTs = AV_NOPTS_VALUE;
+        int seekFrame = -1;
+        for (int retry = 0; retry < AV_TRIM_SEEK_RETRY && seekFrame < 0; retry++) {
+            const int target = pTrimList[i].start - (int)AV_FRAME_MAX_REORDER - retry * (minSkipFrames / 2);
+            if (target <= prevFin) {
+                break;
+            }
+            seekTs = trimSeekFramePts(target);
+            if (0 > av_seek_frame(pFormatCtx, nVideoIndex, seekTs, AVSEEK_FLAG_BACKWARD)) {
+                break;
+            }
+            bool bFound = false;
+            scanTrimSeekKeyframes(INT64_MAX, [&](const AVTrimSeekKey& key) {
+                seekKey = key;
+                bFound = true;
+                return false;
+            });
+            const int keyFrame = (bFound) ? trimSeekFrameIdx(seekKey, false) : -1;
+            if (keyFrame < 0) {
+                break;
+            }
+            if (keyFrame <= pTrimList[i].start) {
+                seekFrame = keyFrame;
+            }
+        }
+        if (seekFrame <= prevFin + 1) {
+            AddMessage(RGY_LOG_DEBUG, _T("could not find keyframe to seek for trim #%d, read through.\n"), i);
+            continue;
+        }
+        if (i == 0) {
+            //最初の範囲の前は、読み込み開始時にseekする
+            //seek後の最初のキーフレームのleading pictureはFramePosListで破棄されるので、キーフレームのフレーム番号から数える
+            firstSeekTs = seekTs;
+            firstFrame = seekFrame;
+            firstKeyPts = seekKey.pts;
+            AddMessage(RGY_LOG_DEBUG, _T("seek to frame %d (keyframe pts %lld) for trim #%d start %d.\n"), firstFrame, (long long)seekKey.pts, i, pTrimList[i].start);
+            continue;
+        }
+        //読み込みを止める位置は、前の範囲の最後のフレームより後からGOPが始まる最初のキーフレーム
+        AVTrimSeekKey stopKey = { 0 };
+        int stopFrame = -1;
+        if (0 <= av_seek_frame(pFormatCtx, nVideoIndex, trimSeekFramePts(prevFin + 1 - (int)AV_FRAME_MAX_REORDER), AVSEEK_FLAG_BACKWARD)) {
+            scanTrimSeekKeyframes(seekKey.pts, [&](const AVTrimSeekKey& key) {
+                const int frame = trimSeekFrameIdx(key, true);
+                if (frame > prevFin) {
+                    stopKey = key;
+                    stopFrame = frame;
+                    return false;
+                }
+                return frame >= 0;
+            });
+        }
+        if (stopFrame < 0 || stopKey.pts >= seekKey.pts || seekFrame <= stopFrame) {
+            AddMessage(RGY_LOG_DEBUG, _T("could not find keyframe to stop before trim #%d, read through.\n"), i);
+            continue;
+        }
+        AVTrimSeekPoint point;
+        point.stopPts = stopKey.pts;
+        point.seekTs = seekTs;
+        point.seekKeyPts = seekKey.pts;
+        point.nTrimIndex = i;
+        point.nSkipFrames = seekFrame - stopFrame;
+        points.push_back(point);
+        AddMessage(RGY_LOG_DEBUG, _T("seek from frame %d (keyframe pts %lld) to frame %d (keyframe pts %lld) for trim #%d start %d.\n"),
+            stopFrame, (long long)stopKey.pts, seekFrame, (long long)seekKey.pts, i, pTrimList[i].start);
+    }
+    //読み込み中のseekはgetFirstFramePosAndFrameRateの後で有効にする
+    trimSeek.points = points;
+    trimSeek.nNext = (int)points.size();
+    if (firstFrame >= 0) {
+        if (0 <= av_seek_frame(pFormatCtx, nVideoIndex, firstSeekTs, AVSEEK_FLAG_BACKWARD)) {
+            return RGY_ERR_NONE;
+        }
+        AddMessage(RGY_LOG_DEBUG, _T("failed to seek to frame %d for trim, read from the beginning.\n"), firstFrame);
+    }
+    return seek_to_start();
+}
+
+RGY_ERR RGYInputAvcodec::checkTrimSeek(const AVPacket *pkt) {
+    auto& trimSeek = m_Demux.trimSeek;
+    if (trimSeek.nNext >= (int)trimSeek.points.size()) {
+        return RGY_ERR_NONE;
+    }
+    const auto& point = trimSeek.points[trimSeek.nNext];
+    if (trimSeek.bWaitKey) {
+        //seek後、目標のキーフレームまでのパケットは読み捨てる (これらはnSkipFramesに含まれている)
+        if (!(pkt->flags & AV_PKT_FLAG_KEY)) {
+            return RGY_ERR_MORE_DATA;
+        }
+        if (pkt->pts != point.seekKeyPts) {
+            AddMessage(RGY_LOG_WARN, _T("unexpected keyframe after seek for trim #%d: pts %lld (expected %lld), trim might be shifted.\n"),
+                point.nTrimIndex, (long long)pkt->pts, (long long)point.seekKeyPts);
+        }
+        trimSeek.bWaitKey = false;
+        trimSeek.bSkipLead = true;
+        return RGY_ERR_NONE;
+    }
+    if (trimSeek.bSkipLead) {
+        //seek後のキーフレームのleading pictureは、入力の最初のキーフレームと同様に読み捨てる
+        //(seek前のフレームを参照しており、正しくデコードできないため)
+        if (!(pkt->flags & AV_PKT_FLAG_KEY) && pkt->pts != AV_NOPTS_VALUE && pkt->pts < point.seekKeyPts) {
+            return RGY_ERR_MORE_DATA;
+        }
+        trimSeek.bSkipLead = false;
+        trimSeek.nNext++;
+        return checkTrimSeek(pkt);
+    }
+    if ((pkt->flags & AV_PKT_FLAG_KEY) && pkt->pts != AV_NOPTS_VALUE && pkt->pts >= point.stopPts) {
+        if (pkt->pts != point.stopPts) {
+            AddMessage(RGY_LOG_WARN, _T("unexpected keyframe before seek for trim #%d: pts %lld (expected %lld), trim might be shifted.\n"),
+                point.nTrimIndex, (long long)pkt->pts, (long long)point.stopPts);
+        }
+        //前の範囲の後のキーフレームに到達したので、このパケットは読み捨てて、次の範囲の手前のキーフレームにseekする
+        m_Demux.frames.fixBeforeDiscontinuity();
+        if (0 > av_seek_frame(m_Demux.format.pFormatCtx, m_Demux.video.nIndex, point.seekTs, AVSEEK_FLAG_BACKWARD)) {
+            AddMessage(RGY_LOG_ERROR, _T("failed to seek for trim #%d.\n"), point.nTrimIndex);
+            return RGY_ERR_UNKNOWN;
+        }
+        AddMessage(RGY_LOG_DEBUG, _T("seek for trim #%d: skip %d frames.\n"), point.nTrimIndex, point.nSkipFrames);
+        trimSeek.bWaitKey = true;
+        return RGY_ERR_MORE_DATA;
+    }
+    return RGY_ERR_NONE;
+}
+
 RGY_ERR RGYInputAvcodec::Init(const TCHAR *strFileName, VideoInfo *pInputInfo, const void *prm) {
     const AvcodecReaderPrm *input_prm = (const AvcodecReaderPrm *)prm;
 
@@ -823,6 +1149,7 @@ RGY_ERR RGYInputAvcodec::Init(const TCHAR *strFileName, VideoInfo *pInputInfo, c
     m_Demux.qVideoPkt.init(4096, SIZE_MAX, 4);
     m_Demux.qVideoPkt.set_keep_length(AV_FRAME_MAX_REORDER);
     m_Demux.qStreamPktL2.init(4096);
+    m_Demux.qVideoFrame.init(64, AV_DECODE_AHEAD_FRAMES);
 
     //動画ストリームを探す
     //動画ストリームは動画を処理しなかったとしても同期のため必要
@@ -1141,6 +1468,21 @@ RGY_ERR RGYInputAvcodec::Init(const TCHAR *strFileName, VideoInfo *pInputInfo, c
             //seekのために行ったgetSampleの結果は破棄する
             m_Demux.frames.clear();
         }
+        //trimの範囲の前や範囲の間が十分長い場合は、その部分をseekで読み飛ばす
+        //(正確なフレーム位置でのカットは、seekで読み飛ばすフレーム数で補正したtrimにより、これまで通りデコード側で行う)
+        //音声・字幕もseekにより同じ位置から読み込まれ、補正後のtrimに従って同期がとられる
+        //フレーム番号は、demuxerのindexにすべてのフレームが含まれていればindexから正確に、
+        //そうでなければ(TSなど)ptsとフレームレートから求め、seek後の実際のキーフレームのptsで確認する
+        int trimSeekFirstFrame = -1;
+        int64_t trimSeekFirstKeyPts = AV_NOPTS_VALUE;
+        m_Demux.trimSeek = AVDemuxTrimSeek();
+        if (input_prm->fSeekSec <= 0.0f
+            && input_prm->nTrimCount > 0
+            && !m_Demux.format.bIsPipe) {
+            if (RGY_ERR_NONE != (sts = initTrimSeek(input_prm->pTrimList, input_prm->nTrimCount, trimSeekFirstFrame, trimSeekFirstKeyPts))) {
+                return sts;
+            }
+        }
 
         //parserはseek後に初期化すること
         //parserが使用されていれば、ここでも使用するようにする
@@ -1189,8 +1531,42 @@ RGY_ERR RGYInputAvcodec::Init(const TCHAR *strFileName, VideoInfo *pInputInfo, c
         if (m_cap2ass.enabled()) {
             m_cap2ass.setVidFirstKeyPts(m_Demux.video.nStreamFirstKeyPts);
         }
+        if (trimSeekFirstFrame >= 0) {
+            if (m_Demux.video.nStreamFirstKeyPts != trimSeekFirstKeyPts) {
+                AddMessage(RGY_LOG_WARN, _T("unexpected first keyframe after seek for trim: pts %lld (expected %lld), trim might be shifted.\n"),
+                    (long long)m_Demux.video.nStreamFirstKeyPts, (long long)trimSeekFirstKeyPts);
+            }
+            //seek後の最初のキーフレームのフレーム番号が、trimの補正量となる
+            //(getSampleで数えたキーフレームより前のパケットは、seek先のキーフレームまでの読み捨てなので含めない)
+            m_sTrimParam.offset = trimSeekFirstFrame;
+            AddMessage(RGY_LOG_DEBUG, _T("skipped %d frames by seek for trim.\n"), trimSeekFirstFrame);
+        }
 
         m_sTrimParam.list = make_vector(input_prm->pTrimList, input_prm->nTrimCount);
+        //読み込み中のseekで読み飛ばすフレーム数の分、以降のtrimの範囲を補正する
+        //すでに読み込んだ位置で止める予定だったseekは行わない
+        if (m_Demux.trimSeek.points.size() > 0) {
+            int64_t maxReadPts = INT64_MIN;
+            for (int i = 0; i < m_Demux.frames.frameNum(); i++) {
+                maxReadPts = (std::max)(maxReadPts, m_Demux.frames.list(i).pts);
+            }
+            auto& points = m_Demux.trimSeek.points;
+            points.erase(std::remove_if(points.begin(), points.end(), [maxReadPts](const AVTrimSeekPoint& point) {
+                return point.stopPts <= maxReadPts;
+            }), points.end());
+            for (const auto& point : points) {
+                for (int i = point.nTrimIndex; i < (int)m_sTrimParam.list.size(); i++) {
+                    m_sTrimParam.list[i].start -= point.nSkipFrames;
+                    if (m_sTrimParam.list[i].fin != TRIM_MAX) {
+                        m_sTrimParam.list[i].fin -= point.nSkipFrames;
+                    }
+                }
+            }
+            m_Demux.trimSeek.nNext = 0;
+            m_Demux.trimSeek.bWaitKey = false;
+            m_Demux.trimSeek.bSkipLead = false;
+            AddMessage(RGY_LOG_DEBUG, _T("%d seek(s) for trim while reading.\n"), (int)points.size());
+        }
         //キーフレームに到達するまでQSVではフレームが出てこない
         //そのぶんのずれを記録しておき、Trim値などに補正をかける
         if (m_sTrimParam.offset) {
@@ -1418,6 +1794,13 @@ RGY_ERR RGYInputAvcodec::Init(const TCHAR *strFileName, VideoInfo *pInputInfo, c
             //入力をスレッド化しない場合には、自動的に同期が保たれるので、ここでの制限は必要ない
             m_Demux.qVideoPkt.set_capacity(256);
         }
+        //swデコードの場合は、デコードを別スレッドで先行して行い、
+        //LoadNextFrameではデコード済みのフレームを取り出して変換するだけにする
+        //スレッドは出力側の設定(caption2assなど)が終わってから開始するよう、最初のLoadNextFrameで起動する
+        m_Demux.thread.bDecodeThread = m_Demux.video.pCodecCtxDecode != nullptr;
+        m_Demux.thread.nDecodeRet = RGY_ERR_NONE;
+        m_bZeroCopyFrame = m_Demux.video.pCodecCtxDecode != nullptr && input_prm->bZeroCopyFrame;
+        AddMessage(RGY_LOG_DEBUG, _T("zero copy frame: %s.\n"), m_bZeroCopyFrame ? _T("on") : _T("off"));
     } else {
         //音声との同期とかに使うので、動画の情報を格納する
         m_Demux.video.nAvgFramerate = av_make_q(input_prm->nVideoAvgFramerate.first, input_prm->nVideoAvgFramerate.second);
@@ -1439,6 +1822,11 @@ RGY_ERR RGYInputAvcodec::Init(const TCHAR *strFileName, VideoInfo *pInputInfo, c
             m_Demux.frames.checkPtsStatus();
         }
 
+        //読み込みスレッドは、出力側の初期化(GetInputStreamInfoなど)が終わってから、最初のGetStreamDataPacketsで起動する
+        m_Demux.thread.bAbortInput = false;
+        m_Demux.thread.nInputThread = (input_prm->nInputThread != 0) ? 1 : 0;
+        AddMessage(RGY_LOG_DEBUG, _T("audio input thread: %s.\n"), m_Demux.thread.nInputThread ? _T("on") : _T("off"));
+
         tstring mes;
         for (const auto& stream : m_Demux.stream) {
             if (mes.length()) mes += _T(", ");
@@ -1629,6 +2017,16 @@ int RGYInputAvcodec::getSample(AVPacket *pkt, bool bTreatFirstPacketAsKeyframe)
         //trimからわかるフレーム数の上限値よりfixedNumがある程度の量の処理を進めたら読み込みを打ち切る
         && m_Demux.frames.fixedNum() - TRIM_OVERREAD_FRAMES < getVideoTrimMaxFramIdx()) {
         if (pkt->stream_index == m_Demux.video.nIndex) {
+            if (m_Demux.trimSeek.nNext < (int)m_Demux.trimSeek.points.size()) {
+                const auto sts = checkTrimSeek(pkt);
+                if (sts == RGY_ERR_MORE_DATA) {
+                    av_packet_unref(pkt);
+                    continue;
+                } else if (sts != RGY_ERR_NONE) {
+                    av_packet_unref(pkt);
+                    return 1;
+                }
+            }
             if (pkt->flags & AV_PKT_FLAG_CORRUPT) {
                 const auto timestamp = (pkt->pts == AV_NOPTS_VALUE) ? pkt->dts : pkt->pts;
                 AddMessage(RGY_LOG_WARN, _T("corrupt packet in video: %lld (%s)\n"), (long long int)timestamp, getTimestampString(timestamp, m_Demux.video.pStream->time_base).c_str());
@@ -1828,7 +2226,7 @@ RGY_ERR RGYInputAvcodec::GetNextBitstreamNoDelete(RGYBitstream *pBitstream) {
     return sts;
 }
 
-void RGYInputAvcodec::GetAudioDataPacketsWhenNoVideoRead() {
+bool RGYInputAvcodec::GetAudioDataPacketsWhenNoVideoRead() {
     m_Demux.video.nSampleGetCount++;
 
     AVPacket pkt;
@@ -1836,12 +2234,13 @@ void RGYInputAvcodec::GetAudioDataPacketsWhenNoVideoRead() {
     if (m_Demux.video.pStream) {
         //動画に映像がある場合、getSampleを呼んで1フレーム分の音声データをm_Demux.qStreamPktL1に取得する
         //同時に映像フレームをロードし、ロードしたptsデータを突っ込む
-        if (!getSample(&pkt)) {
-            //動画データ自体は不要なので解放
-            av_packet_unref(&pkt);
-            CheckAndMoveStreamPacketList();
+        if (getSample(&pkt)) {
+            return false;
         }
-        return;
+        //動画データ自体は不要なので解放
+        av_packet_unref(&pkt);
+        CheckAndMoveStreamPacketList();
+        return true;
     } else {
         const double vidEstDurationSec = m_Demux.video.nSampleGetCount * (double)m_Demux.video.nAvgFramerate.den / (double)m_Demux.video.nAvgFramerate.num; //1フレームの時間(秒)
         //動画に映像がない場合、
@@ -1872,13 +2271,14 @@ void RGYInputAvcodec::GetAudioDataPacketsWhenNoVideoRead() {
                         m_Demux.frames.checkPtsStatus();
                     }
                     CheckAndMoveStreamPacketList();
-                    return;
+                    return true;
                 }
             }
         }
         //読み込みが終了
         int64_t pts = m_Demux.video.nSampleGetCount;
         m_Demux.frames.fin(framePos(pts, pts, 1, 0, m_Demux.video.nSampleGetCount, AV_PKT_FLAG_KEY), m_Demux.video.nSampleGetCount);
+        return false;
     }
 }
 
@@ -1919,9 +2319,43 @@ void RGYInputAvcodec::CheckAndMoveStreamPacketList() {
     }
 }
 
-vector<AVPacket> RGYInputAvcodec::GetStreamDataPackets() {
+vector<AVPacket> RGYInputAvcodec::GetStreamDataPackets(int64_t videoPts, AVRational videoTimebase) {
+    if (!m_Demux.video.bReadVideo && m_Demux.thread.nInputThread) {
+        if (!m_Demux.thread.thAudio.joinable()) {
+            m_Demux.thread.thAudio = std::thread(&RGYInputAvcodec::ThreadFuncReadAudio, this);
+        }
+        //読み込みスレッドから、映像のvideoPtsまでの音声を受け取る
+        //呼び出しの間隔によらず、映像に対して先行・遅延しない単位で返すため、まだ読み込まれていなければ待機する
+        //映像の終了後は、読み込みスレッドの終了まで待ち、残りをすべて返す
+        vector<AVPacket> packets;
+        std::unique_lock<std::mutex> lock(m_Demux.thread.mtxAudio);
+        for (;;) {
+            m_Demux.thread.cvAudio.wait(lock, [this]() { return !m_Demux.thread.qAudioPkt.empty() || m_Demux.thread.bAudioEnd; });
+            if (m_Demux.thread.qAudioPkt.empty()) {
+                break;
+            }
+            auto& batch = m_Demux.thread.qAudioPkt.front();
+            const bool ptsUnknown = batch.pts == AV_NOPTS_VALUE;
+            if (videoPts != AV_NOPTS_VALUE && !ptsUnknown
+                && av_compare_ts(batch.pts, batch.timebase, videoPts, videoTimebase) > 0) {
+                break;
+            }
+            vector_cat(packets, batch.packets);
+            m_Demux.thread.qAudioPkt.pop_front();
+            m_Demux.thread.cvAudio.notify_all();
+            //映像のptsと比較できない場合は、1回分ずつ返す
+            if (videoPts != AV_NOPTS_VALUE && ptsUnknown) {
+                break;
+            }
+        }
+        return packets;
+    }
     if (!m_Demux.video.bReadVideo) {
-        GetAudioDataPacketsWhenNoVideoRead();
+        bool bContinue = GetAudioDataPacketsWhenNoVideoRead();
+        //映像の終了後は、音声の終わりまで読み込む
+        while (bContinue && videoPts == AV_NOPTS_VALUE) {
+            bContinue = GetAudioDataPacketsWhenNoVideoRead();
+        }
     }
 
     //出力するパケットを選択する
@@ -2019,67 +2453,193 @@ RGY_ERR RGYInputAvcodec::GetHeader(RGYBitstream *pBitstream) {
 
 #pragma warning(push)
 #pragma warning(disable:4100)
+RGY_ERR RGYInputAvcodec::decodeNextFrame(AVFrame *pFrame) {
+    for (;;) {
+        AVPacket pkt;
+        av_init_packet(&pkt);
+        if (!m_Demux.thread.thInput.joinable() //入力スレッドがなければ、自分で読み込む
+            && m_Demux.qVideoPkt.get_keep_length() > 0) { //keep_length == 0なら読み込みは終了していて、これ以上読み込む必要はない
+            if (0 == getSample(&pkt)) {
+                m_Demux.qVideoPkt.push(pkt);
+            }
+        }
+
+        bool bGetPacket = false;
+        for (int i = 0; false == (bGetPacket = m_Demux.qVideoPkt.front_copy_no_lock(&pkt, (m_Demux.thread.pQueueInfo) ? &m_Demux.thread.pQueueInfo->usage_vid_in : nullptr)) && m_Demux.qVideoPkt.size() > 0; i++) {
+            m_Demux.qVideoPkt.wait_for_push();
+        }
+        if (!bGetPacket) {
+            //flushするためのパケット
+            pkt.data = nullptr;
+            pkt.size = 0;
+        }
+        int ret = avcodec_send_packet(m_Demux.video.pCodecCtxDecode, &pkt);
+        //AVERROR(EAGAIN) -> パケットを送る前に受け取る必要がある
+        //パケットが受け取られていないのでpopしない
+        if (ret != AVERROR(EAGAIN)) {
+            m_Demux.qVideoPkt.pop();
+            av_packet_unref(&pkt);
+        }
+        if (ret == AVERROR_EOF) { //これ以上パケットを送れない
+            AddMessage(RGY_LOG_DEBUG, _T("failed to send packet to video decoder, already flushed: %s.\n"), qsv_av_err2str(ret).c_str());
+        } else if (ret < 0 && ret != AVERROR(EAGAIN)) {
+            AddMessage(RGY_LOG_ERROR, _T("failed to send packet to video decoder: %s.\n"), qsv_av_err2str(ret).c_str());
+            return RGY_ERR_UNDEFINED_BEHAVIOR;
+        }
+        ret = avcodec_receive_frame(m_Demux.video.pCodecCtxDecode, pFrame);
+        if (ret == AVERROR(EAGAIN)) { //もっとパケットを送る必要がある
+            continue;
+        }
+        if (ret == AVERROR_EOF) {
+            //最後まで読み込んだ
+            return RGY_ERR_MORE_DATA;
+        }
+        if (ret < 0) {
+            AddMessage(RGY_LOG_ERROR, _T("failed to receive frame from video decoder: %s.\n"), qsv_av_err2str(ret).c_str());
+            return RGY_ERR_UNDEFINED_BEHAVIOR;
+        }
+        return RGY_ERR_NONE;
+    }
+}
+
+RGY_ERR RGYInputAvcodec::ThreadFuncDecode() {
+    RGYThreadAffinity::get().apply(RGY_THREAD_ROLE_DEC);
+    RGY_ERR sts = RGY_ERR_NONE;
+    while (!m_Demux.thread.bAbortInput) {
+        AVFrame *pFrame = av_frame_alloc();
+        if (pFrame == nullptr) {
+            AddMessage(RGY_LOG_ERROR, _T("failed to allocate frame for decoder.\n"));
+            sts = RGY_ERR_NULL_PTR;
+            break;
+        }
+        if (RGY_ERR_NONE != (sts = decodeNextFrame(pFrame))) {
+            av_frame_free(&pFrame);
+            break;
+        }
+        //キューがAV_DECODE_AHEAD_FRAMESに達している場合は、LoadNextFrameで取り出されるまで待機する
+        m_Demux.qVideoFrame.push(pFrame);
+    }
+    if (sts == RGY_ERR_NONE) {
+        //中断された
+        sts = RGY_ERR_ABORTED;
+    }
+    //キューへの追加が完了してから終了コードをセットする
+    m_Demux.thread.nDecodeRet = sts;
+    AddMessage(RGY_LOG_DEBUG, _T("Finish decode thread: %s.\n"), get_err_mes(sts));
+    return sts;
+}
+
+bool RGYInputAvcodec::checkZeroCopyFrame(RGYFrame *pSurface, const AVFrame *pFrame) {
+    //色空間の変換が不要で、単純なコピーとなる場合のみ (NV21もRGY_CSP_NV12として扱われるので、pix_fmtで確認する)
+    if (pFrame->format != AV_PIX_FMT_NV12 || m_sConvert->csp_to != RGY_CSP_NV12 || pSurface->csp() != RGY_CSP_NV12) {
+        return false;
+    }
+    //cropがある場合はコピーが必要
+    if (m_inputVideoInfo.crop.e.left || m_inputVideoInfo.crop.e.up || m_inputVideoInfo.crop.e.right || m_inputVideoInfo.crop.e.bottom) {
+        return false;
+    }
+    if (pFrame->width < (int)pSurface->width() || pFrame->height < (int)pSurface->height()) {
+        return false;
+    }
+    //サーフェスはY/UVで共通のpitchを使用する
+    if (pFrame->linesize[0] <= 0 || pFrame->linesize[0] != pFrame->linesize[1]
+        || (pFrame->linesize[0] & 31) || pFrame->linesize[0] > UINT16_MAX) {
+        return false;
+    }
+    if (((size_t)pFrame->data[0] & 31) || ((size_t)pFrame->data[1] & 31)) {
+        return false;
+    }
+    //エンコーダ等はサーフェスの確保された高さまで参照する場合があるので、その分のバッファがあるかを確認する
+    const int planeHeight[2] = { (int)pSurface->allocHeight(), (int)pSurface->allocHeight() >> 1 };
+    for (int i = 0; i < 2; i++) {
+        const AVBufferRef *buf = av_frame_get_plane_buffer((AVFrame *)pFrame, i);
+        if (buf == nullptr
+            || pFrame->data[i] + (size_t)pFrame->linesize[i] * planeHeight[i] > buf->data + buf->size) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void RGYInputAvcodec::releaseFrameRef(RGYFrame *pSurface) {
+    auto ref = std::find_if(m_frameRef.begin(), m_frameRef.end(), [pSurface](const AVDemuxFrameRef& r) { return r.pSurface == pSurface; });
+    if (ref != m_frameRef.end()) {
+        ref->pSurface->setPtrArray(ref->ptrOrg, ref->pitchOrg);
+        av_frame_free(&ref->pFrame);
+        m_frameRef.erase(ref);
+    }
+}
+
 RGY_ERR RGYInputAvcodec::LoadNextFrame(RGYFrame *pSurface) {
     if (m_Demux.video.pCodecCtxDecode) {
+        //サーフェスが以前のフレームを参照していれば、開放してサーフェスを元に戻す
+        //サーフェスが読み込みに渡されるのは、パイプライン側でLockが0になり使用が終了してからなので、ここで開放してよい
+        releaseFrameRef(pSurface);
+
         //動画のデコードを行う
-        int got_frame = 0;
-        while (!got_frame) {
-            AVPacket pkt;
-            av_init_packet(&pkt);
-            if (!m_Demux.thread.thInput.joinable() //入力スレッドがなければ、自分で読み込む
-                && m_Demux.qVideoPkt.get_keep_length() > 0) { //keep_length == 0なら読み込みは終了していて、これ以上読み込む必要はない
-                if (0 == getSample(&pkt)) {
-                    m_Demux.qVideoPkt.push(pkt);
+        AVFrame *pFrame = nullptr;
+        if (m_Demux.thread.bDecodeThread) {
+            if (!m_Demux.thread.thDecode.joinable()) {
+                m_Demux.thread.thDecode = std::thread(&RGYInputAvcodec::ThreadFuncDecode, this);
+                AddMessage(RGY_LOG_DEBUG, _T("Started decode thread, decode ahead %d frames.\n"), AV_DECODE_AHEAD_FRAMES);
+            }
+            //デコードスレッドでデコード済みのフレームを取り出す
+            while (!m_Demux.qVideoFrame.front_copy_and_pop_no_lock(&pFrame)) {
+                //終了コードはキューへの追加の後にセットされるので、
+                //終了コードを確認してからキューが空であれば、もうフレームは来ない
+                const auto decRet = (RGY_ERR)m_Demux.thread.nDecodeRet.load();
+                if (decRet != RGY_ERR_NONE) {
+                    if (m_Demux.qVideoFrame.front_copy_and_pop_no_lock(&pFrame)) {
+                        break;
+                    }
+                    return (decRet == RGY_ERR_ABORTED) ? RGY_ERR_MORE_DATA : decRet;
                 }
+                m_Demux.qVideoFrame.wait_for_push();
             }
-
-            bool bGetPacket = false;
-            for (int i = 0; false == (bGetPacket = m_Demux.qVideoPkt.front_copy_no_lock(&pkt, (m_Demux.thread.pQueueInfo) ? &m_Demux.thread.pQueueInfo->usage_vid_in : nullptr)) && m_Demux.qVideoPkt.size() > 0; i++) {
-                m_Demux.qVideoPkt.wait_for_push();
-            }
-            if (!bGetPacket) {
-                //flushするためのパケット
-                pkt.data = nullptr;
-                pkt.size = 0;
-            }
-            int ret = avcodec_send_packet(m_Demux.video.pCodecCtxDecode, &pkt);
-            //AVERROR(EAGAIN) -> パケットを送る前に受け取る必要がある
-            //パケットが受け取られていないのでpopしない
-            if (ret != AVERROR(EAGAIN)) {
-                m_Demux.qVideoPkt.pop();
-                av_packet_unref(&pkt);
-            }
-            if (ret == AVERROR_EOF) { //これ以上パケットを送れない
-                AddMessage(RGY_LOG_DEBUG, _T("failed to send packet to video decoder, already flushed: %s.\n"), qsv_av_err2str(ret).c_str());
-            } else if (ret < 0 && ret != AVERROR(EAGAIN)) {
-                AddMessage(RGY_LOG_ERROR, _T("failed to send packet to video decoder: %s.\n"), qsv_av_err2str(ret).c_str());
-                return RGY_ERR_UNDEFINED_BEHAVIOR;
-            }
-            ret = avcodec_receive_frame(m_Demux.video.pCodecCtxDecode, m_Demux.video.pFrame);
-            if (ret == AVERROR(EAGAIN)) { //もっとパケットを送る必要がある
-                continue;
-            }
-            if (ret == AVERROR_EOF) {
-                //最後まで読み込んだ
-                return RGY_ERR_MORE_DATA;
+        } else {
+            auto sts = decodeNextFrame(m_Demux.video.pFrame);
+            if (sts != RGY_ERR_NONE) {
+                return sts;
             }
-            if (ret < 0) {
-                AddMessage(RGY_LOG_ERROR, _T("failed to receive frame from video decoder: %s.\n"), qsv_av_err2str(ret).c_str());
-                return RGY_ERR_UNDEFINED_BEHAVIOR;
+            pFrame = m_Demux.video.pFrame;
+        }
+        pSurface->setTimestamp(pFrame->pts);
+        pSurface->setDuration(pFrame->pkt_duration);
+        bool bZeroCopy = m_bZeroCopyFrame && checkZeroCopyFrame(pSurface, pFrame);
+        if (bZeroCopy && pFrame == m_Demux.video.pFrame) {
+            //デコード用のフレームは使いまわすので、参照を別のフレームに移す
+            AVFrame *pFrameRef = av_frame_alloc();
+            if (pFrameRef) {
+                av_frame_move_ref(pFrameRef, pFrame);
+                pFrame = pFrameRef;
+            } else {
+                bZeroCopy = false;
+            }
+        }
+        if (bZeroCopy) {
+            //フレームデータはコピーせず、サーフェスからデコーダのバッファを直接参照させる
+            //フレームはサーフェスが次に読み込みに渡されるまで保持する
+            AVDemuxFrameRef ref;
+            ref.pSurface = pSurface;
+            ref.pFrame = pFrame;
+            pSurface->ptrArray(ref.ptrOrg, false);
+            ref.pitchOrg = pSurface->pitch();
+            void *src_array[3] = { pFrame->data[0], pFrame->data[1], pFrame->data[1] + 1 };
+            pSurface->setPtrArray(src_array, pFrame->linesize[0]);
+            m_frameRef.push_back(ref);
+        } else {
+            //フレームデータをコピー
+            void *dst_array[3];
+            pSurface->ptrArray(dst_array, m_sConvert->csp_to == RGY_CSP_RGB24 || m_sConvert->csp_to == RGY_CSP_RGB32);
+            m_sConvert->func[pFrame->interlaced_frame != 0](
+                dst_array, (const void **)pFrame->data,
+                m_inputVideoInfo.srcWidth, pFrame->linesize[0], pFrame->linesize[1], pSurface->pitch(),
+                m_inputVideoInfo.srcHeight, m_inputVideoInfo.srcHeight, m_inputVideoInfo.crop.c);
+            if (pFrame == m_Demux.video.pFrame) {
+                av_frame_unref(pFrame);
+            } else {
+                av_frame_free(&pFrame);
             }
-            got_frame = TRUE;
-        }
-        pSurface->setTimestamp(m_Demux.video.pFrame->pts);
-        pSurface->setDuration(m_Demux.video.pFrame->pkt_duration);
-        //フレームデータをコピー
-        void *dst_array[3];
-        pSurface->ptrArray(dst_array, m_sConvert->csp_to == RGY_CSP_RGB24 || m_sConvert->csp_to == RGY_CSP_RGB32);
-        m_sConvert->func[m_Demux.video.pFrame->interlaced_frame != 0](
-            dst_array, (const void **)m_Demux.video.pFrame->data,
-            m_inputVideoInfo.srcWidth, m_Demux.video.pFrame->linesize[0], m_Demux.video.pFrame->linesize[1], pSurface->pitch(),
-            m_inputVideoInfo.srcHeight, m_inputVideoInfo.srcHeight, m_inputVideoInfo.crop.c);
-        if (got_frame) {
-            av_frame_unref(m_Demux.video.pFrame);
         }
         m_pEncSatusInfo->m_sData.frameIn++;
     } else {
@@ -2124,6 +2684,7 @@ void RGYInputAvcodec::setOutputVideoInfo(int w, int h, int sar_x, int sar_y, boo
 }
 
 RGY_ERR RGYInputAvcodec::ThreadFuncRead() {
+    RGYThreadAffinity::get().apply(RGY_THREAD_ROLE_INPUT);
     while (!m_Demux.thread.bAbortInput) {
         AVPacket pkt;
         if (getSample(&pkt)) {
@@ -2134,6 +2695,45 @@ RGY_ERR RGYInputAvcodec::ThreadFuncRead() {
     return RGY_ERR_NONE;
 }
 
+RGY_ERR RGYInputAvcodec::ThreadFuncReadAudio() {
+    RGYThreadAffinity::get().apply(RGY_THREAD_ROLE_INPUT);
+    const AVRational vid_pkt_timebase = (m_Demux.video.pStream) ? m_Demux.video.pStream->time_base : av_inv_q(m_Demux.video.nAvgFramerate);
+    int64_t lastPts = AV_NOPTS_VALUE;
+    bool bContinue = true;
+    while (bContinue) {
+        {
+            //先行しすぎないよう、キューに空きができるまで待機する
+            std::unique_lock<std::mutex> lock(m_Demux.thread.mtxAudio);
+            m_Demux.thread.cvAudio.wait(lock, [this]() { return m_Demux.thread.bAbortInput || m_Demux.thread.qAudioPkt.size() < AV_AUDIO_DEMUX_AHEAD_FRAMES; });
+            if (m_Demux.thread.bAbortInput) {
+                break;
+            }
+        }
+        bContinue = GetAudioDataPacketsWhenNoVideoRead();
+
+        //CheckAndMoveStreamPacketListと同じく、映像のこのptsまでの音声がqStreamPktL2に移されている
+        //最後の回は、直前の回と同じ映像のptsで受け渡す (残りは1フレーム分に満たない)
+        AVDemuxAudioBatch batch;
+        if (bContinue && m_Demux.frames.fixedNum() > 0) {
+            lastPts = m_Demux.frames.list(m_Demux.frames.fixedNum()).pts;
+        }
+        batch.pts = lastPts;
+        batch.timebase = vid_pkt_timebase;
+        AVPacket pkt;
+        while (m_Demux.qStreamPktL2.front_copy_and_pop_no_lock(&pkt, nullptr)) {
+            batch.packets.push_back(pkt);
+        }
+        std::lock_guard<std::mutex> lock(m_Demux.thread.mtxAudio);
+        m_Demux.thread.qAudioPkt.push_back(std::move(batch));
+        m_Demux.thread.cvAudio.notify_all();
+    }
+    std::lock_guard<std::mutex> lock(m_Demux.thread.mtxAudio);
+    m_Demux.thread.bAudioEnd = true;
+    m_Demux.thread.cvAudio.notify_all();
+    AddMessage(RGY_LOG_DEBUG, _T("audio input thread finished.\n"));
+    return RGY_ERR_NONE;
+}
+
 #if USE_CUSTOM_INPUT
 int RGYInputAvcodec::readPacket(uint8_t *buf, int buf_size) {
     auto ret = (int)_fread_nolock(buf, 1, buf_size, m_Demux.format.fpInput);
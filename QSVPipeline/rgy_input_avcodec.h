@@ -40,6 +40,8 @@
 #include <deque>
 #include <atomic>
 #include <thread>
+#include <mutex>
+#include <condition_variable>
 #include <cassert>
 
 #if (defined(_WIN32) || defined(_WIN64))
@@ -56,6 +58,10 @@ using std::deque;
 
 static const uint32_t AVCODEC_READER_INPUT_BUF_SIZE = 16 * 1024 * 1024;
 static const uint32_t AV_FRAME_MAX_REORDER = 16;
+static const uint32_t AV_DECODE_AHEAD_FRAMES = 4; //デコードスレッドで先行してデコードしておくフレーム数
+static const uint32_t AV_AUDIO_DEMUX_AHEAD_FRAMES = 64; //音声のみ読み込む場合に、読み込みスレッドで先行して読み込んでおくフレーム数
+static const double AV_TRIM_SEEK_MIN_SEC = 10.0;   //trimの範囲の前や範囲の間がこの秒数以上ある場合は、読み飛ばさずにseekする
+static const int AV_TRIM_SEEK_RETRY = 4;           //seek後のキーフレームがtrimの範囲より後だった場合に、手前にずらして再試行する回数
 static const int FRAMEPOS_POC_INVALID = -1;
 
 enum RGYPtsStatus : uint32_t {
@@ -369,6 +375,21 @@ public:
     bool isEof() const {
         return m_bInputFin;
     }
+    //seekでptsが不連続になる前に、それまでに登録されたフレームのptsとpocを確定させる
+    //(不連続なptsをまとめてソートすると、wrap arroundと誤判定して順序が入れ替わってしまうため)
+    void fixBeforeDiscontinuity() {
+        const int nFrame = (int)m_list.size();
+        sortPts(m_nNextFixNumIndex, nFrame - m_nNextFixNumIndex);
+        m_nNextFixNumIndex += m_nPAFFRewind;
+        m_nPAFFRewind = 0;
+        for (int i = m_nNextFixNumIndex; i < nFrame; i++) {
+            if (i + 1 < nFrame) {
+                adjustDurationAfterSort(i);
+            }
+            setPoc(i);
+        }
+        m_nNextFixNumIndex = nFrame;
+    }
     //現在の情報から、ptsの状態を確認する
     //さらにptsの補正、ptsのソート、pocの確定を行う
     void checkPtsStatus(double durationHintifPtsAllInvalid = 0.0) {
@@ -726,21 +747,70 @@ typedef struct AVDemuxStream {
     C2AFormat                 caption2ass;            //pStream = nullptrの場合 caption2assのformat
 } AVDemuxStream;
 
+//音声のみ読み込む場合に、読み込みスレッドで1回分ずつ取得した音声パケット
+typedef struct AVDemuxAudioBatch {
+    int64_t                      pts;                //この回で、映像のこのptsまでの音声を取得した (不明な場合はAV_NOPTS_VALUE)
+    AVRational                   timebase;           //ptsのtimebase
+    vector<AVPacket>             packets;            //音声パケット
+} AVDemuxAudioBatch;
+
 typedef struct AVDemuxThread {
     int                          nInputThread;       //入力スレッドを使用する
     std::atomic<bool>            bAbortInput;        //読み込みスレッドに停止を通知する
     std::thread                  thInput;            //読み込みスレッド
+    bool                         bDecodeThread;      //動画デコードスレッドを使用する (swデコード時)
+    std::thread                  thDecode;           //動画デコードスレッド
+    std::atomic<int>             nDecodeRet;         //動画デコードスレッドの終了コード (RGY_ERR, 実行中はRGY_ERR_NONE)
+    std::thread                  thAudio;            //音声のみ読み込む場合の読み込みスレッド
+    std::mutex                   mtxAudio;           //qAudioPkt, bAudioEnd用
+    std::condition_variable      cvAudio;            //qAudioPktへの追加・取り出しの通知
+    std::deque<AVDemuxAudioBatch> qAudioPkt;         //読み込みスレッドで取得した、1フレーム分ずつの音声パケット
+    bool                         bAudioEnd;          //読み込みスレッドが終了した
     PerfQueueInfo               *pQueueInfo;         //キューの情報を格納する構造体
 } AVDemuxThread;
 
+//trimの範囲の前や間をseekで読み飛ばす際に調べたキーフレームの情報
+typedef struct AVTrimSeekKey {
+    int64_t pts;      //キーフレームのpts
+    int64_t dts;      //キーフレームのdts
+    int64_t minPts;   //キーフレームとそのleading picture(後にデコードされ、先に表示されるフレーム)のうち最小のpts
+    int     nLead;    //leading pictureの数
+    int     nSkipped; //探索開始からこのキーフレームまでに読んだ、キーフレームでない映像のパケットの数
+} AVTrimSeekKey;
+
+//読み込み中にseekしてtrimの範囲の間を読み飛ばす位置
+typedef struct AVTrimSeekPoint {
+    int64_t stopPts;     //このptsのキーフレームに到達したら、そのパケットを読み捨ててseekする
+    int64_t seekTs;      //av_seek_frameに渡す映像のtimestamp
+    int64_t seekKeyPts;  //seek後の最初のキーフレームのpts
+    int     nTrimIndex;  //seek先のtrimの範囲のindex
+    int     nSkipFrames; //seekで読み飛ばすフレーム数 (seek後のキーフレームのleading pictureを含む)
+} AVTrimSeekPoint;
+
+//trimによるseekの情報
+//フレーム番号(trimの値)は、indexにすべてのフレームが含まれていればindexから正確に、そうでなければptsとフレームレートから求める
+typedef struct AVDemuxTrimSeek {
+    bool                    bIndex;      //indexにすべてのフレームが含まれている
+    AVRational              fps;         //ptsからフレーム番号を求める際のフレームレート
+    int64_t                 firstKeyPts; //入力の最初のキーフレームのpts
+    int                     nSkipped0;   //入力の最初のキーフレームより前のパケットの数 (trimのフレーム番号に含まれる)
+    int                     nLead0;      //入力の最初のキーフレームのleading pictureの数 (trimのフレーム番号に含まれない)
+    vector<AVTrimSeekPoint> points;      //読み込み中にseekする位置
+    int                     nNext;       //次にseekするpointsのindex
+    bool                    bWaitKey;    //seek後、目標のキーフレームを待っている
+    bool                    bSkipLead;   //seek後のキーフレームのleading pictureを読み捨てている
+} AVDemuxTrimSeek;
+
 typedef struct AVDemuxer {
     AVDemuxFormat            format;
     AVDemuxVideo             video;
     FramePosList             frames;
+    AVDemuxTrimSeek          trimSeek;
     vector<AVDemuxStream>    stream;
     vector<const AVChapter*> chapter;
     AVDemuxThread            thread;
     RGYQueueSPSP<AVPacket>   qVideoPkt;
+    RGYQueueSPSP<AVFrame*>   qVideoFrame;            //デコードスレッドでデコード済みのフレーム
     deque<AVPacket>          qStreamPktL1;
     RGYQueueSPSP<AVPacket>   qStreamPktL2;
 } AVDemuxer;
@@ -758,17 +828,27 @@ enum AVCAPTION_STATE {
 
 
 #if ENABLE_CAPTION2ASS
+//Caption2Assの処理は、demuxスレッドの負荷を下げるため、専用のスレッドで行う
+//  - demuxスレッドは読み込んだデータを再利用するブロックにコピーしてキューに積むだけとする
+//  - 処理スレッドはキューにたまったブロックをまとめて処理し、生成した字幕パケットをまとめて返す
 class AVCaption2Ass {
 public:
     AVCaption2Ass() : m_cap2ass(), m_pLog(), m_subList(), m_buffer(),
         m_index(-1), m_trackId(0),
-        m_state(AVCAPTION_UNKNOWN), m_resolutionDetermined(false) {
+        m_state(AVCAPTION_UNKNOWN), m_resolutionDetermined(false),
+        m_thread(), m_mtx(), m_cvIn(), m_cvIdle(), m_qBlock(), m_blockPool(), m_subListOut(),
+        m_bThreadAbort(false), m_bThreadBusy(false), m_threadErr(RGY_ERR_NONE) {
     };
     ~AVCaption2Ass() { close(); };
     bool enabled() const {
         return m_cap2ass.enabled() && m_state >= AVCAPTION_UNKNOWN;
     }
     void close() {
+        stopThread();
+        for (auto& pkt : m_subList) {
+            av_packet_unref(&pkt);
+        }
+        m_subList.clear();
         m_state = AVCAPTION_UNKNOWN;
         m_cap2ass.close();
         m_pLog.reset();
@@ -788,6 +868,15 @@ public:
     }
     void reset() {
         //m_resolutionDeterminedはリセットしない
+        //処理スレッドが処理中のデータを処理し終えてからリセットする
+        waitIdle();
+        {
+            std::lock_guard<std::mutex> lock(m_mtx);
+            for (auto& pkt : m_subListOut) {
+                av_packet_unref(&pkt);
+            }
+            m_subListOut.clear();
+        }
         m_state = AVCAPTION_UNKNOWN;
         m_cap2ass.reset();
         m_buffer.clear();
@@ -818,9 +907,15 @@ public:
         stream.caption2ass = m_cap2ass.format();
         return stream;
     }
+    //demuxスレッドから呼び出す
+    //buf_size == 0 (EOF)の場合は、処理スレッドの処理完了を待って、残りの字幕パケットを回収する
     RGY_ERR proc(uint8_t *buf, size_t buf_size, decltype(AVDemuxer::qStreamPktL1)& qStreamPkt) {
         auto ret = RGY_ERR_NONE;
         if (buf_size == 0) {
+            if (m_state == AVCAPTION_IS_TS && m_resolutionDetermined) {
+                waitIdle();
+                ret = collect(qStreamPkt);
+            }
             return ret;
         }
         if (m_state == AVCAPTION_UNKNOWN) {
@@ -832,27 +927,123 @@ public:
                 vector_cat(m_buffer, buf, buf_size);
             } else {
                 if (m_buffer.size() > 0) {
-                    ret = m_cap2ass.proc(m_buffer.data(), m_buffer.size(), m_subList);
+                    submit(m_buffer.data(), m_buffer.size());
                     m_buffer.clear();
                     m_buffer.shrink_to_fit();
                 }
-                if (ret == RGY_ERR_NONE) {
-                    ret = m_cap2ass.proc(buf, buf_size, m_subList);
-                }
-                if (ret != RGY_ERR_NONE) {
-                    m_state = AVCAPTION_ERROR;
-                } else if (m_index >= 0) { //インデックスが決まるまでは、クラス内にためておく
-                    for (auto it = m_subList.begin(); it != m_subList.end(); it++) {
-                        it->stream_index = m_index;
-                        qStreamPkt.push_back(*it);
-                    }
-                    m_subList.clear();
-                }
+                submit(buf, buf_size);
+                ret = collect(qStreamPkt);
             }
         }
         return ret;
     }
 protected:
+    void startThread() {
+        m_bThreadAbort = false;
+        m_threadErr = RGY_ERR_NONE;
+        m_thread = std::thread(&AVCaption2Ass::threadFunc, this);
+    }
+    void stopThread() {
+        if (m_thread.joinable()) {
+            {
+                std::lock_guard<std::mutex> lock(m_mtx);
+                m_bThreadAbort = true;
+            }
+            m_cvIn.notify_all();
+            m_thread.join();
+        }
+        for (auto& pkt : m_subListOut) {
+            av_packet_unref(&pkt);
+        }
+        m_subListOut.clear();
+        m_qBlock.clear();
+        m_blockPool.clear();
+    }
+    //読み込んだデータをブロックにコピーして処理スレッドに渡す
+    void submit(const uint8_t *buf, size_t buf_size) {
+        if (!m_thread.joinable()) {
+            startThread();
+        }
+        std::vector<uint8_t> block;
+        {
+            std::lock_guard<std::mutex> lock(m_mtx);
+            if (m_blockPool.size() > 0) {
+                block = std::move(m_blockPool.back());
+                m_blockPool.pop_back();
+            }
+        }
+        block.assign(buf, buf + buf_size);
+        {
+            std::lock_guard<std::mutex> lock(m_mtx);
+            m_qBlock.push_back(std::move(block));
+        }
+        m_cvIn.notify_one();
+    }
+    void waitIdle() {
+        if (!m_thread.joinable()) {
+            return;
+        }
+        std::unique_lock<std::mutex> lock(m_mtx);
+        m_cvIdle.wait(lock, [this]() { return m_qBlock.empty() && !m_bThreadBusy; });
+    }
+    //処理スレッドで生成された字幕パケットを回収する
+    RGY_ERR collect(decltype(AVDemuxer::qStreamPktL1)& qStreamPkt) {
+        std::vector<AVPacket> subList;
+        RGY_ERR err = RGY_ERR_NONE;
+        {
+            std::lock_guard<std::mutex> lock(m_mtx);
+            subList.swap(m_subListOut);
+            err = m_threadErr;
+        }
+        vector_cat(m_subList, subList);
+        if (err != RGY_ERR_NONE) {
+            m_state = AVCAPTION_ERROR;
+        } else if (m_index >= 0) { //インデックスが決まるまでは、クラス内にためておく
+            for (auto it = m_subList.begin(); it != m_subList.end(); it++) {
+                it->stream_index = m_index;
+                qStreamPkt.push_back(*it);
+            }
+            m_subList.clear();
+        }
+        return err;
+    }
+    void threadFunc() {
+        std::deque<std::vector<uint8_t>> qBlock;
+        std::vector<AVPacket> subList;
+        std::unique_lock<std::mutex> lock(m_mtx);
+        for (;;) {
+            m_cvIn.wait(lock, [this]() { return m_bThreadAbort || !m_qBlock.empty(); });
+            if (m_bThreadAbort) {
+                break;
+            }
+            //たまっているブロックをまとめて処理する
+            qBlock.swap(m_qBlock);
+            m_bThreadBusy = true;
+            lock.unlock();
+            auto err = RGY_ERR_NONE;
+            for (auto& block : qBlock) {
+                if (err == RGY_ERR_NONE) {
+                    err = m_cap2ass.proc(block.data(), block.size(), subList);
+                }
+            }
+            lock.lock();
+            for (auto& block : qBlock) {
+                m_blockPool.push_back(std::move(block));
+            }
+            qBlock.clear();
+            //生成した字幕パケットはまとめて返す
+            vector_cat(m_subListOut, subList);
+            subList.clear();
+            if (err != RGY_ERR_NONE && m_threadErr == RGY_ERR_NONE) {
+                m_threadErr = err;
+            }
+            m_bThreadBusy = false;
+            if (m_qBlock.empty()) {
+                m_cvIdle.notify_all();
+            }
+        }
+    }
+
     Caption2Ass m_cap2ass; //Caption2Ass処理
     std::shared_ptr<RGYLog> m_pLog;
     std::vector<AVPacket> m_subList;
@@ -869,6 +1060,18 @@ protected:
     //出力解像度が決まったら処理を開始するので、
     //出力解像度が決まったかどうかを示すフラグ
     bool m_resolutionDetermined;
+
+    //処理スレッド関連 (m_mtxで保護する)
+    std::thread m_thread;
+    std::mutex m_mtx;
+    std::condition_variable m_cvIn;   //ブロックが投入された
+    std::condition_variable m_cvIdle; //処理スレッドがすべてのブロックを処理し終えた
+    std::deque<std::vector<uint8_t>> m_qBlock; //処理待ちのブロック
+    std::vector<std::vector<uint8_t>> m_blockPool; //再利用するブロック
+    std::vector<AVPacket> m_subListOut; //処理スレッドで生成された字幕パケット
+    bool m_bThreadAbort;
+    bool m_bThreadBusy;
+    RGY_ERR m_threadErr;
 };
 #else
 class AVCaption2Ass {
@@ -942,8 +1145,17 @@ typedef struct AvcodecReaderPrm {
     DeviceCodecCsp *pHWDecCodecCsp;          //HWデコーダのサポートするコーデックと色空間
     bool           bVideoDetectPulldown;     //pulldownの検出を試みるかどうか
     C2AFormat      caption2ass;              //caption2assの処理の有効化
+    bool           bZeroCopyFrame;           //swデコードしたフレームを、可能ならコピーせずサーフェスから直接参照させる (システムメモリのサーフェスのみ)
 } AvcodecReaderPrm;
 
+//ゼロコピーでサーフェスに参照させているフレーム
+typedef struct AVDemuxFrameRef {
+    RGYFrame                 *pSurface;              //フレームを参照させているサーフェス
+    AVFrame                  *pFrame;                //サーフェスが参照しているデコード済みのフレーム
+    void                     *ptrOrg[3];             //サーフェスの元のポインタ
+    uint32_t                  pitchOrg;              //サーフェスの元のpitch
+} AVDemuxFrameRef;
+
 class RGYInputAvcodec : public RGYInput
 {
 public:
@@ -975,7 +1187,9 @@ public:
     double GetInputVideoDuration();
 
     //音声・字幕パケットの配列を取得する
-    vector<AVPacket> GetStreamDataPackets();
+    //音声のみ読み込む場合は、映像がvideoPts(videoTimebase)まで進んだところまでの音声を返す
+    //videoPtsがAV_NOPTS_VALUEの場合は映像が終了したものとして、残りの音声をすべて返す
+    vector<AVPacket> GetStreamDataPackets(int64_t videoPts, AVRational videoTimebase);
 
     //音声・字幕のコーデックコンテキストを取得する
     vector<AVDemuxStream> GetInputStreamInfo();
@@ -1038,16 +1252,47 @@ protected:
     void CheckAndMoveStreamPacketList();
 
     //音声パケットの配列を取得する (映像を読み込んでいないときに使用)
-    void GetAudioDataPacketsWhenNoVideoRead();
+    //これ以上読み込むデータがなければfalseを返す
+    bool GetAudioDataPacketsWhenNoVideoRead();
 
     //QSVでデコードした際の最初のフレームのptsを取得する
     //さらに、平均フレームレートを推定する
     //fpsDecoderはdecoderの推定したfps
     RGY_ERR getFirstFramePosAndFrameRate(const sTrim *pTrimList, int nTrimCount, bool bDetectpulldown);
 
+    //trimの範囲の前や範囲の間を読み飛ばすseekの位置を決め、最初の範囲の前のseekを行う
+    //最初の範囲の前をseekした場合は、seek後の最初のキーフレームのフレーム番号をfirstFrameに、そのptsをfirstKeyPtsに返す
+    //読み込み中にseekする位置はm_Demux.trimSeek.pointsに格納する
+    RGY_ERR initTrimSeek(const sTrim *pTrimList, int nTrimCount, int& firstFrame, int64_t& firstKeyPts);
+
+    //seek後の映像のパケットを読み、キーフレームごとにその情報をfnKeyに渡す
+    //fnKeyがfalseを返すか、ptsがmaxPtsを超えるか、入力の終端に達したら終了する
+    void scanTrimSeekKeyframes(int64_t maxPts, std::function<bool(const AVTrimSeekKey& key)> fnKey);
+
+    //キーフレームのフレーム番号(trimの値)を求める (bGopStartならleading pictureを含めた表示順の先頭のフレーム番号)
+    //求められない場合は負の値を返す
+    int trimSeekFrameIdx(const AVTrimSeekKey& key, bool bGopStart);
+
+    //フレーム番号に相当するptsを求める
+    int64_t trimSeekFramePts(int frame);
+
+    //読み込み中のtrimによるseekの確認と実行
+    //pktを読み捨てる場合はRGY_ERR_MORE_DATAを返す
+    RGY_ERR checkTrimSeek(const AVPacket *pkt);
+
     //読み込みスレッド関数
     RGY_ERR ThreadFuncRead();
 
+    //音声のみ読み込む場合の読み込みスレッド関数
+    //映像の1フレーム分ずつ先行して読み込み、qAudioPktに格納する
+    RGY_ERR ThreadFuncReadAudio();
+
+    //動画デコードスレッド関数
+    RGY_ERR ThreadFuncDecode();
+
+    //動画パケットをデコードし、1フレーム分をpFrameに取得する
+    RGY_ERR decodeNextFrame(AVFrame *pFrame);
+
     //指定したptsとtimebaseから、該当する動画フレームを取得する
     int getVideoFrameIdx(int64_t pts, AVRational timebase, int iStart);
 
@@ -1067,7 +1312,15 @@ protected:
     void CloseFormat(AVDemuxFormat *pFormat);
     void CloseThread();
 
+    //サーフェスにコピーせず、フレームを直接参照させられるかを確認する
+    bool checkZeroCopyFrame(RGYFrame *pSurface, const AVFrame *pFrame);
+
+    //サーフェスが参照していたフレームを開放し、サーフェスを元の状態に戻す
+    void releaseFrameRef(RGYFrame *pSurface);
+
     AVDemuxer        m_Demux;                      //デコード用情報
+    bool             m_bZeroCopyFrame;             //swデコードしたフレームを、可能ならコピーせずサーフェスから直接参照させる
+    vector<AVDemuxFrameRef> m_frameRef;            //ゼロコピーでサーフェスに参照させているフレーム
     tstring          m_sFramePosListLog;           //FramePosListの内容を入力終了時に出力する (デバッグ用)
     vector<uint8_t>  m_hevcMp42AnnexbBuffer;       //HEVCのmp4->AnnexB簡易変換用バッファ
     AVCaption2Ass    m_cap2ass;
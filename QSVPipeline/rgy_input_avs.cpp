@@ -25,11 +25,14 @@
 //
 // ------------------------------------------------------------------------------------------
 
+#include <chrono>
 #include "rgy_input_avs.h"
 #if ENABLE_AVISYNTH_READER
 
 #if defined(_WIN32) || defined(_WIN64)
 static const TCHAR *avisynth_dll_name = _T("avisynth.dll");
+#elif ENABLE_AVISYNTHPLUS
+static const TCHAR *avisynth_dll_name = _T("libavisynth.so");
 #else
 static const TCHAR *avisynth_dll_name = _T("libavxsynth.so");
 #endif
@@ -57,7 +60,21 @@ RGYInputAvs::RGYInputAvs() :
     m_sAVSenv(nullptr),
     m_sAVSclip(nullptr),
     m_sAVSinfo(nullptr),
-    m_sAvisynth() {
+    m_sAvisynth(),
+    m_thPrefetch(),
+    m_mtxPrefetch(),
+    m_cvPrefetchDone(),
+    m_cvPrefetchSlot(),
+    m_prefetchFrames(),
+    m_prefetchBuf(),
+    m_bAbortPrefetch(false),
+    m_nPrefetchThreads(1),
+    m_nPrefetchDepth(1),
+    m_nPrefetchNext(0),
+    m_nPrefetchConsumed(0),
+    m_nPrefetchHit(0),
+    m_nPrefetchMiss(0),
+    m_dPrefetchWaitMs(0.0) {
     memset(&m_sAvisynth, 0, sizeof(m_sAvisynth));
     m_strReaderName = _T("avs");
 }
@@ -114,9 +131,104 @@ RGY_ERR RGYInputAvs::load_avisynth() {
 #endif
 #pragma warning(pop)
 #undef LOAD_FUNC
+    //Avisynth+のみ (なくてもよい)
+    m_sAvisynth.f_get_env_property = (func_rgy_avs_get_env_property)RGY_GET_PROC_ADDRESS(m_sAvisynth.h_avisynth, "avs_get_env_property");
     return RGY_ERR_NONE;
 }
 
+int RGYInputAvs::getScriptThreads() {
+    //Prefetch()を使用したスクリプトでは、Avisynth+側で複数スレッドからのavs_get_frameが可能になる
+    //それ以外の場合は、Avisynthは1つのスレッドからのみ呼び出す
+    if (m_sAvisynth.f_get_env_property == nullptr) {
+        return 1;
+    }
+    const int threads = (int)m_sAvisynth.f_get_env_property(m_sAVSenv, RGY_AVS_AEP_FILTERCHAIN_THREADS);
+    return (threads > 1) ? threads : 1;
+}
+
+RGY_ERR RGYInputAvs::startPrefetch() {
+    m_nPrefetchThreads = clamp(getScriptThreads(), 1, AVS_PREFETCH_THREADS_MAX);
+    //先読みのフレーム数は、先読みスレッド数と変換済みフレームのメモリ使用量から決める
+    int depth = (std::max)(AVS_PREFETCH_DEPTH_MIN, m_nPrefetchThreads * AVS_PREFETCH_THREAD_MULTI);
+    depth = (std::min)(depth, AVS_PREFETCH_DEPTH_MAX);
+    depth = (std::min)(depth, (int)(((size_t)AVS_PREFETCH_MEM_CAP_MB << 20) / m_nConvBufSize));
+    m_nPrefetchDepth = (std::max)(depth, 1);
+    m_nPrefetchThreads = (std::min)(m_nPrefetchThreads, m_nPrefetchDepth);
+
+    m_prefetchFrames.resize(m_nPrefetchDepth);
+    for (auto& frame : m_prefetchFrames) {
+        auto buf = (uint8_t *)_aligned_malloc(m_nConvBufSize, 64);
+        if (buf == nullptr) {
+            AddMessage(RGY_LOG_ERROR, _T("Failed to allocate memory for prefetch.\n"));
+            return RGY_ERR_NULL_PTR;
+        }
+        m_prefetchBuf.push_back(std::unique_ptr<uint8_t, aligned_malloc_deleter>(buf, aligned_malloc_deleter()));
+        frame.buf = buf;
+        frame.done = false;
+        frame.error = false;
+    }
+    m_nPrefetchNext = 0;
+    m_nPrefetchConsumed = 0;
+    m_bAbortPrefetch = false;
+    for (int i = 0; i < m_nPrefetchThreads; i++) {
+        m_thPrefetch.push_back(std::thread(&RGYInputAvs::prefetchThreadFunc, this));
+    }
+    AddMessage(RGY_LOG_DEBUG, _T("prefetch: %d thread(s), %d frames, converted frame size %d KB.\n"),
+        m_nPrefetchThreads, m_nPrefetchDepth, (int)(m_nConvBufSize >> 10));
+    return RGY_ERR_NONE;
+}
+
+void RGYInputAvs::stopPrefetch() {
+    {
+        std::lock_guard<std::mutex> lock(m_mtxPrefetch);
+        m_bAbortPrefetch = true;
+    }
+    m_cvPrefetchSlot.notify_all();
+    //avs_get_frameの処理中のスレッドは、その完了を待つ
+    for (auto& th : m_thPrefetch) {
+        if (th.joinable()) {
+            th.join();
+        }
+    }
+    m_thPrefetch.clear();
+    m_prefetchFrames.clear();
+    m_prefetchBuf.clear();
+}
+
+void RGYInputAvs::prefetchThreadFunc() {
+    for (;;) {
+        int n = 0;
+        {
+            //先読みバッファに空きがあれば、次のフレームを取得する
+            std::unique_lock<std::mutex> lock(m_mtxPrefetch);
+            m_cvPrefetchSlot.wait(lock, [this]() {
+                return m_bAbortPrefetch || m_nPrefetchNext - m_nPrefetchConsumed < m_nPrefetchDepth;
+            });
+            if (m_bAbortPrefetch
+                || m_nPrefetchNext >= m_inputVideoInfo.frames
+                //LoadNextFrameと同様、trimの結果必要なフレーム数を超えたら先読みを終了する
+                || getVideoTrimMaxFramIdx() < m_nPrefetchNext - TRIM_OVERREAD_FRAMES) {
+                return;
+            }
+            n = m_nPrefetchNext++;
+        }
+        //先読みバッファのこの位置は、読み込み側がフレームnを消費するまで他のフレームには使用されない
+        auto& slot = m_prefetchFrames[n % m_nPrefetchDepth];
+        AVS_VideoFrame *frame = m_sAvisynth.f_get_frame(m_sAVSclip, n);
+        if (frame) {
+            const void *src_array[3] = { m_sAvisynth.f_get_read_ptr_p(frame, AVS_PLANAR_Y), m_sAvisynth.f_get_read_ptr_p(frame, AVS_PLANAR_U), m_sAvisynth.f_get_read_ptr_p(frame, AVS_PLANAR_V) };
+            convertFrameToBuffer(slot.buf, src_array, m_sAvisynth.f_get_pitch_p(frame, AVS_PLANAR_Y), m_sAvisynth.f_get_pitch_p(frame, AVS_PLANAR_U));
+            m_sAvisynth.f_release_video_frame(frame);
+        }
+        {
+            std::lock_guard<std::mutex> lock(m_mtxPrefetch);
+            slot.error = (frame == nullptr);
+            slot.done = true;
+        }
+        m_cvPrefetchDone.notify_all();
+    }
+}
+
 #pragma warning(push)
 #pragma warning(disable:4127) //warning C4127: 条件式が定数です。
 RGY_ERR RGYInputAvs::Init(const TCHAR *strFileName, VideoInfo *pInputInfo, const void *prm) {
@@ -128,7 +240,11 @@ RGY_ERR RGYInputAvs::Init(const TCHAR *strFileName, VideoInfo *pInputInfo, const
         return RGY_ERR_INVALID_HANDLE;
     }
 
+#if IS_AVXSYNTH
+    const auto interface_ver = RGY_AVISYNTH_INTERFACE_25;
+#else
     const auto interface_ver = (m_sAvisynth.f_is_420 && m_sAvisynth.f_is_422 && m_sAvisynth.f_is_444) ? AVISYNTH_INTERFACE_VERSION : RGY_AVISYNTH_INTERFACE_25;
+#endif
     if (nullptr == (m_sAVSenv = m_sAvisynth.f_create_script_environment(interface_ver))) {
         AddMessage(RGY_LOG_ERROR, _T("failed to init avisynth enviroment.\n"));
         return RGY_ERR_INVALID_HANDLE;
@@ -261,6 +377,9 @@ RGY_ERR RGYInputAvs::Init(const TCHAR *strFileName, VideoInfo *pInputInfo, const
     }
     m_sAvisynth.f_release_value(val_version);
 
+    initConvertedFrameLayout();
+    AddMessage(RGY_LOG_DEBUG, _T("script threads: %d.\n"), getScriptThreads());
+
     CreateInputInfo(avisynth_version.c_str(), RGY_CSP_NAMES[m_sConvert->csp_from], RGY_CSP_NAMES[m_sConvert->csp_to], get_simd_str(m_sConvert->simd), &m_inputVideoInfo);
     AddMessage(RGY_LOG_DEBUG, m_strInputInfo);
     *pInputInfo = m_inputVideoInfo;
@@ -270,6 +389,12 @@ RGY_ERR RGYInputAvs::Init(const TCHAR *strFileName, VideoInfo *pInputInfo, const
 
 void RGYInputAvs::Close() {
     AddMessage(RGY_LOG_DEBUG, _T("Closing...\n"));
+    //avs_get_frameを呼んでいる先読みスレッドを終了してから、clipを解放する
+    stopPrefetch();
+    if (m_nPrefetchHit + m_nPrefetchMiss > 0) {
+        AddMessage(RGY_LOG_DEBUG, _T("prefetch: %d thread(s), %d frames, hit %llu, miss %llu, waited %.1f ms.\n"),
+            m_nPrefetchThreads, m_nPrefetchDepth, (unsigned long long)m_nPrefetchHit, (unsigned long long)m_nPrefetchMiss, m_dPrefetchWaitMs);
+    }
     if (m_sAVSclip)
         m_sAvisynth.f_release_clip(m_sAVSclip);
     if (m_sAVSenv)
@@ -280,6 +405,14 @@ void RGYInputAvs::Close() {
     m_sAVSenv = nullptr;
     m_sAVSclip = nullptr;
     m_sAVSinfo = nullptr;
+    m_bAbortPrefetch = false;
+    m_nPrefetchThreads = 1;
+    m_nPrefetchDepth = 1;
+    m_nPrefetchNext = 0;
+    m_nPrefetchConsumed = 0;
+    m_nPrefetchHit = 0;
+    m_nPrefetchMiss = 0;
+    m_dPrefetchWaitMs = 0.0;
     m_pEncSatusInfo.reset();
     AddMessage(RGY_LOG_DEBUG, _T("Closed.\n"));
 }
@@ -292,21 +425,40 @@ RGY_ERR RGYInputAvs::LoadNextFrame(RGYFrame *pSurface) {
         return RGY_ERR_MORE_DATA;
     }
 
-    AVS_VideoFrame *frame = m_sAvisynth.f_get_frame(m_sAVSclip, m_pEncSatusInfo->m_sData.frameIn);
-    if (frame == nullptr) {
-        return RGY_ERR_MORE_DATA;
+    if (m_thPrefetch.size() == 0) {
+        auto sts = startPrefetch();
+        if (sts != RGY_ERR_NONE) {
+            return sts;
+        }
     }
 
-    void *dst_array[3];
-    pSurface->ptrArray(dst_array, m_sConvert->csp_to == RGY_CSP_RGB24 || m_sConvert->csp_to == RGY_CSP_RGB32);
-    const void *src_array[3] = { m_sAvisynth.f_get_read_ptr_p(frame, AVS_PLANAR_Y), m_sAvisynth.f_get_read_ptr_p(frame, AVS_PLANAR_U), m_sAvisynth.f_get_read_ptr_p(frame, AVS_PLANAR_V) };
-
-    m_sConvert->func[(m_inputVideoInfo.picstruct & RGY_PICSTRUCT_INTERLACED) ? 1 : 0](
-        dst_array, src_array,
-        m_inputVideoInfo.srcWidth, m_sAvisynth.f_get_pitch_p(frame, AVS_PLANAR_Y), m_sAvisynth.f_get_pitch_p(frame, AVS_PLANAR_U),
-        pSurface->pitch(), m_inputVideoInfo.srcHeight, m_inputVideoInfo.srcHeight, m_inputVideoInfo.crop.c);
+    //先読みスレッドでの取得・変換の完了を、フレーム順に待つ
+    const int n = (int)m_pEncSatusInfo->m_sData.frameIn;
+    auto& slot = m_prefetchFrames[n % m_nPrefetchDepth];
+    {
+        std::unique_lock<std::mutex> lock(m_mtxPrefetch);
+        if (slot.done) {
+            m_nPrefetchHit++;
+        } else {
+            m_nPrefetchMiss++;
+            const auto tmWait = std::chrono::steady_clock::now();
+            m_cvPrefetchDone.wait(lock, [&slot]() { return slot.done; });
+            m_dPrefetchWaitMs += std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - tmWait).count() * 1e-3;
+        }
+    }
+    if (slot.error) {
+        AddMessage(RGY_LOG_ERROR, _T("Failed to get frame #%d.\n"), n);
+        return RGY_ERR_MORE_DATA;
+    }
 
-    m_sAvisynth.f_release_video_frame(frame);
+    copyConvertedFrame(pSurface, slot.buf);
+    {
+        //先読みバッファの位置を解放する
+        std::lock_guard<std::mutex> lock(m_mtxPrefetch);
+        slot.done = false;
+        m_nPrefetchConsumed = n + 1;
+    }
+    m_cvPrefetchSlot.notify_all();
 
     m_pEncSatusInfo->m_sData.frameIn++;
     return m_pEncSatusInfo->UpdateDisplay();
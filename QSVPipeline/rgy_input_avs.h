@@ -31,11 +31,16 @@
 
 #include "rgy_version.h"
 #if ENABLE_AVISYNTH_READER
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+#include <memory>
 #pragma warning(push)
 #pragma warning(disable:4244)
 #pragma warning(disable:4456)
-#if defined(_WIN32) || defined(_WIN64)
-#include "avisynth_c.h" //Avisynth+のヘッダを想定
+#if defined(_WIN32) || defined(_WIN64) || ENABLE_AVISYNTHPLUS
+#include "avisynth_c.h" //Avisynth+のヘッダを想定 (Linuxではconfigureで検出したAvisynth+のヘッダ)
 #define IS_AVXSYNTH 0
 #else
 #include "avxsynth_c.h"
@@ -45,6 +50,18 @@
 #include "rgy_input.h"
 #pragma warning(pop)
 
+//先読みのスレッド数・フレーム数
+const int AVS_PREFETCH_THREADS_MAX = 8;   //スクリプトがMT対応の場合の先読みスレッド数の上限
+const int AVS_PREFETCH_DEPTH_MIN = 3;     //先読みの最小フレーム数
+const int AVS_PREFETCH_THREAD_MULTI = 2;  //先読みのフレーム数は、先読みスレッド数のこの倍とする
+const int AVS_PREFETCH_DEPTH_MAX = 32;    //先読みの最大フレーム数
+const int AVS_PREFETCH_MEM_CAP_MB = 1024; //先読みした変換済みフレームに使用するメモリの上限
+
+//Avisynth+のavs_get_env_property(AEP_FILTERCHAIN_THREADS)で、Prefetch()で指定されたスレッド数を取得する
+//古いAvisynth/Avxsynthのヘッダには定義がないので、ここで定義して動的にロードする
+typedef size_t (AVSC_CC *func_rgy_avs_get_env_property)(AVS_ScriptEnvironment *, int);
+static const int RGY_AVS_AEP_FILTERCHAIN_THREADS = 4;
+
 #define AVS_FUNCTYPE(x) typedef decltype(avs_ ## x)* func_avs_ ## x;
 
 AVS_FUNCTYPE(invoke);
@@ -88,6 +105,7 @@ struct avs_dll_t {
     AVS_FUNCDECL(is_422)
     AVS_FUNCDECL(is_444)
 #endif
+    func_rgy_avs_get_env_property f_get_env_property;
 };
 
 #undef AVS_FUNCDECL
@@ -104,12 +122,38 @@ protected:
     virtual RGY_ERR Init(const TCHAR *strFileName, VideoInfo *pInputInfo, const void *prm) override;
     RGY_ERR load_avisynth();
     void release_avisynth();
+    //スクリプトがMT対応 (Avisynth+でPrefetch()を使用) の場合はそのスレッド数、そうでなければ1を返す
+    int getScriptThreads();
+    //先読みスレッドを開始する (trimの設定後に行う必要があるので、最初のLoadNextFrameで呼ぶ)
+    RGY_ERR startPrefetch();
+    void stopPrefetch();
+    void prefetchThreadFunc();
 
     AVS_ScriptEnvironment *m_sAVSenv;
     AVS_Clip *m_sAVSclip;
     const AVS_VideoInfo *m_sAVSinfo;
 
     avs_dll_t m_sAvisynth;
+
+    struct AvsPrefetchFrame {
+        uint8_t *buf;  //変換済みのフレーム
+        bool done;     //avs_get_frameと変換が完了したか
+        bool error;    //フレームの取得に失敗した
+    };
+    std::vector<std::thread> m_thPrefetch;
+    std::mutex m_mtxPrefetch;
+    std::condition_variable m_cvPrefetchDone; //フレームの変換完了 (読み込み側が待機)
+    std::condition_variable m_cvPrefetchSlot; //先読みバッファの空き (先読みスレッドが待機)
+    std::vector<AvsPrefetchFrame> m_prefetchFrames; //先読みバッファ (フレーム番号 % 先読みのフレーム数 の位置に格納)
+    std::vector<std::unique_ptr<uint8_t, aligned_malloc_deleter>> m_prefetchBuf;
+    bool m_bAbortPrefetch;
+    int m_nPrefetchThreads;
+    int m_nPrefetchDepth;
+    int m_nPrefetchNext;      //先読みスレッドが次に取得するフレーム
+    int m_nPrefetchConsumed;  //読み込み側で消費したフレーム数
+    uint64_t m_nPrefetchHit;  //読み込み時にすでに変換済みだったフレーム数
+    uint64_t m_nPrefetchMiss; //読み込み時に待機が必要だったフレーム数
+    double m_dPrefetchWaitMs; //読み込み側で待機した時間の合計
 };
 
 #endif //ENABLE_AVISYNTH_READER
@@ -28,6 +28,7 @@
 #include <sstream>
 #include <fcntl.h>
 #include "rgy_input_raw.h"
+#include "rgy_pipe.h"
 
 #if ENABLE_RAW_READER
 
@@ -292,6 +293,13 @@ RGY_ERR RGYInputRaw::Init(const TCHAR *strFileName, VideoInfo *pInputInfo, const
         AddMessage(RGY_LOG_ERROR, _T("Failed to allocate input buffer.\n"));
         return RGY_ERR_NULL_PTR;
     }
+    if (use_stdin) {
+        //パイプからの入力では、1フレーム分を目安にバッファを拡大し、書き込み側とのやり取りの回数を減らす
+        const int pipeSize = rgy_set_pipe_size(stdin, (std::max)(RGY_PIPE_BUF_SIZE_DEFAULT, (int)bufferSize));
+        if (pipeSize > 0) {
+            AddMessage(RGY_LOG_DEBUG, _T("stdin is a pipe, buffer size %d KB.\n"), pipeSize / 1024);
+        }
+    }
 
     m_sConvert = get_convert_csp_func(m_InputCsp, m_inputVideoInfo.csp, false);
     m_inputVideoInfo.shift = ((m_inputVideoInfo.csp == RGY_CSP_P010 || m_inputVideoInfo.csp == RGY_CSP_P210) && m_inputVideoInfo.shift) ? m_inputVideoInfo.shift : 0;
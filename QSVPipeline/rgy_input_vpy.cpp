@@ -31,21 +31,32 @@
 #include <sstream>
 #include <map>
 #include <fstream>
+#include <cmath>
 
 RGYInputVpy::RGYInputVpy() :
-    m_pAsyncBuffer(),
-    m_hAsyncEventFrameSetFin(),
-    m_hAsyncEventFrameSetStart(),
+    m_mtxAsync(),
+    m_cvAsync(),
+    m_asyncFrames(),
+    m_convertBufAll(),
+    m_convertBufFree(),
     m_bAbortAsync(false),
     m_nCopyOfInputFrames(0),
     m_sVSapi(nullptr),
     m_sVSscript(nullptr),
     m_sVSnode(nullptr),
     m_nAsyncFrames(0),
+    m_nAsyncCompleted(0),
+    m_nPrefetchDepth(1),
+    m_nPrefetchDepthMax(1),
+    m_nPrefetchDepthPeak(0),
+    m_dLatencyMs(0.0),
+    m_dConsumeMs(0.0),
+    m_tmLastLoad(),
     m_sVS() {
-    memset(m_pAsyncBuffer, 0, sizeof(m_pAsyncBuffer));
-    memset(m_hAsyncEventFrameSetFin,   0, sizeof(m_hAsyncEventFrameSetFin));
-    memset(m_hAsyncEventFrameSetStart, 0, sizeof(m_hAsyncEventFrameSetStart));
+    for (auto& frame : m_asyncFrames) {
+        frame.buf = nullptr;
+        frame.done = false;
+    }
     memset(&m_sVS, 0, sizeof(m_sVS));
     m_strReaderName = _T("vpy");
 }
@@ -101,47 +112,114 @@ int RGYInputVpy::load_vapoursynth() {
     return 0;
 }
 
-int RGYInputVpy::initAsyncEvents() {
-    for (int i = 0; i < _countof(m_hAsyncEventFrameSetFin); i++) {
-        if (   NULL == (m_hAsyncEventFrameSetFin[i]   = CreateEvent(NULL, FALSE, FALSE, NULL))
-            || NULL == (m_hAsyncEventFrameSetStart[i] = CreateEvent(NULL, FALSE, TRUE,  NULL)))
-            return 1;
+uint8_t *RGYInputVpy::getConvertBuffer() {
+    std::lock_guard<std::mutex> lock(m_mtxAsync);
+    if (m_bAbortAsync) {
+        return nullptr;
+    }
+    if (m_convertBufFree.size() > 0) {
+        auto buf = m_convertBufFree.back();
+        m_convertBufFree.pop_back();
+        return buf;
+    }
+    //同時に使用されるのは先読みのフレーム数分までなので、不足した場合のみ確保する
+    auto buf = (uint8_t *)_aligned_malloc(m_nConvBufSize, 64);
+    if (buf) {
+        m_convertBufAll.push_back(std::unique_ptr<uint8_t, aligned_malloc_deleter>(buf, aligned_malloc_deleter()));
+    }
+    return buf;
+}
+
+void RGYInputVpy::returnConvertBuffer(uint8_t *buf) {
+    if (buf) {
+        std::lock_guard<std::mutex> lock(m_mtxAsync);
+        m_convertBufFree.push_back(buf);
     }
-    return 0;
 }
 
 void RGYInputVpy::closeAsyncEvents() {
+    //要求済みのフレームの処理が完了するのを待つ
+    std::unique_lock<std::mutex> lock(m_mtxAsync);
     m_bAbortAsync = true;
-    for (int i_frame = m_nCopyOfInputFrames; i_frame < m_nAsyncFrames; i_frame++) {
-        const VSFrameRef *src_frame = getFrameFromAsyncBuffer(i_frame);
-        m_sVSapi->freeFrame(src_frame);
-    }
-    for (int i = 0; i < _countof(m_hAsyncEventFrameSetFin); i++) {
-        if (m_hAsyncEventFrameSetFin[i])
-            CloseEvent(m_hAsyncEventFrameSetFin[i]);
-        if (m_hAsyncEventFrameSetStart[i])
-            CloseEvent(m_hAsyncEventFrameSetStart[i]);
-    }
-    memset(m_hAsyncEventFrameSetFin,   0, sizeof(m_hAsyncEventFrameSetFin));
-    memset(m_hAsyncEventFrameSetStart, 0, sizeof(m_hAsyncEventFrameSetStart));
+    m_cvAsync.wait(lock, [this]() { return m_nAsyncCompleted >= m_nAsyncFrames; });
+    for (auto& frame : m_asyncFrames) {
+        frame.buf = nullptr;
+        frame.done = false;
+    }
+    m_convertBufFree.clear();
+    m_convertBufAll.clear();
     m_bAbortAsync = false;
 }
 
 #pragma warning(push)
 #pragma warning(disable:4100)
 void __stdcall frameDoneCallback(void *userData, const VSFrameRef *f, int n, VSNodeRef *, const char *errorMsg) {
-    reinterpret_cast<RGYInputVpy*>(userData)->setFrameToAsyncBuffer(n, f);
+    reinterpret_cast<RGYInputVpy*>(userData)->setFrameToAsyncBuffer(n, f, errorMsg);
 }
 #pragma warning(pop)
 
-void RGYInputVpy::setFrameToAsyncBuffer(int n, const VSFrameRef* f) {
-    WaitForSingleObject(m_hAsyncEventFrameSetStart[n & (ASYNC_BUFFER_SIZE-1)], INFINITE);
-    m_pAsyncBuffer[n & (ASYNC_BUFFER_SIZE-1)] = f;
-    SetEvent(m_hAsyncEventFrameSetFin[n & (ASYNC_BUFFER_SIZE-1)]);
+void RGYInputVpy::setFrameToAsyncBuffer(int n, const VSFrameRef* f, const char *errorMsg) {
+    //色空間の変換はVapourSynthのワーカースレッド上で行い、読み込み側のスレッドではコピーのみとする
+    uint8_t *buf = nullptr;
+    if (f == nullptr) {
+        AddMessage(RGY_LOG_ERROR, _T("Failed to get frame #%d: %s\n"), n, char_to_tstring((errorMsg) ? errorMsg : "").c_str());
+    } else {
+        if (nullptr != (buf = getConvertBuffer())) {
+            const void *src_array[3] = { m_sVSapi->getReadPtr(f, 0), m_sVSapi->getReadPtr(f, 1), m_sVSapi->getReadPtr(f, 2) };
+            convertFrameToBuffer(buf, src_array, m_sVSapi->getStride(f, 0), m_sVSapi->getStride(f, 1));
+        }
+        m_sVSapi->freeFrame(f);
+    }
+    {
+        std::lock_guard<std::mutex> lock(m_mtxAsync);
+        auto& frame = m_asyncFrames[n & (ASYNC_BUFFER_SIZE-1)];
+        const double latencyMs = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - frame.requested).count() * 1e-3;
+        m_dLatencyMs = (m_dLatencyMs <= 0.0) ? latencyMs : m_dLatencyMs * 0.875 + latencyMs * 0.125;
+        frame.buf = buf;
+        frame.done = true;
+        m_nAsyncCompleted++;
+    }
+    m_cvAsync.notify_all();
+}
+
+void RGYInputVpy::requestFrames() {
+    //要求から完了までの間のフレームは、同時に読み込み側で消費されないので、
+    //先読みのフレーム数 < ASYNC_BUFFER_SIZE であればm_asyncFramesの要素が重複することはない
+    std::vector<int> requests;
+    {
+        std::lock_guard<std::mutex> lock(m_mtxAsync);
+        const auto now = std::chrono::steady_clock::now();
+        while (!m_bAbortAsync
+            && m_nAsyncFrames < m_inputVideoInfo.frames
+            && m_nAsyncFrames - (int)m_nCopyOfInputFrames < m_nPrefetchDepth) {
+            auto& frame = m_asyncFrames[m_nAsyncFrames & (ASYNC_BUFFER_SIZE-1)];
+            frame.buf = nullptr;
+            frame.done = false;
+            frame.requested = now;
+            requests.push_back(m_nAsyncFrames);
+            m_nAsyncFrames++;
+        }
+        m_nPrefetchDepthPeak = (std::max)(m_nPrefetchDepthPeak, m_nAsyncFrames - (int)m_nCopyOfInputFrames);
+    }
+    //コールバックの中でロックを取るので、getFrameAsyncはロックの外で呼ぶ
+    for (auto n : requests) {
+        m_sVSapi->getFrameAsync(n, m_sVSnode, frameDoneCallback, this);
+    }
+}
 
-    if (m_nAsyncFrames < m_inputVideoInfo.frames && !m_bAbortAsync) {
-        m_sVSapi->getFrameAsync(m_nAsyncFrames, m_sVSnode, frameDoneCallback, this);
-        m_nAsyncFrames++;
+void RGYInputVpy::adjustPrefetchDepth() {
+    std::lock_guard<std::mutex> lock(m_mtxAsync);
+    if (m_nPrefetchDepthMax <= VPY_PREFETCH_MIN || m_dLatencyMs <= 0.0 || m_dConsumeMs <= 0.0) {
+        return;
+    }
+    //フレームの消費間隔の間に1フレームずつ完了するには、スクリプトの処理時間/消費間隔 のフレームを処理中にしておく必要がある
+    const int required = (int)std::ceil(m_dLatencyMs / (std::max)(m_dConsumeMs, 0.1)) + 1;
+    const int target = clamp(required, VPY_PREFETCH_MIN, m_nPrefetchDepthMax);
+    //増やす場合はすぐに、減らす場合は要求済みのフレームが消費されるのに合わせて少しずつ減らす
+    if (target > m_nPrefetchDepth) {
+        m_nPrefetchDepth = target;
+    } else if (target < m_nPrefetchDepth) {
+        m_nPrefetchDepth--;
     }
 }
 
@@ -186,7 +264,6 @@ RGY_ERR RGYInputVpy::Init(const TCHAR *strFileName, VideoInfo *pInputInfo, const
     const VSVideoInfo *vsvideoinfo = nullptr;
     const VSCoreInfo *vscoreinfo = nullptr;
     if (   !m_sVS.init()
-        || initAsyncEvents()
         || nullptr == (m_sVSapi = m_sVS.getVSApi())
         || m_sVS.evaluateScript(&m_sVSscript, script_data.c_str(), nullptr, efSetWorkingDir)
         || nullptr == (m_sVSnode = m_sVS.getOutput(m_sVSscript, 0))
@@ -301,16 +378,20 @@ RGY_ERR RGYInputVpy::Init(const TCHAR *strFileName, VideoInfo *pInputInfo, const
     m_inputVideoInfo.shift = ((m_inputVideoInfo.csp == RGY_CSP_P010 || m_inputVideoInfo.csp == RGY_CSP_P210) && m_inputVideoInfo.shift) ? m_inputVideoInfo.shift : 0;
     m_inputVideoInfo.frames = vsvideoinfo->numFrames;
 
-    m_nAsyncFrames = vsvideoinfo->numFrames;
-    m_nAsyncFrames = (std::min)(m_nAsyncFrames, vscoreinfo->numThreads);
-    m_nAsyncFrames = (std::min)(m_nAsyncFrames, ASYNC_BUFFER_SIZE-1);
+    initConvertedFrameLayout();
+    //先読みのフレーム数の上限は、VapourSynthのスレッド数と変換済みフレームのメモリ使用量から決める
+    //初期値はVapourSynthのスレッド数とし、以降はLoadNextFrameで調整する
+    m_nPrefetchDepthMax = (std::min)(ASYNC_BUFFER_SIZE-1, vscoreinfo->numThreads * VPY_PREFETCH_THREAD_MULTI);
+    m_nPrefetchDepthMax = (std::min)(m_nPrefetchDepthMax, (int)(((size_t)VPY_PREFETCH_MEM_CAP_MB << 20) / m_nConvBufSize));
+    m_nPrefetchDepthMax = (std::max)(m_nPrefetchDepthMax, 1);
+    m_nPrefetchDepth = clamp(vscoreinfo->numThreads, 1, m_nPrefetchDepthMax);
     if (m_inputVideoInfo.type != RGY_INPUT_FMT_VPY_MT) {
-        m_nAsyncFrames = 1;
-    }
-
-    for (int i = 0; i < m_nAsyncFrames; i++) {
-        m_sVSapi->getFrameAsync(i, m_sVSnode, frameDoneCallback, this);
+        m_nPrefetchDepth = 1;
+        m_nPrefetchDepthMax = 1;
     }
+    AddMessage(RGY_LOG_DEBUG, _T("prefetch: %d frames (max %d), converted frame size %d KB.\n"),
+        m_nPrefetchDepth, m_nPrefetchDepthMax, (int)(m_nConvBufSize >> 10));
+    requestFrames();
 
     tstring vs_ver = _T("VapourSynth");
     if (m_inputVideoInfo.type == RGY_INPUT_FMT_VPY_MT) {
@@ -331,6 +412,10 @@ RGY_ERR RGYInputVpy::Init(const TCHAR *strFileName, VideoInfo *pInputInfo, const
 void RGYInputVpy::Close() {
     AddMessage(RGY_LOG_DEBUG, _T("Closing...\n"));
     closeAsyncEvents();
+    if (m_nAsyncFrames > 0) {
+        AddMessage(RGY_LOG_DEBUG, _T("prefetch: %d frames at last (peak %d, max %d), script latency %.1f ms, consume interval %.1f ms.\n"),
+            m_nPrefetchDepth, m_nPrefetchDepthPeak, m_nPrefetchDepthMax, m_dLatencyMs, m_dConsumeMs);
+    }
     if (m_sVSapi && m_sVSnode)
         m_sVSapi->freeNode(m_sVSnode);
     if (m_sVSscript)
@@ -347,6 +432,12 @@ void RGYInputVpy::Close() {
     m_sVSscript = nullptr;
     m_sVSnode = nullptr;
     m_nAsyncFrames = 0;
+    m_nAsyncCompleted = 0;
+    m_nPrefetchDepth = 1;
+    m_nPrefetchDepthMax = 1;
+    m_nPrefetchDepthPeak = 0;
+    m_dLatencyMs = 0.0;
+    m_dConsumeMs = 0.0;
     m_pEncSatusInfo.reset();
     AddMessage(RGY_LOG_DEBUG, _T("Closed.\n"));
 }
@@ -359,25 +450,42 @@ RGY_ERR RGYInputVpy::LoadNextFrame(RGYFrame *pSurface) {
         return RGY_ERR_MORE_DATA;
     }
 
-    const VSFrameRef *src_frame = getFrameFromAsyncBuffer(m_pEncSatusInfo->m_sData.frameIn);
-    if (src_frame == nullptr) {
-        return RGY_ERR_MORE_DATA;
+    //エンコーダ側でフレームを消費するのにかかった時間 (前回この関数を抜けてからの時間)
+    const auto tmEnter = std::chrono::steady_clock::now();
+    if (m_pEncSatusInfo->m_sData.frameIn > 0) {
+        const double consumeMs = std::chrono::duration_cast<std::chrono::microseconds>(tmEnter - m_tmLastLoad).count() * 1e-3;
+        m_dConsumeMs = (m_dConsumeMs <= 0.0) ? consumeMs : m_dConsumeMs * 0.875 + consumeMs * 0.125;
     }
 
-    void *dst_array[3];
-    pSurface->ptrArray(dst_array, m_sConvert->csp_to == RGY_CSP_RGB24 || m_sConvert->csp_to == RGY_CSP_RGB32);
-    const void *src_array[3] = { m_sVSapi->getReadPtr(src_frame, 0), m_sVSapi->getReadPtr(src_frame, 1), m_sVSapi->getReadPtr(src_frame, 2) };
-    m_sConvert->func[(m_inputVideoInfo.picstruct & RGY_PICSTRUCT_INTERLACED) ? 1 : 0](
-        dst_array, src_array,
-        m_inputVideoInfo.srcWidth, m_sVSapi->getStride(src_frame, 0), m_sVSapi->getStride(src_frame, 1),
-        pSurface->pitch(), m_inputVideoInfo.srcHeight, m_inputVideoInfo.srcHeight, m_inputVideoInfo.crop.c);
+    const int n = (int)m_pEncSatusInfo->m_sData.frameIn;
+    uint8_t *buf = nullptr;
+    {
+        std::unique_lock<std::mutex> lock(m_mtxAsync);
+        auto& frame = m_asyncFrames[n & (ASYNC_BUFFER_SIZE-1)];
+        if (n >= m_nAsyncFrames) {
+            return RGY_ERR_MORE_DATA; //中断等でフレームが要求されていない
+        }
+        m_cvAsync.wait(lock, [&frame]() { return frame.done; });
+        buf = frame.buf;
+        frame.buf = nullptr;
+        frame.done = false;
+    }
+    if (buf == nullptr) {
+        return RGY_ERR_MORE_DATA;
+    }
 
-    m_sVSapi->freeFrame(src_frame);
+    copyConvertedFrame(pSurface, buf);
+    returnConvertBuffer(buf);
 
     m_pEncSatusInfo->m_sData.frameIn++;
     m_nCopyOfInputFrames = m_pEncSatusInfo->m_sData.frameIn;
 
-    return m_pEncSatusInfo->UpdateDisplay();
+    adjustPrefetchDepth();
+    requestFrames();
+
+    const auto ret = m_pEncSatusInfo->UpdateDisplay();
+    m_tmLastLoad = std::chrono::steady_clock::now();
+    return ret;
 }
 
 #endif //ENABLE_VAPOURSYNTH_READER
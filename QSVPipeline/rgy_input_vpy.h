@@ -31,6 +31,11 @@
 
 #include "rgy_version.h"
 #if ENABLE_VAPOURSYNTH_READER
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <vector>
+#include <memory>
 #include "rgy_osdep.h"
 #include "rgy_input.h"
 #include "VapourSynth.h"
@@ -39,6 +44,11 @@
 const int ASYNC_BUFFER_2N = 7;
 const int ASYNC_BUFFER_SIZE = 1<<ASYNC_BUFFER_2N;
 
+//先読みするフレーム数は、スクリプトの処理時間とエンコーダ側がフレームを消費する間隔から、以下の範囲で調整する
+const int VPY_PREFETCH_MIN = 2;           //先読みの最小フレーム数 (VapourSynthMT)
+const int VPY_PREFETCH_THREAD_MULTI = 2;  //先読みの最大フレーム数は、VapourSynthのスレッド数のこの倍まで
+const int VPY_PREFETCH_MEM_CAP_MB = 1024; //先読みした変換済みフレームに使用するメモリの上限
+
 #if _M_IX86
 #define VPY_X64 0
 #else
@@ -79,23 +89,31 @@ public:
     virtual RGY_ERR LoadNextFrame(RGYFrame *pSurface) override;
     virtual void Close() override;
 
-    void setFrameToAsyncBuffer(int n, const VSFrameRef* f);
+    //VapourSynthのワーカースレッドから呼ばれ、フレームを変換して先読みバッファに格納する
+    void setFrameToAsyncBuffer(int n, const VSFrameRef* f, const char *errorMsg);
 protected:
     virtual RGY_ERR Init(const TCHAR *strFileName, VideoInfo *pInputInfo, const void *prm) override;
 
     void release_vapoursynth();
     int load_vapoursynth();
-    int initAsyncEvents();
     void closeAsyncEvents();
-    const VSFrameRef* getFrameFromAsyncBuffer(int n) {
-        WaitForSingleObject(m_hAsyncEventFrameSetFin[n & (ASYNC_BUFFER_SIZE-1)], INFINITE);
-        const VSFrameRef *frame = m_pAsyncBuffer[n & (ASYNC_BUFFER_SIZE-1)];
-        SetEvent(m_hAsyncEventFrameSetStart[n & (ASYNC_BUFFER_SIZE-1)]);
-        return frame;
-    }
-    const VSFrameRef* m_pAsyncBuffer[ASYNC_BUFFER_SIZE];
-    HANDLE m_hAsyncEventFrameSetFin[ASYNC_BUFFER_SIZE];
-    HANDLE m_hAsyncEventFrameSetStart[ASYNC_BUFFER_SIZE];
+    //先読みのフレーム数に達するまでフレームを要求する
+    void requestFrames();
+    //スクリプトの処理時間とフレームの消費間隔から、先読みのフレーム数を調整する
+    void adjustPrefetchDepth();
+    uint8_t *getConvertBuffer();
+    void returnConvertBuffer(uint8_t *buf);
+
+    struct VpyAsyncFrame {
+        uint8_t *buf;  //変換済みのフレーム (エラーの場合はnullptr)
+        bool done;     //VapourSynthでの処理と変換が完了したか
+        std::chrono::steady_clock::time_point requested; //フレームを要求した時刻
+    };
+    std::mutex m_mtxAsync;
+    std::condition_variable m_cvAsync;
+    VpyAsyncFrame m_asyncFrames[ASYNC_BUFFER_SIZE];
+    std::vector<std::unique_ptr<uint8_t, aligned_malloc_deleter>> m_convertBufAll; //確保した変換用バッファ
+    std::vector<uint8_t *> m_convertBufFree; //未使用の変換用バッファ
 
     int getRevInfo(const char *vs_version_string);
 
@@ -105,7 +123,16 @@ protected:
     const VSAPI *m_sVSapi;
     VSScript *m_sVSscript;
     VSNodeRef *m_sVSnode;
-    int m_nAsyncFrames;
+    int m_nAsyncFrames;     //要求したフレーム数
+    int m_nAsyncCompleted;  //処理の完了したフレーム数
+
+    //先読みのフレーム数の調整
+    int m_nPrefetchDepth;
+    int m_nPrefetchDepthMax;
+    int m_nPrefetchDepthPeak;
+    double m_dLatencyMs;    //スクリプトの処理時間 (フレームの要求から変換完了まで) の移動平均
+    double m_dConsumeMs;    //エンコーダ側がフレームを消費する間隔 (読み込み関数の外にいた時間) の移動平均
+    std::chrono::steady_clock::time_point m_tmLastLoad;
 
     vsscript_t m_sVS;
 };
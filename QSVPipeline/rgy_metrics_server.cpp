@@ -0,0 +1,358 @@
+﻿// -----------------------------------------------------------------------------------------
+// QSVEnc/NVEnc by rigaya
+// -----------------------------------------------------------------------------------------
+// The MIT License
+//
+// Copyright (c) 2011-2016 rigaya
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// --------------------------------------------------------------------------------------------
+
+#include <cmath>
+#include <cstdarg>
+#include <cstring>
+#include "rgy_util.h"
+#include "rgy_metrics_server.h"
+#if ENABLE_METRICS_SERVER
+#include <unistd.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif //#if ENABLE_METRICS_SERVER
+
+//待ち受けの終了を確認する間隔 (ms)
+static const int METRICS_POLL_INTERVAL_MS = 100;
+//リクエストの受信を待つ最大時間 (ms)
+static const int METRICS_RECV_TIMEOUT_MS = 1000;
+
+RGYMetricsServer::RGYMetricsServer() :
+    m_sPath(),
+    m_fdListen(-1),
+    m_thServer(),
+    m_bAbort(false),
+    m_mtxSnapshot(),
+    m_snapshot(),
+    m_pLog() {
+    memset(&m_snapshot, 0, sizeof(m_snapshot));
+}
+
+RGYMetricsServer::~RGYMetricsServer() {
+    close();
+}
+
+void RGYMetricsServer::AddMessage(int log_level, const TCHAR *format, ...) {
+    if (m_pLog == nullptr || log_level < m_pLog->getLogLevel()) {
+        return;
+    }
+    va_list args;
+    va_start(args, format);
+    int len = _vsctprintf(format, args) + 1; // _vscprintf doesn't count terminating '\0'
+    tstring buffer;
+    buffer.resize(len, _T('\0'));
+    _vstprintf_s(&buffer[0], len, format, args);
+    va_end(args);
+    m_pLog->write(log_level, (tstring(_T("metrics: ")) + buffer).c_str());
+}
+
+RGY_ERR RGYMetricsServer::init(const tstring& path, std::shared_ptr<RGYLog> pLog) {
+    close();
+    m_pLog = pLog;
+#if ENABLE_METRICS_SERVER
+    m_sPath = tchar_to_string(path);
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (m_sPath.length() == 0 || m_sPath.length() >= sizeof(addr.sun_path)) {
+        AddMessage(RGY_LOG_ERROR, _T("invalid socket path \"%s\", must be shorter than %d bytes.\n"), path.c_str(), (int)sizeof(addr.sun_path));
+        m_sPath.clear();
+        return RGY_ERR_INVALID_PARAM;
+    }
+    strcpy_s(addr.sun_path, m_sPath.c_str());
+
+    //前回の実行で残ったソケットのみ削除する (通常のファイルは上書きしない)
+    struct stat st;
+    if (0 == stat(m_sPath.c_str(), &st)) {
+        if (!S_ISSOCK(st.st_mode)) {
+            AddMessage(RGY_LOG_ERROR, _T("\"%s\" already exists and is not a socket.\n"), path.c_str());
+            m_sPath.clear();
+            return RGY_ERR_INVALID_PARAM;
+        }
+        unlink(m_sPath.c_str());
+    }
+
+    m_fdListen = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (m_fdListen < 0) {
+        AddMessage(RGY_LOG_ERROR, _T("failed to create socket: %s.\n"), char_to_tstring(strerror(errno)).c_str());
+        m_sPath.clear();
+        return RGY_ERR_UNKNOWN;
+    }
+    if (0 != bind(m_fdListen, (const sockaddr *)&addr, sizeof(addr))
+        || 0 != listen(m_fdListen, 8)) {
+        AddMessage(RGY_LOG_ERROR, _T("failed to listen on \"%s\": %s.\n"), path.c_str(), char_to_tstring(strerror(errno)).c_str());
+        ::close(m_fdListen);
+        m_fdListen = -1;
+        m_sPath.clear();
+        return RGY_ERR_UNKNOWN;
+    }
+    m_bAbort = false;
+    m_thServer = std::thread(&RGYMetricsServer::run, this);
+    AddMessage(RGY_LOG_DEBUG, _T("listening on %s.\n"), path.c_str());
+    return RGY_ERR_NONE;
+#else
+    AddMessage(RGY_LOG_ERROR, _T("--metrics-socket is not supported on this platform.\n"));
+    return RGY_ERR_UNSUPPORTED;
+#endif //#if ENABLE_METRICS_SERVER
+}
+
+void RGYMetricsServer::close() {
+    if (m_thServer.joinable()) {
+        m_bAbort = true;
+        m_thServer.join();
+    }
+#if ENABLE_METRICS_SERVER
+    if (m_fdListen >= 0) {
+        ::close(m_fdListen);
+        m_fdListen = -1;
+    }
+    if (m_sPath.length() > 0) {
+        unlink(m_sPath.c_str());
+        AddMessage(RGY_LOG_DEBUG, _T("closed.\n"));
+    }
+#endif //#if ENABLE_METRICS_SERVER
+    m_sPath.clear();
+    m_pLog.reset();
+}
+
+void RGYMetricsServer::update(const RGYMetricsSnapshot& snapshot) {
+    std::lock_guard<std::mutex> lock(m_mtxSnapshot);
+    m_snapshot = snapshot;
+}
+
+void RGYMetricsServer::run() {
+#if ENABLE_METRICS_SERVER
+    while (!m_bAbort) {
+        pollfd pfd;
+        pfd.fd = m_fdListen;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        const int ret = poll(&pfd, 1, METRICS_POLL_INTERVAL_MS);
+        if (ret <= 0 || (pfd.revents & POLLIN) == 0) {
+            continue;
+        }
+        const int fd = accept4(m_fdListen, nullptr, nullptr, SOCK_CLOEXEC);
+        if (fd < 0) {
+            continue;
+        }
+        reply(fd);
+        ::close(fd);
+    }
+#endif //#if ENABLE_METRICS_SERVER
+}
+
+void RGYMetricsServer::reply(int fd) {
+#if ENABLE_METRICS_SERVER
+    //1行分 (またはHTTPのヘッダの終わりまで) を受け取る
+    //クライアントが何も送らずに閉じた場合はJSONを返す
+    std::string request;
+    const auto timeout = std::chrono::steady_clock::now() + std::chrono::milliseconds(METRICS_RECV_TIMEOUT_MS);
+    while (request.find('\n') == std::string::npos && request.length() < 4096) {
+        const int remain = (int)std::chrono::duration_cast<std::chrono::milliseconds>(timeout - std::chrono::steady_clock::now()).count();
+        if (remain <= 0 || m_bAbort) {
+            break;
+        }
+        pollfd pfd;
+        pfd.fd = fd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        if (poll(&pfd, 1, std::min(remain, METRICS_POLL_INTERVAL_MS)) <= 0) {
+            continue;
+        }
+        char buf[512];
+        const auto len = recv(fd, buf, sizeof(buf), 0);
+        if (len <= 0) {
+            break;
+        }
+        request.append(buf, len);
+    }
+    request = request.substr(0, request.find('\n'));
+    while (request.length() > 0 && (request.back() == '\r' || request.back() == ' ')) {
+        request.pop_back();
+    }
+
+    bool http = false;
+    RGYMetricsFormat fmt = RGY_METRICS_JSON;
+    if (request.substr(0, 4) == "GET ") {
+        http = true;
+        const auto target = request.substr(4, request.find(' ', 4) - 4);
+        if (target == "/metrics") {
+            fmt = RGY_METRICS_PROMETHEUS;
+        }
+    } else if (request == "prometheus" || request == "metrics") {
+        fmt = RGY_METRICS_PROMETHEUS;
+    }
+
+    RGYMetricsSnapshot snapshot;
+    {
+        std::lock_guard<std::mutex> lock(m_mtxSnapshot);
+        snapshot = m_snapshot;
+    }
+    std::string body = format(snapshot, fmt);
+    std::string response;
+    if (http) {
+        response = strsprintf("HTTP/1.0 200 OK\r\nContent-Type: %s\r\nContent-Length: %d\r\nConnection: close\r\n\r\n",
+            (fmt == RGY_METRICS_PROMETHEUS) ? "text/plain; version=0.0.4" : "application/json",
+            (int)body.length());
+    }
+    response += body;
+    for (size_t pos = 0; pos < response.length(); ) {
+        const auto len = send(fd, response.data() + pos, response.length() - pos, MSG_NOSIGNAL);
+        if (len <= 0) {
+            break;
+        }
+        pos += len;
+    }
+#else
+    UNREFERENCED_PARAMETER(fd);
+#endif //#if ENABLE_METRICS_SERVER
+}
+
+//JSONとして不正にならないよう、nan/infは0として出力する
+static double metrics_value(double value) {
+    return std::isfinite(value) ? value : 0.0;
+}
+
+std::string RGYMetricsServer::format(const RGYMetricsSnapshot& snapshot, RGYMetricsFormat fmt) {
+    const auto& enc = snapshot.enc;
+    const auto& perf = snapshot.perf;
+    const auto& queue = snapshot.queue;
+    const double progress = (enc.frameTotal > 0) ? std::min(100.0, enc.frameIn * 100.0 / enc.frameTotal) : 0.0;
+    const struct {
+        const char *name;
+        double value;
+    } cpu[] = {
+        { "total",    perf.cpu_percent },
+        { "kernel",   perf.cpu_kernel_percent },
+        { "main",     perf.main_thread_percent },
+        { "enc",      perf.enc_thread_percent },
+        { "in",       perf.in_thread_percent },
+        { "out",      perf.out_thread_percent },
+        { "aud_proc", perf.aud_proc_thread_percent },
+        { "aud_enc",  perf.aud_enc_thread_percent },
+    };
+    const struct {
+        const char *name;
+        size_t value;
+    } queues[] = {
+        { "vid_in",   queue.usage_vid_in },
+        { "aud_in",   queue.usage_aud_in },
+        { "vid_out",  queue.usage_vid_out },
+        { "aud_out",  queue.usage_aud_out },
+        { "aud_enc",  queue.usage_aud_enc },
+        { "aud_proc", queue.usage_aud_proc },
+        { "io_out",   queue.usage_io_out },
+    };
+
+    std::string str;
+    if (fmt == RGY_METRICS_PROMETHEUS) {
+        auto add = [&str](const char *name, const char *type, const char *help) {
+            str += strsprintf("# HELP qsvenc_%s %s\n# TYPE qsvenc_%s %s\n", name, help, name, type);
+        };
+        add("up", "gauge", "1 while encoding, 0 after the encode finished.");
+        str += strsprintf("qsvenc_up %d\n", (snapshot.finished) ? 0 : 1);
+        add("encode_started", "gauge", "1 after the first frame was encoded.");
+        str += strsprintf("qsvenc_encode_started %d\n", (snapshot.encStarted) ? 1 : 0);
+        add("frames_total", "counter", "Frames processed.");
+        str += strsprintf("qsvenc_frames_total{kind=\"in\"} %u\n", enc.frameIn);
+        str += strsprintf("qsvenc_frames_total{kind=\"out\"} %u\n", enc.frameOut);
+        str += strsprintf("qsvenc_frames_total{kind=\"drop\"} %u\n", enc.frameDrop);
+        str += strsprintf("qsvenc_frames_total{kind=\"idr\"} %u\n", enc.frameOutIDR);
+        str += strsprintf("qsvenc_frames_total{kind=\"i\"} %u\n", enc.frameOutI);
+        str += strsprintf("qsvenc_frames_total{kind=\"p\"} %u\n", enc.frameOutP);
+        str += strsprintf("qsvenc_frames_total{kind=\"b\"} %u\n", enc.frameOutB);
+        add("frames_expected", "gauge", "Frames expected to be encoded, 0 if unknown.");
+        str += strsprintf("qsvenc_frames_expected %u\n", enc.frameTotal);
+        add("progress_percent", "gauge", "Encode progress.");
+        str += strsprintf("qsvenc_progress_percent %.3f\n", metrics_value(progress));
+        add("output_bytes_total", "counter", "Bytes of video bitstream written.");
+        str += strsprintf("qsvenc_output_bytes_total %llu\n", (unsigned long long)enc.outFileSize);
+        add("fps", "gauge", "Encode speed.");
+        str += strsprintf("qsvenc_fps{window=\"last\"} %.3f\n", metrics_value(perf.fps));
+        str += strsprintf("qsvenc_fps{window=\"avg\"} %.3f\n", metrics_value(perf.fps_avg));
+        add("bitrate_kbps", "gauge", "Output bitrate.");
+        str += strsprintf("qsvenc_bitrate_kbps{window=\"last\"} %.3f\n", metrics_value(perf.bitrate_kbps));
+        str += strsprintf("qsvenc_bitrate_kbps{window=\"avg\"} %.3f\n", metrics_value(perf.bitrate_kbps_avg));
+        add("cpu_percent", "gauge", "CPU usage of the process and of each thread.");
+        for (const auto& c : cpu) {
+            str += strsprintf("qsvenc_cpu_percent{thread=\"%s\"} %.3f\n", c.name, metrics_value(c.value));
+        }
+        add("gpu_load_percent", "gauge", "GPU load.");
+        str += strsprintf("qsvenc_gpu_load_percent %.3f\n", metrics_value(perf.gpu_load_percent));
+        add("memory_bytes", "gauge", "Memory usage of the process.");
+        str += strsprintf("qsvenc_memory_bytes{type=\"private\"} %lld\n", (long long)perf.mem_private);
+        str += strsprintf("qsvenc_memory_bytes{type=\"virtual\"} %lld\n", (long long)perf.mem_virtual);
+        add("io_bytes_per_second", "gauge", "File IO of the process.");
+        str += strsprintf("qsvenc_io_bytes_per_second{dir=\"read\"} %.0f\n", metrics_value(perf.io_read_per_sec));
+        str += strsprintf("qsvenc_io_bytes_per_second{dir=\"write\"} %.0f\n", metrics_value(perf.io_write_per_sec));
+        add("queue_depth", "gauge", "Items waiting in each queue.");
+        for (const auto& q : queues) {
+            str += strsprintf("qsvenc_queue_depth{queue=\"%s\"} %llu\n", q.name, (unsigned long long)q.value);
+        }
+        add("stage_count", "counter", "Items processed by each stage.");
+        for (int i = 0; i < PERF_STAGE_MAX; i++) {
+            str += strsprintf("qsvenc_stage_count{stage=\"%s\"} %llu\n", PERF_STAGE_NAMES[i], (unsigned long long)snapshot.stage[i].count);
+        }
+        add("stage_latency_ms", "gauge", "Time spent in each stage per item.");
+        for (int i = 0; i < PERF_STAGE_MAX; i++) {
+            str += strsprintf("qsvenc_stage_latency_ms{stage=\"%s\",window=\"last\"} %.3f\n", PERF_STAGE_NAMES[i], metrics_value(snapshot.stage[i].lastMs));
+            str += strsprintf("qsvenc_stage_latency_ms{stage=\"%s\",window=\"avg\"} %.3f\n", PERF_STAGE_NAMES[i], metrics_value(snapshot.stage[i].avgMs));
+            str += strsprintf("qsvenc_stage_latency_ms{stage=\"%s\",window=\"max\"} %.3f\n", PERF_STAGE_NAMES[i], metrics_value(snapshot.stage[i].maxMs));
+        }
+        return str;
+    }
+
+    str += strsprintf("{\"seq\":%llu,\"time\":%.3f,\"finished\":%s,\"started\":%s",
+        (unsigned long long)snapshot.seq, perf.time_us * 1e-6, (snapshot.finished) ? "true" : "false", (snapshot.encStarted) ? "true" : "false");
+    str += strsprintf(",\"frames\":{\"in\":%u,\"out\":%u,\"drop\":%u,\"expected\":%u,\"idr\":%u,\"i\":%u,\"p\":%u,\"b\":%u}",
+        enc.frameIn, enc.frameOut, enc.frameDrop, enc.frameTotal, enc.frameOutIDR, enc.frameOutI, enc.frameOutP, enc.frameOutB);
+    str += strsprintf(",\"progress\":%.3f,\"out_bytes\":%llu,\"fps\":%.3f,\"fps_avg\":%.3f,\"bitrate_kbps\":%.3f,\"bitrate_kbps_avg\":%.3f",
+        metrics_value(progress), (unsigned long long)enc.outFileSize,
+        metrics_value(perf.fps), metrics_value(perf.fps_avg), metrics_value(perf.bitrate_kbps), metrics_value(perf.bitrate_kbps_avg));
+    str += ",\"cpu\":{";
+    for (int i = 0; i < _countof(cpu); i++) {
+        str += strsprintf("%s\"%s\":%.3f", (i) ? "," : "", cpu[i].name, metrics_value(cpu[i].value));
+    }
+    str += strsprintf("},\"gpu_load\":%.3f", metrics_value(perf.gpu_load_percent));
+    str += strsprintf(",\"mem\":{\"private\":%lld,\"virtual\":%lld}", (long long)perf.mem_private, (long long)perf.mem_virtual);
+    str += strsprintf(",\"io\":{\"read\":%.0f,\"write\":%.0f}", metrics_value(perf.io_read_per_sec), metrics_value(perf.io_write_per_sec));
+    str += ",\"queue\":{";
+    for (int i = 0; i < _countof(queues); i++) {
+        str += strsprintf("%s\"%s\":%llu", (i) ? "," : "", queues[i].name, (unsigned long long)queues[i].value);
+    }
+    str += "},\"stage\":{";
+    for (int i = 0; i < PERF_STAGE_MAX; i++) {
+        const auto& s = snapshot.stage[i];
+        str += strsprintf("%s\"%s\":{\"count\":%llu,\"last_ms\":%.3f,\"avg_ms\":%.3f,\"max_ms\":%.3f}", (i) ? "," : "",
+            PERF_STAGE_NAMES[i], (unsigned long long)s.count, metrics_value(s.lastMs), metrics_value(s.avgMs), metrics_value(s.maxMs));
+    }
+    str += "}}\n";
+    return str;
+}
@@ -0,0 +1,105 @@
+﻿// -----------------------------------------------------------------------------------------
+// QSVEnc/NVEnc by rigaya
+// -----------------------------------------------------------------------------------------
+// The MIT License
+//
+// Copyright (c) 2011-2016 rigaya
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// --------------------------------------------------------------------------------------------
+
+#pragma once
+#ifndef __RGY_METRICS_SERVER_H__
+#define __RGY_METRICS_SERVER_H__
+
+#include <string>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include "rgy_osdep.h"
+#include "rgy_tchar.h"
+#include "rgy_log.h"
+#include "rgy_status.h"
+#include "rgy_perf_monitor.h"
+
+//--metrics-socket
+//Unixドメインソケットで待ち受け、接続ごとに最新の計測結果を返して切断する
+//  - リクエストとして1行を受け取り、"prometheus"(または"metrics")ならPrometheusのテキスト形式、
+//    それ以外("json"や空行)ならJSONで返す
+//  - "GET /metrics HTTP/1.x" のようなHTTPのリクエストにはHTTPのヘッダを付けて返す (/metricsならPrometheus、それ以外はJSON)
+//計測結果はCPerfMonitorのスレッドが定期的にupdate()で渡すので、エンコードの各スレッドはロックを取らない
+#if defined(_WIN32) || defined(_WIN64)
+#define ENABLE_METRICS_SERVER 0
+#else
+#define ENABLE_METRICS_SERVER 1
+#endif
+
+//処理段ごとの所要時間の集計結果
+struct RGYMetricsStage {
+    uint64_t count;   //計測回数
+    double   avgMs;   //開始からの平均 (ms)
+    double   lastMs;  //前回の更新からの平均 (ms)
+    double   maxMs;   //最大 (ms)
+};
+
+struct RGYMetricsSnapshot {
+    uint64_t seq;             //更新回数
+    bool encStarted;          //エンコードが開始されているか
+    bool finished;            //エンコードが終了しているか
+    PerfInfo perf;            //CPerfMonitorの計測結果
+    EncodeStatusData enc;     //EncodeStatusの値
+    PerfQueueInfo queue;      //各キューの使用量
+    RGYMetricsStage stage[PERF_STAGE_MAX];
+};
+
+enum RGYMetricsFormat {
+    RGY_METRICS_JSON,
+    RGY_METRICS_PROMETHEUS,
+};
+
+class RGYMetricsServer {
+public:
+    RGYMetricsServer();
+    ~RGYMetricsServer();
+
+    RGY_ERR init(const tstring& path, std::shared_ptr<RGYLog> pLog);
+    void close();
+
+    //CPerfMonitorのスレッドから呼ぶ
+    void update(const RGYMetricsSnapshot& snapshot);
+
+    //snapshotを指定の形式の文字列にする
+    static std::string format(const RGYMetricsSnapshot& snapshot, RGYMetricsFormat fmt);
+protected:
+    void run();
+    void reply(int fd);
+    void AddMessage(int log_level, const TCHAR *format, ...);
+
+    std::string m_sPath;
+    int m_fdListen;
+    std::thread m_thServer;
+    std::atomic<bool> m_bAbort;
+    std::mutex m_mtxSnapshot; //CPerfMonitorのスレッドとサーバのスレッドの間のみで使用する
+    RGYMetricsSnapshot m_snapshot;
+    std::shared_ptr<RGYLog> m_pLog;
+};
+
+#endif //__RGY_METRICS_SERVER_H__
@@ -0,0 +1,210 @@
+﻿// -----------------------------------------------------------------------------------------
+// QSVEnc/NVEnc by rigaya
+// -----------------------------------------------------------------------------------------
+// The MIT License
+//
+// Copyright (c) 2011-2016 rigaya
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// --------------------------------------------------------------------------------------------
+
+#pragma once
+#ifndef __RGY_MUX_INTERLEAVER_H__
+#define __RGY_MUX_INTERLEAVER_H__
+
+#include <cstdint>
+#include <cstddef>
+#include <climits>
+#include <deque>
+#include <queue>
+#include <vector>
+#include <functional>
+
+//複数のストリーム(映像・各音声トラック・各字幕トラック)のパケットを、
+//共通のtimebaseに変換したdtsの小さい順に取り出すためのインターリーバ
+//  - 各ストリームはFIFOで保持し、各ストリームの先頭のみをdtsをキーとしたmin-heapで管理する
+//  - sparseでないストリームは、そのストリームにパケットが来るまで出力を待機する
+//    (先頭のdtsが最小でなくとも、後から小さいdtsのパケットが来る可能性があるため)
+//  - sparseなストリーム(字幕など)は、出力の待機の対象としない
+//  - いずれかのストリームに保持しているパケットが閾値(dtsの幅または個数)を超えたら、
+//    パケットの来ないストリームを待つのをあきらめ、保持しているパケットを出力する
+//スレッドセーフではないので、単一のスレッドから使用すること
+//libavなどには依存しないので、単体でのテストが可能
+template<typename Type>
+class RGYMuxInterleaver {
+public:
+    static const int64_t DTS_UNKNOWN = INT64_MIN; //dtsが不明の場合 (そのストリームの直前のdtsを使用する)
+
+    RGYMuxInterleaver() :
+        m_nMaxWaitDts(INT64_MAX), m_nMaxWaitCount(SIZE_MAX),
+        m_stream(), m_heap(), m_nSeq(0), m_nQueued(0), m_nWaiting(0), m_nOverflow(0) {
+    }
+    ~RGYMuxInterleaver() {
+    }
+    //maxWaitDts   ... あるストリームの保持しているパケットのdtsの幅がこれを超えたら待機をあきらめる
+    //maxWaitCount ... あるストリームの保持しているパケット数がこれを超えたら待機をあきらめる
+    void init(int64_t maxWaitDts, size_t maxWaitCount) {
+        m_nMaxWaitDts = maxWaitDts;
+        m_nMaxWaitCount = maxWaitCount;
+        m_stream.clear();
+        m_heap = decltype(m_heap)();
+        m_nSeq = 0;
+        m_nQueued = 0;
+        m_nWaiting = 0;
+        m_nOverflow = 0;
+    }
+    //ストリームを追加し、そのidを返す
+    int addStream(bool sparse) {
+        Stream stream;
+        stream.sparse = sparse;
+        stream.finished = false;
+        stream.overflow = false;
+        stream.lastDts = DTS_UNKNOWN;
+        m_stream.push_back(stream);
+        if (!sparse) {
+            m_nWaiting++;
+        }
+        return (int)m_stream.size() - 1;
+    }
+    //ストリームidにパケットを追加する
+    void push(int id, int64_t dts, const Type& data) {
+        auto& stream = m_stream[id];
+        if (dts == DTS_UNKNOWN) {
+            dts = (stream.lastDts == DTS_UNKNOWN) ? INT64_MIN + 1 : stream.lastDts;
+        }
+        stream.lastDts = dts;
+        stream.queue.push_back({ dts, data });
+        m_nQueued++;
+        if (stream.queue.size() == 1) {
+            if (!stream.sparse && !stream.finished) {
+                m_nWaiting--;
+            }
+            m_heap.push({ dts, id, m_nSeq++ });
+        }
+        updateOverflow(stream);
+    }
+    //ストリームidにこれ以上パケットが来ないことを通知する
+    void finish(int id) {
+        auto& stream = m_stream[id];
+        if (!stream.finished) {
+            if (!stream.sparse && stream.queue.empty()) {
+                m_nWaiting--;
+            }
+            stream.finished = true;
+        }
+    }
+    //すべてのストリームについて、これ以上パケットが来ないことを通知する
+    void finishAll() {
+        for (int i = 0; i < (int)m_stream.size(); i++) {
+            finish(i);
+        }
+    }
+    //次に出力すべきパケットがあれば取り出してtrueを返す
+    //待機の必要なストリームがあれば、falseを返す
+    bool pop(Type *data, int *id = nullptr, int64_t *dts = nullptr) {
+        if (m_heap.empty() || (m_nWaiting > 0 && m_nOverflow == 0)) {
+            return false;
+        }
+        const auto head = m_heap.top();
+        m_heap.pop();
+        auto& stream = m_stream[head.id];
+        *data = stream.queue.front().data;
+        if (id) *id = head.id;
+        if (dts) *dts = head.dts;
+        stream.queue.pop_front();
+        m_nQueued--;
+        if (stream.queue.empty()) {
+            if (!stream.sparse && !stream.finished) {
+                m_nWaiting++;
+            }
+        } else {
+            m_heap.push({ stream.queue.front().dts, head.id, m_nSeq++ });
+        }
+        updateOverflow(stream);
+        return true;
+    }
+    //保持しているパケットの総数
+    size_t size() const {
+        return m_nQueued;
+    }
+    bool empty() const {
+        return m_nQueued == 0;
+    }
+    //ストリームidの保持しているパケット数
+    size_t size(int id) const {
+        return m_stream[id].queue.size();
+    }
+    //パケットが来るのを待機しているストリームの数
+    int waiting() const {
+        return m_nWaiting;
+    }
+protected:
+    struct Packet {
+        int64_t dts;
+        Type data;
+    };
+    struct Stream {
+        std::deque<Packet> queue;
+        bool sparse;
+        bool finished;
+        bool overflow;
+        int64_t lastDts;
+    };
+    struct Head {
+        int64_t dts;
+        int id;
+        uint64_t seq;
+        //std::priority_queueは最大値を先頭とするので、比較を逆にする
+        //dtsが同じなら、idの小さい(=先に登録した)ストリームを優先する
+        bool operator<(const Head& x) const {
+            if (dts != x.dts) return dts > x.dts;
+            if (id != x.id) return id > x.id;
+            return seq > x.seq;
+        }
+    };
+    //保持しているパケットのdtsの幅がmaxWaitDtsを超えているか
+    //dtsが不明なまま追加された先頭のパケット(INT64_MIN + 1)は幅の計算に含めず、減算のオーバーフローも避ける
+    bool exceedWaitDts(const Stream& stream) const {
+        const int64_t frontDts = stream.queue.front().dts;
+        if (frontDts <= DTS_UNKNOWN + 1 || stream.lastDts <= frontDts) {
+            return false;
+        }
+        return (uint64_t)stream.lastDts - (uint64_t)frontDts > (uint64_t)m_nMaxWaitDts;
+    }
+    void updateOverflow(Stream& stream) {
+        const bool overflow = !stream.queue.empty()
+            && (stream.queue.size() > m_nMaxWaitCount || exceedWaitDts(stream));
+        if (overflow != stream.overflow) {
+            m_nOverflow += (overflow) ? 1 : -1;
+            stream.overflow = overflow;
+        }
+    }
+
+    int64_t m_nMaxWaitDts;
+    size_t m_nMaxWaitCount;
+    std::vector<Stream> m_stream;
+    std::priority_queue<Head> m_heap;
+    uint64_t m_nSeq;
+    size_t m_nQueued;
+    int m_nWaiting;
+    int m_nOverflow;
+};
+
+#endif //__RGY_MUX_INTERLEAVER_H__
@@ -239,7 +239,7 @@ static void SetThreadAffinityMask(pthread_t thread, size_t mask) {
     cpu_set_t cpuset;
     CPU_ZERO(&cpuset);
     for (uint32_t j = 0; j < sizeof(mask) * 8; j++) {
-        if (mask & (1 << j)) {
+        if (mask & ((size_t)1 << j)) {
             CPU_SET(j, &cpuset);
         }
     }
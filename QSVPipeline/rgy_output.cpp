@@ -27,7 +27,13 @@
 
 #include "rgy_output.h"
 #include "rgy_bitstream.h"
+#include "rgy_pipe.h"
 #include <smmintrin.h>
+#if !(defined(_WIN32) || defined(_WIN64))
+#include <cerrno>
+#include <unistd.h>
+#include <sys/uio.h>
+#endif //#if !(defined(_WIN32) || defined(_WIN64))
 
 static RGY_ERR WriteY4MHeader(FILE *fp, const VideoInfo *info) {
     char buffer[256] = { 0 };
@@ -102,7 +108,9 @@ void RGYOutput::Close() {
 }
 
 RGYOutputRaw::RGYOutputRaw() :
-    m_seiNal()
+    m_headerCache(),
+    m_headerSpans(),
+    m_bOutputIsPipe(false)
 #if ENABLE_AVSW_READER
     , m_pBsfc()
 #endif //#if ENABLE_AVSW_READER
@@ -135,6 +143,19 @@ RGY_ERR RGYOutputRaw::Init(const TCHAR *strFileName, const VideoInfo *pVideoOutp
             m_fDest.reset(stdout);
             m_bOutputIsStdout = true;
             AddMessage(RGY_LOG_DEBUG, _T("using stdout\n"));
+            //パイプへの出力では、バッファを拡大して読み出し側の起床回数を減らす
+            const int pipeSize = rgy_set_pipe_size(stdout, (std::max)(RGY_PIPE_BUF_SIZE_DEFAULT, clamp(rawPrm->nBufSizeMB, 0, RGY_OUTPUT_BUF_MB_MAX) * 1024 * 1024));
+            if (pipeSize > 0) {
+                AddMessage(RGY_LOG_DEBUG, _T("stdout is a pipe, buffer size %d KB.\n"), pipeSize / 1024);
+            }
+#if !(defined(_WIN32) || defined(_WIN64))
+            //パイプへはstdioのバッファにコピーせず、writevで直接書き出す
+            if (rgy_is_pipe(stdout)) {
+                fflush(stdout);
+                m_bOutputIsPipe = true;
+                AddMessage(RGY_LOG_DEBUG, _T("write to stdout pipe directly.\n"));
+            }
+#endif //#if !(defined(_WIN32) || defined(_WIN64))
         } else {
             CreateDirectoryRecursive(PathRemoveFileSpecFixed(strFileName).second.c_str());
             FILE *fp = NULL;
@@ -260,9 +281,20 @@ RGY_ERR RGYOutputRaw::Init(const TCHAR *strFileName, const VideoInfo *pVideoOutp
             AddMessage(RGY_LOG_DEBUG, _T("initialized %s filter\n"), bsf_name);
         }
 #endif //#if ENABLE_AVSW_READER
-        if (rawPrm->codecId == RGY_CODEC_HEVC) {
-            m_seiNal = rawPrm->seiNal;
+        RGYHeaderCache::SPSFilter spsFilter;
+#if ENABLE_AVSW_READER
+        if (m_pBsfc) {
+            spsFilter = [this](const uint8_t *sps, size_t size, std::vector<uint8_t>& out) {
+                tstring errMes;
+                auto err = filterSPSWithBsf(m_pBsfc.get(), sps, size, out, errMes);
+                if (err != RGY_ERR_NONE && err != RGY_ERR_MORE_DATA) {
+                    AddMessage(RGY_LOG_ERROR, errMes);
+                }
+                return err;
+            };
         }
+#endif //#if ENABLE_AVSW_READER
+        m_headerCache.init(rawPrm->codecId == RGY_CODEC_HEVC, (rawPrm->codecId == RGY_CODEC_HEVC) ? rawPrm->seiNal : vector<uint8_t>(), spsFilter);
     }
     m_bInited = true;
     return RGY_ERR_NONE;
@@ -277,79 +309,22 @@ RGY_ERR RGYOutputRaw::WriteNextFrame(RGYBitstream *pBitstream) {
 
     size_t nBytesWritten = 0;
     if (!m_bNoOutput) {
-#if ENABLE_AVSW_READER
-        if (m_pBsfc) {
-            uint8_t nal_type = 0;
-            std::vector<nal_info> nal_list;
-            if (m_VideoOutputInfo.codec == RGY_CODEC_HEVC) {
-                nal_type = NALU_HEVC_SPS;
-                nal_list = parse_nal_unit_hevc(pBitstream->data(), pBitstream->size());
-            } else if (m_VideoOutputInfo.codec == RGY_CODEC_H264) {
-                nal_type = NALU_H264_SPS;
-                nal_list = parse_nal_unit_h264(pBitstream->data(), pBitstream->size());
-            }
-            auto sps_nal = std::find_if(nal_list.begin(), nal_list.end(), [](nal_info info) { return info.type == NALU_HEVC_SPS; });
-            if (sps_nal != nal_list.end()) {
-                AVPacket pkt = { 0 };
-                av_init_packet(&pkt);
-                av_new_packet(&pkt, (int)sps_nal->size);
-                memcpy(pkt.data, sps_nal->ptr, sps_nal->size);
-                int ret = 0;
-                if (0 > (ret = av_bsf_send_packet(m_pBsfc.get(), &pkt))) {
-                    av_packet_unref(&pkt);
-                    AddMessage(RGY_LOG_ERROR, _T("failed to send packet to %s bitstream filter: %s.\n"),
-                        char_to_tstring(m_pBsfc->filter->name).c_str(), qsv_av_err2str(ret).c_str());
-                    return RGY_ERR_UNKNOWN;
-                }
-                ret = av_bsf_receive_packet(m_pBsfc.get(), &pkt);
-                if (ret == AVERROR(EAGAIN)) {
-                    return RGY_ERR_NONE;
-                } else if ((ret < 0 && ret != AVERROR_EOF) || pkt.size < 0) {
-                    AddMessage(RGY_LOG_ERROR, _T("failed to run %s bitstream filter: %s.\n"),
-                        char_to_tstring(m_pBsfc->filter->name).c_str(), qsv_av_err2str(ret).c_str());
-                    return RGY_ERR_UNKNOWN;
-                }
-                const auto new_data_size = pBitstream->size() + pkt.size - sps_nal->size;
-                const auto sps_nal_offset = sps_nal->ptr - pBitstream->data();
-                const auto next_nal_orig_offset = sps_nal_offset + sps_nal->size;
-                const auto next_nal_new_offset = sps_nal_offset + pkt.size;
-                const auto stream_orig_length = pBitstream->size();
-                if ((decltype(new_data_size))pBitstream->bufsize() < new_data_size) {
-                    pBitstream->changeSize(new_data_size);
-                } else if (pkt.size > (decltype(pkt.size))sps_nal->size) {
-                    pBitstream->trim();
-                }
-                memmove(pBitstream->data() + next_nal_new_offset, pBitstream->data() + next_nal_orig_offset, stream_orig_length - next_nal_orig_offset);
-                memcpy(pBitstream->data() + sps_nal_offset, pkt.data, pkt.size);
-                av_packet_unref(&pkt);
+        //ヘッダーの書き換えはキャッシュ済みのヘッダーを使って行い、区間ごとに書き出す
+        auto err = m_headerCache.process(pBitstream->data(), pBitstream->size(), m_headerSpans);
+        if (err != RGY_ERR_NONE) {
+            if (err == RGY_ERR_UNDEFINED_BEHAVIOR) {
+                AddMessage(RGY_LOG_ERROR, _T("Unexpected %s header.\n"), CodecToStr(m_VideoOutputInfo.codec).c_str());
             }
+            return err;
         }
-#endif //#if ENABLE_AVSW_READER
-        if (m_seiNal.size()) {
-            const auto nal_list     = parse_nal_unit_hevc(pBitstream->data(), pBitstream->size());
-            const auto hevc_vps_nal = std::find_if(nal_list.begin(), nal_list.end(), [](nal_info info) { return info.type == NALU_HEVC_VPS; });
-            const auto hevc_sps_nal = std::find_if(nal_list.begin(), nal_list.end(), [](nal_info info) { return info.type == NALU_HEVC_SPS; });
-            const auto hevc_pps_nal = std::find_if(nal_list.begin(), nal_list.end(), [](nal_info info) { return info.type == NALU_HEVC_PPS; });
-            const bool header_check = (nal_list.end() != hevc_vps_nal) && (nal_list.end() != hevc_sps_nal) && (nal_list.end() != hevc_pps_nal);
-            if (header_check) {
-                nBytesWritten  = _fwrite_nolock(hevc_vps_nal->ptr, 1, hevc_vps_nal->size, m_fDest.get());
-                nBytesWritten += _fwrite_nolock(hevc_sps_nal->ptr, 1, hevc_sps_nal->size, m_fDest.get());
-                nBytesWritten += _fwrite_nolock(hevc_pps_nal->ptr, 1, hevc_pps_nal->size, m_fDest.get());
-                nBytesWritten += _fwrite_nolock(m_seiNal.data(),   1, m_seiNal.size(),    m_fDest.get());
-                for (const auto& nal : nal_list) {
-                    if (nal.type != NALU_HEVC_VPS && nal.type != NALU_HEVC_SPS && nal.type != NALU_HEVC_PPS) {
-                        nBytesWritten += _fwrite_nolock(nal.ptr, 1, nal.size, m_fDest.get());
-                    }
-                }
-            } else {
-                AddMessage(RGY_LOG_ERROR, _T("Unexpected HEVC header.\n"));
-                return RGY_ERR_UNDEFINED_BEHAVIOR;
-            }
-            m_seiNal.clear();
+        if (m_bOutputIsPipe) {
+            nBytesWritten = writePipe(m_headerSpans);
         } else {
-            nBytesWritten = _fwrite_nolock(pBitstream->data(), 1, pBitstream->size(), m_fDest.get());
-            WRITE_CHECK(nBytesWritten, pBitstream->size());
+            for (const auto& span : m_headerSpans) {
+                nBytesWritten += _fwrite_nolock(span.ptr, 1, span.size, m_fDest.get());
+            }
         }
+        WRITE_CHECK(nBytesWritten, RGYHeaderCache::spansSize(m_headerSpans));
     }
 
     m_pEncSatusInfo->SetOutputData(pBitstream->frametype(), pBitstream->size(), 0);
@@ -363,6 +338,48 @@ RGY_ERR RGYOutputRaw::WriteNextFrame(RGYFrame *pSurface) {
     return RGY_ERR_UNSUPPORTED;
 }
 
+size_t RGYOutputRaw::writePipe(const vector<RGYBitstreamSpan>& spans) {
+    size_t nBytesWritten = 0;
+#if defined(_WIN32) || defined(_WIN64)
+    for (const auto& span : spans) {
+        nBytesWritten += _fwrite_nolock(span.ptr, 1, span.size, m_fDest.get());
+    }
+#else
+    const int fd = fileno(m_fDest.get());
+    size_t idx = 0;    //書き出し中の区間
+    size_t offset = 0; //書き出し中の区間内の位置
+    while (idx < spans.size()) {
+        struct iovec iov[64];
+        int iovcnt = 0;
+        for (size_t i = idx; i < spans.size() && iovcnt < _countof(iov); i++, iovcnt++) {
+            const size_t skip = (i == idx) ? offset : 0;
+            iov[iovcnt].iov_base = (void *)(spans[i].ptr + skip);
+            iov[iovcnt].iov_len  = spans[i].size - skip;
+        }
+        const ssize_t written = writev(fd, iov, iovcnt);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        if (written == 0) {
+            break;
+        }
+        nBytesWritten += written;
+        //書き出せた分だけ区間を進める (パイプが一杯の場合は途中までしか書き出されない)
+        size_t remain = written;
+        while (idx < spans.size() && remain >= spans[idx].size - offset) {
+            remain -= spans[idx].size - offset;
+            offset = 0;
+            idx++;
+        }
+        offset += remain;
+    }
+#endif
+    return nBytesWritten;
+}
+
 CQSVOutFrame::CQSVOutFrame() : m_bY4m(true) {
     m_strWriterName = _T("yuv writer");
     m_OutType = OUT_TYPE_SURFACE;
@@ -377,6 +394,10 @@ RGY_ERR CQSVOutFrame::Init(const TCHAR *strFileName, const VideoInfo *pVideoOutp
         m_fDest.reset(stdout);
         m_bOutputIsStdout = true;
         AddMessage(RGY_LOG_DEBUG, _T("using stdout\n"));
+        const int pipeSize = rgy_set_pipe_size(stdout, RGY_PIPE_BUF_SIZE_DEFAULT);
+        if (pipeSize > 0) {
+            AddMessage(RGY_LOG_DEBUG, _T("stdout is a pipe, buffer size %d KB.\n"), pipeSize / 1024);
+        }
     } else {
         FILE *fp = NULL;
         int error = _tfopen_s(&fp, strFileName, _T("wb"));
@@ -38,6 +38,7 @@
 #include "rgy_log.h"
 #include "rgy_status.h"
 #include "rgy_avutil.h"
+#include "rgy_bitstream.h"
 #include "qsv_util.h"
 
 using std::unique_ptr;
@@ -52,12 +53,44 @@ enum OutputType {
 class RGYTimestamp {
 private:
     std::unordered_map<int64_t, int64_t> m_duration;
+    std::unordered_map<int64_t, uint64_t> m_popMask; //get_and_popした出力 (出力の番号ごとのbit, 複数の出力がある場合のみ)
     std::mutex mtx;
     int64_t last_check_pts;
     int64_t offset;
+    uint64_t m_consumers; //get_and_popを呼ぶ出力 (出力の番号ごとのbit)
 public:
-    RGYTimestamp() : m_duration(), mtx(), last_check_pts(-1), offset(0) {};
+    RGYTimestamp() : m_duration(), m_popMask(), mtx(), last_check_pts(-1), offset(0), m_consumers(0) {};
     ~RGYTimestamp() {};
+    //get_and_popを呼ぶ出力を登録し、その番号を返す (--teeでは複数の出力が登録される)
+    //登録されているすべての出力がget_and_popするまで、durationを保持する
+    int addConsumer() {
+        std::lock_guard<std::mutex> lock(mtx);
+        for (int id = 0; id < 64; id++) {
+            if ((m_consumers & (1ULL << id)) == 0) {
+                m_consumers |= (1ULL << id);
+                return id;
+            }
+        }
+        return -1;
+    }
+    //出力の登録を解除する (出力が失敗した場合・終了した場合)
+    //その出力のget_and_popを待っていたdurationは、ほかの出力がすべてget_and_pop済みなら削除する
+    void removeConsumer(int id) {
+        std::lock_guard<std::mutex> lock(mtx);
+        if (id < 0 || (m_consumers & (1ULL << id)) == 0) {
+            return;
+        }
+        m_consumers &= ~(1ULL << id);
+        for (auto it = m_popMask.begin(); it != m_popMask.end();) {
+            it->second &= m_consumers;
+            if (it->second == m_consumers) {
+                m_duration.erase(it->first);
+                it = m_popMask.erase(it);
+            } else {
+                it++;
+            }
+        }
+    }
     void add(int64_t pts, int64_t duration) {
         std::lock_guard<std::mutex> lock(mtx);
         m_duration[pts] = duration;
@@ -79,13 +112,26 @@ public:
         last_check_pts = pts;
         return pts;
     }
-    int64_t get_and_pop(int64_t pts) {
+    int64_t get_and_pop(int64_t pts, int id) {
         std::lock_guard<std::mutex> lock(mtx);
         auto pos = m_duration.find(pts);
         if (pos == m_duration.end()) {
             return -1;
         }
         auto duration = pos->second;
+        const uint64_t bit = (id >= 0) ? 1ULL << id : 0;
+        if ((m_consumers & bit) == 0) {
+            //登録を解除した出力からは、durationを返すのみとする
+            return duration;
+        }
+        if (m_consumers != bit) {
+            auto& mask = m_popMask[pts];
+            mask |= bit;
+            if (mask != m_consumers) {
+                return duration;
+            }
+            m_popMask.erase(pts);
+        }
         m_duration.erase(pos);
         return duration;
     }
@@ -188,7 +234,12 @@ public:
 protected:
     virtual RGY_ERR Init(const TCHAR *strFileName, const VideoInfo *pOutputInfo, const void *prm) override;
 
-    vector<uint8_t> m_seiNal;
+    //パイプへ区間のリストをstdioを経由せずにまとめて書き出し、書き出したバイト数を返す
+    size_t writePipe(const vector<RGYBitstreamSpan>& spans);
+
+    RGYHeaderCache m_headerCache;               //SPSの書き換え・SEIの挿入を行ったヘッダーのキャッシュ
+    vector<RGYBitstreamSpan> m_headerSpans;     //書き出すデータの区間のリスト
+    bool m_bOutputIsPipe;                       //stdioを経由せずにパイプへ直接書き出す
 #if ENABLE_AVSW_READER
     unique_ptr<AVBSFContext, RGYAVDeleter<AVBSFContext>> m_pBsfc;
 #endif //#if ENABLE_AVSW_READER
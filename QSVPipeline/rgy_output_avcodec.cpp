@@ -35,6 +35,7 @@
 #include "rgy_output_avcodec.h"
 #include "rgy_avlog.h"
 #include "rgy_bitstream.h"
+#include "rgy_thread_affinity.h"
 
 #if ENABLE_AVSW_READER
 #if USE_CUSTOM_IO
@@ -57,6 +58,15 @@ const AVRational RGYOutputAvcodec::QUEUE_DTS_TIMEBASE = av_make_q(1, 90000);
 RGYOutputAvcodec::RGYOutputAvcodec() {
     memset(&m_Mux.format, 0, sizeof(m_Mux.format));
     memset(&m_Mux.video,  0, sizeof(m_Mux.video));
+    m_Mux.segment.fTargetSec = 0.0;
+    m_Mux.segment.nTargetDuration = 0;
+    m_Mux.segment.nIndex = 0;
+    m_Mux.segment.fStartSec = 0.0;
+    m_Mux.segment.fEndSec = 0.0;
+    m_Mux.segment.nBlockSize = 0;
+    m_Mux.segment.pQueueUsage = nullptr;
+    m_bPassthroughClosed = false;
+    m_bPassthroughError = false;
     m_strWriterName = _T("avout");
 }
 
@@ -119,6 +129,8 @@ void RGYOutputAvcodec::CloseVideo(AVMuxVideo *pMuxVideo) {
         fclose(m_Mux.video.fpTsLogFile);
     }
     m_Mux.video.timestampList.clear();
+    m_headerCache.clear();
+    ReleaseVideoTimestamp();
     if (m_Mux.video.pBsfc) {
         av_bsf_free(&m_Mux.video.pBsfc);
     }
@@ -132,7 +144,7 @@ void RGYOutputAvcodec::CloseFormat(AVMuxFormat *pMuxFormat) {
             av_write_trailer(pMuxFormat->pFormatCtx);
         }
 #if USE_CUSTOM_IO
-        if (!pMuxFormat->fpOutput) {
+        if (!pMuxFormat->pFileOutput) {
 #endif
             avio_close(pMuxFormat->pFormatCtx->pb);
             AddMessage(RGY_LOG_DEBUG, _T("Closed AVIO Context.\n"));
@@ -143,24 +155,41 @@ void RGYOutputAvcodec::CloseFormat(AVMuxFormat *pMuxFormat) {
         AddMessage(RGY_LOG_DEBUG, _T("Closed avformat context.\n"));
     }
 #if USE_CUSTOM_IO
-    if (pMuxFormat->fpOutput) {
-        fflush(pMuxFormat->fpOutput);
-        fclose(pMuxFormat->fpOutput);
-        AddMessage(RGY_LOG_DEBUG, _T("Closed File Pointer.\n"));
+    if (pMuxFormat->pFileOutput) {
+        const int err = pMuxFormat->pFileOutput->close();
+        if (err) {
+            AddMessage(RGY_LOG_ERROR, _T("Error while writing output file: %s.\n"), _tcserror(err));
+        }
+        delete pMuxFormat->pFileOutput;
+        AddMessage(RGY_LOG_DEBUG, _T("Closed output file.\n"));
     }
 
     if (pMuxFormat->pAVOutBuffer) {
         av_free(pMuxFormat->pAVOutBuffer);
     }
-
-    if (pMuxFormat->pOutputBuffer) {
-        free(pMuxFormat->pOutputBuffer);
-    }
 #endif //USE_CUSTOM_IO
     memset(pMuxFormat, 0, sizeof(pMuxFormat[0]));
     AddMessage(RGY_LOG_DEBUG, _T("Closed format.\n"));
 }
 
+void RGYOutputAvcodec::CloseSegment(AVMuxSegment *pMuxSegment) {
+    //最後のセグメントはCloseFormatで閉じられているので、公開してプレイリストを完成させる
+    if (pMuxSegment->fTargetSec > 0.0 && pMuxSegment->sCurrentFile.length() > 0) {
+        SegmentPublish((std::max)(pMuxSegment->fEndSec - pMuxSegment->fStartSec, 0.0), true);
+    }
+    pMuxSegment->fTargetSec = 0.0;
+    pMuxSegment->sPlaylist.clear();
+    pMuxSegment->sBaseName.clear();
+    pMuxSegment->sCurrentFile.clear();
+    pMuxSegment->nIndex = 0;
+    pMuxSegment->fStartSec = 0.0;
+    pMuxSegment->fEndSec = 0.0;
+    pMuxSegment->nBlockSize = 0;
+    pMuxSegment->pQueueUsage = nullptr;
+    pMuxSegment->list.clear();
+    AddMessage(RGY_LOG_DEBUG, _T("Closed segment.\n"));
+}
+
 void RGYOutputAvcodec::CloseQueues() {
 #if ENABLE_AVCODEC_OUT_THREAD
     m_Mux.thread.bThAudEncodeAbort = true;
@@ -228,7 +257,22 @@ void RGYOutputAvcodec::CloseThread() {
 void RGYOutputAvcodec::Close() {
     AddMessage(RGY_LOG_DEBUG, _T("Closing...\n"));
     CloseThread();
+    {
+        std::lock_guard<std::mutex> lock(m_mtxPassthrough);
+        m_bPassthroughClosed = true;
+    }
+    //キューに残っているpassthroughのパケットを書き出す
+    if (m_Mux.format.bFileHeaderWritten && m_Mux.passthrough.size() > 0) {
+        WritePassthroughPackets();
+    }
+    for (auto& pkt : m_passthroughPkts) {
+        av_packet_unref(&pkt.first);
+    }
+    m_passthroughPkts.clear();
+    m_pktTee = nullptr;
     CloseFormat(&m_Mux.format);
+    CloseSegment(&m_Mux.segment);
+    m_Mux.passthrough.clear();
     for (int i = 0; i < (int)m_Mux.audio.size(); i++) {
         CloseAudio(&m_Mux.audio[i]);
     }
@@ -522,6 +566,7 @@ RGY_ERR RGYOutputAvcodec::InitVideo(const VideoInfo *pVideoOutputInfo, const Avc
     m_Mux.video.bDtsUnavailable   = prm->bVideoDtsUnavailable;
     m_Mux.video.nInputFirstKeyPts = prm->nVideoInputFirstKeyPts;
     m_Mux.video.pTimestamp        = prm->pVidTimestamp;
+    m_Mux.video.nTimestampConsumer = (m_Mux.video.pTimestamp) ? m_Mux.video.pTimestamp->addConsumer() : -1;
 
     if (prm->pVideoInputStream) {
         m_Mux.video.inputStreamTimebase = prm->pVideoInputStream->time_base;
@@ -592,11 +637,10 @@ RGY_ERR RGYOutputAvcodec::InitVideo(const VideoInfo *pVideoOutputInfo, const Avc
 
     m_Mux.video.timestampList.clear();
 
+    std::vector<uint8_t> seiNal;
     if (pVideoOutputInfo->codec == RGY_CODEC_HEVC && prm->pHEVCHdrSei != nullptr) {
-        auto seiNal = prm->pHEVCHdrSei->gen_nal();
+        seiNal = prm->pHEVCHdrSei->gen_nal();
         if (seiNal.size() > 0) {
-            m_Mux.video.seiNal.copy(seiNal.data(), (uint32_t)seiNal.size());
-
             const auto HEVCHdrSeiPrm = prm->pHEVCHdrSei->getprm();
 
             //streamのside dataとしてmasteringdisplay等を設定する
@@ -746,6 +790,18 @@ RGY_ERR RGYOutputAvcodec::InitVideo(const VideoInfo *pVideoOutputInfo, const Avc
         }
         AddMessage(RGY_LOG_DEBUG, _T("initialized %s filter\n"), bsf_name);
     }
+    RGYHeaderCache::SPSFilter spsFilter;
+    if (m_Mux.video.pBsfc) {
+        spsFilter = [this](const uint8_t *sps, size_t size, std::vector<uint8_t>& out) {
+            tstring errMes;
+            auto err = filterSPSWithBsf(m_Mux.video.pBsfc, sps, size, out, errMes);
+            if (err != RGY_ERR_NONE && err != RGY_ERR_MORE_DATA) {
+                AddMessage(RGY_LOG_ERROR, errMes);
+            }
+            return err;
+        };
+    }
+    m_headerCache.init(pVideoOutputInfo->codec == RGY_CODEC_HEVC, seiNal, spsFilter);
 
     if (prm->pMuxVidTsLogFile) {
         if (_tfopen_s(&m_Mux.video.fpTsLogFile, prm->pMuxVidTsLogFile, _T("a"))) {
@@ -1453,7 +1509,22 @@ RGY_ERR RGYOutputAvcodec::Init(const TCHAR *strFileName, const VideoInfo *pVideo
     }
     AddMessage(RGY_LOG_DEBUG, _T("output filename: \"%s\"\n"), strFileName);
     m_Mux.format.pFilename = strFileName;
-    if (NULL == (m_Mux.format.pOutputFmt = av_guess_format((prm->pOutputFormat) ? tchar_to_string(prm->pOutputFormat).c_str() : NULL, filename.c_str(), NULL))) {
+    //出力ファイルの拡張子が.m3u8なら、IDRで区切ったmpegtsのセグメントとプレイリストを出力する
+    //プロトコルを使用する場合は、libavformatのhls muxerに任せる
+    const TCHAR *pOutputFormat = prm->pOutputFormat;
+    if (pVideoOutputInfo && prm->fSegmentSec > 0.0
+        && check_ext(strFileName, { ".m3u8" }) && !usingAVProtocols(filename, 1)
+        && (pOutputFormat == nullptr || 0 == _tcscmp(pOutputFormat, _T("hls")))) {
+        pOutputFormat = _T("mpegts");
+        m_Mux.segment.fTargetSec = prm->fSegmentSec;
+        //EXT-X-TARGETDURATIONはプレイリストの更新で変更できないので、GOP長から求めたセグメントの最大の長さで決めておく
+        m_Mux.segment.nTargetDuration = (int)std::ceil((std::max)(prm->fSegmentSec, prm->fSegmentMaxSec) - 1e-3);
+        m_Mux.segment.sPlaylist = strFileName;
+        m_Mux.segment.sBaseName = PathRemoveExtensionS(tstring(strFileName));
+        m_Mux.segment.nIndex = 0;
+        AddMessage(RGY_LOG_DEBUG, _T("hls output: segment %.2f sec, target duration %d sec.\n"), m_Mux.segment.fTargetSec, m_Mux.segment.nTargetDuration);
+    }
+    if (NULL == (m_Mux.format.pOutputFmt = av_guess_format((pOutputFormat) ? tchar_to_string(pOutputFormat).c_str() : NULL, filename.c_str(), NULL))) {
         AddMessage(RGY_LOG_ERROR,
             _T("failed to assume format from output filename.\n")
             _T("please set proper extension for output file, or specify format using option %s.\n"), (pVideoOutputInfo) ? _T("--format") : _T("--audio-file <format>:<filename>"));
@@ -1532,16 +1603,36 @@ RGY_ERR RGYOutputAvcodec::Init(const TCHAR *strFileName, const VideoInfo *pVideo
         AddMessage(RGY_LOG_DEBUG, _T("allocated internal buffer %d MB.\n"), m_Mux.format.nAVOutBufferSize / (1024 * 1024));
         CreateDirectoryRecursive(PathRemoveFileSpecFixed(strFileName).second.c_str());
 
-        //"movflags:faststart"にするには、共有モードで開けるようにする必要がある
-        m_Mux.format.fpOutput = _tfsopen(strFileName, _T("wb"), _SH_DENYWR);
-        if (m_Mux.format.fpOutput == NULL) {
-            errno_t error = errno;
-            AddMessage(RGY_LOG_ERROR, _T("failed to open %soutput file \"%s\": %s.\n"), (pVideoOutputInfo) ? _T("") : _T("audio "), strFileName, _tcserror(error));
-            return RGY_ERR_FILE_OPEN; // Couldn't open file
+        //出力バッファはI/Oスレッドで書き出すブロックとして使用する
+        //出力スレッドを使用しない場合は、I/Oスレッドも使用せずにそのまま書き込む
+        if (prm->nOutputThread <= 0) {
+            m_Mux.format.nOutputBufferSize = 0;
+        }
+        //ブロックのサイズはlibavformatからの1回の書き込みの大きさにあわせる
+        const size_t blockSize = (std::min)(m_Mux.format.nAVOutBufferSize, (std::max)(m_Mux.format.nOutputBufferSize / 4, 128u * 1024));
+        m_Mux.format.pFileOutput = new RGYWriteBehindFile();
+        if (m_Mux.segment.fTargetSec > 0.0) {
+            //セグメントごとにファイルを開きなおす
+            m_Mux.segment.nBlockSize = blockSize;
+            m_Mux.segment.pQueueUsage = (prm->pQueueInfo) ? &prm->pQueueInfo->usage_io_out : nullptr;
+            auto sts = SegmentOpen();
+            if (sts != RGY_ERR_NONE) {
+                return sts;
+            }
+        } else {
+            const int openErr = m_Mux.format.pFileOutput->open(strFileName, m_Mux.format.nOutputBufferSize, blockSize, prm->nPreallocSize,
+                (prm->pQueueInfo) ? &prm->pQueueInfo->usage_io_out : nullptr);
+            if (openErr) {
+                AddMessage(RGY_LOG_ERROR, _T("failed to open %soutput file \"%s\": %s.\n"), (pVideoOutputInfo) ? _T("") : _T("audio "), strFileName, _tcserror(openErr));
+                return RGY_ERR_FILE_OPEN; // Couldn't open file
+            }
         }
-        if (0 < (m_Mux.format.nOutputBufferSize = (uint32_t)malloc_degeneracy((void **)&m_Mux.format.pOutputBuffer, m_Mux.format.nOutputBufferSize, 1024 * 1024))) {
-            setvbuf(m_Mux.format.fpOutput, m_Mux.format.pOutputBuffer, _IOFBF, m_Mux.format.nOutputBufferSize);
-            AddMessage(RGY_LOG_DEBUG, _T("set external output buffer %d MB.\n"), m_Mux.format.nOutputBufferSize / (1024 * 1024));
+        if (m_Mux.format.nOutputBufferSize > 0) {
+            AddMessage(RGY_LOG_DEBUG, _T("set write-behind output buffer %d MB (block %d KB).\n"), m_Mux.format.nOutputBufferSize / (1024 * 1024), (int)(blockSize / 1024));
+        }
+        if (prm->nPreallocSize > 0 && m_Mux.segment.fTargetSec <= 0.0) {
+            AddMessage(RGY_LOG_DEBUG, _T("%s %.1f MB for output file.\n"),
+                (m_Mux.format.pFileOutput->preallocated()) ? _T("preallocated") : _T("failed to preallocate"), prm->nPreallocSize / (double)(1024 * 1024));
         }
         if (NULL == (m_Mux.format.pFormatCtx->pb = avio_alloc_context(m_Mux.format.pAVOutBuffer, m_Mux.format.nAVOutBufferSize, 1, this, funcReadPacket, funcWritePacket, funcSeek))) {
             AddMessage(RGY_LOG_ERROR, _T("failed to alloc avio context.\n"));
@@ -1551,6 +1642,7 @@ RGY_ERR RGYOutputAvcodec::Init(const TCHAR *strFileName, const VideoInfo *pVideo
 #endif //#if USE_CUSTOM_IO
 
     m_Mux.trim = prm->trimList;
+    m_Mux.trimCutFrames = trim_cut_frames(m_Mux.trim);
 
     if (pVideoOutputInfo) {
         RGY_ERR sts = InitVideo(pVideoOutputInfo, prm);
@@ -1605,6 +1697,33 @@ RGY_ERR RGYOutputAvcodec::Init(const TCHAR *strFileName, const VideoInfo *pVideo
             }
         }
     }
+    for (const auto& passthroughPrm : prm->passthroughStreamList) {
+        AVMuxPassthrough passthrough = { 0 };
+        passthrough.nSrcIndex = passthroughPrm.pStream->index;
+        passthrough.srcTimebase = passthroughPrm.pStream->time_base;
+        passthrough.nPtsOffset = passthroughPrm.nPtsOffset;
+        if (nullptr == (passthrough.pStreamOut = avformat_new_stream(m_Mux.format.pFormatCtx, nullptr))) {
+            AddMessage(RGY_LOG_ERROR, _T("failed to create new stream for passthrough.\n"));
+            return RGY_ERR_NULL_PTR;
+        }
+        if (0 > (err = avcodec_parameters_copy(passthrough.pStreamOut->codecpar, passthroughPrm.pStream->codecpar))) {
+            AddMessage(RGY_LOG_ERROR, _T("failed to copy codec parameters of passthrough stream: %s.\n"), qsv_av_err2str(err).c_str());
+            return RGY_ERR_UNKNOWN;
+        }
+        passthrough.pStreamOut->codecpar->codec_tag = 0;
+        passthrough.pStreamOut->time_base = passthroughPrm.pStream->time_base;
+        passthrough.pStreamOut->disposition = passthroughPrm.pStream->disposition;
+        av_dict_copy(&passthrough.pStreamOut->metadata, passthroughPrm.pStream->metadata, 0);
+        AddMessage(RGY_LOG_DEBUG, _T("Initialized passthrough output - #%d: %s, from stream %d, timebase %d/%d, pts offset %lld.\n"),
+            (int)m_Mux.passthrough.size(), char_to_tstring(avcodec_get_name(passthrough.pStreamOut->codecpar->codec_id)).c_str(),
+            passthrough.nSrcIndex, passthrough.srcTimebase.num, passthrough.srcTimebase.den, (long long int)passthrough.nPtsOffset);
+        m_Mux.passthrough.push_back(passthrough);
+    }
+    {
+        std::lock_guard<std::mutex> lock(m_mtxPassthrough);
+        m_bPassthroughClosed = false;
+        m_bPassthroughError = false;
+    }
 
     SetChapters(prm->chapterList, prm->bChapterNoTrim);
 
@@ -1617,6 +1736,9 @@ RGY_ERR RGYOutputAvcodec::Init(const TCHAR *strFileName, const VideoInfo *pVideo
         for (uint32_t i = 0; i < m_Mux.sub.size(); i++) {
             if (m_Mux.sub[i].pStreamOut) { m_Mux.sub[i].pStreamOut->codec->flags |= AV_CODEC_FLAG_GLOBAL_HEADER; }
         }
+        for (uint32_t i = 0; i < m_Mux.passthrough.size(); i++) {
+            if (m_Mux.passthrough[i].pStreamOut) { m_Mux.passthrough[i].pStreamOut->codec->flags |= AV_CODEC_FLAG_GLOBAL_HEADER; }
+        }
     }
 
     if (m_Mux.format.pFormatCtx->metadata) {
@@ -1659,7 +1781,8 @@ RGY_ERR RGYOutputAvcodec::Init(const TCHAR *strFileName, const VideoInfo *pVideo
         m_Mux.thread.bAbortOutput = false;
         m_Mux.thread.bThAudProcessAbort = false;
         m_Mux.thread.bThAudEncodeAbort = false;
-        m_Mux.thread.qAudioPacketOut.init(8192, 256 * std::max(1, (int)m_Mux.audio.size())); //字幕のみコピーするときのため、最低でもある程度は確保する
+        //字幕のみコピーするときのため、最低でもある程度は確保する
+        m_Mux.thread.qAudioPacketOut.init(8192, (prm->nAudioQueueSize > 0) ? prm->nAudioQueueSize : AUD_PACKET_QUEUE_SIZE_OUT * std::max(1, (int)m_Mux.audio.size()));
         m_Mux.thread.qVideobitstream.init(4096, (std::max)(64, (m_Mux.video.nFPS.den) ? m_Mux.video.nFPS.num * 4 / m_Mux.video.nFPS.den : 0));
         m_Mux.thread.qVideobitstreamFreeI.init(256);
         m_Mux.thread.qVideobitstreamFreePB.init(3840);
@@ -1669,13 +1792,13 @@ RGY_ERR RGYOutputAvcodec::Init(const TCHAR *strFileName, const VideoInfo *pVideo
 #if ENABLE_AVCODEC_AUDPROCESS_THREAD
         if (m_Mux.thread.bEnableAudProcessThread) {
             AddMessage(RGY_LOG_DEBUG, _T("starting audio process thread...\n"));
-            m_Mux.thread.qAudioPacketProcess.init(8192, 512, 4);
+            m_Mux.thread.qAudioPacketProcess.init(8192, (prm->nAudioQueueSize > 0) ? prm->nAudioQueueSize : AUD_PACKET_QUEUE_SIZE_PROC, 4);
             m_Mux.thread.heEventPktAddedAudProcess = CreateEvent(NULL, TRUE, FALSE, NULL);
             m_Mux.thread.heEventClosingAudProcess  = CreateEvent(NULL, TRUE, FALSE, NULL);
             m_Mux.thread.thAudProcess = std::thread(&RGYOutputAvcodec::ThreadFuncAudThread, this);
             if (m_Mux.thread.bEnableAudEncodeThread) {
                 AddMessage(RGY_LOG_DEBUG, _T("starting audio encode thread...\n"));
-                m_Mux.thread.qAudioFrameEncode.init(8192, 512, 4);
+                m_Mux.thread.qAudioFrameEncode.init(8192, (prm->nAudioQueueSize > 0) ? prm->nAudioQueueSize : AUD_PACKET_QUEUE_SIZE_PROC, 4);
                 m_Mux.thread.heEventPktAddedAudEncode = CreateEvent(NULL, TRUE, FALSE, NULL);
                 m_Mux.thread.heEventClosingAudEncode  = CreateEvent(NULL, TRUE, FALSE, NULL);
                 m_Mux.thread.thAudEncode = std::thread(&RGYOutputAvcodec::ThreadFuncAudEncodeThread, this);
@@ -1819,27 +1942,12 @@ RGY_ERR RGYOutputAvcodec::WriteFileHeader(const RGYBitstream *pBitstream) {
 int64_t RGYOutputAvcodec::AdjustTimestampTrimmed(int64_t nTimeIn, AVRational timescaleIn, AVRational timescaleOut, bool lastValidFrame) {
     AVRational timescaleFps = av_inv_q(m_Mux.video.nFPS);
     const int vidFrameIdx = (int)av_rescale_q(nTimeIn, timescaleIn, timescaleFps);
-    int cutFrames = 0;
-    if (m_Mux.trim.size() > 0) {
-        int nLastFinFrame = 0;
-        for (const auto& trim : m_Mux.trim) {
-            if (vidFrameIdx < trim.start) {
-                if (lastValidFrame) {
-                    cutFrames += (vidFrameIdx - nLastFinFrame);
-                    nLastFinFrame = vidFrameIdx;
-                    break;
-                }
-                return AV_NOPTS_VALUE;
-            }
-            cutFrames += trim.start - nLastFinFrame;
-            if (vidFrameIdx <= trim.fin) {
-                nLastFinFrame = vidFrameIdx;
-                break;
-            }
-            nLastFinFrame = trim.fin;
-        }
-        cutFrames += vidFrameIdx - nLastFinFrame;
+    //削除されるフレーム数は、領域ごとに事前に計算した累積値から求める
+    const auto cut = trim_cut_frames_before(vidFrameIdx, m_Mux.trim, m_Mux.trimCutFrames, lastValidFrame);
+    if (!cut.first) {
+        return AV_NOPTS_VALUE;
     }
+    const int cutFrames = cut.second;
     int64_t tsTimeOut = av_rescale_q(nTimeIn,   timescaleIn,  timescaleOut);
     int64_t tsTrim    = av_rescale_q(cutFrames, timescaleFps, timescaleOut);
     return tsTimeOut - tsTrim;
@@ -1956,6 +2064,7 @@ RGY_ERR RGYOutputAvcodec::WriteNextFrame(RGYBitstream *pBitstream) {
             if (RGY_ERR_NONE != copyStream.init(allocate_bytes)) {
                 AddMessage(RGY_LOG_ERROR, _T("Failed to allocate memory for video bitstream output buffer, %sB.\n"), allocate_bytes);
                 m_Mux.format.bStreamError = true;
+                ReleaseVideoTimestamp();
                 return RGY_ERR_MEMORY_ALLOC;
             }
         }
@@ -1977,11 +2086,26 @@ RGY_ERR RGYOutputAvcodec::WriteNextFrame(RGYBitstream *pBitstream) {
         pBitstream->setSize(0);
         pBitstream->setOffset(0);
         SetEvent(m_Mux.thread.heEventPktAddedOutput);
-        return (m_Mux.format.bStreamError) ? RGY_ERR_UNKNOWN : RGY_ERR_NONE;
+        if (m_Mux.format.bStreamError) {
+            ReleaseVideoTimestamp();
+            return RGY_ERR_UNKNOWN;
+        }
+        return RGY_ERR_NONE;
     }
 #endif
     int64_t dts = 0;
-    return WriteNextFrameInternal(pBitstream, &dts);
+    const auto err = WriteNextFrameInternal(pBitstream, &dts);
+    if (err != RGY_ERR_NONE) {
+        ReleaseVideoTimestamp();
+    }
+    return err;
+}
+
+//エラーで以降のフレームを受け取らなくなるので、ほかの出力がdurationを取得できるよう、timestampの登録を解除する
+void RGYOutputAvcodec::ReleaseVideoTimestamp() {
+    if (m_Mux.video.pTimestamp) {
+        m_Mux.video.pTimestamp->removeConsumer(m_Mux.video.nTimestampConsumer);
+    }
 }
 
 #pragma warning (push)
@@ -1996,30 +2120,27 @@ RGY_ERR RGYOutputAvcodec::WriteNextFrameInternal(RGYBitstream *pBitstream, int64
 #else
         m_Mux.video.bDtsUnavailable = true;
 #endif
-        if (m_VideoOutputInfo.codec == RGY_CODEC_HEVC && m_Mux.video.seiNal.size() > 0) {
-            RGYBitstream old = *pBitstream;
-            std::vector<nal_info> nal_list = parse_nal_unit_hevc(pBitstream->data(), pBitstream->size());
-            const auto hevc_vps_nal = std::find_if(nal_list.begin(), nal_list.end(), [](nal_info info) { return info.type == NALU_HEVC_VPS; });
-            const auto hevc_sps_nal = std::find_if(nal_list.begin(), nal_list.end(), [](nal_info info) { return info.type == NALU_HEVC_SPS; });
-            const auto hevc_pps_nal = std::find_if(nal_list.begin(), nal_list.end(), [](nal_info info) { return info.type == NALU_HEVC_PPS; });
-            const bool header_check = (nal_list.end() != hevc_vps_nal) && (nal_list.end() != hevc_sps_nal) && (nal_list.end() != hevc_pps_nal);
-            if (header_check) {
-                pBitstream->setSize(0);
-                pBitstream->setOffset(0);
-                pBitstream->append(hevc_vps_nal->ptr, hevc_vps_nal->size);
-                pBitstream->append(hevc_sps_nal->ptr, hevc_sps_nal->size);
-                pBitstream->append(hevc_pps_nal->ptr, hevc_pps_nal->size);
-                pBitstream->append(&m_Mux.video.seiNal);
-                for (const auto& nal : nal_list) {
-                    if (nal.type != NALU_HEVC_VPS && nal.type != NALU_HEVC_SPS && nal.type != NALU_HEVC_PPS) {
-                        pBitstream->append(nal.ptr, nal.size);
-                    }
-                }
-            } else {
-                AddMessage(RGY_LOG_ERROR, _T("Unexpected HEVC header.\n"));
-                return RGY_ERR_UNDEFINED_BEHAVIOR;
-            }
-            m_Mux.video.seiNal.clear();
+    }
+    //SPSの書き換え・SEIの挿入はキャッシュ済みのヘッダーを使って行い、書き出すデータの区間のリストを得る
+    auto err = m_headerCache.process(pBitstream->data(), pBitstream->size(), m_headerSpans);
+    if (err != RGY_ERR_NONE) {
+        if (err == RGY_ERR_UNDEFINED_BEHAVIOR) {
+            AddMessage(RGY_LOG_ERROR, _T("Unexpected %s header.\n"), CodecToStr(m_VideoOutputInfo.codec).c_str());
+        }
+        return err;
+    }
+    if (!m_Mux.format.bFileHeaderWritten) {
+        if (m_headerSpans.size() != 1 || m_headerSpans[0].ptr != pBitstream->data()) {
+            //ファイルヘッダー(extradata)にも書き換え後のヘッダーが反映されるよう、最初のフレームは組み立てなおす
+            m_headerBuf.clear();
+            for (const auto& span : m_headerSpans) {
+                m_headerBuf.insert(m_headerBuf.end(), span.ptr, span.ptr + span.size);
+            }
+            pBitstream->setSize(0);
+            pBitstream->setOffset(0);
+            pBitstream->append(m_headerBuf.data(), m_headerBuf.size());
+            m_headerSpans.clear();
+            m_headerSpans.push_back({ pBitstream->data(), pBitstream->size() });
         }
         RGY_ERR sts = WriteFileHeader(pBitstream);
         if (sts != RGY_ERR_NONE) {
@@ -2045,58 +2166,13 @@ RGY_ERR RGYOutputAvcodec::WriteNextFrameInternal(RGYBitstream *pBitstream, int64
     //QSVエンコーダでは、bitstreamからdurationの情報が取得できないので、別途取得する
     int64_t bs_duration = 0;
     if (m_Mux.video.pTimestamp) {
-        while ((bs_duration = m_Mux.video.pTimestamp->get_and_pop(pBitstream->pts())) < 0) {
+        while ((bs_duration = m_Mux.video.pTimestamp->get_and_pop(pBitstream->pts(), m_Mux.video.nTimestampConsumer)) < 0) {
             std::this_thread::sleep_for(std::chrono::milliseconds(1));
         }
     }
 #endif
 
     std::vector<nal_info> nal_list;
-    if (m_Mux.video.pBsfc) {
-        int target_nal = 0;
-        if (m_VideoOutputInfo.codec == RGY_CODEC_HEVC) {
-            target_nal = NALU_HEVC_SPS;
-            nal_list = parse_nal_unit_hevc(pBitstream->data(), pBitstream->size());
-        } else if (m_VideoOutputInfo.codec == RGY_CODEC_H264) {
-            target_nal = NALU_H264_SPS;
-            nal_list = parse_nal_unit_h264(pBitstream->data(), pBitstream->size());
-        }
-        auto sps_nal = std::find_if(nal_list.begin(), nal_list.end(), [target_nal](nal_info info) { return info.type == target_nal; });
-        if (sps_nal != nal_list.end()) {
-            AVPacket pkt = { 0 };
-            av_init_packet(&pkt);
-            av_new_packet(&pkt, (int)sps_nal->size);
-            memcpy(pkt.data, sps_nal->ptr, sps_nal->size);
-            int ret = 0;
-            if (0 > (ret = av_bsf_send_packet(m_Mux.video.pBsfc, &pkt))) {
-                av_packet_unref(&pkt);
-                AddMessage(RGY_LOG_ERROR, _T("failed to send packet to %s bitstream filter: %s.\n"),
-                    char_to_tstring(m_Mux.video.pBsfc->filter->name).c_str(), qsv_av_err2str(ret).c_str());
-                return RGY_ERR_UNKNOWN;
-            }
-            ret = av_bsf_receive_packet(m_Mux.video.pBsfc, &pkt);
-            if (ret == AVERROR(EAGAIN)) {
-                return RGY_ERR_NONE;
-            } else if ((ret < 0 && ret != AVERROR_EOF) || pkt.size < 0) {
-                AddMessage(RGY_LOG_ERROR, _T("failed to run %s bitstream filter: %s.\n"),
-                    char_to_tstring(m_Mux.video.pBsfc->filter->name).c_str(), qsv_av_err2str(ret).c_str());
-                return RGY_ERR_UNKNOWN;
-            }
-            const auto new_data_size = pBitstream->size() + pkt.size - sps_nal->size;
-            const auto sps_nal_offset = sps_nal->ptr - pBitstream->data();
-            const auto next_nal_orig_offset = sps_nal_offset + sps_nal->size;
-            const auto next_nal_new_offset = sps_nal_offset + pkt.size;
-            const auto stream_orig_length = pBitstream->size();
-            if ((decltype(new_data_size))pBitstream->bufsize() < new_data_size) {
-                pBitstream->changeSize(new_data_size);
-            } else if (pkt.size > (decltype(pkt.size))sps_nal->size) {
-                pBitstream->trim();
-            }
-            memmove(pBitstream->data() + next_nal_new_offset, pBitstream->data() + next_nal_orig_offset, stream_orig_length - next_nal_orig_offset);
-            memcpy(pBitstream->data() + sps_nal_offset, pkt.data, pkt.size);
-            av_packet_unref(&pkt);
-        }
-    }
 
     //IDRかどうかのフラグ
     bool isIDR = (pBitstream->frametype() & (RGY_FRAMETYPE_IDR | RGY_FRAMETYPE_I)) != 0;
@@ -2114,11 +2190,17 @@ RGY_ERR RGYOutputAvcodec::WriteNextFrameInternal(RGYBitstream *pBitstream, int64
         }
     }
 
+    //キャッシュ済みのヘッダーとフレームのデータを区間ごとにパケットへコピーする
+    const auto pktSize = RGYHeaderCache::spansSize(m_headerSpans);
     AVPacket pkt = { 0 };
     av_init_packet(&pkt);
-    av_new_packet(&pkt, (int)pBitstream->size());
-    memcpy(pkt.data, pBitstream->data(), pBitstream->size());
-    pkt.size = (int)pBitstream->size();
+    av_new_packet(&pkt, (int)pktSize);
+    auto pktPtr = pkt.data;
+    for (const auto& span : m_headerSpans) {
+        memcpy(pktPtr, span.ptr, span.size);
+        pktPtr += span.size;
+    }
+    pkt.size = (int)pktSize;
 
     const AVRational fpsTimebase = av_inv_q(m_Mux.video.nFPS);
     const AVRational streamTimebase = m_Mux.video.pStreamOut->codec->pkt_timebase;
@@ -2142,6 +2224,26 @@ RGY_ERR RGYOutputAvcodec::WriteNextFrameInternal(RGYBitstream *pBitstream, int64
         pkt.dts = m_Mux.video.timestampList.get_min_pts();
     }
     const auto pts = pkt.pts, dts = pkt.dts, duration = pkt.duration;
+    if (m_Mux.segment.fTargetSec > 0.0) {
+        //セグメントはIDRでのみ区切る (Iフレームはopen GOPの場合があるので使用しない)
+        const bool isSegmentIDR = (m_Mux.video.pStreamOut->codecpar->field_order != AV_FIELD_PROGRESSIVE)
+            ? isIDR : (pBitstream->frametype() & RGY_FRAMETYPE_IDR) != 0;
+        const double ptsSec = pts * av_q2d(streamTimebase);
+        //GOP長を--hls-timeに合わせた場合に丸め誤差で1GOP遅れて区切らないよう、半フレーム分の余裕をとる
+        const double fMarginSec = (m_Mux.video.nFPS.num > 0) ? 0.5 * av_q2d(av_inv_q(m_Mux.video.nFPS)) : 0.0;
+        if (!m_Mux.format.bFileHeaderWritten) {
+            m_Mux.segment.fStartSec = ptsSec;
+            m_Mux.segment.fEndSec = ptsSec;
+        } else if (isSegmentIDR && ptsSec - m_Mux.segment.fStartSec >= m_Mux.segment.fTargetSec - fMarginSec) {
+            auto sts = SegmentNext(ptsSec);
+            if (sts != RGY_ERR_NONE) {
+                av_packet_unref(&pkt);
+                m_Mux.format.bStreamError = true;
+                return sts;
+            }
+        }
+        m_Mux.segment.fEndSec = (std::max)(m_Mux.segment.fEndSec, (pts + duration) * av_q2d(streamTimebase));
+    }
     *pWrittenDts = av_rescale_q(pkt.dts, streamTimebase, QUEUE_DTS_TIMEBASE);
     m_Mux.format.bStreamError |= 0 != av_interleaved_write_frame(m_Mux.format.pFormatCtx, &pkt);
 
@@ -2175,6 +2277,9 @@ RGY_ERR RGYOutputAvcodec::WriteNextFrameInternal(RGYBitstream *pBitstream, int64
     }
 #endif
     m_Mux.format.bFileHeaderWritten = true;
+    if (m_Mux.passthrough.size() > 0) {
+        WritePassthroughPackets();
+    }
     return (m_Mux.format.bStreamError) ? RGY_ERR_UNKNOWN : RGY_ERR_NONE;
 }
 #pragma warning (pop)
@@ -2196,6 +2301,73 @@ vector<int> RGYOutputAvcodec::GetStreamTrackIdList() {
     return std::move(streamTrackId);
 }
 
+vector<const AVStream *> RGYOutputAvcodec::GetAudioOutputStreams() {
+    vector<const AVStream *> streams;
+    for (const auto& audio : m_Mux.audio) {
+        streams.push_back(audio.pStreamOut);
+    }
+    return streams;
+}
+
+void RGYOutputAvcodec::SetPacketTee(std::function<void(const AVPacket *, AVRational)> tee) {
+    m_pktTee = tee;
+}
+
+//他の出力のスレッドから呼ばれるので、ここではキューに格納するだけにする
+void RGYOutputAvcodec::WritePassthroughPacket(const AVPacket *pkt, AVRational timebase) {
+    AVPacket pktCopy;
+    av_init_packet(&pktCopy);
+    if (0 > av_packet_ref(&pktCopy, pkt)) {
+        AddMessage(RGY_LOG_ERROR, _T("failed to copy passthrough packet.\n"));
+        //bStreamErrorはmuxのスレッドのみで扱うので、ここではフラグを立てるだけにする
+        std::lock_guard<std::mutex> lock(m_mtxPassthrough);
+        m_bPassthroughError = true;
+        return;
+    }
+    std::lock_guard<std::mutex> lock(m_mtxPassthrough);
+    if (m_bPassthroughClosed) {
+        av_packet_unref(&pktCopy);
+        return;
+    }
+    m_passthroughPkts.push_back(std::make_pair(pktCopy, timebase));
+}
+
+void RGYOutputAvcodec::WritePassthroughPackets() {
+    std::deque<std::pair<AVPacket, AVRational>> pkts;
+    {
+        std::lock_guard<std::mutex> lock(m_mtxPassthrough);
+        pkts.swap(m_passthroughPkts);
+        m_Mux.format.bStreamError |= m_bPassthroughError;
+    }
+    for (auto& pktTimebase : pkts) {
+        auto& pkt = pktTimebase.first;
+        const AVRational timebaseIn = pktTimebase.second;
+        auto pPassthrough = std::find_if(m_Mux.passthrough.begin(), m_Mux.passthrough.end(),
+            [&pkt](const AVMuxPassthrough& passthrough) { return passthrough.nSrcIndex == pkt.stream_index; });
+        if (pPassthrough == m_Mux.passthrough.end() || m_Mux.format.bStreamError) {
+            av_packet_unref(&pkt);
+            continue;
+        }
+        //映像の先頭にあわせてタイムスタンプをずらし、出力ストリームのtimebaseに変換する
+        const AVRational timebaseOut = pPassthrough->pStreamOut->time_base;
+        const int64_t ptsOffset = av_rescale_q(pPassthrough->nPtsOffset, pPassthrough->srcTimebase, timebaseOut);
+        if (pkt.pts != AV_NOPTS_VALUE) {
+            pkt.pts = av_rescale_q(pkt.pts, timebaseIn, timebaseOut) - ptsOffset;
+        }
+        if (pkt.dts != AV_NOPTS_VALUE) {
+            pkt.dts = av_rescale_q(pkt.dts, timebaseIn, timebaseOut) - ptsOffset;
+        }
+        pkt.duration = (int)av_rescale_q(pkt.duration, timebaseIn, timebaseOut);
+        //映像の先頭より前のパケットは書き出さない
+        if (pkt.pts != AV_NOPTS_VALUE && pkt.pts < 0) {
+            av_packet_unref(&pkt);
+            continue;
+        }
+        pkt.stream_index = pPassthrough->pStreamOut->index;
+        m_Mux.format.bStreamError |= 0 != av_interleaved_write_frame(m_Mux.format.pFormatCtx, &pkt);
+    }
+}
+
 AVMuxAudio *RGYOutputAvcodec::getAudioPacketStreamData(const AVPacket *pkt) {
     const int streamIndex = pkt->stream_index;
     //privには、trackIdへのポインタが格納してある…はず
@@ -2339,6 +2511,9 @@ void RGYOutputAvcodec::WriteNextPacketProcessed(AVMuxAudio *pMuxAudio, AVPacket
         }
         pMuxAudio->nLastPtsOut = pkt->pts;
         *pWrittenDts = av_rescale_q(pkt->dts, pMuxAudio->pStreamOut->time_base, QUEUE_DTS_TIMEBASE);
+        if (m_pktTee) {
+            m_pktTee(pkt, pMuxAudio->pStreamOut->time_base);
+        }
         m_Mux.format.bStreamError |= 0 != av_interleaved_write_frame(m_Mux.format.pFormatCtx, pkt);
         pMuxAudio->nOutputSamples += samples;
     } else {
@@ -2967,6 +3142,7 @@ RGY_ERR RGYOutputAvcodec::WriteNextAudioFrame(AVPktMuxData *pktData) {
 
 RGY_ERR RGYOutputAvcodec::ThreadFuncAudEncodeThread() {
 #if ENABLE_AVCODEC_AUDPROCESS_THREAD
+    RGYThreadAffinity::get().apply(RGY_THREAD_ROLE_AUDENC);
     WaitForSingleObject(m_Mux.thread.heEventPktAddedAudEncode, INFINITE);
     while (!m_Mux.thread.bThAudEncodeAbort) {
         if (!m_Mux.format.bFileHeaderWritten) {
@@ -2994,6 +3170,7 @@ RGY_ERR RGYOutputAvcodec::ThreadFuncAudEncodeThread() {
 
 RGY_ERR RGYOutputAvcodec::ThreadFuncAudThread() {
 #if ENABLE_AVCODEC_AUDPROCESS_THREAD
+    RGYThreadAffinity::get().apply(RGY_THREAD_ROLE_AUDPROC);
     WaitForSingleObject(m_Mux.thread.heEventPktAddedAudProcess, INFINITE);
     while (!m_Mux.thread.bThAudProcessAbort) {
         if (!m_Mux.format.bFileHeaderWritten) {
@@ -3020,22 +3197,39 @@ RGY_ERR RGYOutputAvcodec::ThreadFuncAudThread() {
     return (m_Mux.format.bStreamError) ? RGY_ERR_UNKNOWN : RGY_ERR_NONE;
 }
 
+int64_t RGYOutputAvcodec::muxQueueDts(const AVPktMuxData *pktData, bool bProcessed) {
+    const AVPacket *pkt = &pktData->pkt;
+    const int64_t ts = (pkt->dts != AV_NOPTS_VALUE) ? pkt->dts : pkt->pts;
+    if (ts == AV_NOPTS_VALUE) {
+        return RGYMuxInterleaver<AVMuxInterleaveData>::DTS_UNKNOWN;
+    }
+    const AVRational vid_pkt_timebase = av_isvalid_q(m_Mux.video.inputStreamTimebase) ? m_Mux.video.inputStreamTimebase : av_inv_q(m_Mux.video.nFPS);
+    if (((int16_t)(pkt->flags >> 16)) < 0) {
+        //字幕 (SubtitleWritePacketと同様に入力映像の最初のptsを差し引く)
+        const AVMuxSub *pMuxSub = getSubPacketStreamData(pkt);
+        if (pMuxSub == nullptr) {
+            return RGYMuxInterleaver<AVMuxInterleaveData>::DTS_UNKNOWN;
+        }
+        const int64_t pts_offset = av_rescale_q(m_Mux.video.nInputFirstKeyPts, vid_pkt_timebase, pMuxSub->streamInTimebase);
+        return av_rescale_q(std::max<int64_t>(0, ts - pts_offset), pMuxSub->streamInTimebase, QUEUE_DTS_TIMEBASE);
+    }
+    const AVMuxAudio *pMuxAudio = pktData->pMuxAudio;
+    if (pMuxAudio == nullptr) {
+        return RGYMuxInterleaver<AVMuxInterleaveData>::DTS_UNKNOWN;
+    }
+    //音声 (WriteNextPacketProcessedと同様に入力映像の最初のptsを差し引く)
+    //エンコード済みのパケットはエンコーダのtimebase、それ以外は入力streamのtimebaseとなっている
+    const AVRational timebase = (bProcessed && pMuxAudio->pOutCodecEncodeCtx) ? pMuxAudio->pOutCodecEncodeCtx->time_base : pMuxAudio->pStreamIn->time_base;
+    int64_t dts = av_rescale_q(ts, timebase, QUEUE_DTS_TIMEBASE);
+    if (m_Mux.video.pStreamOut) {
+        dts -= av_rescale_q(m_Mux.video.nInputFirstKeyPts, m_Mux.video.inputStreamTimebase, QUEUE_DTS_TIMEBASE);
+    }
+    return dts;
+}
+
 RGY_ERR RGYOutputAvcodec::WriteThreadFunc() {
 #if ENABLE_AVCODEC_OUT_THREAD
-    //映像と音声の同期をとる際に、それをあきらめるまでの閾値
-    const int nWaitThreshold = 32;
-    const size_t videoPacketThreshold = std::min<size_t>(3072, m_Mux.thread.qVideobitstream.capacity()) - nWaitThreshold;
-    const size_t audioPacketThreshold = std::min<size_t>(6144, m_Mux.thread.qAudioPacketOut.capacity()) - nWaitThreshold;
-    //キューにデータが存在するか
-    bool bAudioExists = false;
-    bool bVideoExists = false;
-    const auto fpsTimebase = av_inv_q(m_Mux.video.nFPS);
-    const auto dtsThreshold = std::max(av_rescale_q(4, fpsTimebase, QUEUE_DTS_TIMEBASE), 4ll);
-    //syncIgnoreDtsは映像と音声の同期を行う必要がないことを意味する
-    //dtsThresholdを加算したときにオーバーフローしないよう、dtsThresholdを引いておく
-    const int64_t syncIgnoreDts = INT64_MAX - dtsThreshold;
-    int64_t audioDts = (m_Mux.audio.size()) ? 0 : syncIgnoreDts;
-    int64_t videoDts = (m_Mux.video.pStreamOut) ? 0 : syncIgnoreDts;
+    RGYThreadAffinity::get().apply(RGY_THREAD_ROLE_OUTPUT);
     WaitForSingleObject(m_Mux.thread.heEventPktAddedOutput, INFINITE);
     //bThAudProcessは出力開始した後で取得する(この前だとまだ起動していないことがある)
     const bool bThAudProcess = m_Mux.thread.thAudProcess.joinable();
@@ -3049,130 +3243,125 @@ RGY_ERR RGYOutputAvcodec::WriteThreadFunc() {
         }
         return sts;
     };
-    int audPacketsPerSec = 64;
-    int nWaitAudio = 0;
-    int nWaitVideo = 0;
-    while (!m_Mux.thread.bAbortOutput) {
-        do {
-            if (!m_Mux.format.bFileHeaderWritten) {
-                std::this_thread::sleep_for(std::chrono::milliseconds(1));
-                //ヘッダー取得前に音声キューのサイズが足りず、エンコードが進まなくなってしまうことがある
-                //キューのcapcityを増やすことでこれを回避する
-                auto type = (m_Mux.thread.thAudEncode.joinable()) ? AUD_QUEUE_ENCODE : AUD_QUEUE_OUT;
-                auto& qAudio = (type == AUD_QUEUE_OUT) ? m_Mux.thread.qAudioPacketOut : m_Mux.thread.qAudioFrameEncode;
-                const auto nQueueCapacity = qAudio.capacity();
-                if (qAudio.size() >= nQueueCapacity) {
-                    qAudio.set_capacity(nQueueCapacity * 3 / 2);
-                }
-                //動画キューになにもなかったら再度待機する
-                if (m_Mux.thread.qVideobitstream.size() == 0) {
+    auto writePacket = [&](AVPktMuxData *pktData) {
+        //音声処理スレッドが別にあるなら、出力スレッドがすべきことは単に出力するだけ
+        //インターリーバからはdts順に取り出されるので、ヘッダ出力前にキャッシュしたパケットもすべて書き出してよい
+        (bThAudProcess) ? writeProcessedPacket(pktData) : WriteNextPacketInternal(pktData, INT64_MAX);
+    };
+
+    //映像・各音声トラック・各字幕トラックをそれぞれストリームとして登録し、dtsの小さい順に出力する
+    //パケットの来ないストリームを待つのは、いずれかのストリームに4秒分(あるいは一定のパケット数)たまるまでとする
+    //(音声が途中までしかなかったり、途中からしかなかったりする場合にこうした処理が必要)
+    RGYMuxInterleaver<AVMuxInterleaveData> interleaver;
+    interleaver.init(av_rescale_q(4, av_make_q(1, 1), QUEUE_DTS_TIMEBASE), 8192);
+    const int streamIdVideo = (m_Mux.video.pStreamOut) ? interleaver.addStream(false) : -1;
+    vector<int> streamIdAudio(m_Mux.audio.size(), -1);
+    for (size_t i = 0; i < m_Mux.audio.size(); i++) {
+        if (!bThAudProcess) {
+            //音声処理スレッドがない場合は、サブストリームに分配される前のパケットが
+            //getAudioPacketStreamDataで最初に見つかるトラックのものとして送られてくる
+            for (size_t j = 0; j < i; j++) {
+                if (m_Mux.audio[j].nStreamIndexIn == m_Mux.audio[i].nStreamIndexIn
+                    && m_Mux.audio[j].nInTrackId == m_Mux.audio[i].nInTrackId) {
+                    streamIdAudio[i] = streamIdAudio[j];
                     break;
                 }
             }
-            //映像・音声の同期待ちが必要な場合、falseとなってループから抜けるよう、ここでfalseに設定する
-            bAudioExists = false;
-            bVideoExists = false;
-            RGYBitstream bitstream = RGYBitstreamInit();
-            while ((audioDts < 0 || videoDts <= audioDts + dtsThreshold)
-                && false != (bVideoExists = m_Mux.thread.qVideobitstream.front_copy_and_pop_no_lock(&bitstream, (m_Mux.thread.pQueueInfo) ? &m_Mux.thread.pQueueInfo->usage_vid_out : nullptr))) {
-                WriteNextFrameInternal(&bitstream, &videoDts);
-                nWaitVideo = 0;
-                //AddMessage(RGY_LOG_TRACE, _T("videoDts=%8lld.\n"), videoDts);
-            }
-            AVPktMuxData pktData = { 0 };
-            while ((videoDts < 0 || audioDts <= videoDts + dtsThreshold)
-                && false != (bAudioExists = m_Mux.thread.qAudioPacketOut.front_copy_and_pop_no_lock(&pktData, (m_Mux.thread.pQueueInfo) ? &m_Mux.thread.pQueueInfo->usage_aud_out : nullptr))) {
-                if (pktData.pMuxAudio && pktData.pMuxAudio->pStreamIn) {
-                    audPacketsPerSec = std::max(audPacketsPerSec, (int)(1.0 / (av_q2d(pktData.pMuxAudio->pStreamIn->time_base) * pktData.pkt.duration) + 0.5));
-                    if ((int)m_Mux.thread.qAudioPacketOut.capacity() < audPacketsPerSec * 4) {
-                        m_Mux.thread.qAudioPacketOut.set_capacity(audPacketsPerSec * 4);
-                    }
-                }
-                const int64_t maxDts = (videoDts >= 0) ? videoDts + dtsThreshold : syncIgnoreDts;
-                //音声処理スレッドが別にあるなら、出力スレッドがすべきことは単に出力するだけ
-                (bThAudProcess) ? writeProcessedPacket(&pktData) : WriteNextPacketInternal(&pktData, maxDts);
-                //複数のstreamがあり得るので最大値をとる
-                audioDts = (std::max)(audioDts, pktData.dts);
-                nWaitAudio = 0;
-                //AddMessage(RGY_LOG_TRACE, _T("audioDts=%8lld, maxDst=%8lld.\n"), audioDts, maxDts);
-            }
-            //一定以上の動画フレームがキューにたまっており、音声キューになにもなければ、
-            //音声を無視して動画フレームの処理を開始させる
-            //音声が途中までしかなかったり、途中からしかなかったりする場合にこうした処理が必要
-            if (m_Mux.thread.qAudioPacketOut.size() == 0 && m_Mux.thread.qVideobitstream.size() > videoPacketThreshold) {
-                nWaitAudio++;
-                if (nWaitAudio <= nWaitThreshold) {
-                    //時折まだパケットが来ているのにタイミングによってsize() == 0が成立することがある
-                    //なのである程度連続でパケットが来ていないときのみ無視するようにする
-                    //このようにすることで適切に同期がとれる
-                    break;
-                }
-                audioDts = videoDts;
-                //AddMessage(RGY_LOG_TRACE, _T("audio not coming.\n"));
-            }
-            //一定以上の音声フレームがキューにたまっており、動画キューになにもなければ、
-            //動画を無視して音声フレームの処理を開始させる
-            if (m_Mux.thread.qVideobitstream.size() == 0 && m_Mux.thread.qAudioPacketOut.size() > audioPacketThreshold) {
-                nWaitVideo++;
-                if (nWaitVideo <= nWaitThreshold) {
-                    //時折まだパケットが来ているのにタイミングによってsize() == 0が成立することがある
-                    //なのである程度連続でパケットが来ていないときのみ無視するようにする
-                    //このようにすることで適切に同期がとれる
-                    break;
-                }
-                videoDts = audioDts;
-                //AddMessage(RGY_LOG_TRACE, _T("video not coming.\n"));
-            }
-        } while (bAudioExists || bVideoExists); //両方のキューがひとまず空になるか、映像・音声の同期待ちが必要になるまで回す
-                                                //次のフレーム・パケットが送られてくるまで待機する
-        //キューの容量が両方とも半分以下なら、すこし待ってみる
-        //一方、どちらかのキューが半分以上使われていれば、なるべく早く処理する必要がある
-        if (   m_Mux.thread.qVideobitstream.size() / (double)m_Mux.thread.qVideobitstream.capacity() < 0.5
-            && m_Mux.thread.qAudioPacketOut.size() / (double)m_Mux.thread.qAudioPacketOut.capacity() < 0.5) {
-            ResetEvent(m_Mux.thread.heEventPktAddedOutput);
-            WaitForSingleObject(m_Mux.thread.heEventPktAddedOutput, 16);
-        } else {
-            std::this_thread::yield();
         }
-    }
-    //メインループを抜けたことを通知する
-    SetEvent(m_Mux.thread.heEventClosingOutput);
-    m_Mux.thread.qAudioPacketOut.set_keep_length(0);
-    m_Mux.thread.qVideobitstream.set_keep_length(0);
-    bAudioExists = !m_Mux.thread.qAudioPacketOut.empty();
-    bVideoExists = !m_Mux.thread.qVideobitstream.empty();
-    //まずは映像と音声の同期をとって出力するためのループ
-    while (bAudioExists && bVideoExists) {
-        AVPktMuxData pktData = { 0 };
-        while (audioDts <= videoDts + dtsThreshold
-            && false != (bAudioExists = m_Mux.thread.qAudioPacketOut.front_copy_and_pop_no_lock(&pktData, (m_Mux.thread.pQueueInfo) ? &m_Mux.thread.pQueueInfo->usage_aud_out : nullptr))) {
-            //音声処理スレッドが別にあるなら、出力スレッドがすべきことは単に出力するだけ
-            const int64_t maxDts = (videoDts >= 0) ? videoDts + dtsThreshold : INT64_MAX;
-            (bThAudProcess) ? writeProcessedPacket(&pktData) : WriteNextPacketInternal(&pktData, maxDts);
-            //複数のstreamがあり得るので最大値をとる
-            audioDts = (std::max)(audioDts, pktData.dts);
+        if (streamIdAudio[i] < 0) {
+            streamIdAudio[i] = interleaver.addStream(false);
         }
+    }
+    vector<int> streamIdSub(m_Mux.sub.size(), -1);
+    for (size_t i = 0; i < m_Mux.sub.size(); i++) {
+        //字幕はパケットが来るとは限らないので、待機の対象としない
+        streamIdSub[i] = interleaver.addStream(true);
+    }
+    //音声のflush用 (pkt.data == nullptrなパケット)
+    const int streamIdFlush = interleaver.addStream(true);
+    int64_t audioLastDts = 0;
+
+    AVMuxInterleaveData muxData;
+    memset(&muxData, 0, sizeof(muxData));
+    int64_t videoDts = 0;
+    //キューからインターリーバにパケットを移す
+    auto moveQueueToInterleaver = [&]() {
         RGYBitstream bitstream = RGYBitstreamInit();
-        while (videoDts <= audioDts + dtsThreshold
-            && false != (bVideoExists = m_Mux.thread.qVideobitstream.front_copy_and_pop_no_lock(&bitstream, (m_Mux.thread.pQueueInfo) ? &m_Mux.thread.pQueueInfo->usage_vid_out : nullptr))) {
-            WriteNextFrameInternal(&bitstream, &videoDts);
+        while (m_Mux.thread.qVideobitstream.front_copy_and_pop_no_lock(&bitstream, (m_Mux.thread.pQueueInfo) ? &m_Mux.thread.pQueueInfo->usage_vid_out : nullptr)) {
+            muxData.bitstream = bitstream;
+            //Bフレームがあるとptsは単調増加しないので、dtsで並べる (dtsが得られない場合のみptsを使用する)
+            int64_t ts = bitstream.dts();
+#if ENCODER_QSV
+            if (ts == (int64_t)MFX_TIMESTAMP_UNKNOWN) {
+                ts = AV_NOPTS_VALUE;
+            }
+#endif
+            if (ts == AV_NOPTS_VALUE) {
+                ts = bitstream.pts();
+            }
+            const int64_t dts = (ts == AV_NOPTS_VALUE) ? RGYMuxInterleaver<AVMuxInterleaveData>::DTS_UNKNOWN : av_rescale_q(ts, m_Mux.video.rBitstreamTimebase, QUEUE_DTS_TIMEBASE);
+            interleaver.push(streamIdVideo, dts, muxData);
         }
-        bAudioExists = !m_Mux.thread.qAudioPacketOut.empty();
-        bVideoExists = !m_Mux.thread.qVideobitstream.empty();
-    }
-    { //音声を書き出す
         AVPktMuxData pktData = { 0 };
         while (m_Mux.thread.qAudioPacketOut.front_copy_and_pop_no_lock(&pktData, (m_Mux.thread.pQueueInfo) ? &m_Mux.thread.pQueueInfo->usage_aud_out : nullptr)) {
-            //音声処理スレッドが別にあるなら、出力スレッドがすべきことは単に出力するだけ
-            (bThAudProcess) ? writeProcessedPacket(&pktData) : WriteNextPacketInternal(&pktData, INT64_MAX);
+            muxData.pktData = pktData;
+            if (pktData.pkt.data == nullptr) {
+                //flushのパケットはすべての音声パケットのあとに出力し、以降は音声パケットを待たない
+                interleaver.push(streamIdFlush, audioLastDts, muxData);
+                for (auto id : streamIdAudio) {
+                    interleaver.finish(id);
+                }
+                continue;
+            }
+            int streamId = -1;
+            const bool bSubtitle = ((int16_t)(pktData.pkt.flags >> 16)) < 0;
+            if (bSubtitle) {
+                const AVMuxSub *pMuxSub = getSubPacketStreamData(&pktData.pkt);
+                if (pMuxSub) {
+                    streamId = streamIdSub[pMuxSub - m_Mux.sub.data()];
+                }
+            } else if (pktData.pMuxAudio) {
+                streamId = streamIdAudio[pktData.pMuxAudio - m_Mux.audio.data()];
+            }
+            if (streamId < 0) {
+                //対応するストリームがない場合はそのまま出力し、エラー処理に任せる
+                writePacket(&pktData);
+                continue;
+            }
+            const int64_t dts = muxQueueDts(&pktData, bThAudProcess);
+            if (!bSubtitle && dts != RGYMuxInterleaver<AVMuxInterleaveData>::DTS_UNKNOWN) {
+                audioLastDts = std::max(audioLastDts, dts);
+            }
+            interleaver.push(streamId, dts, muxData);
         }
-    }
-    { //動画を書き出す
-        RGYBitstream bitstream = RGYBitstreamInit();
-        while (m_Mux.thread.qVideobitstream.front_copy_and_pop_no_lock(&bitstream, (m_Mux.thread.pQueueInfo) ? &m_Mux.thread.pQueueInfo->usage_vid_out : nullptr)) {
-            WriteNextFrameInternal(&bitstream, &videoDts);
+    };
+    //インターリーバから出力可能なパケットをすべて書き出す
+    auto writeInterleaved = [&]() {
+        int streamId = -1;
+        while (interleaver.pop(&muxData, &streamId)) {
+            if (streamId == streamIdVideo) {
+                WriteNextFrameInternal(&muxData.bitstream, &videoDts);
+            } else {
+                writePacket(&muxData.pktData);
+            }
         }
+    };
+    while (!m_Mux.thread.bAbortOutput) {
+        //ResetEventはキューから取り出す前に行い、取り出した後に追加されたパケットで確実に起きられるようにする
+        ResetEvent(m_Mux.thread.heEventPktAddedOutput);
+        moveQueueToInterleaver();
+        writeInterleaved();
+        //次のフレーム・パケットが送られてくるまで待機する
+        WaitForSingleObject(m_Mux.thread.heEventPktAddedOutput, INFINITE);
     }
+    //メインループを抜けたことを通知する
+    SetEvent(m_Mux.thread.heEventClosingOutput);
+    m_Mux.thread.qAudioPacketOut.set_keep_length(0);
+    m_Mux.thread.qVideobitstream.set_keep_length(0);
+    //残りをすべてdts順に書き出す
+    moveQueueToInterleaver();
+    interleaver.finishAll();
+    writeInterleaved();
 #endif
     return (m_Mux.format.bStreamError) ? RGY_ERR_UNKNOWN : RGY_ERR_NONE;
 }
@@ -3207,14 +3396,100 @@ HANDLE RGYOutputAvcodec::getThreadHandleAudEncode() {
 
 #if USE_CUSTOM_IO
 int RGYOutputAvcodec::readPacket(uint8_t *buf, int buf_size) {
-    return (int)_fread_nolock(buf, 1, buf_size, m_Mux.format.fpOutput);
+    return m_Mux.format.pFileOutput->read(buf, buf_size);
 }
 int RGYOutputAvcodec::writePacket(uint8_t *buf, int buf_size) {
-    return (int)_fwrite_nolock(buf, 1, buf_size, m_Mux.format.fpOutput);
+    return m_Mux.format.pFileOutput->write(buf, buf_size);
 }
 int64_t RGYOutputAvcodec::seek(int64_t offset, int whence) {
-    return _fseeki64(m_Mux.format.fpOutput, offset, whence);
+    return m_Mux.format.pFileOutput->seek(offset, whence);
 }
 #endif //USE_CUSTOM_IO
 
+//一時ファイルを置き換える (既存のファイルがあれば上書きする)
+static bool replaceFile(const tstring& src, const tstring& dst) {
+#if defined(_WIN32) || defined(_WIN64)
+    return MoveFileEx(src.c_str(), dst.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+    return rename(src.c_str(), dst.c_str()) == 0;
+#endif
+}
+
+RGY_ERR RGYOutputAvcodec::SegmentOpen() {
+    m_Mux.segment.sCurrentFile = strsprintf(_T("%s_%05d.ts"), m_Mux.segment.sBaseName.c_str(), m_Mux.segment.nIndex);
+    const tstring tmpname = m_Mux.segment.sCurrentFile + _T(".tmp");
+    const int openErr = m_Mux.format.pFileOutput->open(tmpname.c_str(), m_Mux.format.nOutputBufferSize, m_Mux.segment.nBlockSize, 0, m_Mux.segment.pQueueUsage);
+    if (openErr) {
+        AddMessage(RGY_LOG_ERROR, _T("failed to open segment file \"%s\": %s.\n"), tmpname.c_str(), _tcserror(openErr));
+        return RGY_ERR_FILE_OPEN;
+    }
+    AddMessage(RGY_LOG_DEBUG, _T("Opened segment #%d \"%s\".\n"), m_Mux.segment.nIndex, tmpname.c_str());
+    return RGY_ERR_NONE;
+}
+
+RGY_ERR RGYOutputAvcodec::SegmentNext(double fNextStartSec) {
+    //libavformatのバッファに残っているパケットを、すべて現在のセグメントに書き出す
+    av_interleaved_write_frame(m_Mux.format.pFormatCtx, nullptr);
+    av_write_frame(m_Mux.format.pFormatCtx, nullptr);
+    avio_flush(m_Mux.format.pFormatCtx->pb);
+    const int closeErr = m_Mux.format.pFileOutput->close();
+    if (closeErr) {
+        AddMessage(RGY_LOG_ERROR, _T("Error while writing segment file: %s.\n"), _tcserror(closeErr));
+        return RGY_ERR_UNKNOWN;
+    }
+    auto sts = SegmentPublish(fNextStartSec - m_Mux.segment.fStartSec, false);
+    if (sts != RGY_ERR_NONE) {
+        return sts;
+    }
+    //セグメント単独で再生できるよう、次のセグメントの先頭でPAT/PMTを出力させる
+    av_opt_set(m_Mux.format.pFormatCtx->priv_data, "mpegts_flags", "+resend_headers", 0);
+    m_Mux.segment.nIndex++;
+    m_Mux.segment.fStartSec = fNextStartSec;
+    return SegmentOpen();
+}
+
+RGY_ERR RGYOutputAvcodec::SegmentPublish(double fDurationSec, bool bLast) {
+    const tstring tmpname = m_Mux.segment.sCurrentFile + _T(".tmp");
+    if (!replaceFile(tmpname, m_Mux.segment.sCurrentFile)) {
+        AddMessage(RGY_LOG_ERROR, _T("failed to rename segment file \"%s\".\n"), tmpname.c_str());
+        return RGY_ERR_UNKNOWN;
+    }
+    //プレイリストにはプレイリストからの相対パスを記載する
+    m_Mux.segment.list.push_back(std::make_pair(tstring(PathFindFileName(m_Mux.segment.sCurrentFile.c_str())), fDurationSec));
+    AddMessage(RGY_LOG_DEBUG, _T("Published segment #%d, %.3f sec.\n"), m_Mux.segment.nIndex, fDurationSec);
+    if ((int)(fDurationSec + 0.5) > m_Mux.segment.nTargetDuration) {
+        AddMessage(RGY_LOG_WARN, _T("segment #%d (%.3f sec) exceeds the playlist target duration %d sec.\n"),
+            m_Mux.segment.nIndex, fDurationSec, m_Mux.segment.nTargetDuration);
+    }
+    return WritePlaylist(bLast);
+}
+
+RGY_ERR RGYOutputAvcodec::WritePlaylist(bool bEnd) {
+    const tstring tmpname = m_Mux.segment.sPlaylist + _T(".tmp");
+    FILE *fp = nullptr;
+    if (_tfopen_s(&fp, tmpname.c_str(), _T("wb")) != 0 || fp == nullptr) {
+        AddMessage(RGY_LOG_ERROR, _T("failed to open playlist \"%s\".\n"), tmpname.c_str());
+        return RGY_ERR_FILE_OPEN;
+    }
+    fprintf(fp, "#EXTM3U\n");
+    fprintf(fp, "#EXT-X-VERSION:3\n");
+    fprintf(fp, "#EXT-X-TARGETDURATION:%d\n", m_Mux.segment.nTargetDuration);
+    fprintf(fp, "#EXT-X-MEDIA-SEQUENCE:0\n");
+    fprintf(fp, "#EXT-X-PLAYLIST-TYPE:EVENT\n");
+    for (const auto& seg : m_Mux.segment.list) {
+        fprintf(fp, "#EXTINF:%.6f,\n%s\n", seg.second, tchar_to_string(seg.first, CP_UTF8).c_str());
+    }
+    if (bEnd) {
+        fprintf(fp, "#EXT-X-ENDLIST\n");
+    }
+    const bool writeError = ferror(fp) != 0;
+    fclose(fp);
+    if (writeError || !replaceFile(tmpname, m_Mux.segment.sPlaylist)) {
+        AddMessage(RGY_LOG_ERROR, _T("failed to write playlist \"%s\".\n"), m_Mux.segment.sPlaylist.c_str());
+        _tremove(tmpname.c_str());
+        return RGY_ERR_UNKNOWN;
+    }
+    return RGY_ERR_NONE;
+}
+
 #endif //ENABLE_AVSW_READER
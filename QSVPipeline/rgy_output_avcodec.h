@@ -30,11 +30,16 @@
 #define __RGY_OUTPUT_AVCODEC_H__
 
 #include "rgy_queue.h"
+#include "rgy_writebehind.h"
+#include "rgy_mux_interleaver.h"
 #include "rgy_version.h"
 
 #if ENABLE_AVSW_READER
 #include <thread>
 #include <atomic>
+#include <mutex>
+#include <deque>
+#include <functional>
 #include <cstdint>
 #include "rgy_avutil.h"
 #include "rgy_bitstream.h"
@@ -53,6 +58,10 @@ static const int SUB_ENC_BUF_MAX_SIZE = 1024 * 1024;
 static const int VID_BITSTREAM_QUEUE_SIZE_I  = 4;
 static const int VID_BITSTREAM_QUEUE_SIZE_PB = 64;
 
+//音声のキューの最大長の既定値 (AvcodecWriterPrm::nAudioQueueSizeで変更できる)
+static const int AUD_PACKET_QUEUE_SIZE_OUT  = 256; //出力スレッドへのキュー (音声トラックあたり)
+static const int AUD_PACKET_QUEUE_SIZE_PROC = 512; //音声処理/音声エンコードスレッドへのキュー
+
 struct AVMuxTimestamp {
     int64_t timestamp_list[8];
 
@@ -96,9 +105,8 @@ typedef struct AVMuxFormat {
 #if USE_CUSTOM_IO
     uint8_t              *pAVOutBuffer;         //avio_alloc_context用のバッファ
     uint32_t              nAVOutBufferSize;     //avio_alloc_context用のバッファサイズ
-    FILE                 *fpOutput;             //出力ファイルポインタ
-    char                 *pOutputBuffer;        //出力ファイルポインタ用のバッファ
-    uint32_t              nOutputBufferSize;    //出力ファイルポインタ用のバッファサイズ
+    RGYWriteBehindFile   *pFileOutput;          //出力ファイル (I/Oスレッドで書き出す)
+    uint32_t              nOutputBufferSize;    //出力ファイル用のバッファサイズ
 #endif //USE_CUSTOM_IO
     bool                  bStreamError;         //エラーが発生
     bool                  bIsMatroska;          //mkvかどうか
@@ -118,9 +126,9 @@ typedef struct AVMuxVideo {
     AVMuxTimestamp        timestampList;        //エンコーダから渡されたtimestampリスト
     int                   nFpsBaseNextDts;      //出力映像のfpsベースでのdts (API v1.6以下でdtsが計算されない場合に使用する)
     FILE                 *fpTsLogFile;          //mux timestampログファイル
-    RGYBitstream          seiNal;               //追加のsei nal
     AVBSFContext         *pBsfc;                //必要なら使用するbitstreamfilter
     RGYTimestamp         *pTimestamp;           //timestampの情報
+    int                   nTimestampConsumer;   //pTimestampに登録したこの出力の番号
 } AVMuxVideo;
 
 typedef struct AVMuxAudio {
@@ -185,6 +193,14 @@ typedef struct AVMuxSub {
     uint8_t              *pBuf;                 //変換用のバッファ
 } AVMuxSub;
 
+//他の出力で書き出されたパケットをそのまま書き出すストリーム (--ladder, --tee)
+typedef struct AVMuxPassthrough {
+    int                   nSrcIndex;            //コピー元のストリームのindex
+    AVRational            srcTimebase;          //コピー元のストリームのtimebase
+    int64_t               nPtsOffset;           //コピー元のtimebaseで、タイムスタンプから差し引く値
+    AVStream             *pStreamOut;           //出力ファイルのストリーム
+} AVMuxPassthrough;
+
 enum {
     MUX_DATA_TYPE_NONE   = 0,
     MUX_DATA_TYPE_PACKET = 1, //AVPktMuxDataに入っているデータがAVPacket
@@ -201,6 +217,12 @@ typedef struct AVPktMuxData {
     int         got_result;  //type == MUX_DATA_TYPE_FRAME 時有効
 } AVPktMuxData;
 
+//出力スレッドでdts順に並べ替える際に保持するデータ
+typedef struct AVMuxInterleaveData {
+    RGYBitstream bitstream;   //映像の場合に有効
+    AVPktMuxData pktData;     //音声・字幕の場合に有効
+} AVMuxInterleaveData;
+
 enum {
     AUD_QUEUE_PROCESS = 0,
     AUD_QUEUE_ENCODE  = 1,
@@ -234,12 +256,31 @@ typedef struct AVMuxThread {
 } AVMuxThread;
 #endif
 
+//HLSのセグメント分割 (出力ファイルの拡張子が.m3u8の場合)
+//セグメントは映像のIDRでのみ区切り、書き出し中は".tmp"を付けたファイル名で書き出して、完了後にリネームする
+typedef struct AVMuxSegment {
+    double                fTargetSec;           //セグメントの目標の長さ (秒, 0ならセグメント分割しない)
+    int                   nTargetDuration;      //プレイリストのEXT-X-TARGETDURATION (秒, 最初の書き出し時に決め、以降は変更しない)
+    tstring               sPlaylist;            //プレイリストのファイル名
+    tstring               sBaseName;            //セグメントのファイル名 (連番と拡張子を除く)
+    tstring               sCurrentFile;         //書き出し中のセグメントのファイル名
+    int                   nIndex;               //書き出し中のセグメントの番号
+    double                fStartSec;            //書き出し中のセグメントの先頭の時刻 (秒)
+    double                fEndSec;              //書き出した映像の終了時刻 (秒)
+    size_t                nBlockSize;           //セグメントを書き出すRGYWriteBehindFileのブロックサイズ
+    size_t               *pQueueUsage;          //セグメントを書き出すRGYWriteBehindFileのキューの情報
+    vector<std::pair<tstring, double>> list;    //書き出したセグメントのファイル名と長さ
+} AVMuxSegment;
+
 typedef struct AVMux {
     AVMuxFormat         format;
+    AVMuxSegment        segment;
     AVMuxVideo          video;
     vector<AVMuxAudio>  audio;
     vector<AVMuxSub>    sub;
+    vector<AVMuxPassthrough> passthrough;
     vector<sTrim>       trim;
+    vector<int>         trimCutFrames;  //各trimの領域の開始までに削除されるフレーム数
 #if ENABLE_AVCODEC_OUT_THREAD
     AVMuxThread         thread;
 #endif
@@ -255,6 +296,11 @@ typedef struct AVOutputStreamPrm {
     const TCHAR  *pFilter;             //音声フィルタ
 } AVOutputStreamPrm;
 
+typedef struct AVPassthroughStreamPrm {
+    const AVStream *pStream;           //コピー元のストリーム (Init時のみ参照する)
+    int64_t         nPtsOffset;        //コピー元のtimebaseで、タイムスタンプから差し引く値
+} AVPassthroughStreamPrm;
+
 struct AvcodecWriterPrm {
     const AVDictionary          *pInputFormatMetadata;    //入力ファイルのグローバルメタデータ
     const TCHAR                 *pOutputFormat;           //出力のフォーマット
@@ -264,19 +310,24 @@ struct AvcodecWriterPrm {
     int64_t                      nVideoInputFirstKeyPts;  //入力映像の最初のpts
     vector<sTrim>                trimList;                //Trimする動画フレームの領域のリスト
     vector<AVOutputStreamPrm>    inputStreamList;         //入力ファイルの音声・字幕の情報
+    vector<AVPassthroughStreamPrm> passthroughStreamList; //他の出力からそのままコピーするストリーム (--ladder, --tee)
     vector<const AVChapter *>    chapterList;             //チャプターリスト
     bool                         bChapterNoTrim;          //チャプターにtrimを反映しない
     int                          nAudioResampler;         //音声のresamplerの選択
     uint32_t                     nAudioIgnoreDecodeError; //音声デコード時に発生したエラーを無視して、無音に置き換える
     int                          nBufSizeMB;              //出力バッファサイズ
+    int64_t                      nPreallocSize;           //出力ファイルにあらかじめ確保する領域のサイズ (0なら確保しない)
     int                          nOutputThread;           //出力スレッド数
     int                          nAudioThread;            //音声処理スレッド数
+    int                          nAudioQueueSize;         //音声のキューの最大長 (パケット数, 0なら既定値)
     muxOptList                   vMuxOpt;                 //mux時に使用するオプション
     PerfQueueInfo               *pQueueInfo;              //キューの情報を格納する構造体
     const TCHAR                 *pMuxVidTsLogFile;        //mux timestampログファイル
     HEVCHDRSei                  *pHEVCHdrSei;             //HDR関連のmetadata
     RGYTimestamp                *pVidTimestamp;           //動画のtimestampの情報
     std::string                  videoCodecTag;           //動画タグ
+    double                       fSegmentSec;             //HLSのセグメントの目標の長さ (秒, 出力ファイルの拡張子が.m3u8の場合に使用する)
+    double                       fSegmentMaxSec;          //HLSのセグメントの最大の長さ (秒, GOP長から求める, 0なら不明)
 
     AvcodecWriterPrm() :
         pInputFormatMetadata(nullptr),
@@ -287,19 +338,24 @@ struct AvcodecWriterPrm {
         nVideoInputFirstKeyPts(0),
         trimList(),
         inputStreamList(),
+        passthroughStreamList(),
         chapterList(),
         bChapterNoTrim(false),
         nAudioResampler(0),
         nAudioIgnoreDecodeError(0),
         nBufSizeMB(0),
+        nPreallocSize(0),
         nOutputThread(0),
         nAudioThread(0),
+        nAudioQueueSize(0),
         vMuxOpt(),
         pQueueInfo(nullptr),
         pMuxVidTsLogFile(nullptr),
         pHEVCHdrSei(nullptr),
         pVidTimestamp(nullptr),
-        videoCodecTag() {
+        videoCodecTag(),
+        fSegmentSec(0.0),
+        fSegmentMaxSec(0.0) {
     }
 };
 
@@ -317,6 +373,17 @@ public:
 
     virtual vector<int> GetStreamTrackIdList();
 
+    //音声の出力ストリームを取得する
+    vector<const AVStream *> GetAudioOutputStreams();
+
+    //書き出す音声パケットを、書き出し直前にそのストリームのtimebaseとともに渡す関数を設定する (--ladder, --tee)
+    void SetPacketTee(std::function<void(const AVPacket *, AVRational)> tee);
+
+    //他の出力で書き出されたパケットを、passthroughStreamListで指定したストリームに書き出す (--ladder, --tee)
+    //パケットはコピーしてキューに格納し、映像の書き出しにあわせて書き出す
+    //timebaseはパケットのタイムスタンプのtimebase (コピー元の出力のヘッダ書き出し時に変更されることがある)
+    void WritePassthroughPacket(const AVPacket *pkt, AVRational timebase);
+
     virtual void WaitFin() override;
 
     virtual void Close() override;
@@ -351,9 +418,16 @@ protected:
     //AVPktMuxDataを初期化する
     AVPktMuxData pktMuxData(AVFrame *pFrame);
 
+    //出力スレッドでの並べ替えに使用するdtsをQUEUE_DTS_TIMEBASEで返す
+    //bProcessed ... 音声処理スレッドで処理済みのパケットかどうか
+    int64_t muxQueueDts(const AVPktMuxData *pktData, bool bProcessed);
+
     //WriteNextFrameの本体
     RGY_ERR WriteNextFrameInternal(RGYBitstream *pBitstream, int64_t *pWrittenDts);
 
+    //映像のtimestampの情報(pTimestamp)への登録を解除する
+    void ReleaseVideoTimestamp();
+
     //WriteNextPacketの本体
     RGY_ERR WriteNextPacketInternal(AVPktMuxData *pktData, int64_t maxDtsToWrite);
 
@@ -461,6 +535,9 @@ protected:
     //パケットを実際に書き出す
     void WriteNextPacketProcessed(AVMuxAudio *pMuxAudio, AVPacket *pkt, int samples, int64_t *pWrittenDts);
 
+    //キューに格納したpassthroughのパケットを書き出す
+    void WritePassthroughPackets();
+
     //extradataにH264のヘッダーを追加する
     RGY_ERR AddH264HeaderToExtraData(const RGYBitstream *pBitstream);
 
@@ -470,6 +547,18 @@ protected:
     //ファイルヘッダーを書き出す
     RGY_ERR WriteFileHeader(const RGYBitstream *pBitstream);
 
+    //次のHLSのセグメントのファイルを開く
+    RGY_ERR SegmentOpen();
+
+    //書き出し中のセグメントを閉じて、fNextStartSecから始まる次のセグメントを開く
+    RGY_ERR SegmentNext(double fNextStartSec);
+
+    //閉じたセグメントをリネームして、プレイリストに追加する
+    RGY_ERR SegmentPublish(double fDurationSec, bool bLast);
+
+    //プレイリストを書き出す (一時ファイルに書き出してからリネームする)
+    RGY_ERR WritePlaylist(bool bEnd);
+
     //タイムスタンプをTrimなどを考慮しつつ計算しなおす
     //nTimeInがTrimで切り取られる領域の場合
     //lastValidFrame ... true 最後の有効なフレーム+1のtimestampを返す / false .. AV_NOPTS_VALUEを返す
@@ -479,12 +568,21 @@ protected:
     void CloseAudio(AVMuxAudio *pMuxAudio);
     void CloseVideo(AVMuxVideo *pMuxVideo);
     void CloseFormat(AVMuxFormat *pMuxFormat);
+    void CloseSegment(AVMuxSegment *pMuxSegment);
     void CloseThread();
     void CloseQueues();
 
     static const AVRational QUEUE_DTS_TIMEBASE;
     AVMux m_Mux;
     vector<AVPktMuxData> m_AudPktBufFileHead; //ファイルヘッダを書く前にやってきた音声パケットのバッファ
+    std::function<void(const AVPacket *, AVRational)> m_pktTee; //書き出す音声パケットのコピー先
+    std::mutex m_mtxPassthrough;          //m_passthroughPkts, m_bPassthroughClosed, m_bPassthroughError用
+    std::deque<std::pair<AVPacket, AVRational>> m_passthroughPkts; //書き出し待ちのpassthroughのパケットとそのtimebase
+    bool m_bPassthroughClosed;            //Close済みでpassthroughのパケットを受け付けない
+    bool m_bPassthroughError;             //passthroughのパケットの受け取りに失敗した (muxのスレッドでbStreamErrorに反映する)
+    RGYHeaderCache m_headerCache;         //SPSの書き換え・SEIの挿入を行ったヘッダーのキャッシュ
+    std::vector<RGYBitstreamSpan> m_headerSpans; //映像パケットとして書き出すデータの区間のリスト
+    std::vector<uint8_t> m_headerBuf;     //最初のフレームのヘッダーを組み立てるためのバッファ
 };
 
 #endif //ENABLE_AVSW_READER
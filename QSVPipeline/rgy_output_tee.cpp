@@ -0,0 +1,217 @@
+﻿// -----------------------------------------------------------------------------------------
+// QSVEnc/NVEnc by rigaya
+// -----------------------------------------------------------------------------------------
+// The MIT License
+//
+// Copyright (c) 2011-2016 rigaya
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// --------------------------------------------------------------------------------------------
+
+#include <algorithm>
+#include "rgy_osdep.h"
+#include "rgy_tchar.h"
+#include "rgy_util.h"
+#include "rgy_output_tee.h"
+
+RGYOutputTee::RGYOutputTee() :
+    m_pPrimary(),
+    m_targets(),
+    m_nQueueSize(0) {
+    m_strWriterName = _T("tee");
+}
+
+RGYOutputTee::~RGYOutputTee() {
+    Close();
+}
+
+RGY_ERR RGYOutputTee::Init(const TCHAR *strFileName, const VideoInfo *pOutputInfo, const void *prm) {
+    UNREFERENCED_PARAMETER(strFileName);
+    UNREFERENCED_PARAMETER(pOutputInfo);
+    const RGYOutputTeePrm *pTeePrm = (const RGYOutputTeePrm *)prm;
+    if (pTeePrm == nullptr || !pTeePrm->primary) {
+        AddMessage(RGY_LOG_ERROR, _T("primary output not set.\n"));
+        return RGY_ERR_NULL_PTR;
+    }
+    m_pPrimary = pTeePrm->primary;
+    m_bOutputIsStdout = m_pPrimary->outputStdout();
+    m_OutType = m_pPrimary->getOutType();
+
+    m_nQueueSize = (size_t)pTeePrm->nQueueSize;
+    if (m_nQueueSize == 0) {
+        int nQueueSize = RGY_OUTPUT_TEE_QUEUE_MIN;
+        if (m_VideoOutputInfo.fpsN > 0 && m_VideoOutputInfo.fpsD > 0) {
+            nQueueSize = (std::max)(nQueueSize, RGY_OUTPUT_TEE_QUEUE_SEC * m_VideoOutputInfo.fpsN / m_VideoOutputInfo.fpsD);
+        }
+        m_nQueueSize = (size_t)nQueueSize;
+    }
+
+    m_strOutputInfo = m_pPrimary->GetOutputMessage();
+    for (const auto& writer : pTeePrm->secondaries) {
+        std::unique_ptr<TeeTarget> target(new TeeTarget());
+        target->writer = writer;
+        target->bFin = false;
+        target->err = RGY_ERR_NONE;
+        target->nWaitCount = 0;
+        m_targets.push_back(std::move(target));
+
+        const tstring mes = writer->GetOutputMessage();
+        if (mes.length() > 0) {
+            if (m_strOutputInfo.length() > 0 && m_strOutputInfo.back() != _T('\n')) {
+                m_strOutputInfo += _T("\n");
+            }
+            m_strOutputInfo += mes;
+        }
+    }
+    for (auto& target : m_targets) {
+        auto pTarget = target.get();
+        target->thWrite = std::thread([this, pTarget]() { threadWrite(pTarget); });
+    }
+    AddMessage(RGY_LOG_DEBUG, _T("Initialized tee output: %d secondary outputs, queue %d frames.\n"), (int)m_targets.size(), (int)m_nQueueSize);
+    m_bInited = true;
+    return RGY_ERR_NONE;
+}
+
+void RGYOutputTee::threadWrite(TeeTarget *target) {
+    for (;;) {
+        std::unique_lock<std::mutex> lock(target->mtx);
+        target->cvPush.wait(lock, [target]() { return !target->queue.empty() || target->bFin; });
+        if (target->queue.empty()) {
+            break;
+        }
+        RGYBitstream bitstream = target->queue.front();
+        target->queue.pop_front();
+        lock.unlock();
+        target->cvPop.notify_one();
+
+        //副出力のWriteNextFrameはビットストリームを消費する (DataLengthを0にする) ので、バッファはそのまま再利用できる
+        const auto sts = target->writer->WriteNextFrame(&bitstream);
+
+        lock.lock();
+        bitstream.setSize(0);
+        bitstream.setOffset(0);
+        target->bufFree.push_back(bitstream);
+        if (sts != RGY_ERR_NONE) {
+            target->err = sts;
+            //残りのフレームは書き出さずに破棄し、待機している主出力側を起こす
+            //(失敗した出力はRGYTimestampへの登録を解除しているので、破棄したフレームのdurationはほかの出力の取得後に削除される)
+            for (auto& bs : target->queue) {
+                target->bufFree.push_back(bs);
+            }
+            target->queue.clear();
+            lock.unlock();
+            target->cvPop.notify_all();
+            break;
+        }
+    }
+}
+
+RGY_ERR RGYOutputTee::WriteNextFrame(RGYBitstream *pBitstream) {
+    //先に副出力のキューにコピーしておき、主出力の書き出しと並行して書き出す
+    for (size_t i = 0; i < m_targets.size(); i++) {
+        auto& target = m_targets[i];
+        std::unique_lock<std::mutex> lock(target->mtx);
+        if (target->queue.size() >= m_nQueueSize && target->err == RGY_ERR_NONE) {
+            //この出力先が追い付いていないので、キューに空きができるまで待機する
+            target->nWaitCount++;
+            target->cvPop.wait(lock, [this, &target]() { return target->queue.size() < m_nQueueSize || target->err != RGY_ERR_NONE; });
+        }
+        if (target->err != RGY_ERR_NONE) {
+            AddMessage(RGY_LOG_ERROR, _T("Failed to write to tee output #%d: %s.\n"), (int)i, get_err_mes(target->err));
+            return target->err;
+        }
+        RGYBitstream bitstream = RGYBitstreamInit();
+        if (target->bufFree.size() > 0) {
+            bitstream = target->bufFree.back();
+            target->bufFree.pop_back();
+        }
+        lock.unlock();
+
+        auto sts = bitstream.copy(pBitstream);
+
+        lock.lock();
+        if (sts != RGY_ERR_NONE) {
+            target->bufFree.push_back(bitstream);
+            AddMessage(RGY_LOG_ERROR, _T("Failed to allocate memory for tee output.\n"));
+            return sts;
+        }
+        target->queue.push_back(bitstream);
+        lock.unlock();
+        target->cvPush.notify_one();
+    }
+    return m_pPrimary->WriteNextFrame(pBitstream);
+}
+
+RGY_ERR RGYOutputTee::WriteNextFrame(RGYFrame *pSurface) {
+    UNREFERENCED_PARAMETER(pSurface);
+    AddMessage(RGY_LOG_ERROR, _T("tee output does not support raw frame output.\n"));
+    return RGY_ERR_UNSUPPORTED;
+}
+
+void RGYOutputTee::finishThreads() {
+    for (auto& target : m_targets) {
+        {
+            std::lock_guard<std::mutex> lock(target->mtx);
+            target->bFin = true;
+        }
+        target->cvPush.notify_one();
+    }
+    for (size_t i = 0; i < m_targets.size(); i++) {
+        auto& target = m_targets[i];
+        if (target->thWrite.joinable()) {
+            target->thWrite.join();
+            if (target->err != RGY_ERR_NONE) {
+                AddMessage(RGY_LOG_ERROR, _T("Failed to write to tee output #%d: %s.\n"), (int)i, get_err_mes(target->err));
+            }
+        }
+    }
+}
+
+void RGYOutputTee::WaitFin() {
+    finishThreads();
+    if (m_pPrimary) {
+        m_pPrimary->WaitFin();
+    }
+    for (auto& target : m_targets) {
+        target->writer->WaitFin();
+    }
+}
+
+void RGYOutputTee::Close() {
+    AddMessage(RGY_LOG_DEBUG, _T("Closing...\n"));
+    finishThreads();
+    //主出力を先に閉じて、主出力に残っている音声のパケットを副出力に渡してから副出力を閉じる
+    if (m_pPrimary) {
+        m_pPrimary->Close();
+        m_pPrimary.reset();
+    }
+    for (size_t i = 0; i < m_targets.size(); i++) {
+        auto& target = m_targets[i];
+        AddMessage(RGY_LOG_DEBUG, _T("tee output #%d: waited %d times for free queue.\n"), (int)i, target->nWaitCount);
+        target->writer->Close();
+        for (auto& bs : target->bufFree) {
+            bs.clear();
+        }
+        target->bufFree.clear();
+    }
+    m_targets.clear();
+    m_nQueueSize = 0;
+    RGYOutput::Close();
+}
@@ -0,0 +1,96 @@
+﻿// -----------------------------------------------------------------------------------------
+// QSVEnc/NVEnc by rigaya
+// -----------------------------------------------------------------------------------------
+// The MIT License
+//
+// Copyright (c) 2011-2016 rigaya
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// --------------------------------------------------------------------------------------------
+
+#pragma once
+#ifndef __RGY_OUTPUT_TEE_H__
+#define __RGY_OUTPUT_TEE_H__
+
+#include <vector>
+#include <deque>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "rgy_osdep.h"
+#include "rgy_tchar.h"
+#include "rgy_output.h"
+
+//--tee
+//1回のエンコードの出力を、複数の出力先に書き出す
+//主出力 (出力ファイル) は呼び出し元のスレッドで書き出し、音声・字幕・チャプターなどを担当する
+//副出力 (--teeで指定した出力先) は映像のビットストリームのコピーを、それぞれ専用のスレッドで書き出す
+//副出力のキューが満杯の場合のみ待機するので、遅い出力先があってもキューの分までは他の出力先は待たされない
+
+//副出力のキューの長さ (秒)
+static const int RGY_OUTPUT_TEE_QUEUE_SEC = 4;
+//副出力のキューの最小の長さ (フレーム)
+static const int RGY_OUTPUT_TEE_QUEUE_MIN = 64;
+
+struct RGYOutputTeePrm {
+    std::shared_ptr<RGYOutput> primary;                  //主出力 (初期化済みのもの)
+    std::vector<std::shared_ptr<RGYOutput>> secondaries; //副出力 (初期化済みのもの)
+    int nQueueSize;                                      //副出力ごとのキューの長さ (0なら自動)
+};
+
+class RGYOutputTee : public RGYOutput {
+public:
+    RGYOutputTee();
+    virtual ~RGYOutputTee();
+
+    virtual RGY_ERR WriteNextFrame(RGYBitstream *pBitstream) override;
+    virtual RGY_ERR WriteNextFrame(RGYFrame *pSurface) override;
+    virtual void WaitFin() override;
+    virtual void Close() override;
+
+    //主出力を取得する
+    std::shared_ptr<RGYOutput> primary() { return m_pPrimary; }
+protected:
+    virtual RGY_ERR Init(const TCHAR *strFileName, const VideoInfo *pOutputInfo, const void *prm) override;
+
+    //副出力ごとの書き出しスレッドとキュー
+    struct TeeTarget {
+        std::shared_ptr<RGYOutput> writer;
+        std::thread thWrite;
+        std::mutex mtx;
+        std::condition_variable cvPush;     //キューにフレームが追加された
+        std::condition_variable cvPop;      //キューに空きができた
+        std::deque<RGYBitstream> queue;     //書き出し待ちのビットストリーム
+        std::vector<RGYBitstream> bufFree;  //再利用するビットストリームのバッファ
+        bool bFin;                          //これ以上フレームが追加されない
+        RGY_ERR err;                        //書き出しで発生したエラー
+        int nWaitCount;                     //キューが満杯で待機した回数
+    };
+    void threadWrite(TeeTarget *target);
+    //すべての副出力の書き出しスレッドを終了させる
+    void finishThreads();
+
+    std::shared_ptr<RGYOutput> m_pPrimary;
+    std::vector<std::unique_ptr<TeeTarget>> m_targets;
+    size_t m_nQueueSize;
+};
+
+#endif //__RGY_OUTPUT_TEE_H__
@@ -40,6 +40,8 @@
 #include "rgy_util.h"
 #include "rgy_pipe.h"
 #include "gpuz_info.h"
+#include "rgy_thread_affinity.h"
+#include "rgy_metrics_server.h"
 #if defined(_WIN32) || defined(_WIN64)
 #include <psapi.h>
 #else
@@ -430,6 +432,8 @@ CPerfMonitor::CPerfMonitor() {
     memset(m_info, 0, sizeof(m_info));
     memset(&m_pipes, 0, sizeof(m_pipes));
     memset(&m_QueueInfo, 0, sizeof(m_QueueInfo));
+    memset(m_nStagePrevCount, 0, sizeof(m_nStagePrevCount));
+    memset(m_nStagePrevTotal, 0, sizeof(m_nStagePrevTotal));
 #if ENABLE_METRIC_FRAMEWORK
     m_pManager = nullptr;
 #endif //#if ENABLE_METRIC_FRAMEWORK
@@ -458,8 +462,15 @@ void CPerfMonitor::clear() {
         m_bAbort = true;
         m_thCheck.join();
     }
+    if (m_pMetricsServer) {
+        m_pMetricsServer->close();
+        m_pMetricsServer.reset();
+    }
     memset(m_info, 0, sizeof(m_info));
     memset(&m_QueueInfo, 0, sizeof(m_QueueInfo));
+    m_StageLatency.reset();
+    memset(m_nStagePrevCount, 0, sizeof(m_nStagePrevCount));
+    memset(m_nStagePrevTotal, 0, sizeof(m_nStagePrevTotal));
 #if ENABLE_METRIC_FRAMEWORK
     if (m_pManager) {
         const auto metricsUsed = m_Consumer.getMetricUsed();
@@ -479,6 +490,10 @@ void CPerfMonitor::clear() {
     m_bEncStarted = false;
     if (m_fpLog) {
         fprintf(m_fpLog.get(), "\n\n");
+        //各スレッドへの適用結果を残す
+        if (RGYThreadAffinity::get().enabled()) {
+            fprintf(m_fpLog.get(), "# thread affinity: %s\n", tchar_to_string(RGYThreadAffinity::get().summary()).c_str());
+        }
     }
     m_fpLog.reset();
     if (m_pipes.f_stdin) {
@@ -583,6 +598,9 @@ void CPerfMonitor::write_header(FILE *fp, int nSelect) {
     if (nSelect & PERF_MONITOR_QUEUE_AUD_OUT) {
         str += ",queue aud out";
     }
+    if (nSelect & PERF_MONITOR_QUEUE_IO_OUT) {
+        str += ",queue io out";
+    }
     if (nSelect & PERF_MONITOR_MEM_PRIVATE) {
         str += ",mem private (MB)";
     }
@@ -641,6 +659,12 @@ int CPerfMonitor::init(tstring filename, const TCHAR *pPythonPath,
             return 1;
         }
     }
+    if (prm && prm->metricsSocket) {
+        m_pMetricsServer = std::unique_ptr<RGYMetricsServer>(new RGYMetricsServer());
+        if (m_pMetricsServer->init(prm->metricsSocket, m_pRGYLog) != RGY_ERR_NONE) {
+            m_pMetricsServer.reset();
+        }
+    }
 #if ENABLE_METRIC_FRAMEWORK
     //LoadAllを使用する場合、下記のように使わないモジュールを書くことで取得するモジュールを制限できる
     //putenv("GM_EXTENSION_LIB_SKIP_LIST=SEPPublisher,PVRPublisher,CPUInfoPublisher,RenderPerfPublisher");
@@ -804,6 +828,9 @@ int CPerfMonitor::init(tstring filename, const TCHAR *pPythonPath,
     pRGYLog->write(RGY_LOG_DEBUG, _T("Performace Monitor: %s\n"), CPerfMonitor::SelectedCounters(m_nSelectOutputLog).c_str());
     pRGYLog->write(RGY_LOG_DEBUG, _T("Performace Plot   : %s\n"), CPerfMonitor::SelectedCounters(m_nSelectOutputPlot).c_str());
 
+    if (m_fpLog && RGYThreadAffinity::get().enabled()) {
+        fprintf(m_fpLog.get(), "# thread affinity: %s\n", tchar_to_string(RGYThreadAffinity::get().summary()).c_str());
+    }
     write_header(m_fpLog.get(),   m_nSelectOutputLog);
     write_header(m_pipes.f_stdin, m_nSelectOutputPlot);
 
@@ -1059,7 +1086,7 @@ void CPerfMonitor::check() {
         EncodeStatusData data = m_pEncStatus->GetEncodeData();
 
         //fps情報
-        pInfoNew->frames_out = data.frameTotal;
+        pInfoNew->frames_out = data.frameOut;
         if (pInfoNew->frames_out > pInfoOld->frames_out) {
             pInfoNew->fps_avg = pInfoNew->frames_out / (double)(current_time / 10 - m_nEncStartTime) * 1e6;
             if (pInfoNew->time_us > pInfoOld->time_us) {
@@ -1141,6 +1168,9 @@ void CPerfMonitor::write(FILE *fp, int nSelect) {
     if (nSelect & PERF_MONITOR_QUEUE_AUD_OUT) {
         str += strsprintf(",%d", (int)m_QueueInfo.usage_aud_out);
     }
+    if (nSelect & PERF_MONITOR_QUEUE_IO_OUT) {
+        str += strsprintf(",%d", (int)m_QueueInfo.usage_io_out);
+    }
     if (nSelect & PERF_MONITOR_MEM_PRIVATE) {
         str += strsprintf(",%.2lf", pInfo->mem_private / (double)(1024 * 1024));
     }
@@ -1178,6 +1208,35 @@ void CPerfMonitor::write(FILE *fp, int nSelect) {
     }
 }
 
+void CPerfMonitor::publishMetrics() {
+    if (!m_pMetricsServer) {
+        return;
+    }
+    RGYMetricsSnapshot snapshot;
+    memset(&snapshot, 0, sizeof(snapshot));
+    snapshot.seq = m_nStep;
+    snapshot.encStarted = m_bEncStarted;
+    snapshot.finished = m_bAbort;
+    snapshot.perf = m_info[m_nStep & 1];
+    if (m_pEncStatus) {
+        snapshot.enc = m_pEncStatus->GetEncodeData();
+    }
+    snapshot.queue = m_QueueInfo;
+    for (int i = 0; i < PERF_STAGE_MAX; i++) {
+        const auto& counter = m_StageLatency.stage[i];
+        const uint64_t count = counter.count.load(std::memory_order_relaxed);
+        const uint64_t total = std::max(counter.total_us.load(std::memory_order_relaxed), m_nStagePrevTotal[i]);
+        auto& stage = snapshot.stage[i];
+        stage.count  = count;
+        stage.avgMs  = (count > 0) ? total * 1e-3 / count : 0.0;
+        stage.lastMs = (count > m_nStagePrevCount[i]) ? (total - m_nStagePrevTotal[i]) * 1e-3 / (count - m_nStagePrevCount[i]) : 0.0;
+        stage.maxMs  = counter.max_us.load(std::memory_order_relaxed) * 1e-3;
+        m_nStagePrevCount[i] = count;
+        m_nStagePrevTotal[i] = total;
+    }
+    m_pMetricsServer->update(snapshot);
+}
+
 void CPerfMonitor::loader(void *prm) {
     reinterpret_cast<CPerfMonitor*>(prm)->run();
 }
@@ -1197,9 +1256,11 @@ void CPerfMonitor::run() {
         }
         write(m_fpLog.get(),   m_nSelectOutputLog);
         write(m_pipes.f_stdin, m_nSelectOutputPlot);
+        publishMetrics();
         std::this_thread::sleep_for(std::chrono::milliseconds(m_nInterval));
     }
     check();
     write(m_fpLog.get(),   m_nSelectOutputLog);
     write(m_pipes.f_stdin, m_nSelectOutputPlot);
+    publishMetrics();
 }
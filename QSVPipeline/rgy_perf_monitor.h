@@ -30,6 +30,8 @@
 #define __RGY_PERF_MONITOR_H__
 
 #include <thread>
+#include <atomic>
+#include <chrono>
 #include <cstdint>
 #include <climits>
 #include <memory>
@@ -89,6 +91,7 @@ enum : int {
     PERF_MONITOR_VE_CLOCK      = 0x02000000,
     PERF_MONITOR_VEE_LOAD      = 0x04000000,
     PERF_MONITOR_VED_LOAD      = 0x08000000,
+    PERF_MONITOR_QUEUE_IO_OUT  = 0x10000000,
     PERF_MONITOR_ALL         = (int)UINT_MAX,
 };
 
@@ -124,7 +127,8 @@ static const CX_DESC list_pref_monitor[] = {
     { _T("vee_load"),    PERF_MONITOR_VEE_LOAD },
     { _T("ved_load"),    PERF_MONITOR_VEE_LOAD },
     { _T("ve_clock"),    PERF_MONITOR_VE_CLOCK },
-    { _T("queue"),       PERF_MONITOR_QUEUE_VID_IN | PERF_MONITOR_QUEUE_VID_OUT | PERF_MONITOR_QUEUE_AUD_IN | PERF_MONITOR_QUEUE_AUD_OUT },
+    { _T("queue"),       PERF_MONITOR_QUEUE_VID_IN | PERF_MONITOR_QUEUE_VID_OUT | PERF_MONITOR_QUEUE_AUD_IN | PERF_MONITOR_QUEUE_AUD_OUT | PERF_MONITOR_QUEUE_IO_OUT },
+    { _T("queue_io"),    PERF_MONITOR_QUEUE_IO_OUT },
     { nullptr, 0 }
 };
 
@@ -193,6 +197,52 @@ struct PerfQueueInfo {
     size_t usage_aud_out;
     size_t usage_aud_enc;
     size_t usage_aud_proc;
+    size_t usage_io_out;
+};
+
+//--metrics-socket で出力する処理段ごとの所要時間
+enum : int {
+    PERF_STAGE_INPUT = 0, //フレーム/ビットストリームの読み込み
+    PERF_STAGE_ENCODE,    //EncodeFrameAsyncへの投入からSyncOperationの完了まで
+    PERF_STAGE_OUTPUT,    //ビットストリームの書き出し
+    PERF_STAGE_DECODE,    //DecodeFrameAsyncの呼び出し (MFX_WRN_DEVICE_BUSYでの待機を含む)
+    PERF_STAGE_VPP,       //RunFrameVPPAsyncの呼び出し (MFX_WRN_DEVICE_BUSYでの待機を含む)
+    PERF_STAGE_FILTER,    //vppプラグインの呼び出し (MFX_WRN_DEVICE_BUSYでの待機を含む)
+    PERF_STAGE_MAX,
+};
+
+static const char *PERF_STAGE_NAMES[PERF_STAGE_MAX] = {
+    "input", "encode", "output", "decode", "vpp", "filter"
+};
+
+//各スレッドはロックを取らずにatomicに加算するのみで、集計はCPerfMonitorのスレッドで行う
+struct PerfStageLatency {
+    struct Counter {
+        std::atomic<uint64_t> count;
+        std::atomic<uint64_t> total_us;
+        std::atomic<uint64_t> max_us;
+    };
+    Counter stage[PERF_STAGE_MAX];
+
+    PerfStageLatency() {
+        reset();
+    }
+    void reset() {
+        for (auto& c : stage) {
+            c.count.store(0, std::memory_order_relaxed);
+            c.total_us.store(0, std::memory_order_relaxed);
+            c.max_us.store(0, std::memory_order_relaxed);
+        }
+    }
+    void add(int type, std::chrono::steady_clock::time_point start) {
+        const uint64_t us = (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+        auto& c = stage[type];
+        c.total_us.fetch_add(us, std::memory_order_relaxed);
+        c.count.fetch_add(1, std::memory_order_relaxed);
+        uint64_t prev = c.max_us.load(std::memory_order_relaxed);
+        while (prev < us && !c.max_us.compare_exchange_weak(prev, us, std::memory_order_relaxed)) {
+        }
+    }
 };
 
 #if ENABLE_METRIC_FRAMEWORK
@@ -315,9 +365,12 @@ struct CPerfMonitorPrm {
 #if ENABLE_NVML
     const char *pciBusId;
 #endif
+    const TCHAR *metricsSocket; //--metrics-socket (nullptrなら無効)
     char reserved[256];
 };
 
+class RGYMetricsServer;
+
 class CPerfMonitor {
 public:
     CPerfMonitor();
@@ -332,6 +385,10 @@ public:
     PerfQueueInfo *GetQueueInfoPtr() {
         return &m_QueueInfo;
     }
+    //--metrics-socket使用時のみ計測を行うので、それ以外ではnullptrを返す
+    PerfStageLatency *GetStageLatencyPtr() {
+        return (m_pMetricsServer) ? &m_StageLatency : nullptr;
+    }
 #if ENABLE_METRIC_FRAMEWORK
     bool GetQSVInfo(QSVGPUInfo *info) {
         return m_Consumer.getMFXLoad(info);
@@ -357,6 +414,8 @@ protected:
     void run();
     void write_header(FILE *fp, int nSelect);
     void write(FILE *fp, int nSelect);
+    //最新の計測結果を--metrics-socketの応答用に渡す
+    void publishMetrics();
 
     static void loader(void *prm);
 
@@ -390,6 +449,10 @@ protected:
     int m_nSelectOutputPlot;
     PerfQueueInfo m_QueueInfo;
     std::shared_ptr<RGYLog> m_pRGYLog;
+    std::unique_ptr<RGYMetricsServer> m_pMetricsServer;
+    PerfStageLatency m_StageLatency;
+    uint64_t m_nStagePrevCount[PERF_STAGE_MAX]; //前回のpublishMetrics時点の値
+    uint64_t m_nStagePrevTotal[PERF_STAGE_MAX];
 
 #if ENABLE_METRIC_FRAMEWORK
     IExtensionLoader *m_pLoader;
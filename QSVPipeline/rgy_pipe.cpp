@@ -146,4 +146,15 @@ void RGYPipeProcessWin::close() {
 bool RGYPipeProcessWin::processAlive() {
     return WAIT_OBJECT_0 == WaitForSingleObject(m_phandle, 0);
 }
+
+bool rgy_is_pipe(FILE *fp) {
+    return GetFileType((HANDLE)_get_osfhandle(_fileno(fp))) == FILE_TYPE_PIPE;
+}
+
+int rgy_set_pipe_size(FILE *fp, int size) {
+    //Windowsではパイプのバッファサイズは作成時に決まり、後から変更できない
+    UNREFERENCED_PARAMETER(fp);
+    UNREFERENCED_PARAMETER(size);
+    return 0;
+}
 #endif //defined(_WIN32) || defined(_WIN64)
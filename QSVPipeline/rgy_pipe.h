@@ -42,6 +42,7 @@ enum PipeMode {
 };
 
 static const int QSV_PIPE_READ_BUF = 2048;
+static const int RGY_PIPE_BUF_SIZE_DEFAULT = 1024 * 1024; //stdin/stdoutがパイプの場合に設定するバッファサイズ
 
 #if defined(_WIN32) || defined(_WIN64)
 typedef HANDLE PIPE_HANDLE;
@@ -111,4 +112,12 @@ protected:
 };
 #endif //#if defined(_WIN32) || defined(_WIN64)
 
+//fpがパイプに接続されているかどうか
+bool rgy_is_pipe(FILE *fp);
+
+//fpがパイプなら、そのバッファをsizeまで拡大する
+//sizeが非特権プロセスの上限(/proc/sys/fs/pipe-max-size)を超える場合は上限まで拡大する
+//変更後のバッファサイズを返す (パイプでない場合やサイズを変更できない場合は0)
+int rgy_set_pipe_size(FILE *fp, int size);
+
 #endif //__RGY_PIPE_H__
@@ -29,8 +29,11 @@
 #include <cstring>
 #include <cstdio>
 #include <cstdlib>
+#include <algorithm>
 #include <unistd.h>
+#include <fcntl.h>
 #include <sys/wait.h>
+#include <sys/stat.h>
 #include "rgy_pipe.h"
 
 RGYPipeProcessLinux::RGYPipeProcessLinux() {
@@ -102,4 +105,40 @@ bool RGYPipeProcessLinux::processAlive() {
     int status = 0;
     return 0 == waitpid(m_phandle, &status, WNOHANG);
 }
+
+bool rgy_is_pipe(FILE *fp) {
+    struct stat st;
+    return fstat(fileno(fp), &st) == 0 && S_ISFIFO(st.st_mode);
+}
+
+int rgy_set_pipe_size(FILE *fp, int size) {
+    if (!rgy_is_pipe(fp)) {
+        return 0;
+    }
+#if defined(F_SETPIPE_SZ)
+    const int fd = fileno(fp);
+    const int currentSize = fcntl(fd, F_GETPIPE_SZ);
+    if (currentSize >= size) {
+        return currentSize;
+    }
+    if (fcntl(fd, F_SETPIPE_SZ, size) < 0) {
+        //非特権プロセスではpipe-max-sizeまでしか拡大できないので、上限で再試行する
+        int maxSize = 0;
+        FILE *fpMax = fopen("/proc/sys/fs/pipe-max-size", "r");
+        if (fpMax) {
+            if (fscanf(fpMax, "%d", &maxSize) != 1) {
+                maxSize = 0;
+            }
+            fclose(fpMax);
+        }
+        if (maxSize > currentSize) {
+            fcntl(fd, F_SETPIPE_SZ, maxSize);
+        }
+    }
+    return (std::max)(fcntl(fd, F_GETPIPE_SZ), 0);
+#else
+    UNREFERENCED_PARAMETER(size);
+    return 0;
+#endif
+}
 #endif //#if !(defined(_WIN32) || defined(_WIN64))
@@ -0,0 +1,374 @@
+﻿// -----------------------------------------------------------------------------------------
+// QSVEnc/NVEnc by rigaya
+// -----------------------------------------------------------------------------------------
+// The MIT License
+//
+// Copyright (c) 2011-2016 rigaya
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// --------------------------------------------------------------------------------------------
+
+#include <vector>
+#include <fstream>
+#include "rgy_thread_affinity.h"
+#include "rgy_osdep.h"
+#if !(defined(_WIN32) || defined(_WIN64))
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#endif
+
+static void set_cpu(uint64_t *mask, int cpu) {
+    mask[cpu >> 6] |= (uint64_t)1 << (cpu & 63);
+}
+
+static bool cpu_mask_empty(const uint64_t *mask) {
+    for (int i = 0; i < RGY_THREAD_AFFINITY_MAX_CPU / 64; i++) {
+        if (mask[i]) return false;
+    }
+    return true;
+}
+
+//"0:2-5:8" のような整数のリストを展開する
+static int parse_int_list(std::vector<int>& list, const tstring& str, int maxValue) {
+    for (const auto& item : split(str, _T(":"))) {
+        int start = 0, end = 0;
+        if (2 == _stscanf_s(item.c_str(), _T("%d-%d"), &start, &end)) {
+        } else if (1 == _stscanf_s(item.c_str(), _T("%d"), &start)) {
+            end = start;
+        } else {
+            return 1;
+        }
+        if (start < 0 || end < start || end >= maxValue) {
+            return 1;
+        }
+        for (int i = start; i <= end; i++) {
+            list.push_back(i);
+        }
+    }
+    return (list.size() > 0) ? 0 : 1;
+}
+
+//NUMAノードに属するCPUをmaskに追加する
+static int add_node_cpus(uint64_t *mask, int node) {
+#if defined(_WIN32) || defined(_WIN64)
+    GROUP_AFFINITY affinity = { 0 };
+    if (!GetNumaNodeProcessorMaskEx((USHORT)node, &affinity) || affinity.Group != 0) {
+        return 1;
+    }
+    for (int i = 0; i < 64; i++) {
+        if (affinity.Mask & ((KAFFINITY)1 << i)) {
+            set_cpu(mask, i);
+        }
+    }
+    return 0;
+#else
+    std::ifstream ifs(strsprintf("/sys/devices/system/node/node%d/cpulist", node));
+    std::string cpulist;
+    if (!ifs || !std::getline(ifs, cpulist)) {
+        return 1;
+    }
+    //"0-7,16-23" の形式
+    for (const auto& item : split(cpulist, ",")) {
+        int start = 0, end = 0;
+        const int ret = sscanf(item.c_str(), "%d-%d", &start, &end);
+        if (ret == 1) {
+            end = start;
+        } else if (ret != 2) {
+            continue;
+        }
+        for (int i = start; i <= end && i < RGY_THREAD_AFFINITY_MAX_CPU; i++) {
+            set_cpu(mask, i);
+        }
+    }
+    return 0;
+#endif
+}
+
+//"[<role>=]<value>" を分解し、対象となる役割のリストを返す
+static int parse_role(std::vector<int>& roles, tstring& value, const tstring& item) {
+    const auto pos = item.find(_T("="));
+    if (pos == tstring::npos || item.substr(0, pos) == _T("all")) {
+        for (int i = 0; i < RGY_THREAD_ROLE_MAX; i++) {
+            roles.push_back(i);
+        }
+    } else {
+        const int role = get_value_from_chr(list_thread_role, item.substr(0, pos).c_str());
+        if (role == PARSE_ERROR_FLAG) {
+            return 1;
+        }
+        roles.push_back(role);
+    }
+    value = (pos == tstring::npos) ? item : item.substr(pos + 1);
+    return 0;
+}
+
+int parse_thread_affinity(RGYThreadAffinityPrm *prm, const TCHAR *str, tstring& err) {
+    for (const auto& item : split(tstring(str), _T(","))) {
+        std::vector<int> roles;
+        tstring value;
+        if (parse_role(roles, value, item)) {
+            err = _T("unknown thread role: ") + item;
+            return 1;
+        }
+        uint64_t mask[RGY_THREAD_AFFINITY_MAX_CPU / 64] = { 0 };
+        if (value == _T("all")) {
+            ; //指定なし
+        } else if (value.substr(0, 2) == _T("0x")) {
+            unsigned long long hex = 0;
+            if (1 != _stscanf_s(value.c_str() + 2, _T("%llx"), &hex) || hex == 0) {
+                err = _T("invalid cpu mask: ") + value;
+                return 1;
+            }
+            mask[0] = hex;
+        } else if (value.substr(0, 8) == _T("logical#")) {
+            std::vector<int> cpus;
+            if (parse_int_list(cpus, value.substr(8), RGY_THREAD_AFFINITY_MAX_CPU)) {
+                err = _T("invalid cpu list: ") + value;
+                return 1;
+            }
+            for (auto cpu : cpus) {
+                set_cpu(mask, cpu);
+            }
+        } else if (value.substr(0, 5) == _T("node#")) {
+            std::vector<int> nodes;
+            if (parse_int_list(nodes, value.substr(5), RGY_THREAD_AFFINITY_MAX_NODE)) {
+                err = _T("invalid node list: ") + value;
+                return 1;
+            }
+            for (auto node : nodes) {
+                if (add_node_cpus(mask, node)) {
+                    err = strsprintf(_T("failed to get cpus of numa node %d."), node);
+                    return 1;
+                }
+            }
+        } else {
+            err = _T("unknown value: ") + value;
+            return 1;
+        }
+        for (auto role : roles) {
+            memcpy(prm->role[role].cpuMask, mask, sizeof(mask));
+        }
+    }
+    return 0;
+}
+
+int parse_thread_mempolicy(RGYThreadAffinityPrm *prm, const TCHAR *str, tstring& err) {
+    for (const auto& item : split(tstring(str), _T(","))) {
+        std::vector<int> roles;
+        tstring value;
+        if (parse_role(roles, value, item)) {
+            err = _T("unknown thread role: ") + item;
+            return 1;
+        }
+        const auto pos = value.find(_T("#"));
+        const int policy = get_value_from_chr(list_mempolicy, value.substr(0, pos).c_str());
+        if (policy == PARSE_ERROR_FLAG) {
+            err = _T("unknown memory policy: ") + value;
+            return 1;
+        }
+        uint64_t nodeMask = 0;
+        const bool needNodes = policy == RGY_MEMPOLICY_BIND || policy == RGY_MEMPOLICY_INTERLEAVE || policy == RGY_MEMPOLICY_PREFERRED;
+        if (needNodes != (pos != tstring::npos)) {
+            err = _T("invalid memory policy: ") + value;
+            return 1;
+        }
+        if (needNodes) {
+            std::vector<int> nodes;
+            if (parse_int_list(nodes, value.substr(pos + 1), RGY_THREAD_AFFINITY_MAX_NODE)
+                || (policy == RGY_MEMPOLICY_PREFERRED && nodes.size() != 1)) {
+                err = _T("invalid node list: ") + value;
+                return 1;
+            }
+            for (auto node : nodes) {
+                nodeMask |= (uint64_t)1 << node;
+            }
+        }
+        for (auto role : roles) {
+            prm->role[role].memPolicy = (int8_t)policy;
+            prm->role[role].nodeMask = nodeMask;
+        }
+    }
+    return 0;
+}
+
+//"0:2-5:8" の形式に戻す
+static tstring print_int_list(const uint64_t *mask, int maxValue) {
+    tstring str;
+    for (int i = 0; i < maxValue; i++) {
+        if (mask[i >> 6] & ((uint64_t)1 << (i & 63))) {
+            int end = i;
+            while (end + 1 < maxValue && (mask[(end + 1) >> 6] & ((uint64_t)1 << ((end + 1) & 63)))) {
+                end++;
+            }
+            str += (str.length() ? _T(":") : _T("")) + ((end > i) ? strsprintf(_T("%d-%d"), i, end) : strsprintf(_T("%d"), i));
+            i = end;
+        }
+    }
+    return str;
+}
+
+tstring print_thread_affinity(const RGYThreadAffinityPrm& prm) {
+    tstring str;
+    for (int i = 0; i < RGY_THREAD_ROLE_MAX; i++) {
+        if (!cpu_mask_empty(prm.role[i].cpuMask)) {
+            str += strsprintf(_T("%s%s=logical#%s"), (str.length() ? _T(",") : _T("")), get_chr_from_value(list_thread_role, i), print_int_list(prm.role[i].cpuMask, RGY_THREAD_AFFINITY_MAX_CPU).c_str());
+        }
+    }
+    return str;
+}
+
+tstring print_thread_mempolicy(const RGYThreadAffinityPrm& prm) {
+    tstring str;
+    for (int i = 0; i < RGY_THREAD_ROLE_MAX; i++) {
+        if (prm.role[i].memPolicy != RGY_MEMPOLICY_DEFAULT) {
+            str += strsprintf(_T("%s%s=%s"), (str.length() ? _T(",") : _T("")), get_chr_from_value(list_thread_role, i), get_chr_from_value(list_mempolicy, prm.role[i].memPolicy));
+            if (prm.role[i].nodeMask) {
+                str += _T("#") + print_int_list(&prm.role[i].nodeMask, RGY_THREAD_AFFINITY_MAX_NODE);
+            }
+        }
+    }
+    return str;
+}
+
+bool thread_affinity_enabled(const RGYThreadAffinityPrm& prm) {
+    for (int i = 0; i < RGY_THREAD_ROLE_MAX; i++) {
+        if (!cpu_mask_empty(prm.role[i].cpuMask) || prm.role[i].memPolicy != RGY_MEMPOLICY_DEFAULT) {
+            return true;
+        }
+    }
+    return false;
+}
+
+RGYThreadAffinity& RGYThreadAffinity::get() {
+    static RGYThreadAffinity instance;
+    return instance;
+}
+
+RGYThreadAffinity::RGYThreadAffinity() :
+    m_mtx(),
+    m_prm(),
+    m_log(),
+    m_enabled(false),
+    m_nRef(0),
+    m_applied() {
+    memset(&m_prm, 0, sizeof(m_prm));
+}
+
+void RGYThreadAffinity::init(const RGYThreadAffinityPrm& prm, std::shared_ptr<RGYLog> log) {
+    std::lock_guard<std::mutex> lock(m_mtx);
+    //ladderなどで複数のパイプラインが並行して動作する場合は、最初の設定を使い続ける
+    if (m_nRef++ > 0) {
+        return;
+    }
+    m_prm = prm;
+    //デコードスレッドの指定がなければ、読み込みスレッドと同じ設定とする
+    auto& dec = m_prm.role[RGY_THREAD_ROLE_DEC];
+    if (cpu_mask_empty(dec.cpuMask) && dec.memPolicy == RGY_MEMPOLICY_DEFAULT) {
+        dec = m_prm.role[RGY_THREAD_ROLE_INPUT];
+    }
+    m_log = log;
+    m_enabled = thread_affinity_enabled(m_prm);
+    memset(m_applied, 0, sizeof(m_applied));
+}
+
+void RGYThreadAffinity::close() {
+    std::lock_guard<std::mutex> lock(m_mtx);
+    if (m_nRef == 0 || --m_nRef > 0) {
+        return;
+    }
+    m_enabled = false;
+    m_log.reset();
+}
+
+bool RGYThreadAffinity::enabled() {
+    std::lock_guard<std::mutex> lock(m_mtx);
+    return m_enabled;
+}
+
+void RGYThreadAffinity::apply(RGYThreadRole role) {
+    std::lock_guard<std::mutex> lock(m_mtx);
+    if (!m_enabled || role < 0 || role >= RGY_THREAD_ROLE_MAX) {
+        return;
+    }
+    const auto& prm = m_prm.role[role];
+    const TCHAR *roleName = get_chr_from_value(list_thread_role, role);
+    bool success = true;
+    if (!cpu_mask_empty(prm.cpuMask)) {
+#if defined(_WIN32) || defined(_WIN64)
+        success &= (0 != SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)prm.cpuMask[0]));
+#else
+        cpu_set_t cpuset;
+        CPU_ZERO(&cpuset);
+        for (int i = 0; i < RGY_THREAD_AFFINITY_MAX_CPU && i < CPU_SETSIZE; i++) {
+            if (prm.cpuMask[i >> 6] & ((uint64_t)1 << (i & 63))) {
+                CPU_SET(i, &cpuset);
+            }
+        }
+        success &= (0 == pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset));
+#endif
+    }
+    if (prm.memPolicy != RGY_MEMPOLICY_DEFAULT) {
+#if defined(_WIN32) || defined(_WIN64)
+        //Windowsではスレッドごとのメモリポリシーは設定できない
+        if (m_log) m_log->write(RGY_LOG_DEBUG, _T("thread affinity: %s: memory policy is not supported on this platform.\n"), roleName);
+#else
+        //linux/mempolicy.hの値
+        static const int MPOL_PREFERRED_ = 1, MPOL_BIND_ = 2, MPOL_INTERLEAVE_ = 3, MPOL_LOCAL_ = 4;
+        int mode = MPOL_LOCAL_;
+        switch (prm.memPolicy) {
+        case RGY_MEMPOLICY_BIND:       mode = MPOL_BIND_; break;
+        case RGY_MEMPOLICY_INTERLEAVE: mode = MPOL_INTERLEAVE_; break;
+        case RGY_MEMPOLICY_PREFERRED:  mode = MPOL_PREFERRED_; break;
+        default: break;
+        }
+        unsigned long nodemask[64 / (sizeof(unsigned long) * 8)];
+        memcpy(nodemask, &prm.nodeMask, sizeof(nodemask));
+        const long ret = (mode == MPOL_LOCAL_)
+            ? syscall(SYS_set_mempolicy, mode, nullptr, 0)
+            : syscall(SYS_set_mempolicy, mode, nodemask, sizeof(nodemask) * 8 + 1);
+        success &= (ret == 0);
+#endif
+    }
+    m_applied[role] = (success) ? 1 : -1;
+    if (m_log) {
+        m_log->write((success) ? RGY_LOG_DEBUG : RGY_LOG_WARN, _T("thread affinity: %s: %s.\n"), roleName, (success) ? _T("applied") : _T("failed to apply"));
+    }
+}
+
+tstring RGYThreadAffinity::summary() {
+    std::lock_guard<std::mutex> lock(m_mtx);
+    tstring str;
+    for (int i = 0; i < RGY_THREAD_ROLE_MAX; i++) {
+        const auto& prm = m_prm.role[i];
+        if (cpu_mask_empty(prm.cpuMask) && prm.memPolicy == RGY_MEMPOLICY_DEFAULT) {
+            continue;
+        }
+        str += strsprintf(_T("%s%s: cpu %s, mem %s"), (str.length() ? _T(", ") : _T("")), get_chr_from_value(list_thread_role, i),
+            cpu_mask_empty(prm.cpuMask) ? _T("all") : print_int_list(prm.cpuMask, RGY_THREAD_AFFINITY_MAX_CPU).c_str(),
+            get_chr_from_value(list_mempolicy, prm.memPolicy));
+        if (prm.nodeMask) {
+            str += _T("#") + print_int_list(&prm.nodeMask, RGY_THREAD_AFFINITY_MAX_NODE);
+        }
+        str += (m_applied[i] > 0) ? _T(" (applied)") : ((m_applied[i] < 0) ? _T(" (failed)") : _T(""));
+    }
+    return str;
+}
@@ -0,0 +1,131 @@
+﻿// -----------------------------------------------------------------------------------------
+// QSVEnc/NVEnc by rigaya
+// -----------------------------------------------------------------------------------------
+// The MIT License
+//
+// Copyright (c) 2011-2016 rigaya
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// --------------------------------------------------------------------------------------------
+
+#pragma once
+#ifndef __RGY_THREAD_AFFINITY_H__
+#define __RGY_THREAD_AFFINITY_H__
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include "rgy_tchar.h"
+#include "rgy_util.h"
+#include "rgy_log.h"
+
+//スレッドの役割ごとに、使用するCPUとNUMAのメモリポリシーを設定する
+//  - 設定は各スレッドの開始時に、そのスレッド自身から適用する (メモリポリシーは呼び出したスレッドにのみ有効なため)
+//  - 設定はプロセス全体で共通なので、パイプラインごとのinit/closeは参照カウントで管理し、最初のinitの設定を使用する
+//  - CPUの指定は、Linuxではpthread_setaffinity_np、WindowsではSetThreadAffinityMask (プロセッサグループ0のみ) で適用する
+//  - メモリポリシーは、Linuxではset_mempolicyで適用し、Windowsでは未対応
+
+enum RGYThreadRole : int {
+    RGY_THREAD_ROLE_MAIN = 0, //メインスレッド (入力の読み込み)
+    RGY_THREAD_ROLE_ENC,      //エンコードスレッド
+    RGY_THREAD_ROLE_INPUT,    //avhw/avswリーダーの読み込みスレッド
+    RGY_THREAD_ROLE_DEC,      //avswリーダーのデコードスレッド (指定がなければinputの設定を使用する)
+    RGY_THREAD_ROLE_OUTPUT,   //出力スレッド
+    RGY_THREAD_ROLE_AUDPROC,  //音声処理スレッド
+    RGY_THREAD_ROLE_AUDENC,   //音声エンコードスレッド
+    RGY_THREAD_ROLE_MAX
+};
+
+const CX_DESC list_thread_role[] = {
+    { _T("main"),    RGY_THREAD_ROLE_MAIN    },
+    { _T("enc"),     RGY_THREAD_ROLE_ENC     },
+    { _T("input"),   RGY_THREAD_ROLE_INPUT   },
+    { _T("dec"),     RGY_THREAD_ROLE_DEC     },
+    { _T("output"),  RGY_THREAD_ROLE_OUTPUT  },
+    { _T("audproc"), RGY_THREAD_ROLE_AUDPROC },
+    { _T("audenc"),  RGY_THREAD_ROLE_AUDENC  },
+    { NULL, 0 }
+};
+
+enum RGYMemPolicy : int8_t {
+    RGY_MEMPOLICY_DEFAULT = 0, //指定なし
+    RGY_MEMPOLICY_LOCAL,       //スレッドが動作しているノード
+    RGY_MEMPOLICY_BIND,        //指定したノードのみ
+    RGY_MEMPOLICY_INTERLEAVE,  //指定したノードに交互に割り当て
+    RGY_MEMPOLICY_PREFERRED,   //指定したノードを優先
+};
+
+const CX_DESC list_mempolicy[] = {
+    { _T("default"),    RGY_MEMPOLICY_DEFAULT    },
+    { _T("local"),      RGY_MEMPOLICY_LOCAL      },
+    { _T("bind"),       RGY_MEMPOLICY_BIND       },
+    { _T("interleave"), RGY_MEMPOLICY_INTERLEAVE },
+    { _T("preferred"),  RGY_MEMPOLICY_PREFERRED  },
+    { NULL, 0 }
+};
+
+static const int RGY_THREAD_AFFINITY_MAX_CPU = 256;
+static const int RGY_THREAD_AFFINITY_MAX_NODE = 64;
+
+struct RGYThreadAffinityRolePrm {
+    uint64_t cpuMask[RGY_THREAD_AFFINITY_MAX_CPU / 64]; //使用するCPU (すべて0なら指定なし)
+    uint64_t nodeMask;  //メモリポリシーの対象のノード
+    int8_t   memPolicy; //RGY_MEMPOLICY_xxx
+    int8_t   reserved[7];
+};
+
+struct RGYThreadAffinityPrm {
+    RGYThreadAffinityRolePrm role[RGY_THREAD_ROLE_MAX];
+};
+
+//--thread-affinity [<role>=]{all|logical#<int>[:<int>]...|node#<int>[:<int>]...|0x<hex>}[,...]
+//  <role>を省略した場合はすべての役割に設定する、<int>は"0-7"のように範囲でも指定できる
+int parse_thread_affinity(RGYThreadAffinityPrm *prm, const TCHAR *str, tstring& err);
+//--thread-mempolicy [<role>=]{default|local|bind#<node>[:<node>]...|interleave#<node>[:<node>]...|preferred#<node>}[,...]
+int parse_thread_mempolicy(RGYThreadAffinityPrm *prm, const TCHAR *str, tstring& err);
+//コマンドラインの形式に戻す
+tstring print_thread_affinity(const RGYThreadAffinityPrm& prm);
+tstring print_thread_mempolicy(const RGYThreadAffinityPrm& prm);
+bool thread_affinity_enabled(const RGYThreadAffinityPrm& prm);
+
+class RGYThreadAffinity {
+public:
+    static RGYThreadAffinity& get();
+
+    //initとcloseは対で呼ぶ (すべてcloseされるまで設定を保持する)
+    void init(const RGYThreadAffinityPrm& prm, std::shared_ptr<RGYLog> log);
+    void close();
+    bool enabled();
+    //呼び出したスレッドに、roleの設定を適用する (各スレッドの開始時に呼ぶ)
+    void apply(RGYThreadRole role);
+    //設定と適用結果 (性能モニタ・ログ用)
+    tstring summary();
+protected:
+    RGYThreadAffinity();
+
+    std::mutex m_mtx;
+    RGYThreadAffinityPrm m_prm;
+    std::shared_ptr<RGYLog> m_log;
+    bool m_enabled;
+    int m_nRef; //initされている数
+    int m_applied[RGY_THREAD_ROLE_MAX]; //0: 未適用, 1: 適用済み, -1: 失敗
+};
+
+#endif //__RGY_THREAD_AFFINITY_H__
@@ -46,6 +46,7 @@
 #include <list>
 #include <sstream>
 #include <functional>
+#include <algorithm>
 #include <type_traits>
 #include "rgy_osdep.h"
 #include "rgy_err.h"
@@ -915,26 +916,71 @@ static bool inline trim_active(const sTrimParam *pTrim) {
     return true;
 }
 
+//trimのリストを開始フレーム順に並べ、重なっている領域を結合する
+//frame_inside_range等はこの形に正規化されたリストを前提とする
+static void inline normalize_trim_list(std::vector<sTrim>& trimList) {
+    std::sort(trimList.begin(), trimList.end(), [](const sTrim& trimA, const sTrim& trimB) { return trimA.start < trimB.start; });
+    size_t count = 0;
+    for (size_t i = 0; i < trimList.size(); i++) {
+        if (count > 0 && trimList[i].start <= trimList[count-1].fin) {
+            trimList[count-1].fin = (std::max)(trimList[count-1].fin, trimList[i].fin);
+        } else {
+            trimList[count++] = trimList[i];
+        }
+    }
+    trimList.resize(count);
+}
+
 //block index (空白がtrimで削除された領域)
 //       #0       #0         #1         #1       #2    #2
 //   |        |----------|         |----------|     |------
+//リストは正規化されている(開始フレーム順で重なりがない)ので、finも昇順に並んでおり、二分探索で求められる
 static std::pair<bool, int> inline frame_inside_range(int frame, const std::vector<sTrim>& trimList) {
-    int index = 0;
     if (trimList.size() == 0) {
-        return std::make_pair(true, index);
+        return std::make_pair(true, 0);
     }
     if (frame < 0) {
+        return std::make_pair(false, 0);
+    }
+    //frame <= finとなる最初の領域
+    const auto it = std::lower_bound(trimList.begin(), trimList.end(), frame, [](const sTrim& trim, int value) { return trim.fin < value; });
+    const int index = (int)(it - trimList.begin());
+    if (it == trimList.end()) {
         return std::make_pair(false, index);
     }
-    for (; index < (int)trimList.size(); index++) {
-        if (frame < trimList[index].start) {
-            return std::make_pair(false, index);
-        }
-        if (frame <= trimList[index].fin) {
-            return std::make_pair(true, index);
-        }
+    return std::make_pair(frame >= it->start, index);
+}
+
+//trimで削除されるフレーム数の累積を、各領域ごとに求める
+//cutFrames[i] ... 領域iの開始までに削除されるフレーム数
+static std::vector<int> inline trim_cut_frames(const std::vector<sTrim>& trimList) {
+    std::vector<int> cutFrames(trimList.size());
+    int cut = 0;
+    int lastFin = 0;
+    for (size_t i = 0; i < trimList.size(); i++) {
+        cut += trimList[i].start - lastFin;
+        cutFrames[i] = cut;
+        lastFin = trimList[i].fin;
+    }
+    return cutFrames;
+}
+
+//frameより前にtrimで削除されるフレーム数を、trim_cut_framesで求めた累積値から求める
+//frameが削除される場合は、lastValidFrameなら直前の有効なフレームの直後とみなしたときの値を返し、
+//そうでなければfirstにfalseを返す
+static std::pair<bool, int> inline trim_cut_frames_before(int frame, const std::vector<sTrim>& trimList, const std::vector<int>& cutFrames, bool lastValidFrame) {
+    if (trimList.size() == 0) {
+        return std::make_pair(true, 0);
+    }
+    const auto range = frame_inside_range(frame, trimList);
+    const int index = range.second;
+    if (range.first) {
+        return std::make_pair(true, cutFrames[index]);
+    } else if (index < (int)trimList.size() && !lastValidFrame) {
+        return std::make_pair(false, 0);
     }
-    return std::make_pair(false, index);
+    //最後の有効なフレームの直後とする
+    return std::make_pair(true, (index > 0) ? cutFrames[index-1] + frame - trimList[index-1].fin : frame);
 }
 
 static bool inline rearrange_trim_list(int frame, int offset, std::vector<sTrim>& trimList) {
@@ -0,0 +1,387 @@
+﻿// -----------------------------------------------------------------------------------------
+// QSVEnc/NVEnc by rigaya
+// -----------------------------------------------------------------------------------------
+// The MIT License
+//
+// Copyright (c) 2011-2016 rigaya
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// --------------------------------------------------------------------------------------------
+
+#include <algorithm>
+#include <cerrno>
+#if defined(_WIN32) || defined(_WIN64)
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#endif
+#include "rgy_writebehind.h"
+#include "rgy_thread_affinity.h"
+
+RGYWriteBehindFile::RGYWriteBehindFile() :
+#if defined(_WIN32) || defined(_WIN64)
+    m_hFile(INVALID_HANDLE_VALUE),
+#else
+    m_fd(-1),
+#endif
+    m_nBlockSize(0),
+    m_blockBuf(),
+    m_qFree(),
+    m_qFilled(),
+    m_current(),
+    m_mtx(),
+    m_cvFilled(),
+    m_cvFree(),
+    m_thread(),
+    m_bAbort(false),
+    m_nWriting(0),
+    m_nError(0),
+    m_nPos(0),
+    m_nFileSize(0),
+    m_bPreallocated(false),
+    m_pQueueUsage(nullptr) {
+    memset(&m_current, 0, sizeof(m_current));
+}
+
+RGYWriteBehindFile::~RGYWriteBehindFile() {
+    close();
+}
+
+bool RGYWriteBehindFile::is_open() const {
+#if defined(_WIN32) || defined(_WIN64)
+    return m_hFile != INVALID_HANDLE_VALUE;
+#else
+    return m_fd >= 0;
+#endif
+}
+
+int RGYWriteBehindFile::open(const TCHAR *filename, size_t bufferSize, size_t blockSize, int64_t preallocSize, size_t *pQueueUsage) {
+    close();
+#if defined(_WIN32) || defined(_WIN64)
+    //"movflags:faststart"にするには、共有モードで開けるようにする必要がある
+    m_hFile = CreateFile(filename, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (m_hFile == INVALID_HANDLE_VALUE) {
+        return (GetLastError() == ERROR_ACCESS_DENIED) ? EACCES : ENOENT;
+    }
+#else
+    m_fd = ::open(filename, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if (m_fd < 0) {
+        return errno;
+    }
+#endif
+    m_nPos = 0;
+    m_nFileSize = 0;
+    m_nError = 0;
+    m_nWriting = 0;
+    m_bAbort = false;
+    m_pQueueUsage = pQueueUsage;
+
+    //ファイルの領域をあらかじめ確保し、断片化とメタデータの更新を減らす
+    //ファイルシステムが対応していなくても、単に確保しないだけとする
+    m_bPreallocated = false;
+    if (preallocSize > 0) {
+#if defined(_WIN32) || defined(_WIN64)
+        FILE_ALLOCATION_INFO allocInfo;
+        allocInfo.AllocationSize.QuadPart = preallocSize;
+        m_bPreallocated = 0 != SetFileInformationByHandle(m_hFile, FileAllocationInfo, &allocInfo, sizeof(allocInfo));
+#elif defined(__linux__)
+        //ファイルサイズは変更せずに領域のみ確保する
+        m_bPreallocated = 0 == fallocate(m_fd, FALLOC_FL_KEEP_SIZE, 0, preallocSize);
+#endif
+    }
+
+    if (bufferSize > 0) {
+        m_nBlockSize = (std::max<size_t>(blockSize, BLOCK_ALIGN) + (BLOCK_ALIGN - 1)) & ~(BLOCK_ALIGN - 1);
+        const size_t nBlocks = std::max<size_t>(2, bufferSize / m_nBlockSize);
+        for (size_t i = 0; i < nBlocks; i++) {
+            uint8_t *ptr = (uint8_t *)_aligned_malloc(m_nBlockSize, BLOCK_ALIGN);
+            if (ptr == nullptr) {
+                close();
+                return ENOMEM;
+            }
+            m_blockBuf.push_back(ptr);
+            Block block = { ptr, 0, 0 };
+            m_qFree.push_back(block);
+        }
+        m_thread = std::thread(&RGYWriteBehindFile::threadFunc, this);
+    }
+    return 0;
+}
+
+void RGYWriteBehindFile::updateQueueUsage() {
+    //m_mtxをロックした状態で呼ぶこと
+    if (m_pQueueUsage) {
+        *m_pQueueUsage = m_qFilled.size() + m_nWriting;
+    }
+}
+
+int RGYWriteBehindFile::writeAt(const uint8_t *buf, size_t size, int64_t offset) {
+    while (size > 0) {
+#if defined(_WIN32) || defined(_WIN64)
+        OVERLAPPED ov = { 0 };
+        ov.Offset     = (DWORD)(offset & 0xffffffff);
+        ov.OffsetHigh = (DWORD)(offset >> 32);
+        DWORD written = 0;
+        if (!WriteFile(m_hFile, buf, (DWORD)std::min<size_t>(size, 1u << 30), &written, &ov)) {
+            return (GetLastError() == ERROR_DISK_FULL) ? ENOSPC : EIO;
+        }
+#else
+        const ssize_t written = pwrite(m_fd, buf, size, offset);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno;
+        }
+#endif
+        if (written == 0) {
+            return EIO;
+        }
+        buf    += written;
+        size   -= written;
+        offset += written;
+    }
+    return 0;
+}
+
+int RGYWriteBehindFile::readAt(uint8_t *buf, size_t size, int64_t offset, size_t *readSize) {
+    *readSize = 0;
+    while (size > 0) {
+#if defined(_WIN32) || defined(_WIN64)
+        OVERLAPPED ov = { 0 };
+        ov.Offset     = (DWORD)(offset & 0xffffffff);
+        ov.OffsetHigh = (DWORD)(offset >> 32);
+        DWORD nRead = 0;
+        if (!ReadFile(m_hFile, buf, (DWORD)std::min<size_t>(size, 1u << 30), &nRead, &ov)) {
+            if (GetLastError() == ERROR_HANDLE_EOF) {
+                break;
+            }
+            return EIO;
+        }
+#else
+        const ssize_t nRead = pread(m_fd, buf, size, offset);
+        if (nRead < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno;
+        }
+#endif
+        if (nRead == 0) {
+            break;
+        }
+        buf       += nRead;
+        size      -= nRead;
+        offset    += nRead;
+        *readSize += nRead;
+    }
+    return 0;
+}
+
+void RGYWriteBehindFile::threadFunc() {
+    RGYThreadAffinity::get().apply(RGY_THREAD_ROLE_OUTPUT);
+    std::unique_lock<std::mutex> lock(m_mtx);
+    for (;;) {
+        m_cvFilled.wait(lock, [this]() { return m_bAbort || !m_qFilled.empty(); });
+        if (m_qFilled.empty()) {
+            break;
+        }
+        Block block = m_qFilled.front();
+        m_qFilled.pop_front();
+        m_nWriting++;
+        lock.unlock();
+        //一度エラーが発生したら、以降は書き込まずにブロックを返却するだけにする
+        const int err = (m_nError) ? 0 : writeAt(block.ptr, block.size, block.offset);
+        lock.lock();
+        if (err && !m_nError) {
+            m_nError = err;
+        }
+        m_nWriting--;
+        block.size = 0;
+        m_qFree.push_back(block);
+        updateQueueUsage();
+        m_cvFree.notify_all();
+    }
+}
+
+RGYWriteBehindFile::Block *RGYWriteBehindFile::getBlock() {
+    if (m_current.ptr == nullptr) {
+        std::unique_lock<std::mutex> lock(m_mtx);
+        m_cvFree.wait(lock, [this]() { return !m_qFree.empty(); });
+        m_current = m_qFree.front();
+        m_qFree.pop_front();
+        m_current.offset = m_nPos;
+        m_current.size = 0;
+    }
+    return &m_current;
+}
+
+int RGYWriteBehindFile::submitBlock() {
+    if (m_current.ptr) {
+        std::lock_guard<std::mutex> lock(m_mtx);
+        if (m_current.size > 0) {
+            m_qFilled.push_back(m_current);
+            updateQueueUsage();
+            m_cvFilled.notify_one();
+        } else {
+            m_qFree.push_back(m_current);
+        }
+        memset(&m_current, 0, sizeof(m_current));
+    }
+    return m_nError;
+}
+
+int RGYWriteBehindFile::write(const uint8_t *buf, int size) {
+    if (!is_open()) {
+        return -EBADF;
+    }
+    if (m_nError) {
+        return -m_nError;
+    }
+    if (!m_thread.joinable()) {
+        //スレッドを使用しない場合はそのまま書き込む
+        const int err = writeAt(buf, size, m_nPos);
+        if (err) {
+            m_nError = err;
+            return -err;
+        }
+        m_nPos += size;
+    } else {
+        //seekされて書き込み位置が連続しなくなったら、新しいブロックに書き込む
+        if (m_current.ptr && m_current.offset + (int64_t)m_current.size != m_nPos) {
+            submitBlock();
+        }
+        size_t remaining = size;
+        while (remaining > 0) {
+            Block *block = getBlock();
+            const size_t copySize = std::min(remaining, m_nBlockSize - block->size);
+            memcpy(block->ptr + block->size, buf, copySize);
+            block->size += copySize;
+            buf         += copySize;
+            remaining   -= copySize;
+            m_nPos      += copySize;
+            if (block->size == m_nBlockSize) {
+                submitBlock();
+            }
+        }
+    }
+    m_nFileSize = std::max(m_nFileSize, m_nPos);
+    return size;
+}
+
+int RGYWriteBehindFile::flush() {
+    if (m_thread.joinable()) {
+        submitBlock();
+        std::unique_lock<std::mutex> lock(m_mtx);
+        m_cvFree.wait(lock, [this]() { return m_qFilled.empty() && m_nWriting == 0; });
+    }
+    return m_nError;
+}
+
+int RGYWriteBehindFile::read(uint8_t *buf, int size) {
+    if (!is_open()) {
+        return -EBADF;
+    }
+    //書き出し待ちのデータを読めるよう、すべて書き出してから読み込む
+    int err = flush();
+    if (err) {
+        return -err;
+    }
+    size_t readSize = 0;
+    if (0 != (err = readAt(buf, size, m_nPos, &readSize))) {
+        return -err;
+    }
+    m_nPos += readSize;
+    return (int)readSize;
+}
+
+int64_t RGYWriteBehindFile::seek(int64_t offset, int whence) {
+    //AVSEEK_SIZEの場合はファイルサイズを返す
+    if (whence & 0x10000) {
+        return m_nFileSize;
+    }
+    int64_t pos = 0;
+    switch (whence & ~0x20000 /*AVSEEK_FORCE*/) {
+    case SEEK_SET: pos = offset; break;
+    case SEEK_CUR: pos = m_nPos + offset; break;
+    case SEEK_END: pos = m_nFileSize + offset; break;
+    default: return -EINVAL;
+    }
+    if (pos < 0) {
+        return -EINVAL;
+    }
+    //書き込み中のブロックはwrite時に位置の連続性をチェックするので、ここでは位置を変えるだけでよい
+    m_nPos = pos;
+    return m_nPos;
+}
+
+int RGYWriteBehindFile::close() {
+    int err = 0;
+    if (is_open()) {
+        err = flush();
+    }
+    if (m_thread.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(m_mtx);
+            m_bAbort = true;
+        }
+        m_cvFilled.notify_all();
+        m_thread.join();
+    }
+    if (is_open()) {
+#if defined(_WIN32) || defined(_WIN64)
+        if (m_bPreallocated) {
+            //確保したが使用しなかった領域を解放する
+            FILE_END_OF_FILE_INFO eofInfo;
+            eofInfo.EndOfFile.QuadPart = m_nFileSize;
+            SetFileInformationByHandle(m_hFile, FileEndOfFileInfo, &eofInfo, sizeof(eofInfo));
+        }
+        CloseHandle(m_hFile);
+        m_hFile = INVALID_HANDLE_VALUE;
+#else
+        if (m_bPreallocated) {
+            //確保したが使用しなかった領域を解放する
+            if (ftruncate(m_fd, m_nFileSize) != 0 && !err) {
+                err = errno;
+            }
+        }
+        if (::close(m_fd) != 0 && !err) {
+            err = errno;
+        }
+        m_fd = -1;
+#endif
+    }
+    for (auto ptr : m_blockBuf) {
+        _aligned_free(ptr);
+    }
+    m_blockBuf.clear();
+    m_qFree.clear();
+    m_qFilled.clear();
+    memset(&m_current, 0, sizeof(m_current));
+    m_bPreallocated = false;
+    m_bAbort = false;
+    if (m_pQueueUsage) {
+        *m_pQueueUsage = 0;
+        m_pQueueUsage = nullptr;
+    }
+    return err;
+}
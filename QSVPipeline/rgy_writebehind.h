@@ -0,0 +1,122 @@
+﻿// -----------------------------------------------------------------------------------------
+// QSVEnc/NVEnc by rigaya
+// -----------------------------------------------------------------------------------------
+// The MIT License
+//
+// Copyright (c) 2011-2016 rigaya
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// --------------------------------------------------------------------------------------------
+
+#pragma once
+#ifndef __RGY_WRITEBEHIND_H__
+#define __RGY_WRITEBEHIND_H__
+
+#include <cstdint>
+#include <cstddef>
+#include <deque>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include "rgy_osdep.h"
+#include "rgy_tchar.h"
+
+//書き込みをページ境界にアラインしたブロックにコピーし、専用のスレッドから
+//オフセット指定の書き込み(pwrite/WriteFile+OVERLAPPED)で出力するファイル
+//  - 書き込み元のスレッドは、空きブロックがある限りI/Oの遅延でブロックしない
+//  - 各ブロックは書き込み先のオフセットを保持しているので、seekしてからの書き込み
+//    (mp4のmoovの書き戻しなど)もキューに入れたまま正しく処理できる
+//  - 読み込み(faststartの処理など)の際は、キューにたまっているブロックをすべて書き出してから読み込む
+//スレッドセーフではないので、write/read/seek/closeは単一のスレッドから呼ぶこと
+class RGYWriteBehindFile {
+public:
+    static const size_t BLOCK_ALIGN = 4096;
+
+    RGYWriteBehindFile();
+    ~RGYWriteBehindFile();
+
+    //fileを書き込み用に開く
+    //bufferSize    ... ブロックの合計サイズ (0ならスレッドを使用せず、そのまま書き込む)
+    //blockSize     ... 1ブロックのサイズ (BLOCK_ALIGNの倍数に切り上げる)
+    //preallocSize  ... 0より大きければ、その大きさの領域をあらかじめ確保する (失敗しても継続する)
+    //pQueueUsage   ... 書き出し待ちのブロック数を格納する (nullptrなら格納しない)
+    int open(const TCHAR *filename, size_t bufferSize, size_t blockSize, int64_t preallocSize, size_t *pQueueUsage);
+
+    //書き込んだバイト数を返す、エラーの場合は負の値を返す
+    int write(const uint8_t *buf, int size);
+    //読み込んだバイト数を返す、エラーの場合は負の値を返す
+    int read(uint8_t *buf, int size);
+    //whenceはSEEK_SET/SEEK_CUR/SEEK_END/AVSEEK_SIZE(0x10000)、移動後の位置(AVSEEK_SIZEではファイルサイズ)を返す
+    int64_t seek(int64_t offset, int whence);
+    //キューにたまっているブロックをすべて書き出す
+    int flush();
+    //すべて書き出してからファイルを閉じる
+    int close();
+
+    bool is_open() const;
+    //書き込みエラーの際のerrno (エラーがなければ0)
+    int error() const {
+        return m_nError;
+    }
+    //ファイルの領域をあらかじめ確保したかどうか
+    bool preallocated() const {
+        return m_bPreallocated;
+    }
+protected:
+    struct Block {
+        uint8_t *ptr;
+        int64_t offset; //書き込み先のファイル内の位置
+        size_t size;    //書き込むサイズ
+    };
+    //現在書き込み中のブロックをキューに送る
+    int submitBlock();
+    //書き込み中のブロックを取得する (必要なら空きブロックを待つ)
+    Block *getBlock();
+    void threadFunc();
+    int writeAt(const uint8_t *buf, size_t size, int64_t offset);
+    int readAt(uint8_t *buf, size_t size, int64_t offset, size_t *readSize);
+    void updateQueueUsage();
+
+#if defined(_WIN32) || defined(_WIN64)
+    HANDLE m_hFile;
+#else
+    int m_fd;
+#endif
+    size_t m_nBlockSize;
+    std::vector<uint8_t *> m_blockBuf;  //確保したブロックのバッファ
+    std::deque<Block> m_qFree;          //空きブロック
+    std::deque<Block> m_qFilled;        //書き出し待ちのブロック
+    Block m_current;                    //現在書き込み中のブロック (ptr == nullptrなら未取得)
+    std::mutex m_mtx;
+    std::condition_variable m_cvFilled; //書き出し待ちのブロックが追加された
+    std::condition_variable m_cvFree;   //空きブロックが返却された
+    std::thread m_thread;
+    bool m_bAbort;
+    int m_nWriting;                     //I/Oスレッドで書き込み中のブロック数
+    std::atomic<int> m_nError;
+    int64_t m_nPos;                     //現在の位置
+    int64_t m_nFileSize;                //ファイルの論理的なサイズ
+    bool m_bPreallocated;
+    size_t *m_pQueueUsage;
+};
+
+#endif //__RGY_WRITEBEHIND_H__
@@ -0,0 +1,118 @@
+﻿// -----------------------------------------------------------------------------------------
+// QSVEnc/NVEnc by rigaya
+// -----------------------------------------------------------------------------------------
+// The MIT License
+//
+// Copyright (c) 2011-2016 rigaya
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// --------------------------------------------------------------------------------------------
+
+#pragma once
+#ifndef __RGY_TEST_H__
+#define __RGY_TEST_H__
+
+#include <cstdio>
+#include <cstdint>
+#include <vector>
+
+//単体テスト用の簡易的な仕組み
+//  RGY_TEST(name) { ... } でテストを登録し、RGY_CHECK / RGY_CHECK_EQ で確認する
+//  各テストファイルは int main() { return rgy_test_run_all(); } で登録したテストをすべて実行する
+//  失敗した確認があれば、その内容を表示して0以外を返す (make checkはこれで停止する)
+
+struct RGYTestCase {
+    const char *name;
+    void (*func)();
+};
+
+static std::vector<RGYTestCase>& rgy_test_list() {
+    static std::vector<RGYTestCase> list;
+    return list;
+}
+
+static int& rgy_test_fail_count() {
+    static int count = 0;
+    return count;
+}
+
+struct RGYTestRegister {
+    RGYTestRegister(const char *name, void (*func)()) {
+        rgy_test_list().push_back({ name, func });
+    }
+};
+
+#define RGY_TEST(name) \
+    static void rgy_test_##name(); \
+    static RGYTestRegister rgy_test_register_##name(#name, rgy_test_##name); \
+    static void rgy_test_##name()
+
+#define RGY_CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            rgy_test_fail_count()++; \
+        } \
+    } while (0)
+
+//整数値の比較用 (失敗時に両方の値を表示する)
+#define RGY_CHECK_EQ(a, b) \
+    do { \
+        const long long rgy_check_a = (long long)(a); \
+        const long long rgy_check_b = (long long)(b); \
+        if (rgy_check_a != rgy_check_b) { \
+            fprintf(stderr, "%s:%d: check failed: %s == %s (%lld vs %lld)\n", __FILE__, __LINE__, #a, #b, rgy_check_a, rgy_check_b); \
+            rgy_test_fail_count()++; \
+        } \
+    } while (0)
+
+static int rgy_test_run_all() {
+    int failedTests = 0;
+    for (const auto& test : rgy_test_list()) {
+        const int failBefore = rgy_test_fail_count();
+        test.func();
+        const bool ok = failBefore == rgy_test_fail_count();
+        fprintf(stderr, "  %-40s %s\n", test.name, (ok) ? "OK" : "NG");
+        if (!ok) {
+            failedTests++;
+        }
+    }
+    return (failedTests) ? 1 : 0;
+}
+
+//テストで使用する簡易な乱数 (環境によらず同じ系列を生成する)
+class RGYTestRandom {
+public:
+    RGYTestRandom(uint32_t seed) : m_state(seed ? seed : 1) {};
+    uint32_t next() {
+        m_state ^= m_state << 13;
+        m_state ^= m_state >> 17;
+        m_state ^= m_state << 5;
+        return m_state;
+    }
+    //[min, max]の範囲の値を返す
+    int range(int min, int max) {
+        return min + (int)(next() % (uint32_t)(max - min + 1));
+    }
+protected:
+    uint32_t m_state;
+};
+
+#endif //__RGY_TEST_H__
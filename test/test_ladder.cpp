@@ -0,0 +1,246 @@
+﻿// -----------------------------------------------------------------------------------------
+// QSVEnc/NVEnc by rigaya
+// -----------------------------------------------------------------------------------------
+// The MIT License
+//
+// Copyright (c) 2011-2016 rigaya
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// --------------------------------------------------------------------------------------------
+
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <cstring>
+#include <unistd.h>
+#include "rgy_util.h"
+#include "qsv_cmd.h"
+#include "qsv_pipeline.h"
+#include "qsv_ladder.h"
+#include "rgy_test.h"
+
+static const int TEST_WIDTH = 64;
+static const int TEST_HEIGHT = 48;
+static const int TEST_FRAMES = 40;
+
+static std::string test_path(const char *name) {
+    return strsprintf("/tmp/qsvenc_test_ladder_%d_%s", (int)getpid(), name);
+}
+
+//フレームごとに異なる模様のy4mファイルを作成する
+static bool write_test_y4m(const std::string& path) {
+    FILE *fp = nullptr;
+    if (fopen_s(&fp, path.c_str(), "wb") || fp == nullptr) {
+        return false;
+    }
+    fprintf(fp, "YUV4MPEG2 W%d H%d F30:1 Ip A1:1 C420jpeg\n", TEST_WIDTH, TEST_HEIGHT);
+    std::vector<uint8_t> buf(TEST_WIDTH * TEST_HEIGHT * 3 / 2);
+    for (int i = 0; i < TEST_FRAMES; i++) {
+        for (int y = 0; y < TEST_HEIGHT; y++) {
+            for (int x = 0; x < TEST_WIDTH; x++) {
+                buf[y * TEST_WIDTH + x] = (uint8_t)(x * 3 + y * 5 + i * 11 + ((x ^ y) & i));
+            }
+        }
+        memset(buf.data() + TEST_WIDTH * TEST_HEIGHT, 128 + i, TEST_WIDTH * TEST_HEIGHT / 2);
+        fprintf(fp, "FRAME\n");
+        fwrite(buf.data(), 1, buf.size(), fp);
+    }
+    fclose(fp);
+    return true;
+}
+
+//コマンドラインを解析して、エンコード(--ladderの指定があればラダーエンコード)を行う
+static int test_run_encode(const std::string& args) {
+    std::vector<tstring> argList = split(args, " ");
+    std::vector<const TCHAR *> argv;
+    argv.push_back(_T("qsvencc"));
+    for (const auto& arg : argList) {
+        argv.push_back(arg.c_str());
+    }
+    const int argc = (int)argv.size();
+    argv.push_back(_T(""));
+
+    sInputParams prm = { 0 };
+    init_qsvp_prm(&prm);
+    ParseCmdError err;
+    if (parse_cmd(&prm, argv.data(), argc, err) != 0) {
+        fprintf(stderr, "failed to parse: %s\n", args.c_str());
+        return 1;
+    }
+    int ret = 0;
+    if (prm.nLadderRungs > 0) {
+        bool bAbort = false;
+        ret = qsv_run_ladder(&prm, &bAbort);
+    } else {
+        unique_ptr<CQSVPipeline> pPipeline(new CQSVPipeline);
+        ret = (pPipeline->Init(&prm) < MFX_ERR_NONE || pPipeline->Run() < MFX_ERR_NONE) ? 1 : 0;
+        pPipeline->Close();
+    }
+    rgy_free(prm.pLadderRungs);
+    rgy_free(prm.pTrimList);
+    return ret;
+}
+
+//--sw-sessionのエンコーダが出力したフレームの情報 ("QSVSW frame=... pts=... type=... sum=...") を取り出す
+static std::vector<std::string> read_sw_frames(const std::string& path) {
+    std::vector<std::string> frames;
+    FILE *fp = nullptr;
+    if (fopen_s(&fp, path.c_str(), "rb") || fp == nullptr) {
+        return frames;
+    }
+    std::string data;
+    char buf[4096];
+    size_t len = 0;
+    while ((len = fread(buf, 1, sizeof(buf), fp)) > 0) {
+        data.append(buf, len);
+    }
+    fclose(fp);
+    const std::string startCode("\x00\x00\x00\x01", 4);
+    for (size_t pos = data.find("QSVSW "); pos != std::string::npos; pos = data.find("QSVSW ", pos)) {
+        const size_t end = data.find(startCode, pos);
+        frames.push_back(data.substr(pos, (end == std::string::npos) ? std::string::npos : end - pos));
+        if (end == std::string::npos) {
+            break;
+        }
+        pos = end;
+    }
+    return frames;
+}
+
+//各段の出力が、その解像度で単独にエンコードした場合と同じフレーム・タイムスタンプ・画素になること
+RGY_TEST(fan_out_matches_single_encode) {
+    const auto input = test_path("in.y4m");
+    RGY_CHECK(write_test_y4m(input));
+    //前処理にvppの処理がないとパイプラインを構成できないので、denoiseを指定する
+    const std::string common = " --sw-session busy=3,reorder=2 --vpp-denoise 50 --log-level error";
+    const int rungSize[][2] = { { 64, 48 }, { 32, 24 }, { 16, 12 } };
+    const auto ladderDst = test_path("ladder.264");
+    RGY_CHECK_EQ(test_run_encode("--y4m -i " + input + " -o " + ladderDst + common
+        + " --ladder 64x48:1000,32x24:500,16x12:200"), 0);
+
+    std::vector<std::vector<std::string>> rungFrames;
+    for (const auto& size : rungSize) {
+        sLadderRung rung = { 0 };
+        rung.nWidth = size[0];
+        rung.nHeight = size[1];
+        const auto rungDst = qsv_ladder_output_filename(ladderDst.c_str(), rung);
+        const auto singleDst = test_path(strsprintf("single_%dx%d.264", size[0], size[1]).c_str());
+        RGY_CHECK_EQ(test_run_encode("--y4m -i " + input + " -o " + singleDst + common
+            + strsprintf(" --output-res %dx%d", size[0], size[1])), 0);
+
+        const auto frames = read_sw_frames(rungDst);
+        const auto framesSingle = read_sw_frames(singleDst);
+        RGY_CHECK_EQ(frames.size(), TEST_FRAMES);
+        RGY_CHECK(frames == framesSingle);
+        for (int i = 0; i < (int)frames.size(); i++) {
+            RGY_CHECK(frames[i].find(strsprintf("QSVSW frame=%d ", i)) == 0);
+        }
+        rungFrames.push_back(frames);
+        unlink(rungDst.c_str());
+        unlink(singleDst.c_str());
+    }
+    //各段で異なる解像度にリサイズされている
+    RGY_CHECK(rungFrames[0] != rungFrames[1]);
+    RGY_CHECK(rungFrames[1] != rungFrames[2]);
+    unlink(input.c_str());
+}
+
+//遅い段があっても、すべての段がすべてのフレームを順に受け取り、
+//前処理はバッファ数を超えてフレームを確保しない (遅い段を待つ)
+RGY_TEST(hub_slow_rung_back_pressure) {
+    const int nRungs = 3;
+    const int nFrameBuf = 4;
+    const int nFrames = 200;
+    QSVLadderHub hub(nRungs, nFrameBuf);
+    std::vector<int> received(nRungs, 0);
+    std::vector<int> errors(nRungs, 0);
+    std::vector<std::thread> threads;
+    for (int rung = 0; rung < nRungs; rung++) {
+        threads.push_back(std::thread([&, rung]() {
+            RGYTestRandom rnd(100 + rung);
+            QSVLadderFrame *frame = nullptr;
+            while ((frame = hub.popFrame(rung)) != nullptr) {
+                if (frame->buf.get()[0] != (uint8_t)received[rung]) {
+                    errors[rung]++;
+                }
+                received[rung]++;
+                //段1は一定間隔で、段2はランダムに処理を遅らせる
+                if ((rung == 1 && (received[rung] % 10) == 0) || (rung == 2 && rnd.range(0, 7) == 0)) {
+                    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                }
+                hub.releaseFrame(frame);
+            }
+        }));
+    }
+    std::vector<QSVLadderFrame *> framesUsed;
+    for (int i = 0; i < nFrames; i++) {
+        auto frame = hub.getFreeFrame(16, 8);
+        RGY_CHECK(frame != nullptr);
+        if (frame == nullptr) {
+            break;
+        }
+        if (std::find(framesUsed.begin(), framesUsed.end(), frame) == framesUsed.end()) {
+            framesUsed.push_back(frame);
+        }
+        frame->buf.get()[0] = (uint8_t)i;
+        hub.pushFrame(frame);
+    }
+    hub.finish();
+    for (auto& th : threads) {
+        th.join();
+    }
+    RGY_CHECK_EQ(hub.frameIn(), nFrames);
+    RGY_CHECK(hub.waitCount() > 0);
+    RGY_CHECK((int)framesUsed.size() <= nFrameBuf);
+    for (int rung = 0; rung < nRungs; rung++) {
+        RGY_CHECK_EQ(received[rung], nFrames);
+        RGY_CHECK_EQ(errors[rung], 0);
+    }
+}
+
+//段がエラーで停止した場合に、abortで前処理の待機が解除される
+RGY_TEST(hub_abort_releases_front_end) {
+    QSVLadderHub hub(2, 2);
+    for (int i = 0; i < 2; i++) {
+        auto frame = hub.getFreeFrame(16, 8);
+        RGY_CHECK(frame != nullptr);
+        hub.pushFrame(frame);
+    }
+    std::atomic<bool> bReturned(false);
+    QSVLadderFrame *frameAfterAbort = (QSVLadderFrame *)1;
+    std::thread th([&]() {
+        frameAfterAbort = hub.getFreeFrame(16, 8);
+        bReturned = true;
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    RGY_CHECK(!bReturned);
+    hub.abort();
+    th.join();
+    RGY_CHECK(frameAfterAbort == nullptr);
+    RGY_CHECK(hub.aborted());
+    RGY_CHECK(hub.popFrame(0) == nullptr);
+}
+
+int main() {
+    return rgy_test_run_all();
+}
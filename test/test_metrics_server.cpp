@@ -0,0 +1,255 @@
+﻿// -----------------------------------------------------------------------------------------
+// QSVEnc/NVEnc by rigaya
+// -----------------------------------------------------------------------------------------
+// The MIT License
+//
+// Copyright (c) 2011-2016 rigaya
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// --------------------------------------------------------------------------------------------
+
+
+#include <map>
+#include <cstring>
+#include <cstdlib>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "rgy_util.h"
+#include "rgy_metrics_server.h"
+#include "rgy_test.h"
+
+//ソケットに接続してrequestを送り、サーバが切断するまでの応答を返す
+//requestがnullptrなら何も送らずに送信側を閉じる
+static std::string metrics_query(const std::string& path, const char *request) {
+    const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return "";
+    }
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy_s(addr.sun_path, path.c_str());
+    std::string response;
+    if (0 == connect(fd, (const sockaddr *)&addr, sizeof(addr))) {
+        if (request) {
+            send(fd, request, strlen(request), MSG_NOSIGNAL);
+        } else {
+            shutdown(fd, SHUT_WR);
+        }
+        char buf[4096];
+        ssize_t len = 0;
+        while ((len = recv(fd, buf, sizeof(buf), 0)) > 0) {
+            response.append(buf, len);
+        }
+    }
+    close(fd);
+    return response;
+}
+
+//Prometheusのテキスト形式を "名前{ラベル}" -> 値 の対応にする
+static std::map<std::string, double> metrics_parse_prometheus(const std::string& text) {
+    std::map<std::string, double> values;
+    for (const auto& line : split(text, "\n")) {
+        if (line.length() == 0 || line[0] == '#') {
+            continue;
+        }
+        const auto pos = line.rfind(' ');
+        if (pos != std::string::npos) {
+            values[line.substr(0, pos)] = atof(line.substr(pos + 1).c_str());
+        }
+    }
+    return values;
+}
+
+//JSONの括弧と引用符の対応を確認する (値に括弧や引用符を含む文字列はない)
+static bool metrics_json_balanced(const std::string& json) {
+    int depth = 0;
+    bool inString = false;
+    for (const char c : json) {
+        if (c == '"') {
+            inString = !inString;
+        } else if (!inString && c == '{') {
+            depth++;
+        } else if (!inString && c == '}') {
+            if (--depth < 0) {
+                return false;
+            }
+        }
+    }
+    return depth == 0 && !inString;
+}
+
+static bool contains(const std::string& str, const std::string& sub) {
+    return str.find(sub) != std::string::npos;
+}
+
+static RGYMetricsSnapshot metrics_test_snapshot() {
+    RGYMetricsSnapshot snapshot;
+    memset(&snapshot, 0, sizeof(snapshot));
+    snapshot.seq = 42;
+    snapshot.encStarted = true;
+    snapshot.finished = false;
+    snapshot.perf.time_us = 12500000;
+    snapshot.perf.fps = 123.5;
+    snapshot.perf.fps_avg = 120.25;
+    snapshot.perf.bitrate_kbps = 4000.0;
+    snapshot.enc.frameIn = 300;
+    snapshot.enc.frameOut = 290;
+    snapshot.enc.frameTotal = 600;
+    snapshot.enc.frameOutIDR = 2;
+    snapshot.enc.outFileSize = 1234567;
+    snapshot.queue.usage_vid_out = 5;
+    //処理段ごとに異なる値を設定し、名前と値の対応を確認する
+    for (int i = 0; i < PERF_STAGE_MAX; i++) {
+        snapshot.stage[i].count  = 100 + i;
+        snapshot.stage[i].avgMs  = 1.5 + i;
+        snapshot.stage[i].lastMs = 2.25 + i;
+        snapshot.stage[i].maxMs  = 10.0 + i;
+    }
+    return snapshot;
+}
+
+static std::string metrics_test_path() {
+    return strsprintf("/tmp/qsvenc_test_metrics_%d.sock", (int)getpid());
+}
+
+RGY_TEST(json_request) {
+    RGYMetricsServer server;
+    const auto path = metrics_test_path();
+    RGY_CHECK(server.init(char_to_tstring(path), nullptr) == RGY_ERR_NONE);
+    server.update(metrics_test_snapshot());
+
+    const auto json = metrics_query(path, "json\n");
+    RGY_CHECK(json.length() > 0 && json[0] == '{');
+    RGY_CHECK(metrics_json_balanced(json));
+    RGY_CHECK(contains(json, "\"seq\":42,"));
+    RGY_CHECK(contains(json, "\"time\":12.500,"));
+    RGY_CHECK(contains(json, "\"started\":true"));
+    RGY_CHECK(contains(json, "\"finished\":false"));
+    RGY_CHECK(contains(json, "\"frames\":{\"in\":300,\"out\":290,\"drop\":0,\"expected\":600,\"idr\":2,"));
+    RGY_CHECK(contains(json, "\"progress\":50.000,"));
+    RGY_CHECK(contains(json, "\"out_bytes\":1234567,"));
+    RGY_CHECK(contains(json, "\"fps\":123.500,\"fps_avg\":120.250,"));
+    RGY_CHECK(contains(json, "\"vid_out\":5"));
+    RGY_CHECK(contains(json, "\"decode\":{\"count\":103,\"last_ms\":5.250,\"avg_ms\":4.500,\"max_ms\":13.000}"));
+    RGY_CHECK(contains(json, "\"vpp\":{\"count\":104,\"last_ms\":6.250,\"avg_ms\":5.500,\"max_ms\":14.000}"));
+    RGY_CHECK(contains(json, "\"filter\":{\"count\":105,\"last_ms\":7.250,\"avg_ms\":6.500,\"max_ms\":15.000}"));
+
+    //何も送らずに閉じた場合もJSONを返す
+    RGY_CHECK(metrics_query(path, nullptr) == json);
+
+    //更新した値が反映される
+    auto snapshot = metrics_test_snapshot();
+    snapshot.seq = 43;
+    snapshot.finished = true;
+    server.update(snapshot);
+    const auto json2 = metrics_query(path, "json\r\n");
+    RGY_CHECK(contains(json2, "\"seq\":43,"));
+    RGY_CHECK(contains(json2, "\"finished\":true"));
+    server.close();
+    //終了後はソケットが削除される
+    RGY_CHECK(access(path.c_str(), F_OK) != 0);
+}
+
+RGY_TEST(prometheus_request) {
+    RGYMetricsServer server;
+    const auto path = metrics_test_path();
+    RGY_CHECK(server.init(char_to_tstring(path), nullptr) == RGY_ERR_NONE);
+    server.update(metrics_test_snapshot());
+
+    const auto text = metrics_query(path, "prometheus\n");
+    auto values = metrics_parse_prometheus(text);
+    RGY_CHECK(contains(text, "# TYPE qsvenc_stage_count counter\n"));
+    RGY_CHECK_EQ(values["qsvenc_up"], 1);
+    RGY_CHECK_EQ(values["qsvenc_encode_started"], 1);
+    RGY_CHECK_EQ(values["qsvenc_frames_total{kind=\"in\"}"], 300);
+    RGY_CHECK_EQ(values["qsvenc_frames_total{kind=\"out\"}"], 290);
+    RGY_CHECK_EQ(values["qsvenc_frames_expected"], 600);
+    RGY_CHECK_EQ(values["qsvenc_output_bytes_total"], 1234567);
+    RGY_CHECK(values["qsvenc_progress_percent"] == 50.0);
+    RGY_CHECK(values["qsvenc_fps{window=\"last\"}"] == 123.5);
+    RGY_CHECK_EQ(values["qsvenc_queue_depth{queue=\"vid_out\"}"], 5);
+    //各処理段の名前と値
+    for (int i = 0; i < PERF_STAGE_MAX; i++) {
+        const std::string stage = PERF_STAGE_NAMES[i];
+        RGY_CHECK(values.count("qsvenc_stage_count{stage=\"" + stage + "\"}") == 1);
+        RGY_CHECK_EQ(values["qsvenc_stage_count{stage=\"" + stage + "\"}"], 100 + i);
+        RGY_CHECK(values["qsvenc_stage_latency_ms{stage=\"" + stage + "\",window=\"last\"}"] == 2.25 + i);
+        RGY_CHECK(values["qsvenc_stage_latency_ms{stage=\"" + stage + "\",window=\"avg\"}"] == 1.5 + i);
+        RGY_CHECK(values["qsvenc_stage_latency_ms{stage=\"" + stage + "\",window=\"max\"}"] == 10.0 + i);
+    }
+    RGY_CHECK_EQ(values["qsvenc_stage_count{stage=\"decode\"}"], 100 + PERF_STAGE_DECODE);
+    RGY_CHECK_EQ(values["qsvenc_stage_count{stage=\"vpp\"}"], 100 + PERF_STAGE_VPP);
+    RGY_CHECK_EQ(values["qsvenc_stage_count{stage=\"filter\"}"], 100 + PERF_STAGE_FILTER);
+
+    //"metrics"も同じ形式
+    RGY_CHECK(metrics_query(path, "metrics\n") == text);
+
+    //HTTPのリクエストにはヘッダを付ける
+    const auto http = metrics_query(path, "GET /metrics HTTP/1.1\r\nHost: localhost\r\n\r\n");
+    RGY_CHECK(http.substr(0, 17) == "HTTP/1.0 200 OK\r\n");
+    RGY_CHECK(contains(http, "Content-Type: text/plain; version=0.0.4\r\n"));
+    RGY_CHECK(contains(http, strsprintf("Content-Length: %d\r\n", (int)text.length())));
+    RGY_CHECK(http.length() > text.length() && http.substr(http.length() - text.length()) == text);
+    const auto httpJson = metrics_query(path, "GET / HTTP/1.1\r\n\r\n");
+    RGY_CHECK(contains(httpJson, "Content-Type: application/json\r\n"));
+    RGY_CHECK(contains(httpJson, "\"seq\":42,"));
+    server.close();
+}
+
+RGY_TEST(stage_latency_counters) {
+    //PerfStageLatencyの集計が各処理段に分かれて加算される
+    PerfStageLatency latency;
+    const auto start = std::chrono::steady_clock::now() - std::chrono::milliseconds(5);
+    latency.add(PERF_STAGE_DECODE, start);
+    latency.add(PERF_STAGE_DECODE, start);
+    latency.add(PERF_STAGE_VPP, start);
+    latency.add(PERF_STAGE_FILTER, start);
+    RGY_CHECK_EQ(latency.stage[PERF_STAGE_DECODE].count.load(), 2);
+    RGY_CHECK_EQ(latency.stage[PERF_STAGE_VPP].count.load(), 1);
+    RGY_CHECK_EQ(latency.stage[PERF_STAGE_FILTER].count.load(), 1);
+    RGY_CHECK_EQ(latency.stage[PERF_STAGE_ENCODE].count.load(), 0);
+    RGY_CHECK(latency.stage[PERF_STAGE_DECODE].max_us.load() >= 5000);
+    RGY_CHECK(latency.stage[PERF_STAGE_DECODE].total_us.load() >= 10000);
+    RGY_CHECK(std::string(PERF_STAGE_NAMES[PERF_STAGE_DECODE]) == "decode");
+    RGY_CHECK(std::string(PERF_STAGE_NAMES[PERF_STAGE_VPP]) == "vpp");
+    RGY_CHECK(std::string(PERF_STAGE_NAMES[PERF_STAGE_FILTER]) == "filter");
+}
+
+RGY_TEST(invalid_path) {
+    RGYMetricsServer server;
+    //通常のファイルは上書きしない
+    const auto path = metrics_test_path() + ".txt";
+    FILE *fp = fopen(path.c_str(), "w");
+    RGY_CHECK(fp != nullptr);
+    if (fp) {
+        fclose(fp);
+    }
+    RGY_CHECK(server.init(char_to_tstring(path), nullptr) == RGY_ERR_INVALID_PARAM);
+    RGY_CHECK(access(path.c_str(), F_OK) == 0);
+    unlink(path.c_str());
+    //長すぎるパス
+    RGY_CHECK(server.init(char_to_tstring(std::string(200, 'a')), nullptr) == RGY_ERR_INVALID_PARAM);
+}
+
+int main() {
+    return rgy_test_run_all();
+}
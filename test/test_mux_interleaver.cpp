@@ -0,0 +1,279 @@
+﻿// -----------------------------------------------------------------------------------------
+// QSVEnc/NVEnc by rigaya
+// -----------------------------------------------------------------------------------------
+// The MIT License
+//
+// Copyright (c) 2011-2016 rigaya
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// --------------------------------------------------------------------------------------------
+
+#include <vector>
+#include <algorithm>
+#include "rgy_osdep.h"
+#include "rgy_mux_interleaver.h"
+#include "rgy_test.h"
+
+//テスト用のパケット (ストリーム内の番号と、追加時に指定したdtsを持つ)
+struct TestPacket {
+    int stream;
+    int index;
+    int64_t dts;
+};
+
+//取り出したパケットを記録し、順序を確認する
+class TestOutput {
+public:
+    TestOutput(int nStreams) : m_packets(), m_count(nStreams, 0), m_errors(0) {};
+
+    //取り出せるパケットをすべて取り出す
+    void drain(RGYMuxInterleaver<TestPacket>& interleaver) {
+        TestPacket packet;
+        int id = -1;
+        int64_t dts = 0;
+        while (interleaver.pop(&packet, &id, &dts)) {
+            //ストリーム内の順序は維持され、取り出したidはパケットのストリームと一致する
+            if (id != packet.stream || packet.index != m_count[id]) {
+                m_errors++;
+            }
+            m_count[id]++;
+            m_packets.push_back(packet);
+            m_dts.push_back(dts);
+        }
+    }
+    //取り出したパケットのdtsが減少しない
+    bool sorted() const {
+        return std::is_sorted(m_dts.begin(), m_dts.end());
+    }
+    const std::vector<TestPacket>& packets() const { return m_packets; }
+    const std::vector<int64_t>& dts() const { return m_dts; }
+    int count(int id) const { return m_count[id]; }
+    int errors() const { return m_errors; }
+protected:
+    std::vector<TestPacket> m_packets;
+    std::vector<int64_t> m_dts;
+    std::vector<int> m_count;
+    int m_errors;
+};
+
+static void test_push(RGYMuxInterleaver<TestPacket>& interleaver, int id, int index, int64_t dts) {
+    TestPacket packet = { id, index, dts };
+    interleaver.push(id, dts, packet);
+}
+
+//映像と、開始位置のずれた2つの音声を、ストリームごとにまとまった単位で追加しても、dts順に出力される
+RGY_TEST(skewed_streams) {
+    RGYMuxInterleaver<TestPacket> interleaver;
+    interleaver.init(INT64_MAX, SIZE_MAX);
+    const int nStreams = 3;
+    for (int i = 0; i < nStreams; i++) {
+        interleaver.addStream(false);
+    }
+    //映像は30fps(3000)、音声0は500先行して1920間隔、音声1は20000遅れて2048間隔 (90kHz)
+    const int64_t start[nStreams] = { 0, -500, 20000 };
+    const int64_t step[nStreams] = { 3000, 1920, 2048 };
+    //1度に追加するパケット数 (muxerへの入力の偏りを模擬する)
+    const int burst[nStreams] = { 1, 8, 30 };
+    const int64_t endDts = 90000 * 20;
+    std::vector<int> index(nStreams, 0);
+    TestOutput output(nStreams);
+    for (bool remain = true; remain; ) {
+        remain = false;
+        for (int id = 0; id < nStreams; id++) {
+            for (int j = 0; j < burst[id]; j++) {
+                const int64_t dts = start[id] + step[id] * index[id];
+                if (dts >= endDts) {
+                    break;
+                }
+                test_push(interleaver, id, index[id]++, dts);
+                remain = true;
+            }
+            output.drain(interleaver);
+        }
+    }
+    interleaver.finishAll();
+    output.drain(interleaver);
+    RGY_CHECK(interleaver.empty());
+    RGY_CHECK_EQ(output.errors(), 0);
+    RGY_CHECK(output.sorted());
+    for (int id = 0; id < nStreams; id++) {
+        RGY_CHECK_EQ(output.count(id), index[id]);
+    }
+    //先行する音声0の先頭が最初に出力される
+    RGY_CHECK(output.packets().size() > 0 && output.packets()[0].stream == 1);
+}
+
+//ストリームごとのdtsの間隔や、追加の順序がランダムにばらついても、dts順に出力される
+RGY_TEST(jittered_streams) {
+    RGYTestRandom rnd(2024);
+    for (int iter = 0; iter < 200; iter++) {
+        RGYMuxInterleaver<TestPacket> interleaver;
+        interleaver.init(INT64_MAX, SIZE_MAX);
+        const int nStreams = rnd.range(1, 5);
+        std::vector<int64_t> lastDts(nStreams);
+        std::vector<int> index(nStreams, 0);
+        std::vector<int> total(nStreams);
+        for (int id = 0; id < nStreams; id++) {
+            interleaver.addStream(false);
+            lastDts[id] = rnd.range(-5000, 5000);
+            total[id] = rnd.range(0, 300);
+        }
+        TestOutput output(nStreams);
+        for (;;) {
+            std::vector<int> remain;
+            for (int id = 0; id < nStreams; id++) {
+                if (index[id] < total[id]) {
+                    remain.push_back(id);
+                }
+            }
+            if (remain.size() == 0) {
+                break;
+            }
+            const int id = remain[rnd.range(0, (int)remain.size() - 1)];
+            //dtsはストリーム内では減少しないが、間隔は揺らぐ (同じdtsの連続も含む)
+            lastDts[id] += rnd.range(0, 4000);
+            test_push(interleaver, id, index[id]++, lastDts[id]);
+            if (index[id] == total[id] && rnd.range(0, 1)) {
+                interleaver.finish(id);
+            }
+            output.drain(interleaver);
+            //待機の上限がなければ、すべてのストリームにパケットがあるか終了するまで出力しない
+            RGY_CHECK(interleaver.waiting() > 0 || interleaver.empty());
+        }
+        interleaver.finishAll();
+        output.drain(interleaver);
+        RGY_CHECK(interleaver.empty());
+        RGY_CHECK_EQ(output.errors(), 0);
+        RGY_CHECK(output.sorted());
+        for (int id = 0; id < nStreams; id++) {
+            RGY_CHECK_EQ(output.count(id), total[id]);
+        }
+        if (rgy_test_fail_count()) {
+            break;
+        }
+    }
+}
+
+//dtsが不明なパケットは、そのストリームの直前のdtsとして扱う
+RGY_TEST(missing_timestamps) {
+    const int64_t DTS_UNKNOWN = RGYMuxInterleaver<TestPacket>::DTS_UNKNOWN;
+    RGYMuxInterleaver<TestPacket> interleaver;
+    interleaver.init(INT64_MAX, SIZE_MAX);
+    const int video = interleaver.addStream(false);
+    const int audio = interleaver.addStream(false);
+    //映像の先頭はdts不明 -> 最も前に出力される
+    test_push(interleaver, video, 0, DTS_UNKNOWN);
+    test_push(interleaver, video, 1, 3000);
+    test_push(interleaver, video, 2, DTS_UNKNOWN); //3000とみなす
+    test_push(interleaver, video, 3, 6000);
+    test_push(interleaver, audio, 0, 1000);
+    test_push(interleaver, audio, 1, DTS_UNKNOWN); //1000とみなす
+    test_push(interleaver, audio, 2, 4000);
+    test_push(interleaver, audio, 3, DTS_UNKNOWN); //4000とみなす
+    interleaver.finishAll();
+    TestOutput output(2);
+    output.drain(interleaver);
+    RGY_CHECK_EQ(output.errors(), 0);
+    RGY_CHECK(output.sorted());
+    const int expectedStream[] = { video, audio, audio, video, video, audio, audio, video };
+    const int64_t expectedDts[] = { DTS_UNKNOWN + 1, 1000, 1000, 3000, 3000, 4000, 4000, 6000 };
+    RGY_CHECK_EQ(output.packets().size(), _countof(expectedStream));
+    for (size_t i = 0; i < output.packets().size() && i < _countof(expectedStream); i++) {
+        RGY_CHECK_EQ(output.packets()[i].stream, expectedStream[i]);
+        RGY_CHECK_EQ(output.dts()[i], expectedDts[i]);
+    }
+}
+
+//あるストリームのパケットが途絶えても、保持するパケットは閾値(個数・dtsの幅)までに抑えられる
+RGY_TEST(bounded_delay) {
+    const size_t maxWaitCount = 16;
+    const int64_t maxWaitDts = 30000;
+    for (int mode = 0; mode < 2; mode++) {
+        RGYMuxInterleaver<TestPacket> interleaver;
+        //mode 0: 個数で制限、mode 1: dtsの幅で制限
+        interleaver.init((mode == 1) ? maxWaitDts : INT64_MAX, (mode == 0) ? maxWaitCount : SIZE_MAX);
+        const int video = interleaver.addStream(false);
+        const int audio = interleaver.addStream(false);
+        TestOutput output(2);
+        int nVideo = 0, nAudio = 0;
+        //映像の保持できるパケット数
+        const int maxHeld = (mode == 0) ? (int)maxWaitCount : (int)(maxWaitDts / 3000) + 1;
+        size_t maxQueued = 0;
+        int64_t maxSpan = 0;
+        for (int i = 0; i < 600; i++) {
+            test_push(interleaver, video, nVideo++, i * 3000);
+            //音声は200-399フレームの間途絶える
+            if (i < 200 || 400 <= i) {
+                test_push(interleaver, audio, nAudio++, i * 3000 + 100);
+            }
+            output.drain(interleaver);
+            //音声の途絶えている間も、映像は遅れて出力される
+            if (i == 399) {
+                RGY_CHECK(output.count(video) >= nVideo - maxHeld);
+            }
+            maxQueued = (std::max)(maxQueued, interleaver.size(video));
+            //映像のdtsは3000間隔なので、保持しているパケットのdtsの幅は個数から求まる
+            if (interleaver.size(video) > 0) {
+                maxSpan = (std::max)(maxSpan, (int64_t)(interleaver.size(video) - 1) * 3000);
+            }
+        }
+        //待機しつづけず、途絶えている間も閾値を超えた分は出力される
+        if (mode == 0) {
+            RGY_CHECK(maxQueued <= maxWaitCount);
+            RGY_CHECK(maxQueued >= maxWaitCount / 2);
+        } else {
+            RGY_CHECK(maxSpan <= maxWaitDts);
+            RGY_CHECK(maxSpan >= maxWaitDts / 2);
+        }
+        interleaver.finishAll();
+        output.drain(interleaver);
+        RGY_CHECK(interleaver.empty());
+        RGY_CHECK_EQ(output.errors(), 0);
+        RGY_CHECK_EQ(output.count(video), nVideo);
+        RGY_CHECK_EQ(output.count(audio), nAudio);
+        //音声の再開後は、再びdts順に出力される
+        const auto& dts = output.dts();
+        RGY_CHECK(std::is_sorted(dts.end() - 200, dts.end()));
+    }
+}
+
+//sparseなストリーム(字幕)にパケットがなくても待機しない
+RGY_TEST(sparse_stream_does_not_wait) {
+    RGYMuxInterleaver<TestPacket> interleaver;
+    interleaver.init(INT64_MAX, SIZE_MAX);
+    const int video = interleaver.addStream(false);
+    const int sub = interleaver.addStream(true);
+    TestOutput output(2);
+    for (int i = 0; i < 10; i++) {
+        test_push(interleaver, video, i, i * 3000);
+        output.drain(interleaver);
+        RGY_CHECK_EQ(output.count(video), i + 1);
+    }
+    test_push(interleaver, sub, 0, 15000);
+    test_push(interleaver, video, 10, 30000);
+    output.drain(interleaver);
+    RGY_CHECK_EQ(output.count(sub), 1);
+    RGY_CHECK_EQ(output.count(video), 11);
+    RGY_CHECK_EQ(output.errors(), 0);
+}
+
+int main() {
+    return rgy_test_run_all();
+}
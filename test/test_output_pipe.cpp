@@ -0,0 +1,233 @@
+﻿// -----------------------------------------------------------------------------------------
+// QSVEnc/NVEnc by rigaya
+// -----------------------------------------------------------------------------------------
+// The MIT License
+//
+// Copyright (c) 2011-2016 rigaya
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// --------------------------------------------------------------------------------------------
+
+
+#include <cstring>
+#include <cerrno>
+#include <chrono>
+#include <thread>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "rgy_output.h"
+#include "rgy_test.h"
+
+//writePipeの途中までしか書き出されない場合の処理を確認するため、writevを置き換える
+//  g_writevLimit > 0 なら、1回のwritevで書き出すバイト数をその値までに制限する
+//  g_writevEintrEvery > 0 なら、その回数おきに何も書き出さずEINTRを返す
+static size_t g_writevLimit = 0;
+static int g_writevEintrEvery = 0;
+static int g_writevCalls = 0;
+static int g_writevPartial = 0; //要求より少ないバイト数を書き出した回数
+static int g_writevEintr = 0;
+
+extern "C" ssize_t writev(int fd, const struct iovec *iov, int iovcnt) {
+    g_writevCalls++;
+    if (g_writevEintrEvery > 0 && (g_writevCalls % g_writevEintrEvery) == 0) {
+        g_writevEintr++;
+        errno = EINTR;
+        return -1;
+    }
+    std::vector<struct iovec> limited;
+    size_t requested = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        requested += iov[i].iov_len;
+        struct iovec vec = iov[i];
+        if (g_writevLimit > 0) {
+            size_t used = 0;
+            for (const auto& v : limited) {
+                used += v.iov_len;
+            }
+            if (used >= g_writevLimit) {
+                break;
+            }
+            vec.iov_len = (std::min)(vec.iov_len, g_writevLimit - used);
+        }
+        limited.push_back(vec);
+    }
+    const ssize_t ret = syscall(SYS_writev, fd, limited.data(), (int)limited.size());
+    if (ret >= 0 && (size_t)ret < requested) {
+        g_writevPartial++;
+    }
+    return ret;
+}
+
+//writePipeを直接呼ぶためのRGYOutputRaw
+class TestOutputRaw : public RGYOutputRaw {
+public:
+    void setPipe(FILE *fp) {
+        m_fDest.reset(fp);
+        m_bOutputIsPipe = true;
+    }
+    size_t write(const vector<RGYBitstreamSpan>& spans) {
+        return writePipe(spans);
+    }
+};
+
+//パイプの読み出し側: EOFまで読み出したデータをすべて保持するか、先頭から比較する
+class TestPipeReader {
+public:
+    TestPipeReader(int fd, size_t chunkSize, const std::vector<uint8_t> *pattern) :
+        m_fd(fd), m_chunkSize(chunkSize), m_pattern(pattern), m_thread(), data(), nBytes(0), nMismatch(0) {
+        m_thread = std::thread([this]() { run(); });
+    }
+    ~TestPipeReader() {
+        join();
+    }
+    void join() {
+        if (m_thread.joinable()) {
+            m_thread.join();
+        }
+        if (m_fd >= 0) {
+            close(m_fd);
+            m_fd = -1;
+        }
+    }
+protected:
+    void run() {
+        std::vector<uint8_t> buffer(m_chunkSize);
+        for (;;) {
+            const ssize_t ret = read(m_fd, buffer.data(), buffer.size());
+            if (ret < 0 && errno == EINTR) {
+                continue;
+            }
+            if (ret <= 0) {
+                break;
+            }
+            if (m_pattern) {
+                //繰り返しのパターンと比較する (大きなデータを保持しないように)
+                for (size_t i = 0; i < (size_t)ret; ) {
+                    const size_t patternPos = (nBytes + i) % m_pattern->size();
+                    const size_t size = (std::min)((size_t)ret - i, m_pattern->size() - patternPos);
+                    nMismatch += memcmp(buffer.data() + i, m_pattern->data() + patternPos, size) != 0;
+                    i += size;
+                }
+            } else {
+                data.insert(data.end(), buffer.data(), buffer.data() + ret);
+            }
+            nBytes += ret;
+        }
+    }
+    int m_fd;
+    size_t m_chunkSize;
+    const std::vector<uint8_t> *m_pattern;
+    std::thread m_thread;
+public:
+    std::vector<uint8_t> data;
+    size_t nBytes;
+    size_t nMismatch;
+};
+
+static std::vector<uint8_t> test_random_data(RGYTestRandom& rnd, size_t size) {
+    std::vector<uint8_t> data(size);
+    for (auto& byte : data) {
+        byte = (uint8_t)rnd.next();
+    }
+    return data;
+}
+
+//ランダムな長さ(0を含む)の区間に分割する
+static std::vector<RGYBitstreamSpan> test_random_spans(RGYTestRandom& rnd, const std::vector<uint8_t>& data, int maxSpan) {
+    std::vector<RGYBitstreamSpan> spans;
+    size_t pos = 0;
+    while (pos < data.size()) {
+        const size_t size = (std::min)(data.size() - pos, (size_t)rnd.range(0, maxSpan));
+        spans.push_back({ data.data() + pos, size });
+        pos += size;
+    }
+    return spans;
+}
+
+RGY_TEST(partial_writes_resume) {
+    RGYTestRandom rnd(4711);
+    const auto data = test_random_data(rnd, 1024 * 1024 + 123);
+    //区間の数はiovの上限(64)を超えるようにする
+    const auto spans = test_random_spans(rnd, data, 3000);
+    RGY_CHECK(spans.size() > 64);
+    const size_t limits[] = { 1, 7, 1000, 2999, 4096, 65537 };
+    for (const size_t limit : limits) {
+        int fds[2];
+        RGY_CHECK_EQ(pipe(fds), 0);
+        TestPipeReader reader(fds[0], 777, nullptr);
+        TestOutputRaw output;
+        output.setPipe(fdopen(fds[1], "wb"));
+
+        g_writevLimit = limit;
+        g_writevEintrEvery = 5;
+        g_writevCalls = 0;
+        g_writevPartial = 0;
+        g_writevEintr = 0;
+        const size_t written = output.write(spans);
+        const int nPartial = g_writevPartial;
+        const int nEintr = g_writevEintr;
+        g_writevLimit = 0;
+        g_writevEintrEvery = 0;
+
+        output.Close();
+        reader.join();
+        RGY_CHECK_EQ(written, data.size());
+        RGY_CHECK(reader.data == data);
+        //区間の途中・境界での再開と、EINTRからの再試行の両方が起きている
+        RGY_CHECK(nPartial > 0);
+        RGY_CHECK(nEintr > 0);
+    }
+}
+
+RGY_TEST(throughput_and_identity) {
+    //1MBのパターンを区間に分けて繰り返し、256MBを書き出す
+    RGYTestRandom rnd(2718);
+    const auto pattern = test_random_data(rnd, 1024 * 1024);
+    const auto patternSpans = test_random_spans(rnd, pattern, 200 * 1024);
+    const int nRepeat = 256;
+
+    int fds[2];
+    RGY_CHECK_EQ(pipe(fds), 0);
+    TestPipeReader reader(fds[0], 1024 * 1024, &pattern);
+    TestOutputRaw output;
+    output.setPipe(fdopen(fds[1], "wb"));
+
+    size_t written = 0;
+    const auto tmStart = std::chrono::steady_clock::now();
+    for (int i = 0; i < nRepeat; i++) {
+        written += output.write(patternSpans);
+    }
+    output.Close();
+    reader.join();
+    const double sec = std::chrono::duration<double>(std::chrono::steady_clock::now() - tmStart).count();
+    const double mbPerSec = (double)written / (1024.0 * 1024.0) / (std::max)(sec, 1e-6);
+    fprintf(stderr, "    %.1f MB/s\n", mbPerSec);
+
+    RGY_CHECK_EQ(written, pattern.size() * nRepeat);
+    RGY_CHECK_EQ(reader.nBytes, written);
+    RGY_CHECK_EQ(reader.nMismatch, 0);
+    //パイプへの書き出しがボトルネックにならないこと (エンコードの出力レートを十分上回る)
+    RGY_CHECK(mbPerSec > 100.0);
+}
+
+int main() {
+    return rgy_test_run_all();
+}
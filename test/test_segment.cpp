@@ -0,0 +1,424 @@
+﻿// -----------------------------------------------------------------------------------------
+// QSVEnc/NVEnc by rigaya
+// -----------------------------------------------------------------------------------------
+// The MIT License
+//
+// Copyright (c) 2011-2016 rigaya
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// --------------------------------------------------------------------------------------------
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <cstring>
+#include <cmath>
+#include <unistd.h>
+#include "rgy_util.h"
+#include "qsv_cmd.h"
+#include "qsv_pipeline.h"
+#include "qsv_segment.h"
+#include "rgy_test.h"
+
+static const int TEST_WIDTH = 64;
+static const int TEST_HEIGHT = 48;
+static const int TEST_FRAMES = 40;
+//30fpsのフレームの間隔 (HW_TIMEBASE)
+static const int64_t TEST_FRAME_DURATION = 3000;
+
+static std::string test_path(const char *name) {
+    return strsprintf("/tmp/qsvenc_test_segment_%d_%s", (int)getpid(), name);
+}
+
+static bool trim_list_equal(const std::vector<sTrim>& a, const std::vector<sTrim>& b) {
+    if (a.size() != b.size()) {
+        return false;
+    }
+    for (size_t i = 0; i < a.size(); i++) {
+        if (a[i].start != b[i].start || a[i].fin != b[i].fin) {
+            return false;
+        }
+    }
+    return true;
+}
+
+//結合の出力先として、受け取ったフレームを記録するRGYOutput
+class RGYOutputCapture : public RGYOutput {
+public:
+    struct CaptureFrame {
+        std::string data;
+        int64_t pts;
+        int64_t dts;
+        RGY_FRAMETYPE frametype;
+    };
+    RGYOutputCapture() : m_captured() {
+        m_strWriterName = _T("capture");
+        m_OutType = OUT_TYPE_BITSTREAM;
+    };
+    virtual ~RGYOutputCapture() {};
+
+    virtual RGY_ERR WriteNextFrame(RGYBitstream *pBitstream) override {
+        CaptureFrame frame;
+        frame.data.assign((const char *)pBitstream->data(), pBitstream->size());
+        frame.pts = pBitstream->pts();
+        frame.dts = pBitstream->dts();
+        frame.frametype = pBitstream->frametype();
+        m_captured.push_back(frame);
+        return RGY_ERR_NONE;
+    }
+    virtual RGY_ERR WriteNextFrame(RGYFrame *pSurface) override {
+        return RGY_ERR_UNSUPPORTED;
+    }
+    const std::vector<CaptureFrame>& captured() const {
+        return m_captured;
+    }
+protected:
+    virtual RGY_ERR Init(const TCHAR *strFileName, const VideoInfo *pOutputInfo, const void *prm) override {
+        m_bInited = true;
+        return RGY_ERR_NONE;
+    }
+    std::vector<CaptureFrame> m_captured;
+};
+
+static VideoInfo test_video_info() {
+    VideoInfo info;
+    info.codec = RGY_CODEC_H264;
+    info.dstWidth = TEST_WIDTH;
+    info.dstHeight = TEST_HEIGHT;
+    info.fpsN = 30;
+    info.fpsD = 1;
+    return info;
+}
+
+//区間の一時ファイルに、指定のタイムスタンプのフレームを書き込む
+//各フレームのデータは "seg<区間>-<番号>" とする
+static std::shared_ptr<RGYOutputSegment> test_write_segment(int iseg, const std::vector<std::pair<int64_t, int64_t>>& ptsDtsList,
+    std::shared_ptr<RGYLog> pLog, std::shared_ptr<EncodeStatus> pEncStatus) {
+    auto segment = std::make_shared<RGYOutputSegment>();
+    segment->setFilename(test_path(strsprintf("seg%d.tmp", iseg).c_str()));
+    const auto videoInfo = test_video_info();
+    if (segment->RGYOutput::Init(_T("unused"), &videoInfo, nullptr, pLog, pEncStatus) != RGY_ERR_NONE) {
+        return nullptr;
+    }
+    RGYBitstream bitstream = RGYBitstreamInit();
+    for (int i = 0; i < (int)ptsDtsList.size(); i++) {
+        const auto data = strsprintf("seg%d-%d", iseg, i);
+        bitstream.copy((const uint8_t *)data.c_str(), data.length(), ptsDtsList[i].second, ptsDtsList[i].first);
+        bitstream.setFrametype((i == 0) ? RGY_FRAMETYPE_IDR : RGY_FRAMETYPE_P);
+        segment->WriteNextFrame(&bitstream);
+    }
+    bitstream.clear();
+    segment->Close();
+    return segment;
+}
+
+//キーフレームが等間隔の場合、目標位置に最も近いキーフレームで分割する
+RGY_TEST(split_nearest_keyframe) {
+    std::vector<int> keyFrames;
+    for (int i = 0; i < 1000; i += 90) {
+        keyFrames.push_back(i);
+    }
+    //目標位置 250, 500, 750 に対し、最も近いキーフレームは 270, 540, 720
+    const auto segments = qsv_split_segments(keyFrames, 1000, 4, 60);
+    RGY_CHECK(trim_list_equal(segments, { { 0, 269 }, { 270, 539 }, { 540, 719 }, { 720, TRIM_MAX } }));
+    //区間は隙間なく連続する
+    for (size_t i = 1; i < segments.size(); i++) {
+        RGY_CHECK_EQ(segments[i].start, segments[i-1].fin + 1);
+    }
+    //先頭のキーフレームが0でない場合はそこから開始する
+    const auto segmentsOffset = qsv_split_segments({ 30, 300, 600 }, 900, 3, 60);
+    RGY_CHECK(trim_list_equal(segmentsOffset, { { 30, 299 }, { 300, 599 }, { 600, TRIM_MAX } }));
+}
+
+//最小フレーム数より短くなる区間はつくらず、同じキーフレームを重複して使わない
+RGY_TEST(split_min_frames) {
+    //目標位置 250 -> 10 (先頭に近すぎる), 500 -> 500, 750 -> 990 (末尾に近すぎる)
+    RGY_CHECK(trim_list_equal(qsv_split_segments({ 0, 10, 500, 990 }, 1000, 4, 60), { { 0, 499 }, { 500, TRIM_MAX } }));
+    //キーフレームより多くの区間を要求しても、区間は重複しない
+    RGY_CHECK(trim_list_equal(qsv_split_segments({ 0, 500 }, 1000, 8, 60), { { 0, 499 }, { 500, TRIM_MAX } }));
+    //分割できない場合は1区間となる
+    RGY_CHECK(trim_list_equal(qsv_split_segments({ 0 }, 1000, 4, 60), { { 0, TRIM_MAX } }));
+    RGY_CHECK(trim_list_equal(qsv_split_segments({ 0, 30 }, 100, 2, 60), { { 0, TRIM_MAX } }));
+    //キーフレームがなければ区間もない
+    RGY_CHECK(qsv_split_segments({}, 1000, 4, 60).size() == 0);
+}
+
+//総フレーム数が不明な場合は、最後のキーフレームまでで分割する
+RGY_TEST(split_unknown_frames) {
+    RGY_CHECK(trim_list_equal(qsv_split_segments({ 0, 100, 200, 300 }, 0, 3, 1), { { 0, 99 }, { 100, 199 }, { 200, TRIM_MAX } }));
+    RGY_CHECK(trim_list_equal(qsv_split_segments({ 0, 100, 200, 300 }, 0, 1, 1), { { 0, TRIM_MAX } }));
+}
+
+//区間ごとにタイムスタンプが0から始まる場合でも、結合後は連続し、区間内の間隔・pts/dtsの差は維持される
+RGY_TEST(stitch_timestamps) {
+    auto pLog = std::make_shared<RGYLog>(nullptr, RGY_LOG_ERROR);
+    auto pEncStatus = std::make_shared<EncodeStatus>();
+    const int64_t d = TEST_FRAME_DURATION;
+    //区間0: Bフレームあり (出力順 I P B B ...)、dtsは負の値から始まる
+    const std::vector<std::pair<int64_t, int64_t>> seg0 = {
+        { 0, -d }, { 3*d, 0 }, { d, d }, { 2*d, 2*d }, { 5*d, 3*d }, { 4*d, 4*d }
+    };
+    //区間1: 入力のタイムスタンプのまま (途中から開始)、区間内で間隔が一定でない
+    const std::vector<std::pair<int64_t, int64_t>> seg1 = {
+        { 100*d, 100*d }, { 101*d, 101*d }, { 103*d, 103*d }, { 104*d, 104*d }
+    };
+    //区間2: dtsが不明
+    const std::vector<std::pair<int64_t, int64_t>> seg2 = {
+        { 0, (int64_t)MFX_TIMESTAMP_UNKNOWN }, { d, (int64_t)MFX_TIMESTAMP_UNKNOWN }
+    };
+    std::vector<std::shared_ptr<RGYOutputSegment>> segments = {
+        test_write_segment(0, seg0, pLog, pEncStatus),
+        test_write_segment(1, seg1, pLog, pEncStatus),
+        test_write_segment(2, seg2, pLog, pEncStatus),
+    };
+    for (const auto& segment : segments) {
+        RGY_CHECK(segment != nullptr);
+        if (segment == nullptr) {
+            return;
+        }
+    }
+    auto pWriter = std::make_shared<RGYOutputCapture>();
+    const auto videoInfo = test_video_info();
+    RGY_CHECK(pWriter->RGYOutput::Init(_T("unused"), &videoInfo, nullptr, pLog, pEncStatus) == RGY_ERR_NONE);
+    RGYTimestamp timestamp;
+    RGY_CHECK(qsv_stitch_segments(segments, pWriter, &timestamp, pLog) == RGY_ERR_NONE);
+
+    //区間0は0から、区間1は区間0の最後(5d)の次の6dから、区間2は区間1の最後(6d+4d)の次の11dから
+    const int64_t offset[] = { 0, 6*d - 100*d, 11*d };
+    const std::vector<std::pair<int64_t, int64_t>> *segList[] = { &seg0, &seg1, &seg2 };
+    const auto& captured = pWriter->captured();
+    RGY_CHECK_EQ(captured.size(), seg0.size() + seg1.size() + seg2.size());
+    size_t idx = 0;
+    for (int iseg = 0; iseg < 3 && idx < captured.size(); iseg++) {
+        for (int i = 0; i < (int)segList[iseg]->size() && idx < captured.size(); i++, idx++) {
+            //データは区間順・区間内の出力順のまま
+            RGY_CHECK(captured[idx].data == strsprintf("seg%d-%d", iseg, i));
+            RGY_CHECK_EQ(captured[idx].frametype, (i == 0) ? RGY_FRAMETYPE_IDR : RGY_FRAMETYPE_P);
+            RGY_CHECK_EQ(captured[idx].pts, (*segList[iseg])[i].first + offset[iseg]);
+            const int64_t dts = (*segList[iseg])[i].second;
+            RGY_CHECK_EQ(captured[idx].dts, (dts == (int64_t)MFX_TIMESTAMP_UNKNOWN) ? dts : dts + offset[iseg]);
+        }
+    }
+    //dtsは区間の境界をまたいでも増加する
+    for (size_t i = 1; i < seg0.size() + seg1.size() && i < captured.size(); i++) {
+        RGY_CHECK(captured[i-1].dts < captured[i].dts);
+    }
+    //durationは表示順で次のフレームまでの間隔、最後のフレームは1フレーム分
+    std::vector<int64_t> ptsList;
+    for (const auto& frame : captured) {
+        ptsList.push_back(frame.pts);
+    }
+    std::sort(ptsList.begin(), ptsList.end());
+    const int64_t expectedPts[] = { 0, d, 2*d, 3*d, 4*d, 5*d, 6*d, 7*d, 9*d, 10*d, 11*d, 12*d };
+    RGY_CHECK_EQ(ptsList.size(), _countof(expectedPts));
+    for (size_t i = 0; i < ptsList.size() && i < _countof(expectedPts); i++) {
+        RGY_CHECK_EQ(ptsList[i], expectedPts[i]);
+        const int64_t duration = (i + 1 < _countof(expectedPts)) ? expectedPts[i+1] - expectedPts[i] : d;
+        RGY_CHECK_EQ(timestamp.get_and_pop(ptsList[i], -1), duration);
+    }
+    for (const auto& segment : segments) {
+        unlink(tchar_to_string(segment->filename()).c_str());
+    }
+}
+
+//フレームのない区間は読み飛ばし、タイムスタンプも詰める
+RGY_TEST(stitch_empty_segment) {
+    auto pLog = std::make_shared<RGYLog>(nullptr, RGY_LOG_ERROR);
+    auto pEncStatus = std::make_shared<EncodeStatus>();
+    const int64_t d = TEST_FRAME_DURATION;
+    std::vector<std::shared_ptr<RGYOutputSegment>> segments = {
+        test_write_segment(0, { { 0, 0 }, { d, d } }, pLog, pEncStatus),
+        test_write_segment(1, {}, pLog, pEncStatus),
+        test_write_segment(2, { { 0, 0 } }, pLog, pEncStatus),
+    };
+    auto pWriter = std::make_shared<RGYOutputCapture>();
+    const auto videoInfo = test_video_info();
+    pWriter->RGYOutput::Init(_T("unused"), &videoInfo, nullptr, pLog, pEncStatus);
+    RGY_CHECK(qsv_stitch_segments(segments, pWriter, nullptr, pLog) == RGY_ERR_NONE);
+    const auto& captured = pWriter->captured();
+    RGY_CHECK_EQ(captured.size(), 3);
+    if (captured.size() == 3) {
+        RGY_CHECK(captured[2].data == "seg2-0");
+        RGY_CHECK_EQ(captured[2].pts, 2*d);
+    }
+    for (const auto& segment : segments) {
+        unlink(tchar_to_string(segment->filename()).c_str());
+    }
+}
+
+//フレームごとに異なる模様のy4mファイルを作成する
+static bool write_test_y4m(const std::string& path) {
+    FILE *fp = nullptr;
+    if (fopen_s(&fp, path.c_str(), "wb") || fp == nullptr) {
+        return false;
+    }
+    fprintf(fp, "YUV4MPEG2 W%d H%d F30:1 Ip A1:1 C420jpeg\n", TEST_WIDTH, TEST_HEIGHT);
+    std::vector<uint8_t> buf(TEST_WIDTH * TEST_HEIGHT * 3 / 2);
+    for (int i = 0; i < TEST_FRAMES; i++) {
+        for (int y = 0; y < TEST_HEIGHT; y++) {
+            for (int x = 0; x < TEST_WIDTH; x++) {
+                buf[y * TEST_WIDTH + x] = (uint8_t)(x * 7 + y * 3 + i * 13 + ((x + y) & i));
+            }
+        }
+        memset(buf.data() + TEST_WIDTH * TEST_HEIGHT, 64 + i, TEST_WIDTH * TEST_HEIGHT / 2);
+        fprintf(fp, "FRAME\n");
+        fwrite(buf.data(), 1, buf.size(), fp);
+    }
+    fclose(fp);
+    return true;
+}
+
+//コマンドラインを解析して、指定の出力先にエンコードする
+static int test_run_encode(const std::string& args, std::shared_ptr<RGYOutput> pWriter) {
+    std::vector<tstring> argList = split(args, " ");
+    std::vector<const TCHAR *> argv;
+    argv.push_back(_T("qsvencc"));
+    for (const auto& arg : argList) {
+        argv.push_back(arg.c_str());
+    }
+    const int argc = (int)argv.size();
+    argv.push_back(_T(""));
+
+    sInputParams prm = { 0 };
+    init_qsvp_prm(&prm);
+    ParseCmdError err;
+    if (parse_cmd(&prm, argv.data(), argc, err) != 0) {
+        fprintf(stderr, "failed to parse: %s\n", args.c_str());
+        return 1;
+    }
+    unique_ptr<CQSVPipeline> pPipeline(new CQSVPipeline);
+    pPipeline->SetOutputOverride(pWriter);
+    const int ret = (pPipeline->Init(&prm) < MFX_ERR_NONE || pPipeline->Run() < MFX_ERR_NONE) ? 1 : 0;
+    pPipeline->Close();
+    rgy_free(prm.pTrimList);
+    return ret;
+}
+
+//--sw-sessionのエンコーダの出力 ("QSVSW frame=... pts=... type=... sum=...") から、画素のチェックサムを取り出す
+static std::string sw_frame_sum(const std::string& data) {
+    const auto pos = data.find(" sum=");
+    return (pos == std::string::npos) ? std::string() : data.substr(pos + 5, 8);
+}
+
+//--trimで区間ごとにエンコードして結合したものが、全体を一度にエンコードしたものと同じフレーム・タイムスタンプになる
+RGY_TEST(stitch_encoded_segments) {
+    const auto input = test_path("in.y4m");
+    RGY_CHECK(write_test_y4m(input));
+    auto pLog = std::make_shared<RGYLog>(nullptr, RGY_LOG_ERROR);
+    const std::string common = " --sw-session busy=2,reorder=2 --log-level error";
+    const auto dst = test_path("out.264");
+
+    auto pWriterFull = std::make_shared<RGYOutputCapture>();
+    RGY_CHECK_EQ(test_run_encode("--y4m -i " + input + " -o " + dst + common, pWriterFull), 0);
+
+    const sTrim segmentTrim[] = { { 0, 12 }, { 13, 29 }, { 30, TRIM_MAX } };
+    std::vector<std::shared_ptr<RGYOutputSegment>> segments;
+    for (int i = 0; i < (int)_countof(segmentTrim); i++) {
+        auto segment = std::make_shared<RGYOutputSegment>();
+        segment->setFilename(test_path(strsprintf("enc_seg%d.tmp", i).c_str()));
+        const std::string trim = (segmentTrim[i].fin == TRIM_MAX)
+            ? strsprintf(" --trim %d:0", segmentTrim[i].start) : strsprintf(" --trim %d:%d", segmentTrim[i].start, segmentTrim[i].fin);
+        RGY_CHECK_EQ(test_run_encode("--y4m -i " + input + " -o " + dst + common + trim, segment), 0);
+        //各区間の先頭はキーフレーム
+        RGY_CHECK(segment->frames().size() > 0 && (segment->frames()[0].frametype & (RGY_FRAMETYPE_IDR | RGY_FRAMETYPE_I)) != 0);
+        segments.push_back(segment);
+    }
+    auto pWriter = std::make_shared<RGYOutputCapture>();
+    pWriter->RGYOutput::Init(_T("unused"), &segments[0]->videoOutputInfo(), nullptr, pLog, std::make_shared<EncodeStatus>());
+    RGYTimestamp timestamp;
+    RGY_CHECK(qsv_stitch_segments(segments, pWriter, &timestamp, pLog) == RGY_ERR_NONE);
+
+    const auto& full = pWriterFull->captured();
+    const auto& stitched = pWriter->captured();
+    RGY_CHECK_EQ(full.size(), TEST_FRAMES);
+    RGY_CHECK_EQ(stitched.size(), TEST_FRAMES);
+    //表示順に並べると、全体のエンコードと同じ画素・タイムスタンプとなる
+    auto sort_by_pts = [](std::vector<RGYOutputCapture::CaptureFrame> frames) {
+        std::sort(frames.begin(), frames.end(), [](const RGYOutputCapture::CaptureFrame& a, const RGYOutputCapture::CaptureFrame& b) {
+            return a.pts < b.pts;
+        });
+        return frames;
+    };
+    const auto fullSorted = sort_by_pts(full);
+    const auto stitchedSorted = sort_by_pts(stitched);
+    for (int i = 0; i < (int)(std::min)(fullSorted.size(), stitchedSorted.size()); i++) {
+        RGY_CHECK(sw_frame_sum(stitchedSorted[i].data) == sw_frame_sum(fullSorted[i].data));
+        RGY_CHECK_EQ(stitchedSorted[i].pts, fullSorted[i].pts);
+        RGY_CHECK_EQ(stitchedSorted[i].pts, i * TEST_FRAME_DURATION);
+        RGY_CHECK_EQ(timestamp.get_and_pop(stitchedSorted[i].pts, -1), TEST_FRAME_DURATION);
+    }
+    //出力順では、dtsは区間の境界をまたいでも増加し、ptsを超えない
+    for (int i = 0; i < (int)stitched.size(); i++) {
+        RGY_CHECK(stitched[i].dts <= stitched[i].pts);
+        if (i > 0) {
+            RGY_CHECK(stitched[i-1].dts < stitched[i].dts);
+        }
+    }
+    for (const auto& segment : segments) {
+        unlink(tchar_to_string(segment->filename()).c_str());
+    }
+    unlink(input.c_str());
+}
+
+//目標に対する超過・不足分が、残りの区間のビットレートで相殺される
+RGY_TEST(bitrate_carry_over) {
+    //完了した区間がなければ目標のまま
+    RGY_CHECK_EQ(qsv_segment_bitrate(1000, 0, 30, 1, 0, 0, 300), 1000);
+    //300フレーム(10秒)を1200kbpsで出力 (2000kbitの超過) -> 残り600フレーム(20秒)で100kbps下げる
+    RGY_CHECK_EQ(qsv_segment_bitrate(1000, 0, 30, 1, 1200 * 10 * 1000 / 8, 300, 600), 900);
+    //不足した場合は上げる
+    RGY_CHECK_EQ(qsv_segment_bitrate(1000, 0, 30, 1, 800 * 10 * 1000 / 8, 300, 600), 1100);
+    //最大ビットレートは超えない
+    RGY_CHECK_EQ(qsv_segment_bitrate(1000, 1050, 30, 1, 800 * 10 * 1000 / 8, 300, 600), 1050);
+    //調整幅はQSV_SEGMENT_BITRATE_ADJUST_MAXまで
+    RGY_CHECK_EQ(qsv_segment_bitrate(1000, 0, 30, 1, 5000 * 10 * 1000 / 8, 300, 30), (int)(1000 * (1.0 - QSV_SEGMENT_BITRATE_ADJUST_MAX)));
+    RGY_CHECK_EQ(qsv_segment_bitrate(1000, 0, 30, 1, 0, 300, 30), (int)(1000 * (1.0 + QSV_SEGMENT_BITRATE_ADJUST_MAX)));
+    //フレームレートが不明なら調整しない
+    RGY_CHECK_EQ(qsv_segment_bitrate(1000, 0, 0, 0, 1200 * 10 * 1000 / 8, 300, 600), 1000);
+}
+
+//区間ごとにエンコーダのビットレートの誤差がばらついても、全体のサイズは目標に近づく
+RGY_TEST(bitrate_carry_over_total) {
+    const int targetKbps = 2000;
+    const int segmentFrames = 120;
+    //区間ごとの、指定したビットレートに対する実際の出力の比率
+    const double encoderError[] = { 1.30, 1.15, 0.95, 1.20, 0.90, 1.10, 1.25, 1.00 };
+    const int nSegments = (int)_countof(encoderError);
+    const int nFrames = segmentFrames * nSegments;
+    int64_t doneBytes = 0, doneBytesFixed = 0;
+    int doneFrames = 0;
+    for (int i = 0; i < nSegments; i++) {
+        const int kbps = qsv_segment_bitrate(targetKbps, 0, 30, 1, doneBytes, doneFrames, nFrames - doneFrames);
+        const double sec = segmentFrames / 30.0;
+        doneBytes += (int64_t)(kbps * encoderError[i] * sec * 1000 / 8);
+        doneBytesFixed += (int64_t)(targetKbps * encoderError[i] * sec * 1000 / 8);
+        doneFrames += segmentFrames;
+    }
+    const double budgetBytes = targetKbps * (nFrames / 30.0) * 1000 / 8;
+    const double error = std::abs(doneBytes / budgetBytes - 1.0);
+    const double errorFixed = std::abs(doneBytesFixed / budgetBytes - 1.0);
+    RGY_CHECK(error < 0.01);
+    RGY_CHECK(error < errorFixed);
+}
+
+int main() {
+    return rgy_test_run_all();
+}
@@ -0,0 +1,345 @@
+﻿// -----------------------------------------------------------------------------------------
+// QSVEnc/NVEnc by rigaya
+// -----------------------------------------------------------------------------------------
+// The MIT License
+//
+// Copyright (c) 2011-2016 rigaya
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// --------------------------------------------------------------------------------------------
+
+
+#include <string>
+#include <cstring>
+#include <algorithm>
+#include "qsv_stage.h"
+#include "rgy_test.h"
+
+//テスト用のフレーム (FrameOrderをフレーム番号として使う)
+class TestFramePool {
+public:
+    TestFramePool(int count) : m_surfaces(count) {
+        for (int i = 0; i < count; i++) {
+            memset(&m_surfaces[i], 0, sizeof(m_surfaces[i]));
+            m_surfaces[i].Data.FrameOrder = i;
+        }
+    }
+    mfxFrameSurface1 *get(int i) {
+        return &m_surfaces[i];
+    }
+protected:
+    std::vector<mfxFrameSurface1> m_surfaces;
+};
+
+static int frame_id(const QSVStageFrame *frame) {
+    return (int)frame->pSurface->Data.FrameOrder;
+}
+
+//入力の段: nFramesのフレームを出力する
+//  delayを指定すると、デコーダのようにdelay枚をため込んでから出力し、入力の終了後にdrainで取り出させる
+class TestSource : public QSVStage {
+public:
+    TestSource(TestFramePool *pool, int nFrames, int delay) :
+        QSVStage(_T("source"), delay > 0), m_pool(pool), m_nFrames(nFrames), m_delay(delay), m_read(0), m_out(0) {};
+    virtual mfxStatus process(const QSVStageFrame *in, QSVStageFrame *out) override {
+        if (m_read >= m_nFrames) {
+            return MFX_ERR_MORE_DATA;
+        }
+        m_read++;
+        if (m_read - m_out <= m_delay) {
+            return MFX_ERR_NONE; //ため込んだだけ
+        }
+        out->pSurface = m_pool->get(m_out++);
+        return MFX_ERR_NONE;
+    }
+    virtual mfxStatus drain(QSVStageFrame *out) override {
+        if (m_out >= m_read) {
+            return MFX_ERR_MORE_DATA;
+        }
+        out->pSurface = m_pool->get(m_out++);
+        return MFX_ERR_NONE;
+    }
+protected:
+    TestFramePool *m_pool;
+    int m_nFrames;
+    int m_delay;
+    int m_read;
+    int m_out;
+};
+
+//フレームをdelay枚ため込んでから、順に出力する段 (vppやエンコーダの代わり)
+class TestDelay : public QSVStage {
+public:
+    TestDelay(const TCHAR *name, int delay) : QSVStage(name, true), m_delay(delay), m_buffer() {};
+    virtual mfxStatus process(const QSVStageFrame *in, QSVStageFrame *out) override {
+        m_buffer.push_back(*in);
+        if ((int)m_buffer.size() <= m_delay) {
+            return MFX_ERR_MORE_DATA;
+        }
+        *out = m_buffer.front();
+        m_buffer.pop_front();
+        return MFX_ERR_NONE;
+    }
+    virtual mfxStatus drain(QSVStageFrame *out) override {
+        if (m_buffer.empty()) {
+            return MFX_ERR_MORE_DATA;
+        }
+        *out = m_buffer.front();
+        m_buffer.pop_front();
+        return MFX_ERR_NONE;
+    }
+protected:
+    int m_delay;
+    std::deque<QSVStageFrame> m_buffer;
+};
+
+//パイプラインの最後の段: 受け取ったフレームと、その時点の各段のキューの長さを記録する
+class TestSink : public QSVStage {
+public:
+    TestSink(const QSVStageGraph *graph) : QSVStage(_T("sink"), false), m_graph(graph), frames(), maxQueued(0) {};
+    virtual mfxStatus process(const QSVStageFrame *in, QSVStageFrame *out) override {
+        frames.push_back(frame_id(in));
+        size_t queued = 0;
+        for (const auto& stage : m_graph->stages()) {
+            queued += stage->queueSize();
+        }
+        //処理中のこのフレームは除く
+        maxQueued = std::max(maxQueued, queued - 1);
+        return MFX_ERR_NONE;
+    }
+protected:
+    const QSVStageGraph *m_graph;
+public:
+    std::vector<int> frames;
+    size_t maxQueued;
+};
+
+//headの終了とflushの完了の順序を記録する
+struct TestGraphLog {
+    std::vector<std::basic_string<TCHAR>> events;
+    QSVStageGraph::FuncHeadEnd onHeadEnd() {
+        return [this](QSVStage *head, bool bDraining, mfxStatus sts) {
+            events.push_back(std::basic_string<TCHAR>((bDraining) ? _T("drained:") : _T("end:")) + head->name());
+            return (sts == MFX_ERR_MORE_DATA) ? MFX_ERR_NONE : sts;
+        };
+    }
+    QSVStageGraph::FuncFlushed onFlushed() {
+        return [this](QSVStage *stage) {
+            events.push_back(std::basic_string<TCHAR>(_T("flushed:")) + stage->name());
+        };
+    }
+};
+
+static std::vector<int> sequence(int start, int count) {
+    std::vector<int> list;
+    for (int i = 0; i < count; i++) {
+        list.push_back(start + i);
+    }
+    return list;
+}
+
+RGY_TEST(frames_pass_in_order) {
+    const int nFrames = 50;
+    TestFramePool pool(nFrames);
+    QSVStageGraph graph;
+    graph.add(std::unique_ptr<QSVStage>(new TestSource(&pool, nFrames, 0)));
+    graph.add(std::unique_ptr<QSVStage>(new QSVStageFunc(_T("filter"), false,
+        [](const QSVStageFrame *in, QSVStageFrame *out) {
+            *out = *in;
+            return MFX_ERR_NONE;
+        })));
+    auto sink = (TestSink *)graph.add(std::unique_ptr<QSVStage>(new TestSink(&graph)));
+    TestGraphLog log;
+    RGY_CHECK_EQ(graph.run(log.onHeadEnd(), log.onFlushed()), MFX_ERR_NONE);
+    RGY_CHECK(sink->frames == sequence(0, nFrames));
+    //前の段のフレームが最後の段まで処理されてから、次のフレームを取得する
+    RGY_CHECK_EQ(sink->maxQueued, 0);
+    //ため込む段がないので、入力の終了ですべての段が終了する
+    const std::vector<std::basic_string<TCHAR>> expected = {
+        _T("end:source"), _T("flushed:source"), _T("flushed:filter"), _T("flushed:sink")
+    };
+    RGY_CHECK(log.events == expected);
+    for (const auto& stage : graph.stages()) {
+        RGY_CHECK(stage->state() == QSV_STAGE_FLUSHED);
+    }
+}
+
+RGY_TEST(buffering_stages_drain_in_order) {
+    const int nFrames = 40;
+    TestFramePool pool(nFrames);
+    QSVStageGraph graph;
+    graph.add(std::unique_ptr<QSVStage>(new TestSource(&pool, nFrames, 3)));
+    graph.add(std::unique_ptr<QSVStage>(new QSVStageFunc(_T("filter"), false,
+        [](const QSVStageFrame *in, QSVStageFrame *out) {
+            *out = *in;
+            return MFX_ERR_NONE;
+        })));
+    graph.add(std::unique_ptr<QSVStage>(new TestDelay(_T("vpp"), 2)));
+    graph.add(std::unique_ptr<QSVStage>(new TestDelay(_T("encoder"), 5)));
+    auto sink = (TestSink *)graph.add(std::unique_ptr<QSVStage>(new TestSink(&graph)));
+    TestGraphLog log;
+    RGY_CHECK_EQ(graph.run(log.onHeadEnd(), log.onFlushed()), MFX_ERR_NONE);
+    //ため込まれたフレームも含め、すべてのフレームが順に出てくる
+    RGY_CHECK(sink->frames == sequence(0, nFrames));
+    RGY_CHECK_EQ(sink->maxQueued, 0);
+    //ため込む段は、先頭から順にflushされる
+    const std::vector<std::basic_string<TCHAR>> expected = {
+        _T("end:source"),
+        _T("drained:source"), _T("flushed:source"), _T("flushed:filter"),
+        _T("drained:vpp"), _T("flushed:vpp"),
+        _T("drained:encoder"), _T("flushed:encoder"), _T("flushed:sink")
+    };
+    RGY_CHECK(log.events == expected);
+}
+
+RGY_TEST(multiple_output_and_drop) {
+    const int nFrames = 30;
+    TestFramePool pool(nFrames);
+    QSVStageGraph graph;
+    graph.add(std::unique_ptr<QSVStage>(new TestSource(&pool, nFrames, 2)));
+    //3の倍数のフレームは破棄する (avsyncの間引きやtrimの代わり)
+    graph.add(std::unique_ptr<QSVStage>(new QSVStageFunc(_T("drop"), false,
+        [](const QSVStageFrame *in, QSVStageFrame *out) {
+            if (frame_id(in) % 3 != 0) {
+                *out = *in;
+            }
+            return MFX_ERR_NONE;
+        })));
+    //偶数のフレームは2回出力する (bob化やavsyncの水増しの代わり)
+    int nCalls = 0;
+    graph.add(std::unique_ptr<QSVStage>(new QSVStageFunc(_T("dup"), false,
+        [&nCalls](const QSVStageFrame *in, QSVStageFrame *out) {
+            *out = *in;
+            if (frame_id(in) % 2 == 0 && nCalls++ == 0) {
+                return MFX_ERR_MORE_SURFACE;
+            }
+            nCalls = 0;
+            return MFX_ERR_NONE;
+        })));
+    graph.add(std::unique_ptr<QSVStage>(new TestDelay(_T("encoder"), 4)));
+    auto sink = (TestSink *)graph.add(std::unique_ptr<QSVStage>(new TestSink(&graph)));
+    TestGraphLog log;
+    RGY_CHECK_EQ(graph.run(log.onHeadEnd(), log.onFlushed()), MFX_ERR_NONE);
+    std::vector<int> expected;
+    for (int i = 0; i < nFrames; i++) {
+        if (i % 3 != 0) {
+            expected.push_back(i);
+            if (i % 2 == 0) {
+                expected.push_back(i);
+            }
+        }
+    }
+    RGY_CHECK(sink->frames == expected);
+    //同じ入力を繰り返し処理する間、入力はキューに残る
+    RGY_CHECK_EQ(sink->maxQueued, 1);
+}
+
+RGY_TEST(error_stops_pipeline) {
+    const int nFrames = 30;
+    TestFramePool pool(nFrames);
+    QSVStageGraph graph;
+    graph.add(std::unique_ptr<QSVStage>(new TestSource(&pool, nFrames, 0)));
+    graph.add(std::unique_ptr<QSVStage>(new QSVStageFunc(_T("vpp"), true,
+        [](const QSVStageFrame *in, QSVStageFrame *out) {
+            if (frame_id(in) == 10) {
+                return MFX_ERR_DEVICE_FAILED;
+            }
+            *out = *in;
+            return MFX_ERR_NONE;
+        })));
+    auto sink = (TestSink *)graph.add(std::unique_ptr<QSVStage>(new TestSink(&graph)));
+    //エラーはheadの段とともに通知され、runはそのエラーを返す
+    std::vector<mfxStatus> errors;
+    std::vector<QSVStage *> heads;
+    auto sts = graph.run([&](QSVStage *head, bool bDraining, mfxStatus sts_end) {
+        heads.push_back(head);
+        errors.push_back(sts_end);
+        return (sts_end == MFX_ERR_MORE_DATA) ? MFX_ERR_NONE : sts_end;
+    }, [](QSVStage *stage) {});
+    RGY_CHECK_EQ(sts, MFX_ERR_DEVICE_FAILED);
+    RGY_CHECK(sink->frames == sequence(0, 10));
+    RGY_CHECK_EQ(errors.size(), 1);
+    RGY_CHECK(heads.size() == 1 && heads[0] == graph.stages()[0].get());
+
+    //flush中のエラー
+    QSVStageGraph graph2;
+    graph2.add(std::unique_ptr<QSVStage>(new TestSource(&pool, nFrames, 4)));
+    graph2.add(std::unique_ptr<QSVStage>(new QSVStageFunc(_T("encoder"), true,
+        [](const QSVStageFrame *in, QSVStageFrame *out) {
+            return MFX_ERR_NONE;
+        },
+        [](QSVStageFrame *out) {
+            return MFX_ERR_ABORTED;
+        })));
+    std::vector<bool> draining;
+    sts = graph2.run([&](QSVStage *head, bool bDraining, mfxStatus sts_end) {
+        draining.push_back(bDraining);
+        return (sts_end == MFX_ERR_MORE_DATA) ? MFX_ERR_NONE : sts_end;
+    }, [](QSVStage *stage) {});
+    RGY_CHECK_EQ(sts, MFX_ERR_ABORTED);
+    RGY_CHECK(draining == std::vector<bool>({ false, true, true }));
+    RGY_CHECK(graph2.stages()[0]->state() == QSV_STAGE_FLUSHED);
+    RGY_CHECK(graph2.stages()[1]->state() == QSV_STAGE_DRAINING);
+}
+
+RGY_TEST(retry_busy) {
+    //ビジーの間は再試行し、出力が得られたら警告は無視する
+    int nCalls = 0;
+    auto sts = qsv_run_retry_busy([&](bool& bOutput) {
+        nCalls++;
+        bOutput = nCalls > 5000;
+        return MFX_WRN_DEVICE_BUSY;
+    });
+    RGY_CHECK_EQ(sts, MFX_ERR_NONE);
+    RGY_CHECK_EQ(nCalls, 5001);
+
+    //出力のない警告も再試行する
+    nCalls = 0;
+    sts = qsv_run_retry_busy([&](bool& bOutput) {
+        nCalls++;
+        bOutput = false;
+        return (nCalls < 3) ? MFX_WRN_VIDEO_PARAM_CHANGED : MFX_ERR_MORE_DATA;
+    });
+    RGY_CHECK_EQ(sts, MFX_ERR_MORE_DATA);
+    RGY_CHECK_EQ(nCalls, 3);
+
+    //エラーはそのまま返す
+    sts = qsv_run_retry_busy([&](bool& bOutput) {
+        bOutput = false;
+        return MFX_ERR_DEVICE_FAILED;
+    });
+    RGY_CHECK_EQ(sts, MFX_ERR_DEVICE_FAILED);
+
+    //ビジーが続いたらタイムアウトする
+    int nTimeout = 0;
+    const auto tmStart = std::chrono::steady_clock::now();
+    sts = qsv_run_retry_busy([&](bool& bOutput) {
+        bOutput = false;
+        return MFX_WRN_DEVICE_BUSY;
+    }, [&]() { nTimeout++; }, 50);
+    const auto elapsedMs = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - tmStart).count();
+    RGY_CHECK_EQ(sts, MFX_ERR_UNKNOWN);
+    RGY_CHECK_EQ(nTimeout, 1);
+    RGY_CHECK(50 <= elapsedMs && elapsedMs < 5000);
+}
+
+int main() {
+    return rgy_test_run_all();
+}
@@ -0,0 +1,204 @@
+﻿// -----------------------------------------------------------------------------------------
+// QSVEnc/NVEnc by rigaya
+// -----------------------------------------------------------------------------------------
+// The MIT License
+//
+// Copyright (c) 2011-2016 rigaya
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// --------------------------------------------------------------------------------------------
+
+#include "rgy_util.h"
+#include "rgy_test.h"
+
+//比較用の線形探索による実装 (二分探索化する前のframe_inside_range)
+static std::pair<bool, int> frame_inside_range_linear(int frame, const std::vector<sTrim>& trimList) {
+    int index = 0;
+    if (trimList.size() == 0) {
+        return std::make_pair(true, index);
+    }
+    if (frame < 0) {
+        return std::make_pair(false, index);
+    }
+    for (; index < (int)trimList.size(); index++) {
+        if (frame < trimList[index].start) {
+            return std::make_pair(false, index);
+        }
+        if (frame <= trimList[index].fin) {
+            return std::make_pair(true, index);
+        }
+    }
+    return std::make_pair(false, index);
+}
+
+//比較用の線形探索による実装 (累積値を使う前のRGYOutputAvcodec::AdjustTimestampTrimmedの削除フレーム数の計算)
+static std::pair<bool, int> trim_cut_frames_before_linear(int vidFrameIdx, const std::vector<sTrim>& trimList, bool lastValidFrame) {
+    int cutFrames = 0;
+    if (trimList.size() > 0) {
+        int nLastFinFrame = 0;
+        for (const auto& trim : trimList) {
+            if (vidFrameIdx < trim.start) {
+                if (lastValidFrame) {
+                    cutFrames += (vidFrameIdx - nLastFinFrame);
+                    nLastFinFrame = vidFrameIdx;
+                    break;
+                }
+                return std::make_pair(false, 0);
+            }
+            cutFrames += trim.start - nLastFinFrame;
+            if (vidFrameIdx <= trim.fin) {
+                nLastFinFrame = vidFrameIdx;
+                break;
+            }
+            nLastFinFrame = trim.fin;
+        }
+        cutFrames += vidFrameIdx - nLastFinFrame;
+    }
+    return std::make_pair(true, cutFrames);
+}
+
+//比較用: フレームごとに、いずれかの範囲に含まれるかを調べる
+static bool frame_in_any_range(int frame, const std::vector<sTrim>& trimList) {
+    for (const auto& trim : trimList) {
+        if (trim.start <= frame && frame <= trim.fin) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool trim_list_equal(const std::vector<sTrim>& a, const std::vector<sTrim>& b) {
+    if (a.size() != b.size()) {
+        return false;
+    }
+    for (size_t i = 0; i < a.size(); i++) {
+        if (a[i].start != b[i].start || a[i].fin != b[i].fin) {
+            return false;
+        }
+    }
+    return true;
+}
+
+RGY_TEST(normalize_overlapping) {
+    std::vector<sTrim> list = { { 100, 200 }, { 150, 300 }, { 0, 50 } };
+    normalize_trim_list(list);
+    RGY_CHECK(trim_list_equal(list, { { 0, 50 }, { 100, 300 } }));
+}
+
+RGY_TEST(normalize_contained) {
+    //後ろの範囲が前の範囲に含まれる場合に、finが短くならないこと
+    std::vector<sTrim> list = { { 100, 500 }, { 200, 300 }, { 400, 450 } };
+    normalize_trim_list(list);
+    RGY_CHECK(trim_list_equal(list, { { 100, 500 } }));
+}
+
+RGY_TEST(normalize_adjacent) {
+    //隣接するだけの範囲は結合しないが、どのフレームも範囲内と判定される
+    std::vector<sTrim> list = { { 10, 19 }, { 0, 9 }, { 20, 20 } };
+    normalize_trim_list(list);
+    RGY_CHECK(trim_list_equal(list, { { 0, 9 }, { 10, 19 }, { 20, 20 } }));
+    for (int frame = 0; frame <= 20; frame++) {
+        RGY_CHECK(frame_inside_range(frame, list).first);
+    }
+    RGY_CHECK(!frame_inside_range(21, list).first);
+    RGY_CHECK_EQ(frame_inside_range(10, list).second, 1);
+    //開始と終了が同じフレームなら結合する
+    list = { { 0, 10 }, { 10, 20 } };
+    normalize_trim_list(list);
+    RGY_CHECK(trim_list_equal(list, { { 0, 20 } }));
+}
+
+RGY_TEST(normalize_open_ended) {
+    std::vector<sTrim> list = { { 300, TRIM_MAX }, { 50, 60 }, { 400, 500 }, { 55, 100 } };
+    normalize_trim_list(list);
+    RGY_CHECK(trim_list_equal(list, { { 50, 100 }, { 300, TRIM_MAX } }));
+    RGY_CHECK(frame_inside_range(INT_MAX - 1, list).first);
+    RGY_CHECK_EQ(frame_inside_range(200, list).second, 1);
+
+    std::vector<sTrim> empty;
+    normalize_trim_list(empty);
+    RGY_CHECK(empty.size() == 0);
+    RGY_CHECK(frame_inside_range(12345, empty).first);
+}
+
+//ランダムな(重なり・包含・隣接・終端なしを含む)リストを正規化し、
+//frame_inside_range, trim_cut_frames_beforeを線形探索による実装と比較する
+RGY_TEST(random_lists_match_linear) {
+    RGYTestRandom rnd(12345);
+    for (int iter = 0; iter < 2000; iter++) {
+        const int count = rnd.range(1, 12);
+        std::vector<sTrim> list;
+        for (int i = 0; i < count; i++) {
+            sTrim trim;
+            trim.start = rnd.range(0, 600);
+            switch (rnd.range(0, 4)) {
+            case 0:  trim.fin = TRIM_MAX; break;
+            case 1:  trim.fin = trim.start; break;
+            default: trim.fin = trim.start + rnd.range(0, 80); break;
+            }
+            list.push_back(trim);
+        }
+        const auto original = list;
+        normalize_trim_list(list);
+        //正規化後は開始順で重なりがない
+        for (size_t i = 1; i < list.size(); i++) {
+            RGY_CHECK(list[i-1].fin < list[i].start);
+        }
+        const auto cutFrames = trim_cut_frames(list);
+        for (int frame = -3; frame < 800; frame++) {
+            //正規化の前後で、範囲に含まれるフレームは変わらない
+            const auto range = frame_inside_range(frame, list);
+            RGY_CHECK(range.first == (frame >= 0 && frame_in_any_range(frame, original)));
+            const auto rangeLinear = frame_inside_range_linear(frame, list);
+            RGY_CHECK(range.first == rangeLinear.first);
+            RGY_CHECK_EQ(range.second, rangeLinear.second);
+            for (int lastValidFrame = 0; lastValidFrame < 2; lastValidFrame++) {
+                const auto cut = trim_cut_frames_before(frame, list, cutFrames, lastValidFrame != 0);
+                const auto cutLinear = trim_cut_frames_before_linear(frame, list, lastValidFrame != 0);
+                RGY_CHECK(cut.first == cutLinear.first);
+                if (cut.first && cutLinear.first) {
+                    RGY_CHECK_EQ(cut.second, cutLinear.second);
+                }
+            }
+        }
+        if (rgy_test_fail_count()) {
+            break;
+        }
+    }
+}
+
+RGY_TEST(cut_frames_known_values) {
+    //frame 0-99を削除, 100-199を残す, 200-299を削除, 300-を残す
+    const std::vector<sTrim> list = { { 100, 199 }, { 300, TRIM_MAX } };
+    const auto cutFrames = trim_cut_frames(list);
+    RGY_CHECK_EQ(trim_cut_frames_before(100, list, cutFrames, false).second, 100);
+    RGY_CHECK_EQ(trim_cut_frames_before(150, list, cutFrames, false).second, 100);
+    RGY_CHECK(!trim_cut_frames_before(250, list, cutFrames, false).first);
+    RGY_CHECK(!trim_cut_frames_before(50, list, cutFrames, false).first);
+    RGY_CHECK_EQ(trim_cut_frames_before(50, list, cutFrames, true).second, 50);
+    RGY_CHECK_EQ(trim_cut_frames_before(250, list, cutFrames, true).second, 151);
+    RGY_CHECK_EQ(trim_cut_frames_before(300, list, cutFrames, false).second, 201);
+    RGY_CHECK(trim_cut_frames_before(1000, std::vector<sTrim>(), std::vector<int>(), false).first);
+    RGY_CHECK_EQ(trim_cut_frames_before(1000, std::vector<sTrim>(), std::vector<int>(), false).second, 0);
+}
+
+int main() {
+    return rgy_test_run_all();
+}